@@ -73,6 +73,14 @@ typedef struct
    */
   GHashTable *invocations;
 
+  /*
+   * The replies field maps request ids of calls made with
+   * jsonrpc_client_call_with_reply_func() to their JsonrpcReply. These
+   * skip the GTask machinery and are completed directly from the read
+   * loop.
+   */
+  GHashTable *replies;
+
   /*
    * We hold an extra reference to the GIOStream pair to make things
    * easier to construct and ensure that the streams are in tact in
@@ -144,10 +152,29 @@ typedef struct
 
 typedef struct
 {
+  JsonrpcClient *client;
   GHashTable *invocations;
+  GHashTable *replies;
   GError *error;
 } PanicData;
 
+typedef struct
+{
+  JsonrpcClientReplyFunc func;
+  gpointer user_data;
+  /* only set for replies failed before the call was sent */
+  JsonrpcClient *client;
+  GError *error;
+} JsonrpcReply;
+
+static void
+jsonrpc_reply_free (JsonrpcReply *reply)
+{
+  g_clear_object (&reply->client);
+  g_clear_error (&reply->error);
+  g_slice_free (JsonrpcReply, reply);
+}
+
 G_DEFINE_TYPE_WITH_PRIVATE (JsonrpcClient, jsonrpc_client, G_TYPE_OBJECT)
 
 enum {
@@ -233,9 +260,11 @@ error_invocations_from_idle (gpointer data)
   PanicData *pd = data;
   GHashTableIter iter;
   GTask *task;
+  JsonrpcReply *reply;
 
   g_assert (pd != NULL);
   g_assert (pd->invocations != NULL);
+  g_assert (pd->replies != NULL);
   g_assert (pd->error != NULL);
 
   g_hash_table_iter_init (&iter, pd->invocations);
@@ -245,7 +274,17 @@ error_invocations_from_idle (gpointer data)
         g_task_return_error (task, g_error_copy (pd->error));
     }
 
+  g_hash_table_iter_init (&iter, pd->replies);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&reply))
+    {
+      g_hash_table_iter_steal (&iter);
+      reply->func (pd->client, NULL, pd->error, reply->user_data);
+      jsonrpc_reply_free (reply);
+    }
+
   g_clear_pointer (&pd->invocations, g_hash_table_unref);
+  g_clear_pointer (&pd->replies, g_hash_table_unref);
+  g_clear_object (&pd->client);
   g_clear_pointer (&pd->error, g_error_free);
   g_slice_free (PanicData, pd);
 
@@ -268,12 +307,16 @@ cancel_pending_from_main (JsonrpcClient *self,
    * re-entrancy cases.
    */
   pd = g_slice_new0 (PanicData);
+  /* Pending replies keep us alive like the tasks do */
+  pd->client = g_object_ref (self);
   pd->invocations = g_steal_pointer (&priv->invocations);
+  pd->replies = g_steal_pointer (&priv->replies);
   pd->error = g_error_copy (error);
   g_idle_add_full (G_MAXINT, error_invocations_from_idle, pd, NULL);
 
   /* Keep a hashtable around for code that expects a pointer there */
   priv->invocations = g_hash_table_new_full (NULL, NULL, NULL, g_object_unref);
+  priv->replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)jsonrpc_reply_free);
 }
 
 static gboolean
@@ -394,6 +437,7 @@ jsonrpc_client_dispose (GObject *object)
   JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
 
   g_clear_pointer (&priv->invocations, g_hash_table_unref);
+  g_clear_pointer (&priv->replies, g_hash_table_unref);
 
   g_clear_object (&priv->input_stream);
   g_clear_object (&priv->output_stream);
@@ -583,6 +627,7 @@ jsonrpc_client_init (JsonrpcClient *self)
   JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
 
   priv->invocations = g_hash_table_new_full (NULL, NULL, NULL, g_object_unref);
+  priv->replies = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)jsonrpc_reply_free);
   priv->is_first_call = TRUE;
   priv->read_loop_cancellable = g_cancellable_new ();
 }
@@ -669,6 +714,36 @@ jsonrpc_client_call_write_cb (GObject      *object,
    */
 }
 
+/*
+ * jsonrpc_client_complete_reply:
+ *
+ * Completes the call made by jsonrpc_client_call_with_reply_func() with
+ * the id @id. The reply is removed from the table before the callback
+ * runs so it may safely issue further calls.
+ *
+ * Returns: %TRUE if there was such a call
+ */
+static gboolean
+jsonrpc_client_complete_reply (JsonrpcClient *self,
+                               gint64         id,
+                               GVariant      *result,
+                               const GError  *error)
+{
+  JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
+  JsonrpcReply *reply;
+
+  reply = g_hash_table_lookup (priv->replies, GINT_TO_POINTER (id));
+  if (reply == NULL)
+    return FALSE;
+
+  g_hash_table_steal (priv->replies, GINT_TO_POINTER (id));
+
+  reply->func (self, result, error, reply->user_data);
+  jsonrpc_reply_free (reply);
+
+  return TRUE;
+}
+
 static void
 jsonrpc_client_call_read_cb (GObject      *object,
                              GAsyncResult *result,
@@ -700,6 +775,7 @@ jsonrpc_client_call_read_cb (GObject      *object,
       return;
     }
 
+handle_message:
   g_assert (message != NULL);
 
   /* If we received a gvariant-based message, upgrade connection */
@@ -756,10 +832,11 @@ jsonrpc_client_call_read_cb (GObject      *object,
     {
       g_autoptr(GVariant) params = NULL;
       gint64 id = -1;
-      GTask *task;
+      GTask *task = NULL;
 
       if (!g_variant_dict_lookup (dict, "id", "x", &id) ||
-          NULL == (task = g_hash_table_lookup (priv->invocations, GINT_TO_POINTER (id))))
+          (NULL == (task = g_hash_table_lookup (priv->invocations, GINT_TO_POINTER (id))) &&
+           !g_hash_table_contains (priv->replies, GINT_TO_POINTER (id))))
         {
           error = g_error_new_literal (G_IO_ERROR,
                                        G_IO_ERROR_INVALID_DATA,
@@ -768,7 +845,11 @@ jsonrpc_client_call_read_cb (GObject      *object,
           return;
         }
 
-      if (NULL != (params = g_variant_dict_lookup_value (dict, "result", NULL)))
+      params = g_variant_dict_lookup_value (dict, "result", NULL);
+
+      if (task == NULL)
+        jsonrpc_client_complete_reply (self, id, params, NULL);
+      else if (params != NULL)
         g_task_return_pointer (task, g_steal_pointer (&params), (GDestroyNotify)g_variant_unref);
       else
         g_task_return_pointer (task, NULL, NULL);
@@ -844,7 +925,7 @@ jsonrpc_client_call_read_cb (GObject      *object,
 
           if (task != NULL)
             g_task_return_error (task, g_steal_pointer (&error));
-          else
+          else if (!jsonrpc_client_complete_reply (self, id, NULL, error))
             g_warning ("Received error for task %"G_GINT64_FORMAT" which is unknown", id);
 
           goto begin_next_read;
@@ -864,10 +945,25 @@ begin_next_read:
   if (priv->input_stream != NULL &&
       priv->in_shutdown == FALSE &&
       priv->failed == FALSE)
-    jsonrpc_input_stream_read_message_async (priv->input_stream,
-                                             priv->read_loop_cancellable,
-                                             jsonrpc_client_call_read_cb,
-                                             g_steal_pointer (&self));
+    {
+      g_autoptr(GVariant) next_message = NULL;
+
+      /* dispatch messages which arrived in the same read right away */
+      if (_jsonrpc_input_stream_take_buffered_message (priv->input_stream, &next_message))
+        {
+          g_clear_pointer (&dict, g_variant_dict_unref);
+          g_clear_pointer (&message, g_variant_unref);
+          g_clear_error (&error);
+          message = g_steal_pointer (&next_message);
+          stream = priv->input_stream;
+          goto handle_message;
+        }
+
+      jsonrpc_input_stream_read_message_async (priv->input_stream,
+                                               priv->read_loop_cancellable,
+                                               jsonrpc_client_call_read_cb,
+                                               g_steal_pointer (&self));
+    }
 }
 
 static void
@@ -1080,6 +1176,115 @@ jsonrpc_client_call_async (JsonrpcClient       *self,
   jsonrpc_client_call_with_id_async (self, method, params, NULL, cancellable, callback, user_data);
 }
 
+static gboolean
+jsonrpc_client_fail_reply_from_idle (gpointer data)
+{
+  JsonrpcReply *reply = data;
+
+  reply->func (reply->client, NULL, reply->error, reply->user_data);
+  jsonrpc_reply_free (reply);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+jsonrpc_client_reply_write_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  JsonrpcOutputStream *stream = (JsonrpcOutputStream *)object;
+  g_autoptr(JsonrpcClient) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (JSONRPC_IS_OUTPUT_STREAM (stream));
+  g_assert (JSONRPC_IS_CLIENT (self));
+
+  /* Panic fails all pending replies, no need to do it here */
+  if (!jsonrpc_output_stream_write_message_finish (stream, result, &error))
+    jsonrpc_client_panic (self, error);
+}
+
+/**
+ * jsonrpc_client_call_with_reply_func:
+ * @self: A #JsonrpcClient
+ * @method: The name of the method to call
+ * @params: (transfer none) (nullable): A [struct@GLib.Variant] of parameters or %NULL
+ * @id: (out) (optional): A location for the request id or %NULL
+ * @func: (scope async): called with the reply or an error
+ * @user_data: user data for @func
+ *
+ * Like [method@Client.call_with_id_async] but without a #GTask per call.
+ * @func is called exactly once, directly from the read loop when the
+ * reply arrives and from the main loop when the call fails. It is never
+ * called before this function returns.
+ *
+ * If @params is floating, the floating reference is consumed.
+ */
+void
+jsonrpc_client_call_with_reply_func (JsonrpcClient          *self,
+                                     const gchar            *method,
+                                     GVariant               *params,
+                                     gint64                 *id,
+                                     JsonrpcClientReplyFunc  func,
+                                     gpointer                user_data)
+{
+  JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
+  g_autoptr(GVariant) message = NULL;
+  g_autoptr(GVariant) sunk_variant = NULL;
+  JsonrpcReply *reply;
+  GVariantDict dict;
+  gint64 idval;
+
+  g_return_if_fail (JSONRPC_IS_CLIENT (self));
+  g_return_if_fail (method != NULL);
+  g_return_if_fail (func != NULL);
+
+  if (id != NULL)
+    *id = 0;
+
+  if (params == NULL)
+    params = g_variant_new_maybe (G_VARIANT_TYPE_VARIANT, NULL);
+
+  /* If we got a floating reference, we should consume it */
+  if (g_variant_is_floating (params))
+    sunk_variant = g_variant_ref_sink (params);
+
+  reply = g_slice_new0 (JsonrpcReply);
+  reply->func = func;
+  reply->user_data = user_data;
+
+  if (!jsonrpc_client_check_ready (self, &reply->error))
+    {
+      reply->client = g_object_ref (self);
+      g_idle_add (jsonrpc_client_fail_reply_from_idle, reply);
+      return;
+    }
+
+  idval = ++priv->sequence;
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "jsonrpc", "s", "2.0");
+  g_variant_dict_insert (&dict, "id", "x", idval);
+  g_variant_dict_insert (&dict, "method", "s", method);
+  g_variant_dict_insert_value (&dict, "params", params);
+
+  message = g_variant_take_ref (g_variant_dict_end (&dict));
+
+  g_hash_table_insert (priv->replies, GINT_TO_POINTER (idval), reply);
+
+  jsonrpc_output_stream_write_message_async (priv->output_stream,
+                                             message,
+                                             NULL,
+                                             jsonrpc_client_reply_write_cb,
+                                             g_object_ref (self));
+
+  if (priv->is_first_call)
+    jsonrpc_client_start_listening (self);
+
+  if (id != NULL)
+    *id = idval;
+}
+
 /**
  * jsonrpc_client_call_finish:
  * @self: A #JsonrpcClient.
@@ -1255,6 +1460,67 @@ jsonrpc_client_send_notification_async (JsonrpcClient       *self,
                                              g_steal_pointer (&task));
 }
 
+/**
+ * jsonrpc_client_send_notification_with_text_async:
+ * @self: A #JsonrpcClient
+ * @method: The name of the method to call
+ * @params: (transfer none): A [struct@GLib.Variant] of parameters
+ * @text: the text replacing %JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER in @params
+ * @text_len: length of @text in bytes
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ *
+ * Like [method@Client.send_notification_async] but with a large string
+ * payload which is escaped directly into the output buffer instead of being
+ * copied into @params. @text is only accessed during this call.
+ *
+ * Complete with [method@Client.send_notification_finish].
+ */
+void
+jsonrpc_client_send_notification_with_text_async (JsonrpcClient       *self,
+                                                  const gchar         *method,
+                                                  GVariant            *params,
+                                                  const gchar         *text,
+                                                  gsize                text_len,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
+  g_autoptr(GVariant) message = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantDict dict;
+
+  g_return_if_fail (JSONRPC_IS_CLIENT (self));
+  g_return_if_fail (method != NULL);
+  g_return_if_fail (params != NULL);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, jsonrpc_client_send_notification_async);
+
+  if (!jsonrpc_client_check_ready (self, &error))
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "jsonrpc", "s", "2.0");
+  g_variant_dict_insert (&dict, "method", "s", method);
+  g_variant_dict_insert_value (&dict, "params", params);
+
+  message = g_variant_take_ref (g_variant_dict_end (&dict));
+
+  jsonrpc_output_stream_write_message_with_text_async (priv->output_stream,
+                                                       message,
+                                                       text,
+                                                       text_len,
+                                                       cancellable,
+                                                       jsonrpc_client_send_notification_write_cb,
+                                                       g_steal_pointer (&task));
+}
+
 /**
  * jsonrpc_client_send_notification_finish:
  * @self: A #JsonrpcClient
@@ -1696,6 +1962,52 @@ jsonrpc_client_start_listening (JsonrpcClient *self)
     }
 }
 
+/**
+ * jsonrpc_client_set_max_message_size:
+ * @self: A #JsonrpcClient
+ * @max_size: maximum size of a received message in bytes
+ *
+ * Larger messages received from the peer are skipped instead of being
+ * treated as a fatal error; if they are replies, the corresponding call
+ * fails with an error.
+ *
+ * See jsonrpc_input_stream_set_max_message_size().
+ */
+void
+jsonrpc_client_set_max_message_size (JsonrpcClient *self,
+                                     gsize          max_size)
+{
+  JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
+
+  g_return_if_fail (JSONRPC_IS_CLIENT (self));
+
+  if (priv->input_stream != NULL)
+    jsonrpc_input_stream_set_max_message_size (priv->input_stream, max_size);
+}
+
+/**
+ * jsonrpc_client_get_pending_output_size:
+ * @self: A #JsonrpcClient
+ *
+ * Gets the number of bytes of messages which were queued for sending but
+ * haven't been written to the underlying stream yet. A growing value means
+ * the peer doesn't keep up with reading.
+ *
+ * Returns: the size of the pending output in bytes
+ */
+gsize
+jsonrpc_client_get_pending_output_size (JsonrpcClient *self)
+{
+  JsonrpcClientPrivate *priv = jsonrpc_client_get_instance_private (self);
+
+  g_return_val_if_fail (JSONRPC_IS_CLIENT (self), 0);
+
+  if (priv->output_stream == NULL)
+    return 0;
+
+  return jsonrpc_output_stream_get_pending_size (priv->output_stream);
+}
+
 /**
  * jsonrpc_client_get_use_gvariant:
  * @self: A #JsonrpcClient
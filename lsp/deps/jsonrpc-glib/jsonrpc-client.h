@@ -40,6 +40,24 @@ typedef enum
 JSONRPC_AVAILABLE_IN_3_26
 G_DECLARE_DERIVABLE_TYPE (JsonrpcClient, jsonrpc_client, JSONRPC, CLIENT, GObject)
 
+/* Defined when jsonrpc_client_get_pending_output_size() is available */
+#define JSONRPC_CLIENT_PENDING_OUTPUT_SIZE 1
+
+/* Defined when jsonrpc_client_call_with_reply_func() is available */
+#define JSONRPC_CLIENT_REPLY_FUNC 1
+
+/**
+ * JsonrpcClientReplyFunc:
+ * @self: A #JsonrpcClient
+ * @reply: (nullable): the result of the call or %NULL
+ * @error: (nullable): the error of a failed call or %NULL
+ * @user_data: user data passed to jsonrpc_client_call_with_reply_func()
+ */
+typedef void (*JsonrpcClientReplyFunc) (JsonrpcClient *self,
+                                        GVariant      *reply,
+                                        const GError  *error,
+                                        gpointer       user_data);
+
 struct _JsonrpcClientClass
 {
   GObjectClass parent_class;
@@ -66,6 +84,11 @@ JSONRPC_AVAILABLE_IN_3_26
 GQuark         jsonrpc_client_error_quark              (void);
 JSONRPC_AVAILABLE_IN_3_26
 JsonrpcClient *jsonrpc_client_new                      (GIOStream            *io_stream);
+JSONRPC_AVAILABLE_IN_3_44
+void           jsonrpc_client_set_max_message_size     (JsonrpcClient        *self,
+                                                        gsize                 max_size);
+JSONRPC_AVAILABLE_IN_3_44
+gsize          jsonrpc_client_get_pending_output_size  (JsonrpcClient        *self);
 JSONRPC_AVAILABLE_IN_3_26
 gboolean       jsonrpc_client_get_use_gvariant         (JsonrpcClient        *self);
 JSONRPC_AVAILABLE_IN_3_26
@@ -99,6 +122,13 @@ void           jsonrpc_client_call_with_id_async       (JsonrpcClient        *se
                                                         GCancellable         *cancellable,
                                                         GAsyncReadyCallback   callback,
                                                         gpointer              user_data);
+JSONRPC_AVAILABLE_IN_3_44
+void           jsonrpc_client_call_with_reply_func     (JsonrpcClient        *self,
+                                                        const gchar          *method,
+                                                        GVariant             *params,
+                                                        gint64               *id,
+                                                        JsonrpcClientReplyFunc func,
+                                                        gpointer              user_data);
 JSONRPC_AVAILABLE_IN_3_26
 void           jsonrpc_client_call_async               (JsonrpcClient        *self,
                                                         const gchar          *method,
@@ -124,6 +154,16 @@ void           jsonrpc_client_send_notification_async  (JsonrpcClient        *se
                                                         GCancellable         *cancellable,
                                                         GAsyncReadyCallback   callback,
                                                         gpointer              user_data);
+JSONRPC_AVAILABLE_IN_3_44
+void           jsonrpc_client_send_notification_with_text_async
+                                                       (JsonrpcClient        *self,
+                                                        const gchar          *method,
+                                                        GVariant             *params,
+                                                        const gchar          *text,
+                                                        gsize                 text_len,
+                                                        GCancellable         *cancellable,
+                                                        GAsyncReadyCallback   callback,
+                                                        gpointer              user_data);
 JSONRPC_AVAILABLE_IN_3_26
 gboolean       jsonrpc_client_send_notification_finish (JsonrpcClient        *self,
                                                         GAsyncResult         *result,
@@ -23,7 +23,9 @@
 
 G_BEGIN_DECLS
 
-gboolean _jsonrpc_input_stream_get_has_seen_gvariant (JsonrpcInputStream *self) G_GNUC_INTERNAL;
+gboolean _jsonrpc_input_stream_get_has_seen_gvariant (JsonrpcInputStream  *self) G_GNUC_INTERNAL;
+gboolean _jsonrpc_input_stream_take_buffered_message (JsonrpcInputStream  *self,
+                                                      GVariant           **message) G_GNUC_INTERNAL;
 
 G_END_DECLS
 
@@ -24,267 +24,1598 @@
 #include <json-glib/json-glib.h>
 #include <string.h>
 
+#if defined (__SSE2__)
+# include <emmintrin.h>
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #include "jsonrpc-input-stream.h"
 #include "jsonrpc-input-stream-private.h"
+#include "jsonrpc-message.h"
+
+/* Size of the reads from the peer, the buffer grows beyond it only to hold
+ * a message larger than that */
+#define READ_CHUNK_SIZE   (64 * 1024)
+/* Bigger buffers are released once drained so a single huge reply doesn't
+ * keep its memory for the lifetime of the stream */
+#define MAX_IDLE_BUFFER_SIZE (1024 * 1024)
+#define MAX_HEADER_SIZE   (8 * 1024)
+/* JSON bodies of at least this size are decoded in a worker thread so big
+ * replies don't stall the main loop */
+#define THREADED_DECODE_SIZE (256 * 1024)
+/* Bodies of at least this size are written to a temporary file and decoded
+ * from its memory mapping instead of growing the framing buffer to hold
+ * them */
+#define SPILL_SIZE        (4 * 1024 * 1024)
+/* JSON-RPC "Internal error" */
+#define JSONRPC_INTERNAL_ERROR (-32603)
+
+typedef enum
+{
+  FRAME_INCOMPLETE,
+  FRAME_COMPLETE,
+  FRAME_ERROR,
+  FRAME_DECODE_IN_THREAD,
+  FRAME_SPILL_IN_THREAD,
+} FrameResult;
+
+typedef struct
+{
+  gint16        priority;
+  guint         use_gvariant : 1;
+  /* location of the body handed to the decoding thread, or of the part of
+   * a spilled body handed to the writing thread */
+  const gchar  *body;
+  gsize         body_len;
+  gsize         frame_len;
+  guint         spilled : 1;
+} ReadState;
+
+/* Where the search for the top-level "id" member of a skipped message
+ * stands, its body is fed to it in chunks as they arrive */
+typedef enum
+{
+  ID_SCAN_NONE,
+  ID_SCAN_KEY,       /* after the "id" key at the top level */
+  ID_SCAN_COLON,     /* after the colon following it */
+  ID_SCAN_VALUE,     /* inside the numeric value */
+  ID_SCAN_DONE,
+} IdScanState;
+
+typedef struct
+{
+  IdScanState state;
+  gint        depth;
+  gsize       str_len;     /* of the string being scanned */
+  gint64      id;
+  guint       in_string : 1;
+  guint       escaped : 1;
+  guint       is_id : 1;   /* the string being scanned still matches "id" */
+} IdScan;
+
+typedef struct
+{
+  gssize max_size_bytes;
+
+  /* Framing buffer, bytes between head and tail have been read from the
+   * peer but not consumed yet. needed is the number of bytes from head
+   * required to complete the message being received. */
+  gchar *buffer;
+  gsize  buffer_size;
+  gsize  head;
+  gsize  tail;
+  gsize  needed;
+
+  /* Body bytes of the current message still to be received when it is
+   * spilled to spill_file or skipped because it exceeds max_size_bytes */
+  gsize          body_remaining;
+  GFile         *spill_file;
+  GFileIOStream *spill_stream;
+  GMappedFile   *spill_mapped;
+  IdScan         skip_scan;
+
+  guint  has_seen_gvariant : 1;
+  guint  skipping : 1;
+} JsonrpcInputStreamPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (JsonrpcInputStream, jsonrpc_input_stream, G_TYPE_DATA_INPUT_STREAM)
+
+static gboolean jsonrpc_input_stream_debug;
+
+static void jsonrpc_input_stream_process (GTask *task);
+static void jsonrpc_input_stream_consume (JsonrpcInputStream *self,
+                                          gsize               frame_len);
+
+static void
+read_state_free (gpointer data)
+{
+  ReadState *state = data;
+
+  g_slice_free (ReadState, state);
+}
+
+static void
+jsonrpc_input_stream_release_spill (JsonrpcInputStream *self)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+
+  g_clear_pointer (&priv->spill_mapped, g_mapped_file_unref);
+
+  if (priv->spill_stream != NULL)
+    {
+      g_io_stream_close (G_IO_STREAM (priv->spill_stream), NULL, NULL);
+      g_clear_object (&priv->spill_stream);
+    }
+
+  if (priv->spill_file != NULL)
+    {
+      g_file_delete (priv->spill_file, NULL, NULL);
+      g_clear_object (&priv->spill_file);
+    }
+}
+
+static void
+jsonrpc_input_stream_finalize (GObject *object)
+{
+  JsonrpcInputStream *self = (JsonrpcInputStream *)object;
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+
+  jsonrpc_input_stream_release_spill (self);
+  g_clear_pointer (&priv->buffer, g_free);
+
+  G_OBJECT_CLASS (jsonrpc_input_stream_parent_class)->finalize (object);
+}
+
+static void
+jsonrpc_input_stream_class_init (JsonrpcInputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = jsonrpc_input_stream_finalize;
+
+  jsonrpc_input_stream_debug = !!g_getenv ("JSONRPC_DEBUG");
+}
+
+static void
+jsonrpc_input_stream_init (JsonrpcInputStream *self)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+
+  priv->max_size_bytes = JSONRPC_INPUT_STREAM_DEFAULT_MAX_MESSAGE_SIZE;
+
+  g_data_input_stream_set_newline_type (G_DATA_INPUT_STREAM (self),
+                                        G_DATA_STREAM_NEWLINE_TYPE_ANY);
+}
+
+JsonrpcInputStream *
+jsonrpc_input_stream_new (GInputStream *base_stream)
+{
+  return g_object_new (JSONRPC_TYPE_INPUT_STREAM,
+                       "base-stream", base_stream,
+                       NULL);
+}
+
+/*
+ * Single pass JSON to GVariant decoder producing the same variants as
+ * json_gvariant_deserialize_data() without a signature (objects as a{sv},
+ * arrays as av, null as mv) but without building the intermediate JsonNode
+ * tree first.
+ */
+
+#define JSONRPC_DECODER_MAX_DEPTH 512
+
+typedef struct
+{
+  const gchar *begin;
+  const gchar *p;
+  const gchar *end;
+  guint        depth;
+  GHashTable  *keys;  /* member name -> its string GVariant shared by all objects */
+  guint64      n_variants;  /* created while decoding, reported in the statistics */
+} JsonrpcDecoder;
+
+/* Totals of the JSON bodies decoded by all the streams, bodies can be decoded
+ * in worker threads */
+typedef struct
+{
+  guint64 n_messages;
+  guint64 n_bytes;
+  guint64 n_variants;
+  gint64  usec;
+} JsonrpcDecodeStatistics;
+
+G_LOCK_DEFINE_STATIC (decode_statistics);
+static JsonrpcDecodeStatistics decode_statistics;
+
+static GVariant *jsonrpc_decoder_parse_value (JsonrpcDecoder  *decoder,
+                                              GError         **error);
+
+static gboolean
+jsonrpc_decoder_error (JsonrpcDecoder  *decoder,
+                       GError         **error,
+                       const gchar     *what)
+{
+  g_set_error (error,
+               JSON_PARSER_ERROR,
+               JSON_PARSER_ERROR_INVALID_DATA,
+               "Invalid JSON message: %s at offset %"G_GSIZE_FORMAT,
+               what,
+               (gsize)(decoder->p - decoder->begin));
+  return FALSE;
+}
+
+#define IS_JSON_WS(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+/*
+ * The scanning of string contents and of whitespace runs (indentation of
+ * pretty-printed messages) checks 16 bytes at once where SSE2 or NEON is
+ * available; the remaining bytes are checked one by one.
+ */
+
+/* first '"', '\\' or control character in [p, end), end if none */
+static inline const gchar *
+jsonrpc_decoder_find_string_special (const gchar *p,
+                                     const gchar *end)
+{
+#if defined (__SSE2__)
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i max_control = _mm_set1_epi8 (0x1F);
+
+  while (end - p >= 16)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *)p);
+      __m128i special = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (chunk, quote),
+                                                    _mm_cmpeq_epi8 (chunk, backslash)),
+                                      /* unsigned chunk <= 0x1F */
+                                      _mm_cmpeq_epi8 (_mm_min_epu8 (chunk, max_control), chunk));
+      gint mask = _mm_movemask_epi8 (special);
+
+      if (mask != 0)
+        return p + g_bit_nth_lsf (mask, -1);
+
+      p += 16;
+    }
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+  const uint8x16_t quote = vdupq_n_u8 ('"');
+  const uint8x16_t backslash = vdupq_n_u8 ('\\');
+  const uint8x16_t space = vdupq_n_u8 (0x20);
+
+  while (end - p >= 16)
+    {
+      uint8x16_t chunk = vld1q_u8 ((const guint8 *)p);
+      uint8x16_t special = vorrq_u8 (vorrq_u8 (vceqq_u8 (chunk, quote),
+                                               vceqq_u8 (chunk, backslash)),
+                                     vcltq_u8 (chunk, space));
+
+      /* the exact position is found below */
+      if (vmaxvq_u8 (special) != 0)
+        break;
+
+      p += 16;
+    }
+#endif
+
+  while (p < end && *p != '"' && *p != '\\' && (guchar)*p >= 0x20)
+    p++;
+
+  return p;
+}
+
+static inline void
+jsonrpc_decoder_skip_ws (JsonrpcDecoder *decoder)
+{
+  const gchar *p = decoder->p;
+  const gchar *end = decoder->end;
+
+  /* most messages are compact - at most a single space between tokens */
+  if (p >= end || !IS_JSON_WS (*p))
+    return;
+
+  p++;
+
+#if defined (__SSE2__)
+  while (end - p >= 16)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *)p);
+      __m128i ws = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 (' ')),
+                                               _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\n'))),
+                                 _mm_or_si128 (_mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\r')),
+                                               _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\t'))));
+      gint mask = ~_mm_movemask_epi8 (ws) & 0xFFFF;
+
+      if (mask != 0)
+        {
+          decoder->p = p + g_bit_nth_lsf (mask, -1);
+          return;
+        }
+
+      p += 16;
+    }
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+  while (end - p >= 16)
+    {
+      uint8x16_t chunk = vld1q_u8 ((const guint8 *)p);
+      uint8x16_t ws = vorrq_u8 (vorrq_u8 (vceqq_u8 (chunk, vdupq_n_u8 (' ')),
+                                          vceqq_u8 (chunk, vdupq_n_u8 ('\n'))),
+                                vorrq_u8 (vceqq_u8 (chunk, vdupq_n_u8 ('\r')),
+                                          vceqq_u8 (chunk, vdupq_n_u8 ('\t'))));
+
+      if (vminvq_u8 (ws) == 0)
+        break;
+
+      p += 16;
+    }
+#endif
+
+  while (p < end && IS_JSON_WS (*p))
+    p++;
+
+  decoder->p = p;
+}
+
+static gboolean
+jsonrpc_decoder_parse_hex4 (JsonrpcDecoder *decoder,
+                            gunichar       *value)
+{
+  guint i;
+
+  if (decoder->end - decoder->p < 4)
+    return FALSE;
+
+  *value = 0;
+
+  for (i = 0; i < 4; i++)
+    {
+      gint digit = g_ascii_xdigit_value (decoder->p[i]);
+
+      if (digit < 0)
+        return FALSE;
+
+      *value = (*value << 4) | digit;
+    }
+
+  decoder->p += 4;
+
+  return TRUE;
+}
+
+static gchar *
+jsonrpc_decoder_parse_string (JsonrpcDecoder  *decoder,
+                              GError         **error)
+{
+  const gchar *start;
+  GString *str;
+
+  g_assert (*decoder->p == '"');
+
+  start = ++decoder->p;
+
+  /* Fast path, strings without escapes are copied at once */
+  decoder->p = jsonrpc_decoder_find_string_special (decoder->p, decoder->end);
+
+  if (decoder->p < decoder->end && *decoder->p == '"')
+    {
+      if (!g_utf8_validate (start, decoder->p - start, NULL))
+        {
+          jsonrpc_decoder_error (decoder, error, "invalid UTF-8 in string");
+          return NULL;
+        }
+
+      decoder->p++;
+      return g_strndup (start, decoder->p - start - 1);
+    }
+
+  str = g_string_new_len (start, decoder->p - start);
+
+  while (decoder->p < decoder->end && *decoder->p != '"')
+    {
+      const gchar *run = decoder->p;
+      gunichar c;
+
+      decoder->p = jsonrpc_decoder_find_string_special (decoder->p, decoder->end);
+
+      g_string_append_len (str, run, decoder->p - run);
+
+      if (decoder->p >= decoder->end || *decoder->p == '"')
+        break;
+
+      if ((guchar)*decoder->p < 0x20)
+        {
+          jsonrpc_decoder_error (decoder, error, "control character in string");
+          goto failure;
+        }
+
+      /* escape sequence */
+      decoder->p++;
+
+      if (decoder->p >= decoder->end)
+        break;
+
+      switch (*decoder->p++)
+        {
+        case '"':  g_string_append_c (str, '"'); break;
+        case '\\': g_string_append_c (str, '\\'); break;
+        case '/':  g_string_append_c (str, '/'); break;
+        case 'b':  g_string_append_c (str, '\b'); break;
+        case 'f':  g_string_append_c (str, '\f'); break;
+        case 'n':  g_string_append_c (str, '\n'); break;
+        case 'r':  g_string_append_c (str, '\r'); break;
+        case 't':  g_string_append_c (str, '\t'); break;
+
+        case 'u':
+          if (!jsonrpc_decoder_parse_hex4 (decoder, &c))
+            {
+              jsonrpc_decoder_error (decoder, error, "invalid unicode escape");
+              goto failure;
+            }
+
+          if (c >= 0xD800 && c <= 0xDBFF)
+            {
+              gunichar low;
+
+              if (decoder->end - decoder->p >= 6 &&
+                  decoder->p[0] == '\\' && decoder->p[1] == 'u')
+                {
+                  const gchar *saved = decoder->p;
+
+                  decoder->p += 2;
+                  if (jsonrpc_decoder_parse_hex4 (decoder, &low) &&
+                      low >= 0xDC00 && low <= 0xDFFF)
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                  else
+                    {
+                      decoder->p = saved;
+                      c = 0xFFFD;
+                    }
+                }
+              else
+                c = 0xFFFD;
+            }
+          else if ((c >= 0xDC00 && c <= 0xDFFF) || c == 0)
+            c = 0xFFFD;  /* lone surrogate or NUL which GVariant can't hold */
+
+          g_string_append_unichar (str, c);
+          break;
+
+        default:
+          decoder->p--;
+          jsonrpc_decoder_error (decoder, error, "invalid escape sequence");
+          goto failure;
+        }
+    }
+
+  if (decoder->p >= decoder->end)
+    {
+      jsonrpc_decoder_error (decoder, error, "unterminated string");
+      goto failure;
+    }
+
+  decoder->p++;
+
+  if (!g_utf8_validate (str->str, str->len, NULL))
+    {
+      jsonrpc_decoder_error (decoder, error, "invalid UTF-8 in string");
+      goto failure;
+    }
+
+  return g_string_free (str, FALSE);
+
+failure:
+  g_string_free (str, TRUE);
+  return NULL;
+}
+
+static GVariant *
+jsonrpc_decoder_parse_number (JsonrpcDecoder  *decoder,
+                              GError         **error)
+{
+  const gchar *start = decoder->p;
+  gboolean is_double = FALSE;
+  gchar buf[64];
+  gchar *copy;
+  gchar *endptr;
+  GVariant *ret = NULL;
+  gsize len;
+
+  if (decoder->p < decoder->end && *decoder->p == '-')
+    decoder->p++;
+
+  while (decoder->p < decoder->end)
+    {
+      gchar c = *decoder->p;
+
+      if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        is_double = TRUE;
+      else if (!g_ascii_isdigit (c))
+        break;
+
+      decoder->p++;
+    }
+
+  len = decoder->p - start;
+
+  if (len == 0 || (len == 1 && *start == '-'))
+    {
+      jsonrpc_decoder_error (decoder, error, "invalid number");
+      return NULL;
+    }
+
+  /* the buffer isn't necessarily terminated after the number */
+  if (len < sizeof buf)
+    {
+      memcpy (buf, start, len);
+      buf[len] = '\0';
+      copy = buf;
+    }
+  else
+    copy = g_strndup (start, len);
+
+  errno = 0;
+
+  if (!is_double)
+    {
+      gint64 val = g_ascii_strtoll (copy, &endptr, 10);
+
+      if (errno == ERANGE)
+        is_double = TRUE;
+      else if (*endptr == '\0')
+        ret = g_variant_new_int64 (val);
+    }
+
+  if (is_double)
+    {
+      gdouble val = g_ascii_strtod (copy, &endptr);
+
+      if (*endptr == '\0')
+        ret = g_variant_new_double (val);
+    }
+
+  if (ret == NULL)
+    jsonrpc_decoder_error (decoder, error, "invalid number");
+
+  if (copy != buf)
+    g_free (copy);
+
+  return ret;
+}
+
+/*
+ * Member names repeat in every element of arrays so short ones without escape
+ * sequences are created once per message and shared by all the objects.
+ * Returns a non-floating reference.
+ */
+static GVariant *
+jsonrpc_decoder_parse_key (JsonrpcDecoder  *decoder,
+                           GError         **error)
+{
+  const gchar *start = decoder->p + 1;
+  gboolean shared = FALSE;
+  GVariant *key;
+  gchar buf[64];
+  gchar *str;
+  const gchar *q;
+
+  q = jsonrpc_decoder_find_string_special (start, MIN (decoder->end, start + sizeof buf - 1));
+
+  if (q < decoder->end && *q == '"')
+    {
+      memcpy (buf, start, q - start);
+      buf[q - start] = '\0';
+      shared = TRUE;
+
+      if (decoder->keys && (key = g_hash_table_lookup (decoder->keys, buf)))
+        {
+          decoder->p = q + 1;
+          return g_variant_ref (key);
+        }
+    }
+
+  if (!(str = jsonrpc_decoder_parse_string (decoder, error)))
+    return NULL;
+
+  key = g_variant_ref_sink (g_variant_new_take_string (str));
+  decoder->n_variants++;
+
+  if (shared)
+    {
+      if (decoder->keys == NULL)
+        decoder->keys = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                               (GDestroyNotify)g_variant_unref);
+      g_hash_table_insert (decoder->keys,
+                           (gpointer)g_variant_get_string (key, NULL),
+                           g_variant_ref (key));
+    }
+
+  return key;
+}
+
+static gboolean
+jsonrpc_decoder_expect_literal (JsonrpcDecoder *decoder,
+                                const gchar    *literal,
+                                gsize           len)
+{
+  if ((gsize)(decoder->end - decoder->p) < len ||
+      memcmp (decoder->p, literal, len) != 0)
+    return FALSE;
+
+  decoder->p += len;
+
+  return TRUE;
+}
+
+static GVariant *
+jsonrpc_decoder_parse_object (JsonrpcDecoder  *decoder,
+                              GError         **error)
+{
+  GVariantBuilder builder;
+
+  g_assert (*decoder->p == '{');
+
+  decoder->p++;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  jsonrpc_decoder_skip_ws (decoder);
+
+  if (decoder->p < decoder->end && *decoder->p == '}')
+    {
+      decoder->p++;
+      return g_variant_builder_end (&builder);
+    }
+
+  for (;;)
+    {
+      g_autoptr(GVariant) key = NULL;
+      GVariant *value;
+
+      jsonrpc_decoder_skip_ws (decoder);
+
+      if (decoder->p >= decoder->end || *decoder->p != '"')
+        {
+          jsonrpc_decoder_error (decoder, error, "expected member name");
+          goto failure;
+        }
+
+      if (!(key = jsonrpc_decoder_parse_key (decoder, error)))
+        goto failure;
+
+      jsonrpc_decoder_skip_ws (decoder);
+
+      if (decoder->p >= decoder->end || *decoder->p != ':')
+        {
+          jsonrpc_decoder_error (decoder, error, "expected ':'");
+          goto failure;
+        }
+
+      decoder->p++;
+
+      if (!(value = jsonrpc_decoder_parse_value (decoder, error)))
+        goto failure;
+
+      g_variant_builder_add_value (&builder,
+                                   g_variant_new_dict_entry (key, g_variant_new_variant (value)));
+      decoder->n_variants += 2;
+
+      jsonrpc_decoder_skip_ws (decoder);
+
+      if (decoder->p < decoder->end && *decoder->p == ',')
+        {
+          decoder->p++;
+          continue;
+        }
+
+      if (decoder->p < decoder->end && *decoder->p == '}')
+        {
+          decoder->p++;
+          return g_variant_builder_end (&builder);
+        }
+
+      jsonrpc_decoder_error (decoder, error, "expected ',' or '}'");
+      goto failure;
+    }
+
+failure:
+  g_variant_builder_clear (&builder);
+  return NULL;
+}
+
+static GVariant *
+jsonrpc_decoder_parse_array (JsonrpcDecoder  *decoder,
+                             GError         **error)
+{
+  GVariantBuilder builder;
+
+  g_assert (*decoder->p == '[');
+
+  decoder->p++;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("av"));
+
+  jsonrpc_decoder_skip_ws (decoder);
+
+  if (decoder->p < decoder->end && *decoder->p == ']')
+    {
+      decoder->p++;
+      return g_variant_builder_end (&builder);
+    }
+
+  for (;;)
+    {
+      GVariant *value;
+
+      if (!(value = jsonrpc_decoder_parse_value (decoder, error)))
+        goto failure;
+
+      g_variant_builder_add_value (&builder, g_variant_new_variant (value));
+      decoder->n_variants++;
+
+      jsonrpc_decoder_skip_ws (decoder);
+
+      if (decoder->p < decoder->end && *decoder->p == ',')
+        {
+          decoder->p++;
+          continue;
+        }
+
+      if (decoder->p < decoder->end && *decoder->p == ']')
+        {
+          decoder->p++;
+          return g_variant_builder_end (&builder);
+        }
+
+      jsonrpc_decoder_error (decoder, error, "expected ',' or ']'");
+      goto failure;
+    }
+
+failure:
+  g_variant_builder_clear (&builder);
+  return NULL;
+}
+
+static GVariant *
+jsonrpc_decoder_parse_value (JsonrpcDecoder  *decoder,
+                             GError         **error)
+{
+  GVariant *ret = NULL;
+  gchar *str;
+
+  jsonrpc_decoder_skip_ws (decoder);
+
+  if (decoder->p >= decoder->end)
+    {
+      jsonrpc_decoder_error (decoder, error, "unexpected end of data");
+      return NULL;
+    }
+
+  if (++decoder->depth > JSONRPC_DECODER_MAX_DEPTH)
+    {
+      jsonrpc_decoder_error (decoder, error, "nesting too deep");
+      return NULL;
+    }
+
+  switch (*decoder->p)
+    {
+    case '{':
+      ret = jsonrpc_decoder_parse_object (decoder, error);
+      break;
+
+    case '[':
+      ret = jsonrpc_decoder_parse_array (decoder, error);
+      break;
+
+    case '"':
+      if ((str = jsonrpc_decoder_parse_string (decoder, error)))
+        ret = g_variant_new_take_string (str);
+      break;
+
+    case 't':
+      if (jsonrpc_decoder_expect_literal (decoder, "true", 4))
+        ret = g_variant_new_boolean (TRUE);
+      else
+        jsonrpc_decoder_error (decoder, error, "invalid literal");
+      break;
+
+    case 'f':
+      if (jsonrpc_decoder_expect_literal (decoder, "false", 5))
+        ret = g_variant_new_boolean (FALSE);
+      else
+        jsonrpc_decoder_error (decoder, error, "invalid literal");
+      break;
+
+    case 'n':
+      if (jsonrpc_decoder_expect_literal (decoder, "null", 4))
+        ret = g_variant_new_maybe (G_VARIANT_TYPE_VARIANT, NULL);
+      else
+        jsonrpc_decoder_error (decoder, error, "invalid literal");
+      break;
+
+    default:
+      ret = jsonrpc_decoder_parse_number (decoder, error);
+      break;
+    }
+
+  decoder->depth--;
+
+  if (ret != NULL)
+    decoder->n_variants++;
+
+  return ret;
+}
+
+static GVariant *
+jsonrpc_input_stream_decode_json (const gchar  *data,
+                                  gsize         length,
+                                  GError      **error)
+{
+  JsonrpcDecoder decoder = { data, data, data + length, 0, NULL, 0 };
+  gint64 start_time = g_get_monotonic_time ();
+  GVariant *ret;
+
+  /* UTF-8 BOM */
+  if (length >= 3 && memcmp (data, "\xEF\xBB\xBF", 3) == 0)
+    decoder.p += 3;
+
+  ret = jsonrpc_decoder_parse_value (&decoder, error);
+
+  if (ret != NULL)
+    {
+      jsonrpc_decoder_skip_ws (&decoder);
+
+      if (decoder.p != decoder.end)
+        {
+          g_variant_unref (g_variant_ref_sink (ret));
+          jsonrpc_decoder_error (&decoder, error, "trailing data");
+          ret = NULL;
+        }
+    }
+
+  g_clear_pointer (&decoder.keys, g_hash_table_unref);
+
+  G_LOCK (decode_statistics);
+  decode_statistics.n_messages++;
+  decode_statistics.n_bytes += length;
+  decode_statistics.n_variants += decoder.n_variants;
+  decode_statistics.usec += g_get_monotonic_time () - start_time;
+  G_UNLOCK (decode_statistics);
+
+  return ret;
+}
+
+static GVariant *
+jsonrpc_input_stream_decode_body (const gchar  *data,
+                                  gsize         length,
+                                  gboolean      use_gvariant,
+                                  const gchar  *gvariant_type,
+                                  GError      **error)
+{
+  GVariant *message;
+
+  if G_UNLIKELY (jsonrpc_input_stream_debug && use_gvariant == FALSE)
+    g_message ("<<< %.*s", (gint)length, data);
+
+  if (use_gvariant)
+    {
+      g_autoptr(GBytes) bytes = NULL;
+
+      /* the framing buffer is reused for the following messages */
+      bytes = g_bytes_new (data, length);
+      message = g_variant_new_from_bytes (gvariant_type ? G_VARIANT_TYPE (gvariant_type)
+                                                        : G_VARIANT_TYPE_VARDICT,
+                                          bytes, FALSE);
+
+      if G_UNLIKELY (jsonrpc_input_stream_debug)
+        {
+          g_autofree gchar *debugstr = g_variant_print (message, TRUE);
+          g_message ("<<< %s", debugstr);
+        }
+    }
+  else
+    message = jsonrpc_input_stream_decode_json (data, length, error);
+
+  /* Don't let message be floating */
+  if (message != NULL)
+    g_variant_take_ref (message);
+
+  return message;
+}
+
+static gboolean
+jsonrpc_input_stream_parse_content_length (const gchar *str,
+                                           gsize        len,
+                                           gssize       max_size,
+                                           gssize      *content_length)
+{
+  gint64 value = 0;
+  gsize i = 0;
+
+  while (i < len && (str[i] == ' ' || str[i] == '\t'))
+    i++;
+
+  if (i == len || !g_ascii_isdigit (str[i]))
+    return FALSE;
+
+  for (; i < len && g_ascii_isdigit (str[i]); i++)
+    {
+      value = value * 10 + (str[i] - '0');
+
+      if (value > max_size)
+        return FALSE;
+    }
+
+  *content_length = value;
+
+  return TRUE;
+}
+
+/*
+ * Looks for the top-level "id" member in a part of a message which is too
+ * large to be received so the request waiting for it can be failed. The
+ * whole body is scanned as servers may put "id" after a huge "result".
+ */
+static void
+id_scan_feed (IdScan      *scan,
+              const gchar *data,
+              gsize        len)
+{
+  gsize i;
+
+  for (i = 0; i < len && scan->state != ID_SCAN_DONE; i++)
+    {
+      gchar c = data[i];
+
+      if (scan->in_string)
+        {
+          if (scan->escaped)
+            scan->escaped = FALSE;
+          else if (c == '\\')
+            {
+              scan->escaped = TRUE;
+              scan->is_id = FALSE;
+            }
+          else if (c == '"')
+            {
+              scan->in_string = FALSE;
+              if (scan->depth == 1 && scan->is_id && scan->str_len == 2)
+                scan->state = ID_SCAN_KEY;
+            }
+          else
+            {
+              scan->is_id = scan->is_id && scan->str_len < 2 && c == "id"[scan->str_len];
+              scan->str_len++;
+            }
+          continue;
+        }
+
+      if (scan->state != ID_SCAN_NONE && g_ascii_isspace (c) && scan->state != ID_SCAN_VALUE)
+        continue;
+
+      if (scan->state == ID_SCAN_KEY && c == ':')
+        {
+          scan->state = ID_SCAN_COLON;
+          continue;
+        }
+      else if ((scan->state == ID_SCAN_COLON || scan->state == ID_SCAN_VALUE) && g_ascii_isdigit (c))
+        {
+          if (scan->state == ID_SCAN_COLON)
+            scan->id = 0;
+          if (scan->id < G_MAXINT64 / 10)
+            scan->id = scan->id * 10 + (c - '0');
+          scan->state = ID_SCAN_VALUE;
+          continue;
+        }
+      else if (scan->state == ID_SCAN_VALUE)
+        {
+          scan->state = ID_SCAN_DONE;
+          continue;
+        }
 
-typedef struct
+      /* "id" was a value, or the id isn't a number, keep looking */
+      scan->state = ID_SCAN_NONE;
+
+      switch (c)
+        {
+        case '"':
+          scan->in_string = TRUE;
+          scan->str_len = 0;
+          scan->is_id = TRUE;
+          break;
+
+        case '{':
+        case '[':
+          scan->depth++;
+          break;
+
+        case '}':
+        case ']':
+          scan->depth--;
+          break;
+
+        default:
+          break;
+        }
+    }
+}
+
+static gboolean
+id_scan_finish (IdScan *scan,
+                gint64 *id)
 {
-  gssize        content_length;
-  gchar        *buffer;
-  GVariantType *gvariant_type;
-  gint16        priority;
-  guint         use_gvariant : 1;
-} ReadState;
+  if (scan->state != ID_SCAN_VALUE && scan->state != ID_SCAN_DONE)
+    return FALSE;
 
-typedef struct
+  *id = scan->id;
+  return TRUE;
+}
+
+static void
+jsonrpc_input_stream_start_skip (JsonrpcInputStream *self)
 {
-  gssize max_size_bytes;
-  guint  has_seen_gvariant : 1;
-} JsonrpcInputStreamPrivate;
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
 
-G_DEFINE_TYPE_WITH_PRIVATE (JsonrpcInputStream, jsonrpc_input_stream, G_TYPE_DATA_INPUT_STREAM)
+  priv->skipping = TRUE;
+  memset (&priv->skip_scan, 0, sizeof priv->skip_scan);
+}
 
-static gboolean jsonrpc_input_stream_debug;
+static gboolean
+jsonrpc_input_stream_start_spill (JsonrpcInputStream  *self,
+                                  GError             **error)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
 
-static void
-read_state_free (gpointer data)
+  priv->spill_file = g_file_new_tmp ("jsonrpc-XXXXXX.json", &priv->spill_stream, error);
+
+  return priv->spill_file != NULL;
+}
+
+static gboolean
+jsonrpc_input_stream_finish_spill (JsonrpcInputStream  *self,
+                                   GError             **error)
 {
-  ReadState *state = data;
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  g_autofree gchar *path = g_file_get_path (priv->spill_file);
 
-  g_clear_pointer (&state->buffer, g_free);
-  g_clear_pointer (&state->gvariant_type, g_free);
-  g_slice_free (ReadState, state);
+  if (!g_io_stream_close (G_IO_STREAM (priv->spill_stream), NULL, error))
+    return FALSE;
+  g_clear_object (&priv->spill_stream);
+
+  priv->spill_mapped = g_mapped_file_new (path, FALSE, error);
+
+  return priv->spill_mapped != NULL;
 }
 
-static void
-jsonrpc_input_stream_class_init (JsonrpcInputStreamClass *klass)
+/*
+ * Receives the body of a message which is spilled to a temporary file or
+ * skipped. Returns FRAME_INCOMPLETE while more data is needed.
+ *
+ * If @offload is given, received parts of spilled bodies are not written
+ * but their location is stored in @offload and FRAME_SPILL_IN_THREAD is
+ * returned; the caller then has to consume them once written.
+ */
+static FrameResult
+jsonrpc_input_stream_receive_body (JsonrpcInputStream  *self,
+                                   ReadState           *offload,
+                                   GVariant           **message,
+                                   GError             **error)
 {
-  jsonrpc_input_stream_debug = !!g_getenv ("JSONRPC_DEBUG");
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  gsize n = MIN (priv->body_remaining, priv->tail - priv->head);
+  const gchar *chunk = priv->buffer + priv->head;
+  gint64 id = -1;
+
+  if (priv->skipping)
+    id_scan_feed (&priv->skip_scan, chunk, n);
+  else if (n > 0 && offload != NULL)
+    {
+      offload->body = chunk;
+      offload->body_len = n;
+      return FRAME_SPILL_IN_THREAD;
+    }
+  else if (n > 0 &&
+           !g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (priv->spill_stream)),
+                                       chunk, n, NULL, NULL, error))
+    {
+      /* put the rest of the body to the bin */
+      jsonrpc_input_stream_start_skip (self);
+      jsonrpc_input_stream_release_spill (self);
+      return FRAME_ERROR;
+    }
+
+  priv->body_remaining -= n;
+  jsonrpc_input_stream_consume (self, n);
+
+  if (priv->body_remaining > 0)
+    return FRAME_INCOMPLETE;
+
+  if (!priv->skipping)
+    {
+      if (!jsonrpc_input_stream_finish_spill (self, error))
+        {
+          jsonrpc_input_stream_release_spill (self);
+          return FRAME_ERROR;
+        }
+      return FRAME_COMPLETE;
+    }
+
+  priv->skipping = FALSE;
+
+  /* fail the request the reply belongs to, notifications are just dropped */
+  if (id_scan_finish (&priv->skip_scan, &id))
+    {
+      *message = JSONRPC_MESSAGE_NEW (
+        "jsonrpc", "2.0",
+        "id", JSONRPC_MESSAGE_PUT_INT64 (id),
+        "error", "{",
+          "code", JSONRPC_MESSAGE_PUT_INT64 (JSONRPC_INTERNAL_ERROR),
+          "message", JSONRPC_MESSAGE_PUT_STRING ("Message from peer exceeds the maximum message size"),
+        "}"
+      );
+    }
+
+  return FRAME_COMPLETE;
+}
+
+/*
+ * Tries to cut one complete message off the front of the framing buffer.
+ * The buffer is only consumed when a message was successfully decoded.
+ *
+ * If @offload is given, large JSON bodies are not decoded but their
+ * location is stored in @offload and FRAME_DECODE_IN_THREAD is returned;
+ * the caller then has to call jsonrpc_input_stream_consume() once done.
+ */
+static FrameResult
+jsonrpc_input_stream_try_frame (JsonrpcInputStream  *self,
+                                ReadState           *offload,
+                                GVariant           **message,
+                                gboolean            *use_gvariant,
+                                GError             **error)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  g_autofree gchar *gvariant_type = NULL;
+  const gchar *data = priv->buffer + priv->head;
+  const gchar *end = priv->buffer + priv->tail;
+  const gchar *p = data;
+  gssize content_length = -1;
+
+  *message = NULL;
+  *use_gvariant = FALSE;
+  priv->needed = 0;
+
+  if (priv->body_remaining > 0)
+    {
+      FrameResult res = jsonrpc_input_stream_receive_body (self, offload, message, error);
+
+      if (res != FRAME_COMPLETE)
+        return res;
+
+      /* skipped notification, continue with the next message */
+      if (priv->spill_mapped == NULL && *message == NULL)
+        return jsonrpc_input_stream_try_frame (self, offload, message, use_gvariant, error);
+
+      if (*message != NULL)
+        return FRAME_COMPLETE;
+    }
+
+  if (priv->spill_mapped != NULL)
+    {
+      const gchar *contents = g_mapped_file_get_contents (priv->spill_mapped);
+      gsize length = g_mapped_file_get_length (priv->spill_mapped);
+
+      if (offload != NULL)
+        {
+          offload->body = contents;
+          offload->body_len = length;
+          offload->frame_len = 0;
+          offload->spilled = TRUE;
+          return FRAME_DECODE_IN_THREAD;
+        }
+
+      *message = jsonrpc_input_stream_decode_body (contents, length, FALSE, NULL, error);
+      jsonrpc_input_stream_release_spill (self);
+
+      return *message != NULL ? FRAME_COMPLETE : FRAME_ERROR;
+    }
+
+  /* recomputed below, head moved while receiving the body */
+  data = priv->buffer + priv->head;
+  end = priv->buffer + priv->tail;
+  p = data;
+
+  if (priv->head == priv->tail)
+    return FRAME_INCOMPLETE;
+
+  for (;;)
+    {
+      const gchar *eol = memchr (p, '\n', end - p);
+      gsize line_len;
+
+      if (eol == NULL)
+        {
+          if (end - data > MAX_HEADER_SIZE)
+            {
+              g_set_error (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_DATA,
+                           "Invalid headers received from peer");
+              return FRAME_ERROR;
+            }
+
+          return FRAME_INCOMPLETE;
+        }
+
+      line_len = eol - p;
+      if (line_len > 0 && p[line_len - 1] == '\r')
+        line_len--;
+
+      /*
+       * If we are at the end of the headers, we can make progress towards
+       * parsing the JSON content. Otherwise we need to continue parsing
+       * the next header.
+       */
+      if (line_len == 0)
+        {
+          p = eol + 1;
+          break;
+        }
+
+      if (line_len >= 16 && g_ascii_strncasecmp ("Content-Length: ", p, 16) == 0)
+        {
+          if (!jsonrpc_input_stream_parse_content_length (p + 16, line_len - 16,
+                                                          G_MAXSSIZE / 16,
+                                                          &content_length))
+            {
+              g_set_error (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_DATA,
+                           "Invalid Content-Length received from peer");
+              return FRAME_ERROR;
+            }
+        }
+      else if (line_len >= 14 && g_ascii_strncasecmp ("Content-Type: ", p, 14) == 0)
+        {
+          if (g_strstr_len (p, line_len, "application/gvariant") != NULL)
+            *use_gvariant = TRUE;
+        }
+      else if (line_len >= 17 && g_ascii_strncasecmp ("X-GVariant-Type: ", p, 17) == 0)
+        {
+          g_free (gvariant_type);
+          gvariant_type = g_strndup (p + 17, line_len - 17);
+
+          if (!g_variant_type_string_is_valid (gvariant_type))
+            {
+              g_set_error (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_DATA,
+                           "Invalid X-GVariant-Type received from peer");
+              return FRAME_ERROR;
+            }
+        }
+
+      p = eol + 1;
+    }
+
+  if (content_length <= 0)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVALID_DATA,
+                   "Invalid or missing Content-Length header from peer");
+      return FRAME_ERROR;
+    }
+
+  /* Too large messages are skipped instead of failing the whole
+   * connection, huge ones are stored outside of the framing buffer */
+  if (content_length > priv->max_size_bytes ||
+      (content_length >= SPILL_SIZE && !*use_gvariant))
+    {
+      priv->head += p - data;
+      priv->body_remaining = content_length;
+
+      if (content_length > priv->max_size_bytes)
+        {
+          g_warning ("Skipping message of %"G_GSSIZE_FORMAT" bytes exceeding the maximum message size",
+                     content_length);
+          jsonrpc_input_stream_start_skip (self);
+        }
+      else if (!jsonrpc_input_stream_start_spill (self, error))
+        {
+          jsonrpc_input_stream_start_skip (self);
+          return FRAME_ERROR;
+        }
+
+      return jsonrpc_input_stream_try_frame (self, offload, message, use_gvariant, error);
+    }
+
+  if (end - p < content_length)
+    {
+      priv->needed = (p - data) + content_length;
+      return FRAME_INCOMPLETE;
+    }
+
+  if (offload != NULL && !*use_gvariant && content_length >= THREADED_DECODE_SIZE)
+    {
+      offload->body = p;
+      offload->body_len = content_length;
+      offload->frame_len = (p - data) + content_length;
+      return FRAME_DECODE_IN_THREAD;
+    }
+
+  *message = jsonrpc_input_stream_decode_body (p, content_length, *use_gvariant,
+                                               gvariant_type, error);
+  if (*message == NULL)
+    return FRAME_ERROR;
+
+  jsonrpc_input_stream_consume (self, (p - data) + content_length);
+
+  return FRAME_COMPLETE;
 }
 
 static void
-jsonrpc_input_stream_init (JsonrpcInputStream *self)
+jsonrpc_input_stream_consume (JsonrpcInputStream *self,
+                              gsize               frame_len)
 {
   JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
 
-  /* 16 MB */
-  priv->max_size_bytes = 16 * 1024 * 1024;
+  priv->head += frame_len;
 
-  g_data_input_stream_set_newline_type (G_DATA_INPUT_STREAM (self),
-                                        G_DATA_STREAM_NEWLINE_TYPE_ANY);
+  if (priv->head == priv->tail)
+    {
+      priv->head = priv->tail = 0;
+
+      if (priv->buffer_size > MAX_IDLE_BUFFER_SIZE)
+        {
+          g_clear_pointer (&priv->buffer, g_free);
+          priv->buffer_size = 0;
+        }
+    }
 }
 
-JsonrpcInputStream *
-jsonrpc_input_stream_new (GInputStream *base_stream)
+static void
+jsonrpc_input_stream_reserve (JsonrpcInputStream *self)
 {
-  return g_object_new (JSONRPC_TYPE_INPUT_STREAM,
-                       "base-stream", base_stream,
-                       NULL);
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  gsize size;
+
+  /* move the partial message to the front */
+  if (priv->head > 0)
+    {
+      memmove (priv->buffer, priv->buffer + priv->head, priv->tail - priv->head);
+      priv->tail -= priv->head;
+      priv->head = 0;
+    }
+
+  size = MAX (priv->needed, priv->tail + READ_CHUNK_SIZE);
+
+  if (size > priv->buffer_size)
+    {
+      priv->buffer = g_realloc (priv->buffer, size);
+      priv->buffer_size = size;
+    }
 }
 
 static void
-jsonrpc_input_stream_read_body_cb (GObject      *object,
-                                   GAsyncResult *result,
-                                   gpointer      user_data)
+jsonrpc_input_stream_read_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
 {
-  JsonrpcInputStream *self = (JsonrpcInputStream *)object;
+  GInputStream *base_stream = (GInputStream *)object;
   g_autoptr(GTask) task = user_data;
   g_autoptr(GError) error = NULL;
-  g_autoptr(GVariant) message = NULL;
-  ReadState *state;
-  gsize n_read;
+  JsonrpcInputStream *self;
+  JsonrpcInputStreamPrivate *priv;
+  gssize n_read;
 
-  g_assert (JSONRPC_IS_INPUT_STREAM (self));
+  g_assert (G_IS_INPUT_STREAM (base_stream));
   g_assert (G_IS_TASK (task));
 
-  state = g_task_get_task_data (task);
+  self = g_task_get_source_object (task);
+  priv = jsonrpc_input_stream_get_instance_private (self);
 
-  if (!g_input_stream_read_all_finish (G_INPUT_STREAM (self), result, &n_read, &error))
+  n_read = g_input_stream_read_finish (base_stream, result, &error);
+
+  if (n_read < 0)
     {
       g_task_return_error (task, g_steal_pointer (&error));
       return;
     }
 
-  if ((gssize)n_read != state->content_length)
+  if (n_read == 0)
     {
       g_task_return_new_error (task,
                                G_IO_ERROR,
-                               G_IO_ERROR_INVALID_DATA,
-                               "Failed to read %"G_GSSIZE_FORMAT" bytes",
-                               state->content_length);
+                               G_IO_ERROR_FAILED,
+                               "No data to read from peer");
       return;
     }
 
-  state->buffer [state->content_length] = '\0';
-
-  if G_UNLIKELY (jsonrpc_input_stream_debug && state->use_gvariant == FALSE)
-    g_message ("<<< %s", state->buffer);
+  priv->tail += n_read;
 
-  if (state->use_gvariant)
-    {
-      g_autoptr(GBytes) bytes = NULL;
-
-      bytes = g_bytes_new_take (g_steal_pointer (&state->buffer), state->content_length);
-      message = g_variant_new_from_bytes (state->gvariant_type ?  state->gvariant_type
-                                                               : G_VARIANT_TYPE_VARDICT,
-                                          bytes, FALSE);
+  jsonrpc_input_stream_process (g_steal_pointer (&task));
+}
 
-      if G_UNLIKELY (jsonrpc_input_stream_debug && state->use_gvariant)
-        {
-          g_autofree gchar *debugstr = g_variant_print (message, TRUE);
-          g_message ("<<< %s", debugstr);
-        }
-    }
-  else
-    {
-      message = json_gvariant_deserialize_data (state->buffer, state->content_length, NULL, &error);
-      g_clear_pointer (&state->buffer, g_free);
-    }
+static void
+jsonrpc_input_stream_decode_worker (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+  ReadState *state = task_data;
+  GError *error = NULL;
+  GVariant *message;
 
-  g_assert (state->buffer == NULL);
-  g_assert (message != NULL || error != NULL);
+  message = jsonrpc_input_stream_decode_body (state->body, state->body_len, FALSE, NULL, &error);
 
-  /* Don't let message be floating */
   if (message != NULL)
-    g_variant_take_ref (message);
-
-  if (error != NULL)
-    g_task_return_error (task, g_steal_pointer (&error));
+    g_task_return_pointer (task, message, (GDestroyNotify)g_variant_unref);
   else
-    g_task_return_pointer (task,
-                           g_steal_pointer (&message),
-                           (GDestroyNotify)g_variant_unref);
+    g_task_return_error (task, error);
 }
 
 static void
-jsonrpc_input_stream_read_headers_cb (GObject      *object,
-                                      GAsyncResult *result,
-                                      gpointer      user_data)
+jsonrpc_input_stream_decode_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
 {
   JsonrpcInputStream *self = (JsonrpcInputStream *)object;
-  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
   g_autoptr(GTask) task = user_data;
   g_autoptr(GError) error = NULL;
-  g_autofree gchar *line = NULL;
-  GCancellable *cancellable = NULL;
-  ReadState *state;
-  gsize length = 0;
+  ReadState *state = g_task_get_task_data (task);
+  GVariant *message;
 
   g_assert (JSONRPC_IS_INPUT_STREAM (self));
-  g_assert (G_IS_ASYNC_RESULT (result));
   g_assert (G_IS_TASK (task));
 
-  state = g_task_get_task_data (task);
-  cancellable = g_task_get_cancellable (task);
+  message = g_task_propagate_pointer (G_TASK (result), &error);
 
-  line = g_data_input_stream_read_line_finish_utf8 (G_DATA_INPUT_STREAM (self), result, &length, &error);
+  if (state->spilled)
+    jsonrpc_input_stream_release_spill (self);
+  else if (message != NULL)
+    jsonrpc_input_stream_consume (self, state->frame_len);
+  state->body = NULL;
+  state->spilled = FALSE;
 
-  if (line == NULL)
+  if (message == NULL)
     {
-      if (error != NULL)
-        g_task_return_error (task, g_steal_pointer (&error));
-      else
-        g_task_return_new_error (task,
-                                 G_IO_ERROR,
-                                 G_IO_ERROR_FAILED,
-                                 "No data to read from peer");
+      g_task_return_error (task, g_steal_pointer (&error));
       return;
     }
 
-  if (strncasecmp ("Content-Length: ", line, 16) == 0)
-    {
-      const gchar *lenptr = line + 16;
-      gint64 content_length;
+  g_task_return_pointer (task, message, (GDestroyNotify)g_variant_unref);
+}
 
-      content_length = g_ascii_strtoll (lenptr, NULL, 10);
+static void
+jsonrpc_input_stream_spill_worker (GTask        *task,
+                                   gpointer      source_object,
+                                   gpointer      task_data,
+                                   GCancellable *cancellable)
+{
+  JsonrpcInputStream *self = source_object;
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  ReadState *state = task_data;
+  GError *error = NULL;
 
-      if (((content_length == G_MININT64 || content_length == G_MAXINT64) && errno == ERANGE) ||
-          (content_length < 0) ||
-          (content_length == G_MAXSSIZE) ||
-          (content_length > priv->max_size_bytes))
-        {
-          g_task_return_new_error (task,
-                                   G_IO_ERROR,
-                                   G_IO_ERROR_INVALID_DATA,
-                                   "Invalid Content-Length received from peer");
-          return;
-        }
+  if (g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (priv->spill_stream)),
+                                 state->body, state->body_len, NULL, NULL, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
 
-      state->content_length = content_length;
-    }
+static void
+jsonrpc_input_stream_spill_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  JsonrpcInputStream *self = (JsonrpcInputStream *)object;
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  GTask *task = user_data;
+  g_autoptr(GError) error = NULL;
+  ReadState *state = g_task_get_task_data (task);
+  gsize n = state->body_len;
 
-  if (strncasecmp ("Content-Type: ", line, 14) == 0)
-    {
-      if (NULL != strstr (line, "application/gvariant"))
-        state->use_gvariant = TRUE;
-    }
+  g_assert (JSONRPC_IS_INPUT_STREAM (self));
+  g_assert (G_IS_TASK (task));
 
-  if (strncasecmp ("X-GVariant-Type: ", line, 17) == 0)
+  state->body = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
     {
-      const gchar *type_string = line + 17;
+      /* put the rest of the body to the bin */
+      jsonrpc_input_stream_start_skip (self);
+      jsonrpc_input_stream_release_spill (self);
+      g_task_return_error (task, g_steal_pointer (&error));
+      g_object_unref (task);
+      return;
+    }
 
-      if (!g_variant_type_string_is_valid (type_string))
-        {
-          g_task_return_new_error (task,
-                                   G_IO_ERROR,
-                                   G_IO_ERROR_INVALID_DATA,
-                                   "Invalid X-GVariant-Type received from peer");
-          return;
-        }
+  priv->body_remaining -= n;
+  jsonrpc_input_stream_consume (self, n);
 
-      g_clear_pointer (&state->gvariant_type, g_free);
-      state->gvariant_type = (GVariantType *)g_strdup (type_string);
-    }
+  jsonrpc_input_stream_process (task);
+}
 
-  /*
-   * If we are at the end of the headers, we can make progress towards
-   * parsing the JSON content. Otherwise we need to continue parsing
-   * the next header.
-   */
+static void
+jsonrpc_input_stream_process (GTask *task)
+{
+  JsonrpcInputStream *self = g_task_get_source_object (task);
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  ReadState *state = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+  GVariant *message = NULL;
+  gboolean use_gvariant = FALSE;
+  GInputStream *base_stream;
 
-  if (line[0] == '\0')
+  switch (jsonrpc_input_stream_try_frame (self, state, &message, &use_gvariant, &error))
     {
-      if (state->content_length <= 0)
-        {
-          g_task_return_new_error (task,
-                                   G_IO_ERROR,
-                                   G_IO_ERROR_INVALID_DATA,
-                                   "Invalid or missing Content-Length header from peer");
-          return;
-        }
+    case FRAME_DECODE_IN_THREAD:
+      {
+        GTask *decode_task = g_task_new (self, NULL, jsonrpc_input_stream_decode_cb, task);
+
+        /* the framing buffer isn't touched until the decoding finishes as
+         * no other read is issued before the read task completes */
+        g_task_set_task_data (decode_task, state, NULL);
+        g_task_run_in_thread (decode_task, jsonrpc_input_stream_decode_worker);
+        g_object_unref (decode_task);
+      }
+      return;
+
+    case FRAME_SPILL_IN_THREAD:
+      {
+        GTask *spill_task = g_task_new (self, NULL, jsonrpc_input_stream_spill_cb, task);
+
+        /* like for decoding, the framing buffer stays untouched until the
+         * received part of the body is written */
+        g_task_set_task_data (spill_task, state, NULL);
+        g_task_run_in_thread (spill_task, jsonrpc_input_stream_spill_worker);
+        g_object_unref (spill_task);
+      }
+      return;
 
-      state->buffer = g_malloc (state->content_length + 1);
-      g_input_stream_read_all_async (G_INPUT_STREAM (self),
-                                     state->buffer,
-                                     state->content_length,
-                                     state->priority,
-                                     cancellable,
-                                     jsonrpc_input_stream_read_body_cb,
-                                     g_steal_pointer (&task));
+    case FRAME_COMPLETE:
+      state->use_gvariant = use_gvariant;
+      g_task_return_pointer (task, message, (GDestroyNotify)g_variant_unref);
+      g_object_unref (task);
       return;
+
+    case FRAME_ERROR:
+      g_task_return_error (task, g_steal_pointer (&error));
+      g_object_unref (task);
+      return;
+
+    case FRAME_INCOMPLETE:
+    default:
+      break;
     }
 
-  g_data_input_stream_read_line_async (G_DATA_INPUT_STREAM (self),
-                                       state->priority,
-                                       cancellable,
-                                       jsonrpc_input_stream_read_headers_cb,
-                                       g_steal_pointer (&task));
+  jsonrpc_input_stream_reserve (self);
+
+  base_stream = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (self));
+  g_input_stream_read_async (base_stream,
+                             priv->buffer + priv->tail,
+                             priv->buffer_size - priv->tail,
+                             state->priority,
+                             g_task_get_cancellable (task),
+                             jsonrpc_input_stream_read_cb,
+                             task);
 }
 
+/*
+ * Headers and bodies of all messages are parsed from a single framing
+ * buffer so a burst of small messages arriving in one read is handled
+ * without any further reads from the peer.
+ */
 void
 jsonrpc_input_stream_read_message_async (JsonrpcInputStream  *self,
                                          GCancellable        *cancellable,
                                          GAsyncReadyCallback  callback,
                                          gpointer             user_data)
 {
-  g_autoptr(GTask) task = NULL;
+  GTask *task;
   ReadState *state;
 
   g_return_if_fail (JSONRPC_IS_INPUT_STREAM (self));
   g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
   state = g_slice_new0 (ReadState);
-  state->content_length = -1;
   state->priority = G_PRIORITY_LOW;
 
   task = g_task_new (self, cancellable, callback, user_data);
@@ -292,11 +1623,7 @@ jsonrpc_input_stream_read_message_async (JsonrpcInputStream  *self,
   g_task_set_task_data (task, state, read_state_free);
   g_task_set_priority (task, state->priority);
 
-  g_data_input_stream_read_line_async (G_DATA_INPUT_STREAM (self),
-                                       state->priority,
-                                       cancellable,
-                                       jsonrpc_input_stream_read_headers_cb,
-                                       g_steal_pointer (&task));
+  jsonrpc_input_stream_process (task);
 }
 
 gboolean
@@ -387,6 +1714,61 @@ jsonrpc_input_stream_read_message (JsonrpcInputStream  *self,
   return ret;
 }
 
+/**
+ * jsonrpc_input_stream_set_max_message_size:
+ * @self: a #JsonrpcInputStream
+ * @max_size: maximum size of a message body in bytes
+ *
+ * Messages larger than @max_size are skipped; if the request they reply to
+ * can be determined, it fails with an error.
+ *
+ * The default is %JSONRPC_INPUT_STREAM_DEFAULT_MAX_MESSAGE_SIZE.
+ */
+void
+jsonrpc_input_stream_set_max_message_size (JsonrpcInputStream *self,
+                                           gsize               max_size)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+
+  g_return_if_fail (JSONRPC_IS_INPUT_STREAM (self));
+
+  priv->max_size_bytes = MIN (max_size, G_MAXSSIZE / 16);
+}
+
+/**
+ * jsonrpc_input_stream_get_decode_statistics:
+ * @n_messages: (out) (optional): location for the number of decoded JSON messages
+ * @n_bytes: (out) (optional): location for their total size in bytes
+ * @n_variants: (out) (optional): location for the number of #GVariant
+ *   instances created while decoding them
+ * @usec: (out) (optional): location for the total decoding time in microseconds
+ *
+ * Gets totals of the JSON messages decoded by all the input streams of the
+ * process so the throughput of the conversion to #GVariant can be measured
+ * on real traffic.
+ */
+void
+jsonrpc_input_stream_get_decode_statistics (guint64 *n_messages,
+                                            guint64 *n_bytes,
+                                            guint64 *n_variants,
+                                            gint64  *usec)
+{
+  JsonrpcDecodeStatistics stats;
+
+  G_LOCK (decode_statistics);
+  stats = decode_statistics;
+  G_UNLOCK (decode_statistics);
+
+  if (n_messages)
+    *n_messages = stats.n_messages;
+  if (n_bytes)
+    *n_bytes = stats.n_bytes;
+  if (n_variants)
+    *n_variants = stats.n_variants;
+  if (usec)
+    *usec = stats.usec;
+}
+
 gboolean
 _jsonrpc_input_stream_get_has_seen_gvariant (JsonrpcInputStream *self)
 {
@@ -396,3 +1778,40 @@ _jsonrpc_input_stream_get_has_seen_gvariant (JsonrpcInputStream *self)
 
   return priv->has_seen_gvariant;
 }
+
+/*
+ * Takes the next message if it is already complete in the framing buffer
+ * so callers can dispatch a whole burst of messages at once. Returns FALSE
+ * if a read from the peer is needed (or the buffered data is invalid, which
+ * is then reported by the next jsonrpc_input_stream_read_message_async()).
+ */
+gboolean
+_jsonrpc_input_stream_take_buffered_message (JsonrpcInputStream  *self,
+                                             GVariant           **message)
+{
+  JsonrpcInputStreamPrivate *priv = jsonrpc_input_stream_get_instance_private (self);
+  g_autoptr(GVariant) local_message = NULL;
+  ReadState offload = { 0, };
+  gboolean use_gvariant = FALSE;
+
+  g_return_val_if_fail (JSONRPC_IS_INPUT_STREAM (self), FALSE);
+  g_return_val_if_fail (message != NULL, FALSE);
+
+  if (priv->head == priv->tail)
+    return FALSE;
+
+  /* large messages are left to the read path which spills and decodes them
+   * in threads */
+  if (jsonrpc_input_stream_try_frame (self, &offload, &local_message, &use_gvariant, NULL) != FRAME_COMPLETE)
+    return FALSE;
+
+  priv->has_seen_gvariant |= use_gvariant;
+
+  /* Unbox the variant if it is in a wrapper */
+  if (g_variant_is_of_type (local_message, G_VARIANT_TYPE_VARIANT))
+    *message = g_variant_get_variant (local_message);
+  else
+    *message = g_steal_pointer (&local_message);
+
+  return TRUE;
+}
@@ -27,6 +27,9 @@ G_BEGIN_DECLS
 
 #define JSONRPC_TYPE_INPUT_STREAM (jsonrpc_input_stream_get_type())
 
+/* Default for jsonrpc_input_stream_set_max_message_size() */
+#define JSONRPC_INPUT_STREAM_DEFAULT_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
 JSONRPC_AVAILABLE_IN_3_26
 G_DECLARE_DERIVABLE_TYPE (JsonrpcInputStream, jsonrpc_input_stream, JSONRPC, INPUT_STREAM, GDataInputStream)
 
@@ -62,6 +65,15 @@ gboolean            jsonrpc_input_stream_read_message_finish (JsonrpcInputStream
                                                               GVariant            **message,
                                                               GError              **error);
 
+JSONRPC_AVAILABLE_IN_3_44
+void                jsonrpc_input_stream_set_max_message_size (JsonrpcInputStream  *self,
+                                                               gsize                max_size);
+JSONRPC_AVAILABLE_IN_3_44
+void                jsonrpc_input_stream_get_decode_statistics (guint64            *n_messages,
+                                                                guint64            *n_bytes,
+                                                                guint64            *n_variants,
+                                                                gint64             *usec);
+
 G_END_DECLS
 
 #endif /* JSONRPC_INPUT_STREAM_H */
@@ -675,3 +675,155 @@ jsonrpc_message_parse (GVariant *message,
 
   return ret;
 }
+
+#define MAX_MEMBERS 16
+
+static gboolean
+jsonrpc_message_get_member (GVariant          *value,
+                            JsonrpcMessageAny *valptr)
+{
+  gboolean ret = FALSE;
+
+  if (IS_GET_VARIANT (valptr))
+    {
+      GVariant *child = NULL;
+
+      if (g_variant_is_of_type (value, G_VARIANT_TYPE_VARIANT) &&
+          (child = g_variant_get_variant (value)) &&
+          g_variant_is_of_type (child, G_VARIANT_TYPE ("a{sv}")))
+        *((JsonrpcMessageGetVariant *)valptr)->variantptr = child;
+      else
+        {
+          g_clear_pointer (&child, g_variant_unref);
+          *((JsonrpcMessageGetVariant *)valptr)->variantptr = g_variant_ref (value);
+        }
+      ret = TRUE;
+    }
+  else if (IS_GET_STRING (valptr))
+    {
+      /* Safe to get data pointer because @value is a sub-variant of the
+       * message and therefore shares raw data */
+      if (g_variant_is_of_type (value, G_VARIANT_TYPE ("s")))
+        {
+          *((JsonrpcMessageGetString *)valptr)->valptr = g_variant_get_string (value, NULL);
+          ret = TRUE;
+        }
+      else if (g_variant_is_of_type (value, G_VARIANT_TYPE ("mv")) ||
+               g_variant_is_of_type (value, G_VARIANT_TYPE ("ms")))
+        {
+          *((JsonrpcMessageGetString *)valptr)->valptr = NULL;
+          ret = TRUE;
+        }
+    }
+  else if (IS_GET_DICT (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE ("a{sv}"))))
+        *((JsonrpcMessageGetDict *)valptr)->dictptr = g_variant_dict_new (value);
+    }
+  else if (IS_GET_ITER (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE ("av")) ||
+                 g_variant_is_of_type (value, G_VARIANT_TYPE ("a{sv}"))))
+        *((JsonrpcMessageGetIter *)valptr)->iterptr = g_variant_iter_new (value);
+    }
+  else if (IS_GET_INT32 (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE_INT32)))
+        *((JsonrpcMessageGetInt32 *)valptr)->valptr = g_variant_get_int32 (value);
+    }
+  else if (IS_GET_INT64 (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE_INT64)))
+        *((JsonrpcMessageGetInt64 *)valptr)->valptr = g_variant_get_int64 (value);
+    }
+  else if (IS_GET_BOOLEAN (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN)))
+        *((JsonrpcMessageGetBoolean *)valptr)->valptr = g_variant_get_boolean (value);
+    }
+  else if (IS_GET_DOUBLE (valptr))
+    {
+      if ((ret = g_variant_is_of_type (value, G_VARIANT_TYPE_DOUBLE)))
+        *((JsonrpcMessageGetDouble *)valptr)->valptr = g_variant_get_double (value);
+    }
+  else
+    g_error ("jsonrpc_message_parse_members() supports only JSONRPC_MESSAGE_GET_*() values");
+
+  return ret;
+}
+
+/**
+ * jsonrpc_message_parse_members:
+ * @message: a #GVariant of type a{sv}, possibly boxed in a variant
+ *
+ * Extracts several top-level members of @message in a single walk over its
+ * entries. The arguments are pairs of a member name and one of the
+ * JSONRPC_MESSAGE_GET_*() destinations, terminated by %NULL.
+ *
+ * Unlike jsonrpc_message_parse(), which builds a #GVariantDict of the whole
+ * message for every call and stops at the first missing member, every member
+ * is optional here — destinations of members that are missing or of another
+ * type are left untouched.
+ *
+ * Returns: the number of extracted members
+ */
+guint
+jsonrpc_message_parse_members (GVariant *message,
+                               ...)
+{
+  g_autoptr(GVariant) unboxed = NULL;
+  const gchar *keys[MAX_MEMBERS];
+  JsonrpcMessageAny *valptrs[MAX_MEMBERS];
+  guint n_keys = 0;
+  guint n_found = 0;
+  guint32 pending = 0;
+  const gchar *key;
+  GVariantIter iter;
+  GVariant *value;
+  va_list args;
+
+  va_start (args, message);
+  while ((key = va_arg (args, const gchar *)))
+    {
+      if (n_keys == MAX_MEMBERS)
+        g_error ("jsonrpc_message_parse_members() accepts at most %d members", MAX_MEMBERS);
+      keys[n_keys] = key;
+      valptrs[n_keys] = va_arg (args, gpointer);
+      if (valptrs[n_keys] == NULL)
+        g_error ("got unexpected NULL for key %s", key);
+      pending |= 1u << n_keys;
+      n_keys++;
+    }
+  va_end (args);
+
+  if (message == NULL)
+    return 0;
+
+  if (g_variant_is_of_type (message, G_VARIANT_TYPE_VARIANT))
+    message = unboxed = g_variant_get_variant (message);
+
+  if (!g_variant_is_of_type (message, G_VARIANT_TYPE ("a{sv}")))
+    return 0;
+
+  g_variant_iter_init (&iter, message);
+  while (pending != 0 && g_variant_iter_next (&iter, "{&sv}", &key, &value))
+    {
+      guint i;
+
+      for (i = 0; i < n_keys; i++)
+        {
+          if ((pending & (1u << i)) && strcmp (keys[i], key) == 0)
+            {
+              /* the first member of the name wins, later duplicates are skipped */
+              pending &= ~(1u << i);
+              if (jsonrpc_message_get_member (value, valptrs[i]))
+                n_found++;
+              break;
+            }
+        }
+
+      g_variant_unref (value);
+    }
+
+  return n_found;
+}
@@ -176,6 +176,8 @@ typedef struct
   jsonrpc_message_parse(message,  __VA_ARGS__, NULL)
 #define JSONRPC_MESSAGE_PARSE_ARRAY(iter, ...) \
   jsonrpc_message_parse_array(iter, __VA_ARGS__, NULL)
+#define JSONRPC_MESSAGE_PARSE_MEMBERS(message, ...) \
+  jsonrpc_message_parse_members(message, __VA_ARGS__, NULL)
 
 #define JSONRPC_MESSAGE_PUT_STRING(_val) \
   (&((JsonrpcMessagePutString) { .magic = {_JSONRPC_MESSAGE_PUT_STRING_MAGIC_C}, .val = _val }))
@@ -230,6 +232,9 @@ gboolean  jsonrpc_message_parse       (GVariant *message, ...) G_GNUC_NULL_TERMI
 JSONRPC_AVAILABLE_IN_3_26
 gboolean  jsonrpc_message_parse_array (GVariantIter *iter, ...) G_GNUC_NULL_TERMINATED;
 
+JSONRPC_AVAILABLE_IN_3_44
+guint     jsonrpc_message_parse_members (GVariant *message, ...) G_GNUC_NULL_TERMINATED;
+
 G_END_DECLS
 
 #endif /* JSONRPC_MESSAGE_H */
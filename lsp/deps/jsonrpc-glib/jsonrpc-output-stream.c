@@ -22,6 +22,12 @@
 
 #include <string.h>
 
+#if defined (__SSE2__)
+# include <emmintrin.h>
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #include "jsonrpc-output-stream.h"
 #include "jsonrpc-version.h"
 
@@ -51,6 +57,8 @@
 typedef struct
 {
   GQueue queue;
+  /* bytes queued or being written */
+  gsize  pending_size;
   guint  use_gvariant : 1;
   guint  processing : 1;
 } JsonrpcOutputStreamPrivate;
@@ -149,6 +157,414 @@ jsonrpc_output_stream_init (JsonrpcOutputStream *self)
   g_queue_init (&priv->queue);
 }
 
+/* Space reserved in front of the message body for the Content-Length header
+ * so the header can be filled in once the body length is known without
+ * moving the body around. Header and body then go out in a single write. */
+#define HEADER_RESERVE 64
+
+typedef struct
+{
+  GByteArray  *buffer;
+  const gchar *text;
+  gsize        text_len;
+  guint        text_written : 1;
+  guint64      n_variants;  /* visited while writing, reported in the statistics */
+} JsonrpcJsonWriter;
+
+/* Totals of the JSON bodies created by all the streams */
+typedef struct
+{
+  guint64 n_messages;
+  guint64 n_bytes;
+  guint64 n_variants;
+  gint64  usec;
+} JsonrpcEncodeStatistics;
+
+G_LOCK_DEFINE_STATIC (encode_statistics);
+static JsonrpcEncodeStatistics encode_statistics;
+
+static inline void
+jsonrpc_json_writer_append (JsonrpcJsonWriter *writer,
+                            const gchar       *str,
+                            gsize              len)
+{
+  g_byte_array_append (writer->buffer, (const guint8 *)str, len);
+}
+
+#define NEEDS_ESCAPE(c) ((c) < 0x20 || (c) == '"' || (c) == '\\' || (c) == 0x7f)
+
+/*
+ * Index of the first character needing an escape in text[i..text_len),
+ * text_len if none. Document texts of didOpen and didChange rarely contain
+ * anything but newlines and quotes so SSE2 or NEON checks 16 bytes at once.
+ */
+static inline gsize
+jsonrpc_output_stream_find_escape (const gchar *text,
+                                   gsize        i,
+                                   gsize        text_len)
+{
+#if defined (__SSE2__)
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i del = _mm_set1_epi8 (0x7f);
+  const __m128i max_control = _mm_set1_epi8 (0x1F);
+
+  while (text_len - i >= 16)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *)(text + i));
+      __m128i special = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (chunk, quote),
+                                                    _mm_cmpeq_epi8 (chunk, backslash)),
+                                      _mm_or_si128 (_mm_cmpeq_epi8 (chunk, del),
+                                                    /* unsigned chunk <= 0x1F */
+                                                    _mm_cmpeq_epi8 (_mm_min_epu8 (chunk, max_control), chunk)));
+      gint mask = _mm_movemask_epi8 (special);
+
+      if (mask != 0)
+        return i + g_bit_nth_lsf (mask, -1);
+
+      i += 16;
+    }
+#elif defined (__aarch64__) && defined (__ARM_NEON)
+  const uint8x16_t quote = vdupq_n_u8 ('"');
+  const uint8x16_t backslash = vdupq_n_u8 ('\\');
+  const uint8x16_t del = vdupq_n_u8 (0x7f);
+  const uint8x16_t space = vdupq_n_u8 (0x20);
+
+  while (text_len - i >= 16)
+    {
+      uint8x16_t chunk = vld1q_u8 ((const guint8 *)text + i);
+      uint8x16_t special = vorrq_u8 (vorrq_u8 (vceqq_u8 (chunk, quote),
+                                               vceqq_u8 (chunk, backslash)),
+                                     vorrq_u8 (vceqq_u8 (chunk, del),
+                                               vcltq_u8 (chunk, space)));
+
+      /* the exact position is found below */
+      if (vmaxvq_u8 (special) != 0)
+        break;
+
+      i += 16;
+    }
+#endif
+
+  while (i < text_len && !NEEDS_ESCAPE ((guchar)text[i]))
+    i++;
+
+  return i;
+}
+
+static void
+jsonrpc_output_stream_append_escaped (GByteArray  *buffer,
+                                      const gchar *text,
+                                      gsize        text_len)
+{
+  static const gchar hex[] = "0123456789abcdef";
+  gsize start = 0;
+  gsize i;
+
+  for (i = 0; (i = jsonrpc_output_stream_find_escape (text, i, text_len)) < text_len; i++)
+    {
+      guchar c = (guchar)text[i];
+      const gchar *esc;
+      gchar ubuf[6];
+
+      /* copy the run of characters which need no escaping in one go */
+      if (i > start)
+        g_byte_array_append (buffer, (const guint8 *)text + start, i - start);
+      start = i + 1;
+
+      switch (c)
+        {
+        case '"':  esc = "\\\""; break;
+        case '\\': esc = "\\\\"; break;
+        case '\b': esc = "\\b"; break;
+        case '\f': esc = "\\f"; break;
+        case '\n': esc = "\\n"; break;
+        case '\r': esc = "\\r"; break;
+        case '\t': esc = "\\t"; break;
+        default:
+          ubuf[0] = '\\';
+          ubuf[1] = 'u';
+          ubuf[2] = '0';
+          ubuf[3] = '0';
+          ubuf[4] = hex[c >> 4];
+          ubuf[5] = hex[c & 0xf];
+          g_byte_array_append (buffer, (const guint8 *)ubuf, sizeof ubuf);
+          continue;
+        }
+
+      g_byte_array_append (buffer, (const guint8 *)esc, 2);
+    }
+
+  if (i > start)
+    g_byte_array_append (buffer, (const guint8 *)text + start, i - start);
+}
+
+static void
+jsonrpc_json_writer_append_string (JsonrpcJsonWriter *writer,
+                                   const gchar       *str,
+                                   gsize              len)
+{
+  jsonrpc_json_writer_append (writer, "\"", 1);
+
+  if (writer->text != NULL &&
+      !writer->text_written &&
+      strcmp (str, JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER) == 0)
+    {
+      jsonrpc_output_stream_append_escaped (writer->buffer, writer->text, writer->text_len);
+      writer->text_written = TRUE;
+    }
+  else
+    jsonrpc_output_stream_append_escaped (writer->buffer, str, len);
+
+  jsonrpc_json_writer_append (writer, "\"", 1);
+}
+
+static void
+jsonrpc_json_writer_append_int (JsonrpcJsonWriter *writer,
+                                gint64             value)
+{
+  /* positions and versions are formatted without the printf machinery */
+  gchar buf[24];
+  gchar *p = buf + sizeof buf;
+  guint64 abs_value = value < 0 ? -(guint64)value : (guint64)value;
+
+  do
+    {
+      *--p = '0' + abs_value % 10;
+      abs_value /= 10;
+    }
+  while (abs_value != 0);
+
+  if (value < 0)
+    *--p = '-';
+
+  jsonrpc_json_writer_append (writer, p, buf + sizeof buf - p);
+}
+
+static void
+jsonrpc_json_writer_append_double (JsonrpcJsonWriter *writer,
+                                   gdouble            value)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_ascii_dtostr (buf, sizeof buf, value);
+  jsonrpc_json_writer_append (writer, buf, strlen (buf));
+
+  /* ensure doubles don't become ints */
+  if (strpbrk (buf, ".eE") == NULL)
+    jsonrpc_json_writer_append (writer, ".0", 2);
+}
+
+static void jsonrpc_json_writer_append_value (JsonrpcJsonWriter *writer,
+                                              GVariant          *value);
+
+static void
+jsonrpc_json_writer_append_member (JsonrpcJsonWriter *writer,
+                                   GVariant          *entry)
+{
+  g_autoptr(GVariant) key = g_variant_get_child_value (entry, 0);
+  g_autoptr(GVariant) value = g_variant_get_child_value (entry, 1);
+
+  if (g_variant_is_of_type (key, G_VARIANT_TYPE_STRING))
+    {
+      gsize len;
+      const gchar *str = g_variant_get_string (key, &len);
+
+      jsonrpc_json_writer_append (writer, "\"", 1);
+      jsonrpc_output_stream_append_escaped (writer->buffer, str, len);
+      jsonrpc_json_writer_append (writer, "\"", 1);
+    }
+  else
+    {
+      g_autofree gchar *str = g_variant_print (key, FALSE);
+
+      jsonrpc_json_writer_append (writer, "\"", 1);
+      jsonrpc_output_stream_append_escaped (writer->buffer, str, strlen (str));
+      jsonrpc_json_writer_append (writer, "\"", 1);
+    }
+
+  jsonrpc_json_writer_append (writer, ":", 1);
+  jsonrpc_json_writer_append_value (writer, value);
+}
+
+/*
+ * Walks @value emitting the same JSON as json_gvariant_serialize_data()
+ * directly into the output buffer without building a JsonNode tree and
+ * a separate JSON string first.
+ */
+static void
+jsonrpc_json_writer_append_value (JsonrpcJsonWriter *writer,
+                                  GVariant          *value)
+{
+  writer->n_variants++;
+
+  switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      if (g_variant_get_boolean (value))
+        jsonrpc_json_writer_append (writer, "true", 4);
+      else
+        jsonrpc_json_writer_append (writer, "false", 5);
+      break;
+
+    case G_VARIANT_CLASS_BYTE:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_byte (value));
+      break;
+
+    case G_VARIANT_CLASS_INT16:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_int16 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT16:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_uint16 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT32:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_int32 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT32:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_uint32 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT64:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_int64 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT64:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_uint64 (value));
+      break;
+
+    case G_VARIANT_CLASS_HANDLE:
+      jsonrpc_json_writer_append_int (writer, g_variant_get_handle (value));
+      break;
+
+    case G_VARIANT_CLASS_DOUBLE:
+      jsonrpc_json_writer_append_double (writer, g_variant_get_double (value));
+      break;
+
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+      {
+        gsize len;
+        const gchar *str = g_variant_get_string (value, &len);
+
+        jsonrpc_json_writer_append_string (writer, str, len);
+      }
+      break;
+
+    case G_VARIANT_CLASS_MAYBE:
+      {
+        g_autoptr(GVariant) child = g_variant_get_maybe (value);
+
+        if (child == NULL)
+          jsonrpc_json_writer_append (writer, "null", 4);
+        else
+          jsonrpc_json_writer_append_value (writer, child);
+      }
+      break;
+
+    case G_VARIANT_CLASS_VARIANT:
+      {
+        g_autoptr(GVariant) child = g_variant_get_variant (value);
+
+        jsonrpc_json_writer_append_value (writer, child);
+      }
+      break;
+
+    case G_VARIANT_CLASS_DICT_ENTRY:
+      /* a single dictionary entry => object */
+      jsonrpc_json_writer_append (writer, "{", 1);
+      jsonrpc_json_writer_append_member (writer, value);
+      jsonrpc_json_writer_append (writer, "}", 1);
+      break;
+
+    case G_VARIANT_CLASS_ARRAY:
+    case G_VARIANT_CLASS_TUPLE:
+      {
+        gboolean is_object = g_variant_get_type_string (value)[1] == G_VARIANT_CLASS_DICT_ENTRY &&
+                             g_variant_is_of_type (value, G_VARIANT_TYPE_ARRAY);
+        gsize n_children = g_variant_n_children (value);
+        gsize i;
+
+        jsonrpc_json_writer_append (writer, is_object ? "{" : "[", 1);
+
+        for (i = 0; i < n_children; i++)
+          {
+            g_autoptr(GVariant) child = g_variant_get_child_value (value, i);
+
+            if (i > 0)
+              jsonrpc_json_writer_append (writer, ",", 1);
+
+            if (is_object)
+              jsonrpc_json_writer_append_member (writer, child);
+            else
+              jsonrpc_json_writer_append_value (writer, child);
+          }
+
+        jsonrpc_json_writer_append (writer, is_object ? "}" : "]", 1);
+      }
+      break;
+
+    default:
+      jsonrpc_json_writer_append (writer, "null", 4);
+      break;
+    }
+}
+
+static GBytes *
+jsonrpc_output_stream_create_json_bytes (JsonrpcOutputStream  *self,
+                                         GVariant             *message,
+                                         const gchar          *text,
+                                         gsize                 text_len,
+                                         GError              **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  JsonrpcJsonWriter writer = { NULL, text, text_len, FALSE, 0 };
+  gint64 start_time = g_get_monotonic_time ();
+  gchar header[HEADER_RESERVE];
+  gsize body_len;
+  gsize len;
+
+  g_assert (JSONRPC_IS_OUTPUT_STREAM (self));
+  g_assert (message != NULL);
+
+  /* assume a few escapes (mostly newlines) per 16 bytes of text */
+  writer.buffer = g_byte_array_sized_new (HEADER_RESERVE + g_variant_get_size (message) + 128 +
+                                          text_len + text_len / 16);
+  g_byte_array_set_size (writer.buffer, HEADER_RESERVE);
+
+  jsonrpc_json_writer_append_value (&writer, message);
+
+  if (text != NULL && !writer.text_written)
+    {
+      g_byte_array_unref (writer.buffer);
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_ARGUMENT,
+                           "Message does not contain text placeholder");
+      return NULL;
+    }
+
+  body_len = writer.buffer->len - HEADER_RESERVE;
+
+  /* Content-Length header right-aligned in the reserved space */
+  len = g_snprintf (header, sizeof header, "Content-Length: %"G_GSIZE_FORMAT"\r\n\r\n", body_len);
+  memcpy (writer.buffer->data + HEADER_RESERVE - len, header, len);
+
+  bytes = g_byte_array_free_to_bytes (writer.buffer);
+
+  G_LOCK (encode_statistics);
+  encode_statistics.n_messages++;
+  encode_statistics.n_bytes += body_len;
+  encode_statistics.n_variants += writer.n_variants;
+  encode_statistics.usec += g_get_monotonic_time () - start_time;
+  G_UNLOCK (encode_statistics);
+
+  return g_bytes_new_from_bytes (bytes, HEADER_RESERVE - len, len + body_len);
+}
+
 static GBytes *
 jsonrpc_output_stream_create_bytes (JsonrpcOutputStream  *self,
                                     GVariant             *message,
@@ -156,7 +572,6 @@ jsonrpc_output_stream_create_bytes (JsonrpcOutputStream  *self,
 {
   JsonrpcOutputStreamPrivate *priv = jsonrpc_output_stream_get_instance_private (self);
   g_autoptr(GByteArray) buffer = NULL;
-  g_autofree gchar *message_freeme = NULL;
   gconstpointer message_data = NULL;
   gsize message_len = 0;
   gchar header[256];
@@ -165,41 +580,32 @@ jsonrpc_output_stream_create_bytes (JsonrpcOutputStream  *self,
   g_assert (JSONRPC_IS_OUTPUT_STREAM (self));
   g_assert (message != NULL);
 
-  buffer = g_byte_array_sized_new (g_variant_get_size (message) + 128);
-
   if G_UNLIKELY (jsonrpc_output_stream_debug)
     {
       g_autofree gchar *str = g_variant_print (message, TRUE);
       g_message (">>> %s", str);
     }
 
-  if (priv->use_gvariant)
-    {
-      message_data = g_variant_get_data (message);
-      message_len = g_variant_get_size (message);
-    }
-  else
-    {
-      message_freeme = json_gvariant_serialize_data (message, &message_len);
-      message_data = message_freeme;
-    }
+  if (!priv->use_gvariant)
+    return jsonrpc_output_stream_create_json_bytes (self, message, NULL, 0, error);
+
+  buffer = g_byte_array_sized_new (g_variant_get_size (message) + 128);
+
+  message_data = g_variant_get_data (message);
+  message_len = g_variant_get_size (message);
 
   /* Add Content-Length header */
   len = g_snprintf (header, sizeof header, "Content-Length: %"G_GSIZE_FORMAT"\r\n", message_len);
   g_byte_array_append (buffer, (const guint8 *)header, len);
 
-  if (priv->use_gvariant)
-    {
-      /* Add Content-Type header */
-      len = g_snprintf (header, sizeof header, "Content-Type: application/%s\r\n",
-                        priv->use_gvariant ? "gvariant" : "json");
-      g_byte_array_append (buffer, (const guint8 *)header, len);
-
-      /* Add our GVariantType for the peer to decode */
-      len = g_snprintf (header, sizeof header, "X-GVariant-Type: %s\r\n",
-                        (const gchar *)g_variant_get_type_string (message));
-      g_byte_array_append (buffer, (const guint8 *)header, len);
-    }
+  /* Add Content-Type header */
+  len = g_snprintf (header, sizeof header, "Content-Type: application/gvariant\r\n");
+  g_byte_array_append (buffer, (const guint8 *)header, len);
+
+  /* Add our GVariantType for the peer to decode */
+  len = g_snprintf (header, sizeof header, "X-GVariant-Type: %s\r\n",
+                    (const gchar *)g_variant_get_type_string (message));
+  g_byte_array_append (buffer, (const guint8 *)header, len);
 
   g_byte_array_append (buffer, (const guint8 *)"\r\n", 2);
 
@@ -209,6 +615,38 @@ jsonrpc_output_stream_create_bytes (JsonrpcOutputStream  *self,
   return g_byte_array_free_to_bytes (g_steal_pointer (&buffer));
 }
 
+static GBytes *
+jsonrpc_output_stream_create_bytes_with_text (JsonrpcOutputStream  *self,
+                                              GVariant             *message,
+                                              const gchar          *text,
+                                              gsize                 text_len,
+                                              GError              **error)
+{
+  JsonrpcOutputStreamPrivate *priv = jsonrpc_output_stream_get_instance_private (self);
+
+  g_assert (JSONRPC_IS_OUTPUT_STREAM (self));
+  g_assert (message != NULL);
+
+  if (priv->use_gvariant)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "Text payloads are only supported with JSON encoding");
+      return NULL;
+    }
+
+  if G_UNLIKELY (jsonrpc_output_stream_debug)
+    {
+      g_autofree gchar *str = g_variant_print (message, TRUE);
+      g_message (">>> %s (%"G_GSIZE_FORMAT" bytes of text)", str, text_len);
+    }
+
+  /* the message itself is small - the text is spliced in at the placeholder
+   * position directly from the caller's buffer */
+  return jsonrpc_output_stream_create_json_bytes (self, message, text, text_len, error);
+}
+
 JsonrpcOutputStream *
 jsonrpc_output_stream_new (GOutputStream *base_stream)
 {
@@ -231,6 +669,7 @@ jsonrpc_output_stream_fail_pending (JsonrpcOutputStream *self)
   priv->queue.head = NULL;
   priv->queue.tail = NULL;
   priv->queue.length = 0;
+  priv->pending_size = 0;
 
   for (iter = list; iter != NULL; iter = iter->next)
     {
@@ -245,6 +684,26 @@ jsonrpc_output_stream_fail_pending (JsonrpcOutputStream *self)
   g_list_free (list);
 }
 
+/*
+ * Messages queued while a write is in progress are sent together in a
+ * single write, up to this size, saving syscalls and wakeups of the peer.
+ */
+#define COALESCE_MAX_SIZE (256 * 1024)
+
+typedef struct
+{
+  GPtrArray *tasks;
+  GBytes    *bytes;
+} WriteBatch;
+
+static void
+write_batch_free (WriteBatch *batch)
+{
+  g_ptr_array_unref (batch->tasks);
+  g_bytes_unref (batch->bytes);
+  g_slice_free (WriteBatch, batch);
+}
+
 static void
 jsonrpc_output_stream_pump (JsonrpcOutputStream *self)
 {
@@ -252,6 +711,7 @@ jsonrpc_output_stream_pump (JsonrpcOutputStream *self)
   g_autoptr(GTask) task = NULL;
   const guint8 *data;
   GCancellable *cancellable;
+  WriteBatch *batch;
   GBytes *bytes;
   gsize len;
 
@@ -270,6 +730,7 @@ jsonrpc_output_stream_pump (JsonrpcOutputStream *self)
 
   if (g_output_stream_is_closed (G_OUTPUT_STREAM (self)))
     {
+      priv->pending_size -= len;
       g_task_return_new_error (task,
                                G_IO_ERROR,
                                G_IO_ERROR_CLOSED,
@@ -277,6 +738,41 @@ jsonrpc_output_stream_pump (JsonrpcOutputStream *self)
       return;
     }
 
+  batch = g_slice_new0 (WriteBatch);
+  batch->tasks = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (batch->tasks, g_steal_pointer (&task));
+
+  if (priv->queue.length > 0 && len < COALESCE_MAX_SIZE)
+    {
+      GByteArray *buf = g_byte_array_sized_new (MIN (priv->pending_size, COALESCE_MAX_SIZE));
+
+      g_byte_array_append (buf, data, len);
+
+      while (priv->queue.length > 0)
+        {
+          GTask *next = g_queue_peek_head (&priv->queue);
+          GBytes *next_bytes = g_task_get_task_data (next);
+          gsize next_len;
+          const guint8 *next_data = g_bytes_get_data (next_bytes, &next_len);
+
+          if (buf->len + next_len > COALESCE_MAX_SIZE)
+            break;
+
+          g_byte_array_append (buf, next_data, next_len);
+          g_ptr_array_add (batch->tasks, g_queue_pop_head (&priv->queue));
+        }
+
+      batch->bytes = g_byte_array_free_to_bytes (buf);
+    }
+  else
+    batch->bytes = g_bytes_ref (bytes);
+
+  /* cancelling one of the messages must not cancel the others */
+  if (batch->tasks->len > 1)
+    cancellable = NULL;
+
+  data = g_bytes_get_data (batch->bytes, &len);
+
   priv->processing = TRUE;
 
   g_output_stream_write_all_async (G_OUTPUT_STREAM (self),
@@ -285,7 +781,7 @@ jsonrpc_output_stream_pump (JsonrpcOutputStream *self)
                                    G_PRIORITY_DEFAULT,
                                    cancellable,
                                    jsonrpc_output_stream_write_message_async_cb,
-                                   g_steal_pointer (&task));
+                                   batch);
 }
 
 static void
@@ -296,36 +792,41 @@ jsonrpc_output_stream_write_message_async_cb (GObject      *object,
   JsonrpcOutputStream *self = (JsonrpcOutputStream *)object;
   JsonrpcOutputStreamPrivate *priv = jsonrpc_output_stream_get_instance_private (self);
   g_autoptr(GError) error = NULL;
-  g_autoptr(GTask) task = user_data;
-  GBytes *bytes;
+  WriteBatch *batch = user_data;
   gsize n_written;
+  guint i;
 
   g_assert (JSONRPC_IS_OUTPUT_STREAM (self));
   g_assert (G_IS_ASYNC_RESULT (result));
-  g_assert (G_IS_TASK (task));
+  g_assert (batch != NULL);
 
   priv->processing = FALSE;
+  priv->pending_size -= g_bytes_get_size (batch->bytes);
 
   if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (self), result, &n_written, &error))
     {
-      g_task_return_error (task, g_steal_pointer (&error));
+      for (i = 0; i < batch->tasks->len; i++)
+        g_task_return_error (g_ptr_array_index (batch->tasks, i), g_error_copy (error));
+      write_batch_free (batch);
       jsonrpc_output_stream_fail_pending (self);
       return;
     }
 
-  bytes = g_task_get_task_data (task);
-
-  if (g_bytes_get_size (bytes) != n_written)
+  if (g_bytes_get_size (batch->bytes) != n_written)
     {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               G_IO_ERROR_CLOSED,
-                               "Failed to write all bytes to peer");
+      for (i = 0; i < batch->tasks->len; i++)
+        g_task_return_new_error (g_ptr_array_index (batch->tasks, i),
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_CLOSED,
+                                 "Failed to write all bytes to peer");
+      write_batch_free (batch);
       jsonrpc_output_stream_fail_pending (self);
       return;
     }
 
-  g_task_return_boolean (task, TRUE);
+  for (i = 0; i < batch->tasks->len; i++)
+    g_task_return_boolean (g_ptr_array_index (batch->tasks, i), TRUE);
+  write_batch_free (batch);
 
   jsonrpc_output_stream_pump (self);
 }
@@ -371,6 +872,61 @@ jsonrpc_output_stream_write_message_async (JsonrpcOutputStream *self,
       return;
     }
 
+  priv->pending_size += g_bytes_get_size (bytes);
+  g_task_set_task_data (task, g_steal_pointer (&bytes), (GDestroyNotify)g_bytes_unref);
+  g_queue_push_tail (&priv->queue, g_steal_pointer (&task));
+  jsonrpc_output_stream_pump (self);
+}
+
+/**
+ * jsonrpc_output_stream_write_message_with_text_async:
+ * @self: a #JsonrpcOutputStream
+ * @message: (transfer none): a #GVariant
+ * @text: the text to be placed into the message
+ * @text_len: length of @text in bytes
+ * @cancellable: (nullable): a #GCancellable or %NULL
+ * @callback: (nullable): a #GAsyncReadyCallback or %NULL
+ * @user_data: closure data for @callback
+ *
+ * Like jsonrpc_output_stream_write_message_async() but the string value
+ * %JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER inside @message is replaced by
+ * @text. The text is escaped directly into the output buffer so large
+ * payloads such as document contents don't have to be copied into
+ * intermediate #GVariant and JSON representations.
+ *
+ * @text is only read during this call and does not have to outlive it.
+ */
+void
+jsonrpc_output_stream_write_message_with_text_async (JsonrpcOutputStream *self,
+                                                     GVariant            *message,
+                                                     const gchar         *text,
+                                                     gsize                text_len,
+                                                     GCancellable        *cancellable,
+                                                     GAsyncReadyCallback  callback,
+                                                     gpointer             user_data)
+{
+  JsonrpcOutputStreamPrivate *priv = jsonrpc_output_stream_get_instance_private (self);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_return_if_fail (JSONRPC_IS_OUTPUT_STREAM (self));
+  g_return_if_fail (message != NULL);
+  g_return_if_fail (text != NULL || text_len == 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, jsonrpc_output_stream_write_message_with_text_async);
+  g_task_set_priority (task, G_PRIORITY_LOW);
+
+  if (NULL == (bytes = jsonrpc_output_stream_create_bytes_with_text (self, message, text ? text : "",
+                                                                     text_len, &error)))
+    {
+      g_task_return_error (task, g_steal_pointer (&error));
+      return;
+    }
+
+  priv->pending_size += g_bytes_get_size (bytes);
   g_task_set_task_data (task, g_steal_pointer (&bytes), (GDestroyNotify)g_bytes_unref);
   g_queue_push_tail (&priv->queue, g_steal_pointer (&task));
   jsonrpc_output_stream_pump (self);
@@ -450,6 +1006,60 @@ jsonrpc_output_stream_write_message (JsonrpcOutputStream  *self,
   return g_task_propagate_boolean (task, error);
 }
 
+/**
+ * jsonrpc_output_stream_get_encode_statistics:
+ * @n_messages: (out) (optional): location for the number of created JSON messages
+ * @n_bytes: (out) (optional): location for their total size in bytes
+ * @n_variants: (out) (optional): location for the number of #GVariant
+ *   values visited while creating them
+ * @usec: (out) (optional): location for the total time in microseconds
+ *
+ * Gets totals of the JSON messages created by all the output streams of the
+ * process so the throughput of the conversion from #GVariant can be measured
+ * on real traffic.
+ */
+void
+jsonrpc_output_stream_get_encode_statistics (guint64 *n_messages,
+                                             guint64 *n_bytes,
+                                             guint64 *n_variants,
+                                             gint64  *usec)
+{
+  JsonrpcEncodeStatistics stats;
+
+  G_LOCK (encode_statistics);
+  stats = encode_statistics;
+  G_UNLOCK (encode_statistics);
+
+  if (n_messages)
+    *n_messages = stats.n_messages;
+  if (n_bytes)
+    *n_bytes = stats.n_bytes;
+  if (n_variants)
+    *n_variants = stats.n_variants;
+  if (usec)
+    *usec = stats.usec;
+}
+
+/**
+ * jsonrpc_output_stream_get_pending_size:
+ * @self: a #JsonrpcOutputStream
+ *
+ * Gets the number of bytes of the messages queued by
+ * jsonrpc_output_stream_write_message_async() and similar functions which
+ * haven't been completely written to the base stream yet.
+ *
+ * Returns: the size of the pending messages in bytes
+ */
+gsize
+jsonrpc_output_stream_get_pending_size (JsonrpcOutputStream *self)
+{
+  JsonrpcOutputStreamPrivate *priv = jsonrpc_output_stream_get_instance_private (self);
+
+  g_return_val_if_fail (JSONRPC_IS_OUTPUT_STREAM (self), 0);
+
+  return priv->pending_size;
+}
+
 gboolean
 jsonrpc_output_stream_get_use_gvariant (JsonrpcOutputStream *self)
 {
@@ -28,6 +28,10 @@ G_BEGIN_DECLS
 
 #define JSONRPC_TYPE_OUTPUT_STREAM (jsonrpc_output_stream_get_type())
 
+/* String value replaced by the text passed to
+ * jsonrpc_output_stream_write_message_with_text_async() */
+#define JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER "@!^%TEXT"
+
 JSONRPC_AVAILABLE_IN_3_26
 G_DECLARE_DERIVABLE_TYPE (JsonrpcOutputStream, jsonrpc_output_stream, JSONRPC, OUTPUT_STREAM, GDataOutputStream)
 
@@ -56,6 +60,13 @@ gboolean             jsonrpc_output_stream_get_use_gvariant     (JsonrpcOutputSt
 JSONRPC_AVAILABLE_IN_3_26
 void                 jsonrpc_output_stream_set_use_gvariant     (JsonrpcOutputStream  *self,
                                                                  gboolean              use_gvariant);
+JSONRPC_AVAILABLE_IN_3_44
+gsize                jsonrpc_output_stream_get_pending_size     (JsonrpcOutputStream  *self);
+JSONRPC_AVAILABLE_IN_3_44
+void                 jsonrpc_output_stream_get_encode_statistics (guint64             *n_messages,
+                                                                  guint64             *n_bytes,
+                                                                  guint64             *n_variants,
+                                                                  gint64              *usec);
 JSONRPC_AVAILABLE_IN_3_26
 gboolean             jsonrpc_output_stream_write_message        (JsonrpcOutputStream  *self,
                                                                  GVariant             *message,
@@ -67,6 +78,15 @@ void                 jsonrpc_output_stream_write_message_async  (JsonrpcOutputSt
                                                                  GCancellable         *cancellable,
                                                                  GAsyncReadyCallback   callback,
                                                                  gpointer              user_data);
+JSONRPC_AVAILABLE_IN_3_44
+void                 jsonrpc_output_stream_write_message_with_text_async
+                                                                (JsonrpcOutputStream  *self,
+                                                                 GVariant             *message,
+                                                                 const gchar          *text,
+                                                                 gsize                 text_len,
+                                                                 GCancellable         *cancellable,
+                                                                 GAsyncReadyCallback   callback,
+                                                                 gpointer              user_data);
 JSONRPC_AVAILABLE_IN_3_26
 gboolean             jsonrpc_output_stream_write_message_finish (JsonrpcOutputStream  *self,
                                                                  GAsyncResult         *result,
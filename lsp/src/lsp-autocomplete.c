@@ -25,12 +25,22 @@
 #include "lsp-rpc.h"
 #include "lsp-server.h"
 #include "lsp-symbol-kinds.h"
+#include "lsp-fuzzy.h"
+#include "lsp-timing.h"
+#include "lsp-sync.h"
 
 #include <jsonrpc-glib.h>
 #include <ctype.h>
 #include <glib.h>
 
 
+#define LETTER_NUM ('z' - 'a' + 1)
+// number of items resolved in advance before and after the selected one
+#define RESOLVE_PREFETCH 2
+// caret pause after which completion of the identifier before it is prefetched
+#define COMPLETION_PREFETCH_DELAY 500
+
+
 typedef struct
 {
 	gchar *label;
@@ -38,13 +48,28 @@ typedef struct
 	gchar *sort_text;
 	gchar *filter_text;
 	gchar *insert_text;
+	gchar *edit_text;  // newText of text_edit
+	gboolean is_snippet;
+	GVariant *raw_symbol;
+	gboolean resolved;
+	gboolean resolve_pending;
+
+	// decoded from raw_symbol by decode_symbol() only when needed
+	gboolean decoded;
 	gchar *detail;
 	gchar *documentation;
 	LspTextEdit *text_edit;
 	GPtrArray * additional_edits;
-	gboolean is_snippet;
-	GVariant *raw_symbol;
-	gboolean resolved;
+
+	// precomputed when parsed so filtering and sorting don't allocate
+	gchar *label_key;  // lowercase label
+	gchar *filter_key;  // lowercase filter text
+	guint8 letter_counts[LETTER_NUM];  // of filter_key
+	guint32 letters;  // bitmap of letters in filter_key
+	guint64 mask;  // lsp_fuzzy_get_mask() of label_key
+	gboolean is_identifier;
+	gint score;  // fuzzy match score against the current prefix
+	guint order;  // index in the server-sorted list
 } LspAutocompleteSymbol;
 
 
@@ -52,35 +77,87 @@ typedef struct
 {
 	GeanyDocument *doc;
 	gint request_id;
+	gint anchor;
+	gchar *prefix;
+	LspPosition pos;
+	gint64 request_time;
 } LspAutocompleteAsyncData;
 
 
+// last received completion list, re-filtered locally while the typed prefix
+// grows if the server reported it as complete
+typedef struct
+{
+	GPtrArray *symbols;  // LspAutocompleteSymbol, owned
+	LspServer *server;
+	guint doc_id;
+	gint anchor;  // start of the completed identifier
+	gchar *prefix;  // identifier prefix at the time of the request
+	LspPosition pos;  // position of the request
+	gboolean is_incomplete;
+} LspAutocompleteCache;
+
+
 typedef struct
 {
 	gint pass;
 	gchar *prefix;
 	gboolean use_label;
 	const gchar *word_chars;
+	gchar *prefix_key;  // lowercase prefix
+	guint8 prefix_counts[LETTER_NUM];
+	guint32 prefix_letters;
+	gchar prefix_start[3];  // first two bytes of prefix_key
+	LspFuzzyPattern *pattern;
 } SortData;
 
 
 typedef struct
 {
-	LspAutocompleteSymbol *symbol;
+	LspAutocompleteSymbol *symbol;  // NULL when the request was given up
 	GeanyDocument *doc;
+	LspRpcRequest request;
 } ResolveData;
 
 
+// completion of the identifier before the caret requested once the caret
+// stops after it so the list is ready when the identifier gets typed further
+typedef struct
+{
+	guint id;  // of the request, 0 when there's no prefetch
+	LspServer *server;
+	guint doc_id;
+	gint anchor;  // start of the identifier
+	gchar *prefix;  // the identifier at the time of the request
+	LspPosition lsp_pos;  // position of the request
+	LspRpcRequest request;  // 0 once answered
+	GVariant *response;
+	gint waiting_request_id;  // completion waiting for the response, 0 if none
+	gint64 request_time;
+} LspAutocompletePrefetch;
+
+
+extern GeanyPlugin *geany_plugin;
+
+
 static GPtrArray *displayed_autocomplete_symbols = NULL;
 static gint sent_request_id = 0;
 static gint received_request_id = 0;
 static gint discard_up_to_request_id = 0;
 static gboolean statusbar_modified = FALSE;
+static LspRpcRequest pending_request = 0;
+static LspAutocompleteCache cache = {NULL};
+static GPtrArray *pending_resolves = NULL;  // ResolveData, freed by resolve_cb
+static LspAutocompletePrefetch prefetch = {0};
+static guint last_prefetch_id = 0;
+static guint prefetch_source = 0;
 
 
 void lsp_autocomplete_discard_pending_requests()
 {
 	discard_up_to_request_id = sent_request_id;
+	lsp_rpc_cancel(pending_request);
+	pending_request = 0;
 }
 
 
@@ -99,23 +176,114 @@ static void free_autocomplete_symbol(gpointer data)
 	g_free(sym->sort_text);
 	g_free(sym->filter_text);
 	g_free(sym->insert_text);
+	g_free(sym->edit_text);
 	g_free(sym->detail);
 	g_free(sym->documentation);
 	lsp_utils_free_lsp_text_edit(sym->text_edit);
 	if (sym->additional_edits)
 		g_ptr_array_free(sym->additional_edits, TRUE);
 	g_variant_unref(sym->raw_symbol);
+	g_free(sym->label_key);
+	g_free(sym->filter_key);
 	g_free(sym);
 }
 
 
+/* Only the fields needed for filtering and sorting are parsed for all the
+ * received items, the rest is decoded for displayed or selected items */
+static void decode_symbol(LspAutocompleteSymbol *sym)
+{
+	GVariant *text_edit = NULL;
+	GVariantIter *additional_edits = NULL;
+	const gchar *detail = NULL;
+	const gchar *documentation = NULL;
+
+	if (sym->decoded)
+		return;
+	sym->decoded = TRUE;
+
+	JSONRPC_MESSAGE_PARSE(sym->raw_symbol, "detail", JSONRPC_MESSAGE_GET_STRING(&detail));
+	JSONRPC_MESSAGE_PARSE(sym->raw_symbol, "textEdit", JSONRPC_MESSAGE_GET_VARIANT(&text_edit));
+	JSONRPC_MESSAGE_PARSE(sym->raw_symbol, "additionalTextEdits", JSONRPC_MESSAGE_GET_ITER(&additional_edits));
+
+	if (!JSONRPC_MESSAGE_PARSE(sym->raw_symbol, "documentation", JSONRPC_MESSAGE_GET_STRING(&documentation)))
+	{
+		JSONRPC_MESSAGE_PARSE(sym->raw_symbol, "documentation", "{",
+			"value", JSONRPC_MESSAGE_GET_STRING(&documentation),
+		"}");
+	}
+
+	sym->detail = g_strdup(detail);
+	sym->documentation = g_strdup(documentation);
+	sym->text_edit = lsp_utils_parse_text_edit(text_edit);
+	sym->additional_edits = lsp_utils_parse_text_edits(additional_edits);
+
+	if (text_edit)
+		g_variant_unref(text_edit);
+
+	if (additional_edits)
+		g_variant_iter_free(additional_edits);
+}
+
+
+static void cancel_resolve(ResolveData *data)
+{
+	data->symbol->resolve_pending = FALSE;
+	data->symbol = NULL;
+	g_ptr_array_remove_fast(pending_resolves, data);
+	lsp_rpc_cancel(data->request);  // resolve_cb frees data
+}
+
+
+static void cancel_all_resolves(void)
+{
+	while (pending_resolves && pending_resolves->len > 0)
+		cancel_resolve(pending_resolves->pdata[0]);
+}
+
+
+static void clear_cache(void)
+{
+	// displayed symbols are owned by the cache
+	lsp_autocomplete_set_displayed_symbols(NULL);
+	cancel_all_resolves();
+	if (cache.symbols)
+		g_ptr_array_free(cache.symbols, TRUE);
+	g_free(cache.prefix);
+	memset(&cache, 0, sizeof(cache));
+}
+
+
+static void clear_prefetch(void)
+{
+	LspRpcRequest request = prefetch.request;
+
+	if (prefetch.response)
+		g_variant_unref(prefetch.response);
+	g_free(prefetch.prefix);
+	memset(&prefetch, 0, sizeof(prefetch));
+	// prefetch_cb() ignores the reply from now on
+	lsp_rpc_cancel(request);
+}
+
+
+/* Frees the cached completion list unless it is being displayed */
+void lsp_autocomplete_drop_cache(void)
+{
+	if (!displayed_autocomplete_symbols)
+		clear_cache();
+	if (prefetch.response)
+		clear_prefetch();
+}
+
+
 static const gchar *get_label(LspAutocompleteSymbol *sym, gboolean use_label)
 {
 	if (use_label && sym->label)
 		return sym->label;
 
-	if (sym->text_edit && sym->text_edit->new_text)
-		return sym->text_edit->new_text;
+	if (sym->edit_text)
+		return sym->edit_text;
 	if (sym->insert_text)
 		return sym->insert_text;
 	if (sym->label)
@@ -194,6 +362,7 @@ void lsp_autocomplete_item_selected(LspServer *server, GeanyDocument *doc, guint
 		return;
 
 	sym = displayed_autocomplete_symbols->pdata[index];
+	decode_symbol(sym);
 	/* The sent_request_id == received_request_id detects the condition when
 	 * user typed a character and pressed enter immediately afterwards in which
 	 * case the autocompletion list doesn't contain up-to-date text edits.
@@ -201,10 +370,23 @@ void lsp_autocomplete_item_selected(LspServer *server, GeanyDocument *doc, guint
 	 * below. */
 	if (sel_num == 1 && sym->text_edit && sent_request_id == received_request_id)
 	{
+		LspTextEdit *text_edit = sym->text_edit;
+		LspTextEdit adjusted_edit;
+
+		// the list may have been re-filtered locally after more characters were
+		// typed - extend edits ending at the request position to the cursor
+		if (text_edit->range.end.line == cache.pos.line &&
+			text_edit->range.end.character == cache.pos.character)
+		{
+			adjusted_edit = *text_edit;
+			adjusted_edit.range.end = lsp_utils_scintilla_pos_to_lsp(sci, sci_get_current_position(sci));
+			text_edit = &adjusted_edit;
+		}
+
 		if (server->config.autocomplete_apply_additional_edits && sym->additional_edits)
-			lsp_utils_apply_text_edits(sci, sym->text_edit, sym->additional_edits, sym->is_snippet);
+			lsp_utils_apply_text_edits(sci, text_edit, sym->additional_edits, sym->is_snippet);
 		else
-			lsp_utils_apply_text_edit(sci, sym->text_edit, sym->is_snippet);
+			lsp_utils_apply_text_edit(sci, text_edit, sym->is_snippet);
 	}
 	else
 	{
@@ -247,10 +429,18 @@ void lsp_autocomplete_clear_statusbar(void)
 static void resolve_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	ResolveData *data = user_data;
+	LspAutocompleteSymbol *symbol = data->symbol;
 	LspServer *server = lsp_server_get_if_running(data->doc);
 
-	if (!error && server && data->doc == document_get_current() && displayed_autocomplete_symbols &&
-		g_ptr_array_find(displayed_autocomplete_symbols, data->symbol, NULL))
+	if (symbol)
+	{
+		g_ptr_array_remove_fast(pending_resolves, data);
+		symbol->resolve_pending = FALSE;
+		// don't try again for items the server failed to resolve
+		symbol->resolved = !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+	}
+
+	if (!error && symbol)
 	{
 		const gchar *documentation = NULL;
 
@@ -261,22 +451,23 @@ static void resolve_cb(GVariant *return_value, GError *error, gpointer user_data
 			"}");
 		}
 
+		decode_symbol(symbol);
+
 		if (documentation)
 		{
-			gint current_selection = SSM(data->doc->editor->sci, SCI_AUTOCGETCURRENT, 0, 0);
-			gchar *label;
+			g_free(symbol->documentation);
+			symbol->documentation = g_strdup(documentation);
+		}
 
-			g_free(data->symbol->documentation);
-			data->symbol->documentation = g_strdup(documentation);
-			data->symbol->resolved = TRUE;
+		if (server && data->doc == document_get_current() && displayed_autocomplete_symbols)
+		{
+			gint current_selection = SSM(data->doc->editor->sci, SCI_AUTOCGETCURRENT, 0, 0);
 
-			if (current_selection < displayed_autocomplete_symbols->len)
+			if (current_selection >= 0 && current_selection < displayed_autocomplete_symbols->len &&
+				displayed_autocomplete_symbols->pdata[current_selection] == symbol)
 			{
-				LspAutocompleteSymbol *sym = displayed_autocomplete_symbols->pdata[current_selection];
-
-				label = get_symbol_label(server, sym);
-				if (sym == data->symbol)
-					lsp_autocomplete_selection_changed(data->doc, label);  // reshow
+				gchar *label = get_symbol_label(server, symbol);
+				lsp_autocomplete_selection_changed(data->doc, label);  // reshow
 				g_free(label);
 			}
 		}
@@ -288,6 +479,69 @@ static void resolve_cb(GVariant *return_value, GError *error, gpointer user_data
 }
 
 
+static void resolve_symbol(LspServer *srv, GeanyDocument *doc, LspAutocompleteSymbol *sym,
+	gboolean prefetch)
+{
+	ResolveData *data;
+	LspRpcRequest request;
+
+	if (sym->resolved || sym->resolve_pending)
+		return;
+
+	if (!pending_resolves)
+		pending_resolves = g_ptr_array_new();
+
+	data = g_new0(ResolveData, 1);
+	data->doc = doc;
+	data->symbol = sym;
+	sym->resolve_pending = TRUE;
+	g_ptr_array_add(pending_resolves, data);
+
+	// prefetched items don't hold up more important requests
+	if (prefetch)
+		request = lsp_rpc_call_background(srv, "completionItem/resolve", sym->raw_symbol,
+			resolve_cb, data);
+	else
+		request = lsp_rpc_call(srv, "completionItem/resolve", sym->raw_symbol,
+			resolve_cb, data);
+
+	// resolve_cb may have been called already
+	if (g_ptr_array_find(pending_resolves, data, NULL))
+		data->request = request;
+}
+
+
+/* Resolves the selected item and its neighbors so documentation is available
+ * immediately when moving through the list; requests for items no longer
+ * around the selection are cancelled */
+static void resolve_around(LspServer *srv, GeanyDocument *doc, LspAutocompleteSymbol *sym)
+{
+	guint index, first, last, i;
+
+	if (!g_ptr_array_find(displayed_autocomplete_symbols, sym, &index))
+		return;
+
+	first = index > RESOLVE_PREFETCH ? index - RESOLVE_PREFETCH : 0;
+	last = MIN(index + RESOLVE_PREFETCH, displayed_autocomplete_symbols->len - 1);
+
+	for (i = 0; pending_resolves && i < pending_resolves->len; )
+	{
+		ResolveData *data = pending_resolves->pdata[i];
+		guint pos;
+
+		if (!g_ptr_array_find(displayed_autocomplete_symbols, data->symbol, &pos) ||
+			pos < first || pos > last)
+			cancel_resolve(data);  // replaced by the last item, check again
+		else
+			i++;
+	}
+
+	resolve_symbol(srv, doc, sym, FALSE);
+	for (i = first; i <= last; i++)
+		resolve_symbol(srv, doc, displayed_autocomplete_symbols->pdata[i], TRUE);
+}
+
+
 LspAutocompleteSymbol *find_symbol(GeanyDocument *doc, const gchar *text)
 {
 	LspServer *srv = lsp_server_get(doc);
@@ -323,14 +577,16 @@ void lsp_autocomplete_selection_changed(GeanyDocument *doc, const gchar *text)
 	if (!sym || !srv || !srv->config.autocomplete_show_documentation)
 		return;
 
-	if (!sym->resolved && srv->supports_completion_resolve)
+	decode_symbol(sym);
+
+	if (srv->supports_completion_resolve)
 	{
-		ResolveData *data = g_new0(ResolveData, 1);
-		data->doc = doc;
-		data->symbol = sym;
-		lsp_rpc_call(srv, "completionItem/resolve", sym->raw_symbol, resolve_cb, data);
+		resolve_around(srv, doc, sym);
+		if (!sym->resolved)
+			return;  // shown by resolve_cb
 	}
-	else if (!sym->documentation)
+
+	if (!sym->documentation)
 		lsp_autocomplete_clear_statusbar();
 	else
 	{
@@ -434,15 +690,6 @@ static void show_tags_list(LspServer *server, GeanyDocument *doc, GPtrArray *sym
 }
 
 
-static gint strstr_delta(const gchar *s1, const gchar *s2)
-{
-	const gchar *pos = strstr(s1, s2);
-	if (!pos)
-		return -1;
-	return pos - s1;
-}
-
-
 static gboolean has_identifier_chars(const gchar *s, const gchar *word_chars)
 {
 	gint i;
@@ -456,16 +703,57 @@ static gboolean has_identifier_chars(const gchar *s, const gchar *word_chars)
 }
 
 
-static void get_letter_counts(gint *counts, const gchar *str)
+static guint32 get_letter_counts(guint8 *counts, const gchar *str)
 {
+	guint32 letters = 0;
 	gint i;
 
 	for (i = 0; str[i]; i++)
 	{
 		gchar c = str[i];
 		if (c >= 'a' && c <= 'z')
-			counts[c-'a']++;
+		{
+			if (counts[c-'a'] < G_MAXUINT8)
+				counts[c-'a']++;
+			letters |= 1u << (c-'a');
+		}
 	}
+
+	return letters;
+}
+
+
+static gchar *get_key(const gchar *str)
+{
+	gchar *key = lsp_utils_utf8_strdown(str);
+	return key ? key : g_strdup("");
+}
+
+
+static void init_symbol_keys(LspServer *server, LspAutocompleteSymbol *sym)
+{
+	const gchar *label = get_label(sym, server->config.autocomplete_use_label);
+
+	sym->label_key = get_key(label);
+	if (sym->filter_text)
+		sym->filter_key = get_key(sym->filter_text);
+	else
+		sym->filter_key = g_strdup(sym->label_key);
+	sym->letters = get_letter_counts(sym->letter_counts, sym->filter_key);
+	sym->mask = lsp_fuzzy_get_mask(sym->label_key);
+	sym->is_identifier = has_identifier_chars(label, server->config.word_chars);
+}
+
+
+static void init_prefix_keys(SortData *sort_data)
+{
+	if (!sort_data->prefix)
+		return;
+
+	sort_data->prefix_key = get_key(sort_data->prefix);
+	sort_data->prefix_letters = get_letter_counts(sort_data->prefix_counts, sort_data->prefix_key);
+	strncpy(sort_data->prefix_start, sort_data->prefix_key, 2);
+	sort_data->pattern = lsp_fuzzy_pattern_new(sort_data->prefix_key);
 }
 
 
@@ -475,43 +763,32 @@ static void get_letter_counts(gint *counts, const gchar *str)
 // when the typed string is just slightly misspelled. For servers that don't
 // filter by themselves this filters the the strings that are totally out and
 // together with sorting presents reasonable suggestions
-static gboolean should_filter(const gchar *name, const gchar *prefix)
+static gboolean should_filter(LspAutocompleteSymbol *sym, SortData *sort_data)
 {
-	gint name_letters['z'-'a'+1] = {0};
-	gint prefix_letters['z'-'a'+1] = {0};
-	gchar c;
+	gint i;
 
-	get_letter_counts(name_letters, name);
-	get_letter_counts(prefix_letters, prefix);
+	if (sort_data->prefix_letters & ~sym->letters)
+		return TRUE;
 
-	for (c = 'a'; c <= 'z'; c++)
+	for (i = 0; i < LETTER_NUM; i++)
 	{
-		if (name_letters[c-'a'] < prefix_letters[c-'a'])
+		if (sym->letter_counts[i] < sort_data->prefix_counts[i])
 			return TRUE;
 	}
 
-	if (strlen(prefix) >= 2)
-	{
-		gchar pref[] = {prefix[0], prefix[1], '\0'};
-		if (!strstr(name, pref))
-			return TRUE;
-	}
+	if (sort_data->prefix_start[1] && !strstr(sym->filter_key, sort_data->prefix_start))
+		return TRUE;
 
 	return FALSE;
 }
 
 
-static gboolean filter_autocomplete_symbols(LspAutocompleteSymbol *sym, const gchar *text,
-	gboolean use_label)
+static gboolean filter_autocomplete_symbols(LspAutocompleteSymbol *sym, SortData *sort_data)
 {
-	const gchar *filter_text;
-
-	if (EMPTY(text))
+	if (EMPTY(sort_data->prefix))
 		return FALSE;
 
-	filter_text = sym->filter_text ? sym->filter_text : get_label(sym, use_label);
-
-	return GPOINTER_TO_INT(lsp_utils_lowercase_cmp((LspUtilsCmpFn)should_filter, filter_text, text));
+	return should_filter(sym, sort_data);
 }
 
 
@@ -525,8 +802,9 @@ static gint sort_autocomplete_symbols(gconstpointer a, gconstpointer b, gpointer
 
 	if (sort_data->pass == 2 && label1 && label2 && sort_data->prefix)
 	{
-		const gchar *wc = sort_data->word_chars;
-		gint diff1, diff2;
+		const gchar *key1 = sym1->label_key;
+		const gchar *key2 = sym2->label_key;
+		const gchar *prefix_key = sort_data->prefix_key;
 
 		if (g_strcmp0(label1, sort_data->prefix) == 0 && g_strcmp0(label2, sort_data->prefix) != 0)
 			return -1;
@@ -539,33 +817,23 @@ static gint sort_autocomplete_symbols(gconstpointer a, gconstpointer b, gpointer
 			return 1;
 
 		// case insensitive variants
-		if (utils_str_casecmp(label1, sort_data->prefix) == 0 && utils_str_casecmp(label2, sort_data->prefix) != 0)
+		if (strcmp(key1, prefix_key) == 0 && strcmp(key2, prefix_key) != 0)
 			return -1;
-		if (utils_str_casecmp(label1, sort_data->prefix) != 0 && utils_str_casecmp(label2, sort_data->prefix) == 0)
+		if (strcmp(key1, prefix_key) != 0 && strcmp(key2, prefix_key) == 0)
 			return 1;
 
-		if (lsp_utils_lowercase_cmp((LspUtilsCmpFn)g_str_has_prefix, label1, sort_data->prefix) &&
-			!lsp_utils_lowercase_cmp((LspUtilsCmpFn)g_str_has_prefix, label2, sort_data->prefix))
+		if (g_str_has_prefix(key1, prefix_key) && !g_str_has_prefix(key2, prefix_key))
 			return -1;
-		if (!lsp_utils_lowercase_cmp((LspUtilsCmpFn)g_str_has_prefix, label1, sort_data->prefix) &&
-			lsp_utils_lowercase_cmp((LspUtilsCmpFn)g_str_has_prefix, label2, sort_data->prefix))
+		if (!g_str_has_prefix(key1, prefix_key) && g_str_has_prefix(key2, prefix_key))
 			return 1;
 
-		// anywhere within string, any case, earlier occurrence wins
-		diff1 = GPOINTER_TO_INT(lsp_utils_lowercase_cmp(
-			(LspUtilsCmpFn)strstr_delta, label1, sort_data->prefix));
-		diff2 = GPOINTER_TO_INT(lsp_utils_lowercase_cmp(
-			(LspUtilsCmpFn)strstr_delta, label2, sort_data->prefix));
-		if (diff1 != -1 && diff2 == -1)
-			return -1;
-		if (diff1 == -1 && diff2 != -1)
-			return 1;
-		if (diff1 != -1 && diff2 != -1 && diff1 != diff2)
-			return diff1 - diff2;
+		// fuzzy match anywhere within string, better match wins
+		if (sym1->score != sym2->score)
+			return sym1->score > sym2->score ? -1 : 1;
 
-		if (has_identifier_chars(label1, wc) && !has_identifier_chars(label2, wc))
+		if (sym1->is_identifier && !sym2->is_identifier)
 			return -1;
-		if (!has_identifier_chars(label1, wc) && has_identifier_chars(label2, wc))
+		if (!sym1->is_identifier && sym2->is_identifier)
 			return 1;
 	}
 
@@ -573,12 +841,81 @@ static gint sort_autocomplete_symbols(gconstpointer a, gconstpointer b, gpointer
 		return g_strcmp0(sym1->sort_text, sym2->sort_text);
 
 	if (label1 && label2)
-		return utils_str_casecmp(label1, label2);
+		return strcmp(sym1->label_key, sym2->label_key);
 
 	return 0;
 }
 
 
+static gint compare_ranked_symbols(LspAutocompleteSymbol *sym1, LspAutocompleteSymbol *sym2,
+	SortData *sort_data)
+{
+	gint res = sort_autocomplete_symbols(&sym1, &sym2, sort_data);
+
+	if (res != 0)
+		return res;
+	return (sym1->order > sym2->order) - (sym1->order < sym2->order);
+}
+
+
+static void sift_down(gpointer *heap, guint len, guint i, SortData *sort_data)
+{
+	while (TRUE)
+	{
+		guint child = 2 * i + 1;
+		gpointer tmp;
+
+		if (child >= len)
+			break;
+		if (child + 1 < len && compare_ranked_symbols(heap[child + 1], heap[child], sort_data) > 0)
+			child++;
+		if (compare_ranked_symbols(heap[child], heap[i], sort_data) <= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+
+static gint sort_ranked_symbols(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	return compare_ranked_symbols(*((LspAutocompleteSymbol **)a), *((LspAutocompleteSymbol **)b),
+		user_data);
+}
+
+
+/* Leaves only the best n symbols in the array, sorted. Instead of sorting all
+ * the symbols, the best ones are collected in a heap with the worst of them on
+ * top so selecting them is O(len * log(n)). */
+static void select_top_symbols(GPtrArray *symbols, guint n, SortData *sort_data)
+{
+	gpointer *heap = symbols->pdata;
+	guint i;
+
+	if (symbols->len > n)
+	{
+		for (i = n / 2; i > 0; i--)
+			sift_down(heap, n, i - 1, sort_data);
+
+		for (i = n; i < symbols->len; i++)
+		{
+			if (compare_ranked_symbols(heap[i], heap[0], sort_data) < 0)
+			{
+				heap[0] = heap[i];
+				sift_down(heap, n, 0, sort_data);
+			}
+		}
+
+		g_ptr_array_set_size(symbols, n);
+	}
+
+	g_ptr_array_sort_with_data(symbols, sort_ranked_symbols, sort_data);
+}
+
+
 static gboolean should_add(GPtrArray *symbols, const gchar *prefix)
 {
 	LspAutocompleteSymbol *sym;
@@ -600,157 +937,176 @@ static gboolean should_add(GPtrArray *symbols, const gchar *prefix)
 }
 
 
-static void process_response(LspServer *server, GVariant *response, GeanyDocument *doc)
+/* Filters and sorts the cached symbols for the currently typed prefix and shows
+ * them */
+static void show_cached_symbols(LspServer *server, GeanyDocument *doc)
 {
-	//gboolean is_incomplete = FALSE;
-	GVariantIter *iter = NULL;
-	GVariant *member = NULL;
 	ScintillaObject *sci = doc->editor->sci;
 	gint pos = sci_get_current_position(sci);
 	gint prefixlen = get_ident_prefixlen(server->config.word_chars, doc, pos);
-	SortData sort_data = { 1, NULL, server->config.autocomplete_use_label, server->config.word_chars };
-	GPtrArray *symbols, *symbols_filtered;
+	SortData sort_data = { 2, NULL, server->config.autocomplete_use_label, server->config.word_chars };
+	GPtrArray *symbols;
 	GHashTable *entry_set;
-	gint i;
+	guint i;
+
+	symbols = g_ptr_array_new_full(cache.symbols->len, NULL);  // owned by the cache
+	entry_set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (prefixlen > 0)
+		sort_data.prefix = sci_get_contents_range(sci, pos - prefixlen, pos);
+	init_prefix_keys(&sort_data);
+
+	/* remove duplicates and items not matching filtering criteria */
+	for (i = 0; i < cache.symbols->len; i++)
+	{
+		LspAutocompleteSymbol *sym = cache.symbols->pdata[i];
+		gchar *display_label = get_symbol_label(server, sym);
+
+		if (g_hash_table_contains(entry_set, display_label) ||
+			filter_autocomplete_symbols(sym, &sort_data))
+		{
+			g_free(display_label);
+		}
+		else
+		{
+			sym->score = sort_data.pattern ?
+				lsp_fuzzy_score(sort_data.pattern, get_label(sym, sort_data.use_label), sym->label_key, sym->mask) : 0;
+			g_ptr_array_add(symbols, sym);
+			g_hash_table_insert(entry_set, display_label, NULL);
+		}
+	}
+
+	/* sort with symbols matching the typed prefix first - only those fitting
+	 * into the popup are needed */
+	select_top_symbols(symbols, MAX(server->config.autocomplete_window_max_entries + 1, 2), &sort_data);
 
-	JSONRPC_MESSAGE_PARSE(response, 
-		//"isIncomplete", JSONRPC_MESSAGE_GET_BOOLEAN(&is_incomplete),
+	if (should_add(symbols, sort_data.prefix))
+		show_tags_list(server, doc, symbols);
+	else
+	{
+		lsp_autocomplete_set_displayed_symbols(NULL);
+		g_ptr_array_free(symbols, TRUE);
+		SSM(doc->editor->sci, SCI_AUTOCCANCEL, 0, 0);
+	}
+
+	g_hash_table_destroy(entry_set);
+	g_free(sort_data.prefix);
+	g_free(sort_data.prefix_key);
+	lsp_fuzzy_pattern_free(sort_data.pattern);
+}
+
+
+static void process_response(LspServer *server, GVariant *response, LspAutocompleteAsyncData *data)
+{
+	gboolean is_incomplete = FALSE;
+	GVariantIter *iter = NULL;
+	GVariant *member = NULL;
+	GeanyDocument *doc = data->doc;
+	SortData sort_data = { 1, NULL, server->config.autocomplete_use_label, server->config.word_chars };
+	GPtrArray *symbols;
+	guint i;
+
+	JSONRPC_MESSAGE_PARSE(response,
+		"isIncomplete", JSONRPC_MESSAGE_GET_BOOLEAN(&is_incomplete));
+	JSONRPC_MESSAGE_PARSE(response,
 		"items", JSONRPC_MESSAGE_GET_ITER(&iter));
 
 	if (!iter && g_variant_is_of_type(response, G_VARIANT_TYPE_ARRAY))
 		iter = g_variant_iter_new(response);
 
+	clear_cache();
+
 	if (!iter)
 	{
 		SSM(doc->editor->sci, SCI_AUTOCCANCEL, 0, 0);
 		return;
 	}
 
-	symbols = g_ptr_array_new_full(0, NULL);  // not freeing symbols here
+	symbols = g_ptr_array_new_full(0, free_autocomplete_symbol);
 
 	while (g_variant_iter_next(iter, "v", &member))
 	{
 		LspAutocompleteSymbol *sym;
 		GVariant *text_edit = NULL;
-		GVariantIter *additional_edits = NULL;
+		GVariant *edit_range = NULL;
 		const gchar *label = NULL;
 		const gchar *insert_text = NULL;
+		const gchar *edit_text = NULL;
 		const gchar *sort_text = NULL;
 		const gchar *filter_text = NULL;
-		const gchar *detail = NULL;
-		const gchar *documentation = NULL;
 		gint64 kind = 0;
 		gint64 format = 0;
 
-		JSONRPC_MESSAGE_PARSE(member, "kind", JSONRPC_MESSAGE_GET_INT64(&kind));
-
-		if (kind == LspCompletionKindSnippet && !server->config.autocomplete_use_snippets)
-		{
-			g_variant_unref(member);
-			continue;
-		}
-
-		JSONRPC_MESSAGE_PARSE(member, "insertText", JSONRPC_MESSAGE_GET_STRING(&insert_text));
-		JSONRPC_MESSAGE_PARSE(member, "insertTextFormat", JSONRPC_MESSAGE_GET_INT64(&format));
-
-		if (!server->config.autocomplete_use_snippets && format == 2 &&
+		JSONRPC_MESSAGE_PARSE_MEMBERS(member,
+			"kind", JSONRPC_MESSAGE_GET_INT64(&kind),
+			"insertText", JSONRPC_MESSAGE_GET_STRING(&insert_text),
+			"insertTextFormat", JSONRPC_MESSAGE_GET_INT64(&format),
+			"label", JSONRPC_MESSAGE_GET_STRING(&label),
+			"sortText", JSONRPC_MESSAGE_GET_STRING(&sort_text),
+			"filterText", JSONRPC_MESSAGE_GET_STRING(&filter_text),
+			"textEdit", JSONRPC_MESSAGE_GET_VARIANT(&text_edit));
+
+		if ((kind == LspCompletionKindSnippet && !server->config.autocomplete_use_snippets) ||
+			(!server->config.autocomplete_use_snippets && format == 2 &&
 			// Lua server flags as snippet without actually being a snippet
-			insert_text && strchr(insert_text, '$'))
+			insert_text && strchr(insert_text, '$')))
 		{
+			if (text_edit)
+				g_variant_unref(text_edit);
 			g_variant_unref(member);
 			continue;
 		}
 
-		JSONRPC_MESSAGE_PARSE(member, "label", JSONRPC_MESSAGE_GET_STRING(&label));
-		JSONRPC_MESSAGE_PARSE(member, "sortText", JSONRPC_MESSAGE_GET_STRING(&sort_text));
-		JSONRPC_MESSAGE_PARSE(member, "filterText", JSONRPC_MESSAGE_GET_STRING(&filter_text));
-		JSONRPC_MESSAGE_PARSE(member, "detail", JSONRPC_MESSAGE_GET_STRING(&detail));
-		JSONRPC_MESSAGE_PARSE(member, "textEdit", JSONRPC_MESSAGE_GET_VARIANT(&text_edit));
-		JSONRPC_MESSAGE_PARSE(member, "additionalTextEdits", JSONRPC_MESSAGE_GET_ITER(&additional_edits));
-
-		if (!JSONRPC_MESSAGE_PARSE(member, "documentation", JSONRPC_MESSAGE_GET_STRING(&documentation)))
-		{
-			JSONRPC_MESSAGE_PARSE(member, "documentation", "{",
-				"value", JSONRPC_MESSAGE_GET_STRING(&documentation),
-			"}");
-		}
+		// only edits with range are used (see lsp_utils_parse_text_edit())
+		JSONRPC_MESSAGE_PARSE_MEMBERS(text_edit,
+			"newText", JSONRPC_MESSAGE_GET_STRING(&edit_text),
+			"range", JSONRPC_MESSAGE_GET_VARIANT(&edit_range));
 
 		sym = g_new0(LspAutocompleteSymbol, 1);
 		sym->label = g_strdup(label);
 		sym->insert_text = g_strdup(insert_text);
+		sym->edit_text = edit_range ? g_strdup(edit_text) : NULL;
 		sym->sort_text = g_strdup(sort_text);
-		sym->detail = g_strdup(detail);
-		sym->documentation = g_strdup(documentation);
+		sym->filter_text = g_strdup(filter_text);
 		sym->kind = kind;
-		sym->text_edit = lsp_utils_parse_text_edit(text_edit);
-		sym->additional_edits = lsp_utils_parse_text_edits(additional_edits);
 		sym->is_snippet = (format == 2);
 		sym->raw_symbol = member;
+		init_symbol_keys(server, sym);
 
 		g_ptr_array_add(symbols, sym);
 
+		if (edit_range)
+			g_variant_unref(edit_range);
 		if (text_edit)
 			g_variant_unref(text_edit);
-
-		if (additional_edits)
-			g_variant_iter_free(additional_edits);
 	}
 
 	/* sort based on sorting provided by LSP server */
 	g_ptr_array_sort_with_data(symbols, sort_autocomplete_symbols, &sort_data);
-
-	symbols_filtered = g_ptr_array_new_full(symbols->len, free_autocomplete_symbol);
-	entry_set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-	if (prefixlen > 0)
-		sort_data.prefix = sci_get_contents_range(sci, pos - prefixlen, pos);
-
-	/* remove duplicates and items not matching filtering criteria */
 	for (i = 0; i < symbols->len; i++)
-	{
-		LspAutocompleteSymbol *sym = symbols->pdata[i];
-		gchar *display_label = get_symbol_label(server, sym);
+		((LspAutocompleteSymbol *)symbols->pdata[i])->order = i;
 
-		if (g_hash_table_contains(entry_set, display_label) ||
-			filter_autocomplete_symbols(sym, sort_data.prefix, sort_data.use_label))
-		{
-			free_autocomplete_symbol(sym);
-			g_free(display_label);
-		}
-		else
-		{
-			g_ptr_array_add(symbols_filtered, sym);
-			g_hash_table_insert(entry_set, display_label, NULL);
-		}
-	}
-
-	g_ptr_array_free(symbols, TRUE);
-	symbols = symbols_filtered;
-
-	sort_data.pass = 2;
-	/* sort with symbols matching the typed prefix first */
-	g_ptr_array_sort_with_data(symbols, sort_autocomplete_symbols, &sort_data);
+	cache.symbols = symbols;
+	cache.server = server;
+	cache.doc_id = doc->id;
+	cache.anchor = data->anchor;
+	cache.prefix = g_strdup(data->prefix);
+	cache.pos = data->pos;
+	cache.is_incomplete = is_incomplete;
 
-	if (should_add(symbols, sort_data.prefix))
-		show_tags_list(server, doc, symbols);
-	else
-	{
-		g_ptr_array_free(symbols, TRUE);
-		SSM(doc->editor->sci, SCI_AUTOCCANCEL, 0, 0);
-	}
+	show_cached_symbols(server, doc);
 
 	g_variant_iter_free(iter);
-	g_hash_table_destroy(entry_set);
-	g_free(sort_data.prefix);
 }
 
 
 static void autocomplete_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
+	LspAutocompleteAsyncData *data = user_data;
+
 	if (!error)
 	{
 		GeanyDocument *current_doc = document_get_current();
-		LspAutocompleteAsyncData *data = user_data;
 		GeanyDocument *doc = data->doc;
 
 		if (current_doc == doc && data->request_id > received_request_id &&
@@ -758,12 +1114,240 @@ static void autocomplete_cb(GVariant *return_value, GError *error, gpointer user
 		{
 			LspServer *srv = lsp_server_get(doc);
 			received_request_id = data->request_id;
-			process_response(srv, return_value, doc);
+			process_response(srv, return_value, data);
+			if (SSM(doc->editor->sci, SCI_AUTOCACTIVE, 0, 0))
+				lsp_timing_record(LSP_TIMING_COMPLETION_POPUP, sci_get_line_count(doc->editor->sci),
+					data->request_time);
 			//printf("%s\n", lsp_utils_json_pretty_print(return_value));
 		}
 	}
 
-	g_free(user_data);
+	g_free(data->prefix);
+	g_free(data);
+}
+
+
+/* The cached list can be used when the server reported it complete and we are
+ * still completing the same identifier, only longer */
+static gboolean can_use_cache(LspServer *server, GeanyDocument *doc, gint anchor, const gchar *prefix)
+{
+	return cache.symbols && !cache.is_incomplete && cache.server == server &&
+		cache.doc_id == doc->id && cache.anchor == anchor &&
+		g_str_has_prefix(prefix, cache.prefix);
+}
+
+
+static void show_prefetched(gint request_id)
+{
+	GeanyDocument *doc = document_get_current();
+	LspAutocompleteAsyncData data = {0};
+	LspServer *srv;
+
+	if (!doc || doc->id != prefetch.doc_id || request_id <= received_request_id ||
+		request_id <= discard_up_to_request_id)
+		return;
+
+	srv = lsp_server_get(doc);
+	if (srv != prefetch.server)
+		return;
+
+	data.doc = doc;
+	data.request_id = request_id;
+	data.anchor = prefetch.anchor;
+	data.prefix = prefetch.prefix;
+	data.pos = prefetch.lsp_pos;
+
+	received_request_id = request_id;
+	process_response(srv, prefetch.response, &data);
+	if (SSM(doc->editor->sci, SCI_AUTOCACTIVE, 0, 0))
+		lsp_timing_record(LSP_TIMING_COMPLETION_POPUP, sci_get_line_count(doc->editor->sci),
+			prefetch.request_time);
+}
+
+
+static void prefetch_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	gboolean is_incomplete = FALSE;
+	gint request_id;
+
+	if (GPOINTER_TO_UINT(user_data) != prefetch.id)
+		return;
+
+	if (!error && return_value)
+	{
+		JSONRPC_MESSAGE_PARSE(return_value,
+			"isIncomplete", JSONRPC_MESSAGE_GET_BOOLEAN(&is_incomplete));
+	}
+
+	prefetch.request = 0;
+	// an incomplete list can't be filtered for the identifier typed further
+	if (error || !return_value || is_incomplete)
+	{
+		GeanyDocument *doc = document_get_current();
+		LspServer *srv = prefetch.server;
+		gboolean waiting = prefetch.waiting_request_id != 0;
+		guint doc_id = prefetch.doc_id;
+
+		clear_prefetch();
+		// the typed identifier still deserves its completion
+		if (waiting && doc && doc->id == doc_id && lsp_server_get(doc) == srv)
+			lsp_autocomplete_completion(srv, doc, FALSE);
+		return;
+	}
+
+	prefetch.response = g_variant_ref(return_value);
+
+	request_id = prefetch.waiting_request_id;
+	if (request_id != 0)
+	{
+		show_prefetched(request_id);
+		clear_prefetch();
+	}
+}
+
+
+/* Still completing the prefetched identifier, only longer */
+static gboolean is_prefetch_hit(LspServer *server, GeanyDocument *doc, gint anchor, const gchar *prefix)
+{
+	return prefetch.server == server && prefetch.doc_id == doc->id &&
+		prefetch.anchor == anchor && g_str_has_prefix(prefix, prefetch.prefix);
+}
+
+
+static gboolean use_prefetch(LspServer *server, GeanyDocument *doc, gint anchor, const gchar *prefix)
+{
+	gint request_id;
+
+	if (prefetch.id == 0)
+		return FALSE;
+
+	if (!is_prefetch_hit(server, doc, anchor, prefix))
+	{
+		lsp_timing_cache_lookup(LSP_TIMING_CACHE_COMPLETION_PREFETCH, FALSE);
+		clear_prefetch();
+		return FALSE;
+	}
+
+	lsp_timing_cache_lookup(LSP_TIMING_CACHE_COMPLETION_PREFETCH, TRUE);
+	// any response still on the way would be for an older position
+	lsp_autocomplete_discard_pending_requests();
+	request_id = ++sent_request_id;
+
+	if (prefetch.response)
+	{
+		prefetch.request_time = g_get_monotonic_time();
+		show_prefetched(request_id);
+		clear_prefetch();
+	}
+	else
+		prefetch.waiting_request_id = request_id;
+
+	return TRUE;
+}
+
+
+/* Length of the identifier right before the caret if the caret isn't inside
+ * a word, string or comment, 0 otherwise */
+static gint get_prefetch_prefixlen(LspServer *srv, GeanyDocument *doc, gint pos)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	gint pos_before = SSM(sci, SCI_POSITIONBEFORE, pos, 0);
+	gint lexer = sci_get_lexer(sci);
+	gint style = sci_get_style_at(sci, pos_before);
+	gchar next_c = sci_get_char_at(sci, pos);
+
+	if (pos == 0 || highlighting_is_string_style(lexer, style) ||
+		highlighting_is_comment_style(lexer, style))
+		return 0;
+
+	if (next_c != '\0' && strchr(srv->config.word_chars, next_c))
+		return 0;
+
+	return get_ident_prefixlen(srv->config.word_chars, doc, pos);
+}
+
+
+/* Requests the same completion as if it was invoked manually at the caret -
+ * the server's document isn't touched so the request is as cheap as any
+ * other background request */
+static void send_prefetch(LspServer *srv, GeanyDocument *doc, gint pos, gint prefixlen)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	LspPosition lsp_pos = lsp_utils_scintilla_pos_to_lsp(sci, pos);
+	const gchar *context_keys[] = {"triggerKind", "triggerCharacter"};
+	GVariant *context_values[2];
+	GVariant *node;
+	gchar *doc_uri;
+
+	doc_uri = lsp_utils_get_doc_uri(doc);
+	context_values[0] = g_variant_new_int32(1);
+	context_values[1] = g_variant_new_maybe(G_VARIANT_TYPE_STRING, NULL);
+	node = lsp_utils_new_text_document_position(doc_uri, lsp_pos, "context",
+		lsp_utils_new_vardict(2, context_keys, context_values));
+
+	prefetch.id = ++last_prefetch_id;
+	prefetch.server = srv;
+	prefetch.doc_id = doc->id;
+	prefetch.anchor = pos - prefixlen;
+	prefetch.prefix = sci_get_contents_range(sci, pos - prefixlen, pos);
+	prefetch.lsp_pos = lsp_pos;
+	prefetch.request_time = g_get_monotonic_time();
+	prefetch.request = lsp_rpc_call_background(srv, "textDocument/completion", node,
+		prefetch_cb, GUINT_TO_POINTER(prefetch.id));
+
+	g_free(doc_uri);
+	g_variant_unref(node);
+}
+
+
+static gboolean prefetch_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get_if_running(doc);
+	ScintillaObject *sci;
+	gboolean is_cached;
+	gchar *prefix;
+	gint prefixlen;
+	gint pos;
+
+	prefetch_source = 0;
+
+	if (!srv || !srv->config.autocomplete_enable || !srv->config.autocomplete_prefetch_enable ||
+		!lsp_sync_is_document_open(srv, doc) || lsp_rpc_is_degraded(srv))
+		return G_SOURCE_REMOVE;
+
+	sci = doc->editor->sci;
+	pos = sci_get_current_position(sci);
+	if (sci_has_selection(sci) || SSM(sci, SCI_AUTOCACTIVE, 0, 0))
+		return G_SOURCE_REMOVE;
+
+	prefixlen = get_prefetch_prefixlen(srv, doc, pos);
+	if (prefixlen == 0)
+		return G_SOURCE_REMOVE;
+
+	prefix = sci_get_contents_range(sci, pos - prefixlen, pos);
+	is_cached = can_use_cache(srv, doc, pos - prefixlen, prefix) ||
+		(prefetch.id != 0 && is_prefetch_hit(srv, doc, pos - prefixlen, prefix) &&
+		g_strcmp0(prefix, prefetch.prefix) == 0);
+	g_free(prefix);
+
+	if (!is_cached)
+	{
+		clear_prefetch();
+		send_prefetch(srv, doc, pos, prefixlen);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Requests completion of the identifier before the caret once the caret stops
+ * moving so the list shows instantly when the identifier is typed further */
+void lsp_autocomplete_schedule_prefetch(G_GNUC_UNUSED GeanyDocument *doc)
+{
+	if (prefetch_source != 0)
+		g_source_remove(prefetch_source);
+	prefetch_source = plugin_timeout_add(geany_plugin, COMPLETION_PREFETCH_DELAY, prefetch_idle, NULL);
 }
 
 
@@ -813,6 +1397,9 @@ void lsp_autocomplete_completion(LspServer *server, GeanyDocument *doc, gboolean
 	gchar c = pos > 0 ? sci_get_char_at(sci, pos_before) : '\0';
 	gchar c_str[2] = {c, '\0'};
 	gint prefixlen = get_ident_prefixlen(server->config.word_chars, doc, pos);
+	gchar *prefix;
+	const gchar *context_keys[] = {"triggerKind", "triggerCharacter"};
+	GVariant *context_values[2];
 
 	// also check position before the just typed characters (i.e. 2 positions
 	// before pos) - at least for Python comments typing at EOL probably doesn't
@@ -881,28 +1468,44 @@ void lsp_autocomplete_completion(LspServer *server, GeanyDocument *doc, gboolean
 		}
 	}
 
+	prefix = sci_get_contents_range(sci, pos - prefixlen, pos);
+	if (!force && can_use_cache(server, doc, pos - prefixlen, prefix))
+	{
+		lsp_timing_cache_lookup(LSP_TIMING_CACHE_COMPLETION, TRUE);
+		// any response still on the way would be older than the cached list
+		lsp_autocomplete_discard_pending_requests();
+		show_cached_symbols(server, doc);
+		g_free(prefix);
+		return;
+	}
+
+	if (!force && use_prefetch(server, doc, pos - prefixlen, prefix))
+	{
+		g_free(prefix);
+		return;
+	}
+
+	lsp_timing_cache_lookup(LSP_TIMING_CACHE_COMPLETION, FALSE);
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
-	node = JSONRPC_MESSAGE_NEW (
-		"textDocument", "{",
-			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-		"}",
-		"position", "{",
-			"line", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.line),
-			"character", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.character),
-		"}",
-		"context", "{",
-			"triggerKind", JSONRPC_MESSAGE_PUT_INT32(is_trigger_char ? 2 : 1),
-			"triggerCharacter", JSONRPC_MESSAGE_PUT_STRING(is_trigger_char ? c_str : NULL),
-		"}"
-	);
+	context_values[0] = g_variant_new_int32(is_trigger_char ? 2 : 1);
+	context_values[1] = is_trigger_char ? g_variant_new_string(c_str) :
+		g_variant_new_maybe(G_VARIANT_TYPE_STRING, NULL);
+	node = lsp_utils_new_text_document_position(doc_uri, lsp_pos, "context",
+		lsp_utils_new_vardict(2, context_keys, context_values));
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 	data = g_new0(LspAutocompleteAsyncData, 1);
 	data->doc = doc;
 	data->request_id = ++sent_request_id;
-
-	lsp_rpc_call(server, "textDocument/completion", node,
+	data->anchor = pos - prefixlen;
+	data->prefix = prefix;
+	data->pos = lsp_pos;
+	data->request_time = g_get_monotonic_time();
+
+	// the previous result would be discarded anyway
+	lsp_rpc_cancel(pending_request);
+	pending_request = lsp_rpc_call(server, "textDocument/completion", node,
 		autocomplete_cb, data);
 
 	g_free(doc_uri);
@@ -24,6 +24,7 @@
 void lsp_autocomplete_style_init(GeanyDocument *doc);
 
 void lsp_autocomplete_completion(LspServer *server, GeanyDocument *doc, gboolean force);
+void lsp_autocomplete_schedule_prefetch(GeanyDocument *doc);
 
 void lsp_autocomplete_set_displayed_symbols(GPtrArray *symbols);
 void lsp_autocomplete_item_selected(LspServer *server, GeanyDocument *doc, guint index);
@@ -31,4 +32,6 @@ void lsp_autocomplete_selection_changed(GeanyDocument *doc, const gchar *text);
 void lsp_autocomplete_discard_pending_requests();
 void lsp_autocomplete_clear_statusbar(void);
 
+void lsp_autocomplete_drop_cache(void);
+
 #endif  /* LSP_AUTOCOMPLETE_H */
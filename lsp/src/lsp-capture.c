@@ -0,0 +1,232 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+/* Session capture for replaying the traffic outside of Geany. The file
+ * contains one JSON object per line; the first one describes the capture:
+ *
+ *   {"capture": 1, "server": "clangd", "start": <real time in µs>}
+ *
+ * and every following one a single message:
+ *
+ *   {"time": <µs since start>, "from": "client" | "server",
+ *    "type": "request" | "notification" | "response",
+ *    "method": "...", "id": <int or string>,
+ *    "params" | "result": <JSON>, "error": {"code": <int>, "message": "..."}}
+ *
+ * "id" is present for requests and responses; responses carry the method of
+ * the request they answer. Client request ids are those used on the wire so
+ * a mock server can match them. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-capture.h"
+
+#include <geanyplugin.h>
+#include <json-glib/json-glib.h>
+#include <string.h>
+
+
+struct LspCapture
+{
+	GOutputStream *stream;
+	gint64 start_time;
+};
+
+
+LspCapture *lsp_capture_start(const gchar *path, const gchar *server_cmd)
+{
+	GFile *fp = g_file_new_for_path(path);
+	GFileOutputStream *file_stream;
+	LspCapture *capture = NULL;
+
+	file_stream = g_file_replace(fp, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL);
+	if (file_stream)
+	{
+		JsonBuilder *builder = json_builder_new();
+		JsonNode *root;
+		gchar *line;
+
+		capture = g_new0(LspCapture, 1);
+		// messages are written synchronously, buffering keeps it cheap
+		capture->stream = g_buffered_output_stream_new_sized(G_OUTPUT_STREAM(file_stream), 256 * 1024);
+		capture->start_time = g_get_monotonic_time();
+		g_object_unref(file_stream);
+
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "capture");
+		json_builder_add_int_value(builder, 1);
+		json_builder_set_member_name(builder, "server");
+		json_builder_add_string_value(builder, server_cmd ? server_cmd : "");
+		json_builder_set_member_name(builder, "start");
+		json_builder_add_int_value(builder, g_get_real_time());
+		json_builder_end_object(builder);
+
+		root = json_builder_get_root(builder);
+		line = json_to_string(root, FALSE);
+		g_output_stream_printf(capture->stream, NULL, NULL, NULL, "%s\n", line);
+
+		g_free(line);
+		json_node_unref(root);
+		g_object_unref(builder);
+	}
+	else
+		msgwin_status_add(_("Failed to create capture file: %s"), path);
+
+	g_object_unref(fp);
+
+	return capture;
+}
+
+
+void lsp_capture_stop(LspCapture *capture)
+{
+	if (!capture)
+		return;
+
+	g_output_stream_close(capture->stream, NULL, NULL);
+	g_object_unref(capture->stream);
+	g_free(capture);
+}
+
+
+static JsonNode *build_message(LspCapture *capture, LspCaptureType type, const gchar *method,
+	GVariant *id, GVariant *payload, GError *error)
+{
+	gboolean from_client = type <= LspCaptureClientResponse;
+	JsonBuilder *builder = json_builder_new();
+	const gchar *type_str;
+	JsonNode *root;
+
+	switch (type)
+	{
+		case LspCaptureClientRequest:
+		case LspCaptureServerRequest:
+			type_str = "request";
+			break;
+		case LspCaptureClientNotification:
+		case LspCaptureServerNotification:
+			type_str = "notification";
+			break;
+		default:
+			type_str = "response";
+			break;
+	}
+
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "time");
+	json_builder_add_int_value(builder, g_get_monotonic_time() - capture->start_time);
+	json_builder_set_member_name(builder, "from");
+	json_builder_add_string_value(builder, from_client ? "client" : "server");
+	json_builder_set_member_name(builder, "type");
+	json_builder_add_string_value(builder, type_str);
+	json_builder_set_member_name(builder, "method");
+	json_builder_add_string_value(builder, method ? method : "");
+
+	if (id)
+	{
+		json_builder_set_member_name(builder, "id");
+		json_builder_add_value(builder, json_gvariant_serialize(id));
+	}
+
+	if (error)
+	{
+		json_builder_set_member_name(builder, "error");
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "code");
+		json_builder_add_int_value(builder, error->code);
+		json_builder_set_member_name(builder, "message");
+		json_builder_add_string_value(builder, error->message);
+		json_builder_end_object(builder);
+	}
+	else
+	{
+		json_builder_set_member_name(builder, g_strcmp0(type_str, "response") == 0 ? "result" : "params");
+		if (payload)
+			json_builder_add_value(builder, json_gvariant_serialize(payload));
+		else
+			json_builder_add_null_value(builder);
+	}
+
+	json_builder_end_object(builder);
+
+	root = json_builder_get_root(builder);
+	g_object_unref(builder);
+
+	return root;
+}
+
+
+/* id and payload may be NULL; for responses, payload is the result */
+void lsp_capture_message(LspCapture *capture, LspCaptureType type, const gchar *method,
+	GVariant *id, GVariant *payload, GError *error)
+{
+	JsonNode *root;
+	gchar *line;
+
+	if (!capture)
+		return;
+
+	root = build_message(capture, type, method, id, payload, error);
+	line = json_to_string(root, FALSE);
+	g_output_stream_printf(capture->stream, NULL, NULL, NULL, "%s\n", line);
+
+	g_free(line);
+	json_node_unref(root);
+}
+
+
+/* Captures a client notification whose params contain the placeholder string
+ * standing for text (see lsp_rpc_notify_with_text()) */
+void lsp_capture_message_with_text(LspCapture *capture, const gchar *method, GVariant *params,
+	const gchar *placeholder, const gchar *text, gsize text_len)
+{
+	gchar *quoted_placeholder, *line, *pos;
+	JsonNode *root, *text_node;
+
+	if (!capture)
+		return;
+
+	root = build_message(capture, LspCaptureClientNotification, method, NULL, params, NULL);
+	line = json_to_string(root, FALSE);
+	json_node_unref(root);
+
+	quoted_placeholder = g_strconcat("\"", placeholder, "\"", NULL);
+	pos = strstr(line, quoted_placeholder);
+	if (pos)
+	{
+		gchar *text_copy = g_strndup(text, text_len);
+		gchar *quoted_text;
+
+		text_node = json_node_init_string(json_node_alloc(), text_copy);
+		quoted_text = json_to_string(text_node, FALSE);
+
+		*pos = '\0';
+		g_output_stream_printf(capture->stream, NULL, NULL, NULL, "%s%s%s\n", line, quoted_text,
+			pos + strlen(quoted_placeholder));
+
+		g_free(quoted_text);
+		json_node_unref(text_node);
+		g_free(text_copy);
+	}
+	else
+		g_output_stream_printf(capture->stream, NULL, NULL, NULL, "%s\n", line);
+
+	g_free(quoted_placeholder);
+	g_free(line);
+}
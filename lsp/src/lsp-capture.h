@@ -0,0 +1,48 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+#ifndef LSP_CAPTURE_H
+#define LSP_CAPTURE_H 1
+
+#include <glib.h>
+
+
+typedef enum
+{
+	LspCaptureClientRequest,
+	LspCaptureClientNotification,
+	LspCaptureClientResponse,
+
+	LspCaptureServerRequest,
+	LspCaptureServerNotification,
+	LspCaptureServerResponse
+} LspCaptureType;
+
+
+struct LspCapture;
+typedef struct LspCapture LspCapture;
+
+
+LspCapture *lsp_capture_start(const gchar *path, const gchar *server_cmd);
+void lsp_capture_stop(LspCapture *capture);
+
+void lsp_capture_message(LspCapture *capture, LspCaptureType type, const gchar *method,
+	GVariant *id, GVariant *payload, GError *error);
+void lsp_capture_message_with_text(LspCapture *capture, const gchar *method, GVariant *params,
+	const gchar *placeholder, const gchar *text, gsize text_len);
+
+#endif  /* LSP_CAPTURE_H */
@@ -25,15 +25,42 @@
 #include "lsp-rpc.h"
 #include "lsp-sync.h"
 #include "lsp-command.h"
-#include "lsp-utils.h"
+#include "lsp-inlay-hints.h"
 
 #include <jsonrpc-glib.h>
+#include <string.h>
+
+#define ANNOTATIONS_KEY "lsp_code_lens_annotations"
+
+
+typedef struct {
+	GeanyDocument *doc;
+	guint version;
+	gint line;  /* of the resolved lens */
+} LspCodeLensData;
+
+
+typedef struct {
+	gint line;
+	GVariant *code_lens;
+} LspUnresolvedLens;
 
 
 extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
 static GPtrArray *commands;
+static GPtrArray *unresolved;  /* LspUnresolvedLens of lens_doc, resolved when shown */
+static GeanyDocument *lens_doc;
+static guint lens_version;
+static guint viewport_source;
+
+
+static void unresolved_lens_free(LspUnresolvedLens *lens)
+{
+	g_variant_unref(lens->code_lens);
+	g_free(lens);
+}
 
 
 static void set_color(LspServer *srv, GeanyDocument *doc)
@@ -102,6 +129,8 @@ void lsp_code_lens_style_init(GeanyDocument *doc)
 
 	if (!commands)
 		commands = g_ptr_array_new_full(0, (GDestroyNotify)lsp_command_free);
+	if (!unresolved)
+		unresolved = g_ptr_array_new_full(0, (GDestroyNotify)unresolved_lens_free);
 }
 
 
@@ -113,38 +142,259 @@ static void add_annotation(ScintillaObject *sci, gint line, const gchar *text)
 }
 
 
+static void update_line(ScintillaObject *sci, gint line, const gchar *text)
+{
+	gint len = SSM(sci, SCI_EOLANNOTATIONGETTEXT, line, 0);
+
+	if (!text && len == 0)
+		return;
+
+	if (text && len == (gint)strlen(text))
+	{
+		gchar *old_text = g_malloc0(len + 1);
+		gboolean same;
+
+		SSM(sci, SCI_EOLANNOTATIONGETTEXT, line, (sptr_t)old_text);
+		same = strcmp(old_text, text) == 0;
+		g_free(old_text);
+
+		if (same)
+			return;
+	}
+
+	if (text)
+		add_annotation(sci, line, text);
+	else
+		SSM(sci, SCI_EOLANNOTATIONSETTEXT, line, (sptr_t)NULL);
+}
+
+
+/* touches only the lines whose annotation differs from the text in line_texts;
+ * only the lines annotated last time and now are visited unless lines were
+ * added or removed in between, which moves the annotations */
+static void update_annotations(ScintillaObject *sci, GHashTable *line_texts)
+{
+	GHashTable *prev_texts = g_object_get_data(G_OBJECT(sci), ANNOTATIONS_KEY);
+	GHashTableIter iter;
+	gpointer line, text;
+
+	if (prev_texts)
+	{
+		g_hash_table_iter_init(&iter, prev_texts);
+		while (g_hash_table_iter_next(&iter, &line, NULL))
+		{
+			if (!g_hash_table_contains(line_texts, line))
+				update_line(sci, GPOINTER_TO_INT(line), NULL);
+		}
+
+		g_hash_table_iter_init(&iter, line_texts);
+		while (g_hash_table_iter_next(&iter, &line, &text))
+			update_line(sci, GPOINTER_TO_INT(line), text);
+	}
+	else
+	{
+		gint line_count = sci_get_line_count(sci);
+		gint i;
+
+		for (i = 0; i < line_count; i++)
+			update_line(sci, i, g_hash_table_lookup(line_texts, GINT_TO_POINTER(i)));
+	}
+
+	g_object_set_data_full(G_OBJECT(sci), ANNOTATIONS_KEY, g_hash_table_ref(line_texts),
+		(GDestroyNotify)g_hash_table_unref);
+}
+
+
+void lsp_code_lens_text_modified(GeanyDocument *doc, gint lines_added)
+{
+	if (lines_added != 0)
+		g_object_set_data(G_OBJECT(doc->editor->sci), ANNOTATIONS_KEY, NULL);
+}
+
+
+static void append_title(GString *str, const gchar *title)
+{
+	if (str->len == 0)
+		g_string_append(str, _("LSP Commands: "));
+	else
+		g_string_append(str, " | ");
+	g_string_append(str, title);
+}
+
+
+/* GHashTable<line, annotation text> of the current commands and inlay hints
+ * of doc - a line has a single end-of-line annotation shared by both */
+static GHashTable *get_line_texts(GeanyDocument *doc)
+{
+	GHashTable *strings = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)g_free);
+	GHashTable *hints = lsp_inlay_hints_get_line_texts(doc);
+	LspCommand *cmd;
+	guint i;
+
+	foreach_ptr_array(cmd, i, commands)
+	{
+		gchar *text;
+		GString *str;
+
+		if (doc != lens_doc)
+			break;
+
+		text = g_hash_table_lookup(strings, GUINT_TO_POINTER(cmd->line));
+		str = g_string_new(text);
+		append_title(str, cmd->title);
+		g_hash_table_insert(strings, GUINT_TO_POINTER(cmd->line), g_string_free(str, FALSE));
+	}
+
+	if (hints)
+	{
+		GHashTableIter iter;
+		gpointer line, hint;
+
+		g_hash_table_iter_init(&iter, hints);
+		while (g_hash_table_iter_next(&iter, &line, &hint))
+		{
+			gchar *text = g_hash_table_lookup(strings, line);
+
+			text = text ? g_strconcat(hint, "    ", text, NULL) : g_strdup(hint);
+			g_hash_table_insert(strings, line, text);
+		}
+	}
+
+	return strings;
+}
+
+
+static LspCommand *parse_command(GVariant *code_lens, gint line_num)
+{
+	const gchar *title = NULL;
+	const gchar *command = NULL;
+	GVariant *arguments = NULL;
+	LspCommand *cmd;
+
+	if (!JSONRPC_MESSAGE_PARSE(code_lens,
+		"command", "{",
+			"title", JSONRPC_MESSAGE_GET_STRING(&title),
+			"command", JSONRPC_MESSAGE_GET_STRING(&command),
+		"}"))
+	{
+		return NULL;
+	}
+
+	JSONRPC_MESSAGE_PARSE (code_lens,
+		"command", "{",
+			"arguments", JSONRPC_MESSAGE_GET_VARIANT(&arguments),
+		"}"
+	);
+
+	cmd = g_new0(LspCommand, 1);
+	cmd->line = line_num;
+	cmd->title = g_strdup(title);
+	cmd->command = g_strdup(command);
+	cmd->arguments = arguments;
+
+	return cmd;
+}
+
+
+static gboolean is_current(GeanyDocument *doc, guint version)
+{
+	LspServer *srv = DOC_VALID(doc) ? lsp_server_get_if_running(doc) : NULL;
+
+	return srv && doc == lens_doc && lsp_sync_peek_doc_version(srv, doc) == version;
+}
+
+
+static void resolve_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	LspCodeLensData *data = user_data;
+	GeanyDocument *doc = data->doc;
+
+	if (!error && is_current(doc, data->version))
+	{
+		LspCommand *cmd = parse_command(return_value, data->line);
+
+		if (cmd)
+		{
+			GHashTable *line_texts;
+
+			g_ptr_array_add(commands, cmd);
+
+			line_texts = get_line_texts(doc);
+			update_annotations(doc->editor->sci, line_texts);
+			g_hash_table_unref(line_texts);
+		}
+	}
+
+	g_free(data);
+}
+
+
+/* resolves lenses without command once they become visible */
+static void resolve_visible(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	ScintillaObject *sci = doc->editor->sci;
+	gint first_line, last_line;
+	guint i;
+
+	if (!srv || !unresolved || unresolved->len == 0 || doc != lens_doc)
+		return;
+
+	first_line = SSM(sci, SCI_DOCLINEFROMVISIBLE, SSM(sci, SCI_GETFIRSTVISIBLELINE, 0, 0), 0);
+	last_line = first_line + SSM(sci, SCI_LINESONSCREEN, 0, 0);
+
+	for (i = 0; i < unresolved->len; )
+	{
+		LspUnresolvedLens *lens = unresolved->pdata[i];
+
+		if (lens->line >= first_line && lens->line <= last_line)
+		{
+			LspCodeLensData *data = g_new0(LspCodeLensData, 1);
+
+			data->doc = doc;
+			data->version = lens_version;
+			data->line = lens->line;
+			lsp_rpc_call_background(srv, "codeLens/resolve", lens->code_lens, resolve_cb, data);
+
+			g_ptr_array_remove_index_fast(unresolved, i);
+		}
+		else
+			i++;
+	}
+}
+
+
 static void code_lens_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
-	GeanyDocument *doc = user_data;
+	LspCodeLensData *data = user_data;
+	GeanyDocument *doc = data->doc;
 	LspServer *srv;
 
 	srv = DOC_VALID(doc) ? lsp_server_get(doc) : NULL;
 
-	if (!error && srv && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
+	if (!error && srv && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY) &&
+		!lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/codeLens"))
 	{
-		GVariant *code_action = NULL;
-		gint last_line = 0;
+		GVariant *code_lens = NULL;
+		GHashTable *line_texts;
 		GVariantIter iter;
-		GString *str;
 
 		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
-		SSM(doc->editor->sci, SCI_EOLANNOTATIONCLEARALL, 0, 0);
-
-		str = g_string_new(NULL);
+		g_ptr_array_set_size(commands, 0);
+		g_ptr_array_set_size(unresolved, 0);
+		lens_doc = doc;
+		lens_version = data->version;
 
 		g_variant_iter_init(&iter, return_value);
 
-		while (g_variant_iter_loop(&iter, "v", &code_action))
+		while (g_variant_iter_loop(&iter, "v", &code_lens))
 		{
-			const gchar *title = NULL;
-			const gchar *command = NULL;
-			GVariant *arguments = NULL;
 			GVariant *loc_variant = NULL;
 			LspCommand *cmd;
 			gint line_num = 0;
 
-			JSONRPC_MESSAGE_PARSE(code_action,
+			JSONRPC_MESSAGE_PARSE(code_lens,
 				"range", JSONRPC_MESSAGE_GET_VARIANT(&loc_variant)
 			);
 
@@ -155,49 +405,65 @@ static void code_lens_cb(GVariant *return_value, GError *error, gpointer user_da
 				g_variant_unref(loc_variant);
 			}
 
-			if (!JSONRPC_MESSAGE_PARSE(code_action,
-				"command", "{",
-					"title", JSONRPC_MESSAGE_GET_STRING(&title),
-					"command", JSONRPC_MESSAGE_GET_STRING(&command),
-				"}"))
+			cmd = parse_command(code_lens, line_num);
+			if (cmd)
+				g_ptr_array_add(commands, cmd);
+			else if (srv->supports_code_lens_resolve)
 			{
-				continue;
+				LspUnresolvedLens *lens = g_new0(LspUnresolvedLens, 1);
+
+				lens->line = line_num;
+				lens->code_lens = g_variant_ref(code_lens);
+				g_ptr_array_add(unresolved, lens);
 			}
+		}
 
-			JSONRPC_MESSAGE_PARSE (code_action,
-				"command", "{",
-					"arguments", JSONRPC_MESSAGE_GET_VARIANT(&arguments),
-				"}"
-			);
+		line_texts = get_line_texts(doc);
+		update_annotations(doc->editor->sci, line_texts);
+		g_hash_table_unref(line_texts);
 
-			cmd = g_new0(LspCommand, 1);
-			cmd->line = line_num;
-			cmd->title = g_strdup(title);
-			cmd->command = g_strdup(command);
-			cmd->arguments = arguments;
+		resolve_visible(doc);
+	}
 
-			if (line_num != last_line && str->len > 0)
-			{
-				add_annotation(doc->editor->sci, last_line, str->str);
-				g_string_set_size(str, 0);
-			}
-			if (str->len == 0)
-				g_string_append(str, _("LSP Commands: "));
-			else
-				g_string_append(str, " | ");
-			g_string_append(str, cmd->title);
-			last_line = line_num;
+	g_free(data);
+}
 
-			g_ptr_array_add(commands, cmd);
-		}
 
-		if (str->len > 0)
-			add_annotation(doc->editor->sci, last_line, str->str);
+static gboolean viewport_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
 
-		g_string_free(str, TRUE);
+	viewport_source = 0;
 
-		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
-	}
+	if (doc)
+		resolve_visible(doc);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+void lsp_code_lens_viewport_changed(GeanyDocument *doc)
+{
+	if (!unresolved || unresolved->len == 0 || doc != lens_doc)
+		return;
+
+	if (viewport_source != 0)
+		g_source_remove(viewport_source);
+	viewport_source = plugin_timeout_add(geany_plugin, 300, viewport_idle, NULL);
+}
+
+
+void lsp_code_lens_update_annotations(GeanyDocument *doc)
+{
+	GHashTable *line_texts;
+
+	lsp_code_lens_style_init(doc);
+	if (!commands)
+		return;
+
+	line_texts = get_line_texts(doc);
+	update_annotations(doc->editor->sci, line_texts);
+	g_hash_table_unref(line_texts);
 }
 
 
@@ -207,17 +473,47 @@ GPtrArray *lsp_code_lens_get_commands(void)
 }
 
 
+/* approximate memory of the code lenses, kept only for the last document they
+ * were received for */
+gsize lsp_code_lens_get_cache_size(GeanyDocument *doc)
+{
+	LspUnresolvedLens *lens;
+	LspCommand *cmd;
+	gsize size = 0;
+	guint i;
+
+	if (doc != lens_doc || !commands)
+		return 0;
+
+	foreach_ptr_array(cmd, i, commands)
+	{
+		size += sizeof(gpointer) + sizeof(LspCommand) + lsp_utils_get_string_size(cmd->title) +
+			lsp_utils_get_string_size(cmd->kind) + lsp_utils_get_string_size(cmd->command) +
+			lsp_utils_get_variant_size(cmd->arguments) + lsp_utils_get_variant_size(cmd->edit) +
+			lsp_utils_get_variant_size(cmd->data);
+	}
+	foreach_ptr_array(lens, i, unresolved)
+		size += sizeof(gpointer) + sizeof(LspUnresolvedLens) + lsp_utils_get_variant_size(lens->code_lens);
+
+	return size;
+}
+
+
 void lsp_code_lens_send_request(GeanyDocument *doc)
 {
 	LspServer *server = lsp_server_get(doc);
+	LspCodeLensData *data;
 	gchar *doc_uri;
 	GVariant *node;
 
 	if (!doc || !doc->real_path || !server)
 		return;
 
-	if (!server->config.code_lens_enable)
+	if (!server->config.code_lens_enable || lsp_server_is_large_file(server, doc) ||
+		lsp_rpc_is_degraded(server))
+	{
 		return;
+	}
 
 	/* set annotation colors every time - Geany doesn't provide any notification
 	 * when color theme changes which also resets colors to some defaults. Even
@@ -238,8 +534,11 @@ void lsp_code_lens_send_request(GeanyDocument *doc)
 			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
 		"}"
 	);
-	lsp_rpc_call(server, "textDocument/codeLens", node,
-		code_lens_cb, doc);
+	data = g_new0(LspCodeLensData, 1);
+	data->doc = doc;
+	data->version = lsp_sync_peek_doc_version(server, doc);
+	lsp_rpc_call_background(server, "textDocument/codeLens", node,
+		code_lens_cb, data);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
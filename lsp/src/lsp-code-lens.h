@@ -25,7 +25,11 @@
 
 void lsp_code_lens_send_request(GeanyDocument *doc);
 void lsp_code_lens_style_init(GeanyDocument *doc);
+void lsp_code_lens_viewport_changed(GeanyDocument *doc);
+void lsp_code_lens_update_annotations(GeanyDocument *doc);
+void lsp_code_lens_text_modified(GeanyDocument *doc, gint lines_added);
 
 GPtrArray *lsp_code_lens_get_commands(void);
+gsize lsp_code_lens_get_cache_size(GeanyDocument *doc);
 
 #endif  /* LSP_CODE_LENS_H */
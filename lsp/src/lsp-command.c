@@ -24,9 +24,13 @@
 #include "lsp-utils.h"
 #include "lsp-rpc.h"
 #include "lsp-diagnostics.h"
+#include "lsp-sync.h"
 
 #include <jsonrpc-glib.h>
 
+#define CODE_ACTION_CACHE_MAX 8
+#define CODE_ACTION_PREFETCH_DELAY 500
+
 
 typedef struct
 {
@@ -40,12 +44,48 @@ typedef struct
 {
 	CodeActionCallback callback;
 	gpointer user_data;
+	GeanyDocument *doc;
+	guint doc_id;
+	guint version;
+	gint start;
+	gint end;
+	GVariant *diag;
+	gboolean cache;
 } CodeActionData;
 
 
+/* code actions for a range at the given document version with the given
+ * diagnostic in the request context (NULL when there was none) */
+typedef struct
+{
+	guint doc_id;
+	guint version;
+	gint start;
+	gint end;
+	GVariant *diag;
+	GPtrArray *actions;  // LspCommand
+} CodeActionCacheEntry;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+static GQueue code_action_cache = G_QUEUE_INIT;  // CodeActionCacheEntry, most recently used first
+static LspRpcRequest pending_prefetch;
+static guint prefetch_source;
+
+
+typedef struct
+{
+	LspCommandResolvedCallback callback;
+	gpointer user_data;
+} ResolveData;
+
+
 void lsp_command_free(LspCommand *cmd)
 {
 	g_free(cmd->title);
+	g_free(cmd->kind);
 	g_free(cmd->command);
 	if (cmd->arguments)
 		g_variant_unref(cmd->arguments);
@@ -57,9 +97,97 @@ void lsp_command_free(LspCommand *cmd)
 }
 
 
+static LspCommand *command_copy(LspCommand *cmd)
+{
+	LspCommand *copy = g_new0(LspCommand, 1);
+
+	copy->line = cmd->line;
+	copy->title = g_strdup(cmd->title);
+	copy->kind = g_strdup(cmd->kind);
+	copy->command = g_strdup(cmd->command);
+	copy->arguments = cmd->arguments ? g_variant_ref(cmd->arguments) : NULL;
+	copy->edit = cmd->edit ? g_variant_ref(cmd->edit) : NULL;
+	copy->data = cmd->data ? g_variant_ref(cmd->data) : NULL;
+
+	return copy;
+}
+
+
+static GPtrArray *commands_copy(GPtrArray *commands)
+{
+	GPtrArray *copy = g_ptr_array_new_full(commands->len, (GDestroyNotify)lsp_command_free);
+	LspCommand *cmd;
+	guint i;
+
+	foreach_ptr_array(cmd, i, commands)
+		g_ptr_array_add(copy, command_copy(cmd));
+
+	return copy;
+}
+
+
+static void cache_entry_free(CodeActionCacheEntry *entry)
+{
+	if (entry->diag)
+		g_variant_unref(entry->diag);
+	g_ptr_array_free(entry->actions, TRUE);
+	g_free(entry);
+}
+
+
+static CodeActionCacheEntry *find_cached(GeanyDocument *doc, guint version, gint start, gint end,
+	GVariant *diag)
+{
+	GList *node;
+
+	for (node = code_action_cache.head; node; node = node->next)
+	{
+		CodeActionCacheEntry *entry = node->data;
+
+		if (entry->doc_id == doc->id && entry->version == version &&
+			entry->start == start && entry->end == end &&
+			(entry->diag == diag || (entry->diag && diag && g_variant_equal(entry->diag, diag))))
+		{
+			// most recently used first
+			g_queue_unlink(&code_action_cache, node);
+			g_queue_push_head_link(&code_action_cache, node);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void add_cached(CodeActionData *data, GPtrArray *actions)
+{
+	CodeActionCacheEntry *entry = find_cached(data->doc, data->version, data->start, data->end, data->diag);
+
+	if (entry)
+	{
+		g_ptr_array_free(entry->actions, TRUE);
+		entry->actions = commands_copy(actions);
+		return;
+	}
+
+	entry = g_new0(CodeActionCacheEntry, 1);
+	entry->doc_id = data->doc_id;
+	entry->version = data->version;
+	entry->start = data->start;
+	entry->end = data->end;
+	entry->diag = data->diag ? g_variant_ref(data->diag) : NULL;
+	entry->actions = commands_copy(actions);
+	g_queue_push_head(&code_action_cache, entry);
+
+	if (code_action_cache.length > CODE_ACTION_CACHE_MAX)
+		cache_entry_free(g_queue_pop_tail(&code_action_cache));
+}
+
+
 static LspCommand *parse_code_action(GVariant *code_action)
 {
 	const gchar *title = NULL;
+	const gchar *kind = NULL;
 	const gchar *command = NULL;
 	GVariant *arguments = NULL;
 	GVariant *edit = NULL;
@@ -109,10 +237,15 @@ static LspCommand *parse_code_action(GVariant *code_action)
 		JSONRPC_MESSAGE_PARSE(code_action,
 			"data", JSONRPC_MESSAGE_GET_VARIANT(&data)
 		);
+
+		JSONRPC_MESSAGE_PARSE(code_action,
+			"kind", JSONRPC_MESSAGE_GET_STRING(&kind)
+		);
 	}
 
 	cmd = g_new0(LspCommand, 1);
 	cmd->title = g_strdup(title);
+	cmd->kind = g_strdup(kind);
 	cmd->command = g_strdup(command);
 	cmd->arguments = arguments;
 	cmd->edit = edit;
@@ -124,38 +257,24 @@ static LspCommand *parse_code_action(GVariant *code_action)
 
 static void resolve_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
-	CommandData *data = user_data;
-	gboolean performed = FALSE;
-
-	if (!error && data->doc == document_get_current())
-	{
-		LspServer *server = lsp_server_get_if_running(data->doc);
-
-		if (server)
-		{
-			LspCommand *cmd = parse_code_action(return_value);
-
-			if (cmd && (cmd->command || cmd->edit))
-			{
-				lsp_command_perform(server, cmd, data->callback, data->user_data);
-				performed = TRUE;
-			}
-		}
+	ResolveData *data = user_data;
+	LspCommand *cmd = NULL;
 
-		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
-	}
+	if (!error && return_value)
+		cmd = parse_code_action(return_value);
 
-	if (!performed)
-		data->callback(data->user_data);
+	//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
+	data->callback(cmd, data->user_data);
 	g_free(data);
 }
 
 
-static void resolve_code_action(LspServer *server, LspCommand *cmd, LspCallback callback, gpointer user_data)
+void lsp_command_resolve(LspServer *server, LspCommand *cmd, LspCommandResolvedCallback callback,
+	gpointer user_data)
 {
 	GVariant *node;
-	CommandData *data;
+	ResolveData *data;
 
 	if (cmd->data)
 	{
@@ -175,16 +294,51 @@ static void resolve_code_action(LspServer *server, LspCommand *cmd, LspCallback
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	data = g_new0(CommandData, 1);
+	data = g_new0(ResolveData, 1);
 	data->callback = callback;
 	data->user_data = user_data;
-	data->doc = document_get_current();
 	lsp_rpc_call(server, "codeAction/resolve", node, resolve_cb, data);
 
 	g_variant_unref(node);
 }
 
 
+static void resolved_perform_cb(LspCommand *cmd, gpointer user_data)
+{
+	CommandData *data = user_data;
+	gboolean performed = FALSE;
+
+	if (cmd && data->doc == document_get_current())
+	{
+		LspServer *server = lsp_server_get_if_running(data->doc);
+
+		if (server && (cmd->command || cmd->edit))
+		{
+			lsp_command_perform(server, cmd, data->callback, data->user_data);
+			performed = TRUE;
+		}
+	}
+
+	if (!performed && data->callback)
+		data->callback(data->user_data);
+
+	if (cmd)
+		lsp_command_free(cmd);
+	g_free(data);
+}
+
+
+static void resolve_code_action(LspServer *server, LspCommand *cmd, LspCallback callback, gpointer user_data)
+{
+	CommandData *data = g_new0(CommandData, 1);
+
+	data->callback = callback;
+	data->user_data = user_data;
+	data->doc = document_get_current();
+	lsp_command_resolve(server, cmd, resolved_perform_cb, data);
+}
+
+
 static void command_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	CommandData *data = user_data;
@@ -204,7 +358,7 @@ void lsp_command_perform(LspServer *server, LspCommand *cmd, LspCallback callbac
 	}
 
 	if (cmd->edit)
-		lsp_utils_apply_workspace_edit(cmd->edit);
+		lsp_utils_apply_workspace_edit_full(cmd->edit, server->position_encoding, NULL, NULL);
 
 	if (cmd->command)
 	{
@@ -268,41 +422,56 @@ static void code_action_cb(GVariant *return_value, GError *error, gpointer user_
 		}
 	}
 
+	if (!error && data->cache && DOC_VALID(data->doc) && data->doc->id == data->doc_id)
+	{
+		LspServer *srv = lsp_server_get_if_running(data->doc);
+
+		// positions are only meaningful for the version they were taken at
+		if (srv && lsp_sync_peek_doc_version(srv, data->doc) == data->version)
+			add_cached(data, code_actions);
+	}
+
 	if (data->callback(code_actions, data->user_data))
 		g_ptr_array_free(code_actions, TRUE);
 
+	if (data->diag)
+		g_variant_unref(data->diag);
 	g_free(data);
 }
 
 
-void lsp_command_send_code_action_request(GeanyDocument *doc, gint pos, CodeActionCallback actions_resolved_cb, gpointer user_data)
+static void get_request_range(GeanyDocument *doc, gint pos, gchar **only_kinds, gint *start, gint *end)
+{
+	ScintillaObject *sci = doc->editor->sci;
+
+	*start = sci_get_selection_start(sci);
+	*end = sci_get_selection_end(sci);
+
+	if (only_kinds)
+	{
+		*start = 0;
+		*end = sci_get_length(sci);
+	}
+	else if (*start == *end)
+		*start = *end = pos;
+}
+
+
+static LspRpcRequest send_request(LspServer *srv, GeanyDocument *doc, gint pos, gchar **only_kinds,
+	CodeActionCallback actions_resolved_cb, gpointer user_data)
 {
-	LspServer *srv = lsp_server_get_if_running(doc);
 	GVariant *diag_raw = lsp_diagnostics_get_diag_raw(pos);
 	GVariant *node, *diagnostics, *diags_dict;
 	LspPosition lsp_pos_start, lsp_pos_end;
 	gint pos_start, pos_end;
-	ScintillaObject *sci;
+	ScintillaObject *sci = doc->editor->sci;
 	GVariantDict dict;
 	GPtrArray *arr;
 	gchar *doc_uri;
 	CodeActionData *data;
+	LspRpcRequest request;
 
-	if (!srv)
-	{
-		GPtrArray *empty = g_ptr_array_new_full(0, (GDestroyNotify)lsp_command_free);
-		if (actions_resolved_cb(empty, user_data))
-			g_ptr_array_free(empty, TRUE);
-		return;
-	}
-
-	sci = doc->editor->sci;
-
-	pos_start = sci_get_selection_start(sci);
-	pos_end = sci_get_selection_end(sci);
-
-	if (pos_start == pos_end)
-		pos_start = pos_end = pos;
+	get_request_range(doc, pos, only_kinds, &pos_start, &pos_end);
 
 	lsp_pos_start = lsp_utils_scintilla_pos_to_lsp(sci, pos_start);
 	lsp_pos_end = lsp_utils_scintilla_pos_to_lsp(sci, pos_end);
@@ -315,6 +484,16 @@ void lsp_command_send_code_action_request(GeanyDocument *doc, gint pos, CodeActi
 
 	g_variant_dict_init(&dict, NULL);
 	g_variant_dict_insert_value(&dict, "diagnostics", diagnostics);
+	if (only_kinds)
+	{
+		GVariantBuilder builder;
+		gchar **kind;
+
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+		foreach_strv(kind, only_kinds)
+			g_variant_builder_add(&builder, "v", g_variant_new_string(*kind));
+		g_variant_dict_insert_value(&dict, "only", g_variant_builder_end(&builder));
+	}
 	diags_dict = g_variant_take_ref(g_variant_dict_end(&dict));
 
 	doc_uri = lsp_utils_get_doc_uri(doc);
@@ -343,10 +522,102 @@ void lsp_command_send_code_action_request(GeanyDocument *doc, gint pos, CodeActi
 	data = g_new0(CodeActionData, 1);
 	data->user_data = user_data;
 	data->callback = actions_resolved_cb;
-	lsp_rpc_call(srv, "textDocument/codeAction", node, code_action_cb, data);
+	data->doc = doc;
+	data->doc_id = doc->id;
+	data->version = lsp_sync_peek_doc_version(srv, doc);
+	data->start = pos_start;
+	data->end = pos_end;
+	data->diag = diag_raw ? g_variant_ref(diag_raw) : NULL;
+	// whole-document requests of the given kinds are made on save only
+	data->cache = only_kinds == NULL;
+	request = lsp_rpc_call(srv, "textDocument/codeAction", node, code_action_cb, data);
 
 	g_variant_unref(node);
 	g_variant_unref(diags_dict);
 	g_free(doc_uri);
 	g_ptr_array_free(arr, TRUE);
+
+	return request;
+}
+
+
+void lsp_command_send_code_action_request_full(GeanyDocument *doc, gint pos, gchar **only_kinds,
+	CodeActionCallback actions_resolved_cb, gpointer user_data)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+
+	if (!srv)
+	{
+		GPtrArray *empty = g_ptr_array_new_full(0, (GDestroyNotify)lsp_command_free);
+		if (actions_resolved_cb(empty, user_data))
+			g_ptr_array_free(empty, TRUE);
+		return;
+	}
+
+	if (!only_kinds)
+	{
+		CodeActionCacheEntry *entry;
+		gint start, end;
+
+		get_request_range(doc, pos, NULL, &start, &end);
+		entry = find_cached(doc, lsp_sync_peek_doc_version(srv, doc), start, end,
+			lsp_diagnostics_get_diag_raw(pos));
+
+		if (entry)
+		{
+			GPtrArray *actions = commands_copy(entry->actions);
+
+			if (actions_resolved_cb(actions, user_data))
+				g_ptr_array_free(actions, TRUE);
+			return;
+		}
+	}
+
+	send_request(srv, doc, pos, only_kinds, actions_resolved_cb, user_data);
+}
+
+
+void lsp_command_send_code_action_request(GeanyDocument *doc, gint pos, CodeActionCallback actions_resolved_cb, gpointer user_data)
+{
+	lsp_command_send_code_action_request_full(doc, pos, NULL, actions_resolved_cb, user_data);
+}
+
+
+static gboolean prefetch_received(G_GNUC_UNUSED GPtrArray *actions, G_GNUC_UNUSED gpointer user_data)
+{
+	// only stored in the cache
+	return TRUE;
+}
+
+
+static gboolean prefetch_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get_if_running(doc);
+	gint pos, start, end;
+
+	prefetch_source = 0;
+
+	if (!srv || !srv->config.code_action_enable)
+		return G_SOURCE_REMOVE;
+
+	pos = sci_get_current_position(doc->editor->sci);
+	get_request_range(doc, pos, NULL, &start, &end);
+	if (!find_cached(doc, lsp_sync_peek_doc_version(srv, doc), start, end, lsp_diagnostics_get_diag_raw(pos)))
+	{
+		lsp_rpc_cancel(pending_prefetch);
+		pending_prefetch = send_request(srv, doc, pos, NULL, prefetch_received, NULL);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* fetches code actions at the caret once the caret stops moving so the
+ * context menu and the code action keybindings can use them right away */
+void lsp_command_schedule_code_action_prefetch(G_GNUC_UNUSED GeanyDocument *doc)
+{
+	if (prefetch_source != 0)
+		g_source_remove(prefetch_source);
+	prefetch_source = plugin_timeout_add(geany_plugin, CODE_ACTION_PREFETCH_DELAY, prefetch_idle, NULL);
 }
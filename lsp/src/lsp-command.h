@@ -27,6 +27,7 @@ typedef struct
 {
 	guint line;
 	gchar *title;
+	gchar *kind;
 	gchar *command;
 	GVariant *arguments;
 	GVariant *edit;
@@ -35,12 +36,22 @@ typedef struct
 
 typedef gboolean (*CodeActionCallback) (GPtrArray *actions, gpointer user_data);
 
+// cmd is NULL when resolving failed, otherwise owned by the callback
+typedef void (*LspCommandResolvedCallback) (LspCommand *cmd, gpointer user_data);
+
 void lsp_command_free(LspCommand *cmd);
 
 void lsp_command_perform(LspServer *server, LspCommand *cmd, LspCallback callback, gpointer user_data);
+void lsp_command_resolve(LspServer *server, LspCommand *cmd, LspCommandResolvedCallback callback,
+	gpointer user_data);
 
 // Careful! Returning TRUE from actions_resolved_cb frees the actions array, FALSE passes the
 // ownership to the caller
 void lsp_command_send_code_action_request(GeanyDocument *doc, gint pos, CodeActionCallback actions_resolved_cb, gpointer user_data);
+// with only_kinds, actions of these kinds are requested for the whole document
+void lsp_command_send_code_action_request_full(GeanyDocument *doc, gint pos, gchar **only_kinds,
+	CodeActionCallback actions_resolved_cb, gpointer user_data);
+
+void lsp_command_schedule_code_action_prefetch(GeanyDocument *doc);
 
 #endif  /* LSP_COMMAND_H */
@@ -22,28 +22,102 @@
 
 #include "lsp-diagnostics.h"
 #include "lsp-utils.h"
+#include "lsp-doc-state.h"
+#include "lsp-sync.h"
+#include "lsp-rpc.h"
 
 #include <jsonrpc-glib.h>
 
+#define DIAG_INDEX_KEY "lsp_diagnostics_index"
+#define PAINTED_LINES_KEY "lsp_diagnostics_painted_lines"
+#define DIAG_BATCH_DELAY 100
+#define MSGWIN_CHUNK_SIZE 500
+#define SNAPSHOT_HEADER "LSP-DIAGNOSTICS 1"
+
 extern GeanyData *geany_data;
+extern GeanyPlugin *geany_plugin;
 
 
 typedef struct {
 	LspRange range;
-	gchar *code;
-	gchar *source;
-	gchar *message;
+	// strings point inside diag_raw
+	const gchar *code;
+	const gchar *source;
+	const gchar *message;
 	gint severity;
 	GVariant *diag_raw;
 } LspDiag;
 
 
+/* Diagnostics of a file are kept only as the received array and parsed into
+ * LspDiags when needed, normally once the file gets opened */
+typedef struct {
+	GVariant *raw;
+	GVariant *companion_raw;  // published by the companion server, may be NULL
+	GPtrArray *diags;  // sorted LspDiag of both, NULL until needed
+	gchar *result_id;  // of pulled diagnostics
+	gboolean stale;  // from the previous session, not published by the server yet
+} LspFileDiags;
+
+
+// diagnostics of a file stored with the project for the next session
+typedef struct {
+	GVariant *raw;
+	GeanyFiletypeID ft_id;
+	gchar *checksum;  // of the file the loaded diagnostics belong to, NULL when received now
+	gboolean mismatch;  // the opened file differs from checksum
+} LspSnapshotDiags;
+
+
 typedef struct {
-	const gchar *fname;
-	const LspDiag *diag;
+	GeanyDocument *doc;
+	guint version;
+} LspPullData;
+
+
+// entry of the diagnostics list in the message window
+typedef struct {
+	const gchar *fname;  // inside LspMsgwinFill.fnames
+	gint line;
+	gint severity;
+	gchar *message;
 } LspFileDiag;
 
 
+// diagnostics list being added to the message window in idle time
+typedef struct {
+	GPtrArray *items;  // LspFileDiag
+	GPtrArray *fnames;
+	guint next;
+	guint source;
+} LspMsgwinFill;
+
+
+// diagnostic with its Scintilla range inside LspDiagIndex
+typedef struct {
+	gint start;
+	gint end;
+	gint max_end;  // maximum end of this and all previous items
+	guint order;  // inside the diagnostics array
+	LspDiag *diag;
+} LspDiagPos;
+
+
+// highlighted diagnostics of a document sorted by start position
+typedef struct {
+	GArray *items;
+	guint generation;
+	guint version;
+} LspDiagIndex;
+
+
+// lines with drawn diagnostics, first_line > last_line when none
+typedef struct {
+	gint first_line;
+	gint last_line;
+} LspPaintedLines;
+
+
 typedef enum {
 	LSP_DIAG_SEVERITY_MIN = 1,
 	LspError = 1,
@@ -56,24 +130,47 @@ typedef enum {
 
 static gint style_indices[LSP_DIAG_SEVERITY_MAX];
 
+static LspMsgwinFill msgwin_fill;
+
 static ScintillaObject *calltip_sci;
+
+static struct {
+	gchar *path;
+	GHashTable *files;  // real path -> LspSnapshotDiags, NULL without project
+} snapshot;
+// changes whenever diagnostics or their styles change so indices get rebuilt
+static guint diag_generation = 0;
+
+
+static GPtrArray *get_diags(LspServer *srv, const gchar *real_path);
 static GtkWidget *issue_label;
 static GtkWidget *issue_label_container;
 
 
 static void diag_free(LspDiag *diag)
 {
-	g_free(diag->code);
-	g_free(diag->source);
-	g_free(diag->message);
 	g_variant_unref(diag->diag_raw);
 	g_free(diag);
 }
 
 
-static void array_free(GPtrArray *arr)
+static void file_diags_free(LspFileDiags *file_diags)
+{
+	if (file_diags->diags)
+		g_ptr_array_free(file_diags->diags, TRUE);
+	g_variant_unref(file_diags->raw);
+	if (file_diags->companion_raw)
+		g_variant_unref(file_diags->companion_raw);
+	g_free(file_diags->result_id);
+	g_free(file_diags);
+}
+
+
+static void snapshot_diags_free(LspSnapshotDiags *diags)
 {
-	g_ptr_array_free(arr, TRUE);
+	g_variant_unref(diags->raw);
+	g_free(diags->checksum);
+	g_free(diags);
 }
 
 
@@ -91,73 +188,264 @@ void lsp_diagnostics_common_destroy(void)
 
 void lsp_diagnostics_init(LspServer *srv)
 {
+	diag_generation++;
 	if (!srv->diag_table)
-		srv->diag_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)array_free);
+		srv->diag_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)file_diags_free);
 	g_hash_table_remove_all(srv->diag_table);
 }
 
 
 void lsp_diagnostics_free(LspServer *srv)
 {
+	diag_generation++;
 	if (srv->diag_table)
 		g_hash_table_destroy(srv->diag_table);
 	srv->diag_table = NULL;
+	if (srv->pending_diags_source)
+		g_source_remove(srv->pending_diags_source);
+	srv->pending_diags_source = 0;
+	if (srv->pending_diags)
+		g_hash_table_destroy(srv->pending_diags);
+	srv->pending_diags = NULL;
 }
 
 
-static LspDiag *get_diag(gint pos, gint where)
+static void diag_index_free(LspDiagIndex *index)
 {
-	GeanyDocument *doc = document_get_current();
-	LspServer *srv = lsp_server_get(doc);
-	LspDiag *previous_diag = NULL;
+	g_array_free(index->items, TRUE);
+	g_free(index);
+}
+
+
+static gsize get_file_diags_size(LspFileDiags *file_diags)
+{
+	gsize size = sizeof(LspFileDiags) + lsp_utils_get_variant_size(file_diags->raw) +
+		lsp_utils_get_string_size(file_diags->result_id);
+
+	if (file_diags->companion_raw)
+		size += lsp_utils_get_variant_size(file_diags->companion_raw);
+
+	if (file_diags->diags)
+		size += file_diags->diags->len * (sizeof(gpointer) + sizeof(LspDiag));
+
+	return size;
+}
+
+
+/* approximate memory of the diagnostics of doc including their highlighting
+ * index, of all files of the server when doc is NULL */
+gsize lsp_diagnostics_get_cache_size(LspServer *srv, GeanyDocument *doc)
+{
+	LspFileDiags *file_diags;
+	LspDiagIndex *index;
+	gsize size = 0;
+
+	if (!srv->diag_table)
+		return 0;
+
+	if (!doc)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+
+		g_hash_table_iter_init(&iter, srv->diag_table);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			size += lsp_utils_get_string_size(key) + get_file_diags_size(value);
+		return size;
+	}
+
+	file_diags = doc->real_path ? g_hash_table_lookup(srv->diag_table, doc->real_path) : NULL;
+	if (file_diags)
+		size += get_file_diags_size(file_diags);
+
+	index = plugin_get_document_data(geany_plugin, doc, DIAG_INDEX_KEY);
+	if (index)
+		size += sizeof(LspDiagIndex) + index->items->len * sizeof(LspDiagPos);
+
+	return size;
+}
+
+
+/* Frees the diagnostics of files which aren't open - they are received again
+ * when the server publishes them next time */
+void lsp_diagnostics_drop_unopened(LspServer *srv)
+{
+	GHashTable *open_paths;
+	GHashTableIter iter;
+	gpointer key;
+	guint i;
+
+	if (!srv->diag_table)
+		return;
+
+	open_paths = g_hash_table_new(g_str_hash, g_str_equal);
+	foreach_document(i)
+	{
+		if (documents[i]->real_path)
+			g_hash_table_add(open_paths, documents[i]->real_path);
+	}
+
+	g_hash_table_iter_init(&iter, srv->diag_table);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		if (!g_hash_table_contains(open_paths, key))
+			g_hash_table_iter_remove(&iter);
+	}
+
+	g_hash_table_destroy(open_paths);
+}
+
+
+static gint sort_diag_pos(gconstpointer a, gconstpointer b)
+{
+	const LspDiagPos *p1 = a;
+	const LspDiagPos *p2 = b;
+
+	if (p1->start != p2->start)
+		return p1->start < p2->start ? -1 : 1;
+
+	return (p1->order > p2->order) - (p1->order < p2->order);
+}
+
+
+/* Returns the index of diagnostics of doc, rebuilt when the diagnostics or
+ * the document changed since the last call */
+static LspDiagIndex *get_diag_index(LspServer *srv, GeanyDocument *doc)
+{
+	LspDiagIndex *index = plugin_get_document_data(geany_plugin, doc, DIAG_INDEX_KEY);
+	guint version = lsp_sync_peek_doc_version(srv, doc);
+	ScintillaObject *sci = doc->editor->sci;
 	GPtrArray *diags;
-	gint i;
+	gint max_end = -1;
+	guint i;
 
-	if (!srv || !doc->real_path)
-		return NULL;
+	if (index && index->generation == diag_generation && index->version == version)
+		return index;
 
-	diags = g_hash_table_lookup(srv->diag_table, doc->real_path);
+	diags = get_diags(srv, doc->real_path);
 	if (!diags)
 		return NULL;
 
+	index = g_new0(LspDiagIndex, 1);
+	index->generation = diag_generation;
+	index->version = version;
+	index->items = g_array_sized_new(FALSE, FALSE, sizeof(LspDiagPos), diags->len);
+
 	for (i = 0; i < diags->len; i++)
 	{
-		ScintillaObject *sci = doc->editor->sci;
 		LspDiag *diag = diags->pdata[i];
-		gint start_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.start);
-		gint end_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.end);
-		gint index = style_indices[diag->severity];
+		LspDiagPos item;
 
-		if (index == 0)
+		if (style_indices[diag->severity] == 0)
 			continue;
 
-		if (start_pos == end_pos)
-		{
-			start_pos = SSM(sci, SCI_POSITIONBEFORE, start_pos, 0);
-			end_pos = SSM(sci, SCI_POSITIONAFTER, end_pos, 0);
-		}
+		item.start = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.start);
+		item.end = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.end);
+		item.order = i;
+		item.diag = diag;
 
-		if (where == 0)  // at the position
-		{
-			if (pos >= start_pos && pos <= end_pos)
-				return diag;
-		}
-		else if (where == 1)  // after position
-		{
-			if (start_pos > pos)
-				return diag;
-		}
-		else if (where == -1)  // before position
+		if (item.start == item.end)
 		{
-			if (end_pos < pos)
-				previous_diag = diag;
-			else
-				break;
+			item.start = SSM(sci, SCI_POSITIONBEFORE, item.start, 0);
+			item.end = SSM(sci, SCI_POSITIONAFTER, item.end, 0);
 		}
+
+		g_array_append_val(index->items, item);
+	}
+
+	g_array_sort(index->items, sort_diag_pos);
+
+	for (i = 0; i < index->items->len; i++)
+	{
+		LspDiagPos *item = &g_array_index(index->items, LspDiagPos, i);
+
+		max_end = MAX(max_end, item->end);
+		item->max_end = max_end;
+	}
+
+	plugin_set_document_data_full(geany_plugin, doc, DIAG_INDEX_KEY, index,
+		(GDestroyNotify)diag_index_free);
+
+	return index;
+}
+
+
+// first item with start > pos
+static guint find_first_start_after(GArray *items, gint pos)
+{
+	guint lo = 0, hi = items->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index(items, LspDiagPos, mid).start > pos)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+
+// first item with max_end >= pos, i.e. the first one not ending before pos
+static guint find_first_max_end_from(GArray *items, gint pos)
+{
+	guint lo = 0, hi = items->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index(items, LspDiagPos, mid).max_end >= pos)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	if (previous_diag)
-		return previous_diag;
+	return lo;
+}
+
+
+static LspDiag *get_diag(gint pos, gint where)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get(doc);
+	LspDiagIndex *index;
+	GArray *items;
+	guint i;
+
+	if (!srv || !doc->real_path)
+		return NULL;
+
+	index = get_diag_index(srv, doc);
+	if (!index)
+		return NULL;
+	items = index->items;
+
+	if (where == 0)  // at the position
+	{
+		// among items starting at or before pos, the first one reaching pos
+		guint count = find_first_start_after(items, pos);
+
+		i = find_first_max_end_from(items, pos);
+		if (i < count)
+			return g_array_index(items, LspDiagPos, i).diag;
+	}
+	else if (where == 1)  // after position
+	{
+		i = find_first_start_after(items, pos);
+		if (i < items->len)
+			return g_array_index(items, LspDiagPos, i).diag;
+	}
+	else if (where == -1)  // before position
+	{
+		// the one preceding the first diagnostic not ending before pos
+		i = find_first_max_end_from(items, pos);
+		if (i > 0)
+			return g_array_index(items, LspDiagPos, i - 1).diag;
+	}
 
 	return NULL;
 }
@@ -205,33 +493,44 @@ void lsp_diagnostics_goto_prev_diag(gint pos)
 }
 
 
+/* Called on every redraw - the verdict is remembered in the document state
+ * until the document's path or server configuration change */
 static gboolean is_diagnostics_disabled_for(GeanyDocument *doc, LspServerConfig *cfg)
 {
-	gboolean is_disabled = FALSE;
-	gint i = 0;
-	gchar **comps;
+	LspDocState *state;
+	GPatternSpec *spec;
 	gchar *fname;
+	guint i;
 
 	if (!cfg || !cfg->diagnostics_enable)
 		return TRUE;
 
-	if (EMPTY(cfg->diagnostics_disable_for))
+	if (!cfg->diagnostics_disable_specs)
 		return FALSE;
 
-	comps = g_strsplit(cfg->diagnostics_disable_for, ";", -1);
-	fname = utils_get_utf8_from_locale(doc->real_path);
-
-	for (i = 0; comps && comps[i] && !is_disabled; i++)
+	state = lsp_doc_state_get(doc);
+	if (state->diag_disabled_cfg == cfg &&
+		g_strcmp0(state->diag_disabled_path, doc->real_path) == 0)
 	{
-		// TODO: possibly precompile the glob and store somewhere if performance is a problem
-		if (g_pattern_match_simple(comps[i], fname))
-			is_disabled = TRUE;
+		return state->diag_disabled;
 	}
 
-	g_strfreev(comps);
+	state->diag_disabled = FALSE;
+	fname = utils_get_utf8_from_locale(doc->real_path);
+	foreach_ptr_array(spec, i, cfg->diagnostics_disable_specs)
+	{
+		if (lsp_utils_pattern_match(spec, fname))
+		{
+			state->diag_disabled = TRUE;
+			break;
+		}
+	}
 	g_free(fname);
 
-	return is_disabled;
+	state->diag_disabled_cfg = cfg;
+	SETPTR(state->diag_disabled_path, g_strdup(doc->real_path));
+
+	return state->diag_disabled;
 }
 
 
@@ -320,14 +619,19 @@ static void create_label(void)
 }
 
 
-static void set_statusbar_issue_num(gint num)
+static void set_statusbar_issue_num(gint num, gboolean stale)
 {
 	gchar *issue_str;
 
 	if (!issue_label)
 		create_label();
 
-	issue_str = num >= 0 ? g_strdup_printf(_("issues: %d"), num) : g_strdup("");
+	if (num < 0)
+		issue_str = g_strdup("");
+	else if (stale)
+		issue_str = g_strdup_printf(_("issues: %d (stale)"), num);
+	else
+		issue_str = g_strdup_printf(_("issues: %d"), num);
 	gtk_label_set_text(GTK_LABEL(issue_label), issue_str);
 	g_free(issue_str);
 }
@@ -336,13 +640,17 @@ static void set_statusbar_issue_num(gint num)
 static void refresh_issue_statusbar(GeanyDocument *doc)
 {
 	LspServer *srv = lsp_server_get_if_running(doc);
+	gboolean stale = FALSE;
 	gint num = 0;
 
 	if (srv && doc->real_path && !is_diagnostics_disabled_for(doc, &srv->config))
 	{
-		GPtrArray *diags = g_hash_table_lookup(srv->diag_table, doc->real_path);
+		LspFileDiags *file_diags = g_hash_table_lookup(srv->diag_table, doc->real_path);
+		GPtrArray *diags = get_diags(srv, doc->real_path);
 		gint i;
 
+		stale = file_diags && file_diags->stale;
+
 		for (i = 0; diags && i < diags->len; i++)
 		{
 			LspDiag *diag = diags->pdata[i];
@@ -352,43 +660,46 @@ static void refresh_issue_statusbar(GeanyDocument *doc)
 		}
 	}
 
-	set_statusbar_issue_num(num);
+	set_statusbar_issue_num(num, stale);
 }
 
 
-void lsp_diagnostics_redraw(GeanyDocument *doc)
+/* Lines on the screen together with a screen above and below */
+static void get_paint_range(ScintillaObject *sci, gint *first_line, gint *last_line)
 {
-	LspServer *srv = lsp_server_get_if_running(doc);
-	ScintillaObject *sci;
-	GPtrArray *diags;
-	gint last_start_pos = 0, last_end_pos = 0;
-	gint i;
+	gint first_visible = SSM(sci, SCI_GETFIRSTVISIBLELINE, 0, 0);
+	gint lines_on_screen = SSM(sci, SCI_LINESONSCREEN, 0, 0);
 
-	if (!srv || !doc || !doc->real_path || is_diagnostics_disabled_for(doc, &srv->config))
-	{
-		set_statusbar_issue_num(-1);
-		if (doc)
-			clear_indicators(doc->editor->sci);
-		return;
-	}
-
-	sci = doc->editor->sci;
+	*first_line = MAX(0, SSM(sci, SCI_DOCLINEFROMVISIBLE, first_visible, 0) - lines_on_screen);
+	*last_line = SSM(sci, SCI_DOCLINEFROMVISIBLE, first_visible + lines_on_screen, 0) + lines_on_screen;
+}
 
-	clear_indicators(sci);
 
-	diags = g_hash_table_lookup(srv->diag_table, doc->real_path);
-	if (!diags)
-	{
-		set_statusbar_issue_num(0);
-		return;
-	}
+/* Draws diagnostics intersecting lines first_line..last_line except those
+ * intersecting skip_first..skip_last which are drawn already */
+static void paint_diags(GeanyDocument *doc, GPtrArray *diags, gint first_line, gint last_line,
+	gint skip_first, gint skip_last)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	gint last_start_pos = 0, last_end_pos = 0;
+	guint i;
 
 	for (i = 0; i < diags->len; i++)
 	{
 		LspDiag *diag = diags->pdata[i];
-		gint start_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.start);
-		gint end_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.end);
-		gint next_pos = SSM(sci, SCI_POSITIONAFTER, start_pos, 0);
+		gint start_pos, end_pos, next_pos;
+
+		// sorted by start
+		if (diag->range.start.line > last_line)
+			break;
+		if (diag->range.end.line < first_line)
+			continue;
+		if (diag->range.start.line <= skip_last && diag->range.end.line >= skip_first)
+			continue;
+
+		start_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.start);
+		end_pos = lsp_utils_lsp_pos_to_scintilla(sci, diag->range.end);
+		next_pos = SSM(sci, SCI_POSITIONAFTER, start_pos, 0);
 
 		if (start_pos == end_pos)
 		{
@@ -414,11 +725,136 @@ void lsp_diagnostics_redraw(GeanyDocument *doc)
 			last_end_pos = end_pos;
 		}
 	}
+}
+
+
+static LspPaintedLines *get_painted_lines(GeanyDocument *doc)
+{
+	LspPaintedLines *painted = plugin_get_document_data(geany_plugin, doc, PAINTED_LINES_KEY);
+
+	if (!painted)
+	{
+		painted = g_new0(LspPaintedLines, 1);
+		plugin_set_document_data_full(geany_plugin, doc, PAINTED_LINES_KEY, painted, g_free);
+	}
+
+	return painted;
+}
+
+
+static gchar *get_doc_checksum(GeanyDocument *doc)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	const guchar *text = (const guchar *) SSM(sci, SCI_GETCHARACTERPOINTER, 0, 0);
+
+	return g_compute_checksum_for_data(G_CHECKSUM_SHA1, text, sci_get_length(sci));
+}
+
+
+/* Diagnostics of the previous session are shown as stale until the server
+ * publishes the file's diagnostics, if the file didn't change since */
+static void restore_snapshot(LspServer *srv, GeanyDocument *doc)
+{
+	LspSnapshotDiags *entry;
+	gchar *checksum;
+
+	if (!snapshot.files || g_hash_table_contains(srv->diag_table, doc->real_path))
+		return;
+
+	entry = g_hash_table_lookup(snapshot.files, doc->real_path);
+	if (!entry || !entry->checksum || entry->mismatch || entry->ft_id != srv->filetype)
+		return;
+
+	checksum = get_doc_checksum(doc);
+	if (g_strcmp0(checksum, entry->checksum) == 0)
+	{
+		LspFileDiags *file_diags = g_new0(LspFileDiags, 1);
+
+		file_diags->raw = g_variant_ref(entry->raw);
+		file_diags->stale = TRUE;
+		g_hash_table_insert(srv->diag_table, g_strdup(doc->real_path), file_diags);
+		diag_generation++;
+	}
+	else
+		entry->mismatch = TRUE;
+	g_free(checksum);
+}
+
+
+void lsp_diagnostics_redraw(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	LspPaintedLines *painted;
+	ScintillaObject *sci;
+	GPtrArray *diags;
+
+	if (!srv || !doc || !doc->real_path || is_diagnostics_disabled_for(doc, &srv->config))
+	{
+		set_statusbar_issue_num(-1, FALSE);
+		if (doc)
+			clear_indicators(doc->editor->sci);
+		return;
+	}
+
+	sci = doc->editor->sci;
+
+	clear_indicators(sci);
+
+	painted = get_painted_lines(doc);
+	painted->first_line = 1;
+	painted->last_line = 0;
+
+	restore_snapshot(srv, doc);
+
+	diags = get_diags(srv, doc->real_path);
+	if (!diags)
+	{
+		set_statusbar_issue_num(0, FALSE);
+		return;
+	}
+
+	// the rest is drawn when scrolled to
+	get_paint_range(sci, &painted->first_line, &painted->last_line);
+	paint_diags(doc, diags, painted->first_line, painted->last_line, 1, 0);
 
 	refresh_issue_statusbar(doc);
 }
 
 
+void lsp_diagnostics_scrolled(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	LspPaintedLines *painted;
+	gint first_line, last_line;
+	GPtrArray *diags;
+
+	if (!srv || !doc->real_path || is_diagnostics_disabled_for(doc, &srv->config))
+		return;
+
+	diags = get_diags(srv, doc->real_path);
+	painted = plugin_get_document_data(geany_plugin, doc, PAINTED_LINES_KEY);
+	if (!diags || !painted)
+		return;
+
+	get_paint_range(doc->editor->sci, &first_line, &last_line);
+
+	if (first_line >= painted->first_line && last_line <= painted->last_line)
+		return;
+
+	// keep the drawn lines contiguous - start over after jumps
+	if (painted->first_line > painted->last_line ||
+		last_line < painted->first_line - 1 || first_line > painted->last_line + 1)
+	{
+		lsp_diagnostics_redraw(doc);
+		return;
+	}
+
+	paint_diags(doc, diags, first_line, last_line, painted->first_line, painted->last_line);
+	painted->first_line = MIN(painted->first_line, first_line);
+	painted->last_line = MAX(painted->last_line, last_line);
+}
+
+
 void lsp_diagnostics_style_init(GeanyDocument *doc)
 {
 	LspServer *srv = lsp_server_get_if_running(doc);
@@ -433,6 +869,7 @@ void lsp_diagnostics_style_init(GeanyDocument *doc)
 	style_indices[LspWarning] = lsp_utils_set_indicator_style(sci, srv->config.diagnostics_warning_style);
 	style_indices[LspInfo] = lsp_utils_set_indicator_style(sci, srv->config.diagnostics_info_style);
 	style_indices[LspHint] = lsp_utils_set_indicator_style(sci, srv->config.diagnostics_hint_style);
+	diag_generation++;
 
 	SSM(sci, SCI_SETMOUSEDWELLTIME, 500, 0);
 }
@@ -457,34 +894,13 @@ static gint sort_diags(gconstpointer a, gconstpointer b)
 }
 
 
-void lsp_diagnostics_received(LspServer *srv, GVariant* diags)
+static void parse_diags(GPtrArray *arr, GVariant *raw)
 {
-	GeanyDocument *doc = document_get_current();;
-	GVariantIter *iter = NULL;
-	const gchar *uri = NULL;
-	gchar *real_path;
 	GVariant *diag = NULL;
-	GPtrArray *arr;
-
-	JSONRPC_MESSAGE_PARSE(diags,
-		"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
-		"diagnostics", JSONRPC_MESSAGE_GET_ITER(&iter)
-		);
-
-	if (!iter)
-		return;
-
-	real_path = lsp_utils_get_real_path_from_uri_locale(uri);
-
-	if (!real_path)
-	{
-		g_variant_iter_free(iter);
-		return;
-	}
-
-	arr = g_ptr_array_new_full(10, (GDestroyNotify)diag_free);
+	GVariantIter iter;
 
-	while (g_variant_iter_next(iter, "v", &diag))
+	g_variant_iter_init(&iter, raw);
+	while (g_variant_iter_next(&iter, "v", &diag))
 	{
 		GVariant *range = NULL;
 		const gchar *code = NULL;
@@ -493,16 +909,17 @@ void lsp_diagnostics_received(LspServer *srv, GVariant* diags)
 		gint64 severity = 0;
 		LspDiag *lsp_diag;
 
-		JSONRPC_MESSAGE_PARSE(diag, "code", JSONRPC_MESSAGE_GET_STRING(&code));
-		JSONRPC_MESSAGE_PARSE(diag, "source", JSONRPC_MESSAGE_GET_STRING(&source));
-		JSONRPC_MESSAGE_PARSE(diag, "message", JSONRPC_MESSAGE_GET_STRING(&message));
-		JSONRPC_MESSAGE_PARSE(diag, "severity", JSONRPC_MESSAGE_GET_INT64(&severity));
-		JSONRPC_MESSAGE_PARSE(diag, "range", JSONRPC_MESSAGE_GET_VARIANT(&range));
+		JSONRPC_MESSAGE_PARSE_MEMBERS(diag,
+			"code", JSONRPC_MESSAGE_GET_STRING(&code),
+			"source", JSONRPC_MESSAGE_GET_STRING(&source),
+			"message", JSONRPC_MESSAGE_GET_STRING(&message),
+			"severity", JSONRPC_MESSAGE_GET_INT64(&severity),
+			"range", JSONRPC_MESSAGE_GET_VARIANT(&range));
 
 		lsp_diag = g_new0(LspDiag, 1);
-		lsp_diag->code = g_strdup(code);
-		lsp_diag->source = g_strdup(source);
-		lsp_diag->message = g_strdup(message);
+		lsp_diag->code = code;
+		lsp_diag->source = source;
+		lsp_diag->message = message;
 		lsp_diag->severity = severity;
 		lsp_diag->range = lsp_utils_parse_range(range);
 		lsp_diag->diag_raw = diag;
@@ -512,16 +929,327 @@ void lsp_diagnostics_received(LspServer *srv, GVariant* diags)
 		if (range)
 			g_variant_unref(range);
 	}
+}
+
+
+// diagnostics of the server merged with those of its companion
+static GPtrArray *parse_file_diags(LspFileDiags *file_diags)
+{
+	GPtrArray *arr = g_ptr_array_new_full(g_variant_n_children(file_diags->raw),
+		(GDestroyNotify)diag_free);
+
+	parse_diags(arr, file_diags->raw);
+	if (file_diags->companion_raw)
+		parse_diags(arr, file_diags->companion_raw);
 
 	g_ptr_array_sort(arr, sort_diags);
 
-	g_hash_table_insert(srv->diag_table, g_strdup(real_path), arr);
+	return arr;
+}
+
+
+static GPtrArray *get_diags(LspServer *srv, const gchar *real_path)
+{
+	LspFileDiags *file_diags = g_hash_table_lookup(srv->diag_table, real_path);
+
+	if (!file_diags)
+		return NULL;
+
+	if (!file_diags->diags)
+		file_diags->diags = parse_file_diags(file_diags);
+
+	return file_diags->diags;
+}
+
+
+/* Takes ownership of raw, returns whether diagnostics of doc changed */
+static gboolean store_diags(LspServer *srv, const gchar *real_path, GVariant *raw,
+	const gchar *result_id, GeanyDocument *doc)
+{
+	LspFileDiags *file_diags = g_hash_table_lookup(srv->diag_table, real_path);
+	LspFileDiags *old_diags;
+
+	if (snapshot.files)
+	{
+		LspSnapshotDiags *entry = g_new0(LspSnapshotDiags, 1);
+
+		entry->raw = g_variant_ref(raw);
+		entry->ft_id = srv->filetype;
+		g_hash_table_insert(snapshot.files, g_strdup(real_path), entry);
+	}
+
+	// servers often publish identical diagnostics repeatedly
+	if (file_diags && g_variant_equal(file_diags->raw, raw))
+	{
+		gboolean was_stale = file_diags->stale;
+
+		SETPTR(file_diags->result_id, g_strdup(result_id));
+		file_diags->stale = FALSE;
+		g_variant_unref(raw);
+		return was_stale && doc && g_strcmp0(doc->real_path, real_path) == 0;
+	}
+
+	old_diags = file_diags;
+	file_diags = g_new0(LspFileDiags, 1);
+	file_diags->raw = raw;
+	file_diags->result_id = g_strdup(result_id);
+	if (old_diags && old_diags->companion_raw)
+		file_diags->companion_raw = g_variant_ref(old_diags->companion_raw);
+	g_hash_table_insert(srv->diag_table, g_strdup(real_path), file_diags);
+	diag_generation++;
+
+	return doc && doc->real_path && g_strcmp0(doc->real_path, real_path) == 0;
+}
+
+
+/* Stores diagnostics published by the companion of srv next to those of srv,
+ * takes ownership of raw, returns whether diagnostics of doc changed */
+static gboolean store_companion_diags(LspServer *srv, const gchar *real_path, GVariant *raw,
+	GeanyDocument *doc)
+{
+	LspFileDiags *file_diags = g_hash_table_lookup(srv->diag_table, real_path);
+
+	if (file_diags && file_diags->companion_raw && g_variant_equal(file_diags->companion_raw, raw))
+	{
+		g_variant_unref(raw);
+		return FALSE;
+	}
+
+	if (!file_diags)
+	{
+		file_diags = g_new0(LspFileDiags, 1);
+		file_diags->raw = g_variant_ref_sink(g_variant_new_array(G_VARIANT_TYPE_VARIANT, NULL, 0));
+		g_hash_table_insert(srv->diag_table, g_strdup(real_path), file_diags);
+	}
+
+	if (file_diags->companion_raw)
+		g_variant_unref(file_diags->companion_raw);
+	file_diags->companion_raw = raw;
+	if (file_diags->diags)
+		g_ptr_array_free(file_diags->diags, TRUE);
+	file_diags->diags = NULL;
+	diag_generation++;
+
+	return doc && doc->real_path && g_strcmp0(doc->real_path, real_path) == 0;
+}
+
+
+/* Drops the diagnostics of the companion of srv once it stops */
+void lsp_diagnostics_clear_companion(LspServer *srv)
+{
+	GeanyDocument *doc = document_get_current();
+	gboolean redraw = FALSE;
+	LspFileDiags *file_diags;
+	GHashTableIter iter;
+	const gchar *key;
+
+	if (!srv->diag_table)
+		return;
+
+	g_hash_table_iter_init(&iter, srv->diag_table);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&file_diags))
+	{
+		if (!file_diags->companion_raw)
+			continue;
+
+		g_variant_unref(file_diags->companion_raw);
+		file_diags->companion_raw = NULL;
+		if (file_diags->diags)
+			g_ptr_array_free(file_diags->diags, TRUE);
+		file_diags->diags = NULL;
+		diag_generation++;
+
+		redraw = redraw || (doc && g_strcmp0(doc->real_path, key) == 0);
+	}
 
-	if (doc && doc->real_path && g_strcmp0(doc->real_path, real_path) == 0)
+	if (redraw && lsp_server_get_if_running(doc) == srv)
 		lsp_diagnostics_redraw(doc);
+}
+
+
+/* Stores the diagnostics of one publishDiagnostics notification, returns
+ * whether diagnostics of doc changed */
+static gboolean process_diagnostics(LspServer *srv, GVariant* diags, GeanyDocument *doc)
+{
+	gboolean doc_changed;
+	GVariant *raw = NULL;
+	const gchar *uri = NULL;
+	gchar *real_path;
+
+	JSONRPC_MESSAGE_PARSE(diags,
+		"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
+		"diagnostics", JSONRPC_MESSAGE_GET_VARIANT(&raw)
+		);
+
+	if (!raw)
+		return FALSE;
+
+	real_path = lsp_utils_get_real_path_from_uri_locale(uri);
+
+	if (!real_path || !g_variant_is_of_type(raw, G_VARIANT_TYPE_ARRAY))
+	{
+		g_free(real_path);
+		g_variant_unref(raw);
+		return FALSE;
+	}
+
+	if (srv->is_companion)
+		doc_changed = store_companion_diags(srv->companion_owner, real_path, raw, doc);
+	else
+		doc_changed = store_diags(srv, real_path, raw, NULL, doc);
 
-	g_variant_iter_free(iter);
 	g_free(real_path);
+
+	return doc_changed;
+}
+
+
+static gboolean process_pending_diagnostics(gpointer user_data)
+{
+	LspServer *srv = user_data;
+	GeanyDocument *doc = document_get_current();
+	GHashTable *pending = srv->pending_diags;
+	gboolean redraw = FALSE;
+	GHashTableIter iter;
+	gpointer val;
+
+	srv->pending_diags = NULL;
+	srv->pending_diags_source = 0;
+
+	// detached companion, its diagnostics are not shown any more
+	if (srv->is_companion && !srv->companion_owner)
+	{
+		g_hash_table_destroy(pending);
+		return G_SOURCE_REMOVE;
+	}
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, NULL, &val))
+		redraw = process_diagnostics(srv, val, doc) || redraw;
+	g_hash_table_destroy(pending);
+
+	// also updates the issue count in the status bar
+	if (redraw)
+		lsp_diagnostics_redraw(doc);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Servers often publish diagnostics of many files at once - they are collected
+ * for a while, keeping only the latest ones for each file, and processed
+ * together */
+void lsp_diagnostics_received(LspServer *srv, GVariant* diags)
+{
+	const gchar *uri = NULL;
+
+	JSONRPC_MESSAGE_PARSE(diags,
+		"uri", JSONRPC_MESSAGE_GET_STRING(&uri)
+	);
+
+	if (!uri)
+		return;
+
+	lsp_server_record_startup(srv, LSP_STARTUP_FIRST_DIAGNOSTICS);
+
+	if (!srv->pending_diags)
+		srv->pending_diags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)g_variant_unref);
+	g_hash_table_insert(srv->pending_diags, g_strdup(uri), g_variant_ref(diags));
+
+	if (srv->pending_diags_source == 0)
+		srv->pending_diags_source = plugin_timeout_add(geany_plugin, DIAG_BATCH_DELAY,
+			process_pending_diagnostics, srv);
+}
+
+
+static void pull_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	LspPullData *data = user_data;
+	GeanyDocument *doc = data->doc;
+	LspServer *srv = DOC_VALID(doc) ? lsp_server_get_if_running(doc) : NULL;
+
+	if (!error && srv && doc->real_path &&
+		!lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/diagnostic"))
+	{
+		const gchar *kind = NULL;
+		const gchar *result_id = NULL;
+		GVariant *items = NULL;
+
+		lsp_server_record_startup(srv, LSP_STARTUP_FIRST_DIAGNOSTICS);
+
+		JSONRPC_MESSAGE_PARSE(return_value,
+			"kind", JSONRPC_MESSAGE_GET_STRING(&kind)
+		);
+		JSONRPC_MESSAGE_PARSE(return_value,
+			"resultId", JSONRPC_MESSAGE_GET_STRING(&result_id)
+		);
+		JSONRPC_MESSAGE_PARSE(return_value,
+			"items", JSONRPC_MESSAGE_GET_VARIANT(&items)
+		);
+
+		// "unchanged" reports keep what we have
+		if (g_strcmp0(kind, "full") == 0 && items && g_variant_is_of_type(items, G_VARIANT_TYPE_ARRAY))
+		{
+			if (store_diags(srv, doc->real_path, items, result_id, doc) &&
+				doc == document_get_current())
+			{
+				lsp_diagnostics_redraw(doc);
+			}
+			items = NULL;
+		}
+
+		if (items)
+			g_variant_unref(items);
+	}
+
+	g_free(data);
+}
+
+
+/* Requests diagnostics of doc from servers supporting pull diagnostics; the
+ * server only re-computes them when they may have changed since the last
+ * result */
+void lsp_diagnostics_pull(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	LspFileDiags *file_diags;
+	LspPullData *data;
+	GVariant *node;
+	gchar *doc_uri;
+
+	if (!srv || !doc->real_path || !srv->supports_pull_diagnostics ||
+		is_diagnostics_disabled_for(doc, &srv->config))
+	{
+		return;
+	}
+
+	lsp_sync_text_document_did_open(srv, doc);
+
+	doc_uri = lsp_utils_get_doc_uri(doc);
+	file_diags = g_hash_table_lookup(srv->diag_table, doc->real_path);
+
+	if (file_diags && file_diags->result_id)
+		node = JSONRPC_MESSAGE_NEW(
+			"textDocument", "{",
+				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+			"}",
+			"previousResultId", JSONRPC_MESSAGE_PUT_STRING(file_diags->result_id)
+		);
+	else
+		node = JSONRPC_MESSAGE_NEW(
+			"textDocument", "{",
+				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+			"}"
+		);
+
+	data = g_new0(LspPullData, 1);
+	data->doc = doc;
+	data->version = lsp_sync_peek_doc_version(srv, doc);
+	lsp_rpc_call_background(srv, "textDocument/diagnostic", node, pull_cb, data);
+
+	g_free(doc_uri);
+	g_variant_unref(node);
 }
 
 
@@ -530,6 +1258,7 @@ void lsp_diagnostics_clear(LspServer *srv, GeanyDocument *doc)
 	if (srv && doc && doc->real_path)
 	{
 		g_hash_table_remove(srv->diag_table, doc->real_path);
+		diag_generation++;
 		lsp_diagnostics_redraw(doc);
 	}
 
@@ -556,14 +1285,14 @@ static gint compare_diags(gconstpointer a, gconstpointer b)
 	if (res != 0)
 		return res;
 
-	if (item_a->diag->range.start.line < item_b->diag->range.start.line)
+	if (item_a->line < item_b->line)
 		return -1;
-	if (item_a->diag->range.start.line > item_b->diag->range.start.line)
+	if (item_a->line > item_b->line)
 		return 1;
 
-	if (item_a->diag->severity < item_b->diag->severity)
+	if (item_a->severity < item_b->severity)
 		return -1;
-	if (item_a->diag->severity > item_b->diag->severity)
+	if (item_a->severity > item_b->severity)
 		return 1;
 
 	return 0;
@@ -581,79 +1310,298 @@ static void replace_char(gchar *str, gchar find, gchar replace)
 }
 
 
-static void show_in_msgwin(LspFileDiag *diag)
+static void file_diag_free(LspFileDiag *item)
 {
-	gint lineno = diag->diag->range.start.line;
-	gchar *fname = utils_get_utf8_from_locale(diag->fname);
-	gchar *new_msg = g_strdup(diag->diag->message);
-	gchar *base_path;
+	g_free(item->message);
+	g_free(item);
+}
 
-	base_path = lsp_utils_get_project_base_path();
+
+/* File name as shown in the message window - relative to the project base
+ * path when inside it */
+static gchar *get_display_fname(const gchar *base_path, const gchar *locale_fname)
+{
+	gchar *fname = utils_get_utf8_from_locale(locale_fname);
 
 	if (base_path)
 	{
 		gchar *rel_path = lsp_utils_get_relative_path(base_path, fname);
-		gchar *locale_base_path = utils_get_locale_from_utf8(base_path);
 
 		if (rel_path && !g_str_has_prefix(rel_path, ".."))
 			SETPTR(fname, g_strdup(rel_path));
 
-		msgwin_set_messages_dir(locale_base_path);
-
-		g_free(locale_base_path);
 		g_free(rel_path);
 	}
 
-	replace_char(new_msg, '\n', ' ');
-	replace_char(new_msg, '\r', ' ');
-	msgwin_msg_add(COLOR_BLACK, -1, NULL, "%s:%d:  %s", fname, lineno + 1, new_msg);
+	return fname;
+}
 
-	g_free(fname);
-	g_free(new_msg);
-	g_free(base_path);
+
+static void stop_msgwin_fill(void)
+{
+	if (msgwin_fill.source)
+		g_source_remove(msgwin_fill.source);
+	if (msgwin_fill.items)
+		g_ptr_array_free(msgwin_fill.items, TRUE);
+	if (msgwin_fill.fnames)
+		g_ptr_array_free(msgwin_fill.fnames, TRUE);
+	memset(&msgwin_fill, 0, sizeof(msgwin_fill));
+}
+
+
+static gboolean msgwin_fill_idle(gpointer user_data)
+{
+	guint end = MIN(msgwin_fill.next + MSGWIN_CHUNK_SIZE, msgwin_fill.items->len);
+
+	for (; msgwin_fill.next < end; msgwin_fill.next++)
+	{
+		LspFileDiag *item = msgwin_fill.items->pdata[msgwin_fill.next];
+
+		msgwin_msg_add(COLOR_BLACK, -1, NULL, "%s:%d:  %s", item->fname, item->line + 1,
+			item->message);
+	}
+
+	if (msgwin_fill.next < msgwin_fill.items->len)
+		return G_SOURCE_CONTINUE;
+
+	msgwin_fill.source = 0;
+	stop_msgwin_fill();
+	return G_SOURCE_REMOVE;
 }
 
 
+/* The list is added to the message window in chunks during idle time so big
+ * lists don't block the UI; all the data is copied as diagnostics may change
+ * in the meantime */
 void lsp_diagnostics_show_all(gboolean current_doc_only)
 {
 	GeanyDocument *doc = document_get_current();
 	LspServer *srv = lsp_server_get(doc);
-	GPtrArray *arr, *diags;
-	LspFileDiag *item;
+	gint max_severity;
+	GPtrArray *diags;
+	LspFileDiags *file_diags;
 	GHashTableIter iter;
 	const gchar *key;
+	gchar *base_path;
 	guint i;
 
 	if (!srv)
 		return;
 
-	arr = g_ptr_array_new_full(100, g_free);
+	stop_msgwin_fill();
+
+	msgwin_fill.items = g_ptr_array_new_full(100, (GDestroyNotify)file_diag_free);
+	msgwin_fill.fnames = g_ptr_array_new_with_free_func(g_free);
+	max_severity = srv->config.diagnostics_msgwin_severity > 0 ?
+		srv->config.diagnostics_msgwin_severity : LspHint;
+	base_path = lsp_utils_get_project_base_path();
 
 	g_hash_table_iter_init(&iter, srv->diag_table);
-	while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&diags))
+	while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&file_diags))
 	{
+		gchar *fname = NULL;
 		LspDiag *diag;
 
+		if (current_doc_only && !utils_str_equal(doc->real_path, key))
+			continue;
+
+		// diagnostics of files which aren't open are parsed only for the listing
+		diags = file_diags->diags ? g_ptr_array_ref(file_diags->diags) : parse_file_diags(file_diags);
+
 		foreach_ptr_array(diag, i, diags)
 		{
-			if (current_doc_only && !utils_str_equal(doc->real_path, key))
+			LspFileDiag *item;
+
+			if (diag->severity > max_severity)
 				continue;
 
+			if (!fname)
+			{
+				fname = get_display_fname(base_path, key);
+				g_ptr_array_add(msgwin_fill.fnames, fname);
+			}
+
 			item = g_new0(LspFileDiag, 1);
-			item->fname = key;
-			item->diag = diag;
-			g_ptr_array_add(arr, item);
+			item->fname = fname;
+			item->line = diag->range.start.line;
+			item->severity = diag->severity;
+			item->message = g_strdup(diag->message ? diag->message : "");
+			replace_char(item->message, '\n', ' ');
+			replace_char(item->message, '\r', ' ');
+			g_ptr_array_add(msgwin_fill.items, item);
 		}
+
+		g_ptr_array_unref(diags);
 	}
 
-	g_ptr_array_sort(arr, compare_diags);
+	g_ptr_array_sort(msgwin_fill.items, compare_diags);
 
 	msgwin_clear_tab(MSG_MESSAGE);
 	msgwin_switch_tab(MSG_MESSAGE, TRUE);
-	foreach_ptr_array(item, i, arr)
+
+	if (base_path)
+	{
+		gchar *locale_base_path = utils_get_locale_from_utf8(base_path);
+		msgwin_set_messages_dir(locale_base_path);
+		g_free(locale_base_path);
+	}
+	g_free(base_path);
+
+	msgwin_msg_add(COLOR_BLUE, -1, NULL, _("%u issues found"), msgwin_fill.items->len);
+
+	if (msgwin_fill.items->len > 0)
+		msgwin_fill.source = plugin_timeout_add(geany_plugin, 0, msgwin_fill_idle, NULL);
+	else
+		stop_msgwin_fill();
+}
+
+
+static gchar *get_snapshot_path(void)
+{
+	GeanyProject *project = geany_data->app->project;
+	gchar *checksum, *name, *path;
+
+	if (!project || !project->file_name)
+		return NULL;
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, project->file_name, -1);
+	name = g_strconcat(checksum, ".diag", NULL);
+	path = g_build_filename(geany_data->app->configdir, "plugins", PLUGIN, "diagnostics", name, NULL);
+
+	g_free(name);
+	g_free(checksum);
+	return path;
+}
+
+
+// checksum of the file the diagnostics received in this session belong to
+static gchar *get_file_checksum(const gchar *real_path)
+{
+	GeanyDocument *doc = document_find_by_real_path(real_path);
+	gchar *contents, *checksum;
+	gsize len;
+
+	// diagnostics of unsaved modifications
+	if (doc && doc->changed)
+		return NULL;
+
+	if (!g_file_get_contents(real_path, &contents, &len, NULL))
+		return NULL;
+
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar *) contents, len);
+	g_free(contents);
+	return checksum;
+}
+
+
+static void save_snapshot(void)
+{
+	LspSnapshotDiags *entry;
+	GHashTableIter iter;
+	gchar *real_path, *dirname;
+	GString *str;
+
+	str = g_string_new(SNAPSHOT_HEADER"\n");
+	g_hash_table_iter_init(&iter, snapshot.files);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &real_path, (gpointer *) &entry))
+	{
+		GeanyFiletype *ft = filetypes_index(entry->ft_id);
+		gchar *checksum, *raw_str;
+
+		if (!ft || g_variant_n_children(entry->raw) == 0)
+			continue;
+
+		checksum = entry->checksum ? g_strdup(entry->checksum) : get_file_checksum(real_path);
+		if (!checksum)
+			continue;
+
+		raw_str = g_variant_print(entry->raw, TRUE);
+		g_string_append_printf(str, "%s\t%s\t", ft->name, checksum);
+		lsp_utils_append_escaped(str, real_path);
+		g_string_append_c(str, '\t');
+		g_string_append(str, raw_str);
+		g_string_append_c(str, '\n');
+
+		g_free(raw_str);
+		g_free(checksum);
+	}
+
+	dirname = g_path_get_dirname(snapshot.path);
+	utils_mkdir(dirname, TRUE);
+	if (!g_file_set_contents(snapshot.path, str->str, str->len, NULL))
+		msgwin_status_add(_("Cannot write LSP diagnostics snapshot %s"), snapshot.path);
+
+	g_free(dirname);
+	g_string_free(str, TRUE);
+}
+
+
+static void load_snapshot(void)
+{
+	gchar *contents = NULL;
+	gchar **lines, **line;
+
+	if (!g_file_get_contents(snapshot.path, &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	if (g_strcmp0(lines[0], SNAPSHOT_HEADER) != 0)
+	{
+		g_strfreev(lines);
+		return;
+	}
+
+	for (line = lines + 1; *line; line++)
+	{
+		gchar **fields = g_strsplit(*line, "\t", 4);
+		GeanyFiletype *ft = g_strv_length(fields) == 4 ? filetypes_lookup_by_name(fields[0]) : NULL;
+		GVariant *raw = ft ? g_variant_parse(NULL, fields[3], NULL, NULL, NULL) : NULL;
+
+		if (raw && g_variant_is_of_type(raw, G_VARIANT_TYPE_ARRAY))
+		{
+			LspSnapshotDiags *entry = g_new0(LspSnapshotDiags, 1);
+
+			entry->raw = raw;
+			entry->ft_id = ft->id;
+			entry->checksum = g_strdup(fields[1]);
+			g_hash_table_insert(snapshot.files, g_strcompress(fields[2]), entry);
+		}
+		else if (raw)
+			g_variant_unref(raw);
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+}
+
+
+/* loads diagnostics stored with the current project in the previous session */
+void lsp_diagnostics_snapshot_load(void)
+{
+	lsp_diagnostics_snapshot_unload();
+
+	snapshot.path = get_snapshot_path();
+	if (!snapshot.path)
+		return;
+
+	snapshot.files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)snapshot_diags_free);
+	load_snapshot();
+}
+
+
+/* stores diagnostics of the current project for the next session */
+void lsp_diagnostics_snapshot_unload(void)
+{
+	if (snapshot.files)
 	{
-		show_in_msgwin(item);
+		save_snapshot();
+		g_hash_table_destroy(snapshot.files);
 	}
+	snapshot.files = NULL;
 
-	g_ptr_array_free(arr, TRUE);
+	g_free(snapshot.path);
+	snapshot.path = NULL;
 }
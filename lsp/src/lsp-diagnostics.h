@@ -35,7 +35,10 @@ void lsp_diagnostics_show_all(gboolean current_doc_only);
 
 void lsp_diagnostics_received(LspServer *srv, GVariant* diags);
 void lsp_diagnostics_redraw(GeanyDocument *doc);
+void lsp_diagnostics_scrolled(GeanyDocument *doc);
+void lsp_diagnostics_pull(GeanyDocument *doc);
 void lsp_diagnostics_clear(LspServer *srv, GeanyDocument *doc);
+void lsp_diagnostics_clear_companion(LspServer *srv);
 
 void lsp_diagnostics_style_init(GeanyDocument *doc);
 
@@ -45,4 +48,10 @@ GVariant *lsp_diagnostics_get_diag_raw(gint pos);
 void lsp_diagnostics_goto_next_diag(gint pos);
 void lsp_diagnostics_goto_prev_diag(gint pos);
 
+void lsp_diagnostics_snapshot_load(void);
+void lsp_diagnostics_snapshot_unload(void);
+
+gsize lsp_diagnostics_get_cache_size(LspServer *srv, GeanyDocument *doc);
+void lsp_diagnostics_drop_unopened(LspServer *srv);
+
 #endif  /* LSP_DIAGNOSTICS_H */
@@ -0,0 +1,349 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Results of the server stored per file in the plugin's configuration
+ * directory so they can be shown right after opening the file in the next
+ * session, before the server sends its own. An entry is valid only for the
+ * file contents and file type it was stored for. Checksums are computed and
+ * entries read and written by worker threads. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-disk-cache.h"
+#include "lsp-utils.h"
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#define CACHE_HEADER "LSP-CACHE 1"
+// entries not used for this long are removed
+#define CACHE_MAX_AGE (30 * G_TIME_SPAN_DAY)
+// maximum number of entries, the least recently used ones are removed first
+#define CACHE_MAX_FILES 1000
+
+
+typedef struct
+{
+	gchar *path;  // locale
+	gchar *ft_name;
+	gchar *text;  // document text the entry is for
+	gsize text_len;
+	gchar *contents;  // stored or loaded entry contents
+	guint doc_id;
+	LspDiskCacheCallback callback;
+} CacheTask;
+
+
+typedef struct
+{
+	gchar *name;
+	gint64 mtime;
+} CacheFile;
+
+
+extern GeanyData *geany_data;
+
+static GMutex tasks_mutex;
+static GCond tasks_cond;
+static guint running_tasks = 0;
+static gboolean pruned = FALSE;
+
+
+static void cache_task_free(CacheTask *task)
+{
+	g_free(task->path);
+	g_free(task->ft_name);
+	g_free(task->text);
+	g_free(task->contents);
+	g_free(task);
+}
+
+
+static gchar *get_cache_dir(void)
+{
+	return g_build_filename(geany_data->app->configdir, "plugins", PLUGIN, "cache", NULL);
+}
+
+
+static gchar *get_cache_path(GeanyDocument *doc, const gchar *kind)
+{
+	gchar *checksum, *name, *dir, *path;
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, doc->real_path, -1);
+	name = g_strconcat(checksum, ".", kind, NULL);
+	dir = get_cache_dir();
+	path = g_build_filename(dir, name, NULL);
+
+	g_free(dir);
+	g_free(name);
+	g_free(checksum);
+	return path;
+}
+
+
+// first line of the entry identifying the document contents
+static gchar *get_header(CacheTask *task)
+{
+	gchar *checksum, *header;
+
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar *) task->text, task->text_len);
+	header = g_strdup_printf("%s\t%s\t%s\n", CACHE_HEADER, task->ft_name, checksum);
+
+	g_free(checksum);
+	return header;
+}
+
+
+static void task_started(void)
+{
+	g_mutex_lock(&tasks_mutex);
+	running_tasks++;
+	g_mutex_unlock(&tasks_mutex);
+}
+
+
+static void task_finished(void)
+{
+	g_mutex_lock(&tasks_mutex);
+	running_tasks--;
+	g_cond_broadcast(&tasks_cond);
+	g_mutex_unlock(&tasks_mutex);
+}
+
+
+static gint sort_files_newest_first(gconstpointer a, gconstpointer b)
+{
+	const CacheFile *f1 = *((const CacheFile **) a);
+	const CacheFile *f2 = *((const CacheFile **) b);
+
+	return f1->mtime < f2->mtime ? 1 : (f1->mtime > f2->mtime ? -1 : 0);
+}
+
+
+static void cache_file_free(CacheFile *file)
+{
+	g_free(file->name);
+	g_free(file);
+}
+
+
+static void prune_thread(GTask *task, gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	const gchar *dirname = task_data;
+	gint64 now = g_get_real_time();
+	GPtrArray *files;
+	const gchar *name;
+	GDir *dir;
+	guint i;
+
+	dir = g_dir_open(dirname, 0, NULL);
+	if (!dir)
+	{
+		g_task_return_boolean(task, TRUE);
+		task_finished();
+		return;
+	}
+
+	files = g_ptr_array_new_with_free_func((GDestroyNotify) cache_file_free);
+	while ((name = g_dir_read_name(dir)) != NULL)
+	{
+		CacheFile *file;
+		GStatBuf st;
+
+		file = g_new0(CacheFile, 1);
+		file->name = g_build_filename(dirname, name, NULL);
+		if (g_stat(file->name, &st) == 0)
+			file->mtime = (gint64) st.st_mtime * G_USEC_PER_SEC;
+		g_ptr_array_add(files, file);
+	}
+	g_dir_close(dir);
+
+	g_ptr_array_sort(files, sort_files_newest_first);
+	for (i = 0; i < files->len; i++)
+	{
+		CacheFile *file = files->pdata[i];
+
+		if (i >= CACHE_MAX_FILES || now - file->mtime > CACHE_MAX_AGE)
+			g_unlink(file->name);
+	}
+
+	g_ptr_array_free(files, TRUE);
+	g_task_return_boolean(task, TRUE);
+	task_finished();
+}
+
+
+static void run_task(gpointer task_data, GDestroyNotify task_data_free, GTaskThreadFunc func,
+	GAsyncReadyCallback callback)
+{
+	GTask *task = g_task_new(NULL, NULL, callback, NULL);
+
+	task_started();
+	g_task_set_task_data(task, task_data, task_data_free);
+	g_task_run_in_thread(task, func);
+	g_object_unref(task);
+}
+
+
+// removes expired entries once per session
+static void prune_cache(void)
+{
+	if (pruned)
+		return;
+
+	pruned = TRUE;
+	run_task(get_cache_dir(), g_free, prune_thread, NULL);
+}
+
+
+static CacheTask *new_cache_task(GeanyDocument *doc, const gchar *kind)
+{
+	CacheTask *task = g_new0(CacheTask, 1);
+
+	task->path = get_cache_path(doc, kind);
+	task->ft_name = g_strdup(doc->file_type->name);
+	task->text = sci_get_contents(doc->editor->sci, -1);
+	task->text_len = sci_get_length(doc->editor->sci);
+	task->doc_id = doc->id;
+
+	return task;
+}
+
+
+static void load_thread(GTask *task, gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	CacheTask *cache_task = task_data;
+	gchar *contents = NULL;
+
+	if (g_file_get_contents(cache_task->path, &contents, NULL, NULL))
+	{
+		gchar *header = get_header(cache_task);
+
+		if (g_str_has_prefix(contents, header))
+		{
+			cache_task->contents = g_strdup(contents + strlen(header));
+			// used entries don't expire
+			g_utime(cache_task->path, NULL);
+		}
+
+		g_free(header);
+		g_free(contents);
+	}
+
+	g_task_return_boolean(task, TRUE);
+	task_finished();
+}
+
+
+static void load_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	CacheTask *cache_task = g_task_get_task_data(G_TASK(res));
+	GeanyDocument *doc = document_find_by_id(cache_task->doc_id);
+
+	// the entry is only valid for the text it was checked against
+	if (doc && cache_task->contents && !doc->changed &&
+		(gsize) sci_get_length(doc->editor->sci) == cache_task->text_len)
+	{
+		cache_task->callback(doc, cache_task->contents);
+	}
+}
+
+
+/* calls callback with the contents stored for the current document text when
+ * there is such an entry */
+void lsp_disk_cache_load(GeanyDocument *doc, const gchar *kind, LspDiskCacheCallback callback)
+{
+	CacheTask *task;
+
+	if (!doc->real_path)
+		return;
+
+	prune_cache();
+
+	task = new_cache_task(doc, kind);
+	// don't copy the text of documents without an entry
+	if (!g_file_test(task->path, G_FILE_TEST_EXISTS))
+	{
+		cache_task_free(task);
+		return;
+	}
+	task->callback = callback;
+	run_task(task, (GDestroyNotify) cache_task_free, load_thread, load_done);
+}
+
+
+static void store_thread(GTask *task, gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	CacheTask *cache_task = task_data;
+	gchar *dirname, *header, *data;
+
+	header = get_header(cache_task);
+	data = g_strconcat(header, cache_task->contents, NULL);
+	dirname = g_path_get_dirname(cache_task->path);
+	g_mkdir_with_parents(dirname, 0755);
+	g_file_set_contents(cache_task->path, data, -1, NULL);
+
+	g_free(dirname);
+	g_free(data);
+	g_free(header);
+
+	g_task_return_boolean(task, TRUE);
+	task_finished();
+}
+
+
+/* stores contents for the current document text, NULL removes the entry */
+void lsp_disk_cache_store(GeanyDocument *doc, const gchar *kind, const gchar *contents)
+{
+	CacheTask *task;
+
+	// the next session gets the file from disk, not these modifications
+	if (!doc->real_path || doc->changed)
+		return;
+
+	if (!contents)
+	{
+		gchar *path = get_cache_path(doc, kind);
+
+		g_unlink(path);
+		g_free(path);
+		return;
+	}
+
+	prune_cache();
+
+	task = new_cache_task(doc, kind);
+	task->contents = g_strdup(contents);
+	run_task(task, (GDestroyNotify) cache_task_free, store_thread, NULL);
+}
+
+
+/* blocks until entries being stored are written, e.g. before unloading */
+void lsp_disk_cache_wait(void)
+{
+	g_mutex_lock(&tasks_mutex);
+	while (running_tasks > 0)
+		g_cond_wait(&tasks_cond, &tasks_mutex);
+	g_mutex_unlock(&tasks_mutex);
+}
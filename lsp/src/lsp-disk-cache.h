@@ -0,0 +1,30 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_DISK_CACHE_H
+#define LSP_DISK_CACHE_H 1
+
+#include <geanyplugin.h>
+
+typedef void (*LspDiskCacheCallback) (GeanyDocument *doc, const gchar *contents);
+
+void lsp_disk_cache_load(GeanyDocument *doc, const gchar *kind, LspDiskCacheCallback callback);
+void lsp_disk_cache_store(GeanyDocument *doc, const gchar *kind, const gchar *contents);
+void lsp_disk_cache_wait(void);
+
+#endif  /* LSP_DISK_CACHE_H */
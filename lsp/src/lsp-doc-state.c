@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-doc-state.h"
+
+
+#define DOC_STATE_KEY "lsp_doc_state"
+
+
+extern GeanyPlugin *geany_plugin;
+
+// notifications usually come for the same document many times in a row
+static GeanyDocument *last_doc;
+static LspDocState *last_state;
+
+
+static void doc_state_free(LspDocState *state)
+{
+	if (state == last_state)
+	{
+		last_doc = NULL;
+		last_state = NULL;
+	}
+
+	if (state->update_source != 0)
+		g_source_remove(state->update_source);
+	if (state->reload_source != 0)
+		g_source_remove(state->reload_source);
+	if (state->semtokens && state->semtokens_free)
+		state->semtokens_free(state->semtokens);
+
+	g_free(state->configured_path);
+	g_free(state->diag_disabled_path);
+	g_free(state->lang_id);
+	g_free(state->root);
+	g_free(state->uri);
+	g_free(state->uri_path);
+	g_free(state->reload_text);
+	g_free(state);
+}
+
+
+/* The state is created on first use and freed together with the document */
+LspDocState *lsp_doc_state_get(GeanyDocument *doc)
+{
+	LspDocState *state;
+
+	if (doc == last_doc)
+		return last_state;
+
+	state = plugin_get_document_data(geany_plugin, doc, DOC_STATE_KEY);
+	if (!state)
+	{
+		state = g_new0(LspDocState, 1);
+		plugin_set_document_data_full(geany_plugin, doc, DOC_STATE_KEY, state,
+			(GDestroyNotify)doc_state_free);
+	}
+
+	last_doc = doc;
+	last_state = state;
+
+	return state;
+}
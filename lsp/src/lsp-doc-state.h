@@ -0,0 +1,68 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_DOC_STATE_H
+#define LSP_DOC_STATE_H 1
+
+#include <geanyplugin.h>
+
+
+struct LspServer;
+struct LspServerConfig;
+
+/* Per-document state used on every edit or request, fetched by a single
+ * lookup instead of a string-keyed document data lookup per value */
+typedef struct
+{
+	// lsp-sync.c
+	guint version;
+
+	// lsp-server.c
+	gboolean configured_valid;
+	// filetype index of the configured (not running) server for the document,
+	// -1 when there's none - servers are replaced on restarts, their slots stay
+	gint configured_ft;
+	gchar *configured_path;  // real path the configured server was found for
+	GeanyFiletype *ft;
+	gchar *lang_id;
+	gchar *root;
+
+	// lsp-utils.c
+	gchar *uri;
+	gchar *uri_path;  // real path the URI is for
+
+	// lsp-main.c
+	guint update_source;
+	guint reload_source;
+	gchar *reload_text;
+	gint reload_text_len;
+
+	// lsp-diagnostics.c
+	const struct LspServerConfig *diag_disabled_cfg;  // config the verdict is for, NULL if unknown
+	gchar *diag_disabled_path;  // real path the verdict is for
+	gboolean diag_disabled;
+
+	// lsp-semtokens.c
+	gpointer semtokens;
+	GDestroyNotify semtokens_free;
+} LspDocState;
+
+
+LspDocState *lsp_doc_state_get(GeanyDocument *doc);
+
+#endif  /* LSP_DOC_STATE_H */
@@ -0,0 +1,650 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Index of the files under the project base path used by goto file. The
+ * directory tree is crawled in a background thread, skipping files matched by
+ * .gitignore and .ignore files, and kept up to date using directory monitors.
+ * Paths are kept relative to the base path in a sorted array. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-file-index.h"
+#include "lsp-server.h"
+#include "lsp-symbol.h"
+#include "lsp-utils.h"
+#include "lsp-workspace-index.h"
+
+#include <gio/gio.h>
+#include <string.h>
+
+/* upper bound of indexed files to keep the memory use sane */
+#define FILE_INDEX_MAX 500000
+/* directories above this number aren't monitored, their changes are
+ * picked up by the next crawl only */
+#define MONITORS_MAX 8192
+/* delay of a new crawl after a directory was created */
+#define RECRAWL_DELAY 2000
+
+
+typedef struct
+{
+	gchar *dir;  /* directory of the ignore file relative to the base path */
+	gsize dir_len;
+	GPatternSpec *pattern;
+	gboolean anchored;  /* matched against the path relative to dir instead of the name */
+	gboolean dir_only;
+	gboolean negated;
+} IgnoreRule;
+
+
+typedef struct
+{
+	gchar *base_path;  /* locale */
+	GStringChunk *strings;
+	GPtrArray *files;  /* sorted locale paths relative to base_path, stored in strings */
+	GPtrArray *dirs;  /* crawled directories relative to base_path, stored in strings */
+	GPtrArray *rules;  /* IgnoreRule */
+} CrawlResult;
+
+
+extern GeanyData *geany_data;
+extern GeanyPlugin *geany_plugin;
+
+static struct
+{
+	gchar *base_path;  /* locale, NULL when not indexing */
+	CrawlResult *crawl;  /* NULL until the first crawl finishes */
+	GCancellable *cancellable;
+	GPtrArray *monitors;
+	guint recrawl_source;
+	GPtrArray *view;  /* GPtrArray<LspSymbol> built on demand */
+	guint view_docs_hash;
+	LspFileIndexListener listener;
+	gpointer listener_data;
+} s_index;
+
+
+static void ignore_rule_free(IgnoreRule *rule)
+{
+	g_free(rule->dir);
+	g_pattern_spec_free(rule->pattern);
+	g_free(rule);
+}
+
+
+static CrawlResult *crawl_result_new(const gchar *base_path)
+{
+	CrawlResult *res = g_new0(CrawlResult, 1);
+
+	res->base_path = g_strdup(base_path);
+	res->strings = g_string_chunk_new(65536);
+	res->files = g_ptr_array_new();
+	res->dirs = g_ptr_array_new();
+	res->rules = g_ptr_array_new_with_free_func((GDestroyNotify)ignore_rule_free);
+
+	return res;
+}
+
+
+static void crawl_result_free(CrawlResult *res)
+{
+	if (!res)
+		return;
+
+	g_free(res->base_path);
+	g_ptr_array_free(res->files, TRUE);
+	g_ptr_array_free(res->dirs, TRUE);
+	g_ptr_array_free(res->rules, TRUE);
+	g_string_chunk_free(res->strings);
+	g_free(res);
+}
+
+
+static gboolean pattern_match(GPatternSpec *pattern, const gchar *str)
+{
+#if GLIB_CHECK_VERSION(2, 70, 0)
+	return g_pattern_spec_match_string(pattern, str);
+#else
+	return g_pattern_match_string(pattern, str);
+#endif
+}
+
+
+/* the last matching rule wins like in git - negated rules re-include paths */
+static gboolean is_ignored(GPtrArray *rules, const gchar *rel_path, gboolean is_dir)
+{
+	const gchar *name = strrchr(rel_path, G_DIR_SEPARATOR);
+	gboolean ignored = FALSE;
+	guint i;
+
+	name = name ? name + 1 : rel_path;
+
+	if (is_dir && (g_strcmp0(name, ".git") == 0 || g_strcmp0(name, ".hg") == 0 ||
+		g_strcmp0(name, ".svn") == 0 || g_strcmp0(name, ".bzr") == 0))
+		return TRUE;
+
+	for (i = 0; i < rules->len; i++)
+	{
+		IgnoreRule *rule = rules->pdata[i];
+		const gchar *path = rel_path;
+
+		if (rule->dir_only && !is_dir)
+			continue;
+
+		if (rule->dir_len > 0)
+		{
+			if (strncmp(rel_path, rule->dir, rule->dir_len) != 0 ||
+				rel_path[rule->dir_len] != G_DIR_SEPARATOR)
+				continue;
+			path = rel_path + rule->dir_len + 1;
+		}
+
+		if (pattern_match(rule->pattern, rule->anchored ? path : name))
+			ignored = !rule->negated;
+	}
+
+	return ignored;
+}
+
+
+static void read_ignore_file(CrawlResult *res, const gchar *rel_dir, const gchar *dir_path,
+	const gchar *fname)
+{
+	gchar *path = g_build_filename(dir_path, fname, NULL);
+	gchar *contents;
+	gchar **lines, **line;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		g_free(path);
+		return;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	foreach_strv(line, lines)
+	{
+		gchar *pattern = g_strstrip(*line);
+		IgnoreRule *rule;
+		gboolean negated = FALSE;
+		gboolean dir_only = FALSE;
+		gboolean anchored;
+		gsize len;
+
+		if (*pattern == '#')
+			continue;
+		if (*pattern == '!')
+		{
+			negated = TRUE;
+			pattern++;
+		}
+
+		len = strlen(pattern);
+		if (len > 0 && pattern[len - 1] == '/')
+		{
+			dir_only = TRUE;
+			pattern[len - 1] = '\0';
+		}
+
+		anchored = strchr(pattern, '/') != NULL;
+		if (*pattern == '/')
+			pattern++;
+		if (!*pattern)
+			continue;
+
+		if (G_DIR_SEPARATOR != '/')
+			g_strdelimit(pattern, "/", G_DIR_SEPARATOR);
+
+		rule = g_new0(IgnoreRule, 1);
+		rule->dir = g_strdup(rel_dir);
+		rule->dir_len = strlen(rel_dir);
+		rule->pattern = g_pattern_spec_new(pattern);
+		rule->anchored = anchored;
+		rule->dir_only = dir_only;
+		rule->negated = negated;
+		g_ptr_array_add(res->rules, rule);
+	}
+
+	g_strfreev(lines);
+	g_free(contents);
+	g_free(path);
+}
+
+
+static void crawl_dir(CrawlResult *res, const gchar *rel_dir, GCancellable *cancellable)
+{
+	gchar *dir_path = *rel_dir ? g_build_filename(res->base_path, rel_dir, NULL) : g_strdup(res->base_path);
+	GDir *dir = g_dir_open(dir_path, 0, NULL);
+	GPtrArray *subdirs;
+	const gchar *name;
+	guint i;
+
+	if (!dir)
+	{
+		g_free(dir_path);
+		return;
+	}
+
+	g_ptr_array_add(res->dirs, g_string_chunk_insert(res->strings, rel_dir));
+	read_ignore_file(res, rel_dir, dir_path, ".gitignore");
+	read_ignore_file(res, rel_dir, dir_path, ".ignore");
+
+	subdirs = g_ptr_array_new_with_free_func(g_free);
+	while ((name = g_dir_read_name(dir)) && res->files->len < FILE_INDEX_MAX)
+	{
+		gchar *path = g_build_filename(dir_path, name, NULL);
+		gchar *rel_path = *rel_dir ? g_build_filename(rel_dir, name, NULL) : g_strdup(name);
+		gboolean is_dir = g_file_test(path, G_FILE_TEST_IS_DIR);
+
+		// symlinked directories could create loops
+		if (is_dir && g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+			;
+		else if (is_ignored(res->rules, rel_path, is_dir))
+			;
+		else if (is_dir)
+		{
+			g_ptr_array_add(subdirs, rel_path);
+			rel_path = NULL;
+		}
+		else
+			g_ptr_array_add(res->files, g_string_chunk_insert(res->strings, rel_path));
+
+		g_free(rel_path);
+		g_free(path);
+	}
+	g_dir_close(dir);
+
+	for (i = 0; i < subdirs->len && !g_cancellable_is_cancelled(cancellable); i++)
+		crawl_dir(res, subdirs->pdata[i], cancellable);
+
+	g_ptr_array_free(subdirs, TRUE);
+	g_free(dir_path);
+}
+
+
+static gint compare_paths(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+
+static void crawl_thread(GTask *task, G_GNUC_UNUSED gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	CrawlResult *res = crawl_result_new(task_data);
+
+	crawl_dir(res, "", cancellable);
+	g_ptr_array_sort(res->files, compare_paths);
+
+	g_task_return_pointer(task, res, (GDestroyNotify)crawl_result_free);
+}
+
+
+/* index of the first path not smaller than rel_path */
+static guint lower_bound(GPtrArray *files, const gchar *rel_path)
+{
+	guint lo = 0, hi = files->len;
+
+	while (lo < hi)
+	{
+		guint mid = lo + (hi - lo) / 2;
+
+		if (strcmp(files->pdata[mid], rel_path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static gboolean contains_file(const gchar *rel_path)
+{
+	GPtrArray *files = s_index.crawl->files;
+	guint i = lower_bound(files, rel_path);
+
+	return i < files->len && strcmp(files->pdata[i], rel_path) == 0;
+}
+
+
+static void clear_view(void)
+{
+	if (s_index.view)
+		g_ptr_array_unref(s_index.view);
+	s_index.view = NULL;
+}
+
+
+static void add_file(const gchar *rel_path)
+{
+	GPtrArray *files = s_index.crawl->files;
+	guint i = lower_bound(files, rel_path);
+
+	if (files->len >= FILE_INDEX_MAX)
+		return;
+	if (i < files->len && strcmp(files->pdata[i], rel_path) == 0)
+		return;
+
+	g_ptr_array_insert(files, i, g_string_chunk_insert(s_index.crawl->strings, rel_path));
+	clear_view();
+}
+
+
+/* removes the file or, for directories, all the files below */
+static void remove_files(const gchar *rel_path)
+{
+	GPtrArray *files = s_index.crawl->files;
+	gchar *prefix = g_strconcat(rel_path, G_DIR_SEPARATOR_S, NULL);
+	guint start, end;
+
+	start = lower_bound(files, rel_path);
+	if (start < files->len && strcmp(files->pdata[start], rel_path) == 0)
+	{
+		g_ptr_array_remove_index(files, start);
+		clear_view();
+	}
+
+	// paths with a common prefix are adjacent in the sorted array
+	start = lower_bound(files, prefix);
+	for (end = start; end < files->len && g_str_has_prefix(files->pdata[end], prefix); end++)
+		;
+	if (end > start)
+	{
+		g_ptr_array_remove_range(files, start, end - start);
+		clear_view();
+	}
+
+	g_free(prefix);
+}
+
+
+static void start_crawl(void);
+
+
+static gboolean recrawl_cb(G_GNUC_UNUSED gpointer user_data)
+{
+	s_index.recrawl_source = 0;
+	start_crawl();
+	return G_SOURCE_REMOVE;
+}
+
+
+static void on_file_changed(G_GNUC_UNUSED GFileMonitor *monitor, GFile *file,
+	G_GNUC_UNUSED GFile *other_file, GFileMonitorEvent event, G_GNUC_UNUSED gpointer user_data)
+{
+	gsize base_len;
+	gchar *path;
+
+	if (!s_index.crawl)
+		return;
+
+	path = g_file_get_path(file);
+	if (path && s_index.listener)
+		s_index.listener(path, event, s_index.listener_data);
+
+	if (event != G_FILE_MONITOR_EVENT_CREATED && event != G_FILE_MONITOR_EVENT_DELETED)
+	{
+		g_free(path);
+		return;
+	}
+
+	base_len = strlen(s_index.base_path);
+	if (path && g_str_has_prefix(path, s_index.base_path) && path[base_len] == G_DIR_SEPARATOR)
+	{
+		const gchar *rel_path = path + base_len + 1;
+
+		if (event == G_FILE_MONITOR_EVENT_DELETED)
+		{
+			remove_files(rel_path);
+			lsp_workspace_index_file_removed(path);
+		}
+		else
+		{
+			gboolean is_dir = g_file_test(path, G_FILE_TEST_IS_DIR);
+
+			if (is_ignored(s_index.crawl->rules, rel_path, is_dir))
+				;
+			else if (is_dir)
+			{
+				// new directories need crawling and monitoring - do it in one go
+				// after things calm down
+				if (s_index.recrawl_source)
+					g_source_remove(s_index.recrawl_source);
+				s_index.recrawl_source = plugin_timeout_add(geany_plugin, RECRAWL_DELAY, recrawl_cb, NULL);
+			}
+			else
+				add_file(rel_path);
+		}
+	}
+
+	g_free(path);
+}
+
+
+static void monitor_free(GFileMonitor *monitor)
+{
+	g_signal_handlers_disconnect_by_func(monitor, on_file_changed, NULL);
+	g_file_monitor_cancel(monitor);
+	g_object_unref(monitor);
+}
+
+
+static void update_monitors(void)
+{
+	GPtrArray *dirs = s_index.crawl->dirs;
+	guint i;
+
+	g_ptr_array_set_size(s_index.monitors, 0);
+
+	for (i = 0; i < dirs->len && i < MONITORS_MAX; i++)
+	{
+		const gchar *rel_dir = dirs->pdata[i];
+		gchar *path = *rel_dir ? g_build_filename(s_index.base_path, rel_dir, NULL) : g_strdup(s_index.base_path);
+		GFile *file = g_file_new_for_path(path);
+		GFileMonitor *monitor = g_file_monitor_directory(file, G_FILE_MONITOR_NONE, NULL, NULL);
+
+		if (monitor)
+		{
+			g_signal_connect(monitor, "changed", G_CALLBACK(on_file_changed), NULL);
+			g_ptr_array_add(s_index.monitors, monitor);
+		}
+
+		g_object_unref(file);
+		g_free(path);
+	}
+}
+
+
+static void crawl_finished_cb(G_GNUC_UNUSED GObject *source_object, GAsyncResult *result,
+	G_GNUC_UNUSED gpointer user_data)
+{
+	CrawlResult *res = g_task_propagate_pointer(G_TASK(result), NULL);
+
+	// cancelled - the index may have been unloaded or recrawled in the meantime
+	if (!res)
+		return;
+
+	crawl_result_free(s_index.crawl);
+	s_index.crawl = res;
+	g_clear_object(&s_index.cancellable);
+	clear_view();
+
+	update_monitors();
+}
+
+
+static void start_crawl(void)
+{
+	GTask *task;
+
+	if (s_index.cancellable)
+	{
+		g_cancellable_cancel(s_index.cancellable);
+		g_object_unref(s_index.cancellable);
+	}
+	s_index.cancellable = g_cancellable_new();
+
+	task = g_task_new(NULL, s_index.cancellable, crawl_finished_cb, NULL);
+	g_task_set_task_data(task, g_strdup(s_index.base_path), g_free);
+	g_task_run_in_thread(task, crawl_thread);
+	g_object_unref(task);
+}
+
+
+void lsp_file_index_unload(void)
+{
+	if (s_index.cancellable)
+	{
+		g_cancellable_cancel(s_index.cancellable);
+		g_object_unref(s_index.cancellable);
+	}
+	s_index.cancellable = NULL;
+
+	if (s_index.recrawl_source)
+		g_source_remove(s_index.recrawl_source);
+	s_index.recrawl_source = 0;
+
+	if (s_index.monitors)
+		g_ptr_array_free(s_index.monitors, TRUE);
+	s_index.monitors = NULL;
+
+	clear_view();
+	crawl_result_free(s_index.crawl);
+	s_index.crawl = NULL;
+
+	g_free(s_index.base_path);
+	s_index.base_path = NULL;
+}
+
+
+void lsp_file_index_load(void)
+{
+	gchar *base_path;
+
+	lsp_file_index_unload();
+
+	// the monitors are needed by the listener even without the goto file feature
+	if (!lsp_server_get_all_section_config()->goto_file_index_enable && !s_index.listener)
+		return;
+
+	base_path = lsp_utils_get_project_base_path();
+	if (!base_path)
+		return;
+
+	s_index.base_path = utils_get_locale_from_utf8(base_path);
+	s_index.monitors = g_ptr_array_new_with_free_func((GDestroyNotify)monitor_free);
+	start_crawl();
+
+	g_free(base_path);
+}
+
+
+void lsp_file_index_set_listener(LspFileIndexListener listener, gpointer user_data)
+{
+	gboolean was_set = s_index.listener != NULL;
+
+	s_index.listener = listener;
+	s_index.listener_data = user_data;
+
+	if (listener && !was_set && !s_index.base_path)
+		lsp_file_index_load();
+}
+
+
+static guint hash_documents(void)
+{
+	guint hash = 0;
+	guint i;
+
+	foreach_document(i)
+	{
+		if (documents[i]->real_path)
+			hash = hash * 31 + g_str_hash(documents[i]->real_path);
+	}
+
+	return hash;
+}
+
+
+static void add_symbol(LspSymbolPool *pool, const gchar *path)
+{
+	gchar *file_name = utils_get_utf8_from_locale(path);
+	const gchar *name = strrchr(file_name, G_DIR_SEPARATOR);
+
+	name = name ? name + 1 : file_name;
+	g_ptr_array_add(s_index.view, lsp_symbol_pool_new_symbol(pool, name, "", "", file_name,
+		0, 0, 0, 0, TM_ICON_OTHER));
+
+	g_free(file_name);
+}
+
+
+/* Returns the indexed files together with open documents outside the index as
+ * symbols suitable for the goto panel, or NULL when the project isn't indexed
+ * (yet). The returned array is owned by the index and valid until the next call. */
+GPtrArray *lsp_file_index_get(void)
+{
+	GPtrArray *files;
+	LspSymbolPool *pool;
+	gsize base_len;
+	guint docs_hash;
+	guint i;
+
+	if (!s_index.crawl)
+		return NULL;
+
+	docs_hash = hash_documents();
+	if (s_index.view && s_index.view_docs_hash == docs_hash)
+		return s_index.view;
+
+	clear_view();
+
+	files = s_index.crawl->files;
+	base_len = strlen(s_index.base_path);
+	pool = lsp_symbol_pool_new();
+	s_index.view = g_ptr_array_new_full(files->len, (GDestroyNotify)lsp_symbol_unref);
+	s_index.view_docs_hash = docs_hash;
+
+	foreach_document(i)
+	{
+		const gchar *real_path = documents[i]->real_path;
+
+		if (!real_path)
+			continue;
+
+		if (g_str_has_prefix(real_path, s_index.base_path) && real_path[base_len] == G_DIR_SEPARATOR &&
+			contains_file(real_path + base_len + 1))
+			continue;
+
+		add_symbol(pool, real_path);
+	}
+
+	for (i = 0; i < files->len; i++)
+	{
+		gchar *path = g_build_filename(s_index.base_path, files->pdata[i], NULL);
+
+		add_symbol(pool, path);
+		g_free(path);
+	}
+
+	lsp_symbol_pool_unref(pool);
+
+	return s_index.view;
+}
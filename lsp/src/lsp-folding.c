@@ -0,0 +1,309 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Fold levels from textDocument/foldingRange replace those of the lexer
+ * (whose "fold" property is switched off). The fold level of a line only
+ * depends on the ranges containing it so after a new response only lines
+ * inside ranges that appeared or disappeared are looked at, and of these only
+ * lines whose level really differs are set. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-folding.h"
+#include "lsp-utils.h"
+#include "lsp-rpc.h"
+#include "lsp-sync.h"
+
+#include <jsonrpc-glib.h>
+
+
+#define FOLDING_CACHE_KEY "lsp_folding_cache"
+
+
+typedef struct
+{
+	gint start;
+	gint end;
+} FoldRange;
+
+
+typedef struct
+{
+	guint version;  // of the document the ranges were received for
+	GArray *ranges;  // FoldRange sorted by start and end
+	gboolean lexer_fold_disabled;
+} FoldingCache;
+
+
+typedef struct
+{
+	GeanyDocument *doc;
+	guint doc_id;
+	guint version;
+} LspFoldingData;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+static LspRpcRequest pending_request;
+
+
+static void cache_free(FoldingCache *cache)
+{
+	if (cache->ranges)
+		g_array_free(cache->ranges, TRUE);
+	g_free(cache);
+}
+
+
+static FoldingCache *get_cache(GeanyDocument *doc, gboolean create)
+{
+	FoldingCache *cache = plugin_get_document_data(geany_plugin, doc, FOLDING_CACHE_KEY);
+
+	if (!cache && create)
+	{
+		cache = g_new0(FoldingCache, 1);
+		plugin_set_document_data_full(geany_plugin, doc, FOLDING_CACHE_KEY, cache,
+			(GDestroyNotify)cache_free);
+	}
+
+	return cache;
+}
+
+
+static gint compare_ranges(gconstpointer a, gconstpointer b)
+{
+	const FoldRange *r1 = a;
+	const FoldRange *r2 = b;
+
+	if (r1->start != r2->start)
+		return r1->start - r2->start;
+	return r1->end - r2->end;
+}
+
+
+static GArray *parse_ranges(GVariant *return_value)
+{
+	GArray *ranges = g_array_new(FALSE, FALSE, sizeof(FoldRange));
+	GVariant *range = NULL;
+	GVariantIter iter;
+
+	g_variant_iter_init(&iter, return_value);
+
+	while (g_variant_iter_loop(&iter, "v", &range))
+	{
+		gint64 start = -1, end = -1;
+
+		JSONRPC_MESSAGE_PARSE(range,
+			"startLine", JSONRPC_MESSAGE_GET_INT64(&start),
+			"endLine", JSONRPC_MESSAGE_GET_INT64(&end)
+		);
+
+		// ranges spanning a single line cannot be folded
+		if (start >= 0 && end > start)
+		{
+			FoldRange r = {start, end};
+			g_array_append_val(ranges, r);
+		}
+	}
+
+	g_array_sort(ranges, compare_ranges);
+
+	return ranges;
+}
+
+
+static void mark_affected(gint *affected, const FoldRange *r, gint line_count)
+{
+	if (r->start >= line_count)
+		return;
+
+	affected[r->start]++;
+	affected[MIN(r->end, line_count - 1) + 1]--;
+}
+
+
+static void apply_ranges(ScintillaObject *sci, GArray *old_ranges, GArray *ranges)
+{
+	gint line_count = sci_get_line_count(sci);
+	// +1 after the last line of a range
+	gint *depth_diff = g_new0(gint, line_count + 1);
+	gint *affected_diff = g_new0(gint, line_count + 1);
+	guint8 *headers = g_new0(guint8, line_count);
+	gint depth = 0, affected = 0;
+	guint i = 0, j = 0;
+	gint line;
+
+	// ranges are sorted so a merge finds those only in one of the arrays
+	while (old_ranges && (i < old_ranges->len || j < ranges->len))
+	{
+		FoldRange *r1 = i < old_ranges->len ? &g_array_index(old_ranges, FoldRange, i) : NULL;
+		FoldRange *r2 = j < ranges->len ? &g_array_index(ranges, FoldRange, j) : NULL;
+		gint cmp = !r1 ? 1 : !r2 ? -1 : compare_ranges(r1, r2);
+
+		if (cmp < 0)
+		{
+			mark_affected(affected_diff, r1, line_count);
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			mark_affected(affected_diff, r2, line_count);
+			j++;
+		}
+		else
+		{
+			i++;
+			j++;
+		}
+	}
+
+	for (i = 0; i < ranges->len; i++)
+	{
+		FoldRange *r = &g_array_index(ranges, FoldRange, i);
+
+		if (r->start >= line_count)
+			continue;
+		headers[r->start] = TRUE;
+		depth_diff[r->start + 1]++;
+		depth_diff[MIN(r->end, line_count - 1) + 1]--;
+	}
+
+	for (line = 0; line < line_count; line++)
+	{
+		depth += depth_diff[line];
+		affected += affected_diff[line];
+
+		// without previous ranges the lexer's levels have to be replaced everywhere
+		if (!old_ranges || affected > 0)
+		{
+			gint level = (SC_FOLDLEVELBASE + depth) | (headers[line] ? SC_FOLDLEVELHEADERFLAG : 0);
+			gint old_level = SSM(sci, SCI_GETFOLDLEVEL, line, 0) &
+				(SC_FOLDLEVELNUMBERMASK | SC_FOLDLEVELHEADERFLAG);
+
+			if (level != old_level)
+				SSM(sci, SCI_SETFOLDLEVEL, line, level);
+		}
+	}
+
+	g_free(depth_diff);
+	g_free(affected_diff);
+	g_free(headers);
+}
+
+
+static void folding_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	LspFoldingData *data = user_data;
+	GeanyDocument *doc = data->doc;
+	LspServer *srv;
+
+	srv = DOC_VALID(doc) && doc->id == data->doc_id ? lsp_server_get_if_running(doc) : NULL;
+
+	if (!error && srv && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY) &&
+		!lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/foldingRange"))
+	{
+		ScintillaObject *sci = doc->editor->sci;
+		FoldingCache *cache = get_cache(doc, TRUE);
+		GArray *ranges = parse_ranges(return_value);
+
+		// the lexer would overwrite our levels whenever it re-styles
+		if (SSM(sci, SCI_GETPROPERTYINT, (uptr_t)"fold", 0) != 0)
+		{
+			SSM(sci, SCI_SETPROPERTY, (uptr_t)"fold", (sptr_t)"0");
+			cache->lexer_fold_disabled = TRUE;
+			// levels set by the lexer may be anywhere
+			if (cache->ranges)
+				g_array_free(cache->ranges, TRUE);
+			cache->ranges = NULL;
+		}
+
+		apply_ranges(sci, cache->ranges, ranges);
+
+		if (cache->ranges)
+			g_array_free(cache->ranges, TRUE);
+		cache->ranges = ranges;
+		cache->version = data->version;
+	}
+
+	g_free(data);
+}
+
+
+/* Requested after edit pauses for the current document only, nothing is sent
+ * when the ranges for the current version are known already */
+void lsp_folding_send_request(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	FoldingCache *cache;
+	LspFoldingData *data;
+	gchar *doc_uri;
+	GVariant *node;
+	guint version;
+
+	if (!srv || !srv->config.folding_range_enable || !doc->real_path ||
+		!geany_data->editor_prefs->folding || lsp_rpc_is_degraded(srv))
+	{
+		return;
+	}
+
+	version = lsp_sync_peek_doc_version(srv, doc);
+	cache = get_cache(doc, FALSE);
+	if (cache && cache->ranges && cache->version == version)
+		return;
+
+	lsp_sync_text_document_did_open(srv, doc);
+
+	doc_uri = lsp_utils_get_doc_uri(doc);
+	node = JSONRPC_MESSAGE_NEW(
+		"textDocument", "{",
+			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+		"}"
+	);
+
+	data = g_new0(LspFoldingData, 1);
+	data->doc = doc;
+	data->doc_id = doc->id;
+	data->version = version;
+
+	lsp_rpc_cancel(pending_request);
+	pending_request = lsp_rpc_call_background(srv, "textDocument/foldingRange", node,
+		folding_cb, data);
+
+	g_free(doc_uri);
+	g_variant_unref(node);
+}
+
+
+/* Gives folding back to the lexer, e.g. when the document is closed on the
+ * server */
+void lsp_folding_destroy(GeanyDocument *doc)
+{
+	FoldingCache *cache = get_cache(doc, FALSE);
+
+	if (!cache)
+		return;
+
+	if (cache->lexer_fold_disabled)
+		SSM(doc->editor->sci, SCI_SETPROPERTY, (uptr_t)"fold", (sptr_t)"1");
+
+	plugin_set_document_data(geany_plugin, doc, FOLDING_CACHE_KEY, NULL);
+}
@@ -35,6 +35,242 @@ typedef struct {
 } FormatData;
 
 
+typedef struct {
+	const gchar *str;
+	gsize len;
+	guint hash;
+} DiffLine;
+
+
+// larger differences aren't worth the quadratic memory of the edit graph trace
+#define DIFF_MAX_EDITS 1000
+
+static GArray *split_lines(const gchar *text, gsize len)
+{
+	GArray *lines = g_array_new(FALSE, FALSE, sizeof(DiffLine));
+	gsize pos = 0;
+
+	while (pos < len)
+	{
+		DiffLine line = {text + pos, 0, 5381};
+
+		while (pos < len)
+		{
+			gchar c = text[pos++];
+
+			line.len++;
+			line.hash = line.hash * 33 + (guchar)c;
+			if (c == '\n' || (c == '\r' && (pos >= len || text[pos] != '\n')))
+				break;
+		}
+		g_array_append_val(lines, line);
+	}
+
+	return lines;
+}
+
+
+static gboolean lines_equal(GArray *a, gint i, GArray *b, gint j)
+{
+	DiffLine *l1 = &g_array_index(a, DiffLine, i);
+	DiffLine *l2 = &g_array_index(b, DiffLine, j);
+
+	return l1->hash == l2->hash && l1->len == l2->len && memcmp(l1->str, l2->str, l1->len) == 0;
+}
+
+
+// byte offset of the given line, text length past the last line
+static gsize line_offset(GArray *lines, guint index, const gchar *text, gsize len)
+{
+	if (index >= lines->len)
+		return len;
+	return g_array_index(lines, DiffLine, index).str - text;
+}
+
+
+/* Myers' O(ND) diff over lines [0, n) of a and [0, m) of b, fills old_match with
+ * the matching line of b for every line of a (or -1). Returns FALSE when the
+ * number of differences exceeds DIFF_MAX_EDITS. */
+static gboolean diff_lines(GArray *a, gint off_a, gint n, GArray *b, gint off_b, gint m, gint *old_match)
+{
+	gint max = MIN(n + m, DIFF_MAX_EDITS);
+	GPtrArray *trace = g_ptr_array_new_with_free_func(g_free);
+	gint *v = g_new(gint, 2 * max + 3) + max + 1;
+	gboolean found = FALSE;
+	gint d, k, x, y;
+
+	v[1] = 0;
+	for (d = 0; d <= max && !found; d++)
+	{
+		gint *saved;
+
+		for (k = -d; k <= d; k += 2)
+		{
+			if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+				x = v[k + 1];
+			else
+				x = v[k - 1] + 1;
+			y = x - k;
+			while (x < n && y < m && lines_equal(a, off_a + x, b, off_b + y))
+			{
+				x++;
+				y++;
+			}
+			v[k] = x;
+			if (x >= n && y >= m)
+				found = TRUE;
+		}
+
+		// v[-d..d] after step d
+		saved = g_new(gint, 2 * d + 1);
+		memcpy(saved, v - d, (2 * d + 1) * sizeof(gint));
+		g_ptr_array_add(trace, saved);
+	}
+	g_free(v - max - 1);
+
+	if (!found)
+	{
+		g_ptr_array_free(trace, TRUE);
+		return FALSE;
+	}
+
+	for (x = 0; x < n; x++)
+		old_match[x] = -1;
+
+	x = n;
+	y = m;
+	for (d = trace->len - 1; d > 0; d--)
+	{
+		gint *prev = (gint *)trace->pdata[d - 1] + d - 1;
+		gint prev_k, prev_x, prev_y;
+
+		k = x - y;
+		if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+			prev_k = k + 1;
+		else
+			prev_k = k - 1;
+		prev_x = prev[prev_k];
+		prev_y = prev_x - prev_k;
+
+		while (x > prev_x && y > prev_y)
+		{
+			x--;
+			y--;
+			old_match[x] = y;
+		}
+		x = prev_x;
+		y = prev_y;
+	}
+	while (x > 0 && y > 0)
+	{
+		x--;
+		y--;
+		old_match[x] = y;
+	}
+
+	g_ptr_array_free(trace, TRUE);
+	return TRUE;
+}
+
+
+static gboolean is_multiline_edit(LspTextEdit *e)
+{
+	return e->range.start.line != e->range.end.line || strchr(e->new_text, '\n') != NULL;
+}
+
+
+/* Formatters often replace the whole document by a single edit - apply only the
+ * lines that really changed so markers, folds and indicators on other lines
+ * survive and the server only receives small didChange ranges. */
+static void apply_edit_minimal(ScintillaObject *sci, LspTextEdit *e)
+{
+	gint start_pos = lsp_utils_lsp_pos_to_scintilla(sci, e->range.start);
+	gint end_pos = lsp_utils_lsp_pos_to_scintilla(sci, e->range.end);
+	gint end_line = sci_get_line_from_position(sci, end_pos);
+	gint region_start = sci_get_position_from_line(sci, sci_get_line_from_position(sci, start_pos));
+	gint region_end = end_line + 1 < sci_get_line_count(sci) ?
+		sci_get_position_from_line(sci, end_line + 1) : sci_get_length(sci);
+	gchar *old_text = sci_get_contents_range(sci, region_start, region_end);
+	GString *new_text = g_string_new_len(old_text, start_pos - region_start);
+	GArray *old_lines, *new_lines;
+	gint prefix = 0, n, m, i, j;
+	gint *old_match;
+	GArray *hunks;
+
+	g_string_append(new_text, e->new_text);
+	g_string_append(new_text, old_text + (end_pos - region_start));
+
+	old_lines = split_lines(old_text, region_end - region_start);
+	new_lines = split_lines(new_text->str, new_text->len);
+	n = old_lines->len;
+	m = new_lines->len;
+
+	// common prefix and suffix are cheap to skip and usually most of the file
+	while (prefix < n && prefix < m && lines_equal(old_lines, prefix, new_lines, prefix))
+		prefix++;
+	while (n > prefix && m > prefix && lines_equal(old_lines, n - 1, new_lines, m - 1))
+	{
+		n--;
+		m--;
+	}
+	n -= prefix;
+	m -= prefix;
+
+	old_match = g_new(gint, n + 1);
+	if (!diff_lines(old_lines, prefix, n, new_lines, prefix, m, old_match))
+	{
+		for (i = 0; i < n; i++)
+			old_match[i] = -1;
+	}
+
+	// hunks as (old_start, old_end, new_start, new_end) quadruples
+	hunks = g_array_new(FALSE, FALSE, sizeof(gint));
+	i = 0;
+	j = 0;
+	while (i < n || j < m)
+	{
+		gint hunk[4];
+
+		if (i < n && j < m && old_match[i] == j)
+		{
+			i++;
+			j++;
+			continue;
+		}
+
+		hunk[0] = i;
+		hunk[2] = j;
+		while (i < n && old_match[i] == -1)
+			i++;
+		// new lines without match are those before the next matched one
+		j = i < n ? old_match[i] : m;
+		hunk[1] = i;
+		hunk[3] = j;
+		g_array_append_vals(hunks, hunk, 4);
+	}
+
+	// apply from the end so earlier positions stay valid
+	for (i = hunks->len - 4; i >= 0; i -= 4)
+	{
+		gint *hunk = &g_array_index(hunks, gint, i);
+		gsize del_start = line_offset(old_lines, prefix + hunk[0], old_text, region_end - region_start);
+		gsize del_end = line_offset(old_lines, prefix + hunk[1], old_text, region_end - region_start);
+		gsize ins_start = line_offset(new_lines, prefix + hunk[2], new_text->str, new_text->len);
+		gsize ins_end = line_offset(new_lines, prefix + hunk[3], new_text->str, new_text->len);
+
+		SSM(sci, SCI_SETTARGETRANGE, region_start + del_start, region_start + del_end);
+		SSM(sci, SCI_REPLACETARGET, ins_end - ins_start, (sptr_t)(new_text->str + ins_start));
+	}
+
+	g_array_free(hunks, TRUE);
+	g_free(old_match);
+	g_array_free(old_lines, TRUE);
+	g_array_free(new_lines, TRUE);
+	g_string_free(new_text, TRUE);
+	g_free(old_text);
+}
+
+
 static void format_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	FormatData *data = user_data;
@@ -49,7 +285,10 @@ static void format_cb(GVariant *return_value, GError *error, gpointer user_data)
 		edits = lsp_utils_parse_text_edits(&iter);
 
 		sci_start_undo_action(doc->editor->sci);
-		lsp_utils_apply_text_edits(doc->editor->sci, NULL, edits, FALSE);
+		if (edits->len == 1 && is_multiline_edit(edits->pdata[0]))
+			apply_edit_minimal(doc->editor->sci, edits->pdata[0]);
+		else
+			lsp_utils_apply_text_edits(doc->editor->sci, NULL, edits, FALSE);
 		sci_end_undo_action(doc->editor->sci);
 
 		g_ptr_array_free(edits, TRUE);
@@ -66,7 +305,7 @@ static void format_cb(GVariant *return_value, GError *error, gpointer user_data)
 
 void lsp_format_perform(GeanyDocument *doc, gboolean force_whole_doc, LspCallback callback, gpointer user_data)
 {
-	LspServer *srv = lsp_server_get(doc);
+	LspServer *srv = lsp_server_get_for_formatting(lsp_server_get(doc));
 	ScintillaObject *sci;
 	const gchar *method;
 	GVariant *node = NULL;
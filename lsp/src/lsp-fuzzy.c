@@ -0,0 +1,264 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Fuzzy matching in the style of fzf - the pattern characters have to appear in
+ * the matched string in the same order; the score rewards consecutive matches
+ * and matches at word boundaries (after separators, camelCase humps, start of
+ * the string) and penalizes gaps between matched characters. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-fuzzy.h"
+
+#include <string.h>
+
+
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_BOUNDARY (SCORE_MATCH / 2)
+#define BONUS_NON_WORD (SCORE_MATCH / 2)
+#define BONUS_CAMEL (BONUS_BOUNDARY + SCORE_GAP_EXTENSION)
+#define BONUS_CONSECUTIVE -(SCORE_GAP_START + SCORE_GAP_EXTENSION)
+#define BONUS_FIRST_CHAR_MULTIPLIER 2
+
+#define INVALID (G_MININT / 2)
+
+
+typedef enum
+{
+	CharNonWord,
+	CharLower,
+	CharUpper,
+	CharDigit
+} CharClass;
+
+
+static CharClass get_char_class(guchar c)
+{
+	if (c >= 'a' && c <= 'z')
+		return CharLower;
+	if (c >= 'A' && c <= 'Z')
+		return CharUpper;
+	if (c >= '0' && c <= '9')
+		return CharDigit;
+	if (c >= 0x80)  // non-ASCII considered letters
+		return CharLower;
+	return CharNonWord;
+}
+
+
+static gint get_bonus(CharClass prev, CharClass cur)
+{
+	if (cur == CharNonWord)
+		return BONUS_NON_WORD;
+	if (prev == CharNonWord)
+		return BONUS_BOUNDARY;
+	if ((prev == CharLower && cur == CharUpper) ||
+		(prev != CharDigit && cur == CharDigit))
+		return BONUS_CAMEL;
+	return 0;
+}
+
+
+/* Bitmap of the characters contained in the string - a string can only match
+ * the pattern if it contains all the characters of the pattern which makes it
+ * possible to reject most non-matching strings with a single AND.
+ * Bits 0-25 are letters, 26-35 digits, the rest is shared by other
+ * characters. */
+guint64 lsp_fuzzy_get_mask(const gchar *lowercase_str)
+{
+	const guchar *s = (const guchar *) lowercase_str;
+	guint64 mask = 0;
+
+	for (; *s; s++)
+	{
+		guchar c = *s;
+		guint bit;
+
+		if (c >= 'a' && c <= 'z')
+			bit = c - 'a';
+		else if (c >= '0' && c <= '9')
+			bit = 26 + c - '0';
+		else
+			bit = 36 + c % 28;
+
+		mask |= G_GUINT64_CONSTANT(1) << bit;
+	}
+
+	return mask;
+}
+
+
+LspFuzzyPattern *lsp_fuzzy_pattern_new(const gchar *lowercase_pattern)
+{
+	LspFuzzyPattern *pattern = g_new0(LspFuzzyPattern, 1);
+
+	pattern->text = g_strdup(lowercase_pattern);
+	pattern->len = strlen(pattern->text);
+	pattern->mask = lsp_fuzzy_get_mask(pattern->text);
+
+	return pattern;
+}
+
+
+void lsp_fuzzy_pattern_free(LspFuzzyPattern *pattern)
+{
+	if (!pattern)
+		return;
+	g_free(pattern->text);
+	g_free(pattern->scratch);
+	g_free(pattern);
+}
+
+
+/* Returns the score of str matching the pattern or LSP_FUZZY_NO_MATCH. str is
+ * used for camelCase detection only and may be NULL; mask is
+ * lsp_fuzzy_get_mask() of lowercase_str. The work buffers are kept in the
+ * pattern so scoring a large number of strings doesn't allocate. */
+gint lsp_fuzzy_score(LspFuzzyPattern *pattern, const gchar *str, const gchar *lowercase_str,
+	guint64 mask)
+{
+	const gchar *p = pattern->text;
+	const gchar *s = lowercase_str;
+	gint *bonus, *prev_row, *row, *prev_chunk, *chunk;
+	gsize m = pattern->len;
+	gsize n, i, j, first = 0;
+	gboolean use_case;
+	CharClass prev_class;
+	gint result;
+
+	if (m == 0)
+		return 0;
+
+	if (pattern->mask & ~mask)
+		return LSP_FUZZY_NO_MATCH;
+
+	// quick check the pattern is a subsequence, find the first possible start
+	for (i = 0, j = 0; s[j] && i < m; j++)
+	{
+		if (s[j] == p[i])
+		{
+			if (i == 0)
+				first = j;
+			i++;
+		}
+	}
+	if (i < m)
+		return LSP_FUZZY_NO_MATCH;
+	n = strlen(s);
+
+	if (pattern->scratch_len < 5 * n)
+	{
+		pattern->scratch_len = 5 * n;
+		pattern->scratch = g_renew(gint, pattern->scratch, pattern->scratch_len);
+	}
+	bonus = pattern->scratch;
+	prev_row = bonus + n;
+	row = prev_row + n;
+	prev_chunk = row + n;
+	chunk = prev_chunk + n;
+
+	use_case = str && strlen(str) == n;
+	prev_class = CharNonWord;
+	for (j = 0; j < n; j++)
+	{
+		CharClass cur_class = get_char_class(use_case ? str[j] : s[j]);
+
+		bonus[j] = get_bonus(prev_class, cur_class);
+		prev_class = cur_class;
+	}
+
+	for (i = 0; i < m; i++)
+	{
+		gint gap = INVALID;
+		gint *tmp;
+
+		for (j = 0; j < n; j++)
+		{
+			gint score = INVALID;
+			gint chunk_bonus = 0;
+
+			// best score of the previous pattern character matched before
+			// j - 1, i.e. followed by a gap
+			if (i > 0 && j >= 2)
+			{
+				if (gap > INVALID)
+					gap += SCORE_GAP_EXTENSION;
+				if (prev_row[j - 2] > INVALID)
+					gap = MAX(gap, prev_row[j - 2] + SCORE_GAP_START);
+			}
+
+			if (j >= first && s[j] == p[i])
+			{
+				if (i == 0)
+				{
+					score = SCORE_MATCH + bonus[j] * BONUS_FIRST_CHAR_MULTIPLIER;
+					chunk_bonus = bonus[j];
+				}
+				else
+				{
+					gint consecutive = INVALID;
+					gint gapped = INVALID;
+					gint consecutive_bonus = 0;
+
+					if (j >= 1 && prev_row[j - 1] > INVALID)
+					{
+						// consecutive characters keep the bonus of the chunk start
+						consecutive_bonus = MAX(MAX(prev_chunk[j - 1], BONUS_CONSECUTIVE), bonus[j]);
+						consecutive = prev_row[j - 1] + SCORE_MATCH + consecutive_bonus;
+					}
+					if (gap > INVALID)
+						gapped = gap + SCORE_MATCH + bonus[j];
+
+					if (consecutive > INVALID && consecutive >= gapped)
+					{
+						score = consecutive;
+						chunk_bonus = consecutive_bonus;
+					}
+					else if (gapped > INVALID)
+					{
+						score = gapped;
+						chunk_bonus = bonus[j];
+					}
+				}
+			}
+
+			row[j] = score;
+			chunk[j] = chunk_bonus;
+		}
+
+		tmp = prev_row;
+		prev_row = row;
+		row = tmp;
+		tmp = prev_chunk;
+		prev_chunk = chunk;
+		chunk = tmp;
+	}
+
+	result = LSP_FUZZY_NO_MATCH;
+	for (j = 0; j < n; j++)
+	{
+		if (prev_row[j] > INVALID)
+			result = MAX(result, prev_row[j]);
+	}
+
+	return result;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_FUZZY_H
+#define LSP_FUZZY_H 1
+
+#include <glib.h>
+
+
+#define LSP_FUZZY_NO_MATCH G_MININT
+// bits of lsp_fuzzy_get_mask() corresponding to letters 'a'-'z'
+#define LSP_FUZZY_LETTERS_MASK ((G_GUINT64_CONSTANT(1) << 26) - 1)
+
+
+typedef struct
+{
+	gchar *text;  // lowercase
+	gsize len;
+	guint64 mask;
+	gint *scratch;
+	gsize scratch_len;
+} LspFuzzyPattern;
+
+
+LspFuzzyPattern *lsp_fuzzy_pattern_new(const gchar *lowercase_pattern);
+void lsp_fuzzy_pattern_free(LspFuzzyPattern *pattern);
+
+guint64 lsp_fuzzy_get_mask(const gchar *lowercase_str);
+gint lsp_fuzzy_score(LspFuzzyPattern *pattern, const gchar *str, const gchar *lowercase_str,
+	guint64 mask);
+
+#endif  /* LSP_FUZZY_H */
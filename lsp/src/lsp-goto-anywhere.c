@@ -25,10 +25,15 @@
 #include "lsp-symbols.h"
 #include "lsp-utils.h"
 #include "lsp-symbol.h"
+#include "lsp-workspace-index.h"
+#include "lsp-file-index.h"
+#include "lsp-fuzzy.h"
 
 #include <gtk/gtk.h>
 #include <geanyplugin.h>
 
+#include <string.h>
+
 
 typedef struct
 {
@@ -37,12 +42,117 @@ typedef struct
 } DocQueryData;
 
 
+typedef struct
+{
+	const gchar *name;
+	const gchar *key;  /* normalized and casefolded name */
+	const gchar *file_name;  /* utf8 */
+	gulong line;
+	TMTagType type;
+	guint64 mask;
+} TagEntry;
+
+
+typedef struct
+{
+	TagEntry *entry;
+	gint score;
+	guint index;
+} TagMatch;
+
+
+/* bounds of the delay before a workspace/symbol request is sent */
+#define WORKSPACE_DEBOUNCE_MIN 30
+#define WORKSPACE_DEBOUNCE_MAX 300
+
+
 extern GeanyData *geany_data;
+extern GeanyPlugin *geany_plugin;
+
+static gchar *s_workspace_query;  /* query currently displayed */
+static gchar *s_sent_query;  /* query of the last sent workspace/symbol request */
+static guint s_workspace_source;
+static gint64 s_request_time;
+static gint s_server_latency = 2 * WORKSPACE_DEBOUNCE_MIN;  /* smoothed, in ms */
+
+/* name index of the tags last queried */
+static struct
+{
+	guint hash;  /* of the tags the index was built from */
+	TMParserType lang;
+	GArray *entries;  /* TagEntry sorted by key */
+	GStringChunk *strings;
+} tag_index;
 
 
 static void workspace_symbol_cb(GPtrArray *symbols, gpointer user_data)
 {
-	lsp_goto_panel_fill(symbols);
+	GeanyFiletypeID ft_id = GPOINTER_TO_INT(user_data);
+	gint latency = (g_get_monotonic_time() - s_request_time) / 1000;
+	GPtrArray *filtered;
+
+	s_server_latency = (3 * s_server_latency + latency) / 4;
+
+	lsp_workspace_index_add(symbols);
+
+	// the query changed in the meantime
+	if (g_strcmp0(s_sent_query, s_workspace_query) != 0)
+		return;
+
+	filtered = lsp_goto_panel_filter(lsp_workspace_index_get(ft_id), s_workspace_query);
+	// the server may match symbols differently
+	lsp_goto_panel_fill(filtered->len > 0 ? filtered : symbols);
+	g_ptr_array_free(filtered, TRUE);
+}
+
+
+static gboolean send_workspace_request(gpointer user_data)
+{
+	GeanyFiletypeID ft_id = GPOINTER_TO_INT(user_data);
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get(doc);
+
+	s_workspace_source = 0;
+
+	if (srv && doc->file_type->id == ft_id)
+	{
+		SETPTR(s_sent_query, g_strdup(s_workspace_query));
+		s_request_time = g_get_monotonic_time();
+		lsp_symbols_workspace_request(doc, s_sent_query, workspace_symbol_cb, user_data);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void goto_workspace_symbol(GeanyDocument *doc, LspServer *srv, const gchar *query)
+{
+	GeanyFiletypeID ft_id = doc->file_type->id;
+	GPtrArray *filtered;
+
+	lsp_workspace_index_add_open_documents(ft_id);
+
+	filtered = lsp_goto_panel_filter(lsp_workspace_index_get(ft_id), query);
+	lsp_goto_panel_fill(filtered);
+
+	SETPTR(s_workspace_query, g_strdup(query));
+	if (s_workspace_source)
+		g_source_remove(s_workspace_source);
+	s_workspace_source = 0;
+
+	// fill the gaps of the index from the server once the user stops typing -
+	// the slower the server, the longer we wait
+	if (srv && srv->supports_workspace_symbols && filtered->len < lsp_goto_panel_get_max_items())
+	{
+		gint delay = CLAMP(s_server_latency / 2, WORKSPACE_DEBOUNCE_MIN, WORKSPACE_DEBOUNCE_MAX);
+
+		s_workspace_source = plugin_timeout_add(geany_plugin, delay, send_workspace_request,
+			GINT_TO_POINTER(ft_id));
+	}
+	else
+		lsp_symbols_workspace_cancel();
+
+	g_ptr_array_free(filtered, TRUE);
 }
 
 
@@ -134,10 +244,20 @@ static void goto_line(GeanyDocument *doc, const gchar *line_str)
 
 static void goto_file(const gchar *file_str)
 {
-	GPtrArray *arr = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
-	GPtrArray *filtered;
+	GPtrArray *files = lsp_file_index_get();
+	GPtrArray *arr, *filtered;
 	guint i;
 
+	if (files)
+	{
+		filtered = lsp_goto_panel_filter(files, file_str);
+		lsp_goto_panel_fill(filtered);
+		g_ptr_array_free(filtered, TRUE);
+		return;
+	}
+
+	// no project or not indexed yet
+	arr = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
 	foreach_document(i)
 	{
 		GeanyDocument *doc = documents[i];
@@ -165,41 +285,207 @@ static void goto_file(const gchar *file_str)
 }
 
 
-static void goto_tm_symbol(const gchar *query, GPtrArray *tags, TMParserType lang)
+static gint compare_tag_entries(gconstpointer a, gconstpointer b)
 {
-	GPtrArray *converted = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
-	GPtrArray *filtered;
+	const TagEntry *e1 = a;
+	const TagEntry *e2 = b;
+
+	return strcmp(e1->key, e2->key);
+}
+
+
+/* tags are recreated whenever their file is parsed again so hashing the tag
+ * pointers and lines is enough to detect a change without touching the names */
+static guint hash_tags(GPtrArray *tags)
+{
+	guint hash = 5381;
+	TMTag *tag;
+	guint i;
+
+	foreach_ptr_array(tag, i, tags)
+		hash = (hash << 5) + hash + (GPOINTER_TO_UINT(tag) ^ tag->line);
+
+	return hash ^ tags->len;
+}
+
+
+/* (re)builds the index when @tags changed since the last query; the entries
+ * hold copies of the tag data so they stay valid when the tags are freed */
+static void update_tag_index(GPtrArray *tags, TMParserType lang)
+{
+	guint hash = hash_tags(tags);
+	/* TMSourceFile -> utf8 file name */
+	GHashTable *file_names;
 	TMTag *tag;
 	guint i;
 
-	if (tags)
+	if (tag_index.entries && tag_index.hash == hash && tag_index.lang == lang)
+		return;
+
+	if (tag_index.entries)
+		g_array_free(tag_index.entries, TRUE);
+	if (tag_index.strings)
+		g_string_chunk_free(tag_index.strings);
+
+	tag_index.hash = hash;
+	tag_index.lang = lang;
+	tag_index.entries = g_array_sized_new(FALSE, FALSE, sizeof(TagEntry), tags->len);
+	tag_index.strings = g_string_chunk_new(4096);
+	file_names = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	foreach_ptr_array(tag, i, tags)
 	{
-		foreach_ptr_array(tag, i, tags)
+		if (tag->lang == lang && tag->type != tm_tag_local_var_t && tag->file)
 		{
-			if (tag->lang == lang && tag->type != tm_tag_local_var_t && tag->file)
+			gchar *normalized = g_utf8_normalize(tag->name, -1, G_NORMALIZE_ALL);
+			gchar *key = normalized ? g_utf8_casefold(normalized, -1) : NULL;
+			TagEntry entry;
+
+			if (key)
 			{
-				gchar *file_name, *name;
-				LspSymbol *sym;
+				entry.file_name = g_hash_table_lookup(file_names, tag->file);
+				if (!entry.file_name)
+				{
+					gchar *file_name = utils_get_utf8_from_locale(tag->file->file_name);
+
+					entry.file_name = g_string_chunk_insert(tag_index.strings, file_name);
+					g_hash_table_insert(file_names, tag->file, (gpointer) entry.file_name);
+					g_free(file_name);
+				}
+				entry.name = g_string_chunk_insert(tag_index.strings, tag->name);
+				entry.key = g_string_chunk_insert(tag_index.strings, key);
+				entry.line = tag->line;
+				entry.type = tag->type;
+				entry.mask = lsp_fuzzy_get_mask(entry.key);
+				g_array_append_val(tag_index.entries, entry);
+			}
+			g_free(key);
+			g_free(normalized);
+		}
+	}
+
+	g_hash_table_destroy(file_names);
+	g_array_sort(tag_index.entries, compare_tag_entries);
+}
 
-				name = g_strdup(tag->name);
-				file_name = utils_get_utf8_from_locale(tag->file->file_name);
 
-				sym = lsp_symbol_new(name, "", "", file_name, 0, 0, tag->line, 0,
-					lsp_symbol_kinds_get_symbol_icon(lsp_symbol_kinds_tm_to_lsp(tag->type)));
+/* index of the first entry whose key isn't smaller than @prefix */
+static guint tag_index_lower_bound(const gchar *prefix)
+{
+	guint lo = 0, hi = tag_index.entries->len;
 
-				g_ptr_array_add(converted, sym);
+	while (lo < hi)
+	{
+		guint mid = lo + (hi - lo) / 2;
 
-				g_free(name);
-				g_free(file_name);
-			}
+		if (strcmp(g_array_index(tag_index.entries, TagEntry, mid).key, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static gint compare_tag_matches(gconstpointer a, gconstpointer b)
+{
+	const TagMatch *m1 = a;
+	const TagMatch *m2 = b;
+
+	if (m1->score != m2->score)
+		return m1->score > m2->score ? -1 : 1;
+	return m1->index < m2->index ? -1 : (m1->index > m2->index);
+}
+
+
+/* adds the entry at @index to @matches if all patterns match it */
+static void match_tag_entry(GArray *matches, GPtrArray *patterns, guint index)
+{
+	TagEntry *entry = &g_array_index(tag_index.entries, TagEntry, index);
+	TagMatch match = {entry, 0, index};
+	guint i;
+
+	for (i = 0; i < patterns->len; i++)
+	{
+		gint score = lsp_fuzzy_score(patterns->pdata[i], entry->name, entry->key, entry->mask);
+
+		if (score == LSP_FUZZY_NO_MATCH)
+			return;
+		match.score += score;
+	}
+
+	g_array_append_val(matches, match);
+}
+
+
+/* Tags are looked up in an index sorted by the casefolded name. Names starting
+ * with the first word of the query are found by binary search; only when
+ * there aren't enough of them all names are fuzzy-matched. Symbols are created
+ * just for the displayed tags. */
+static void goto_tm_symbol(const gchar *query, GPtrArray *tags, TMParserType lang)
+{
+	GPtrArray *symbols = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+	GPtrArray *patterns = g_ptr_array_new_with_free_func((GDestroyNotify)lsp_fuzzy_pattern_free);
+	GArray *matches = g_array_new(FALSE, FALSE, sizeof(TagMatch));
+	guint max_items = lsp_goto_panel_get_max_items();
+	gchar *normalized, *casefolded;
+	gchar **words, **word;
+	guint i;
+
+	update_tag_index(tags, lang);
+
+	normalized = g_utf8_normalize(query, -1, G_NORMALIZE_ALL);
+	casefolded = g_utf8_casefold(normalized ? normalized : "", -1);
+	words = g_strsplit_set(casefolded, " ", -1);
+	foreach_strv(word, words)
+	{
+		if (**word)
+			g_ptr_array_add(patterns, lsp_fuzzy_pattern_new(*word));
+	}
+
+	if (patterns->len == 0)
+	{
+		for (i = 0; i < tag_index.entries->len && i < max_items; i++)
+			match_tag_entry(matches, patterns, i);
+	}
+	else
+	{
+		const gchar *prefix = ((LspFuzzyPattern *)patterns->pdata[0])->text;
+
+		for (i = tag_index_lower_bound(prefix); i < tag_index.entries->len; i++)
+		{
+			if (!g_str_has_prefix(g_array_index(tag_index.entries, TagEntry, i).key, prefix))
+				break;
+			match_tag_entry(matches, patterns, i);
+		}
+
+		if (matches->len < max_items)
+		{
+			g_array_set_size(matches, 0);
+			for (i = 0; i < tag_index.entries->len; i++)
+				match_tag_entry(matches, patterns, i);
 		}
 	}
 
-	filtered = lsp_goto_panel_filter(converted, query);
-	lsp_goto_panel_fill(filtered);
+	g_array_sort(matches, compare_tag_matches);
 
-	g_ptr_array_free(filtered, TRUE);
-	g_ptr_array_free(converted, TRUE);
+	for (i = 0; i < matches->len && i < max_items; i++)
+	{
+		TagEntry *entry = g_array_index(matches, TagMatch, i).entry;
+
+		g_ptr_array_add(symbols, lsp_symbol_new(entry->name, "", "", entry->file_name, 0, 0,
+			entry->line, 0, lsp_symbol_kinds_get_symbol_icon(lsp_symbol_kinds_tm_to_lsp(entry->type))));
+	}
+
+	lsp_goto_panel_fill(symbols);
+
+	g_ptr_array_free(symbols, TRUE);
+	g_array_free(matches, TRUE);
+	g_ptr_array_free(patterns, TRUE);
+	g_strfreev(words);
+	g_free(casefolded);
+	g_free(normalized);
 }
 
 
@@ -211,11 +497,8 @@ static void perform_lookup(const gchar *query)
 
 	if (g_str_has_prefix(query_str, "#"))
 	{
-		if (srv && srv->supports_workspace_symbols)
-			lsp_symbols_workspace_request(doc, query_str+1, workspace_symbol_cb, NULL);
-		else if (doc)
-			// TODO: possibly improve performance by binary searching the start and the end point
-			goto_tm_symbol(query_str+1, geany_data->app->tm_workspace->tags_array, doc->file_type->lang);
+		if (doc)
+			goto_workspace_symbol(doc, srv, query_str+1);
 	}
 	else if (g_str_has_prefix(query_str, "@"))
 	{
@@ -224,7 +507,7 @@ static void perform_lookup(const gchar *query)
 			DocQueryData *data = g_new0(DocQueryData, 1);
 			data->query = g_strdup(query_str);
 			data->doc = doc;
-			lsp_symbols_doc_request(doc, doc_symbol_cb, data);
+			lsp_symbols_doc_request(doc, FALSE, doc_symbol_cb, data);
 		}
 		else if (doc)
 		{
@@ -265,6 +548,21 @@ static void goto_panel_query(const gchar *query_type, gboolean prefill)
 }
 
 
+void lsp_goto_anywhere_destroy(void)
+{
+	if (tag_index.entries)
+		g_array_free(tag_index.entries, TRUE);
+	if (tag_index.strings)
+		g_string_chunk_free(tag_index.strings);
+	memset(&tag_index, 0, sizeof(tag_index));
+
+	g_free(s_workspace_query);
+	s_workspace_query = NULL;
+	g_free(s_sent_query);
+	s_sent_query = NULL;
+}
+
+
 void lsp_goto_anywhere_for_workspace(void)
 {
 	goto_panel_query("#", TRUE);
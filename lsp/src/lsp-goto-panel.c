@@ -29,10 +29,13 @@
 #include "lsp-symbol-kinds.h"
 #include "lsp-utils.h"
 #include "lsp-symbol.h"
+#include "lsp-fuzzy.h"
 
 #include <gtk/gtk.h>
 #include <geanyplugin.h>
 
+#include <string.h>
+
 
 enum {
 	COL_ICON,
@@ -56,6 +59,11 @@ struct {
 
 static LspGotoPanelLookupFunction lookup_function;
 
+/* the last array returned by lsp_goto_panel_filter() and the number of all
+ * symbols that matched */
+static GPtrArray *last_filtered;
+static guint last_filtered_total;
+
 
 extern GeanyData *geany_data;
 
@@ -142,13 +150,28 @@ static void tree_view_activate_focused_row(GtkTreeView *view)
 }
 
 
+guint lsp_goto_panel_get_max_items(void)
+{
+	return lsp_server_get_all_section_config()->goto_panel_max_items;
+}
+
+
+/* at most lsp_goto_panel_get_max_items() symbols are shown, followed by a row
+ * with the number of the remaining ones */
 void lsp_goto_panel_fill(GPtrArray *symbols)
 {
 	GtkTreeView *view = GTK_TREE_VIEW(panel_data.tree_view);
+	guint max_items = lsp_goto_panel_get_max_items();
+	guint total = symbols->len;
+	guint shown = 0;
 	GtkTreeIter iter;
 	LspSymbol *sym;
 	guint i;
 
+	if (symbols == last_filtered)
+		total = MAX(last_filtered_total, symbols->len);
+	last_filtered = NULL;
+
 	gtk_list_store_clear(panel_data.store);
 
 	foreach_ptr_array(sym, i, symbols)
@@ -156,7 +179,14 @@ void lsp_goto_panel_fill(GPtrArray *symbols)
 		gchar *label;
 
 		if (!lsp_symbol_get_file(sym))
+		{
+			total--;
 			continue;
+		}
+
+		if (shown == max_items)
+			break;
+		shown++;
 
 		if (lsp_symbol_get_line(sym) > 0)
 			label = g_markup_printf_escaped("%s\n<small><i>%s:%lu</i></small>",
@@ -175,6 +205,20 @@ void lsp_goto_panel_fill(GPtrArray *symbols)
 		g_free(label);
 	}
 
+	if (total > shown)
+	{
+		gchar *more = g_strdup_printf(g_dngettext(GETTEXT_PACKAGE, "%u more item", "%u more items",
+			total - shown), total - shown);
+		gchar *label = g_markup_printf_escaped("<i>%s</i>", more);
+
+		gtk_list_store_insert_with_values(panel_data.store, NULL, -1,
+			COL_LABEL, label,
+			-1);
+
+		g_free(label);
+		g_free(more);
+	}
+
 	if (gtk_tree_model_get_iter_first(gtk_tree_view_get_model(view), &iter))
 		tree_view_set_cursor_from_iter(GTK_TREE_VIEW(panel_data.tree_view), &iter);
 }
@@ -281,6 +325,10 @@ static void on_view_row_activated(GtkTreeView *view, GtkTreePath *path,
 			COL_LINENO, &line,
 			-1);
 
+		// the row with the number of items not shown
+		if (!file_path)
+			return;
+
 		SETPTR(file_path, utils_get_locale_from_utf8(file_path));
 		doc = document_open_file(file_path, FALSE, NULL, NULL);
 
@@ -390,49 +438,189 @@ void lsp_goto_panel_show(const gchar *query, LspGotoPanelLookupFunction func)
 }
 
 
+typedef struct
+{
+	LspSymbol *symbol;
+	gint score;
+	guint index;
+} ScoredSymbol;
+
+
+static gint compare_scored_symbols(gconstpointer a, gconstpointer b)
+{
+	const ScoredSymbol *s1 = a;
+	const ScoredSymbol *s2 = b;
+
+	if (s1->score != s2->score)
+		return s1->score > s2->score ? -1 : 1;
+	return s1->index < s2->index ? -1 : (s1->index > s2->index);
+}
+
+
+/* casefolded names of the last filtered symbols and the symbols matching the
+ * last filter - when the filter only gets extended, just the previous matches
+ * are checked again */
+static struct
+{
+	GPtrArray *symbols;  /* referenced so the pointer isn't reused for another array */
+	guint len;
+	GPtrArray *keys;  /* casefolded names, computed when needed */
+	GArray *masks;
+	gchar *filter;
+	GArray *matched;  /* indices of symbols matching filter, NULL if not known */
+} filter_cache;
+
+
+static void clear_filter_cache(void)
+{
+	if (filter_cache.symbols)
+		g_ptr_array_unref(filter_cache.symbols);
+	if (filter_cache.keys)
+		g_ptr_array_free(filter_cache.keys, TRUE);
+	if (filter_cache.masks)
+		g_array_free(filter_cache.masks, TRUE);
+	if (filter_cache.matched)
+		g_array_free(filter_cache.matched, TRUE);
+	g_free(filter_cache.filter);
+	memset(&filter_cache, 0, sizeof(filter_cache));
+}
+
+
+static const gchar *get_filter_key(guint i, guint64 *mask)
+{
+	gchar *key = filter_cache.keys->pdata[i];
+
+	if (!key)
+	{
+		const gchar *name = lsp_symbol_get_name(filter_cache.symbols->pdata[i]);
+		gchar *normalized = name ? g_utf8_normalize(name, -1, G_NORMALIZE_ALL) : NULL;
+
+		// empty key for symbols which can never match
+		key = normalized ? g_utf8_casefold(normalized, -1) : g_strdup("");
+		filter_cache.keys->pdata[i] = key;
+		g_array_index(filter_cache.masks, guint64, i) = lsp_fuzzy_get_mask(key);
+		g_free(normalized);
+	}
+
+	*mask = g_array_index(filter_cache.masks, guint64, i);
+	return key;
+}
+
+
+void lsp_goto_panel_destroy(void)
+{
+	clear_filter_cache();
+}
+
+
+/* Every space-separated word of the filter has to fuzzy-match the symbol name;
+ * the best lsp_goto_panel_get_max_items() matches ordered by the sum of the word
+ * scores are returned */
 GPtrArray *lsp_goto_panel_filter(GPtrArray *symbols, const gchar *filter)
 {
 	GPtrArray *ret = g_ptr_array_new();
+	GPtrArray *patterns;
+	GArray *matches;
+	GArray *candidates, *matched;
 	gchar *case_normalized_filter;
 	gchar **tf_strv;
+	gchar **val;
+	guint max_items = lsp_goto_panel_get_max_items();
 	guint i;
-	guint j = 0;
 
 	if (!symbols)
 		return ret;
 
+	if (filter_cache.symbols != symbols || filter_cache.len != symbols->len)
+	{
+		clear_filter_cache();
+		filter_cache.symbols = g_ptr_array_ref(symbols);
+		filter_cache.len = symbols->len;
+		filter_cache.keys = g_ptr_array_new_full(symbols->len, g_free);
+		g_ptr_array_set_size(filter_cache.keys, symbols->len);
+		filter_cache.masks = g_array_sized_new(FALSE, TRUE, sizeof(guint64), symbols->len);
+		g_array_set_size(filter_cache.masks, symbols->len);
+	}
+
+	// matches of the extended filter are a subset of the previous matches
+	candidates = NULL;
+	if (filter_cache.matched && filter_cache.filter && g_str_has_prefix(filter, filter_cache.filter))
+		candidates = filter_cache.matched;
+
 	case_normalized_filter = g_utf8_normalize(filter, -1, G_NORMALIZE_ALL);
 	SETPTR(case_normalized_filter, g_utf8_casefold(case_normalized_filter, -1));
 
 	tf_strv = g_strsplit_set(case_normalized_filter, " ", -1);
-
-	for (i = 0; i < symbols->len && j < 20; i++)
+	patterns = g_ptr_array_new_with_free_func((GDestroyNotify)lsp_fuzzy_pattern_free);
+	foreach_strv(val, tf_strv)
 	{
-		LspSymbol *symbol = symbols->pdata[i];
-		gboolean filtered = FALSE;
-		gchar *case_normalized_name;
-		gchar **val;
+		if (**val)
+			g_ptr_array_add(patterns, lsp_fuzzy_pattern_new(*val));
+	}
 
-		case_normalized_name = g_utf8_normalize(lsp_symbol_get_name(symbol), -1, G_NORMALIZE_ALL);
-		SETPTR(case_normalized_name, g_utf8_casefold(case_normalized_name, -1));
+	matches = g_array_new(FALSE, FALSE, sizeof(ScoredSymbol));
+	matched = NULL;
 
-		foreach_strv(val, tf_strv)
+	if (patterns->len == 0)
+	{
+		// nothing to sort by - take the first ones
+		for (i = 0; i < symbols->len && i < max_items; i++)
 		{
-			if (case_normalized_name != NULL && *val != NULL)
-				filtered = strstr(case_normalized_name, *val) == NULL;
-
-			if (filtered)
-				break;
+			ScoredSymbol match = {symbols->pdata[i], 0, i};
+			g_array_append_val(matches, match);
 		}
-		if (!filtered)
+	}
+	else
+	{
+		guint num = candidates ? candidates->len : symbols->len;
+
+		matched = g_array_new(FALSE, FALSE, sizeof(guint));
+		for (i = 0; i < num; i++)
 		{
-			g_ptr_array_add(ret, symbol);
-			j++;
+			guint index = candidates ? g_array_index(candidates, guint, i) : i;
+			LspSymbol *symbol = symbols->pdata[index];
+			const gchar *name = lsp_symbol_get_name(symbol);
+			ScoredSymbol match = {symbol, 0, index};
+			const gchar *key;
+			guint64 mask;
+			guint j;
+
+			if (!name)
+				continue;
+
+			key = get_filter_key(index, &mask);
+			for (j = 0; j < patterns->len; j++)
+			{
+				gint score = lsp_fuzzy_score(patterns->pdata[j], name, key, mask);
+
+				if (score == LSP_FUZZY_NO_MATCH)
+					break;
+				match.score += score;
+			}
+
+			if (j == patterns->len)
+			{
+				g_array_append_val(matches, match);
+				g_array_append_val(matched, index);
+			}
 		}
-
-		g_free(case_normalized_name);
 	}
 
+	if (filter_cache.matched)
+		g_array_free(filter_cache.matched, TRUE);
+	filter_cache.matched = matched;
+	SETPTR(filter_cache.filter, g_strdup(filter));
+
+	g_array_sort(matches, compare_scored_symbols);
+
+	for (i = 0; i < matches->len && i < max_items; i++)
+		g_ptr_array_add(ret, g_array_index(matches, ScoredSymbol, i).symbol);
+
+	last_filtered = ret;
+	last_filtered_total = patterns->len == 0 ? symbols->len : matches->len;
+
+	g_array_free(matches, TRUE);
+	g_ptr_array_free(patterns, TRUE);
 	g_strfreev(tf_strv);
 	g_free(case_normalized_filter);
 
@@ -25,6 +25,9 @@ typedef void (*LspGotoPanelLookupFunction) (const char *);
 
 void lsp_goto_panel_show(const gchar *query, LspGotoPanelLookupFunction func);
 void lsp_goto_panel_fill(GPtrArray *symbols);
+guint lsp_goto_panel_get_max_items(void);
 GPtrArray *lsp_goto_panel_filter(GPtrArray *symbols, const gchar *filter);
 
+void lsp_goto_panel_destroy(void);
+
 #endif  /* LSP_LOOKUP_PANEL_H */
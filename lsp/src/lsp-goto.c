@@ -25,18 +25,64 @@
 #include "lsp-rpc.h"
 #include "lsp-goto-panel.h"
 #include "lsp-symbol.h"
+#include "lsp-progress.h"
+#include "lsp-sync.h"
+#include "lsp-timing.h"
 
 #include <jsonrpc-glib.h>
 
 
+#define GOTO_CACHE_MAX 16
+#define GOTO_PREFETCH_DELAY 500
+
+
+typedef enum {
+	PREFETCH_DEFINITION,
+	PREFETCH_DECLARATION,
+	PREFETCH_NUM
+} PrefetchKind;
+
+
 typedef struct {
 	GeanyDocument *doc;
 	gboolean show_in_msgwin;
+	gboolean msgwin_started;  /* partial results already shown */
+	gchar *partial_token;
+	/* speculative request which is only cached until someone asks for it;
+	 * set to FALSE when the jump is requested while waiting for the reply */
+	gboolean prefetch;
+	gint kind;  /* PrefetchKind, -1 for requests which aren't cached */
+	guint doc_id;
+	guint version;
+	gint start;  /* identifier range */
+	gint end;
 } GotoData;
 
 
+/* reply for an identifier at the given document version */
+typedef struct {
+	gint kind;
+	guint doc_id;
+	guint version;
+	gint start;
+	gint end;
+	GVariant *result;
+} GotoCacheEntry;
+
+
+extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
+static const gchar *prefetch_methods[PREFETCH_NUM] = {
+	"textDocument/definition",
+	"textDocument/declaration"
+};
+
+static GotoData *prefetch_data[PREFETCH_NUM];  /* waiting for reply */
+static LspRpcRequest prefetch_requests[PREFETCH_NUM];
+static guint prefetch_source;
+static GQueue goto_cache = G_QUEUE_INIT;  /* GotoCacheEntry, most recently used first */
+
 
 // TODO: free on plugin unload
 GPtrArray *last_result;
@@ -71,178 +117,339 @@ static void filter_symbols(const gchar *filter)
 }
 
 
-static void show_in_msgwin(LspLocation *loc, GHashTable *sci_table)
+/* lines of files which aren't open are read directly, all lines of a file at once */
+static void show_in_msgwin(GPtrArray *locations)
 {
-	ScintillaObject *sci = NULL;
-	gint lineno = loc->range.start.line;
-	gchar *fname, *base_path;
-	GeanyDocument *doc;
-	gchar *line_str;
-
-	fname = lsp_utils_get_real_path_from_uri_utf8(loc->uri);
-	if (!fname)
-		return;
-
-	doc = document_find_by_filename(fname);
-	base_path = lsp_utils_get_project_base_path();
-
-	if (doc)
-		sci = doc->editor->sci;
-	else
+	GHashTable *file_lines = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)g_array_unref);
+	GHashTable *file_texts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)g_ptr_array_unref);
+	GArray *line_indices = g_array_sized_new(FALSE, FALSE, sizeof(guint), locations->len);
+	gchar *base_path = lsp_utils_get_project_base_path();
+	LspLocation *loc;
+	guint i;
+
+	foreach_ptr_array(loc, i, locations)
 	{
-		if (sci_table)
-			sci = g_hash_table_lookup(sci_table, fname);
-		if (!sci)
+		gchar *fname = lsp_utils_get_real_path_from_uri_utf8(loc->uri);
+		guint index = 0;
+
+		if (fname && !document_find_by_filename(fname))
 		{
-			sci = lsp_utils_new_sci_from_file(fname);
-			if (sci && sci_table)
-				g_hash_table_insert(sci_table, g_strdup(fname), g_object_ref_sink(sci));
+			GArray *lines = g_hash_table_lookup(file_lines, fname);
+			guint lineno = loc->range.start.line;
+
+			if (!lines)
+			{
+				lines = g_array_new(FALSE, FALSE, sizeof(guint));
+				g_hash_table_insert(file_lines, g_strdup(fname), lines);
+			}
+			index = lines->len;
+			g_array_append_val(lines, lineno);
 		}
-	}
+		g_array_append_val(line_indices, index);
 
-	line_str = sci ? sci_get_line(sci, lineno) : g_strdup("");
-	g_strstrip(line_str);
+		g_free(fname);
+	}
 
 	if (base_path)
 	{
-		gchar *rel_path = lsp_utils_get_relative_path(base_path, fname);
 		gchar *locale_base_path = utils_get_locale_from_utf8(base_path);
 
-		if (rel_path && !g_str_has_prefix(rel_path, ".."))
-			SETPTR(fname, g_strdup(rel_path));
-
 		msgwin_set_messages_dir(locale_base_path);
-
 		g_free(locale_base_path);
-		g_free(rel_path);
 	}
-	msgwin_msg_add(COLOR_BLACK, -1, NULL, "%s:%d:  %s", fname, lineno + 1, line_str);
 
-	g_free(line_str);
-	g_free(fname);
+	foreach_ptr_array(loc, i, locations)
+	{
+		gint lineno = loc->range.start.line;
+		gchar *fname, *line_str;
+		GeanyDocument *doc;
+
+		fname = lsp_utils_get_real_path_from_uri_utf8(loc->uri);
+		if (!fname)
+			continue;
+
+		doc = document_find_by_filename(fname);
+		if (doc)
+			line_str = sci_get_line(doc->editor->sci, lineno);
+		else
+		{
+			GPtrArray *texts = g_hash_table_lookup(file_texts, fname);
+			const gchar *text;
+
+			if (!texts)
+			{
+				texts = lsp_utils_get_file_lines(fname, g_hash_table_lookup(file_lines, fname));
+				g_hash_table_insert(file_texts, g_strdup(fname), texts);
+			}
+			text = texts->pdata[g_array_index(line_indices, guint, i)];
+			line_str = g_strdup(text ? text : "");
+		}
+		g_strstrip(line_str);
+
+		if (base_path)
+		{
+			gchar *rel_path = lsp_utils_get_relative_path(base_path, fname);
+
+			if (rel_path && !g_str_has_prefix(rel_path, ".."))
+				SETPTR(fname, g_strdup(rel_path));
+			g_free(rel_path);
+		}
+		msgwin_msg_add(COLOR_BLACK, -1, NULL, "%s:%d:  %s", fname, lineno + 1, line_str);
+
+		g_free(line_str);
+		g_free(fname);
+	}
+
+	g_array_free(line_indices, TRUE);
+	g_hash_table_destroy(file_texts);
+	g_hash_table_destroy(file_lines);
 	g_free(base_path);
-	if (!sci_table && !doc)
+}
+
+
+static void start_msgwin(GotoData *data)
+{
+	if (data->msgwin_started)
+		return;
+
+	msgwin_clear_tab(MSG_MESSAGE);
+	msgwin_switch_tab(MSG_MESSAGE, TRUE);
+	data->msgwin_started = TRUE;
+}
+
+
+static void goto_partial_result_cb(GVariant *value, gpointer user_data)
+{
+	GotoData *data = user_data;
+	GPtrArray *locations;
+	GVariantIter iter;
+
+	if (!DOC_VALID(data->doc) || !g_variant_is_of_type(value, G_VARIANT_TYPE_ARRAY))
+		return;
+
+	g_variant_iter_init(&iter, value);
+	locations = lsp_utils_parse_locations(&iter);
+
+	if (locations && locations->len > 0)
 	{
-		g_object_ref_sink(sci);
-		g_object_unref(sci);
+		start_msgwin(data);
+		show_in_msgwin(locations);
 	}
+
+	if (locations)
+		g_ptr_array_free(locations, TRUE);
 }
 
 
-static void goto_cb(GVariant *return_value, GError *error, gpointer user_data)
+static void goto_data_free(GotoData *data)
 {
-	if (!error)
+	lsp_progress_partial_result_free(data->partial_token);
+	g_free(data->partial_token);
+	g_free(data);
+}
+
+
+static void cache_entry_free(GotoCacheEntry *entry)
+{
+	g_variant_unref(entry->result);
+	g_free(entry);
+}
+
+
+static GotoCacheEntry *find_cached(gint kind, GeanyDocument *doc, guint version, gint start, gint end)
+{
+	GList *node;
+
+	for (node = goto_cache.head; node; node = node->next)
 	{
-		GotoData *data = user_data;
+		GotoCacheEntry *entry = node->data;
 
-		if (DOC_VALID(data->doc))
+		if (entry->kind == kind && entry->doc_id == doc->id && entry->version == version &&
+			entry->start == start && entry->end == end)
 		{
-			if (data->show_in_msgwin)
-			{
-				msgwin_clear_tab(MSG_MESSAGE);
-				msgwin_switch_tab(MSG_MESSAGE, TRUE);
-			}
+			// most recently used first
+			g_queue_unlink(&goto_cache, node);
+			g_queue_push_head_link(&goto_cache, node);
+			return entry;
+		}
+	}
 
-			// single location
+	return NULL;
+}
 
-			/* check G_VARIANT_TYPE_DICTIONARY ("a{?*}") before
-			   G_VARIANT_TYPE_ARRAY ("a*") as dictionary is apparently a
-			   subset of array :-( */
-			if (g_variant_is_of_type(return_value, G_VARIANT_TYPE_DICTIONARY))
-			{
-				LspLocation *loc = lsp_utils_parse_location(return_value);
 
-				if (loc)
-				{
-					if (data->show_in_msgwin)
-						show_in_msgwin(loc, NULL);
-					else
-						goto_location(data->doc, loc);
-				}
+static void add_cached(GotoData *data, GVariant *result)
+{
+	GotoCacheEntry *entry;
 
-				lsp_utils_free_lsp_location(loc);
-			}
-			// array of locations
-			else if (g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
-			{
-				GPtrArray *locations = NULL;
-				GVariantIter iter;
+	if (!DOC_VALID(data->doc) || data->doc->id != data->doc_id ||
+		find_cached(data->kind, data->doc, data->version, data->start, data->end))
+		return;
+
+	entry = g_new0(GotoCacheEntry, 1);
+	entry->kind = data->kind;
+	entry->doc_id = data->doc_id;
+	entry->version = data->version;
+	entry->start = data->start;
+	entry->end = data->end;
+	entry->result = g_variant_ref(result);
+	g_queue_push_head(&goto_cache, entry);
+
+	if (goto_cache.length > GOTO_CACHE_MAX)
+		cache_entry_free(g_queue_pop_tail(&goto_cache));
+}
 
-				g_variant_iter_init(&iter, return_value);
 
-				locations = lsp_utils_parse_locations(&iter);
+static void show_result(GotoData *data, GVariant *return_value)
+{
+	if (DOC_VALID(data->doc))
+	{
+		if (data->show_in_msgwin)
+			start_msgwin(data);
+
+		// single location
 
-				if (locations && locations->len > 0)
+		/* check G_VARIANT_TYPE_DICTIONARY ("a{?*}") before
+		   G_VARIANT_TYPE_ARRAY ("a*") as dictionary is apparently a
+		   subset of array :-( */
+		if (g_variant_is_of_type(return_value, G_VARIANT_TYPE_DICTIONARY))
+		{
+			LspLocation *loc = lsp_utils_parse_location(return_value);
+
+			if (loc)
+			{
+				if (data->show_in_msgwin)
 				{
-					if (data->show_in_msgwin)
-					{
-						GHashTable *sci_table = g_hash_table_new_full(g_str_hash,
-							g_str_equal, g_free, (GDestroyNotify)g_object_unref);
-						LspLocation *loc;
-						guint j;
+					GPtrArray *locations = g_ptr_array_new();
 
-						foreach_ptr_array(loc, j, locations)
-						{
-							show_in_msgwin(loc, sci_table);
-						}
+					g_ptr_array_add(locations, loc);
+					show_in_msgwin(locations);
+					g_ptr_array_free(locations, TRUE);
+				}
+				else
+					goto_location(data->doc, loc);
+			}
 
-						g_hash_table_destroy(sci_table);
-					}
-					else if (locations->len == 1)
-						goto_location(data->doc, locations->pdata[0]);
-					else
-					{
-						LspLocation *loc;
-						guint j;
+			lsp_utils_free_lsp_location(loc);
+		}
+		// array of locations
+		else if (g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
+		{
+			GPtrArray *locations = NULL;
+			GVariantIter iter;
 
-						if (last_result)
-							g_ptr_array_free(last_result, TRUE);
+			g_variant_iter_init(&iter, return_value);
+
+			locations = lsp_utils_parse_locations(&iter);
+
+			if (locations && locations->len > 0)
+			{
+				if (data->show_in_msgwin)
+					show_in_msgwin(locations);
+				else if (locations->len == 1)
+					goto_location(data->doc, locations->pdata[0]);
+				else
+				{
+					LspLocation *loc;
+					guint j;
 
-						last_result = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+					if (last_result)
+						g_ptr_array_free(last_result, TRUE);
 
-						foreach_ptr_array(loc, j, locations)
-						{
-							gchar *file_name, *name;
-							LspSymbol *sym;
+					last_result = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
 
-							file_name = lsp_utils_get_real_path_from_uri_utf8(loc->uri);
-							if (!file_name)
-								continue;
+					foreach_ptr_array(loc, j, locations)
+					{
+						gchar *file_name, *name;
+						LspSymbol *sym;
 
-							name = g_path_get_basename(file_name);
+						file_name = lsp_utils_get_real_path_from_uri_utf8(loc->uri);
+						if (!file_name)
+							continue;
 
-							sym = lsp_symbol_new(name, "", "", file_name, 0, 0, loc->range.start.line + 1, 0,
-								TM_ICON_OTHER);
+						name = g_path_get_basename(file_name);
 
-							g_ptr_array_add(last_result, sym);
+						sym = lsp_symbol_new(name, "", "", file_name, 0, 0, loc->range.start.line + 1, 0,
+							TM_ICON_OTHER);
 
-							g_free(name);
-							g_free(file_name);
-						}
+						g_ptr_array_add(last_result, sym);
 
-						lsp_goto_panel_show("", filter_symbols);
+						g_free(name);
+						g_free(file_name);
 					}
-				}
 
-				g_ptr_array_free(locations, TRUE);
+					lsp_goto_panel_show("", filter_symbols);
+				}
 			}
+
+			g_ptr_array_free(locations, TRUE);
 		}
+	}
+
+	//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
+}
+
+
+static void goto_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	GotoData *data = user_data;
+
+	// no more partial results once the response arrives
+	lsp_progress_partial_result_free(data->partial_token);
 
-		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
+	if (data->kind >= 0 && prefetch_data[data->kind] == data)
+	{
+		prefetch_data[data->kind] = NULL;
+		prefetch_requests[data->kind] = 0;
+	}
+
+	if (!error)
+	{
+		LspServer *srv = DOC_VALID(data->doc) ? lsp_server_get_if_running(data->doc) : NULL;
+
+		// positions are only meaningful for the version they were taken at
+		if (data->kind >= 0 && srv && lsp_sync_peek_doc_version(srv, data->doc) == data->version)
+			add_cached(data, return_value);
+
+		if (!data->prefetch)
+			show_result(data, return_value);
 	}
 
-	g_free(user_data);
+	goto_data_free(data);
 }
 
 
-static void perform_goto(LspServer *server, GeanyDocument *doc, gint pos, const gchar *request,
-	gboolean show_in_msgwin)
+static GotoData *goto_data_new(GeanyDocument *doc, gint kind, guint version, gint start, gint end,
+	gboolean prefetch)
+{
+	GotoData *data = g_new0(GotoData, 1);
+
+	data->doc = doc;
+	data->kind = kind;
+	data->doc_id = doc->id;
+	data->version = version;
+	data->start = start;
+	data->end = end;
+	data->prefetch = prefetch;
+
+	return data;
+}
+
+
+static LspRpcRequest send_goto(LspServer *server, GeanyDocument *doc, gint pos, const gchar *request,
+	GotoData *data)
 {
 	GVariant *node;
 	ScintillaObject *sci = doc->editor->sci;
 	LspPosition lsp_pos = lsp_utils_scintilla_pos_to_lsp(sci, pos);
 	gchar *doc_uri = lsp_utils_get_doc_uri(doc);
-	GotoData *data = g_new0(GotoData, 1);
+	LspRpcRequest id;
+
+	// long listings are shown as the server streams them
+	if (data->show_in_msgwin)
+		data->partial_token = lsp_progress_partial_result_new(server, goto_partial_result_cb, data);
 
 	node = JSONRPC_MESSAGE_NEW (
 		"textDocument", "{",
@@ -257,12 +464,165 @@ static void perform_goto(LspServer *server, GeanyDocument *doc, gint pos, const
 		"}"
 	);
 
-	data->doc = doc;
-	data->show_in_msgwin = show_in_msgwin;
-	lsp_rpc_call(server, request, node, goto_cb, data);
+	if (data->partial_token)
+	{
+		GVariantDict dict;
+
+		g_variant_dict_init(&dict, node);
+		g_variant_dict_insert_value(&dict, "partialResultToken", g_variant_new_string(data->partial_token));
+		g_variant_unref(node);
+		node = g_variant_take_ref(g_variant_dict_end(&dict));
+	}
+
+	id = lsp_rpc_call(server, request, node, goto_cb, data);
 
 	g_free(doc_uri);
 	g_variant_unref(node);
+
+	return id;
+}
+
+
+static void perform_goto(LspServer *server, GeanyDocument *doc, gint pos, const gchar *request,
+	gboolean show_in_msgwin)
+{
+	GotoData *data = goto_data_new(doc, -1, 0, -1, -1, FALSE);
+
+	data->show_in_msgwin = show_in_msgwin;
+	send_goto(server, doc, pos, request, data);
+}
+
+
+static gboolean is_pending_prefetch(PrefetchKind kind, GeanyDocument *doc, guint version,
+	gint start, gint end)
+{
+	GotoData *data = prefetch_data[kind];
+
+	return data && data->doc == doc && data->doc_id == doc->id && data->version == version &&
+		data->start == start && data->end == end;
+}
+
+
+/* jumps to the reply prefetched for the identifier at pos if there is one */
+static void perform_prefetched_goto(LspServer *server, GeanyDocument *doc, gint pos, PrefetchKind kind)
+{
+	guint version = lsp_sync_peek_doc_version(server, doc);
+	GotoCacheEntry *entry;
+	GotoData *data;
+	gint start, end;
+
+	if (!lsp_utils_get_current_iden_range(doc, pos, server->config.word_chars, &start, &end))
+	{
+		perform_goto(server, doc, pos, prefetch_methods[kind], FALSE);
+		return;
+	}
+
+	entry = find_cached(kind, doc, version, start, end);
+	lsp_timing_cache_lookup(LSP_TIMING_CACHE_GOTO,
+		entry != NULL || is_pending_prefetch(kind, doc, version, start, end));
+
+	if (entry)
+	{
+		GVariant *result = g_variant_ref(entry->result);
+		GotoData tmp = {0};
+
+		tmp.doc = doc;
+		show_result(&tmp, result);
+		g_variant_unref(result);
+		return;
+	}
+
+	// the reply is on its way - jump once it arrives
+	if (is_pending_prefetch(kind, doc, version, start, end))
+	{
+		prefetch_data[kind]->prefetch = FALSE;
+		return;
+	}
+
+	data = goto_data_new(doc, kind, version, start, end, FALSE);
+	send_goto(server, doc, pos, prefetch_methods[kind], data);
+}
+
+
+static void cancel_prefetch(PrefetchKind kind)
+{
+	LspRpcRequest request = prefetch_requests[kind];
+
+	// requests somebody waits for aren't speculative any more
+	if (!prefetch_data[kind] || !prefetch_data[kind]->prefetch)
+		return;
+
+	prefetch_data[kind] = NULL;
+	prefetch_requests[kind] = 0;
+	lsp_rpc_cancel(request);
+}
+
+
+static gboolean prefetch_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get_if_running(doc);
+	gint pos, start, end, kind;
+	guint version;
+
+	prefetch_source = 0;
+
+	if (!srv || !srv->config.goto_prefetch_enable || sci_has_selection(doc->editor->sci))
+		return G_SOURCE_REMOVE;
+
+	pos = sci_get_current_position(doc->editor->sci);
+	if (!lsp_utils_get_current_iden_range(doc, pos, srv->config.word_chars, &start, &end))
+		return G_SOURCE_REMOVE;
+
+	version = lsp_sync_peek_doc_version(srv, doc);
+
+	for (kind = 0; kind < PREFETCH_NUM; kind++)
+	{
+		gboolean enabled = kind == PREFETCH_DEFINITION ?
+			srv->config.goto_definition_enable : srv->config.goto_declaration_enable;
+		GotoData *data;
+
+		if (!enabled || find_cached(kind, doc, version, start, end) ||
+			is_pending_prefetch(kind, doc, version, start, end))
+			continue;
+
+		cancel_prefetch(kind);
+		if (prefetch_data[kind])
+			continue;  // the user waits for a different reply
+
+		data = goto_data_new(doc, kind, version, start, end, TRUE);
+		prefetch_data[kind] = data;
+		prefetch_requests[kind] = send_goto(srv, doc, pos, prefetch_methods[kind], data);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* requests definition and declaration of the identifier at the caret once the
+ * caret stops moving so jumping to them is instant */
+void lsp_goto_schedule_prefetch(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	gint pos = sci_get_current_position(doc->editor->sci);
+	gint start = -1, end = -1;
+	gint kind;
+
+	if (srv)
+		lsp_utils_get_current_iden_range(doc, pos, srv->config.word_chars, &start, &end);
+
+	// the caret left the identifier the speculative requests were sent for
+	for (kind = 0; kind < PREFETCH_NUM; kind++)
+	{
+		GotoData *data = prefetch_data[kind];
+
+		if (data && (data->doc != doc || data->start != start || data->end != end))
+			cancel_prefetch(kind);
+	}
+
+	if (prefetch_source != 0)
+		g_source_remove(prefetch_source);
+	prefetch_source = plugin_timeout_add(geany_plugin, GOTO_PREFETCH_DELAY, prefetch_idle, NULL);
 }
 
 
@@ -274,7 +634,10 @@ void lsp_goto_definition(gint pos)
 	if (!doc || !srv)
 		return;
 
-	perform_goto(srv, doc, pos, "textDocument/definition", FALSE);
+	if (srv->config.goto_prefetch_enable)
+		perform_prefetched_goto(srv, doc, pos, PREFETCH_DEFINITION);
+	else
+		perform_goto(srv, doc, pos, "textDocument/definition", FALSE);
 }
 
 
@@ -286,7 +649,10 @@ void lsp_goto_declaration(gint pos)
 	if (!doc || !srv)
 		return;
 
-	perform_goto(srv, doc, pos, "textDocument/declaration", FALSE);
+	if (srv->config.goto_prefetch_enable)
+		perform_prefetched_goto(srv, doc, pos, PREFETCH_DECLARATION);
+	else
+		perform_goto(srv, doc, pos, "textDocument/declaration", FALSE);
 }
 
 
@@ -324,3 +690,32 @@ void lsp_goto_references(gint pos)
 
 	perform_goto(srv, doc, pos, "textDocument/references", TRUE);
 }
+
+
+/* replies for the closed document are useless, document ids get reused */
+void lsp_goto_doc_closed(GeanyDocument *doc)
+{
+	GList *node = goto_cache.head;
+
+	while (node)
+	{
+		GList *next = node->next;
+		GotoCacheEntry *entry = node->data;
+
+		if (entry->doc_id == doc->id)
+		{
+			cache_entry_free(entry);
+			g_queue_delete_link(&goto_cache, node);
+		}
+		node = next;
+	}
+}
+
+
+void lsp_goto_destroy(void)
+{
+	GotoCacheEntry *entry;
+
+	while ((entry = g_queue_pop_head(&goto_cache)))
+		cache_entry_free(entry);
+}
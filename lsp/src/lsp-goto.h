@@ -30,4 +30,9 @@ void lsp_goto_type_definition(gint pos);
 void lsp_goto_implementations(gint pos);
 void lsp_goto_references(gint pos);
 
+void lsp_goto_schedule_prefetch(GeanyDocument *doc);
+void lsp_goto_doc_closed(GeanyDocument *doc);
+
+void lsp_goto_destroy(void);
+
 #endif  /* LSP_GOTO_H */
@@ -0,0 +1,633 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Call and type hierarchy shown in a sidebar tab. Only the items of the symbol
+ * under the cursor are requested up front; the next level of a node is
+ * requested when the node gets expanded and kept until the document changes.
+ * Requests of nodes collapsed before their result arrives are cancelled. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-hierarchy.h"
+#include "lsp-utils.h"
+#include "lsp-rpc.h"
+#include "lsp-doc-state.h"
+#include "lsp-symbol-kinds.h"
+
+#include <jsonrpc-glib.h>
+
+
+enum
+{
+	COL_ICON,
+	COL_NAME,
+	COL_TOOLTIP,
+	COL_ITEM,  // CallHierarchyItem or TypeHierarchyItem
+	COL_URI,  // of the location the row jumps to
+	COL_LINE,
+	COL_STATE,
+	COL_REQUEST,
+	COL_VERSION,  // of the document the children were loaded for
+	COL_NUM
+};
+
+
+typedef enum
+{
+	NODE_UNLOADED,
+	NODE_LOADING,
+	NODE_LOADED,
+	NODE_PLACEHOLDER  // child shown until the children of its parent are loaded
+} NodeState;
+
+
+typedef struct
+{
+	gchar *path;
+	guint generation;
+	LspRpcRequest request;
+} ExpandData;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+static GtkWidget *s_vbox;
+static GtkWidget *s_label;
+static GtkWidget *s_tree;
+static GtkTreeStore *s_store;
+
+static struct
+{
+	GeanyDocument *doc;
+	LspHierarchyKind kind;
+	guint generation;  // changes with every shown hierarchy
+} s_current;
+
+
+static const gchar *prepare_method(LspHierarchyKind kind)
+{
+	if (kind == LSP_HIERARCHY_INCOMING_CALLS || kind == LSP_HIERARCHY_OUTGOING_CALLS)
+		return "textDocument/prepareCallHierarchy";
+	return "textDocument/prepareTypeHierarchy";
+}
+
+
+static const gchar *expand_method(LspHierarchyKind kind)
+{
+	switch (kind)
+	{
+		case LSP_HIERARCHY_INCOMING_CALLS:
+			return "callHierarchy/incomingCalls";
+		case LSP_HIERARCHY_OUTGOING_CALLS:
+			return "callHierarchy/outgoingCalls";
+		case LSP_HIERARCHY_SUPERTYPES:
+			return "typeHierarchy/supertypes";
+		default:
+			return "typeHierarchy/subtypes";
+	}
+}
+
+
+static const gchar *kind_title(LspHierarchyKind kind)
+{
+	switch (kind)
+	{
+		case LSP_HIERARCHY_INCOMING_CALLS:
+			return _("Incoming calls");
+		case LSP_HIERARCHY_OUTGOING_CALLS:
+			return _("Outgoing calls");
+		case LSP_HIERARCHY_SUPERTYPES:
+			return _("Supertypes");
+		default:
+			return _("Subtypes");
+	}
+}
+
+
+static LspServer *get_server(void)
+{
+	if (!DOC_VALID(s_current.doc))
+		return NULL;
+	return lsp_server_get_if_running(s_current.doc);
+}
+
+
+static guint get_doc_version(void)
+{
+	return DOC_VALID(s_current.doc) ? lsp_doc_state_get(s_current.doc)->version : 0;
+}
+
+
+static void add_placeholder(GtkTreeIter *parent)
+{
+	GtkTreeIter iter;
+
+	gtk_tree_store_append(s_store, &iter, parent);
+	gtk_tree_store_set(s_store, &iter,
+		COL_NAME, _("Loading..."),
+		COL_STATE, NODE_PLACEHOLDER,
+		-1);
+}
+
+
+/* Adds the row of a hierarchy item, jumping to call_range when given (the
+ * call site of an incoming call) or to the item's selection range */
+static void add_item(GtkTreeIter *parent, GVariant *item, GVariant *call_range)
+{
+	const gchar *name = NULL;
+	const gchar *detail = NULL;
+	const gchar *uri = NULL;
+	GVariant *sel_range = NULL;
+	gint64 kind = 0;
+	LspRange range;
+	GtkTreeIter iter;
+	gchar *fname, *tooltip;
+	TMIcon icon;
+
+	JSONRPC_MESSAGE_PARSE_MEMBERS(item,
+		"name", JSONRPC_MESSAGE_GET_STRING(&name),
+		"detail", JSONRPC_MESSAGE_GET_STRING(&detail),
+		"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
+		"kind", JSONRPC_MESSAGE_GET_INT64(&kind),
+		"selectionRange", JSONRPC_MESSAGE_GET_VARIANT(&sel_range));
+
+	if (!name || !uri)
+	{
+		if (sel_range)
+			g_variant_unref(sel_range);
+		return;
+	}
+
+	range = lsp_utils_parse_range(call_range ? call_range : sel_range);
+	icon = lsp_symbol_kinds_get_symbol_icon((LspSymbolKind)kind);
+
+	fname = lsp_utils_get_real_path_from_uri_utf8(uri);
+	tooltip = g_strdup_printf("%s%s%s:%d", detail ? detail : "", detail ? "\n" : "",
+		fname ? fname : uri, range.start.line + 1);
+
+	gtk_tree_store_append(s_store, &iter, parent);
+	gtk_tree_store_set(s_store, &iter,
+		COL_ICON, symbols_get_icon_pixbuf(icon),
+		COL_NAME, name,
+		COL_TOOLTIP, tooltip,
+		COL_ITEM, item,
+		COL_URI, uri,
+		COL_LINE, range.start.line,
+		COL_STATE, NODE_UNLOADED,
+		-1);
+	add_placeholder(&iter);
+
+	g_free(tooltip);
+	g_free(fname);
+	if (sel_range)
+		g_variant_unref(sel_range);
+}
+
+
+static void remove_children(GtkTreeIter *parent)
+{
+	GtkTreeIter child;
+
+	while (gtk_tree_model_iter_children(GTK_TREE_MODEL(s_store), &child, parent))
+		gtk_tree_store_remove(s_store, &child);
+}
+
+
+static void add_children(GtkTreeIter *parent, GVariant *result)
+{
+	GVariant *member = NULL;
+	GVariantIter iter;
+
+	if (!g_variant_is_of_type(result, G_VARIANT_TYPE_ARRAY))
+		return;
+
+	g_variant_iter_init(&iter, result);
+	while (g_variant_iter_next(&iter, "v", &member))
+	{
+		GVariant *item = NULL;
+		GVariant *from_ranges = NULL;
+
+		switch (s_current.kind)
+		{
+			case LSP_HIERARCHY_INCOMING_CALLS:
+				JSONRPC_MESSAGE_PARSE_MEMBERS(member,
+					"from", JSONRPC_MESSAGE_GET_VARIANT(&item),
+					"fromRanges", JSONRPC_MESSAGE_GET_VARIANT(&from_ranges));
+				break;
+			case LSP_HIERARCHY_OUTGOING_CALLS:
+				JSONRPC_MESSAGE_PARSE_MEMBERS(member,
+					"to", JSONRPC_MESSAGE_GET_VARIANT(&item));
+				break;
+			default:
+				item = g_variant_ref(member);
+				break;
+		}
+
+		if (item)
+		{
+			GVariant *call_range = NULL;
+
+			// call sites of incoming calls are inside the caller
+			if (from_ranges && g_variant_is_of_type(from_ranges, G_VARIANT_TYPE_ARRAY) &&
+				g_variant_n_children(from_ranges) > 0)
+			{
+				GVariant *child = g_variant_get_child_value(from_ranges, 0);
+
+				call_range = g_variant_is_of_type(child, G_VARIANT_TYPE_VARIANT) ?
+					g_variant_get_variant(child) : g_variant_ref(child);
+				g_variant_unref(child);
+			}
+
+			add_item(parent, item, call_range);
+
+			if (call_range)
+				g_variant_unref(call_range);
+			g_variant_unref(item);
+		}
+
+		if (from_ranges)
+			g_variant_unref(from_ranges);
+		g_variant_unref(member);
+	}
+}
+
+
+/* The row still waiting for the result of the request of data - FALSE when
+ * a different hierarchy is shown or the request got cancelled */
+static gboolean get_row_iter(ExpandData *data, GtkTreeIter *iter)
+{
+	LspRpcRequest request;
+	gint state;
+
+	if (!s_store || data->generation != s_current.generation ||
+		!gtk_tree_model_get_iter_from_string(GTK_TREE_MODEL(s_store), iter, data->path))
+		return FALSE;
+
+	gtk_tree_model_get(GTK_TREE_MODEL(s_store), iter,
+		COL_STATE, &state,
+		COL_REQUEST, &request,
+		-1);
+
+	return state == NODE_LOADING && request == data->request;
+}
+
+
+static void expand_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	ExpandData *data = user_data;
+	GtkTreeIter iter;
+
+	if (!error && get_row_iter(data, &iter))
+	{
+		GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(s_store), &iter);
+
+		remove_children(&iter);
+		add_children(&iter, return_value);
+		gtk_tree_store_set(s_store, &iter,
+			COL_STATE, NODE_LOADED,
+			COL_REQUEST, 0,
+			-1);
+
+		// the row was expanded with the placeholder only
+		if (gtk_tree_model_iter_has_child(GTK_TREE_MODEL(s_store), &iter))
+			gtk_tree_view_expand_row(GTK_TREE_VIEW(s_tree), path, FALSE);
+		gtk_tree_path_free(path);
+	}
+	else if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+		get_row_iter(data, &iter))
+	{
+		gtk_tree_store_set(s_store, &iter,
+			COL_STATE, NODE_UNLOADED,
+			COL_REQUEST, 0,
+			-1);
+	}
+
+	g_free(data->path);
+	g_free(data);
+}
+
+
+static void load_children(GtkTreeIter *iter)
+{
+	LspServer *srv = get_server();
+	GVariant *item = NULL;
+	ExpandData *data;
+	GVariant *node;
+
+	if (!srv)
+		return;
+
+	gtk_tree_model_get(GTK_TREE_MODEL(s_store), iter, COL_ITEM, &item, -1);
+	if (!item)
+		return;
+
+	node = JSONRPC_MESSAGE_NEW(
+		"item", "{",
+			JSONRPC_MESSAGE_PUT_VARIANT(item),
+		"}"
+	);
+
+	data = g_new0(ExpandData, 1);
+	data->path = gtk_tree_model_get_string_from_iter(GTK_TREE_MODEL(s_store), iter);
+	data->generation = s_current.generation;
+	data->request = lsp_rpc_call(srv, expand_method(s_current.kind), node, expand_cb, data);
+
+	gtk_tree_store_set(s_store, iter,
+		COL_STATE, NODE_LOADING,
+		COL_REQUEST, data->request,
+		COL_VERSION, get_doc_version(),
+		-1);
+
+	g_variant_unref(node);
+	g_variant_unref(item);
+}
+
+
+static gboolean on_test_expand_row(GtkTreeView *tree_view, GtkTreeIter *iter,
+	GtkTreePath *path, gpointer user_data)
+{
+	guint version;
+	gint state;
+
+	gtk_tree_model_get(GTK_TREE_MODEL(s_store), iter,
+		COL_STATE, &state,
+		COL_VERSION, &version,
+		-1);
+
+	// levels loaded for an older version of the document are re-requested
+	if (state == NODE_LOADED && version != get_doc_version())
+	{
+		remove_children(iter);
+		add_placeholder(iter);
+		state = NODE_UNLOADED;
+	}
+
+	if (state == NODE_UNLOADED)
+		load_children(iter);
+
+	return FALSE;
+}
+
+
+static gboolean cancel_loading(GtkTreeModel *model, GtkTreePath *path,
+	GtkTreeIter *iter, gpointer user_data)
+{
+	GtkTreePath *collapsed = user_data;
+	LspRpcRequest request;
+	gint state;
+
+	if (!gtk_tree_path_is_descendant(path, collapsed) && gtk_tree_path_compare(path, collapsed) != 0)
+		return FALSE;
+
+	gtk_tree_model_get(model, iter,
+		COL_STATE, &state,
+		COL_REQUEST, &request,
+		-1);
+
+	if (state == NODE_LOADING)
+	{
+		gtk_tree_store_set(s_store, iter,
+			COL_STATE, NODE_UNLOADED,
+			COL_REQUEST, 0,
+			-1);
+		lsp_rpc_cancel(request);
+	}
+
+	return FALSE;
+}
+
+
+static void on_row_collapsed(GtkTreeView *tree_view, GtkTreeIter *iter,
+	GtkTreePath *path, gpointer user_data)
+{
+	gtk_tree_model_foreach(GTK_TREE_MODEL(s_store), cancel_loading, path);
+}
+
+
+static void on_row_activated(GtkTreeView *tree_view, GtkTreePath *path,
+	GtkTreeViewColumn *column, gpointer user_data)
+{
+	GeanyDocument *old_doc = document_get_current();
+	GeanyDocument *doc = NULL;
+	gchar *uri = NULL;
+	gchar *fname;
+	GtkTreeIter iter;
+	gint line;
+
+	if (!gtk_tree_model_get_iter(GTK_TREE_MODEL(s_store), &iter, path))
+		return;
+
+	gtk_tree_model_get(GTK_TREE_MODEL(s_store), &iter,
+		COL_URI, &uri,
+		COL_LINE, &line,
+		-1);
+
+	fname = uri ? lsp_utils_get_real_path_from_uri_locale(uri) : NULL;
+	if (fname)
+		doc = document_open_file(fname, FALSE, NULL, NULL);
+	if (doc)
+		navqueue_goto_line(old_doc, doc, line + 1);
+
+	g_free(fname);
+	g_free(uri);
+}
+
+
+static void cancel_all(void)
+{
+	GtkTreePath *root = gtk_tree_path_new();
+
+	// empty path is an ancestor of all rows
+	gtk_tree_model_foreach(GTK_TREE_MODEL(s_store), cancel_loading, root);
+	gtk_tree_path_free(root);
+}
+
+
+static void prepare_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	guint generation = GPOINTER_TO_UINT(user_data);
+	GVariant *item = NULL;
+	GVariantIter iter;
+	GtkTreePath *path;
+
+	if (error || !s_store || generation != s_current.generation)
+		return;
+
+	if (!g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY) ||
+		g_variant_n_children(return_value) == 0)
+	{
+		gtk_label_set_text(GTK_LABEL(s_label), _("No symbol found at the cursor"));
+		return;
+	}
+
+	g_variant_iter_init(&iter, return_value);
+	while (g_variant_iter_next(&iter, "v", &item))
+	{
+		add_item(NULL, item, NULL);
+		g_variant_unref(item);
+	}
+
+	// the first level of the first item is needed anyway
+	path = gtk_tree_path_new_first();
+	gtk_tree_view_expand_row(GTK_TREE_VIEW(s_tree), path, FALSE);
+	gtk_tree_path_free(path);
+}
+
+
+static void switch_to_tab(void)
+{
+	GtkNotebook *notebook = GTK_NOTEBOOK(geany_data->main_widgets->sidebar_notebook);
+	gint page = gtk_notebook_page_num(notebook, s_vbox);
+
+	if (page >= 0)
+		gtk_notebook_set_current_page(notebook, page);
+}
+
+
+void lsp_hierarchy_show(gint pos, LspHierarchyKind kind)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get(doc);
+	LspPosition lsp_pos;
+	gchar *doc_uri, *title;
+	GVariant *node;
+
+	if (!srv || !s_vbox)
+		return;
+
+	if ((kind == LSP_HIERARCHY_INCOMING_CALLS || kind == LSP_HIERARCHY_OUTGOING_CALLS) ?
+		!srv->config.call_hierarchy_enable : !srv->config.type_hierarchy_enable)
+		return;
+
+	cancel_all();
+	gtk_tree_store_clear(s_store);
+
+	s_current.doc = doc;
+	s_current.kind = kind;
+	s_current.generation++;
+
+	title = g_strdup_printf("%s - %s", kind_title(kind), DOC_FILENAME(doc));
+	gtk_label_set_text(GTK_LABEL(s_label), title);
+	g_free(title);
+	switch_to_tab();
+
+	lsp_pos = lsp_utils_scintilla_pos_to_lsp(doc->editor->sci, pos);
+	doc_uri = lsp_utils_get_doc_uri(doc);
+
+	node = JSONRPC_MESSAGE_NEW (
+		"textDocument", "{",
+			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+		"}",
+		"position", "{",
+			"line", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.line),
+			"character", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.character),
+		"}"
+	);
+
+	lsp_rpc_call(srv, prepare_method(kind), node, prepare_cb,
+		GUINT_TO_POINTER(s_current.generation));
+
+	g_free(doc_uri);
+	g_variant_unref(node);
+}
+
+
+/* Called when a document gets closed - the hierarchy stays displayed but
+ * can't be expanded any more without its server */
+void lsp_hierarchy_doc_closed(GeanyDocument *doc)
+{
+	if (s_store && doc == s_current.doc)
+	{
+		cancel_all();
+		s_current.doc = NULL;
+	}
+}
+
+
+void lsp_hierarchy_init(void)
+{
+	LspServerConfig *cfg = lsp_server_get_all_section_config();
+	const gchar *tab_label = cfg->hierarchy_tab_label;
+	GtkNotebook *notebook = GTK_NOTEBOOK(geany_data->main_widgets->sidebar_notebook);
+	GtkCellRenderer *text_renderer, *icon_renderer;
+	GtkTreeViewColumn *column;
+	GtkWidget *scrolled;
+
+	if (s_vbox && g_strcmp0(gtk_notebook_get_tab_label_text(notebook, s_vbox), tab_label) != 0)
+		lsp_hierarchy_destroy();
+
+	if (s_vbox || EMPTY(tab_label))
+		return;
+
+	s_store = gtk_tree_store_new(COL_NUM, GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_STRING,
+		G_TYPE_VARIANT, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT, G_TYPE_UINT, G_TYPE_UINT);
+
+	s_tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(s_store));
+	gtk_tree_view_set_headers_visible(GTK_TREE_VIEW(s_tree), FALSE);
+	gtk_tree_view_set_tooltip_column(GTK_TREE_VIEW(s_tree), COL_TOOLTIP);
+	gtk_tree_view_set_activate_on_single_click(GTK_TREE_VIEW(s_tree), TRUE);
+
+	column = gtk_tree_view_column_new();
+	icon_renderer = gtk_cell_renderer_pixbuf_new();
+	text_renderer = gtk_cell_renderer_text_new();
+	gtk_tree_view_column_pack_start(column, icon_renderer, FALSE);
+	gtk_tree_view_column_set_attributes(column, icon_renderer, "pixbuf", COL_ICON, NULL);
+	gtk_tree_view_column_pack_start(column, text_renderer, TRUE);
+	gtk_tree_view_column_set_attributes(column, text_renderer, "text", COL_NAME, NULL);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(s_tree), column);
+
+	g_signal_connect(s_tree, "test-expand-row", G_CALLBACK(on_test_expand_row), NULL);
+	g_signal_connect(s_tree, "row-collapsed", G_CALLBACK(on_row_collapsed), NULL);
+	g_signal_connect(s_tree, "row-activated", G_CALLBACK(on_row_activated), NULL);
+
+	s_label = gtk_label_new("");
+	gtk_label_set_ellipsize(GTK_LABEL(s_label), PANGO_ELLIPSIZE_END);
+	gtk_widget_set_halign(s_label, GTK_ALIGN_START);
+
+	scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+		GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled), s_tree);
+
+	s_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+	gtk_box_pack_start(GTK_BOX(s_vbox), s_label, FALSE, FALSE, 2);
+	gtk_box_pack_start(GTK_BOX(s_vbox), scrolled, TRUE, TRUE, 0);
+	gtk_widget_show_all(s_vbox);
+
+	gtk_notebook_append_page(notebook, s_vbox, gtk_label_new(tab_label));
+}
+
+
+void lsp_hierarchy_destroy(void)
+{
+	if (!s_vbox)
+		return;
+
+	cancel_all();
+	gtk_widget_destroy(s_vbox);
+	g_object_unref(s_store);
+	s_vbox = NULL;
+	s_label = NULL;
+	s_tree = NULL;
+	s_store = NULL;
+	s_current.doc = NULL;
+	s_current.generation++;
+}
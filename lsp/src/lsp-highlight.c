@@ -23,10 +23,14 @@
 #include "lsp-highlight.h"
 #include "lsp-utils.h"
 #include "lsp-rpc.h"
+#include "lsp-sync.h"
+#include "lsp-timing.h"
 
 #include <jsonrpc-glib.h>
 
 #define HIGHLIGHT_DIRTY "lsp_highlight_dirty"
+#define HIGHLIGHT_CACHE "lsp_highlight_cache"
+#define HIGHLIGHT_CACHE_MAX 16
 
 
 typedef struct {
@@ -34,15 +38,103 @@ typedef struct {
 	gint pos;
 	gchar *identifier;
 	gboolean highlight;
+	guint version;
 } LspHighlightData;
 
 
+typedef struct {
+	gint start;
+	gint end;
+} LspHighlightRange;
+
+
+/* occurrences of an identifier, in Scintilla positions */
+typedef struct {
+	gchar *identifier;
+	GArray *ranges;  /* LspHighlightRange */
+} LspHighlightEntry;
+
+
+/* results of the document version the cache belongs to; any of the occurrences
+ * of an identifier can be reused for the others */
+typedef struct {
+	guint version;
+	GPtrArray *entries;  /* LspHighlightEntry, the most recent last */
+	LspHighlightEntry *displayed;
+} LspHighlightCache;
+
+
 extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
 static gint indicator;
 static gint64 last_request_time;
 static gint request_source;
+static LspRpcRequest pending_request;
+
+static const gchar *highlight_methods[] = {"textDocument/documentHighlight", NULL};
+
+
+static void entry_free(LspHighlightEntry *entry)
+{
+	g_free(entry->identifier);
+	g_array_free(entry->ranges, TRUE);
+	g_free(entry);
+}
+
+
+static void cache_free(LspHighlightCache *cache)
+{
+	g_ptr_array_free(cache->entries, TRUE);
+	g_free(cache);
+}
+
+
+static LspHighlightCache *get_cache(GeanyDocument *doc, guint version)
+{
+	LspHighlightCache *cache = plugin_get_document_data(geany_plugin, doc, HIGHLIGHT_CACHE);
+
+	if (!cache)
+	{
+		cache = g_new0(LspHighlightCache, 1);
+		cache->entries = g_ptr_array_new_with_free_func((GDestroyNotify)entry_free);
+		plugin_set_document_data_full(geany_plugin, doc, HIGHLIGHT_CACHE, cache,
+			(GDestroyNotify)cache_free);
+	}
+
+	if (cache->version != version)
+	{
+		g_ptr_array_set_size(cache->entries, 0);
+		cache->displayed = NULL;
+		cache->version = version;
+	}
+
+	return cache;
+}
+
+
+static LspHighlightEntry *find_entry(LspHighlightCache *cache, const gchar *iden, gint pos)
+{
+	guint i, j;
+
+	for (i = 0; i < cache->entries->len; i++)
+	{
+		LspHighlightEntry *entry = cache->entries->pdata[i];
+
+		if (g_strcmp0(entry->identifier, iden) != 0)
+			continue;
+
+		for (j = 0; j < entry->ranges->len; j++)
+		{
+			LspHighlightRange *r = &g_array_index(entry->ranges, LspHighlightRange, j);
+
+			if (pos >= r->start && pos <= r->end)
+				return entry;
+		}
+	}
+
+	return NULL;
+}
 
 
 void lsp_highlight_clear(GeanyDocument *doc)
@@ -50,12 +142,16 @@ void lsp_highlight_clear(GeanyDocument *doc)
 	gboolean dirty = GPOINTER_TO_UINT(plugin_get_document_data(geany_plugin, doc, HIGHLIGHT_DIRTY));
 	if (dirty)
 	{
+		LspHighlightCache *cache = plugin_get_document_data(geany_plugin, doc, HIGHLIGHT_CACHE);
+
 		ScintillaObject *sci = doc->editor->sci;
 
 		if (indicator > 0)
 			sci_indicator_set(sci, indicator);
 		sci_indicator_clear(sci, 0, sci_get_length(sci));
 		plugin_set_document_data(geany_plugin, doc, HIGHLIGHT_DIRTY, GUINT_TO_POINTER(FALSE));
+		if (cache)
+			cache->displayed = NULL;
 	}
 }
 
@@ -81,36 +177,69 @@ void lsp_highlight_style_init(GeanyDocument *doc)
 }
 
 
-static void highlight_range(GeanyDocument *doc, LspRange range)
+static void apply_entry(GeanyDocument *doc, LspHighlightCache *cache, LspHighlightEntry *entry,
+	gint pos, gboolean highlight)
 {
 	ScintillaObject *sci = doc->editor->sci;
-	gint start_pos = lsp_utils_lsp_pos_to_scintilla(sci, range.start);
-	gint end_pos = lsp_utils_lsp_pos_to_scintilla(sci, range.end);
+	gint main_sel_id = 0;
+	guint i;
 
-	if (indicator > 0)
-		editor_indicator_set_on_range(doc->editor, indicator, start_pos, end_pos);
-	plugin_set_document_data(geany_plugin, doc, HIGHLIGHT_DIRTY, GUINT_TO_POINTER(TRUE));
+	if (highlight)
+	{
+		gboolean dirty = GPOINTER_TO_UINT(plugin_get_document_data(geany_plugin, doc, HIGHLIGHT_DIRTY));
+
+		// already shown
+		if (dirty && cache->displayed == entry)
+			return;
+		lsp_highlight_clear(doc);
+	}
+
+	for (i = 0; i < entry->ranges->len; i++)
+	{
+		LspHighlightRange *r = &g_array_index(entry->ranges, LspHighlightRange, i);
+
+		if (highlight)
+		{
+			if (indicator > 0)
+				editor_indicator_set_on_range(doc->editor, indicator, r->start, r->end);
+		}
+		else
+		{
+			SSM(sci, i == 0 ? SCI_SETSELECTION : SCI_ADDSELECTION, r->start, r->end);
+			if (pos >= r->start && pos <= r->end)
+				main_sel_id = i;
+		}
+	}
+
+	if (highlight)
+	{
+		plugin_set_document_data(geany_plugin, doc, HIGHLIGHT_DIRTY, GUINT_TO_POINTER(TRUE));
+		cache->displayed = entry;
+	}
+	else if (entry->ranges->len > 0)
+		SSM(sci, SCI_SETMAINSELECTION, main_sel_id, 0);
 }
 
 
 static void highlight_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	LspHighlightData *data = user_data;
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = doc == data->doc ? lsp_server_get(doc) : NULL;
 
-	if (!error)
+	if (!error && srv && !lsp_sync_is_response_stale(srv, doc, data->version,
+		"textDocument/documentHighlight"))
 	{
-		GeanyDocument *doc = document_get_current();
+		LspHighlightCache *cache = get_cache(doc, data->version);
+		LspHighlightEntry *entry = g_new0(LspHighlightEntry, 1);
 
-		if (doc == data->doc)
-			lsp_highlight_clear(doc);
+		entry->identifier = g_strdup(data->identifier);
+		entry->ranges = g_array_new(FALSE, FALSE, sizeof(LspHighlightRange));
 
-		if (doc == data->doc && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
+		if (g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
 		{
 			GVariant *member = NULL;
 			GVariantIter iter;
-			gint sel_id = 0;
-			gint main_sel_id = 0;
-			gboolean first_sel = TRUE;
 
 			//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
@@ -136,28 +265,27 @@ static void highlight_cb(GVariant *return_value, GError *error, gpointer user_da
 					//restrict to identifiers only
 					if (g_strcmp0(ident, data->identifier) == 0)
 					{
-						if (data->highlight)
-							highlight_range(doc, r);
-						else
-						{
-							SSM(doc->editor->sci, first_sel ? SCI_SETSELECTION : SCI_ADDSELECTION,
-								start_pos, end_pos);
-							if (data->pos >= start_pos && data->pos <= end_pos)
-								main_sel_id = sel_id;
-
-							first_sel = FALSE;
-							sel_id++;
-						}
+						LspHighlightRange hr = {start_pos, end_pos};
+
+						g_array_append_val(entry->ranges, hr);
 					}
 
 					g_free(ident);
 					g_variant_unref(range);
 				}
 			}
+		}
 
-			if (!data->highlight)
-				SSM(doc->editor->sci, SCI_SETMAINSELECTION, main_sel_id, 0);
+		if (cache->entries->len >= HIGHLIGHT_CACHE_MAX)
+		{
+			if (cache->displayed == cache->entries->pdata[0])
+				cache->displayed = NULL;
+			g_ptr_array_remove_index(cache->entries, 0);
 		}
+		g_ptr_array_add(cache->entries, entry);
+
+		lsp_highlight_clear(doc);
+		apply_entry(doc, cache, entry, data->pos, data->highlight);
 	}
 
 	g_free(data->identifier);
@@ -165,6 +293,27 @@ static void highlight_cb(GVariant *return_value, GError *error, gpointer user_da
 }
 
 
+/* applies already received occurrences of the identifier at pos, if any */
+static gboolean apply_cached(LspServer *server, GeanyDocument *doc, gint pos, const gchar *iden,
+	gboolean highlight)
+{
+	LspHighlightCache *cache = get_cache(doc, lsp_sync_peek_doc_version(server, doc));
+	LspHighlightEntry *entry = find_entry(cache, iden, pos);
+
+	if (!entry)
+		return FALSE;
+
+	lsp_timing_cache_lookup(LSP_TIMING_CACHE_HIGHLIGHT, TRUE);
+
+	// a reply for another identifier would override it
+	lsp_rpc_cancel(pending_request);
+	pending_request = 0;
+
+	apply_entry(doc, cache, entry, pos, highlight);
+	return TRUE;
+}
+
+
 static void send_request(LspServer *server, GeanyDocument *doc, gint pos, gboolean highlight)
 {
 	GVariant *node;
@@ -173,36 +322,34 @@ static void send_request(LspServer *server, GeanyDocument *doc, gint pos, gboole
 	gchar *doc_uri = lsp_utils_get_doc_uri(doc);
 	gchar *iden = lsp_utils_get_current_iden(doc, pos, server->config.word_chars);
 	gchar *selection = sci_get_selection_contents(sci);
-	gboolean valid_rename;
-
-	node = JSONRPC_MESSAGE_NEW (
-		"textDocument", "{",
-			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-		"}",
-		"position", "{",
-			"line", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.line),
-			"character", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.character),
-		"}"
-	);
+	gboolean valid_rename, valid;
+
+	node = lsp_utils_new_text_document_position(doc_uri, lsp_pos, NULL, NULL);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
 	valid_rename = (!sci_has_selection(sci) && iden) ||
 		(sci_has_selection(sci) && g_strcmp0(iden, selection) == 0);
 
-	if ((highlight && !sci_has_selection(sci) && iden) || (!highlight && valid_rename))
+	valid = (highlight && !sci_has_selection(sci) && iden) || (!highlight && valid_rename);
+
+	if (valid && !apply_cached(server, doc, pos, iden, highlight))
 	{
 		LspHighlightData *data = g_new0(LspHighlightData, 1);
 
+		lsp_timing_cache_lookup(LSP_TIMING_CACHE_HIGHLIGHT, FALSE);
+
 		data->doc = doc;
 		data->pos = pos;
 		data->identifier = g_strdup(iden);
 		data->highlight = highlight;
-		lsp_rpc_call(server, "textDocument/documentHighlight", node,
+		data->version = lsp_sync_peek_doc_version(server, doc);
+		lsp_rpc_cancel(pending_request);
+		pending_request = lsp_rpc_call(server, "textDocument/documentHighlight", node,
 			highlight_cb, data);
 		last_request_time = g_get_monotonic_time();
 	}
-	else
+	else if (!valid)
 		lsp_highlight_clear(doc);
 
 	g_free(selection);
@@ -215,19 +362,22 @@ static void send_request(LspServer *server, GeanyDocument *doc, gint pos, gboole
 static gboolean request_idle(gpointer data)
 {
 	GeanyDocument *doc = document_get_current();
+	gint64 stall_time = lsp_timing_stall_start();
 	LspServer *srv;
 	gint pos;
 
 	request_source = 0;
 
 	srv = lsp_server_get_if_running(doc);
-	if (!srv)
+	if (!srv || lsp_rpc_is_degraded(srv))
 		return G_SOURCE_REMOVE;
 
 	pos = sci_get_current_position(doc->editor->sci);
 
 	send_request(srv, doc, pos, TRUE);
 
+	lsp_timing_stall_end("highlight timer", NULL, 0, stall_time);
+
 	return G_SOURCE_REMOVE;
 }
 
@@ -237,6 +387,7 @@ void lsp_highlight_schedule_request(GeanyDocument *doc)
 	gint pos = sci_get_current_position(doc->editor->sci);
 	LspServer *srv = lsp_server_get_if_running(doc);
 	gchar *iden;
+	gint debounce;
 
 	if (!srv)
 		return;
@@ -252,16 +403,24 @@ void lsp_highlight_schedule_request(GeanyDocument *doc)
 		request_source = 0;
 		return;
 	}
-	g_free(iden);
 
 	if (request_source != 0)
 		g_source_remove(request_source);
 	request_source = 0;
 
-	if (last_request_time == 0 || g_get_monotonic_time() > last_request_time + 300000)
+	// moving within the same identifier or to another of its occurrences
+	if (!sci_has_selection(doc->editor->sci) && apply_cached(srv, doc, pos, iden, TRUE))
+	{
+		g_free(iden);
+		return;
+	}
+	g_free(iden);
+
+	debounce = lsp_rpc_get_debounce(srv, highlight_methods);
+	if (last_request_time == 0 || g_get_monotonic_time() > last_request_time + debounce * 1000)
 		request_idle(NULL);
 	else
-		request_source = plugin_timeout_add(geany_plugin, 300, request_idle, NULL);
+		request_source = plugin_timeout_add(geany_plugin, debounce, request_idle, NULL);
 }
 
 
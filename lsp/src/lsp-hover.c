@@ -23,17 +23,45 @@
 #include "lsp-hover.h"
 #include "lsp-utils.h"
 #include "lsp-rpc.h"
+#include "lsp-sync.h"
+#include "lsp-timing.h"
 
 #include <jsonrpc-glib.h>
 
+#define HOVER_CACHE_MAX 32
+#define HOVER_PREFETCH_DELAY 500
+
 
 typedef struct {
 	GeanyDocument *doc;
+	guint doc_id;
 	gint pos;
+	gint start;  /* identifier range, -1 if not on identifier */
+	gint end;
+	guint version;
+	gboolean prefetch;
 } LspHoverData;
 
 
+/* hover of an identifier at the given document version; NULL text when the
+ * server has nothing to say */
+typedef struct {
+	guint doc_id;
+	guint version;
+	gint start;
+	gint end;
+	gchar *text;
+} LspHoverCacheEntry;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
 static ScintillaObject *calltip_sci;
+static LspRpcRequest pending_request;
+static LspRpcRequest pending_prefetch;
+static guint prefetch_source;
+static GQueue hover_cache = G_QUEUE_INIT;  /* LspHoverCacheEntry, most recently used first */
 
 
 static void show_calltip(GeanyDocument *doc, gint pos, const gchar *calltip)
@@ -94,25 +122,89 @@ static void show_calltip(GeanyDocument *doc, gint pos, const gchar *calltip)
 }
 
 
+static void cache_entry_free(LspHoverCacheEntry *entry)
+{
+	g_free(entry->text);
+	g_free(entry);
+}
+
+
+static LspHoverCacheEntry *find_cached(GeanyDocument *doc, guint version, gint start, gint end)
+{
+	GList *node;
+
+	for (node = hover_cache.head; node; node = node->next)
+	{
+		LspHoverCacheEntry *entry = node->data;
+
+		if (entry->doc_id == doc->id && entry->version == version &&
+			entry->start == start && entry->end == end)
+		{
+			// most recently used first
+			g_queue_unlink(&hover_cache, node);
+			g_queue_push_head_link(&hover_cache, node);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void add_cached(GeanyDocument *doc, guint version, gint start, gint end, const gchar *text)
+{
+	LspHoverCacheEntry *entry = find_cached(doc, version, start, end);
+
+	if (entry)
+	{
+		SETPTR(entry->text, g_strdup(text));
+		return;
+	}
+
+	entry = g_new0(LspHoverCacheEntry, 1);
+	entry->doc_id = doc->id;
+	entry->version = version;
+	entry->start = start;
+	entry->end = end;
+	entry->text = g_strdup(text);
+	g_queue_push_head(&hover_cache, entry);
+
+	if (hover_cache.length > HOVER_CACHE_MAX)
+		cache_entry_free(g_queue_pop_tail(&hover_cache));
+}
+
+
 static void hover_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
+	LspHoverData *data = user_data;
+
 	if (!error)
 	{
 		GeanyDocument *doc = document_get_current();
-		LspHoverData *data = user_data;
+		const gchar *str = NULL;
 
-		if (doc == data->doc && gtk_widget_has_focus(GTK_WIDGET(doc->editor->sci)))
-		{
-			const gchar *str = NULL;
+		JSONRPC_MESSAGE_PARSE(return_value, 
+			"contents", "{",
+				"value", JSONRPC_MESSAGE_GET_STRING(&str),
+			"}");
 
-			JSONRPC_MESSAGE_PARSE(return_value, 
-				"contents", "{",
-					"value", JSONRPC_MESSAGE_GET_STRING(&str),
-				"}");
+		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
-			//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
+		if (str && strlen(str) == 0)
+			str = NULL;
 
-			if (str && strlen(str) > 0)
+		if (DOC_VALID(data->doc) && data->doc->id == data->doc_id && data->start >= 0)
+		{
+			LspServer *srv = lsp_server_get_if_running(data->doc);
+
+			// positions are only meaningful for the version they were taken at
+			if (srv && lsp_sync_peek_doc_version(srv, data->doc) == data->version)
+				add_cached(data->doc, data->version, data->start, data->end, str);
+		}
+
+		if (!data->prefetch && doc == data->doc && gtk_widget_has_focus(GTK_WIDGET(doc->editor->sci)))
+		{
+			if (str)
 				show_calltip(doc, data->pos, str);
 		}
 	}
@@ -121,37 +213,97 @@ static void hover_cb(GVariant *return_value, GError *error, gpointer user_data)
 }
 
 
-void lsp_hover_send_request(LspServer *server, GeanyDocument *doc, gint pos)
+static void send_request(LspServer *server, GeanyDocument *doc, gint pos, gint start, gint end,
+	gboolean prefetch)
 {
 	GVariant *node;
 	ScintillaObject *sci = doc->editor->sci;
 	LspPosition lsp_pos = lsp_utils_scintilla_pos_to_lsp(sci, pos);
 	gchar *doc_uri = lsp_utils_get_doc_uri(doc);
 	LspHoverData *data = g_new0(LspHoverData, 1);
+	LspRpcRequest *request = prefetch ? &pending_prefetch : &pending_request;
 
-	node = JSONRPC_MESSAGE_NEW (
-		"textDocument", "{",
-			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-		"}",
-		"position", "{",
-			"line", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.line),
-			"character", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.character),
-		"}"
-	);
+	node = lsp_utils_new_text_document_position(doc_uri, lsp_pos, NULL, NULL);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
 	data->doc = doc;
+	data->doc_id = doc->id;
 	data->pos = pos;
-
-	lsp_rpc_call(server, "textDocument/hover", node,
-		hover_cb, data);
+	data->start = start;
+	data->end = end;
+	data->version = lsp_sync_peek_doc_version(server, doc);
+	data->prefetch = prefetch;
+
+	lsp_rpc_cancel(*request);
+	// speculative requests don't delay those the user waits for
+	if (prefetch)
+		*request = lsp_rpc_call_background(server, "textDocument/hover", node, hover_cb, data);
+	else
+		*request = lsp_rpc_call(server, "textDocument/hover", node, hover_cb, data);
 
 	g_free(doc_uri);
 	g_variant_unref(node);
 }
 
 
+void lsp_hover_send_request(LspServer *server, GeanyDocument *doc, gint pos)
+{
+	gint start, end;
+
+	if (lsp_utils_get_current_iden_range(doc, pos, server->config.word_chars, &start, &end))
+	{
+		LspHoverCacheEntry *entry = find_cached(doc, lsp_sync_peek_doc_version(server, doc), start, end);
+
+		lsp_timing_cache_lookup(LSP_TIMING_CACHE_HOVER, entry != NULL);
+		if (entry)
+		{
+			// a pending reply would replace what we show now
+			lsp_rpc_cancel(pending_request);
+			pending_request = 0;
+			if (entry->text)
+				show_calltip(doc, pos, entry->text);
+			return;
+		}
+	}
+	else
+		start = end = -1;
+
+	send_request(server, doc, pos, start, end, FALSE);
+}
+
+
+static gboolean prefetch_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+	LspServer *srv = lsp_server_get_if_running(doc);
+	gint pos, start, end;
+
+	prefetch_source = 0;
+
+	if (!srv || !srv->config.hover_enable || sci_has_selection(doc->editor->sci) ||
+		lsp_rpc_is_degraded(srv))
+		return G_SOURCE_REMOVE;
+
+	pos = sci_get_current_position(doc->editor->sci);
+	if (lsp_utils_get_current_iden_range(doc, pos, srv->config.word_chars, &start, &end) &&
+		!find_cached(doc, lsp_sync_peek_doc_version(srv, doc), start, end))
+		send_request(srv, doc, pos, start, end, TRUE);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* fetches hover of the identifier at the caret once the caret stops moving so
+ * asking for it is instant */
+void lsp_hover_schedule_prefetch(G_GNUC_UNUSED GeanyDocument *doc)
+{
+	if (prefetch_source != 0)
+		g_source_remove(prefetch_source);
+	prefetch_source = plugin_timeout_add(geany_plugin, HOVER_PREFETCH_DELAY, prefetch_idle, NULL);
+}
+
+
 void lsp_hover_hide_calltip(GeanyDocument *doc)
 {
 	if (doc->editor->sci == calltip_sci)
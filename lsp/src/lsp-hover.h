@@ -24,6 +24,7 @@
 #include <glib.h>
 
 void lsp_hover_send_request(LspServer *server, GeanyDocument *doc, gint pos);
+void lsp_hover_schedule_prefetch(GeanyDocument *doc);
 
 void lsp_hover_hide_calltip(GeanyDocument *doc);
 
@@ -0,0 +1,364 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Inlay hints are requested only for the visible lines plus a margin of one
+ * screen above and below. The lines covered so far are kept for the document
+ * version so scrolling only requests the newly exposed lines. Scintilla has
+ * no inline annotations so the hints of a line are shown in its end-of-line
+ * annotation together with code lens commands. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-inlay-hints.h"
+#include "lsp-code-lens.h"
+#include "lsp-utils.h"
+#include "lsp-rpc.h"
+#include "lsp-sync.h"
+
+#include <jsonrpc-glib.h>
+
+
+#define INLAY_HINT_KIND_TYPE 1
+#define INLAY_HINT_KIND_PARAMETER 2
+
+
+typedef struct {
+	GeanyDocument *doc;
+	guint doc_id;
+	guint version;
+	gint start_line;
+	gint end_line;
+	gboolean replace;
+} LspInlayHintsData;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+static GeanyDocument *hints_doc;
+static guint hints_doc_id;
+static guint hints_version;
+static gint covered_start;  /* lines of hints_doc the hints were received for */
+static gint covered_end;
+static GHashTable *hint_lines;  /* line -> annotation text of the line's hints */
+static LspRpcRequest pending_request;
+static guint viewport_source;
+
+
+static gchar *parse_label(GVariant *hint)
+{
+	GVariant *label = NULL;
+	gchar *ret = NULL;
+
+	JSONRPC_MESSAGE_PARSE(hint,
+		"label", JSONRPC_MESSAGE_GET_VARIANT(&label)
+	);
+
+	if (!label)
+		return NULL;
+
+	// either string or InlayHintLabelPart[]
+	if (g_variant_is_of_type(label, G_VARIANT_TYPE_STRING))
+		ret = g_variant_dup_string(label, NULL);
+	else if (g_variant_is_of_type(label, G_VARIANT_TYPE_ARRAY))
+	{
+		GString *str = g_string_new("");
+		GVariant *part = NULL;
+		GVariantIter iter;
+
+		g_variant_iter_init(&iter, label);
+		while (g_variant_iter_loop(&iter, "v", &part))
+		{
+			const gchar *value = NULL;
+
+			JSONRPC_MESSAGE_PARSE(part,
+				"value", JSONRPC_MESSAGE_GET_STRING(&value)
+			);
+			if (value)
+				g_string_append(str, value);
+		}
+		ret = g_string_free(str, FALSE);
+	}
+
+	g_variant_unref(label);
+
+	return ret;
+}
+
+
+/* at the end of line the hint needs the word it belongs to, e.g. "x: int"
+ * instead of ": int" or "count: 5" instead of "count:" */
+static gchar *get_hint_text(ScintillaObject *sci, gint pos, gint64 kind, const gchar *label)
+{
+	gchar *word = NULL;
+	gchar *text;
+
+	if (kind == INLAY_HINT_KIND_TYPE)
+	{
+		gint start = SSM(sci, SCI_WORDSTARTPOSITION, pos, TRUE);
+
+		if (start < pos)
+			word = sci_get_contents_range(sci, start, pos);
+		text = g_strconcat(word ? word : "", label, NULL);
+	}
+	else if (kind == INLAY_HINT_KIND_PARAMETER)
+	{
+		gint end = SSM(sci, SCI_WORDENDPOSITION, pos, TRUE);
+
+		if (end > pos)
+			word = sci_get_contents_range(sci, pos, end);
+		text = g_strconcat(label, " ", word ? word : "", NULL);
+	}
+	else
+		text = g_strdup(label);
+
+	g_free(word);
+
+	return g_strstrip(text);
+}
+
+
+static void parse_hints(GVariant *return_value, ScintillaObject *sci)
+{
+	GVariant *hint = NULL;
+	GVariantIter iter;
+
+	g_variant_iter_init(&iter, return_value);
+
+	while (g_variant_iter_loop(&iter, "v", &hint))
+	{
+		GVariant *pos_variant = NULL;
+		gint64 kind = 0;
+		gchar *label;
+
+		JSONRPC_MESSAGE_PARSE(hint,
+			"position", JSONRPC_MESSAGE_GET_VARIANT(&pos_variant)
+		);
+		JSONRPC_MESSAGE_PARSE(hint,
+			"kind", JSONRPC_MESSAGE_GET_INT64(&kind)
+		);
+		label = parse_label(hint);
+
+		if (pos_variant && !EMPTY(label))
+		{
+			LspPosition lsp_pos = lsp_utils_parse_pos(pos_variant);
+			gint pos = lsp_utils_lsp_pos_to_scintilla(sci, lsp_pos);
+			gchar *line_text = g_hash_table_lookup(hint_lines, GINT_TO_POINTER(lsp_pos.line));
+			gchar *hint_text = get_hint_text(sci, pos, kind, label);
+
+			// hints come sorted by position
+			if (line_text)
+				line_text = g_strconcat(line_text, "  ", hint_text, NULL);
+			else
+				line_text = g_strdup(hint_text);
+			g_hash_table_insert(hint_lines, GINT_TO_POINTER(lsp_pos.line), line_text);
+			g_free(hint_text);
+		}
+
+		if (pos_variant)
+			g_variant_unref(pos_variant);
+		g_free(label);
+	}
+}
+
+
+static gboolean remove_line_in_range(gpointer key, G_GNUC_UNUSED gpointer value, gpointer user_data)
+{
+	LspInlayHintsData *data = user_data;
+	gint line = GPOINTER_TO_INT(key);
+
+	return line >= data->start_line && line <= data->end_line;
+}
+
+
+static void inlay_hints_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	LspInlayHintsData *data = user_data;
+	GeanyDocument *doc = data->doc;
+	LspServer *srv;
+
+	srv = DOC_VALID(doc) && doc->id == data->doc_id ? lsp_server_get_if_running(doc) : NULL;
+
+	if (!error && srv && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY) &&
+		!lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/inlayHint"))
+	{
+		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
+
+		if (!hint_lines)
+			hint_lines = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+
+		if (data->replace || doc != hints_doc || hints_doc_id != data->doc_id ||
+			hints_version != data->version)
+		{
+			g_hash_table_remove_all(hint_lines);
+			hints_doc = doc;
+			hints_doc_id = data->doc_id;
+			hints_version = data->version;
+			covered_start = data->start_line;
+			covered_end = data->end_line;
+		}
+		else
+		{
+			// requested next to the covered lines
+			g_hash_table_foreach_remove(hint_lines, remove_line_in_range, data);
+			covered_start = MIN(covered_start, data->start_line);
+			covered_end = MAX(covered_end, data->end_line);
+		}
+
+		parse_hints(return_value, doc->editor->sci);
+		lsp_code_lens_update_annotations(doc);
+	}
+
+	g_free(data);
+}
+
+
+static void send_range_request(LspServer *srv, GeanyDocument *doc, guint version,
+	gint start_line, gint end_line, gboolean replace)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	LspInlayHintsData *data;
+	LspPosition start, end;
+	gchar *doc_uri;
+	GVariant *node;
+
+	start.line = start_line;
+	start.character = 0;
+	// up to the end of end_line
+	end = lsp_utils_scintilla_pos_to_lsp(sci, SSM(sci, SCI_GETLINEENDPOSITION, end_line, 0));
+
+	doc_uri = lsp_utils_get_doc_uri(doc);
+
+	node = JSONRPC_MESSAGE_NEW(
+		"textDocument", "{",
+			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+		"}",
+		"range", "{",
+			"start", "{",
+				"line", JSONRPC_MESSAGE_PUT_INT32(start.line),
+				"character", JSONRPC_MESSAGE_PUT_INT32(start.character),
+			"}",
+			"end", "{",
+				"line", JSONRPC_MESSAGE_PUT_INT32(end.line),
+				"character", JSONRPC_MESSAGE_PUT_INT32(end.character),
+			"}",
+		"}"
+	);
+
+	data = g_new0(LspInlayHintsData, 1);
+	data->doc = doc;
+	data->doc_id = doc->id;
+	data->version = version;
+	data->start_line = start_line;
+	data->end_line = end_line;
+	data->replace = replace;
+
+	// whatever is pending is recomputed from the covered lines
+	lsp_rpc_cancel(pending_request);
+	pending_request = lsp_rpc_call_background(srv, "textDocument/inlayHint", node,
+		inlay_hints_cb, data);
+
+	g_free(doc_uri);
+	g_variant_unref(node);
+}
+
+
+void lsp_inlay_hints_send_request(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	ScintillaObject *sci;
+	gint first_line, last_line, lines_on_screen;
+	guint version;
+
+	if (!srv || !srv->config.inlay_hints_enable || !doc->real_path || lsp_rpc_is_degraded(srv))
+		return;
+
+	sci = doc->editor->sci;
+	lsp_sync_text_document_did_open(srv, doc);
+
+	lines_on_screen = SSM(sci, SCI_LINESONSCREEN, 0, 0);
+	first_line = SSM(sci, SCI_DOCLINEFROMVISIBLE, SSM(sci, SCI_GETFIRSTVISIBLELINE, 0, 0), 0);
+	last_line = SSM(sci, SCI_DOCLINEFROMVISIBLE,
+		SSM(sci, SCI_GETFIRSTVISIBLELINE, 0, 0) + lines_on_screen, 0);
+	first_line = MAX(0, first_line - lines_on_screen);
+	last_line = MIN(sci_get_line_count(sci) - 1, last_line + lines_on_screen);
+
+	version = lsp_sync_peek_doc_version(srv, doc);
+
+	if (doc != hints_doc || doc->id != hints_doc_id || version != hints_version ||
+		last_line < covered_start - 1 || first_line > covered_end + 1 ||
+		(first_line < covered_start && last_line > covered_end))
+	{
+		// after edits, for other documents and far jumps
+		send_range_request(srv, doc, version, first_line, last_line, TRUE);
+	}
+	else if (first_line < covered_start)
+		send_range_request(srv, doc, version, first_line, covered_start - 1, FALSE);
+	else if (last_line > covered_end)
+		send_range_request(srv, doc, version, covered_end + 1, last_line, FALSE);
+}
+
+
+static gboolean viewport_idle(G_GNUC_UNUSED gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+
+	viewport_source = 0;
+
+	if (doc)
+		lsp_inlay_hints_send_request(doc);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+void lsp_inlay_hints_viewport_changed(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+
+	if (!srv || !srv->config.inlay_hints_enable)
+		return;
+
+	if (viewport_source != 0)
+		g_source_remove(viewport_source);
+	viewport_source = plugin_timeout_add(geany_plugin, 150, viewport_idle, NULL);
+}
+
+
+/* Handles workspace/inlayHint/refresh - documents not visible are refreshed
+ * when activated */
+void lsp_inlay_hints_refresh(LspServer *srv)
+{
+	GeanyDocument *doc = document_get_current();
+
+	hints_doc = NULL;
+
+	if (doc && lsp_server_get_if_running(doc) == srv)
+		lsp_inlay_hints_send_request(doc);
+}
+
+
+/* GHashTable<line, text> of the hints of doc or NULL, owned by this module */
+GHashTable *lsp_inlay_hints_get_line_texts(GeanyDocument *doc)
+{
+	if (!hint_lines || doc != hints_doc || doc->id != hints_doc_id)
+		return NULL;
+	return hint_lines;
+}
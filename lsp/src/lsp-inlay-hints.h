@@ -0,0 +1,32 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_INLAY_HINTS_H
+#define LSP_INLAY_HINTS_H 1
+
+#include "lsp-server.h"
+
+#include <glib.h>
+
+void lsp_inlay_hints_send_request(GeanyDocument *doc);
+void lsp_inlay_hints_viewport_changed(GeanyDocument *doc);
+void lsp_inlay_hints_refresh(LspServer *srv);
+
+GHashTable *lsp_inlay_hints_get_line_texts(GeanyDocument *doc);
+
+#endif  /* LSP_INLAY_HINTS_H */
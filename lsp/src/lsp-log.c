@@ -24,6 +24,51 @@
 #include "lsp-utils.h"
 
 #include <glib.h>
+#include <string.h>
+
+
+/* size of the buffer between the main thread and the asynchronous writer,
+ * must be a power of 2 */
+#define RING_SIZE (8 * 1024 * 1024)
+/* how long the writer sleeps when it may have missed a wakeup */
+#define WRITER_POLL_INTERVAL (50 * G_TIME_SPAN_MILLISECOND)
+
+
+typedef struct
+{
+	guint32 payload_len;  // bytes that follow, padded to 8
+	guint32 type;
+	gint64 time;  // real time, µs
+	gint64 delta;  // -1 when not a response
+	guint32 method_len;
+	guint32 error_len;
+	guint32 params_type_len;
+	guint32 params_len;
+} LspLogRecord;
+
+
+typedef struct LspLogWriter LspLogWriter;
+
+
+/* Single-producer single-consumer ring buffer - the main thread only appends
+ * serialized messages and moves head, the writer thread formats them and
+ * moves tail. Positions grow monotonically and are masked on access. */
+struct LspLogWriter
+{
+	LspLogInfo log;
+	gchar *path;
+	goffset max_size;
+
+	guint8 *ring;
+	gsize head;
+	gsize tail;
+	guint dropped;
+	gint stopping;
+
+	GMutex mutex;
+	GCond cond;
+	GThread *thread;
+};
 
 
 static void log_print(LspLogInfo log, const gchar *fmt, ...)
@@ -43,10 +88,313 @@ static void log_print(LspLogInfo log, const gchar *fmt, ...)
 }
 
 
+static GFileOutputStream *create_log_file(const gchar *path)
+{
+	GFile *fp = g_file_new_for_path(path);
+	GFileOutputStream *stream;
+
+	g_file_delete(fp, NULL, NULL);
+	stream = g_file_create(fp, G_FILE_CREATE_NONE, NULL, NULL);
+	g_object_unref(fp);
+
+	return stream;
+}
+
+
+static const gchar *get_title(LspLogType type)
+{
+	switch (type)
+	{
+		case LspLogClientMessageSent:
+			return "C --> S  req:  ";
+		case LspLogClientMessageReceived:
+			return "C <-- S  resp: ";
+		case LspLogClientNotificationSent:
+			return "C --> S  notif:";
+		case LspLogServerMessageSent:
+			return "C <-- S  req:  ";
+		case LspLogServerMessageReceived:
+			return "C --> S  resp: ";
+		case LspLogServerNotificationSent:
+			return "C <-- S  notif:";
+		case LspLogClientDocumentEvicted:
+			return "C --x S  evict:";
+		case LspLogClientResponseDiscarded:
+			return "C <-x S  stale:";
+	}
+
+	return "";
+}
+
+
+/* time is real time in µs, delta the time since the request in µs or -1 */
+static void write_message(LspLogInfo log, LspLogType type, const gchar *method, GVariant *params,
+	const gchar *error_msg, gint64 time, gint64 delta)
+{
+	const gchar *title = get_title(type);
+	gchar *time_str, *delta_str;
+	GDateTime *dt;
+
+	dt = g_date_time_new_from_unix_local(time / G_USEC_PER_SEC);
+	time_str = g_date_time_format(dt, "\%H:\%M:\%S");
+	g_date_time_unref(dt);
+
+	if (delta >= 0)
+		delta_str = g_strdup_printf(" (%" G_GINT64_FORMAT " ms)", delta / 1000);
+	else
+		delta_str = g_strdup("");
+
+	if (!method)
+		method = "";
+
+	if (log.full)
+	{
+		gchar *json_msg;
+
+		if (!params)
+			json_msg = g_strdup("null");
+		else
+			json_msg = lsp_utils_json_pretty_print(params);
+
+		log_print(log, "\n\n\"[%s.%03d] %s %s%s\":\n%s,\n", time_str,
+			(gint)(time % G_USEC_PER_SEC / 1000), title, method, delta_str, json_msg);
+		g_free(json_msg);
+	}
+	else
+		log_print(log, "[%s.%03d] %s %s%s%s%s\n", time_str, (gint)(time % G_USEC_PER_SEC / 1000),
+			title, method, delta_str, error_msg ? "\n  ^-- " : "", error_msg ? error_msg : "");
+
+	g_free(time_str);
+	g_free(delta_str);
+}
+
+
+static void write_dropped(LspLogInfo log, guint dropped)
+{
+	if (log.full)
+		log_print(log, "\n\n\"[log] %u messages dropped\": null,\n", dropped);
+	else
+		log_print(log, "[log] %u messages dropped\n", dropped);
+}
+
+
+static void ring_write(LspLogWriter *writer, gsize pos, gconstpointer data, gsize len)
+{
+	gsize offset = pos & (RING_SIZE - 1);
+	gsize first = MIN(len, RING_SIZE - offset);
+
+	memcpy(writer->ring + offset, data, first);
+	memcpy(writer->ring, (const guint8 *)data + first, len - first);
+}
+
+
+static void ring_read(LspLogWriter *writer, gsize pos, gpointer data, gsize len)
+{
+	gsize offset = pos & (RING_SIZE - 1);
+	gsize first = MIN(len, RING_SIZE - offset);
+
+	memcpy(data, writer->ring + offset, first);
+	memcpy((guint8 *)data + first, writer->ring, len - first);
+}
+
+
+static void rotate(LspLogWriter *writer)
+{
+	gchar *old_path = g_strconcat(writer->path, ".1", NULL);
+	GFile *fp = g_file_new_for_path(writer->path);
+	GFile *old_fp = g_file_new_for_path(old_path);
+
+	if (writer->log.full)
+		log_print(writer->log, "\n\n\"log continues in the next file\": \"\"\n}\n");
+	g_output_stream_close(G_OUTPUT_STREAM(writer->log.stream), NULL, NULL);
+	g_clear_object(&writer->log.stream);
+
+	g_file_move(fp, old_fp, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, NULL);
+	writer->log.stream = create_log_file(writer->path);
+
+	if (writer->log.stream && writer->log.full)
+		log_print(writer->log, "{\n");
+
+	g_object_unref(old_fp);
+	g_object_unref(fp);
+	g_free(old_path);
+}
+
+
+static void write_record(LspLogWriter *writer, LspLogRecord *rec, const gchar *payload)
+{
+	const gchar *method = payload;
+	const gchar *error_msg = rec->error_len > 0 ? method + rec->method_len + 1 : NULL;
+	const gchar *params_type = method + rec->method_len + 1 + rec->error_len + 1;
+	GVariant *params = NULL;
+
+	if (!writer->log.stream && writer->log.type == 0)
+		return;
+
+	if (rec->params_type_len > 0)
+	{
+		// a separate allocation keeps the serialized data aligned
+		gpointer data = g_malloc(rec->params_len);
+
+		memcpy(data, params_type + rec->params_type_len + 1, rec->params_len);
+		params = g_variant_new_from_data(G_VARIANT_TYPE(params_type), data,
+			rec->params_len, FALSE, g_free, data);
+		g_variant_ref_sink(params);
+	}
+
+	write_message(writer->log, rec->type, method, params, error_msg, rec->time, rec->delta);
+
+	if (params)
+		g_variant_unref(params);
+
+	if (writer->log.stream && writer->max_size > 0 &&
+		g_seekable_tell(G_SEEKABLE(writer->log.stream)) >= writer->max_size)
+	{
+		rotate(writer);
+	}
+}
+
+
+static gpointer writer_thread(gpointer user_data)
+{
+	LspLogWriter *writer = user_data;
+	gchar *payload = NULL;
+	gsize payload_size = 0;
+	guint dropped = 0;
+
+	while (TRUE)
+	{
+		gsize head = g_atomic_pointer_get(&writer->head);
+		guint now_dropped = g_atomic_int_get(&writer->dropped);
+		LspLogRecord rec;
+
+		if (now_dropped != dropped)
+		{
+			write_dropped(writer->log, now_dropped - dropped);
+			dropped = now_dropped;
+		}
+
+		if (writer->tail == head)
+		{
+			if (g_atomic_int_get(&writer->stopping))
+				break;
+
+			g_mutex_lock(&writer->mutex);
+			g_cond_wait_until(&writer->cond, &writer->mutex,
+				g_get_monotonic_time() + WRITER_POLL_INTERVAL);
+			g_mutex_unlock(&writer->mutex);
+			continue;
+		}
+
+		ring_read(writer, writer->tail, &rec, sizeof(rec));
+		if (rec.payload_len > payload_size)
+		{
+			payload_size = rec.payload_len;
+			payload = g_realloc(payload, payload_size);
+		}
+		ring_read(writer, writer->tail + sizeof(rec), payload, rec.payload_len);
+		g_atomic_pointer_set(&writer->tail, writer->tail + sizeof(rec) + rec.payload_len);
+
+		write_record(writer, &rec, payload);
+	}
+
+	g_free(payload);
+
+	return NULL;
+}
+
+
+/* Copies the message into the ring buffer; never blocks - when the writer
+ * doesn't keep up, the message is dropped and only counted */
+static void enqueue_message(LspLogWriter *writer, LspLogType type, const gchar *method,
+	GVariant *params, GError *error, gint64 delta)
+{
+	const gchar *params_type = params ? g_variant_get_type_string(params) : "";
+	gsize params_len = params ? g_variant_get_size(params) : 0;
+	const gchar *error_msg = error ? error->message : "";
+	LspLogRecord rec;
+	gsize total, tail;
+
+	if (!method)
+		method = "";
+
+	rec.type = type;
+	rec.time = g_get_real_time();
+	rec.delta = delta;
+	rec.method_len = strlen(method);
+	rec.error_len = strlen(error_msg);
+	rec.params_type_len = strlen(params_type);
+	rec.params_len = params_len;
+	rec.payload_len = rec.method_len + 1 + rec.error_len + 1 + rec.params_type_len + 1 + params_len;
+	rec.payload_len = (rec.payload_len + 7) & ~7u;
+
+	total = sizeof(rec) + rec.payload_len;
+	tail = g_atomic_pointer_get(&writer->tail);
+	if (total > RING_SIZE - (writer->head - tail))
+	{
+		g_atomic_int_inc(&writer->dropped);
+		return;
+	}
+
+	tail = writer->head;
+	ring_write(writer, tail, &rec, sizeof(rec));
+	tail += sizeof(rec);
+	ring_write(writer, tail, method, rec.method_len + 1);
+	tail += rec.method_len + 1;
+	ring_write(writer, tail, error_msg, rec.error_len + 1);
+	tail += rec.error_len + 1;
+	ring_write(writer, tail, params_type, rec.params_type_len + 1);
+	tail += rec.params_type_len + 1;
+	if (params_len > 0)
+		ring_write(writer, tail, g_variant_get_data(params), params_len);
+
+	g_atomic_pointer_set(&writer->head, writer->head + total);
+
+	// without the mutex a wakeup may get lost - the writer polls in that case
+	g_cond_signal(&writer->cond);
+}
+
+
+static LspLogWriter *writer_new(LspLogInfo log, const gchar *path, gint max_size_mb)
+{
+	LspLogWriter *writer = g_new0(LspLogWriter, 1);
+
+	writer->log = log;
+	writer->path = g_strdup(path);
+	writer->max_size = (goffset)MAX(max_size_mb, 0) * 1024 * 1024;
+	writer->ring = g_malloc(RING_SIZE);
+	g_mutex_init(&writer->mutex);
+	g_cond_init(&writer->cond);
+	writer->thread = g_thread_new("lsp-log", writer_thread, writer);
+
+	return writer;
+}
+
+
+/* returns the log state after writing the remaining messages */
+static LspLogInfo writer_free(LspLogWriter *writer)
+{
+	LspLogInfo log;
+
+	g_atomic_int_set(&writer->stopping, TRUE);
+	g_cond_signal(&writer->cond);
+	g_thread_join(writer->thread);
+
+	log = writer->log;
+
+	g_mutex_clear(&writer->mutex);
+	g_cond_clear(&writer->cond);
+	g_free(writer->ring);
+	g_free(writer->path);
+	g_free(writer);
+
+	return log;
+}
+
+
 LspLogInfo lsp_log_start(LspServerConfig *config)
 {
-	LspLogInfo info = {0, TRUE, NULL};
-	GFile *fp;
+	LspLogInfo info = {0, TRUE, NULL, NULL};
 
 	if (!config->rpc_log)
 		return info;
@@ -59,25 +407,33 @@ LspLogInfo lsp_log_start(LspServerConfig *config)
 		info.type = STDERR_FILENO;
 	else
 	{
-		fp = g_file_new_for_path(config->rpc_log);
-		g_file_delete(fp, NULL, NULL);
-		info.stream = g_file_create(fp, G_FILE_CREATE_NONE, NULL, NULL);
+		info.stream = create_log_file(config->rpc_log);
 
 		if (!info.stream)
 			msgwin_status_add(_("Failed to create log file: %s"), config->rpc_log);
-
-		g_object_unref(fp);
 	}
 
 	if (info.full)
 		log_print(info, "{\n");
 
+	if (config->rpc_log_async && (info.type != 0 || info.stream))
+	{
+		LspLogInfo async_info = info;
+
+		// everything is written by the thread from now on
+		info.writer = writer_new(async_info, config->rpc_log, config->rpc_log_max_size);
+		info.stream = NULL;
+	}
+
 	return info;
 }
 
 
 void lsp_log_stop(LspLogInfo log)
 {
+	if (log.writer)
+		log = writer_free(log.writer);
+
 	if (log.type == 0 && !log.stream)
 		return;
 
@@ -85,80 +441,30 @@ void lsp_log_stop(LspLogInfo log)
 		log_print(log, "\n\n\"log end\": \"\"\n}\n");
 
 	if (log.stream)
+	{
 		g_output_stream_close(G_OUTPUT_STREAM(log.stream), NULL, NULL);
+		g_object_unref(log.stream);
+	}
 	log.stream = NULL;
 	log.type = 0;
 }
 
 
 void lsp_log(LspLogInfo log, LspLogType type, const gchar *method, GVariant *params,
-	GError *error, GDateTime *req_time)
+	GError *error, gint64 req_time)
 {
-	gchar *json_msg, *time_str;
-	const gchar *title = "";
-	GDateTime *time;
-	gint time_str_len;
-	gchar *delta_str = NULL;
-	gchar *err_msg;
+	gint64 delta = req_time > 0 ? g_get_monotonic_time() - req_time : -1;
 
-	if (log.type == 0 && !log.stream)
-		return;
-
-	err_msg = error ? g_strdup_printf("\n  ^-- %s", error->message) : g_strdup("");
-
-	time = g_date_time_new_now_local();
-	if (req_time)
+	if (log.writer)
 	{
-		GTimeSpan delta = g_date_time_difference(time, req_time);
-		delta_str = g_strdup_printf(" (%ld ms)", delta / 1000);
-	}
-	else
-		delta_str = g_strdup("");
-	time_str = g_date_time_format(time, "\%H:\%M:\%S.\%f");
-	time_str_len = strlen(time_str);
-	if (time_str_len > 3)
-		time_str[time_str_len-3] = '\0';
-	g_date_time_unref(time);
-
-	if (!method)
-		method = "";
-
-	switch (type)
-	{
-		case LspLogClientMessageSent:
-			title = "C --> S  req:  ";
-			break;
-		case LspLogClientMessageReceived:
-			title = "C <-- S  resp: ";
-			break;
-		case LspLogClientNotificationSent:
-			title = "C --> S  notif:";
-			break;
-		case LspLogServerMessageSent:
-			title = "C <-- S  req:  ";
-			break;
-		case LspLogServerMessageReceived:
-			title = "C --> S  resp: ";
-			break;
-		case LspLogServerNotificationSent:
-			title = "C <-- S  notif:";
-			break;
+		// only the method and error are logged without full logging
+		enqueue_message(log.writer, type, method, log.full ? params : NULL, error, delta);
+		return;
 	}
 
-	if (log.full)
-	{
-		if (!params)
-			json_msg = g_strdup("null");
-		else
-			json_msg = lsp_utils_json_pretty_print(params);
-
-		log_print(log, "\n\n\"[%s] %s %s%s\":\n%s,\n", time_str, title, method, delta_str, json_msg);
-		g_free(json_msg);
-	}
-	else
-		log_print(log, "[%s] %s %s%s%s\n", time_str, title, method, delta_str, err_msg);
+	if (log.type == 0 && !log.stream)
+		return;
 
-	g_free(time_str);
-	g_free(err_msg);
-	g_free(delta_str);
+	write_message(log, type, method, params, error ? error->message : NULL,
+		g_get_real_time(), delta);
 }
@@ -30,7 +30,10 @@ typedef enum
 
 	LspLogServerMessageSent,
 	LspLogServerMessageReceived,
-	LspLogServerNotificationSent
+	LspLogServerNotificationSent,
+
+	LspLogClientDocumentEvicted,
+	LspLogClientResponseDiscarded
 } LspLogType;
 
 
@@ -38,7 +41,7 @@ LspLogInfo lsp_log_start(LspServerConfig *config);
 void lsp_log_stop(LspLogInfo log);
 
 void lsp_log(LspLogInfo log, LspLogType type, const gchar *method, GVariant *params,
-	GError *error, GDateTime *req_time);
+	GError *error, gint64 req_time);
 
 
 #endif  /* LSP_LOG_H */
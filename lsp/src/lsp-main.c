@@ -23,6 +23,7 @@
 #include "lsp-server.h"
 #include "lsp-sync.h"
 #include "lsp-utils.h"
+#include "lsp-doc-state.h"
 #include "lsp-autocomplete.h"
 #include "lsp-diagnostics.h"
 #include "lsp-hover.h"
@@ -31,16 +32,29 @@
 #include "lsp-goto.h"
 #include "lsp-symbols.h"
 #include "lsp-goto-anywhere.h"
+#include "lsp-goto-panel.h"
 #include "lsp-format.h"
 #include "lsp-highlight.h"
 #include "lsp-rename.h"
 #include "lsp-command.h"
 #include "lsp-code-lens.h"
+#include "lsp-inlay-hints.h"
+#include "lsp-folding.h"
 #include "lsp-symbol.h"
 #include "lsp-extension.h"
 #include "lsp-workspace-folders.h"
 #include "lsp-symbol-tree.h"
+#include "lsp-hierarchy.h"
 #include "lsp-selection-range.h"
+#include "lsp-workspace-index.h"
+#include "lsp-file-index.h"
+#include "lsp-rpc.h"
+#include "lsp-save.h"
+#include "lsp-timing.h"
+#include "lsp-trace.h"
+#include "lsp-memory.h"
+#include "lsp-metrics.h"
+#include "lsp-disk-cache.h"
 
 #include <sys/time.h>
 #include <string.h>
@@ -63,6 +77,7 @@ gchar *project_configuration_file;
 
 static gint last_click_pos;
 static gboolean session_loaded;
+static GtkWidget *large_file_label;
 
 static gboolean geany_quitting = FALSE;
 
@@ -75,8 +90,6 @@ PLUGIN_SET_TRANSLATABLE_INFO(
 	VERSION,
 	"Jiri Techet <techet@gmail.com>")
 
-#define UPDATE_SOURCE_DOC_DATA "lsp_update_source"
-#define CODE_ACTIONS_PERFORMED "lsp_code_actions_performed"
 
 enum {
 	KB_GOTO_DEFINITION,
@@ -99,6 +112,11 @@ enum {
 	KB_HIGHLIGHT_OCCUR,
 	KB_HIGHLIGHT_CLEAR,
 
+	KB_SHOW_INCOMING_CALLS,
+	KB_SHOW_OUTGOING_CALLS,
+	KB_SHOW_SUPERTYPES,
+	KB_SHOW_SUBTYPES,
+
 	KB_EXPAND_SELECTION,
 	KB_SHRINK_SELECTION,
 
@@ -139,6 +157,11 @@ struct
 	GtkWidget *highlight_occur;
 	GtkWidget *highlight_clear;
 
+	GtkWidget *incoming_calls;
+	GtkWidget *outgoing_calls;
+	GtkWidget *supertypes;
+	GtkWidget *subtypes;
+
 	GtkWidget *rename_in_file;
 	GtkWidget *rename_in_project;
 	GtkWidget *format_code;
@@ -176,10 +199,6 @@ struct
 } project_dialog;
 
 
-static void on_save_finish(GeanyDocument *doc);
-static gboolean on_code_actions_received(GPtrArray *actions, gpointer user_data);
-
-
 static gboolean autocomplete_provided(GeanyDocument *doc, gpointer user_data)
 {
 	LspServer *srv = lsp_server_get(doc);
@@ -305,8 +324,9 @@ static void update_menu(GeanyDocument *doc)
 	gboolean selection_range_enable = srv && srv->config.selection_range_enable;
 	gboolean goto_references_enable = srv && srv->config.goto_references_enable;
 	gboolean goto_type_definition_enable = srv && srv->config.goto_type_definition_enable;
-	gboolean document_formatting_enable = srv && srv->config.document_formatting_enable;
-	gboolean range_formatting_enable = srv && srv->config.range_formatting_enable;
+	LspServer *format_srv = lsp_server_get_for_formatting(srv);
+	gboolean document_formatting_enable = format_srv && format_srv->config.document_formatting_enable;
+	gboolean range_formatting_enable = format_srv && format_srv->config.range_formatting_enable;
 	gboolean rename_enable = srv && srv->config.rename_enable;
 	gboolean highlighting_enable = srv && srv->config.highlighting_enable;
 	gboolean goto_declaration_enable = srv && srv->config.goto_declaration_enable;
@@ -315,6 +335,8 @@ static void update_menu(GeanyDocument *doc)
 	gboolean hover_popup_enable = srv && srv->config.hover_available;
 	gboolean code_action_enable = srv && (srv->config.code_action_enable || srv->config.code_lens_enable);
 	gboolean swap_header_source_enable = srv && srv->config.swap_header_source_enable;
+	gboolean call_hierarchy_enable = srv && srv->config.call_hierarchy_enable;
+	gboolean type_hierarchy_enable = srv && srv->config.type_hierarchy_enable;
 
 	if (!menu_items.parent_item)
 		return;
@@ -330,6 +352,11 @@ static void update_menu(GeanyDocument *doc)
 	gtk_widget_set_sensitive(menu_items.goto_ref, goto_references_enable);
 	gtk_widget_set_sensitive(menu_items.goto_impl, goto_implementation_enable);
 
+	gtk_widget_set_sensitive(menu_items.incoming_calls, call_hierarchy_enable);
+	gtk_widget_set_sensitive(menu_items.outgoing_calls, call_hierarchy_enable);
+	gtk_widget_set_sensitive(menu_items.supertypes, type_hierarchy_enable);
+	gtk_widget_set_sensitive(menu_items.subtypes, type_hierarchy_enable);
+
 	gtk_widget_set_sensitive(menu_items.rename_in_file, highlighting_enable);
 	gtk_widget_set_sensitive(menu_items.rename_in_project, rename_enable);
 	gtk_widget_set_sensitive(menu_items.format_code, document_formatting_enable || range_formatting_enable);
@@ -344,30 +371,176 @@ static void update_menu(GeanyDocument *doc)
 }
 
 
-static gboolean on_update_idle(gpointer data)
+static void update_large_file_label(GeanyDocument *doc)
 {
-	GeanyDocument *doc = data;
-	LspServer *srv;
+	LspServer *srv = doc ? lsp_server_get_if_running(doc) : NULL;
+	gboolean large = srv && lsp_server_is_large_file(srv, doc);
 
-	plugin_set_document_data(geany_plugin, doc, UPDATE_SOURCE_DOC_DATA, GUINT_TO_POINTER(0));
+	if (!large_file_label && !large)
+		return;
+
+	if (!large_file_label)
+	{
+		GtkWidget *geany_statusbar = ui_lookup_widget(geany_data->main_widgets->window, "statusbar");
+
+		large_file_label = gtk_label_new(_("large file"));
+		gtk_widget_set_tooltip_text(large_file_label,
+			_("Some LSP features are reduced because of the file size"));
+		gtk_box_pack_start(GTK_BOX(geany_statusbar), large_file_label, FALSE, FALSE, 4);
+	}
+
+	gtk_widget_set_visible(large_file_label, large);
+}
 
-	if (!DOC_VALID(doc))
-		return G_SOURCE_REMOVE;
+
+// requests sent by on_update_idle()
+static const gchar *update_methods[] = {
+	"textDocument/codeLens",
+	"textDocument/inlayHint",
+	"textDocument/diagnostic",
+	"textDocument/semanticTokens/full",
+	"textDocument/semanticTokens/full/delta",
+	"textDocument/semanticTokens/range",
+	"textDocument/documentSymbol",
+	"textDocument/foldingRange",
+	NULL
+};
+
+
+static void update_doc(GeanyDocument *doc)
+{
+	LspServer *srv;
+
+	lsp_doc_state_get(doc)->update_source = 0;
 
 	srv = lsp_server_get_if_running(doc);
 	if (!srv)
-		return G_SOURCE_REMOVE;
+		return;
+
+	// documents modified in the background (e.g. by workspace edits) are
+	// updated once they become visible in on_document_visible()
+	if (doc != document_get_current())
+		return;
 
 	lsp_code_lens_send_request(doc);
+	lsp_inlay_hints_send_request(doc);
+	lsp_folding_send_request(doc);
+	lsp_diagnostics_pull(doc);
 	if (symbol_highlight_provided(doc, NULL))
 		lsp_semtokens_send_request(doc);
-	if (srv->config.document_symbols_enable)
-		lsp_symbols_doc_request(doc, lsp_symbol_request_cb, doc);
+	// symbols of large files are requested only when needed
+	if (srv->config.document_symbols_enable && !lsp_server_is_large_file(srv, doc))
+		lsp_symbols_doc_request(doc, TRUE, lsp_symbol_request_cb, doc);
+
+	update_large_file_label(doc);
+}
+
+
+static gboolean on_update_idle(gpointer data)
+{
+	GeanyDocument *doc = data;
+	gint64 stall_time = lsp_timing_stall_start();
+
+	if (!DOC_VALID(doc))
+		return G_SOURCE_REMOVE;
+
+	update_doc(doc);
+	lsp_timing_stall_end("update timer", NULL, 0, stall_time);
 
 	return G_SOURCE_REMOVE;
 }
 
 
+static void schedule_update(LspServer *srv, GeanyDocument *doc)
+{
+	LspDocState *state = lsp_doc_state_get(doc);
+
+	if (state->update_source != 0)
+		g_source_remove(state->update_source);
+
+	// perform expensive queries only after some minimum delay
+	state->update_source = plugin_timeout_add(geany_plugin, lsp_rpc_get_debounce(srv, update_methods),
+		on_update_idle, doc);
+}
+
+
+static gboolean is_replacing_text(GeanyDocument *doc)
+{
+	return lsp_doc_state_get(doc)->reload_text != NULL;
+}
+
+
+/* Called after the whole text was replaced, typically on reload: a single
+ * full-text change is sent instead of deleting and inserting everything and
+ * nothing at all when the text didn't change. */
+static gboolean finish_text_replace(gpointer user_data)
+{
+	GeanyDocument *doc = user_data;
+	LspDocState *state;
+	gchar *old_text;
+	LspServer *srv;
+
+	if (!DOC_VALID(doc))
+		return G_SOURCE_REMOVE;
+
+	state = lsp_doc_state_get(doc);
+	old_text = state->reload_text;
+	if (!old_text)
+		return G_SOURCE_REMOVE;
+
+	srv = lsp_server_get(doc);
+	if (srv && !lsp_sync_is_document_open(srv, doc))
+	{
+		lsp_sync_text_document_did_open(srv, doc);
+		schedule_update(srv, doc);
+	}
+	else if (srv)
+	{
+		ScintillaObject *sci = doc->editor->sci;
+		const gchar *text = (const gchar *)SSM(sci, SCI_GETCHARACTERPOINTER, 0, 0);
+		gboolean unchanged = state->reload_text_len == sci_get_length(sci) &&
+			memcmp(old_text, text, state->reload_text_len) == 0;
+
+		// unless a request sent the text queued by start_text_replace() already
+		if (unchanged && lsp_sync_discard_pending_changes(srv, doc))
+			lsp_diagnostics_redraw(doc);  // only indicators were removed with the text
+		else
+		{
+			lsp_sync_text_document_did_change_full(srv, doc);
+			schedule_update(srv, doc);
+		}
+	}
+
+	state->reload_source = 0;
+	state->reload_text = NULL;
+	g_free(old_text);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Deletion of the whole text - remember it and suppress incremental changes
+ * until the replacement is finished on document reload or on idle. The full
+ * text is queued right away so requests sent in the meantime don't see the
+ * old one. */
+static void start_text_replace(LspServer *srv, GeanyDocument *doc)
+{
+	LspDocState *state = lsp_doc_state_get(doc);
+	ScintillaObject *sci = doc->editor->sci;
+
+	state->reload_text = sci_get_contents(sci, -1);
+	state->reload_text_len = sci_get_length(sci);
+	state->reload_source = plugin_timeout_add(geany_plugin, 0, finish_text_replace, doc);
+
+	if (lsp_sync_is_document_open(srv, doc))
+	{
+		// earlier edits go out now, the queued text may be dropped if unchanged
+		lsp_sync_flush_pending_changes(srv, doc);
+		lsp_sync_text_document_queue_full_change(srv, doc);
+	}
+}
+
+
 static void on_document_visible(GeanyDocument *doc)
 {
 	LspServer *srv = lsp_server_get(doc);
@@ -375,6 +548,7 @@ static void on_document_visible(GeanyDocument *doc)
 	session_loaded = TRUE;
 
 	update_menu(doc);
+	update_large_file_label(doc);
 
 	// quick synchronous refresh with the last value without server request
 	lsp_symbol_tree_refresh();
@@ -386,20 +560,23 @@ static void on_document_visible(GeanyDocument *doc)
 	lsp_diagnostics_redraw(doc);
 
 	if (!srv)
+	{
+		lsp_server_queue_until_initialized(doc, LSP_SERVER_QUEUED_DID_OPEN, 0);
 		return;
+	}
 
 	lsp_highlight_style_init(doc);
 	lsp_semtokens_style_init(doc);
 	lsp_code_lens_style_init(doc);
 
-	lsp_selection_clear_selections();
-
-	// just in case we didn't get some callback from the server
-	on_save_finish(doc);
+	// results of the previous session until the server sends new ones
+	lsp_semtokens_restore(doc);
+	lsp_symbols_doc_restore(doc);
 
 	// this might not get called for the first time when server gets started because
 	// lsp_server_get() returns NULL. However, we also "open" current and modified
 	// documents after successful server handshake inside on_server_initialized()
+	// and documents shown during initialization are queued
 	lsp_sync_text_document_did_open(srv, doc);
 
 	on_update_idle(doc);
@@ -409,7 +586,11 @@ static void on_document_visible(GeanyDocument *doc)
 static gboolean on_doc_close_idle(gpointer user_data)
 {
 	if (!document_get_current() && menu_items.parent_item)
-		update_menu(NULL);  // the last open document was closed
+	{
+		// the last open document was closed
+		update_menu(NULL);
+		update_large_file_label(NULL);
+	}
 
 	return G_SOURCE_REMOVE;
 }
@@ -421,10 +602,15 @@ static void on_document_close(G_GNUC_UNUSED GObject * obj, GeanyDocument *doc,
 	LspServer *srv = lsp_server_get_if_running(doc);
 
 	plugin_idle_add(geany_plugin, on_doc_close_idle, NULL);
+	lsp_hierarchy_doc_closed(doc);
+	lsp_goto_doc_closed(doc);
 
 	if (!srv)
 		return;
 
+	lsp_semtokens_persist(doc);
+	lsp_symbols_doc_persist(doc);
+
 	lsp_diagnostics_clear(srv, doc);
 	lsp_semtokens_clear(doc);
 	lsp_sync_text_document_did_close(srv, doc);
@@ -438,6 +624,7 @@ static void stop_and_init_all_servers(void)
 
 	lsp_server_init_all();
 	lsp_symbol_tree_init();
+	lsp_hierarchy_init();
 }
 
 
@@ -469,6 +656,17 @@ static void on_document_save(G_GNUC_UNUSED GObject *obj, GeanyDocument *doc,
 		return;
 	}
 
+	lsp_workspace_index_document_saved(doc);
+
+	if (doc->real_path)
+	{
+		gchar *dirname = g_path_get_dirname(doc->real_path);
+
+		// the saved file might be a new project root marker
+		lsp_utils_invalidate_project_root_cache(dirname);
+		g_free(dirname);
+	}
+
 	srv = lsp_server_get(doc);
 	if (!srv)
 		return;
@@ -484,117 +682,16 @@ static void on_document_save(G_GNUC_UNUSED GObject *obj, GeanyDocument *doc,
 }
 
 
-static gboolean code_action_was_performed(LspCommand *cmd, GeanyDocument *doc)
-{
-	GPtrArray *code_actions_performed = plugin_get_document_data(geany_plugin, doc, CODE_ACTIONS_PERFORMED);
-	gchar *name;
-	guint i;
-
-	if (!code_actions_performed)
-		return TRUE;
-
-	foreach_ptr_array(name, i, code_actions_performed)
-	{
-		if (g_strcmp0(cmd->title, name) == 0)
-			return TRUE;
-	}
-
-	return FALSE;
-}
-
-
-static void on_save_finish(GeanyDocument *doc)
-{
-	if (!DOC_VALID(doc))
-		return;
-
-	if (plugin_get_document_data(geany_plugin, doc, CODE_ACTIONS_PERFORMED))
-	{
-		// save file at the end because the intermediate updates modified the file
-		document_save_file(doc, FALSE);
-		plugin_set_document_data(geany_plugin, doc, CODE_ACTIONS_PERFORMED, NULL);
-	}
-}
-
-
-static void on_command_performed(GeanyDocument *doc)
-{
-	if (DOC_VALID(doc))
-	{
-		// re-request code actions on the now modified document
-		lsp_command_send_code_action_request(doc, sci_get_current_position(doc->editor->sci),
-			on_code_actions_received, doc);
-	}
-}
-
-
-static gboolean on_code_actions_received(GPtrArray *actions, gpointer user_data)
-{
-	GeanyDocument *doc = user_data;
-	LspCommand *cmd;
-	LspServer *srv;
-	guint i;
-
-	if (!DOC_VALID(doc))
-		return TRUE;
-
-	srv = lsp_server_get_if_running(doc);
-
-	if (!srv)
-		return TRUE;
-
-	foreach_ptr_array(cmd, i, actions)
-	{
-		if (!code_action_was_performed(cmd, doc) &&
-			g_regex_match_simple(srv->config.command_on_save_regex, cmd->title, G_REGEX_CASELESS, G_REGEX_MATCH_NOTEMPTY))
-		{
-			GPtrArray *code_actions_performed = plugin_get_document_data(geany_plugin, doc, CODE_ACTIONS_PERFORMED);
-
-			// save the performed title so it isn't performed in the next iteration
-			g_ptr_array_add(code_actions_performed, g_strdup(cmd->title));
-			// perform the code action and re-request code actions in its
-			// callback
-			lsp_command_perform(srv, cmd, (LspCallback)on_command_performed, doc);
-			// this isn't the final call - return now
-			return TRUE;
-		}
-	}
-
-	// we get here only when nothing can be performed above - this is the last
-	// code action call
-	if (srv->config.document_formatting_enable && srv->config.format_on_save)
-		lsp_format_perform(doc, TRUE, (LspCallback)on_save_finish, doc);
-	else
-		on_save_finish(doc);
-
-	return TRUE;
-}
-
-
-static void free_ptrarray(gpointer data)
-{
-	g_ptr_array_free((GPtrArray *)data, TRUE);
-}
-
-
 static void on_document_before_save(G_GNUC_UNUSED GObject *obj, GeanyDocument *doc,
 	G_GNUC_UNUSED gpointer user_data)
 {
-	GPtrArray *code_actions_performed = plugin_get_document_data(geany_plugin, doc, CODE_ACTIONS_PERFORMED);
 	LspServer *srv = lsp_server_get(doc);
 
-	// code_actions_performed non-NULL when performing save and applying code actions
-	if (!srv || code_actions_performed)
+	// the pipeline saves the document itself once finished
+	if (!srv || lsp_save_in_progress(doc))
 		return;
 
-	code_actions_performed = g_ptr_array_new_full(1, g_free);
-	plugin_set_document_data_full(geany_plugin, doc, CODE_ACTIONS_PERFORMED, code_actions_performed, free_ptrarray);
-
-	if (srv->config.code_action_enable && !EMPTY(srv->config.command_on_save_regex))
-		lsp_command_send_code_action_request(doc, sci_get_current_position(doc->editor->sci),
-			on_code_actions_received, doc);
-	else if (srv->config.document_formatting_enable && srv->config.format_on_save)
-		lsp_format_perform(doc, TRUE, (LspCallback)on_save_finish, doc);
+	lsp_save_perform(srv, doc);
 }
 
 
@@ -645,8 +742,15 @@ static void on_document_filetype_set(G_GNUC_UNUSED GObject *obj, GeanyDocument *
 static void on_document_reload(G_GNUC_UNUSED GObject *obj, GeanyDocument *doc,
 	G_GNUC_UNUSED gpointer user_data)
 {
-	// do nothing - reload behaves like a normal edit where the original text is
-	// removed from Scintilla and the new one inserted
+	LspDocState *state = lsp_doc_state_get(doc);
+
+	// reload removes the original text from Scintilla and inserts the new one
+	if (state->reload_source != 0)
+	{
+		g_source_remove(state->reload_source);
+		state->reload_source = 0;
+		finish_text_replace(doc);
+	}
 }
 
 
@@ -657,16 +761,12 @@ static void on_document_activate(G_GNUC_UNUSED GObject *obj, GeanyDocument *doc,
 }
 
 
-static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor, SCNotification *nt,
-	G_GNUC_UNUSED gpointer user_data)
+static gboolean handle_editor_notify(GeanyEditor *editor, SCNotification *nt)
 {
 	static gboolean perform_highlight = TRUE;  // static!
 	GeanyDocument *doc = editor->document;
 	ScintillaObject *sci = editor->sci;
 
-	if (nt->nmhdr.code == SCN_PAINTED)  // e.g. caret blinking
-		return FALSE;
-
 	if (nt->nmhdr.code == SCN_AUTOCSELECTION &&
 		plugin_extension_autocomplete_provided(doc, &extension))
 	{
@@ -762,6 +862,16 @@ static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor
 		if (!(nt->modificationType & (SC_MOD_BEFOREINSERT | SC_MOD_INSERTTEXT | SC_MOD_BEFOREDELETE | SC_MOD_DELETETEXT)))
 			return FALSE;
 
+		// before anything converts positions on the modified line
+		if (nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT))
+		{
+			lsp_utils_invalidate_line_index(sci, sci_get_line_from_position(sci, nt->position),
+				nt->linesAdded);
+			lsp_semtokens_text_modified(doc, nt->position, nt->length,
+				(nt->modificationType & SC_MOD_INSERTTEXT) != 0);
+			lsp_code_lens_text_modified(doc, nt->linesAdded);
+		}
+
 		srv = lsp_server_get(doc);
 
 		if (!srv || !doc->real_path)
@@ -773,65 +883,64 @@ static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor
 			lsp_highlight_clear(doc);
 		}
 
-		// BEFORE insert, BEFORE delete - send the original document
-		if (!lsp_sync_is_document_open(srv, doc) &&
-			nt->modificationType & (SC_MOD_BEFOREINSERT | SC_MOD_BEFOREDELETE))
+		if ((nt->modificationType & SC_MOD_BEFOREDELETE) && nt->position == 0 &&
+			nt->length == sci_get_length(sci) && !is_replacing_text(doc))
 		{
-			// might happen when the server just started and no interaction with it was
-			// possible before
-			lsp_sync_text_document_did_open(srv, doc);
+			start_text_replace(srv, doc);
 		}
 
-		if (nt->modificationType & SC_MOD_INSERTTEXT)  // after insert
+		// batched edits are sent by lsp_utils_apply_text_edits() once applied,
+		// replaced whole text by finish_text_replace()
+		if (!lsp_utils_is_applying_edits(sci) && !is_replacing_text(doc))
 		{
-			LspPosition pos_start = lsp_utils_scintilla_pos_to_lsp(sci, nt->position);
-			LspPosition pos_end = pos_start;
-			gchar *text;
+			// BEFORE insert, BEFORE delete - send the original document
+			if (!lsp_sync_is_document_open(srv, doc) &&
+				nt->modificationType & (SC_MOD_BEFOREINSERT | SC_MOD_BEFOREDELETE))
+			{
+				// might happen when the server just started and no interaction with it was
+				// possible before
+				lsp_sync_text_document_did_open(srv, doc);
+			}
 
-			if (srv->use_incremental_sync)
+			if (!srv->use_incremental_sync)
+			{
+				// full document sync - the text is retrieved only once the
+				// pending change gets sent
+				if (nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT))
+					lsp_sync_text_document_mark_changed(srv, doc);
+			}
+			else if (nt->modificationType & SC_MOD_INSERTTEXT)  // after insert
 			{
+				LspPosition pos_start = lsp_utils_scintilla_pos_to_lsp(sci, nt->position);
+				LspPosition pos_end = pos_start;
+				gchar *text;
+
 				text = g_malloc(nt->length + 1);
 				memcpy(text, nt->text, nt->length);
 				text[nt->length] = '\0';
-			}
-			else
-				text = sci_get_contents(doc->editor->sci, -1);
-
-			lsp_sync_text_document_did_change(srv, doc, pos_start, pos_end, text);
 
-			g_free(text);
-		}
-		else if (srv->use_incremental_sync &&(nt->modificationType & SC_MOD_BEFOREDELETE))
-		{
-			// BEFORE! delete for incremental sync
-			LspPosition pos_start = lsp_utils_scintilla_pos_to_lsp(sci, nt->position);
-			LspPosition pos_end = lsp_utils_scintilla_pos_to_lsp(sci, nt->position + nt->length);
-			gchar *text = g_strdup("");
+				lsp_sync_text_document_did_change(srv, doc, pos_start, pos_end, 0, text);
 
-			lsp_sync_text_document_did_change(srv, doc, pos_start, pos_end, text);
-			g_free(text);
-		}
-		else if (!srv->use_incremental_sync &&(nt->modificationType & SC_MOD_DELETETEXT))
-		{
-			// AFTER! delete for full document sync
-			LspPosition dummy_start = lsp_utils_scintilla_pos_to_lsp(sci, 0);
-			LspPosition dummy_end = lsp_utils_scintilla_pos_to_lsp(sci, 0);
-			gchar *text = sci_get_contents(doc->editor->sci, -1);
+				g_free(text);
+			}
+			else if (nt->modificationType & SC_MOD_BEFOREDELETE)
+			{
+				// BEFORE! delete for incremental sync
+				LspPosition pos_start = lsp_utils_scintilla_pos_to_lsp(sci, nt->position);
+				LspPosition pos_end = lsp_utils_scintilla_pos_to_lsp(sci, nt->position + nt->length);
 
-			lsp_sync_text_document_did_change(srv, doc, dummy_start, dummy_end, text);
-			g_free(text);
+				lsp_sync_text_document_did_change(srv, doc, pos_start, pos_end, nt->length, "");
+			}
 		}
 
-		if (nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT))
+		if ((nt->modificationType & (SC_MOD_INSERTTEXT | SC_MOD_DELETETEXT)) && !is_replacing_text(doc))
 		{
-			guint update_source = GPOINTER_TO_UINT(plugin_get_document_data(geany_plugin, doc, UPDATE_SOURCE_DOC_DATA));
-
-			if (update_source != 0)
-				g_source_remove(update_source);
-
-			// perform expensive queries only after some minimum delay
-			update_source = plugin_timeout_add(geany_plugin, 300, on_update_idle, doc);
-			plugin_set_document_data(geany_plugin, doc, UPDATE_SOURCE_DOC_DATA, GUINT_TO_POINTER(update_source));
+			if (!lsp_utils_is_applying_workspace_edit())
+				schedule_update(srv, doc);
+			// workspace edits get a single update of the visible document, the
+			// remaining ones are updated in on_document_visible()
+			else if (doc == document_get_current() && lsp_doc_state_get(doc)->update_source == 0)
+				schedule_update(srv, doc);
 		}
 	}
 	else if (nt->nmhdr.code == SCN_UPDATEUI)
@@ -843,9 +952,14 @@ static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor
 			lsp_diagnostics_hide_calltip(doc);
 
 			SSM(sci, SCI_AUTOCCANCEL, 0, 0);
+		}
 
-			if ((nt->updated & SC_UPDATE_SELECTION) && !sci_has_selection(sci))
-				lsp_selection_clear_selections();
+		if (nt->updated & SC_UPDATE_V_SCROLL)
+		{
+			lsp_semtokens_viewport_changed(doc);
+			lsp_diagnostics_scrolled(doc);
+			lsp_code_lens_viewport_changed(doc);
+			lsp_inlay_hints_viewport_changed(doc);
 		}
 
 		if (perform_highlight && (nt->updated & SC_UPDATE_SELECTION))
@@ -853,6 +967,14 @@ static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor
 			LspServer *srv = lsp_server_get_if_running(doc);
 			if (srv && srv->config.highlighting_enable)
 				lsp_highlight_schedule_request(doc);
+			if (srv && srv->config.hover_enable)
+				lsp_hover_schedule_prefetch(doc);
+			if (srv && srv->config.code_action_enable)
+				lsp_command_schedule_code_action_prefetch(doc);
+			if (srv && srv->config.goto_prefetch_enable)
+				lsp_goto_schedule_prefetch(doc);
+			if (srv && srv->config.autocomplete_prefetch_enable)
+				lsp_autocomplete_schedule_prefetch(doc);
 		}
 
 		if (nt->updated & SC_UPDATE_SELECTION)
@@ -870,6 +992,24 @@ static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor
 }
 
 
+static gboolean on_editor_notify(G_GNUC_UNUSED GObject *obj, GeanyEditor *editor, SCNotification *nt,
+	G_GNUC_UNUSED gpointer user_data)
+{
+	gint64 stall_time;
+	gboolean ret;
+
+	if (nt->nmhdr.code == SCN_PAINTED)  // e.g. caret blinking
+		return FALSE;
+
+	stall_time = lsp_timing_stall_start();
+	ret = handle_editor_notify(editor, nt);
+	lsp_timing_stall_end("editor notification", NULL,
+		nt->nmhdr.code == SCN_MODIFIED ? (gsize)nt->length : 0, stall_time);
+
+	return ret;
+}
+
+
 static void on_project_open(G_GNUC_UNUSED GObject *obj, GKeyFile *kf,
 	G_GNUC_UNUSED gpointer user_data)
 {
@@ -884,11 +1024,20 @@ static void on_project_open(G_GNUC_UNUSED GObject *obj, GKeyFile *kf,
 	gtk_widget_set_sensitive(menu_items.user_config, !have_project_config);
 
 	stop_and_init_all_servers();
+	lsp_server_prestart_all();
+
+	lsp_workspace_index_load();
+	lsp_diagnostics_snapshot_load();
+	lsp_file_index_load();
 }
 
 
 static void on_project_close(G_GNUC_UNUSED GObject *obj, G_GNUC_UNUSED gpointer user_data)
 {
+	lsp_workspace_index_unload();
+	lsp_diagnostics_snapshot_unload();
+	lsp_file_index_unload();
+
 	project_configuration = UnconfiguredConfiguration;
 	project_configuration_type = UserConfigurationType;
 	g_free(project_configuration_file);
@@ -1154,8 +1303,9 @@ static gboolean on_update_editor_menu(G_GNUC_UNUSED GObject *obj,
 	gboolean goto_definition_enable = srv && srv->config.goto_definition_enable;
 	gboolean goto_references_enable = srv && srv->config.goto_references_enable;
 	gboolean code_action_enable = srv && srv->config.code_action_enable;
-	gboolean document_formatting_enable = srv && srv->config.document_formatting_enable;
-	gboolean range_formatting_enable = srv && srv->config.range_formatting_enable;
+	LspServer *format_srv = lsp_server_get_for_formatting(srv);
+	gboolean document_formatting_enable = format_srv && format_srv->config.document_formatting_enable;
+	gboolean range_formatting_enable = format_srv && format_srv->config.range_formatting_enable;
 	gboolean rename_enable = srv && srv->config.rename_enable;
 	gboolean highlighting_enable = srv && srv->config.highlighting_enable;
 
@@ -1214,13 +1364,23 @@ static void terminate_all(void)
 	lsp_server_set_initialized_cb(NULL);
 
 	lsp_server_stop_all(TRUE);
+	lsp_server_free_caches();
 }
 
 
 static void on_geany_before_quit(G_GNUC_UNUSED GObject *obj, G_GNUC_UNUSED gpointer user_data)
 {
+	guint i;
+
 	geany_quitting = TRUE;
 
+	// documents aren't closed with running servers during quit
+	foreach_document(i)
+	{
+		lsp_semtokens_persist(documents[i]);
+		lsp_symbols_doc_persist(documents[i]);
+	}
+
 	terminate_all();  // blocks until all servers are stopped
 }
 
@@ -1281,6 +1441,14 @@ static void on_show_initialize_responses(void)
 }
 
 
+static void on_show_server_statistics(void)
+{
+	gchar *stats = lsp_server_get_statistics();
+	document_new_file(NULL, NULL, stats);
+	g_free(stats);
+}
+
+
 static void show_hover_popup(void)
 {
 	GeanyDocument *doc = document_get_current();
@@ -1363,6 +1531,28 @@ static void invoke_command_kb(guint key_id, gint pos)
 }
 
 
+/* Whether the keybinding sends a request to the server, as opposed to working
+ * with data already received from it */
+static gboolean kb_uses_server(guint key_id)
+{
+	switch (key_id)
+	{
+		case KB_GOTO_LINE:
+		case KB_GOTO_NEXT_DIAG:
+		case KB_GOTO_PREV_DIAG:
+		case KB_SHOW_DIAG:
+		case KB_SHOW_FILE_DIAGS:
+		case KB_SHOW_ALL_DIAGS:
+		case KB_HIGHLIGHT_CLEAR:
+		case KB_SHRINK_SELECTION:
+		case KB_RESTART_SERVERS:
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
 static void invoke_kb(guint key_id, gint pos)
 {
 	GeanyDocument *doc = document_get_current();
@@ -1370,6 +1560,13 @@ static void invoke_kb(guint key_id, gint pos)
 	if (pos < 0)
 		pos = doc ? sci_get_current_position(doc->editor->sci) : 0;
 
+	// performed by on_server_initialized() when the server is starting
+	if (doc && kb_uses_server(key_id) && !lsp_server_get(doc) &&
+		lsp_server_queue_until_initialized(doc, key_id, pos))
+	{
+		return;
+	}
+
 	if (key_id >= KB_COUNT)
 	{
 		invoke_command_kb(key_id , pos);
@@ -1430,6 +1627,19 @@ static void invoke_kb(guint key_id, gint pos)
 			lsp_highlight_clear(doc);
 			break;
 
+		case KB_SHOW_INCOMING_CALLS:
+			lsp_hierarchy_show(pos, LSP_HIERARCHY_INCOMING_CALLS);
+			break;
+		case KB_SHOW_OUTGOING_CALLS:
+			lsp_hierarchy_show(pos, LSP_HIERARCHY_OUTGOING_CALLS);
+			break;
+		case KB_SHOW_SUPERTYPES:
+			lsp_hierarchy_show(pos, LSP_HIERARCHY_SUPERTYPES);
+			break;
+		case KB_SHOW_SUBTYPES:
+			lsp_hierarchy_show(pos, LSP_HIERARCHY_SUBTYPES);
+			break;
+
 		case KB_EXPAND_SELECTION:
 			lsp_selection_range_expand();
 			break;
@@ -1627,6 +1837,36 @@ static void create_menu_items()
 
 	gtk_container_add(GTK_CONTAINER(menu), gtk_separator_menu_item_new());
 
+	menu_items.incoming_calls = gtk_menu_item_new_with_mnemonic(_("Show _Incoming Calls"));
+	gtk_container_add(GTK_CONTAINER(menu), menu_items.incoming_calls);
+	g_signal_connect(menu_items.incoming_calls, "activate", G_CALLBACK(on_menu_invoked),
+		GUINT_TO_POINTER(KB_SHOW_INCOMING_CALLS));
+	keybindings_set_item(group, KB_SHOW_INCOMING_CALLS, NULL, 0, 0, "show_incoming_calls",
+		_("Show incoming calls"), menu_items.incoming_calls);
+
+	menu_items.outgoing_calls = gtk_menu_item_new_with_mnemonic(_("Show _Outgoing Calls"));
+	gtk_container_add(GTK_CONTAINER(menu), menu_items.outgoing_calls);
+	g_signal_connect(menu_items.outgoing_calls, "activate", G_CALLBACK(on_menu_invoked),
+		GUINT_TO_POINTER(KB_SHOW_OUTGOING_CALLS));
+	keybindings_set_item(group, KB_SHOW_OUTGOING_CALLS, NULL, 0, 0, "show_outgoing_calls",
+		_("Show outgoing calls"), menu_items.outgoing_calls);
+
+	menu_items.supertypes = gtk_menu_item_new_with_mnemonic(_("Show _Supertypes"));
+	gtk_container_add(GTK_CONTAINER(menu), menu_items.supertypes);
+	g_signal_connect(menu_items.supertypes, "activate", G_CALLBACK(on_menu_invoked),
+		GUINT_TO_POINTER(KB_SHOW_SUPERTYPES));
+	keybindings_set_item(group, KB_SHOW_SUPERTYPES, NULL, 0, 0, "show_supertypes",
+		_("Show supertypes"), menu_items.supertypes);
+
+	menu_items.subtypes = gtk_menu_item_new_with_mnemonic(_("Show Su_btypes"));
+	gtk_container_add(GTK_CONTAINER(menu), menu_items.subtypes);
+	g_signal_connect(menu_items.subtypes, "activate", G_CALLBACK(on_menu_invoked),
+		GUINT_TO_POINTER(KB_SHOW_SUBTYPES));
+	keybindings_set_item(group, KB_SHOW_SUBTYPES, NULL, 0, 0, "show_subtypes",
+		_("Show subtypes"), menu_items.subtypes);
+
+	gtk_container_add(GTK_CONTAINER(menu), gtk_separator_menu_item_new());
+
 	menu_items.rename_in_file = gtk_menu_item_new_with_mnemonic(_("_Rename Highlighted"));
 	gtk_container_add(GTK_CONTAINER(menu), menu_items.rename_in_file);
 	g_signal_connect(menu_items.rename_in_file, "activate", G_CALLBACK(on_menu_invoked),
@@ -1709,6 +1949,10 @@ static void create_menu_items()
 	gtk_container_add(GTK_CONTAINER(menu), item);
 	g_signal_connect(item, "activate", G_CALLBACK(on_show_initialize_responses), NULL);
 
+	item = gtk_menu_item_new_with_mnemonic(_("Server _Statistics"));
+	gtk_container_add(GTK_CONTAINER(menu), item);
+	g_signal_connect(item, "activate", G_CALLBACK(on_show_server_statistics), NULL);
+
 	gtk_container_add(GTK_CONTAINER(menu), gtk_separator_menu_item_new());
 
 	item = gtk_menu_item_new_with_mnemonic(_("_Restart All Servers"));
@@ -1780,6 +2024,66 @@ static void create_menu_items()
 }
 
 
+/* For servers started on project open, all open documents are sent to the
+ * server so it can index them - the current document first (handled by
+ * the caller), then the rest in the order of the tabs */
+static void open_prestarted_server_documents(LspServer *srv, GeanyDocument *current_doc)
+{
+	GtkNotebook *notebook = GTK_NOTEBOOK(geany_data->main_widgets->notebook);
+	gint max_count = srv->config.open_docs_max_count;
+	gint page_num = gtk_notebook_get_n_pages(notebook);
+	gint opened = 0;
+	gint i;
+
+	// without eviction of the current document by the residency limit
+	if (current_doc && lsp_server_get_if_running(current_doc) == srv)
+		opened++;
+
+	for (i = 0; i < page_num && (max_count <= 0 || opened < max_count); i++)
+	{
+		GeanyDocument *doc = document_get_from_page(i);
+
+		if (doc && doc != current_doc && lsp_server_get_if_running(doc) == srv)
+		{
+			lsp_sync_text_document_did_open(srv, doc);
+			opened++;
+		}
+	}
+}
+
+
+/* Replays what the user did while the server was initializing, in the
+ * original order. Keybinding actions are only performed when their document
+ * is still the current one. */
+static void replay_queued_actions(LspServer *srv, GeanyDocument *current_doc)
+{
+	GQueue *queue = srv->init_queue;
+	LspServerQueuedAction *action;
+
+	if (!queue)
+		return;
+
+	srv->init_queue = NULL;
+
+	while ((action = g_queue_pop_head(queue)))
+	{
+		GeanyDocument *doc = document_find_by_id(action->doc_id);
+
+		if (doc && lsp_server_get_if_running(doc) == srv)
+		{
+			if (action->action == LSP_SERVER_QUEUED_DID_OPEN)
+				lsp_sync_text_document_did_open(srv, doc);
+			else if (doc == current_doc)
+				invoke_kb(action->action, action->pos);
+		}
+
+		g_free(action);
+	}
+
+	g_queue_free(queue);
+}
+
+
 static void on_server_initialized(LspServer *srv)
 {
 	GeanyDocument *current_doc = document_get_current();
@@ -1801,6 +2105,11 @@ static void on_server_initialized(LspServer *srv)
 				lsp_sync_text_document_did_open(srv, doc);
 		}
 	}
+
+	if (srv->prestarted)
+		open_prestarted_server_documents(srv, current_doc);
+
+	replay_queued_actions(srv, current_doc);
 }
 
 
@@ -1818,6 +2127,10 @@ void plugin_init(G_GNUC_UNUSED GeanyData * data)
 
 	create_menu_items();
 
+	lsp_workspace_index_load();
+	lsp_diagnostics_snapshot_load();
+	lsp_file_index_load();
+
 	if (doc)
 		on_document_visible(doc);
 }
@@ -1840,8 +2153,23 @@ void plugin_cleanup(void)
 	gtk_widget_destroy(context_menu_items.separator1);
 	gtk_widget_destroy(context_menu_items.separator2);
 
+	if (large_file_label)
+		gtk_widget_destroy(large_file_label);
+	large_file_label = NULL;
+
 	lsp_symbol_tree_destroy();
+	lsp_hierarchy_destroy();
+	lsp_goto_destroy();
+	lsp_goto_anywhere_destroy();
+	lsp_goto_panel_destroy();
 	lsp_diagnostics_common_destroy();
+	lsp_workspace_index_unload();
+	lsp_diagnostics_snapshot_unload();
+	lsp_file_index_unload();
+	lsp_trace_stop();
+	lsp_memory_stop();
+	lsp_metrics_stop();
+	lsp_disk_cache_wait();
 }
 
 
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Releases the plugin's caches when the system reports low memory or when
+ * their approximate size exceeds memory_cache_max_size. Caches which are the
+ * cheapest to re-create are released first: symbol trees and semantic tokens
+ * of hidden documents, diagnostics of files which aren't open and the
+ * completion list. Under critical memory pressure the least recently used
+ * documents can also be closed on the servers so they free their ASTs. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-memory.h"
+#include "lsp-server.h"
+#include "lsp-sync.h"
+#include "lsp-semtokens.h"
+#include "lsp-symbols.h"
+#include "lsp-symbol-tree.h"
+#include "lsp-diagnostics.h"
+#include "lsp-code-lens.h"
+#include "lsp-autocomplete.h"
+
+#include <geanyplugin.h>
+
+
+#define CACHE_CHECK_INTERVAL 60000
+
+
+typedef enum
+{
+	RECLAIM_HIDDEN_DOCS,
+	RECLAIM_UNOPENED_DIAGS,
+	RECLAIM_COMPLETION,
+	RECLAIM_SERVER_DOCS
+} ReclaimStep;
+
+
+extern GeanyPlugin *geany_plugin;
+
+static gsize max_size;  // bytes, 0 when unlimited
+static gboolean close_server_docs;
+static guint check_source;
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static GMemoryMonitor *monitor;
+#endif
+
+
+static gsize get_cache_size(GPtrArray *servers)
+{
+	LspServer *srv;
+	gsize size = 0;
+	guint i;
+
+	foreach_document(i)
+	{
+		GeanyDocument *doc = documents[i];
+
+		if (!lsp_server_get_if_running(doc))
+			continue;
+
+		size += lsp_semtokens_get_cache_size(doc) + lsp_symbols_get_cache_size(doc) +
+			lsp_symbol_tree_get_cache_size(doc) + lsp_code_lens_get_cache_size(doc);
+	}
+
+	// includes the diagnostics of open documents
+	foreach_ptr_array(srv, i, servers)
+		size += lsp_diagnostics_get_cache_size(srv, NULL);
+
+	return size;
+}
+
+
+static void reclaim(GPtrArray *servers, ReclaimStep step)
+{
+	GeanyDocument *current_doc = document_get_current();
+	LspServer *srv;
+	guint i;
+
+	switch (step)
+	{
+		case RECLAIM_HIDDEN_DOCS:
+			foreach_document(i)
+			{
+				GeanyDocument *doc = documents[i];
+
+				// re-created from the cached symbols and a new token request
+				// once the document is shown again
+				if (doc != current_doc && lsp_server_get_if_running(doc))
+				{
+					lsp_symbol_tree_drop_cache(doc);
+					lsp_semtokens_destroy(doc);
+				}
+			}
+			break;
+		case RECLAIM_UNOPENED_DIAGS:
+			foreach_ptr_array(srv, i, servers)
+				lsp_diagnostics_drop_unopened(srv);
+			break;
+		case RECLAIM_COMPLETION:
+			lsp_autocomplete_drop_cache();
+			break;
+		case RECLAIM_SERVER_DOCS:
+			if (close_server_docs)
+			{
+				foreach_ptr_array(srv, i, servers)
+					lsp_sync_close_lru_documents(srv, "memory pressure");
+			}
+			break;
+	}
+}
+
+
+/* Runs the steps up to last_step in priority order; with limit > 0 it stops
+ * as soon as the caches fit into it */
+static void reclaim_up_to(ReclaimStep last_step, gsize limit, const gchar *reason)
+{
+	GPtrArray *servers = lsp_server_get_all_running();
+	gsize orig_size, size;
+	ReclaimStep step;
+
+	orig_size = size = get_cache_size(servers);
+
+	for (step = RECLAIM_HIDDEN_DOCS; step <= last_step; step++)
+	{
+		if (limit > 0 && size <= limit)
+			break;
+		reclaim(servers, step);
+		size = get_cache_size(servers);
+	}
+
+	if (size < orig_size)
+		msgwin_status_add(_("LSP: released %.1f MB of cached data (%s)"),
+			(orig_size - size) / (1024.0 * 1024.0), reason);
+
+	g_ptr_array_free(servers, TRUE);
+}
+
+
+static gboolean check_cache_size(G_GNUC_UNUSED gpointer user_data)
+{
+	reclaim_up_to(RECLAIM_COMPLETION, max_size, "memory_cache_max_size exceeded");
+	return G_SOURCE_CONTINUE;
+}
+
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static void on_low_memory_warning(G_GNUC_UNUSED GMemoryMonitor *mon,
+	GMemoryMonitorWarningLevel level, G_GNUC_UNUSED gpointer user_data)
+{
+	if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL)
+		reclaim_up_to(RECLAIM_SERVER_DOCS, 0, "critical memory pressure");
+	else if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM)
+		reclaim_up_to(RECLAIM_COMPLETION, 0, "memory pressure");
+	else
+		reclaim_up_to(RECLAIM_HIDDEN_DOCS, 0, "low memory");
+}
+#endif
+
+
+/* max_cache_size in kilobytes, 0 disables the limit */
+void lsp_memory_set_limits(gint max_cache_size, gboolean close_docs)
+{
+	max_size = MAX(max_cache_size, 0) * (gsize)1024;
+	close_server_docs = close_docs;
+
+	if (max_size > 0 && check_source == 0)
+		check_source = plugin_timeout_add(geany_plugin, CACHE_CHECK_INTERVAL, check_cache_size, NULL);
+	else if (max_size == 0 && check_source != 0)
+	{
+		g_source_remove(check_source);
+		check_source = 0;
+	}
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+	if (!monitor)
+	{
+		monitor = g_memory_monitor_dup_default();
+		g_signal_connect(monitor, "low-memory-warning", G_CALLBACK(on_low_memory_warning), NULL);
+	}
+#endif
+}
+
+
+void lsp_memory_stop(void)
+{
+	if (check_source != 0)
+		g_source_remove(check_source);
+	check_source = 0;
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+	if (monitor)
+	{
+		g_signal_handlers_disconnect_by_func(monitor, on_low_memory_warning, NULL);
+		g_object_unref(monitor);
+	}
+	monitor = NULL;
+#endif
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Periodic dump of the statistics in a machine-readable form. Every dump
+ * appends one JSON object per line for each running server:
+ *
+ *   {"time": <real time in µs>, "type": "server", "server": "clangd",
+ *    "filetype": "C", "root": "...", "rss_bytes": <int>, "cpu_time": <s>,
+ *    "resident_docs": <int>, "resident_docs_bytes": <int>,
+ *    "plugin_cache_bytes": <int>, "requests_in_flight": <int>,
+ *    "background_queued": <int>, "background_in_flight": <int>,
+ *    "pending_output_bytes": <int>,
+ *    "methods": {"<method>": {"count", "errors", "cancelled", "bytes_out",
+ *                             "bytes_in", "p50", "p90", "p99"}, ...}}
+ *
+ * followed by one for the plugin itself:
+ *
+ *   {"time": ..., "type": "plugin",
+ *    "operations": {"<operation> (<size>)": {"count", "p50", "p90", "p99"}},
+ *    "caches": {"<cache>": {"hits", "misses"}},
+ *    "stalls": {"<handler>": {"count", "max", "max_payload_bytes"}}}
+ *
+ * Counters are cumulative since the server (or the plugin) started, latencies
+ * are in milliseconds. "root", "rss_bytes" and "cpu_time" are present only
+ * when known. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-metrics.h"
+#include "lsp-server.h"
+
+#include <geanyplugin.h>
+#include <string.h>
+
+
+extern GeanyPlugin *geany_plugin;
+
+static GOutputStream *metrics_stream;
+static gchar *metrics_path;
+static gint metrics_interval;
+static guint metrics_source;
+
+
+static gboolean write_metrics(G_GNUC_UNUSED gpointer user_data)
+{
+	gchar *lines = lsp_server_get_metrics();
+
+	g_output_stream_write_all(metrics_stream, lines, strlen(lines), NULL, NULL, NULL);
+	g_output_stream_flush(metrics_stream, NULL, NULL);
+	g_free(lines);
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/* Appends the metrics to path every interval seconds, stops when path is
+ * empty */
+void lsp_metrics_start(const gchar *path, gint interval)
+{
+	GFileOutputStream *file_stream;
+	GFile *fp;
+
+	if (EMPTY(path))
+		path = NULL;
+	interval = interval > 0 ? interval : 60;
+
+	if (g_strcmp0(path, metrics_path) == 0 && (!path || interval == metrics_interval))
+		return;
+
+	lsp_metrics_stop();
+
+	if (!path)
+		return;
+
+	fp = g_file_new_for_path(path);
+	// appended so the file can collect several sessions
+	file_stream = g_file_append_to(fp, G_FILE_CREATE_NONE, NULL, NULL);
+	if (file_stream)
+	{
+		metrics_stream = G_OUTPUT_STREAM(file_stream);
+		metrics_path = g_strdup(path);
+		metrics_interval = interval;
+		metrics_source = plugin_timeout_add_seconds(geany_plugin, interval, write_metrics, NULL);
+	}
+	else
+		msgwin_status_add(_("Failed to create metrics file: %s"), path);
+
+	g_object_unref(fp);
+}
+
+
+void lsp_metrics_stop(void)
+{
+	if (!metrics_stream)
+		return;
+
+	// the last state of the session
+	write_metrics(NULL);
+
+	if (metrics_source != 0)
+		g_source_remove(metrics_source);
+	metrics_source = 0;
+
+	g_output_stream_close(metrics_stream, NULL, NULL);
+	g_clear_object(&metrics_stream);
+	g_clear_pointer(&metrics_path, g_free);
+}
@@ -25,118 +25,210 @@
 #include <jsonrpc-glib.h>
 
 
+// status bar updates per second at most, servers may report much more often
+#define STATUS_UPDATE_INTERVAL 100
+
+
 typedef struct
 {
-	LspProgressToken token;
 	gchar *title;
 } LspProgress;
 
 
+/* registered partialResultToken's of requests in progress */
+typedef struct
+{
+	LspServer *server;
+	LspPartialResultCallback callback;
+	gpointer user_data;
+} LspPartialResult;
+
+
+extern GeanyPlugin *geany_plugin;
+
 static gint progress_num = 0;
+static gint partial_result_num = 0;
+static GHashTable *partial_results;  /* GHashTable<token, LspPartialResult> */
+static gchar *pending_status;  /* latest status waiting for status_source */
+static guint status_source;
 
 
 static void progress_free(LspProgress *p)
 {
-	g_free(p->token.token_str);
 	g_free(p->title);
 	g_free(p);
 }
 
 
-void lsp_progress_create(LspServer *server, LspProgressToken token)
+/* string and integer tokens are different even when they look the same */
+static gchar *token_key(LspProgressToken token)
 {
+	if (token.token_str)
+		return g_strconcat("s", token.token_str, NULL);
+	return g_strdup_printf("i%d", token.token_int);
+}
+
+
+static LspProgress *progress_lookup(LspServer *server, LspProgressToken token)
+{
+	gchar *key;
 	LspProgress *p;
 
-	p = g_new0(LspProgress, 1);
+	if (!server->progress_ops)
+		return NULL;
 
-	p->token.token_str = g_strdup(token.token_str);
-	p->token.token_int = token.token_int;
+	key = token_key(token);
+	p = g_hash_table_lookup(server->progress_ops, key);
+	g_free(key);
 
-	server->progress_ops = g_slist_prepend(server->progress_ops, p);
+	return p;
 }
 
 
-static gboolean token_equal(LspProgressToken t1, LspProgressToken t2)
+void lsp_progress_create(LspServer *server, LspProgressToken token)
 {
-	if (t1.token_str != NULL || t2.token_str != NULL)
-		return g_strcmp0(t1.token_str, t2.token_str) == 0;
-	return t1.token_int == t2.token_int;
+	if (!server->progress_ops)
+		server->progress_ops = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)progress_free);
+
+	g_hash_table_insert(server->progress_ops, token_key(token), g_new0(LspProgress, 1));
 }
 
 
-static void progress_begin(LspServer *server, LspProgressToken token, const gchar *title, const gchar *message)
+/* Returns a new token to be sent as partialResultToken of a request; callback
+ * is called with the value of every partial result the server sends until the
+ * token is freed, normally when the final response arrives. */
+gchar *lsp_progress_partial_result_new(LspServer *server, LspPartialResultCallback callback,
+	gpointer user_data)
 {
-	GSList *node;
+	LspPartialResult *p = g_new0(LspPartialResult, 1);
+	gchar *token = g_strdup_printf("geany_partial_%d", partial_result_num++);
+
+	if (!partial_results)
+		partial_results = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	p->server = server;
+	p->callback = callback;
+	p->user_data = user_data;
+	g_hash_table_insert(partial_results, g_strdup(token), p);
+
+	return token;
+}
 
-	foreach_slist(node, server->progress_ops)
+
+void lsp_progress_partial_result_free(const gchar *token)
+{
+	if (partial_results && token)
+		g_hash_table_remove(partial_results, token);
+}
+
+
+static gboolean partial_result_of_server(G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
+{
+	LspPartialResult *p = value;
+
+	return p->server == user_data;
+}
+
+
+static gboolean status_update_cb(G_GNUC_UNUSED gpointer user_data)
+{
+	if (!pending_status)
 	{
-		LspProgress *p = node->data;
-		if (token_equal(p->token, token))
-		{
-			p->title = g_strdup(title);
-			ui_set_statusbar(FALSE, "%s: %s", p->title, message ? message : "");
-			if (progress_num == 0)
-			{
-				if (server->config.progress_bar_enable)
-					ui_progress_bar_start("");
-			}
-			progress_num++;
-			break;
-		}
+		status_source = 0;
+		return G_SOURCE_REMOVE;
 	}
+
+	ui_set_statusbar(FALSE, "%s", pending_status);
+	g_free(pending_status);
+	pending_status = NULL;
+
+	return G_SOURCE_CONTINUE;
 }
 
 
-static void progress_report(LspServer *server, LspProgressToken token, const gchar *message)
+/* The first status is shown immediately, the ones arriving within the next
+ * STATUS_UPDATE_INTERVAL only replace each other and the latest is shown
+ * when it elapses */
+static void set_status(const gchar *title, const gchar *message)
 {
-	GSList *node;
+	gchar *status;
 
-	foreach_slist(node, server->progress_ops)
+	if (title)
+		status = g_strconcat(title, ": ", message ? message : "", NULL);
+	else
+		status = g_strdup("");
+
+	if (status_source)
 	{
-		LspProgress *p = node->data;
-		if (token_equal(p->token, token))
-		{
-			ui_set_statusbar(FALSE, "%s: %s", p->title, message ? message : "");
-			break;
-		}
+		SETPTR(pending_status, status);
+		return;
 	}
+
+	ui_set_statusbar(FALSE, "%s", status);
+	g_free(status);
+	status_source = plugin_timeout_add(geany_plugin, STATUS_UPDATE_INTERVAL, status_update_cb, NULL);
 }
 
 
-static void progress_end(LspServer *server, LspProgressToken token, const gchar *message)
+static void progress_begin(LspServer *server, LspProgressToken token, const gchar *title, const gchar *message)
 {
-	GSList *node;
+	LspProgress *p = progress_lookup(server, token);
+
+	if (!p)
+		return;
 
-	foreach_slist(node, server->progress_ops)
+	SETPTR(p->title, g_strdup(title));
+	set_status(p->title, message);
+	if (progress_num == 0)
 	{
-		LspProgress *p = node->data;
-		if (token_equal(p->token, token))
-		{
-			if (progress_num > 0)
-				progress_num--;
-			if (progress_num == 0)
-				ui_progress_bar_stop();
-
-			if (message)
-				ui_set_statusbar(FALSE, "%s: %s", p->title, message ? message : "");
-			else
-				ui_set_statusbar(FALSE, "%s", "");
-
-			server->progress_ops = g_slist_remove_link(server->progress_ops, node);
-			g_slist_free_full(node, (GDestroyNotify)progress_free);
-			break;
-		}
+		if (server->config.progress_bar_enable)
+			ui_progress_bar_start("");
 	}
+	progress_num++;
+}
+
+
+static void progress_report(LspServer *server, LspProgressToken token, const gchar *message)
+{
+	LspProgress *p = progress_lookup(server, token);
+
+	if (p)
+		set_status(p->title, message);
+}
+
+
+static void progress_end(LspServer *server, LspProgressToken token, const gchar *message)
+{
+	LspProgress *p = progress_lookup(server, token);
+	gchar *key;
+
+	if (!p)
+		return;
+
+	if (progress_num > 0)
+		progress_num--;
+	if (progress_num == 0)
+		ui_progress_bar_stop();
+
+	set_status(message ? p->title : NULL, message);
+
+	key = token_key(token);
+	g_hash_table_remove(server->progress_ops, key);
+	g_free(key);
 }
 
 
 void lsp_progress_free_all(LspServer *server)
 {
-	guint len = g_slist_length(server->progress_ops);
+	guint len = server->progress_ops ? g_hash_table_size(server->progress_ops) : 0;
 
-	g_slist_free_full(server->progress_ops, (GDestroyNotify)progress_free);
-	server->progress_ops = 0;
+	if (server->progress_ops)
+		g_hash_table_destroy(server->progress_ops);
+	server->progress_ops = NULL;
 	progress_num = MAX(0, progress_num - len);
+	if (partial_results)
+		g_hash_table_foreach_remove(partial_results, partial_result_of_server, server);
 	if (progress_num == 0)
 		ui_progress_bar_stop();
 }
@@ -161,6 +253,24 @@ void lsp_progress_process_notification(LspServer *srv, GVariant *params)
 			"token", JSONRPC_MESSAGE_GET_INT64(&token_int)
 		);
 	}
+
+	if (token_str && partial_results)
+	{
+		LspPartialResult *p = g_hash_table_lookup(partial_results, token_str);
+
+		if (p && p->server == srv)
+		{
+			GVariant *value = NULL;
+
+			JSONRPC_MESSAGE_PARSE(params, "value", JSONRPC_MESSAGE_GET_VARIANT(&value));
+			if (value)
+			{
+				p->callback(value, p->user_data);
+				g_variant_unref(value);
+			}
+			return;
+		}
+	}
 	JSONRPC_MESSAGE_PARSE(params,
 		"value", "{",
 			"kind", JSONRPC_MESSAGE_GET_STRING(&kind),
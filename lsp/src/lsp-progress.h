@@ -31,8 +31,15 @@ typedef struct
 } LspProgressToken;
 
 
+typedef void (*LspPartialResultCallback) (GVariant *value, gpointer user_data);
+
+
 void lsp_progress_create(LspServer *server, LspProgressToken token);
 
+gchar *lsp_progress_partial_result_new(LspServer *server, LspPartialResultCallback callback,
+	gpointer user_data);
+void lsp_progress_partial_result_free(const gchar *token);
+
 void lsp_progress_process_notification(LspServer *srv, GVariant *params);
 
 void lsp_progress_free_all(LspServer *server);
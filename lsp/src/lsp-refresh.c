@@ -0,0 +1,78 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+/* Coalesces workspace/.../refresh requests of a server. Servers tend to send
+ * them in bursts (e.g. after each indexed batch of files) so they are only
+ * collected and, after a short delay, new data is requested for the current
+ * document once per kind. Other documents request everything anew when they
+ * become visible anyway. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-refresh.h"
+#include "lsp-semtokens.h"
+#include "lsp-inlay-hints.h"
+#include "lsp-code-lens.h"
+#include "lsp-diagnostics.h"
+
+#include <geanyplugin.h>
+
+
+#define REFRESH_DELAY 250
+
+
+extern GeanyPlugin *geany_plugin;
+
+
+static gboolean refresh_cb(gpointer user_data)
+{
+	LspServer *srv = user_data;
+	GeanyDocument *doc = document_get_current();
+	guint kinds = srv->refresh_pending;
+
+	srv->refresh_source = 0;
+	srv->refresh_pending = 0;
+
+	if (!doc || lsp_server_get_if_running(doc) != srv)
+		return G_SOURCE_REMOVE;
+
+	if (kinds & LSP_REFRESH_SEMTOKENS)
+		lsp_semtokens_refresh(srv);
+	if (kinds & LSP_REFRESH_INLAY_HINTS)
+		lsp_inlay_hints_refresh(srv);
+	if (kinds & LSP_REFRESH_CODE_LENS)
+		lsp_code_lens_send_request(doc);
+	if (kinds & LSP_REFRESH_DIAGNOSTICS)
+		lsp_diagnostics_pull(doc);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* the delay isn't restarted by further refreshes so a server refreshing
+ * continuously still gets its data re-requested regularly */
+void lsp_refresh_schedule(LspServer *srv, LspRefreshKind kind)
+{
+	srv->refresh_pending |= kind;
+
+	if (srv->refresh_source == 0)
+		srv->refresh_source = plugin_timeout_add(geany_plugin, REFRESH_DELAY, refresh_cb, srv);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef LSP_REFRESH_H
+#define LSP_REFRESH_H 1
+
+#include "lsp-server.h"
+
+#include <glib.h>
+
+
+typedef enum
+{
+	LSP_REFRESH_SEMTOKENS = 1 << 0,
+	LSP_REFRESH_INLAY_HINTS = 1 << 1,
+	LSP_REFRESH_CODE_LENS = 1 << 2,
+	LSP_REFRESH_DIAGNOSTICS = 1 << 3
+} LspRefreshKind;
+
+
+void lsp_refresh_schedule(LspServer *srv, LspRefreshKind kind);
+
+#endif  /* LSP_REFRESH_H */
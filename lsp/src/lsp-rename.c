@@ -38,6 +38,13 @@ static struct
 extern GeanyData *geany_data;
 
 static GtkWidget *progress_dialog;
+static GtkWidget *progress_label;
+
+
+typedef struct {
+	GCallback on_rename_done;
+	LspPositionEncoding encoding;
+} RenameData;
 
 
 static gchar *show_dialog_rename(const gchar *old_name)
@@ -160,28 +167,69 @@ static GtkWidget *create_progress_dialog(void)
 	gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
 	gtk_box_pack_start(GTK_BOX(vbox), label, TRUE, FALSE, 0);
 
+	progress_label = gtk_label_new(NULL);
+	gtk_label_set_justify(GTK_LABEL(progress_label), GTK_JUSTIFY_CENTER);
+	gtk_box_pack_start(GTK_BOX(vbox), progress_label, TRUE, FALSE, 0);
+
 	gtk_widget_show_all(dialog);
 
 	return dialog;
 }
 
 
-static void rename_cb(GVariant *return_value, GError *error, gpointer user_data)
+static void destroy_progress_dialog(void)
 {
-	GCallback on_rename_done = user_data;
+	if (!progress_dialog)
+		return;
 
 	gtk_widget_destroy(progress_dialog);
 	progress_dialog = NULL;
+	progress_label = NULL;
+}
+
+
+static void apply_edit_cb(guint files_done, guint files_total, gboolean finished, gpointer user_data)
+{
+	RenameData *data = user_data;
+
+	if (!finished)
+	{
+		if (progress_label)
+		{
+			gchar *text = g_strdup_printf(_("Updated %u of %u files"), files_done, files_total);
+
+			gtk_label_set_text(GTK_LABEL(progress_label), text);
+			g_free(text);
+		}
+		return;
+	}
+
+	destroy_progress_dialog();
+	data->on_rename_done();
+	g_free(data);
+}
+
+
+static void rename_cb(GVariant *return_value, GError *error, gpointer user_data)
+{
+	RenameData *data = user_data;
 
 	if (!error)
 	{
 		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
-		if (lsp_utils_apply_workspace_edit(return_value))
-			on_rename_done();
+		// the dialog stays open until all files are written
+		if (lsp_utils_apply_workspace_edit_full(return_value, data->encoding, apply_edit_cb, data))
+			return;
+		destroy_progress_dialog();
 	}
 	else
+	{
+		destroy_progress_dialog();
 		dialogs_show_msgbox(GTK_MESSAGE_ERROR, "%s", error->message);
+	}
+
+	g_free(data);
 }
 
 
@@ -210,6 +258,7 @@ void lsp_rename_send_request(gint pos, GCallback on_rename_done)
 		if (new_name && new_name[0])
 		{
 			gchar *doc_uri = lsp_utils_get_doc_uri(doc);
+			RenameData *data;
 
 			node = JSONRPC_MESSAGE_NEW (
 				"textDocument", "{",
@@ -224,10 +273,15 @@ void lsp_rename_send_request(gint pos, GCallback on_rename_done)
 
 			//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
+			data = g_new0(RenameData, 1);
+			data->on_rename_done = on_rename_done;
+			data->encoding = srv->position_encoding;
+
+			destroy_progress_dialog();
 			progress_dialog = create_progress_dialog();
 
 			lsp_rpc_call(srv, "textDocument/rename", node,
-				rename_cb, on_rename_done);
+				rename_cb, data);
 
 			g_free(doc_uri);
 			g_variant_unref(node);
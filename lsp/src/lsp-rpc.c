@@ -25,33 +25,334 @@
 #include "lsp-diagnostics.h"
 #include "lsp-progress.h"
 #include "lsp-log.h"
+#include "lsp-capture.h"
 #include "lsp-utils.h"
+#include "lsp-sync.h"
+#include "lsp-refresh.h"
 #include "lsp-workspace-folders.h"
+#include "lsp-watched-files.h"
+#include "lsp-timing.h"
+#include "lsp-trace.h"
 
 #include <jsonrpc-glib.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+// background requests sent at the same time, the rest waits in a queue
+#define MAX_BACKGROUND_REQUESTS 2
 
-typedef struct
+// unsent output above which the server is considered not to keep up
+#define OUTPUT_CONGESTION_SIZE (64 * 1024)
+
+// time after the last timeout when suspended background requests are tried again
+#define HEALTH_PROBE_INTERVAL (30 * G_USEC_PER_SEC)
+
+
+typedef struct CallbackData
 {
-	gchar *method_name;
+	const gchar *method_name;  // interned
 	gpointer user_data;
 	LspRpcCallback callback;
-	GDateTime *req_time;
+	gint64 req_time;  // monotonic time when sent, 0 before that
 	gboolean cb_on_startup_shutdown;
+	LspRpcRequest handle;
+	gint64 id;
+	JsonrpcClient *client;
+	GCancellable *cancellable;
+	gboolean background;
+	GVariant *params;  // until sent for queued background requests
+	gchar *uri;
+	GVariant *dedup_params;  // params compared with identical requests
+	GSList *followers;  // identical requests waiting for our response
+	struct CallbackData *primary;  // request we are waiting for as a follower
+	guint timeout_source;
 } CallbackData;
 
 
+typedef struct
+{
+	guint64 count;
+	guint64 errors;
+	guint64 cancellations;
+	guint64 timeouts;
+	guint64 bytes_out;  // sizes are of the serialized GVariants which are
+	guint64 bytes_in;   // close to JSON sizes
+	LspTimingHistogram latency;
+	gdouble recent_latency;  // ms, exponentially smoothed to follow changes
+} LspRpcMethodStats;
+
+
 struct LspRpc
 {
 	JsonrpcClient *client;
+	GQueue *background_queue;
+	guint background_requests;  // sent, waiting for response
+	GHashTable *in_flight;  // set of CallbackData, see in_flight_hash()
+	GHashTable *stats;  // method -> LspRpcMethodStats
+	gint64 last_activity;  // time of the last request or notification sent
+	LspCapture *capture;
+	guint timeouts_in_row;
+	gint64 last_timeout;
+	gdouble failure_rate;  // of recent responses, timeouts and errors count as failures
+	gboolean degraded;  // background requests suspended
 };
 
 
+extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
 GHashTable *client_table;
 
+// LspRpcRequest -> CallbackData of requests waiting for response
+static GHashTable *request_table;
+static LspRpcRequest last_request_handle;
+
+
+static LspRpcMethodStats *get_stats(LspServer *srv, const gchar *method)
+{
+	LspRpcMethodStats *stats = g_hash_table_lookup(srv->rpc->stats, method);
+
+	if (!stats)
+	{
+		stats = g_new0(LspRpcMethodStats, 1);
+		g_hash_table_insert(srv->rpc->stats, g_strdup(method), stats);
+	}
+
+	return stats;
+}
+
+
+static void record_sent(LspServer *srv, const gchar *method, GVariant *params, gsize extra_len)
+{
+	LspRpcMethodStats *stats = get_stats(srv, method);
+
+	stats->count++;
+	stats->bytes_out += (params ? g_variant_get_size(params) : 0) + extra_len;
+	srv->rpc->last_activity = g_get_monotonic_time();
+}
+
+
+static void record_received(LspServer *srv, const gchar *method, GVariant *result, gint64 req_time,
+	GError *error)
+{
+	LspRpcMethodStats *stats = get_stats(srv, method);
+
+	stats->bytes_in += result ? g_variant_get_size(result) : 0;
+
+	if (error)
+		stats->errors++;
+
+	if (req_time > 0)
+	{
+		gint64 latency = g_get_monotonic_time() - req_time;
+		LspRpc *rpc = srv->rpc;
+
+		rpc->failure_rate = 0.9 * rpc->failure_rate + (error ? 0.1 : 0);
+		rpc->timeouts_in_row = 0;
+		if (rpc->degraded)
+		{
+			rpc->degraded = FALSE;
+			msgwin_status_add(_("LSP server %s responds again, background requests resumed"),
+				srv->config.cmd);
+		}
+
+		stats->recent_latency = stats->latency.count == 0 ? latency / 1000.0 :
+			0.8 * stats->recent_latency + 0.2 * latency / 1000.0;
+		lsp_timing_histogram_add(&stats->latency, latency);
+	}
+}
+
+
+static void record_cancelled(JsonrpcClient *client, const gchar *method)
+{
+	LspServer *srv = g_hash_table_lookup(client_table, client);
+
+	if (srv && method)
+		get_stats(srv, method)->cancellations++;
+}
+
+
+static void record_timeout(LspServer *srv, const gchar *method)
+{
+	LspRpc *rpc = srv->rpc;
+	gint max = srv->config.background_suspend_timeouts;
+
+	get_stats(srv, method)->timeouts++;
+	rpc->failure_rate = 0.9 * rpc->failure_rate + 0.1;
+	rpc->timeouts_in_row++;
+	rpc->last_timeout = g_get_monotonic_time();
+
+	msgwin_status_add(_("LSP server %s did not answer %s in time"), srv->config.cmd, method);
+
+	if (!rpc->degraded && max > 0 && rpc->timeouts_in_row >= (guint)max)
+	{
+		rpc->degraded = TRUE;
+		msgwin_status_add(_("LSP server %s keeps timing out, background requests suspended"),
+			srv->config.cmd);
+	}
+}
+
+
+/* Whether requests the user doesn't wait for (semantic tokens, code lens etc.)
+ * shouldn't be sent because the server keeps timing out. Some time after the
+ * last timeout they are allowed again so we find out when the server recovers. */
+gboolean lsp_rpc_is_degraded(LspServer *srv)
+{
+	return srv->rpc && srv->rpc->degraded &&
+		g_get_monotonic_time() - srv->rpc->last_timeout < HEALTH_PROBE_INTERVAL;
+}
+
+
+static gint compare_methods(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(const gchar **)a, *(const gchar **)b);
+}
+
+
+gint64 lsp_rpc_get_last_activity(LspRpc *rpc)
+{
+	return rpc->last_activity;
+}
+
+
+/* Delay in ms before sending the given (NULL-terminated) methods after the
+ * user's last action - roughly the recent latency of the slowest of them so
+ * slow servers don't get requests piling up while fast ones respond quickly,
+ * within the configured bounds */
+gint lsp_rpc_get_debounce(LspServer *srv, const gchar **methods)
+{
+	gint min = MAX(srv->config.debounce_min, 0);
+	gint max = MAX(srv->config.debounce_max, min);
+	gint latency = -1;
+	const gchar **method;
+
+	for (method = methods; srv->rpc && *method; method++)
+	{
+		LspRpcMethodStats *stats = g_hash_table_lookup(srv->rpc->stats, *method);
+
+		if (stats && stats->latency.count > 0)
+			latency = MAX(latency, (gint)stats->recent_latency);
+	}
+
+	if (latency < 0)
+		latency = LSP_RPC_DEFAULT_DEBOUNCE;
+
+	return CLAMP(latency, min, max);
+}
+
+
+/* Appends a table of per-method statistics of the server; latencies are in
+ * milliseconds and are upper bounds of the histogram buckets (~20% precision) */
+void lsp_rpc_append_statistics(LspRpc *rpc, GString *str)
+{
+	GPtrArray *methods = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer key;
+	guint i;
+
+	g_hash_table_iter_init(&iter, rpc->stats);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(methods, key);
+	g_ptr_array_sort(methods, compare_methods);
+
+	g_string_append_printf(str, "recent failures %.0f %%, timeouts in a row %u%s\n\n",
+		rpc->failure_rate * 100, rpc->timeouts_in_row,
+		rpc->degraded ? ", background requests suspended" : "");
+
+	g_string_append_printf(str, "%-45s %8s %7s %9s %8s %10s %10s %9s %9s %9s\n",
+		"method", "count", "errors", "cancelled", "timeouts", "KB out", "KB in", "p50 ms", "p90 ms", "p99 ms");
+
+	for (i = 0; i < methods->len; i++)
+	{
+		const gchar *method = methods->pdata[i];
+		LspRpcMethodStats *stats = g_hash_table_lookup(rpc->stats, method);
+
+		g_string_append_printf(str, "%-45s %8" G_GUINT64_FORMAT " %7" G_GUINT64_FORMAT
+			" %9" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %10.1f %10.1f",
+			method, stats->count, stats->errors, stats->cancellations, stats->timeouts,
+			stats->bytes_out / 1024.0, stats->bytes_in / 1024.0);
+
+		if (stats->latency.count > 0)
+			g_string_append_printf(str, " %9.1f %9.1f %9.1f\n",
+				lsp_timing_histogram_percentile(&stats->latency, 0.5),
+				lsp_timing_histogram_percentile(&stats->latency, 0.9),
+				lsp_timing_histogram_percentile(&stats->latency, 0.99));
+		else
+			g_string_append_printf(str, " %9s %9s %9s\n", "-", "-", "-");
+	}
+
+	g_ptr_array_free(methods, TRUE);
+}
+
+
+static void add_member_int(JsonBuilder *builder, const gchar *name, gint64 val)
+{
+	json_builder_set_member_name(builder, name);
+	json_builder_add_int_value(builder, val);
+}
+
+
+/* Adds the queue depths and per-method statistics as members of the object
+ * being built, latencies in ms */
+void lsp_rpc_append_metrics(LspRpc *rpc, JsonBuilder *builder)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	gint64 in_flight = 0;
+
+	if (request_table)
+	{
+		g_hash_table_iter_init(&iter, request_table);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+		{
+			CallbackData *data = value;
+
+			if (data->client == rpc->client && data->req_time > 0)
+				in_flight++;
+		}
+	}
+
+	add_member_int(builder, "requests_in_flight", in_flight);
+	add_member_int(builder, "background_queued", rpc->background_queue->length);
+	add_member_int(builder, "background_in_flight", rpc->background_requests);
+	add_member_int(builder, "timeouts_in_row", rpc->timeouts_in_row);
+	json_builder_set_member_name(builder, "failure_rate");
+	json_builder_add_double_value(builder, rpc->failure_rate);
+	json_builder_set_member_name(builder, "background_suspended");
+	json_builder_add_boolean_value(builder, rpc->degraded);
+#ifdef JSONRPC_CLIENT_PENDING_OUTPUT_SIZE
+	add_member_int(builder, "pending_output_bytes", jsonrpc_client_get_pending_output_size(rpc->client));
+#endif
+
+	json_builder_set_member_name(builder, "methods");
+	json_builder_begin_object(builder);
+	g_hash_table_iter_init(&iter, rpc->stats);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		LspRpcMethodStats *stats = value;
+
+		json_builder_set_member_name(builder, key);
+		json_builder_begin_object(builder);
+		add_member_int(builder, "count", stats->count);
+		add_member_int(builder, "errors", stats->errors);
+		add_member_int(builder, "cancelled", stats->cancellations);
+		add_member_int(builder, "timeouts", stats->timeouts);
+		add_member_int(builder, "bytes_out", stats->bytes_out);
+		add_member_int(builder, "bytes_in", stats->bytes_in);
+		if (stats->latency.count > 0)
+		{
+			json_builder_set_member_name(builder, "p50");
+			json_builder_add_double_value(builder, lsp_timing_histogram_percentile(&stats->latency, 0.5));
+			json_builder_set_member_name(builder, "p90");
+			json_builder_add_double_value(builder, lsp_timing_histogram_percentile(&stats->latency, 0.9));
+			json_builder_set_member_name(builder, "p99");
+			json_builder_add_double_value(builder, lsp_timing_histogram_percentile(&stats->latency, 0.99));
+		}
+		json_builder_end_object(builder);
+	}
+	json_builder_end_object(builder);
+}
+
 
 static void log_message(GVariant *params)
 {
@@ -129,11 +430,15 @@ static void handle_notification(JsonrpcClient *client, gchar *method, GVariant *
 	gpointer user_data)
 {
 	LspServer *srv = g_hash_table_lookup(client_table, client);
+	gint64 stall_time = lsp_timing_stall_start();
 
 	if (!srv)
 		return;
 
-	lsp_log(srv->log, LspLogServerNotificationSent, method, params, NULL, NULL);
+	lsp_log(srv->log, LspLogServerNotificationSent, method, params, NULL, 0);
+	lsp_capture_message(srv->rpc->capture, LspCaptureServerNotification, method, NULL, params, NULL);
+	get_stats(srv, method)->count++;
+	record_received(srv, method, params, 0, NULL);
 
 	if (g_strcmp0(method, "textDocument/publishDiagnostics") == 0)
 		lsp_diagnostics_received(srv, params);
@@ -164,6 +469,17 @@ static void handle_notification(JsonrpcClient *client, gchar *method, GVariant *
 		//printf("\n\nNOTIFICATION FROM SERVER: %s\n", method);
 		//printf("params:\n%s\n\n\n", lsp_utils_json_pretty_print(params));
 	}
+
+	lsp_timing_stall_end("notification", method, params ? g_variant_get_size(params) : 0, stall_time);
+}
+
+
+static void handle_failed(JsonrpcClient *client, gpointer user_data)
+{
+	LspServer *srv = g_hash_table_lookup(client_table, client);
+
+	if (srv)
+		lsp_server_connection_lost(srv);
 }
 
 
@@ -171,7 +487,8 @@ static void reply_async(LspServer *srv, const gchar *method, JsonrpcClient *clie
 	GVariant *id, GVariant *result)
 {
 	jsonrpc_client_reply_async(client, id, result, NULL, NULL, NULL);
-	lsp_log(srv->log, LspLogServerMessageReceived, method, result, NULL, NULL);
+	lsp_log(srv->log, LspLogServerMessageReceived, method, result, NULL, 0);
+	lsp_capture_message(srv->rpc->capture, LspCaptureClientResponse, method, id, result, NULL);
 }
 
 
@@ -201,26 +518,143 @@ static GVariant *create_progress(LspServer *srv, GVariant *params)
 }
 
 
-static GVariant *apply_edit(LspServer *srv, GVariant *params)
+typedef struct
 {
-	GVariant *edit, *msg;
-	gboolean success;
+	JsonrpcClient *client;
+	GVariant *id;
+} ApplyEditData;
 
-	success = JSONRPC_MESSAGE_PARSE(params,
-		"edit", JSONRPC_MESSAGE_GET_VARIANT(&edit)
-	);
 
-	if (success)
-		success = lsp_utils_apply_workspace_edit(edit);
+static void apply_edit_data_free(ApplyEditData *data)
+{
+	g_object_unref(data->client);
+	g_variant_unref(data->id);
+	g_free(data);
+}
+
+
+static void reply_apply_edit(JsonrpcClient *client, GVariant *id, gboolean success)
+{
+	LspServer *srv = g_hash_table_lookup(client_table, client);
+	GVariant *msg;
+
+	if (!srv)
+		return;  // server stopped while the files were written
 
 	msg = JSONRPC_MESSAGE_NEW(
 		"applied", JSONRPC_MESSAGE_PUT_BOOLEAN(success)
 	);
+	reply_async(srv, "workspace/applyEdit", client, id, msg);
+	g_variant_unref(msg);
+}
+
+
+static void apply_edit_cb(G_GNUC_UNUSED guint files_done, G_GNUC_UNUSED guint files_total,
+	gboolean finished, gpointer user_data)
+{
+	ApplyEditData *data = user_data;
+
+	if (!finished)
+		return;
+
+	reply_apply_edit(data->client, data->id, TRUE);
+	apply_edit_data_free(data);
+}
+
+
+/* Replies once the files which aren't open are written in the background -
+ * the server may otherwise read them before the edits are there */
+static void apply_edit(JsonrpcClient *client, GVariant *id, LspServer *srv, GVariant *params)
+{
+	ApplyEditData *data;
+	GVariant *edit = NULL;
+
+	JSONRPC_MESSAGE_PARSE(params,
+		"edit", JSONRPC_MESSAGE_GET_VARIANT(&edit)
+	);
+
+	data = g_new0(ApplyEditData, 1);
+	data->client = g_object_ref(client);
+	data->id = g_variant_ref(id);
+
+	if (!edit || !lsp_utils_apply_workspace_edit_full(edit, srv->position_encoding,
+		apply_edit_cb, data))
+	{
+		reply_apply_edit(client, id, FALSE);
+		apply_edit_data_free(data);
+	}
 
 	if (edit)
 		g_variant_unref(edit);
+}
 
-	return msg;
+
+/* The settings are deserialized once and the values of requested sections
+ * are kept until initialization_options_file changes - servers ask for the
+ * configuration of every file and folder */
+static void update_config_settings(LspServer *srv)
+{
+	const gchar *utf8_fname = srv->config.initialization_options_file;
+	gint64 mtime = -1;
+
+	if (!EMPTY(utf8_fname))
+	{
+		gchar *fname = utils_get_locale_from_utf8(utf8_fname);
+
+		if (fname)
+			mtime = lsp_utils_get_file_mtime(fname);
+		g_free(fname);
+	}
+
+	if (srv->config_sections && srv->config_mtime == mtime)
+		return;
+
+	if (srv->config_sections)
+		g_hash_table_remove_all(srv->config_sections);
+	else
+		srv->config_sections = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)g_variant_unref);
+
+	if (srv->config_settings)
+		g_variant_unref(srv->config_settings);
+	srv->config_settings = lsp_utils_parse_json_file_as_variant(utf8_fname,
+		srv->config.initialization_options);
+	if (srv->config_settings)
+		g_variant_ref_sink(srv->config_settings);
+	srv->config_mtime = mtime;
+}
+
+
+// value of the dot-separated section in the settings, empty object if missing
+static GVariant *get_config_section(LspServer *srv, const gchar *section)
+{
+	GVariant *value = g_hash_table_lookup(srv->config_sections, section);
+	gchar **keys, **key;
+
+	if (value)
+		return value;
+
+	value = srv->config_settings ? g_variant_ref(srv->config_settings) : NULL;
+	keys = g_strsplit(section, ".", -1);
+	foreach_strv(key, keys)
+	{
+		GVariant *member;
+
+		if (!value || !g_variant_is_of_type(value, G_VARIANT_TYPE_VARDICT))
+			break;
+
+		member = g_variant_lookup_value(value, *key, NULL);
+		g_variant_unref(value);
+		value = member;
+	}
+	g_strfreev(keys);
+
+	if (!value)
+		value = g_variant_ref_sink(g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0));
+
+	g_hash_table_insert(srv->config_sections, g_strdup(section), value);
+
+	return value;
 }
 
 
@@ -235,52 +669,28 @@ static GVariant *workspace_configuration(LspServer *srv, GVariant *params)
 
 	if (iter)
 	{
-		JsonNode *settings = lsp_utils_parse_json_file(srv->config.initialization_options_file,
-			srv->config.initialization_options);
-		JsonNode *empty_elem = json_from_string("{}", NULL);
-		JsonBuilder *builder = json_builder_new();
 		GVariant *member = NULL;
-		JsonNode *res_json = NULL;
+		GVariantBuilder builder;
+
+		update_config_settings(srv);
 
-		json_builder_begin_array(builder);
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
 
 		while (g_variant_iter_loop(iter, "v", &member))
 		{
 			const gchar *section = NULL;
-			gboolean added = FALSE;
 
-			if (JSONRPC_MESSAGE_PARSE(member, "section", JSONRPC_MESSAGE_GET_STRING(&section)))
-			{
-				gchar *path = g_strconcat("$.", section, NULL);
-				JsonNode *matched = json_path_query(path, settings, NULL);
-
-				if (matched)
-				{
-					JsonArray *arr = json_node_get_array(matched);
-					if (arr && json_array_get_length(arr) > 0)
-					{
-						json_builder_add_value(builder, json_array_dup_element(arr, 0));
-						added = TRUE;
-					}
-					json_node_unref(matched);
-				}
-
-				g_free(path);
-			}
+			JSONRPC_MESSAGE_PARSE(member, "section", JSONRPC_MESSAGE_GET_STRING(&section));
 
-			if (!added)
-				json_builder_add_value(builder, json_node_ref(empty_elem));
+			if (section)
+				g_variant_builder_add(&builder, "v", get_config_section(srv, section));
+			else
+				g_variant_builder_add(&builder, "v", g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0));
 		}
 
-		json_builder_end_array(builder);
-		res_json = json_builder_get_root(builder);
-		res = g_variant_take_ref(json_gvariant_deserialize(res_json, NULL, NULL));
+		res = g_variant_take_ref(g_variant_builder_end(&builder));
 
 		g_variant_iter_free(iter);
-		json_node_free(settings);
-		json_node_free(res_json);
-		g_object_unref(builder);
-		json_node_unref(empty_elem);
 	}
 
 	return res;
@@ -378,7 +788,8 @@ static gboolean handle_call(JsonrpcClient *client, gchar* method, GVariant *id,
 	if (!srv)
 		return FALSE;
 
-	lsp_log(srv->log, LspLogServerMessageSent, method, params, NULL, NULL);
+	lsp_log(srv->log, LspLogServerMessageSent, method, params, NULL, 0);
+	lsp_capture_message(srv->rpc->capture, LspCaptureServerRequest, method, id, params, NULL);
 
 	//printf("\n\nREQUEST FROM SERVER: %s\n", method);
 	//printf("params:\n%s\n\n\n", lsp_utils_json_pretty_print(params));
@@ -390,8 +801,9 @@ static gboolean handle_call(JsonrpcClient *client, gchar* method, GVariant *id,
 	}
 	else if (g_strcmp0(method, "workspace/applyEdit") == 0)
 	{
-		msg = apply_edit(srv, params);
-		handled = TRUE;
+		// replied by apply_edit() itself
+		apply_edit(client, id, srv, params);
+		return TRUE;
 	}
 	else if (g_strcmp0(method, "workspace/configuration") == 0)
 	{
@@ -403,16 +815,42 @@ static gboolean handle_call(JsonrpcClient *client, gchar* method, GVariant *id,
 	}
 	else if (g_strcmp0(method, "client/registerCapability") == 0)
 	{
-		// not supported at all, HTML/CSS servers sending the request despite
-		// no indication of support from the client. Just to suppress warnings
-		// from the servers
+		// only watched files support dynamic registration, other capabilities
+		// are accepted just to suppress warnings from servers sending the
+		// request despite no indication of support from the client
+		lsp_watched_files_register(srv, params);
+		msg = NULL;
+		handled = TRUE;
+	}
+	else if (g_strcmp0(method, "client/unregisterCapability") == 0)
+	{
+		lsp_watched_files_unregister(srv, params);
 		msg = NULL;
 		handled = TRUE;
 	}
 	else if (g_strcmp0(method, "workspace/semanticTokens/refresh") == 0)
 	{
-		// not supported at all - Kate seems to do the same as some servers
-		// require a successful reply
+		// only the current document is refreshed, the others get new tokens
+		// when they become visible
+		lsp_refresh_schedule(srv, LSP_REFRESH_SEMTOKENS);
+		msg = NULL;
+		handled = TRUE;
+	}
+	else if (g_strcmp0(method, "workspace/inlayHint/refresh") == 0)
+	{
+		lsp_refresh_schedule(srv, LSP_REFRESH_INLAY_HINTS);
+		msg = NULL;
+		handled = TRUE;
+	}
+	else if (g_strcmp0(method, "workspace/codeLens/refresh") == 0)
+	{
+		lsp_refresh_schedule(srv, LSP_REFRESH_CODE_LENS);
+		msg = NULL;
+		handled = TRUE;
+	}
+	else if (g_strcmp0(method, "workspace/diagnostic/refresh") == 0)
+	{
+		lsp_refresh_schedule(srv, LSP_REFRESH_DIAGNOSTICS);
 		msg = NULL;
 		handled = TRUE;
 	}
@@ -441,8 +879,18 @@ static gboolean handle_call(JsonrpcClient *client, gchar* method, GVariant *id,
 
 		node = json_from_string("{}", NULL);
 		variant = json_gvariant_deserialize(node, NULL, NULL);
-		lsp_log(srv->log, LspLogServerMessageReceived, method, variant, NULL, NULL);
+		lsp_log(srv->log, LspLogServerMessageReceived, method, variant, NULL, 0);
 		g_variant_unref(variant);
+
+		if (srv->rpc->capture)
+		{
+			// replied by jsonrpc-glib
+			GError *error = g_error_new_literal(JSONRPC_CLIENT_ERROR,
+				JSONRPC_CLIENT_ERROR_METHOD_NOT_FOUND, "Method not found");
+
+			lsp_capture_message(srv->rpc->capture, LspCaptureClientResponse, method, id, NULL, error);
+			g_error_free(error);
+		}
 		json_node_free(node);
 	}
 
@@ -450,60 +898,512 @@ static gboolean handle_call(JsonrpcClient *client, gchar* method, GVariant *id,
 }
 
 
-static void call_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+// server tag of trace events
+static const gchar *trace_server(LspServer *srv)
+{
+	return srv ? filetypes_index(srv->filetype)->name : NULL;
+}
+
+
+static void free_callback_data(CallbackData *data)
+{
+	LspServer *srv = g_hash_table_lookup(client_table, data->client);
+
+	lsp_trace_request('e', data->handle, data->method_name, trace_server(srv), data->method_name,
+		data->uri);
+
+	g_hash_table_remove(request_table, GUINT_TO_POINTER(data->handle));
+	if (data->timeout_source)
+		g_source_remove(data->timeout_source);
+	if (srv && data->dedup_params && g_hash_table_lookup(srv->rpc->in_flight, data) == data)
+		g_hash_table_remove(srv->rpc->in_flight, data);
+
+	if (data->params)
+		g_variant_unref(data->params);
+	g_slist_free(data->followers);
+	g_object_unref(data->cancellable);
+	g_free(data->uri);
+	if (data->dedup_params)
+		g_variant_unref(data->dedup_params);
+	g_slice_free(CallbackData, data);
+}
+
+
+// for requests that were never sent
+static void complete_cancelled(CallbackData *data)
 {
-	JsonrpcClient *client = (JsonrpcClient *)source_object;
-	LspServer *srv = g_hash_table_lookup(client_table, client);
-	CallbackData *data = user_data;
-	GVariant *return_value = NULL;
 	GError *error = NULL;
-	gboolean is_startup_shutdown = TRUE;
 
-	jsonrpc_client_call_finish(client, res, &return_value, &error);
+	record_cancelled(data->client, data->method_name);
+	lsp_trace_request('n', data->handle, "cancelled", NULL, data->method_name, data->uri);
+
+	g_cancellable_cancel(data->cancellable);
+	g_cancellable_set_error_if_cancelled(data->cancellable, &error);
+
+	if (data->callback)
+		data->callback(NULL, error, data->user_data);
+
+	g_error_free(error);
+	free_callback_data(data);
+}
+
+
+static void send_request(LspServer *srv, CallbackData *data, GVariant *params);
+
+
+static void send_background_requests(LspServer *srv)
+{
+	LspRpc *rpc = srv->rpc;
+
+	while (rpc->background_requests < MAX_BACKGROUND_REQUESTS &&
+		!g_queue_is_empty(rpc->background_queue))
+	{
+		CallbackData *data = g_queue_pop_head(rpc->background_queue);
+		GVariant *params = data->params;
+
+		data->params = NULL;
+		send_request(srv, data, params);
+		if (params)
+			g_variant_unref(params);
+	}
+}
+
+
+static void deliver_response(CallbackData *data, GVariant *return_value, GError *error,
+	gboolean is_startup_shutdown)
+{
+	GError *cancel_error = NULL;
+
+	lsp_trace_request('n', data->handle, "response received", NULL, data->method_name, data->uri);
+
+	// the server may still answer normally after $/cancelRequest
+	if (g_cancellable_set_error_if_cancelled(data->cancellable, &cancel_error))
+	{
+		return_value = NULL;
+		error = cancel_error;
+	}
+
+	if (data->callback && (!is_startup_shutdown || data->cb_on_startup_shutdown))
+		data->callback(return_value, error, data->user_data);
+
+	lsp_trace_request('n', data->handle, "response processed", NULL, data->method_name, data->uri);
+
+	if (cancel_error)
+		g_error_free(cancel_error);
+}
+
+
+static void handle_response(JsonrpcClient *client, CallbackData *data, GVariant *return_value,
+	GError *error)
+{
+	LspServer *srv = g_hash_table_lookup(client_table, client);
+	gboolean is_startup_shutdown = TRUE;
+	gboolean background = data->background;
+	gint64 stall_time = lsp_timing_stall_start();
+	GSList *followers, *item;
 
 	if (srv)
 	{
 		lsp_log(srv->log, LspLogClientMessageReceived, data->method_name,
 			return_value, error, data->req_time);
 		is_startup_shutdown = srv->startup_shutdown;
+
+		// cancelled requests were already counted and their latency is meaningless
+		if (!g_cancellable_is_cancelled(data->cancellable))
+			record_received(srv, data->method_name, return_value, data->req_time, error);
+
+		if (srv->rpc->capture)
+		{
+			GVariant *id = g_variant_take_ref(g_variant_new_int64(data->id));
+
+			lsp_capture_message(srv->rpc->capture, LspCaptureServerResponse, data->method_name,
+				id, return_value, error);
+			g_variant_unref(id);
+		}
+
+		// no new followers from now on
+		if (data->dedup_params && g_hash_table_lookup(srv->rpc->in_flight, data) == data)
+			g_hash_table_remove(srv->rpc->in_flight, data);
 	}
 
-	if (data->callback && (!is_startup_shutdown || data->cb_on_startup_shutdown))
-		data->callback(return_value, error, data->user_data);
+	deliver_response(data, return_value, error, is_startup_shutdown);
+
+	followers = data->followers;
+	data->followers = NULL;
+	foreach_slist(item, followers)
+	{
+		CallbackData *follower = item->data;
+
+		deliver_response(follower, return_value, error, is_startup_shutdown);
+		free_callback_data(follower);
+	}
+	g_slist_free(followers);
+
+	lsp_timing_stall_end("response", data->method_name,
+		return_value ? g_variant_get_size(return_value) : 0, stall_time);
+
+	free_callback_data(data);
+
+	// the callback might have stopped the server
+	srv = g_hash_table_lookup(client_table, client);
+	if (srv && background)
+	{
+		srv->rpc->background_requests--;
+		send_background_requests(srv);
+	}
+}
+
+
+#ifdef JSONRPC_CLIENT_REPLY_FUNC
+// called directly by the read loop of the client without a GTask per request
+static void reply_cb(JsonrpcClient *client, GVariant *reply, const GError *error, gpointer user_data)
+{
+	GError *err = error ? g_error_copy(error) : NULL;
+
+	handle_response(client, user_data, reply, err);
+
+	if (err)
+		g_error_free(err);
+}
+#else
+static void call_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	JsonrpcClient *client = (JsonrpcClient *)source_object;
+	GVariant *return_value = NULL;
+	GError *error = NULL;
+
+	jsonrpc_client_call_finish(client, res, &return_value, &error);
+
+	handle_response(client, user_data, return_value, error);
 
 	if (return_value)
 		g_variant_unref(return_value);
 
 	if (error)
 		g_error_free(error);
+}
+#endif
 
-	g_date_time_unref(data->req_time);
-	g_free(data->method_name);
-	g_free(data);
+
+static void send_cancel_request(LspServer *srv, CallbackData *data)
+{
+	GVariant *node = JSONRPC_MESSAGE_NEW(
+		"id", JSONRPC_MESSAGE_PUT_INT64(data->id)
+	);
+
+	lsp_rpc_notify(srv, "$/cancelRequest", node, NULL, NULL);
+	g_variant_unref(node);
 }
 
 
-static void call_full(LspServer *srv, const gchar *method, GVariant *params,
+/* The callbacks of the request and its followers are called with an error
+ * right away - a later response is ignored. The CallbackData stays alive until
+ * jsonrpc-glib finishes the call. */
+static gboolean request_timeout_cb(gpointer user_data)
+{
+	CallbackData *data = user_data;
+	LspServer *srv = g_hash_table_lookup(client_table, data->client);
+	gboolean background = data->background;
+	// as in deliver_response(), callbacks aren't called during startup and shutdown
+	gboolean is_startup_shutdown = srv ? srv->startup_shutdown : TRUE;
+	// lsp_rpc_cancel() promises the G_IO_ERROR_CANCELLED error
+	gboolean cancelled = g_cancellable_is_cancelled(data->cancellable);
+	GError *cancel_error = NULL;
+	GError *error;
+	GSList *followers, *item;
+
+	data->timeout_source = 0;
+	lsp_trace_request('n', data->handle, "timed out", NULL, data->method_name, data->uri);
+
+	if (srv)
+		record_timeout(srv, data->method_name);
+
+	if (!cancelled)
+	{
+		g_cancellable_cancel(data->cancellable);
+		if (srv && data->dedup_params && g_hash_table_lookup(srv->rpc->in_flight, data) == data)
+			g_hash_table_remove(srv->rpc->in_flight, data);
+		if (srv && data->id)
+			send_cancel_request(srv, data);
+	}
+
+	g_cancellable_set_error_if_cancelled(data->cancellable, &cancel_error);
+	error = g_error_new(G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "%s timed out", data->method_name);
+
+	// the slot of a hung request is given to the next one
+	if (background)
+	{
+		data->background = FALSE;
+		if (srv)
+			srv->rpc->background_requests--;
+	}
+
+	followers = data->followers;
+	data->followers = NULL;
+
+	if (data->callback && (!is_startup_shutdown || data->cb_on_startup_shutdown))
+		data->callback(NULL, cancelled ? cancel_error : error, data->user_data);
+	data->callback = NULL;
+
+	foreach_slist(item, followers)
+	{
+		CallbackData *follower = item->data;
+
+		if (follower->callback && (!is_startup_shutdown || follower->cb_on_startup_shutdown))
+			follower->callback(NULL, error, follower->user_data);
+		free_callback_data(follower);
+	}
+	g_slist_free(followers);
+
+	if (cancel_error)
+		g_error_free(cancel_error);
+	g_error_free(error);
+
+	// the callbacks might have stopped the server
+	srv = g_hash_table_lookup(client_table, data->client);
+	if (srv && background)
+		send_background_requests(srv);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+// in milliseconds, 0 when unlimited
+static gint get_request_timeout(LspServer *srv, const gchar *method)
+{
+	gchar **timeouts = srv->config.request_timeouts;
+	guint i;
+
+	for (i = 0; timeouts && timeouts[i] && timeouts[i+1]; i += 2)
+	{
+		if (g_strcmp0(timeouts[i], method) == 0)
+			return atoi(timeouts[i+1]);
+	}
+
+	return srv->config.request_timeout;
+}
+
+
+static CallbackData *new_callback_data(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gboolean cb_on_startup_shutdown, gpointer user_data)
 {
-	CallbackData *data = g_new0(CallbackData, 1);
+	const gchar *uri = NULL;
+	CallbackData *data;
 
-	data->method_name = g_strdup(method);
+	if (!request_table)
+		request_table = g_hash_table_new(NULL, NULL);
+
+	data = g_slice_new0(CallbackData);
+	data->method_name = g_intern_string(method);
 	data->user_data = user_data;
 	data->callback = callback;
-	data->req_time = g_date_time_new_now_local();
 	data->cb_on_startup_shutdown = cb_on_startup_shutdown;
+	data->client = srv->rpc->client;
+	data->cancellable = g_cancellable_new();
+
+	if (params)
+	{
+		JSONRPC_MESSAGE_PARSE(params,
+			"textDocument", "{",
+				"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
+			"}");
+	}
+	data->uri = g_strdup(uri);
+
+	// 0 is never a valid handle
+	if (++last_request_handle == 0)
+		last_request_handle++;
+	data->handle = last_request_handle;
+	g_hash_table_insert(request_table, GUINT_TO_POINTER(data->handle), data);
+
+	// until sent, the request may wait in the background queue
+	lsp_trace_request('b', data->handle, method, trace_server(srv), method, data->uri);
+
+	return data;
+}
+
+
+static void send_request(LspServer *srv, CallbackData *data, GVariant *params)
+{
+#ifndef JSONRPC_CLIENT_REPLY_FUNC
+	GVariant *id = NULL;
+#endif
+
+	// make sure the server sees all edits before answering anything
+	if (!srv->startup_shutdown)
+		lsp_sync_flush_pending_changes(srv, NULL);
+
+	data->req_time = g_get_monotonic_time();
+
+	/* Identical document requests sent since the last change of the document
+	 * get the same answer - wait for the request already sent instead */
+	if (data->uri && !srv->startup_shutdown)
+	{
+		CallbackData *primary;
+
+		data->dedup_params = params ? g_variant_ref(params) : g_variant_ref_sink(g_variant_new("()"));
+
+		primary = g_hash_table_lookup(srv->rpc->in_flight, data);
+		if (primary)
+		{
+			gchar *msg = g_strconcat(data->method_name, " (shared with pending request)", NULL);
+
+			lsp_log(srv->log, LspLogClientMessageSent, msg, params, NULL, 0);
+			g_free(msg);
+
+			data->primary = primary;
+			primary->followers = g_slist_append(primary->followers, data);
+			lsp_trace_request('n', data->handle, "shared with pending request", NULL,
+				data->method_name, data->uri);
+			return;
+		}
+
+		g_hash_table_add(srv->rpc->in_flight, data);
+	}
+
+	if (data->background)
+		srv->rpc->background_requests++;
 
-	lsp_log(srv->log, LspLogClientMessageSent, method, params, NULL, NULL);
+	record_sent(srv, data->method_name, params, 0);
 
-	jsonrpc_client_call_async(srv->rpc->client, method, params, NULL, call_cb, data);
+	lsp_log(srv->log, LspLogClientMessageSent, data->method_name, params, NULL, 0);
+	lsp_trace_request('n', data->handle, "sent", NULL, data->method_name, data->uri);
+
+	/* our cancellable isn't passed to jsonrpc-glib - cancelling a partially
+	 * written message would corrupt the stream */
+#ifdef JSONRPC_CLIENT_REPLY_FUNC
+	jsonrpc_client_call_with_reply_func(srv->rpc->client, data->method_name, params, &data->id,
+		reply_cb, data);
+	if (data->id && srv->rpc->capture)
+	{
+		GVariant *id = g_variant_take_ref(g_variant_new_int64(data->id));
+
+		lsp_capture_message(srv->rpc->capture, LspCaptureClientRequest, data->method_name,
+			id, params, NULL);
+		g_variant_unref(id);
+	}
+#else
+	jsonrpc_client_call_with_id_async(srv->rpc->client, data->method_name, params, &id,
+		NULL, call_cb, data);
+	if (id)
+	{
+		data->id = g_variant_get_int64(id);
+		lsp_capture_message(srv->rpc->capture, LspCaptureClientRequest, data->method_name,
+			id, params, NULL);
+		g_variant_unref(id);
+	}
+#endif
+
+	// initialize and shutdown have no limit, nothing works without them anyway
+	if (!data->cb_on_startup_shutdown)
+	{
+		gint timeout = get_request_timeout(srv, data->method_name);
+
+		if (timeout > 0)
+			data->timeout_source = plugin_timeout_add(geany_plugin, timeout, request_timeout_cb, data);
+	}
 }
 
 
-void lsp_rpc_call(LspServer *srv, const gchar *method, GVariant *params,
+static LspRpcRequest call_full(LspServer *srv, const gchar *method, GVariant *params,
+	LspRpcCallback callback, gboolean cb_on_startup_shutdown, gpointer user_data)
+{
+	CallbackData *data = new_callback_data(srv, method, params, callback, cb_on_startup_shutdown, user_data);
+	LspRpcRequest handle = data->handle;
+
+	send_request(srv, data, params);
+
+	return handle;
+}
+
+
+/* Sends $/cancelRequest for a request returned by lsp_rpc_call() that hasn't
+ * been answered yet. Its callback is still called, always with the
+ * G_IO_ERROR_CANCELLED error. Unknown or finished requests are ignored. */
+void lsp_rpc_cancel(LspRpcRequest request)
+{
+	CallbackData *data;
+	LspServer *srv;
+
+	if (request == 0 || !request_table)
+		return;
+
+	data = g_hash_table_lookup(request_table, GUINT_TO_POINTER(request));
+	if (!data || g_cancellable_is_cancelled(data->cancellable))
+		return;
+
+	srv = g_hash_table_lookup(client_table, data->client);
+
+	if (!data->req_time)
+	{
+		// still waiting in the background queue
+		if (srv)
+			g_queue_remove(srv->rpc->background_queue, data);
+		complete_cancelled(data);
+		return;
+	}
+
+	if (data->primary)
+	{
+		data->primary->followers = g_slist_remove(data->primary->followers, data);
+		complete_cancelled(data);
+		return;
+	}
+
+	record_cancelled(data->client, data->method_name);
+	g_cancellable_cancel(data->cancellable);
+
+	// others still wait for the response
+	if (data->followers)
+		return;
+
+	// the server may answer with an error now
+	if (srv && data->dedup_params && g_hash_table_lookup(srv->rpc->in_flight, data) == data)
+		g_hash_table_remove(srv->rpc->in_flight, data);
+
+	if (srv && data->id)
+		send_cancel_request(srv, data);
+}
+
+
+LspRpcRequest lsp_rpc_call(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gpointer user_data)
 {
-	call_full(srv, method, params, callback, FALSE, user_data);
+	return call_full(srv, method, params, callback, FALSE, user_data);
+}
+
+
+/* Requests whose results aren't waited for by the user, like semantic tokens
+ * or code lens. At most MAX_BACKGROUND_REQUESTS of them are sent at the same
+ * time so they don't delay interactive requests and a queued request is
+ * replaced by a newer one with the same method for the same document (its
+ * callback is called with the G_IO_ERROR_CANCELLED error). */
+LspRpcRequest lsp_rpc_call_background(LspServer *srv, const gchar *method, GVariant *params,
+	LspRpcCallback callback, gpointer user_data)
+{
+	CallbackData *data = new_callback_data(srv, method, params, callback, FALSE, user_data);
+	LspRpcRequest handle = data->handle;
+	GList *link, *next;
+
+	data->background = TRUE;
+	data->params = params ? g_variant_ref(params) : NULL;
+
+	for (link = srv->rpc->background_queue->head; link && data->uri; link = next)
+	{
+		CallbackData *queued = link->data;
+
+		next = link->next;
+		if (g_strcmp0(queued->method_name, method) == 0 && g_strcmp0(queued->uri, data->uri) == 0)
+		{
+			g_queue_delete_link(srv->rpc->background_queue, link);
+			complete_cancelled(queued);
+		}
+	}
+
+	g_queue_push_tail(srv->rpc->background_queue, data);
+	send_background_requests(srv);
+
+	return handle;
 }
 
 
@@ -514,6 +1414,52 @@ void lsp_rpc_call_startup_shutdown(LspServer *srv, const gchar *method, GVariant
 }
 
 
+/* Requests are identical when method, document and params match - only the
+ * strings are hashed, params get compared just on collisions */
+static guint in_flight_hash(gconstpointer key)
+{
+	const CallbackData *data = key;
+
+	return g_str_hash(data->method_name) ^ g_str_hash(data->uri);
+}
+
+
+static gboolean in_flight_equal(gconstpointer a, gconstpointer b)
+{
+	const CallbackData *data1 = a;
+	const CallbackData *data2 = b;
+
+	return g_strcmp0(data1->method_name, data2->method_name) == 0 &&
+		g_strcmp0(data1->uri, data2->uri) == 0 &&
+		g_variant_equal(data1->dedup_params, data2->dedup_params);
+}
+
+
+static gboolean has_uri(gpointer key, gpointer value, gpointer user_data)
+{
+	CallbackData *data = value;
+	return g_strcmp0(data->uri, user_data) == 0;
+}
+
+
+// pending requests for documents that change can't be shared any more
+static void forget_in_flight_requests(LspServer *srv, const gchar *method, GVariant *params)
+{
+	const gchar *uri = NULL;
+
+	if (!g_str_has_prefix(method, "textDocument/did") || g_hash_table_size(srv->rpc->in_flight) == 0)
+		return;
+
+	JSONRPC_MESSAGE_PARSE(params,
+		"textDocument", "{",
+			"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
+		"}");
+
+	if (uri)
+		g_hash_table_foreach_remove(srv->rpc->in_flight, has_uri, (gpointer)uri);
+}
+
+
 static void notify_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
 	JsonrpcClient *client = (JsonrpcClient *)source_object;
@@ -532,7 +1478,7 @@ static void notify_cb(GObject *source_object, GAsyncResult *res, gpointer user_d
 	if (error)
 		g_error_free(error);
 
-	g_free(data);
+	g_slice_free(CallbackData, data);
 }
 
 
@@ -540,13 +1486,16 @@ void lsp_rpc_notify(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gpointer user_data)
 {
 	gboolean params_added = FALSE;
-	CallbackData *data = g_new0(CallbackData, 1);
+	CallbackData *data = g_slice_new0(CallbackData);
 
 	data->user_data = user_data;
 	data->callback = callback;
 
 	lsp_log(srv->log, LspLogClientNotificationSent,
-		method, params, NULL, NULL);
+		method, params, NULL, 0);
+
+	if (params)
+		forget_in_flight_requests(srv, method, params);
 
 	/* Two hacks in one:
 	 * 1. some servers (e.g. gopls) require that the params member is present
@@ -565,6 +1514,8 @@ void lsp_rpc_notify(LspServer *srv, const gchar *method, GVariant *params,
 		params_added = TRUE;
 	}
 
+	record_sent(srv, method, params, 0);
+	lsp_capture_message(srv->rpc->capture, LspCaptureClientNotification, method, NULL, params, NULL);
 	jsonrpc_client_send_notification_async(srv->rpc->client, method, params, NULL, notify_cb, data);
 
 	if (params_added)
@@ -572,6 +1523,80 @@ void lsp_rpc_notify(LspServer *srv, const gchar *method, GVariant *params,
 }
 
 
+#ifndef JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER
+// system jsonrpc-glib without text payload support - put the text into params
+static GVariant *replace_text_placeholder(GVariant *variant, const gchar *text, gsize text_len)
+{
+	if (g_variant_is_of_type(variant, G_VARIANT_TYPE_STRING))
+	{
+		if (g_strcmp0(g_variant_get_string(variant, NULL), LSP_RPC_TEXT_PLACEHOLDER) == 0)
+			return g_variant_take_ref(g_variant_new_take_string(g_strndup(text, text_len)));
+	}
+	else if (g_variant_is_container(variant))
+	{
+		GVariantBuilder builder;
+		GVariantIter iter;
+		GVariant *child;
+
+		g_variant_builder_init(&builder, g_variant_get_type(variant));
+		g_variant_iter_init(&iter, variant);
+		while ((child = g_variant_iter_next_value(&iter)))
+		{
+			GVariant *new_child = replace_text_placeholder(child, text, text_len);
+
+			g_variant_builder_add_value(&builder, new_child);
+			g_variant_unref(new_child);
+			g_variant_unref(child);
+		}
+
+		return g_variant_take_ref(g_variant_builder_end(&builder));
+	}
+
+	return g_variant_ref(variant);
+}
+#endif
+
+
+/* Avoids copying large strings like document contents several times -
+ * params contain LSP_RPC_TEXT_PLACEHOLDER in place of the text which is
+ * escaped directly into the output buffer. The text has to be valid only
+ * during the call. */
+void lsp_rpc_notify_with_text(LspServer *srv, const gchar *method, GVariant *params,
+	const gchar *text, gsize text_len)
+{
+	CallbackData *data = g_slice_new0(CallbackData);
+
+	lsp_log(srv->log, LspLogClientNotificationSent,
+		method, params, NULL, 0);
+
+	forget_in_flight_requests(srv, method, params);
+	record_sent(srv, method, params, text_len);
+	lsp_capture_message_with_text(srv->rpc->capture, method, params, LSP_RPC_TEXT_PLACEHOLDER,
+		text, text_len);
+
+#ifdef JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER
+	jsonrpc_client_send_notification_with_text_async(srv->rpc->client, method, params,
+		text, text_len, NULL, notify_cb, data);
+#else
+	params = replace_text_placeholder(params, text, text_len);
+	jsonrpc_client_send_notification_async(srv->rpc->client, method, params, NULL, notify_cb, data);
+	g_variant_unref(params);
+#endif
+}
+
+
+/* Whether messages pile up in the output queue because the server doesn't read
+ * them fast enough */
+gboolean lsp_rpc_is_output_congested(LspServer *srv)
+{
+#ifdef JSONRPC_CLIENT_PENDING_OUTPUT_SIZE
+	return srv->rpc && jsonrpc_client_get_pending_output_size(srv->rpc->client) >= OUTPUT_CONGESTION_SIZE;
+#else
+	return FALSE;
+#endif
+}
+
+
 LspRpc *lsp_rpc_new(LspServer *srv, GIOStream *stream)
 {
 	LspRpc *c = g_new0(LspRpc, 1);
@@ -580,9 +1605,19 @@ LspRpc *lsp_rpc_new(LspServer *srv, GIOStream *stream)
 		client_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
 
 	c->client = jsonrpc_client_new(stream);
+	if (srv->config.rpc_max_message_size > 0)
+		jsonrpc_client_set_max_message_size(c->client,
+			(gsize)srv->config.rpc_max_message_size * 1024 * 1024);
+	c->background_queue = g_queue_new();
+	c->in_flight = g_hash_table_new(in_flight_hash, in_flight_equal);
+	c->stats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	c->last_activity = g_get_monotonic_time();
+	if (!EMPTY(srv->config.rpc_capture))
+		c->capture = lsp_capture_start(srv->config.rpc_capture, srv->config.cmd);
 	g_hash_table_insert(client_table, c->client, srv);
 	g_signal_connect(c->client, "handle-call", G_CALLBACK(handle_call), NULL);
 	g_signal_connect(c->client, "notification", G_CALLBACK(handle_notification), NULL);
+	g_signal_connect(c->client, "failed", G_CALLBACK(handle_failed), NULL);
 	jsonrpc_client_start_listening(c->client);
 
 	return c;
@@ -592,6 +1627,11 @@ LspRpc *lsp_rpc_new(LspServer *srv, GIOStream *stream)
 void lsp_rpc_destroy(LspRpc *rpc)
 {
 	g_hash_table_remove(client_table, rpc->client);
+	// like for sent requests, callbacks aren't called during shutdown
+	g_queue_free_full(rpc->background_queue, (GDestroyNotify)free_callback_data);
+	g_hash_table_destroy(rpc->in_flight);
+	g_hash_table_destroy(rpc->stats);
+	lsp_capture_stop(rpc->capture);
 	jsonrpc_client_close(rpc->client, NULL, NULL);
 	g_object_unref(rpc->client);
 	g_free(rpc);
@@ -22,9 +22,25 @@
 
 #include "lsp-server.h"
 
+#include <jsonrpc-glib.h>
+#include <json-glib/json-glib.h>
+
+
+// string value inside params of lsp_rpc_notify_with_text() replaced by the text
+#ifdef JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER
+# define LSP_RPC_TEXT_PLACEHOLDER JSONRPC_OUTPUT_STREAM_TEXT_PLACEHOLDER
+#else
+# define LSP_RPC_TEXT_PLACEHOLDER "@!^%TEXT"
+#endif
+
+// debounce used until the latency of a method is known
+#define LSP_RPC_DEFAULT_DEBOUNCE 300
 
 typedef void (*LspRpcCallback) (GVariant *return_value, GError *error, gpointer user_data);
 
+// identifies a pending request, 0 is never used for a valid request
+typedef guint LspRpcRequest;
+
 
 struct LspRpc;
 typedef struct LspRpc LspRpc;
@@ -33,8 +49,11 @@ typedef struct LspRpc LspRpc;
 LspRpc *lsp_rpc_new(LspServer *srv, GIOStream *stream);
 void lsp_rpc_destroy(LspRpc *rpc);
 
-void lsp_rpc_call(LspServer *srv, const gchar *method, GVariant *params,
+LspRpcRequest lsp_rpc_call(LspServer *srv, const gchar *method, GVariant *params,
+	LspRpcCallback callback, gpointer user_data);
+LspRpcRequest lsp_rpc_call_background(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gpointer user_data);
+void lsp_rpc_cancel(LspRpcRequest request);
 
 void lsp_rpc_call_startup_shutdown(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gpointer user_data);
@@ -42,5 +61,17 @@ void lsp_rpc_call_startup_shutdown(LspServer *srv, const gchar *method, GVariant
 void lsp_rpc_notify(LspServer *srv, const gchar *method, GVariant *params,
 	LspRpcCallback callback, gpointer user_data);
 
+void lsp_rpc_notify_with_text(LspServer *srv, const gchar *method, GVariant *params,
+	const gchar *text, gsize text_len);
+
+gboolean lsp_rpc_is_output_congested(LspServer *srv);
+gboolean lsp_rpc_is_degraded(LspServer *srv);
+
+gint64 lsp_rpc_get_last_activity(LspRpc *rpc);
+gint lsp_rpc_get_debounce(LspServer *srv, const gchar **methods);
+
+void lsp_rpc_append_statistics(LspRpc *rpc, GString *str);
+void lsp_rpc_append_metrics(LspRpc *rpc, JsonBuilder *builder);
+
 
 #endif  /* LSP_RPC_H */
@@ -0,0 +1,436 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Code actions and formatting performed on save. The file is saved as it is
+ * first, then matching code actions are requested once, the ones that need it
+ * are resolved in parallel and their edits are applied together, followed by
+ * formatting and the final save. Results arriving after on_save_timeout are
+ * ignored. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-save.h"
+#include "lsp-command.h"
+#include "lsp-format.h"
+#include "lsp-utils.h"
+
+#include <string.h>
+
+#define SAVE_PIPELINE_KEY "lsp_save_pipeline"
+
+// code actions overlapping already applied ones are requested again at most
+// this many times
+#define MAX_ROUNDS 3
+
+
+typedef struct
+{
+	gint refcount;
+	GeanyDocument *doc;
+	guint doc_id;
+	gboolean finished;
+	guint timeout_source;
+	guint round;
+	gboolean retry;  // some code actions conflicted with others and weren't performed
+	guint pending;  // unresolved code actions
+	GPtrArray *actions;  // GPtrArray<LspCommand> received from the server
+	GPtrArray *resolved;  // LspCommand returned by codeAction/resolve
+	GPtrArray *selected;  // LspCommand to perform in the received order, NULL when dropped
+	guint next_command;
+	GPtrArray *performed;  // titles of performed code actions
+} SavePipeline;
+
+
+typedef struct
+{
+	SavePipeline *pipeline;
+	guint index;
+} ResolveRequest;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+
+static void request_code_actions(SavePipeline *p);
+
+
+static SavePipeline *pipeline_ref(SavePipeline *p)
+{
+	p->refcount++;
+	return p;
+}
+
+
+static void pipeline_unref(SavePipeline *p)
+{
+	if (--p->refcount > 0)
+		return;
+
+	if (p->actions)
+		g_ptr_array_free(p->actions, TRUE);
+	g_ptr_array_free(p->resolved, TRUE);
+	g_ptr_array_free(p->selected, TRUE);
+	g_ptr_array_free(p->performed, TRUE);
+	g_free(p);
+}
+
+
+// FALSE after timeout or when the document was closed
+static gboolean is_active(SavePipeline *p)
+{
+	return !p->finished && DOC_VALID(p->doc) && p->doc->id == p->doc_id &&
+		plugin_get_document_data(geany_plugin, p->doc, SAVE_PIPELINE_KEY) == p;
+}
+
+
+static void finish(SavePipeline *p)
+{
+	gboolean active = is_active(p);
+
+	if (p->finished)
+		return;
+	p->finished = TRUE;
+
+	if (p->timeout_source)
+	{
+		g_source_remove(p->timeout_source);
+		p->timeout_source = 0;
+		pipeline_unref(p);
+	}
+
+	if (active)
+	{
+		// save file at the end because the intermediate updates modified the
+		// file; the pipeline data is still set so this save doesn't start
+		// another pipeline
+		document_save_file(p->doc, FALSE);
+		plugin_set_document_data(geany_plugin, p->doc, SAVE_PIPELINE_KEY, NULL);
+	}
+}
+
+
+static gboolean on_timeout(gpointer user_data)
+{
+	SavePipeline *p = user_data;
+
+	p->timeout_source = 0;
+	if (is_active(p))
+		msgwin_status_add(_("LSP server didn't finish on-save actions in time, saving the file as it is"));
+	finish(p);
+	pipeline_unref(p);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void on_format_done(gpointer user_data)
+{
+	SavePipeline *p = user_data;
+
+	if (is_active(p))
+		finish(p);
+	pipeline_unref(p);
+}
+
+
+static void format_document(SavePipeline *p)
+{
+	LspServer *srv = lsp_server_get_if_running(p->doc);
+	LspServer *format_srv = lsp_server_get_for_formatting(srv);
+
+	if (srv && format_srv->config.document_formatting_enable && srv->config.format_on_save)
+		lsp_format_perform(p->doc, TRUE, on_format_done, pipeline_ref(p));
+	else
+		finish(p);
+}
+
+
+static void perform_next_command(SavePipeline *p);
+
+static void on_command_performed(gpointer user_data)
+{
+	SavePipeline *p = user_data;
+
+	if (is_active(p))
+		perform_next_command(p);
+	pipeline_unref(p);
+}
+
+
+// commands are executed by the server which sends the edits back using
+// workspace/applyEdit - they have to run one after another
+static void perform_next_command(SavePipeline *p)
+{
+	LspServer *srv = lsp_server_get_if_running(p->doc);
+
+	while (srv && p->next_command < p->selected->len)
+	{
+		LspCommand *cmd = p->selected->pdata[p->next_command++];
+
+		if (cmd && cmd->command)
+		{
+			lsp_command_perform(srv, cmd, on_command_performed, pipeline_ref(p));
+			return;
+		}
+	}
+
+	if (p->retry && p->round < MAX_ROUNDS)
+		request_code_actions(p);
+	else
+		format_document(p);
+}
+
+
+static void apply_code_actions(SavePipeline *p)
+{
+	LspServer *srv = lsp_server_get_if_running(p->doc);
+	GPtrArray *edits = g_ptr_array_new();
+	GArray *edit_actions = g_array_new(FALSE, FALSE, sizeof(guint));
+	LspCommand *cmd;
+	guint i;
+
+	foreach_ptr_array(cmd, i, p->selected)
+	{
+		if (cmd && cmd->edit)
+		{
+			g_ptr_array_add(edits, cmd->edit);
+			g_array_append_val(edit_actions, i);
+		}
+	}
+
+	p->retry = FALSE;
+	if (srv && edits->len > 0)
+	{
+		GArray *skipped = g_array_new(FALSE, FALSE, sizeof(guint));
+		GVariant *merged = lsp_utils_merge_workspace_edits(edits, skipped);
+
+		lsp_utils_apply_workspace_edit_full(merged, srv->position_encoding, NULL, NULL);
+		g_variant_unref(merged);
+
+		// conflicting code actions aren't performed now - they are requested
+		// again for the modified document once the commands finish
+		for (i = 0; i < skipped->len; i++)
+		{
+			guint edit_index = g_array_index(skipped, guint, i);
+
+			p->selected->pdata[g_array_index(edit_actions, guint, edit_index)] = NULL;
+			p->retry = TRUE;
+		}
+		g_array_free(skipped, TRUE);
+	}
+	g_ptr_array_free(edits, TRUE);
+	g_array_free(edit_actions, TRUE);
+
+	foreach_ptr_array(cmd, i, p->selected)
+	{
+		if (!cmd)
+			continue;
+
+		// save the performed title so it isn't performed in the next round
+		g_ptr_array_add(p->performed, g_strdup(cmd->title));
+
+		// edits are applied, perform_next_command() only executes commands
+		if (cmd->edit)
+			g_variant_unref(cmd->edit);
+		cmd->edit = NULL;
+	}
+
+	p->next_command = 0;
+	perform_next_command(p);
+}
+
+
+static void on_code_action_resolved(LspCommand *cmd, gpointer user_data)
+{
+	ResolveRequest *req = user_data;
+	SavePipeline *p = req->pipeline;
+
+	if (cmd && is_active(p) && (cmd->command || cmd->edit))
+	{
+		g_ptr_array_add(p->resolved, cmd);
+		p->selected->pdata[req->index] = cmd;
+	}
+	else if (cmd)
+		lsp_command_free(cmd);
+
+	// actions that failed to resolve stay NULL
+	p->pending--;
+	if (p->pending == 0 && is_active(p))
+		apply_code_actions(p);
+
+	pipeline_unref(p);
+	g_free(req);
+}
+
+
+static gboolean action_matches(LspServer *srv, LspCommand *cmd)
+{
+	gchar **kind;
+
+	if (!EMPTY(srv->config.command_on_save_regex) &&
+		g_regex_match_simple(srv->config.command_on_save_regex, cmd->title, G_REGEX_CASELESS, G_REGEX_MATCH_NOTEMPTY))
+		return TRUE;
+
+	if (cmd->kind && srv->config.command_on_save_kinds)
+	{
+		foreach_strv(kind, srv->config.command_on_save_kinds)
+		{
+			gsize len = strlen(*kind);
+
+			// kinds are hierarchical - "source" matches "source.organizeImports"
+			if (len > 0 && strncmp(cmd->kind, *kind, len) == 0 &&
+				(cmd->kind[len] == '\0' || cmd->kind[len] == '.'))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+static gboolean was_performed(SavePipeline *p, LspCommand *cmd)
+{
+	gchar *title;
+	guint i;
+
+	foreach_ptr_array(title, i, p->performed)
+	{
+		if (g_strcmp0(cmd->title, title) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+static gboolean on_code_actions_received(GPtrArray *actions, gpointer user_data)
+{
+	SavePipeline *p = user_data;
+	LspServer *srv = lsp_server_get_if_running(p->doc);
+	GPtrArray *to_resolve;
+	LspCommand *cmd;
+	guint i;
+
+	if (!is_active(p) || !srv)
+	{
+		if (is_active(p))
+			finish(p);
+		pipeline_unref(p);
+		return TRUE;
+	}
+
+	if (p->actions)
+		g_ptr_array_free(p->actions, TRUE);
+	p->actions = actions;
+	g_ptr_array_set_size(p->selected, 0);
+	to_resolve = g_ptr_array_new();
+
+	foreach_ptr_array(cmd, i, actions)
+	{
+		if (was_performed(p, cmd) || !action_matches(srv, cmd))
+			continue;
+
+		if (!cmd->command && !cmd->edit)
+			g_ptr_array_add(to_resolve, GUINT_TO_POINTER(p->selected->len));
+		g_ptr_array_add(p->selected, cmd);
+	}
+
+	if (p->selected->len == 0)
+		format_document(p);
+	else if (to_resolve->len == 0)
+		apply_code_actions(p);
+	else
+	{
+		gpointer index;
+
+		// all resolved at the same time
+		p->pending = to_resolve->len;
+		foreach_ptr_array(index, i, to_resolve)
+		{
+			ResolveRequest *req = g_new0(ResolveRequest, 1);
+
+			req->pipeline = pipeline_ref(p);
+			req->index = GPOINTER_TO_UINT(index);
+			cmd = p->selected->pdata[req->index];
+			// replaced by the resolved action when it arrives
+			p->selected->pdata[req->index] = NULL;
+			lsp_command_resolve(srv, cmd, on_code_action_resolved, req);
+		}
+	}
+
+	g_ptr_array_free(to_resolve, TRUE);
+	pipeline_unref(p);
+
+	// owned by the pipeline now
+	return FALSE;
+}
+
+
+static void request_code_actions(SavePipeline *p)
+{
+	LspServer *srv = lsp_server_get_if_running(p->doc);
+
+	if (!srv)
+	{
+		finish(p);
+		return;
+	}
+
+	p->round++;
+	lsp_command_send_code_action_request_full(p->doc, sci_get_current_position(p->doc->editor->sci),
+		srv->config.command_on_save_kinds, on_code_actions_received, pipeline_ref(p));
+}
+
+
+gboolean lsp_save_in_progress(GeanyDocument *doc)
+{
+	return plugin_get_document_data(geany_plugin, doc, SAVE_PIPELINE_KEY) != NULL;
+}
+
+
+void lsp_save_perform(LspServer *srv, GeanyDocument *doc)
+{
+	gboolean actions = srv->config.code_action_enable &&
+		(!EMPTY(srv->config.command_on_save_regex) || srv->config.command_on_save_kinds);
+	gboolean format = srv->config.document_formatting_enable && srv->config.format_on_save;
+	SavePipeline *p;
+
+	if (!actions && !format)
+		return;
+
+	p = g_new0(SavePipeline, 1);
+	p->refcount = 1;  // owned by the document data
+	p->doc = doc;
+	p->doc_id = doc->id;
+	p->resolved = g_ptr_array_new_with_free_func((GDestroyNotify)lsp_command_free);
+	p->selected = g_ptr_array_new();
+	p->performed = g_ptr_array_new_with_free_func(g_free);
+	plugin_set_document_data_full(geany_plugin, doc, SAVE_PIPELINE_KEY, p, (GDestroyNotify)pipeline_unref);
+
+	if (srv->config.on_save_timeout > 0)
+		p->timeout_source = plugin_timeout_add(geany_plugin, srv->config.on_save_timeout,
+			on_timeout, pipeline_ref(p));
+
+	if (actions)
+		request_code_actions(p);
+	else
+		format_document(p);
+}
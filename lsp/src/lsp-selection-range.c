@@ -23,6 +23,7 @@
 #include "lsp-selection-range.h"
 #include "lsp-utils.h"
 #include "lsp-rpc.h"
+#include "lsp-sync.h"
 
 #include <jsonrpc-glib.h>
 
@@ -31,100 +32,95 @@ extern GeanyData *geany_data;
 
 typedef struct {
 	GeanyDocument *doc;
+	guint doc_id;
+	guint version;
+	gint pos;
 	gboolean expand;
 } SelectionRangeData;
 
 
-GPtrArray *selections = NULL;
+typedef struct {
+	gint start;
+	gint end;
+} SelectionRange;
 
 
-static gboolean is_within_range(ScintillaObject *sci, LspRange parent, LspRange child)
-{
-	gint parent_start_pos = lsp_utils_lsp_pos_to_scintilla(sci, parent.start);
-	gint parent_end_pos = lsp_utils_lsp_pos_to_scintilla(sci, parent.end);
-	gint child_start_pos = lsp_utils_lsp_pos_to_scintilla(sci, child.start);
-	gint child_end_pos = lsp_utils_lsp_pos_to_scintilla(sci, child.end);
-
-	return (parent_start_pos < child_start_pos && parent_end_pos >= child_end_pos) ||
-		(parent_start_pos <= child_start_pos && parent_end_pos > child_end_pos);
-}
+/* Selection ranges around pos, smallest first, valid for the given document
+ * version. Expanding and shrinking walks this chain without asking the
+ * server again until the document changes. */
+static struct {
+	guint doc_id;
+	guint version;
+	gint pos;
+	GArray *ranges;  // SelectionRange
+} chain;
 
 
-static LspRange get_current_selection(ScintillaObject *sci)
+// parent contains child and is bigger
+static gboolean is_within_range(SelectionRange *parent, SelectionRange *child)
 {
-	LspRange selection;
-	selection.start = lsp_utils_scintilla_pos_to_lsp(sci, sci_get_selection_start(sci));
-	selection.end = lsp_utils_scintilla_pos_to_lsp(sci, sci_get_selection_end(sci));
-	return selection;
+	return parent->start <= child->start && parent->end >= child->end &&
+		(parent->start != child->start || parent->end != child->end);
 }
 
 
-static gboolean is_max_selection(ScintillaObject *sci)
+static GArray *parse_chain(GVariant *val, ScintillaObject *sci)
 {
-	LspRange selection = get_current_selection(sci);
-	LspRange *max_selection;
-
-	if (!selections || selections->len == 0)
-		return FALSE;
+	GArray *ranges = g_array_new(FALSE, FALSE, sizeof(SelectionRange));
+	GVariant *current = g_variant_ref(val);
 
-	max_selection = selections->pdata[selections->len-1];
-
-	return max_selection->start.character == selection.start.character &&
-		max_selection->start.line == selection.start.line &&
-		max_selection->end.character == selection.end.character &&
-		max_selection->end.line == selection.end.line;
-}
+	while (current)
+	{
+		GVariant *range_variant = NULL;
+		GVariant *parent = NULL;
 
+		JSONRPC_MESSAGE_PARSE(current,
+			"range", JSONRPC_MESSAGE_GET_VARIANT(&range_variant));
 
-static void parse_selection(GVariant *val, ScintillaObject *sci, LspRange selection)
-{
-	GVariant *range_variant = NULL;
-	GVariant *parent = NULL;
+		if (range_variant)
+		{
+			LspRange parsed_range = lsp_utils_parse_range(range_variant);
+			SelectionRange range;
 
-	JSONRPC_MESSAGE_PARSE(val,
-		"range", JSONRPC_MESSAGE_GET_VARIANT(&range_variant));
+			range.start = lsp_utils_lsp_pos_to_scintilla(sci, parsed_range.start);
+			range.end = lsp_utils_lsp_pos_to_scintilla(sci, parsed_range.end);
 
-	if (range_variant)
-	{
-		LspRange parsed_range = lsp_utils_parse_range(range_variant);
+			// each parent should be bigger than its child, skip the ones that aren't
+			if (ranges->len == 0 ||
+				is_within_range(&range, &g_array_index(ranges, SelectionRange, ranges->len - 1)))
+				g_array_append_val(ranges, range);
 
-		if (is_within_range(sci, parsed_range, selection))
-		{
-			LspRange *range = g_new0(LspRange, 1);
-			*range = parsed_range;
-			g_ptr_array_add(selections, range);
+			g_variant_unref(range_variant);
 		}
 
-		g_variant_unref(range_variant);
-	}
-
-	JSONRPC_MESSAGE_PARSE(val,
-		"parent", JSONRPC_MESSAGE_GET_VARIANT(&parent));
+		JSONRPC_MESSAGE_PARSE(current,
+			"parent", JSONRPC_MESSAGE_GET_VARIANT(&parent));
 
-	if (parent)
-	{
-		parse_selection(parent, sci, selection);
-		g_variant_unref(parent);
+		g_variant_unref(current);
+		current = parent;
 	}
+
+	return ranges;
 }
 
 
-static LspRange *find_selection_range(ScintillaObject *sci, gboolean expand)
+static SelectionRange *find_selection_range(ScintillaObject *sci, gboolean expand)
 {
-	LspRange selection_range = get_current_selection(sci);;
-	LspRange *found_range = NULL;
-	LspRange *range;
-	gint i;
+	SelectionRange selection = {sci_get_selection_start(sci), sci_get_selection_end(sci)};
+	SelectionRange *found_range = NULL;
+	guint i;
 
 	// sorted from the smallest to the biggest
-	foreach_ptr_array(range, i, selections)
+	for (i = 0; i < chain.ranges->len; i++)
 	{
-		if (expand && is_within_range(sci, *range, selection_range))
+		SelectionRange *range = &g_array_index(chain.ranges, SelectionRange, i);
+
+		if (expand && is_within_range(range, &selection))
 		{
 			found_range = range;
 			break;
 		}
-		else if (!expand && is_within_range(sci, selection_range, *range))
+		else if (!expand && is_within_range(&selection, range))
 			found_range = range;
 	}
 
@@ -134,14 +130,25 @@ static LspRange *find_selection_range(ScintillaObject *sci, gboolean expand)
 
 static void find_and_select(ScintillaObject *sci, gboolean expand)
 {
-	LspRange *found_range = find_selection_range(sci, expand);
+	SelectionRange *found_range = find_selection_range(sci, expand);
 
 	if (found_range)
-	{
-		gint start = lsp_utils_lsp_pos_to_scintilla(sci, found_range->start);
-		gint end = lsp_utils_lsp_pos_to_scintilla(sci, found_range->end);
-		SSM(sci, SCI_SETSELECTION, start, end);
-	}
+		SSM(sci, SCI_SETSELECTION, found_range->start, found_range->end);
+}
+
+
+// the chain was received for this document version and the current selection
+static gboolean chain_usable(GeanyDocument *doc, guint version)
+{
+	ScintillaObject *sci = doc->editor->sci;
+
+	if (!chain.ranges || chain.doc_id != doc->id || chain.version != version)
+		return FALSE;
+
+	if (!sci_has_selection(sci))
+		return sci_get_current_position(sci) == chain.pos;
+
+	return sci_get_selection_start(sci) <= chain.pos && sci_get_selection_end(sci) >= chain.pos;
 }
 
 
@@ -153,26 +160,30 @@ static void goto_cb(GVariant *return_value, GError *error, gpointer user_data)
 	{
 		GeanyDocument *doc = data->doc;
 
-		if (DOC_VALID(doc) && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
+		if (DOC_VALID(doc) && doc->id == data->doc_id &&
+			g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
 		{
+			LspServer *srv = lsp_server_get_if_running(doc);
 			GVariant *val = NULL;
 			GVariantIter iter;
 
 			g_variant_iter_init(&iter, return_value);
 
-			while (g_variant_iter_loop(&iter, "v", &val))
+			// for single query just a single result
+			if (srv && lsp_sync_peek_doc_version(srv, doc) == data->version &&
+				g_variant_iter_loop(&iter, "v", &val))
 			{
-				LspRange selection = get_current_selection(doc->editor->sci);
-				LspRange *existing_range = g_new0(LspRange, 1);
-
-				*existing_range = selection;
-				g_ptr_array_add(selections, existing_range);
-
-				parse_selection(val, doc->editor->sci, selection);
-				break;  // for single query just a single result
+				if (chain.ranges)
+					g_array_free(chain.ranges, TRUE);
+				chain.ranges = parse_chain(val, doc->editor->sci);
+				chain.doc_id = data->doc_id;
+				chain.version = data->version;
+				chain.pos = data->pos;
+				g_variant_unref(val);
+
+				if (doc == document_get_current())
+					find_and_select(doc->editor->sci, data->expand);
 			}
-
-			find_and_select(doc->editor->sci, data->expand);
 		}
 
 		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
@@ -182,14 +193,6 @@ static void goto_cb(GVariant *return_value, GError *error, gpointer user_data)
 }
 
 
-void lsp_selection_clear_selections(void)
-{
-	if (selections)
-		g_ptr_array_free(selections, TRUE);
-	selections = NULL;
-}
-
-
 static void selection_range_request(gboolean expand)
 {
 	GeanyDocument *doc = document_get_current();
@@ -198,15 +201,16 @@ static void selection_range_request(gboolean expand)
 	LspPosition lsp_pos;
 	gchar *doc_uri;
 	GVariant *node;
+	guint version;
 	gint pos;
 
 	if (!server || !server->config.selection_range_enable)
 		return;
 
-	if (expand && is_max_selection(doc->editor->sci))
-		return;
-	else if (sci_has_selection(doc->editor->sci) && selections &&
-			find_selection_range(doc->editor->sci, expand))
+	version = lsp_sync_peek_doc_version(server, doc);
+
+	// also when there's nothing to expand to or shrink to within the chain
+	if (chain_usable(doc, version))
 	{
 		find_and_select(doc->editor->sci, expand);
 		return;
@@ -216,9 +220,6 @@ static void selection_range_request(gboolean expand)
 	lsp_pos = lsp_utils_scintilla_pos_to_lsp(doc->editor->sci, pos);
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
-	lsp_selection_clear_selections();
-	selections = g_ptr_array_new_full(1, g_free);
-
 	node = JSONRPC_MESSAGE_NEW (
 		"textDocument", "{",
 			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
@@ -231,6 +232,9 @@ static void selection_range_request(gboolean expand)
 
 	data = g_new0(SelectionRangeData, 1);
 	data->doc = doc;
+	data->doc_id = doc->id;
+	data->version = version;
+	data->pos = pos;
 	data->expand = expand;
 	lsp_rpc_call(server, "textDocument/selectionRange", node, goto_cb, data);
 
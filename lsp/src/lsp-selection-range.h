@@ -27,7 +27,5 @@
 void lsp_selection_range_expand(void);
 void lsp_selection_range_shrink(void);
 
-void lsp_selection_clear_selections(void);
-
 
 #endif  /* LSP_SELECTION_RANGE_H */
@@ -22,17 +22,34 @@
 
 #include "lsp-semtokens.h"
 #include "lsp-utils.h"
+#include "lsp-doc-state.h"
 #include "lsp-rpc.h"
 #include "lsp-sync.h"
+#include "lsp-disk-cache.h"
+#include "lsp-timing.h"
 
 #include <jsonrpc-glib.h>
 
-#define CACHE_KEY "lsp_semtokens_key"
+#include <stdlib.h>
+#include <string.h>
 
+// the 5 integers of a token in the order of the LSP encoding
+typedef struct {
+	guint delta_line;
+	guint delta_start;
+	guint length;
+	guint token_type;
+	guint token_modifiers;
+} SemanticToken;
+
+#define TOKEN_INTS (sizeof(SemanticToken) / sizeof(guint))
+
+// offsets are in integers as used by the LSP edits
 typedef struct {
 	guint start;
 	guint delete_count;
-	GArray *data;
+	guint data_offset;  // inside the array shared by all edits
+	guint data_len;
 } SemanticTokensEdit;
 
 
@@ -40,15 +57,34 @@ extern GeanyPlugin *geany_plugin;
 
 extern GeanyData *geany_data;
 
+/* Token highlighted in the editor; the positions follow document
+ * modifications */
+typedef struct {
+	gint start;
+	gint end;
+	const gchar *word;  // key in CachedData.keywords
+	gboolean damaged;  // modified since highlighted
+} AppliedToken;
+
 typedef struct {
 	GArray *tokens;
 	gchar *tokens_str;
 	gchar *result_id;
+	GArray *applied;  // AppliedToken sorted by position
+	GHashTable *keywords;  // word -> number of its tokens
 } CachedData;
 
+typedef struct {
+	GeanyDocument *doc;
+	guint version;
+	gboolean viewport;  // range of the visible lines sent before the full request
+} LspSemtokensData;
+
 
 static gint style_index;
 
+static guint viewport_source = 0;
+
 static guint keyword_hash = 0;
 
 
@@ -57,10 +93,31 @@ static void cached_data_free(CachedData *data)
 	g_array_free(data->tokens, TRUE);
 	g_free(data->tokens_str);
 	g_free(data->result_id);
+	if (data->applied)
+		g_array_free(data->applied, TRUE);
+	if (data->keywords)
+		g_hash_table_destroy(data->keywords);
 	g_free(data);
 }
 
 
+static CachedData *get_cache(GeanyDocument *doc)
+{
+	return lsp_doc_state_get(doc)->semtokens;
+}
+
+
+static void set_cache(GeanyDocument *doc, CachedData *data)
+{
+	LspDocState *state = lsp_doc_state_get(doc);
+
+	if (state->semtokens)
+		cached_data_free(state->semtokens);
+	state->semtokens = data;
+	state->semtokens_free = (GDestroyNotify)cached_data_free;
+}
+
+
 void lsp_semtokens_init(gint ft_id)
 {
 	guint i;
@@ -68,7 +125,7 @@ void lsp_semtokens_init(gint ft_id)
 	{
 		GeanyDocument *doc = documents[i];
 		if (doc->file_type->id == ft_id)
-			plugin_set_document_data(geany_plugin, doc, CACHE_KEY, NULL);
+			set_cache(doc, NULL);
 	}
 }
 
@@ -91,31 +148,34 @@ void lsp_semtokens_style_init(GeanyDocument *doc)
 
 void lsp_semtokens_destroy(GeanyDocument *doc)
 {
-	plugin_set_document_data(geany_plugin, doc, CACHE_KEY, NULL);
+	set_cache(doc, NULL);
 }
 
 
-static SemanticTokensEdit *sem_tokens_edit_new(void)
+/* approximate memory of the document's token cache */
+gsize lsp_semtokens_get_cache_size(GeanyDocument *doc)
 {
-	SemanticTokensEdit *edit = g_new0(SemanticTokensEdit, 1);
-	edit->data = g_array_sized_new(FALSE, FALSE, sizeof(guint), 20);
-	return edit;
-}
-
+	CachedData *data = get_cache(doc);
+	gsize size;
 
-static void sem_tokens_edit_free(SemanticTokensEdit *edit)
-{
-	g_array_free(edit->data, TRUE);
-	g_free(edit);
-}
+	if (!data)
+		return 0;
 
+	size = sizeof(CachedData) + data->tokens->len * sizeof(SemanticToken) +
+		lsp_utils_get_string_size(data->tokens_str) + lsp_utils_get_string_size(data->result_id);
+	if (data->applied)
+		size += data->applied->len * sizeof(AppliedToken);
+	if (data->keywords)
+	{
+		GHashTableIter iter;
+		gpointer key;
 
-static void sem_tokens_edit_apply(CachedData *data, SemanticTokensEdit *edit)
-{
-	g_return_if_fail(edit->start + edit->delete_count <= data->tokens->len);
+		g_hash_table_iter_init(&iter, data->keywords);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+			size += 2 * sizeof(gpointer) + sizeof(guint) + lsp_utils_get_string_size(key);
+	}
 
-	g_array_remove_range(data->tokens, edit->start, edit->delete_count);
-	g_array_insert_vals(data->tokens, edit->start, edit->data->data, edit->data->len);
+	return size;
 }
 
 
@@ -126,7 +186,7 @@ static const gchar *get_cached(GeanyDocument *doc)
 	if (style_index > 0)
 		return "";
 
-	data = plugin_get_document_data(geany_plugin, doc, CACHE_KEY);
+	data = get_cache(doc);
 	if (!data || !data->tokens_str)
 		return "";
 
@@ -151,75 +211,198 @@ static void highlight_keywords(LspServer *srv, GeanyDocument *doc)
 }
 
 
-static gchar *process_tokens(GArray *tokens, GeanyDocument *doc, guint64 token_mask)
+/* Adjusts the highlighted token positions the same way Scintilla moves the
+ * indicators; touched tokens are re-highlighted with the next result */
+void lsp_semtokens_text_modified(GeanyDocument *doc, gint pos, gint length, gboolean inserted)
 {
-	GHashTable *type_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-	ScintillaObject *sci = doc->editor->sci;
-	guint delta_line = 0;
-	guint delta_char = 0;
-	guint len = 0;
-	guint token_type = 0;
-	LspPosition last_pos = {0, 0};
-	gboolean first = TRUE;
-	GList *keys, *item;
-	GString *type_str;
-	gint i;
+	CachedData *data = get_cache(doc);
+	guint lo = 0, hi, i;
 
-	if (style_index > 0)
+	if (!data || !data->applied)
+		return;
+
+	// first token not ending before pos - tokens don't overlap
+	hi = data->applied->len;
+	while (lo < hi)
 	{
-		sci_indicator_set(doc->editor->sci, style_index);
-		sci_indicator_clear(doc->editor->sci, 0, sci_get_length(doc->editor->sci));
+		guint mid = (lo + hi) / 2;
+
+		if (g_array_index(data->applied, AppliedToken, mid).end < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	for (i = 0; i < tokens->len; i++)
+	for (i = lo; i < data->applied->len; i++)
 	{
-		guint v = g_array_index(tokens, guint, i);
+		AppliedToken *token = &g_array_index(data->applied, AppliedToken, i);
 
-		switch (i % 5)
+		if (inserted)
+		{
+			if (token->start > pos)
+				token->start += length;
+			else
+				token->damaged = TRUE;
+			token->end += length;
+		}
+		else
 		{
-			case 0:
-				delta_line = v;
-				break;
-			case 1:
-				delta_char = v;
-				break;
-			case 2:
-				len = v;
-				break;
-			case 3:
-				token_type = 1 << v;
-				break;
+			if (token->start < pos + length)
+				token->damaged = TRUE;
+			token->start = token->start > pos ? MAX(pos, token->start - length) : token->start;
+			token->end = MAX(pos, token->end - length);
 		}
+	}
+}
+
+
+static GArray *decode_tokens(GArray *tokens, ScintillaObject *sci, guint64 token_mask)
+{
+	GArray *result = g_array_new(FALSE, TRUE, sizeof(AppliedToken));
+	LspPosition last_pos = {0, 0};
+	guint i;
+
+	for (i = 0; i < tokens->len; i++)
+	{
+		SemanticToken *t = &g_array_index(tokens, SemanticToken, i);
 
-		if (i % 5 == 4)
+		last_pos.line += t->delta_line;
+		if (t->delta_line == 0)
+			last_pos.character += t->delta_start;
+		else
+			last_pos.character = t->delta_start;
+
+		if (t->token_type < 64 && ((G_GUINT64_CONSTANT(1) << t->token_type) & token_mask))
 		{
-			last_pos.line += delta_line;
-			if (delta_line == 0)
-				last_pos.character += delta_char;
-			else
-				last_pos.character = delta_char;
+			LspPosition end_pos = last_pos;
+			AppliedToken token = {0};
 
-			if (token_type & token_mask)
-			{
-				LspPosition end_pos = last_pos;
-				gint sci_pos_start, sci_pos_end;
-				gchar *str;
+			end_pos.character += t->length;
+			token.start = lsp_utils_lsp_pos_to_scintilla(sci, last_pos);
+			token.end = lsp_utils_lsp_pos_to_scintilla(sci, end_pos);
+			g_array_append_val(result, token);
+		}
+	}
 
-				end_pos.character += len;
-				sci_pos_start = lsp_utils_lsp_pos_to_scintilla(sci, last_pos);
-				sci_pos_end = lsp_utils_lsp_pos_to_scintilla(sci, end_pos);
+	return result;
+}
 
-				if (style_index > 0)
-					editor_indicator_set_on_range(doc->editor, style_index, sci_pos_start, sci_pos_end);
 
-				str = sci_get_contents_range(sci, sci_pos_start, sci_pos_end);
-				if (str)
-					g_hash_table_insert(type_table, str, NULL);
-			}
+static void keyword_unref(CachedData *data, const gchar *word, gboolean *changed)
+{
+	guint count = GPOINTER_TO_UINT(g_hash_table_lookup(data->keywords, word));
+
+	if (count > 1)
+		g_hash_table_insert(data->keywords, (gchar *)word, GUINT_TO_POINTER(count - 1));
+	else
+	{
+		g_hash_table_remove(data->keywords, word);
+		*changed = TRUE;
+	}
+}
+
+
+static const gchar *keyword_ref(CachedData *data, gchar *word, gboolean *changed)
+{
+	gpointer key, val;
+
+	if (g_hash_table_lookup_extended(data->keywords, word, &key, &val))
+	{
+		g_hash_table_insert(data->keywords, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(val) + 1));
+		g_free(word);
+		return key;
+	}
+
+	g_hash_table_insert(data->keywords, word, GUINT_TO_POINTER(1));
+	*changed = TRUE;
+	return word;
+}
+
+
+static gboolean same_token(AppliedToken *a, AppliedToken *b)
+{
+	return !a->damaged && a->start == b->start && a->end == b->end;
+}
+
+
+/* Compares the new tokens with the highlighted ones so only ranges of tokens
+ * which changed get their indicators and keywords updated */
+static void apply_tokens(CachedData *data, GeanyDocument *doc, GArray *new_applied,
+	gboolean *keywords_changed)
+{
+	ScintillaObject *sci = doc->editor->sci;
+	GArray *old_applied = data->applied;
+	guint i = 0, j = 0;
+
+	if (style_index > 0)
+		sci_indicator_set(sci, style_index);
+
+	// without previous state, clear what may have been highlighted before
+	if (!old_applied)
+	{
+		if (style_index > 0)
+			sci_indicator_clear(sci, 0, sci_get_length(sci));
+		old_applied = g_array_new(FALSE, TRUE, sizeof(AppliedToken));
+	}
+
+	// remove old tokens first - their ranges may overlap with the new ones
+	while (i < old_applied->len)
+	{
+		AppliedToken *old_token = &g_array_index(old_applied, AppliedToken, i);
+		AppliedToken *new_token = j < new_applied->len ?
+			&g_array_index(new_applied, AppliedToken, j) : NULL;
+
+		if (new_token && same_token(old_token, new_token))
+		{
+			new_token->word = old_token->word;
+			new_token->damaged = TRUE;  // marks as kept in this loop
+			i++;
+			j++;
+		}
+		else if (new_token && new_token->start < old_token->start)
+			j++;
+		else
+		{
+			if (style_index > 0 && old_token->end > old_token->start)
+				sci_indicator_clear(sci, old_token->start, old_token->end - old_token->start);
+			if (old_token->word)
+				keyword_unref(data, old_token->word, keywords_changed);
+			i++;
+		}
+	}
+
+	for (j = 0; j < new_applied->len; j++)
+	{
+		AppliedToken *token = &g_array_index(new_applied, AppliedToken, j);
+
+		if (token->damaged)
+		{
+			token->damaged = FALSE;
+			continue;
+		}
+
+		if (style_index > 0)
+			editor_indicator_set_on_range(doc->editor, style_index, token->start, token->end);
+		else
+		{
+			gchar *str = sci_get_contents_range(sci, token->start, token->end);
+			if (str)
+				token->word = keyword_ref(data, str, keywords_changed);
 		}
 	}
 
-	keys = g_hash_table_get_keys(type_table);
+	g_array_free(old_applied, TRUE);
+	data->applied = new_applied;
+}
+
+
+static gchar *get_keywords_str(GHashTable *keywords)
+{
+	GList *keys, *item;
+	GString *type_str;
+	gboolean first = TRUE;
+
+	keys = g_hash_table_get_keys(keywords);
 	type_str = g_string_new("");
 
 	foreach_list(item, keys)
@@ -231,12 +414,30 @@ static gchar *process_tokens(GArray *tokens, GeanyDocument *doc, guint64 token_m
 	}
 
 	g_list_free(keys);
-	g_hash_table_destroy(type_table);
 
 	return g_string_free(type_str, FALSE);
 }
 
 
+static void process_tokens(CachedData *data, GeanyDocument *doc, guint64 token_mask)
+{
+	gboolean keywords_changed = FALSE;
+	gint64 start_time = g_get_monotonic_time();
+	GArray *new_applied;
+
+	if (!data->keywords)
+		data->keywords = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	new_applied = decode_tokens(data->tokens, doc->editor->sci, token_mask);
+	apply_tokens(data, doc, new_applied, &keywords_changed);
+
+	if (keywords_changed || !data->tokens_str)
+		SETPTR(data->tokens_str, get_keywords_str(data->keywords));
+
+	lsp_timing_record(LSP_TIMING_SEMTOKENS_APPLY, sci_get_line_count(doc->editor->sci), start_time);
+}
+
+
 static void process_full_result(GeanyDocument *doc, GVariant *result, guint64 token_mask)
 {
 	GVariantIter *iter = NULL;
@@ -252,27 +453,27 @@ static void process_full_result(GeanyDocument *doc, GVariant *result, guint64 to
 	if (iter)
 	{
 		GVariant *val = NULL;
-		CachedData *data = plugin_get_document_data(geany_plugin, doc, CACHE_KEY);
+		CachedData *data = get_cache(doc);
+		gsize n = g_variant_iter_n_children(iter);
+		guint *ints;
+		gsize i = 0;
 
 		if (data == NULL)
 		{
 			data = g_new0(CachedData, 1);
-			data->tokens = g_array_sized_new(FALSE, FALSE, sizeof(guint), 1000);
-			plugin_set_document_data_full(geany_plugin, doc, CACHE_KEY, data, (GDestroyNotify)cached_data_free);
+			data->tokens = g_array_sized_new(FALSE, FALSE, sizeof(SemanticToken), 200);
+			set_cache(doc, data);
 		}
 
 		g_free(data->result_id);
 		data->result_id = g_strdup(result_id);
-		data->tokens->len = 0;
+		g_array_set_size(data->tokens, n / TOKEN_INTS);
 
-		while (g_variant_iter_loop(iter, "v", &val))
-		{
-			guint v = g_variant_get_int64(val);
-			g_array_append_val(data->tokens, v);
-		}
+		ints = (guint *)data->tokens->data;
+		while (i < data->tokens->len * TOKEN_INTS && g_variant_iter_loop(iter, "v", &val))
+			ints[i++] = g_variant_get_int64(val);
 
-		g_free(data->tokens_str);
-		data->tokens_str = process_tokens(data->tokens, doc, token_mask);
+		process_tokens(data, doc, token_mask);
 
 		g_variant_iter_free(iter);
 	}
@@ -281,10 +482,57 @@ static void process_full_result(GeanyDocument *doc, GVariant *result, guint64 to
 
 static gint sort_edits(gconstpointer a, gconstpointer b)
 {
-	const SemanticTokensEdit *e1 = *((SemanticTokensEdit **) a);
-	const SemanticTokensEdit *e2 = *((SemanticTokensEdit **) b);
+	const SemanticTokensEdit *e1 = a;
+	const SemanticTokensEdit *e2 = b;
+
+	return (e1->start > e2->start) - (e1->start < e2->start);
+}
+
+
+/* Builds the new token array in a single pass copying the runs between the
+ * (sorted) edits; returns NULL when the edits don't fit the tokens */
+static GArray *apply_edits(GArray *tokens, GArray *edits, GArray *edit_data)
+{
+	const guint *old_ints = (const guint *)tokens->data;
+	gsize old_len = tokens->len * TOKEN_INTS;
+	gsize new_len = old_len;
+	gsize pos = 0, new_pos = 0;
+	GArray *new_tokens;
+	guint *new_ints;
+	guint i;
+
+	for (i = 0; i < edits->len; i++)
+	{
+		SemanticTokensEdit *edit = &g_array_index(edits, SemanticTokensEdit, i);
+
+		if (edit->start < pos || edit->start + edit->delete_count > old_len)
+			return NULL;
+		pos = edit->start + edit->delete_count;
+		new_len = new_len - edit->delete_count + edit->data_len;
+	}
+
+	if (new_len % TOKEN_INTS != 0)
+		return NULL;
+
+	new_tokens = g_array_sized_new(FALSE, FALSE, sizeof(SemanticToken), new_len / TOKEN_INTS);
+	g_array_set_size(new_tokens, new_len / TOKEN_INTS);
+	new_ints = (guint *)new_tokens->data;
+
+	pos = 0;
+	for (i = 0; i < edits->len; i++)
+	{
+		SemanticTokensEdit *edit = &g_array_index(edits, SemanticTokensEdit, i);
+
+		memcpy(new_ints + new_pos, old_ints + pos, (edit->start - pos) * sizeof(guint));
+		new_pos += edit->start - pos;
+		memcpy(new_ints + new_pos, &g_array_index(edit_data, guint, edit->data_offset),
+			edit->data_len * sizeof(guint));
+		new_pos += edit->data_len;
+		pos = edit->start + edit->delete_count;
+	}
+	memcpy(new_ints + new_pos, old_ints + pos, (old_len - pos) * sizeof(guint));
 
-	return e2->start - e1->start;
+	return new_tokens;
 }
 
 
@@ -293,173 +541,260 @@ static gboolean process_delta_result(GeanyDocument *doc, GVariant *result, guint
 	GVariantIter *iter = NULL;
 	const gchar *result_id = NULL;
 	CachedData *data = NULL;
-	gboolean ret = FALSE;
+	GArray *new_tokens = NULL;
 
 	JSONRPC_MESSAGE_PARSE(result,
 		"resultId", JSONRPC_MESSAGE_GET_STRING(&result_id),
 		"edits", JSONRPC_MESSAGE_GET_ITER(&iter)
 	);
 
-	data = plugin_get_document_data(geany_plugin, doc, CACHE_KEY);
+	data = get_cache(doc);
 
-	if (data && (!iter || !result_id))
+	if (data && iter && result_id)
 	{
-		// something got wrong - let's delete our cached result so the next request
-		// is full instead of delta which may be out of sync
-		plugin_set_document_data(geany_plugin, doc, CACHE_KEY, NULL);
-	}
-	else if (data && iter && result_id)
-	{
-		GPtrArray *edits = g_ptr_array_new_full(4, (GDestroyNotify)sem_tokens_edit_free);
-		SemanticTokensEdit *edit;
+		GArray *edits = g_array_new(FALSE, FALSE, sizeof(SemanticTokensEdit));
+		GArray *edit_data = g_array_new(FALSE, FALSE, sizeof(guint));
 		GVariant *val = NULL;
-		guint i;
- 
+
 		while (g_variant_iter_loop(iter, "v", &val))
 		{
+			SemanticTokensEdit edit;
 			GVariantIter *iter2 = NULL;
 			GVariant *val2 = NULL;
 			gint64 delete_count = 0;
 			gint64 start = 0;
-			gboolean success;
 
-			success = JSONRPC_MESSAGE_PARSE(val,
+			if (!JSONRPC_MESSAGE_PARSE(val,
 				"start", JSONRPC_MESSAGE_GET_INT64(&start),
-				"deleteCount", JSONRPC_MESSAGE_GET_INT64(&delete_count),
+				"deleteCount", JSONRPC_MESSAGE_GET_INT64(&delete_count)))
+			{
+				continue;
+			}
+
+			// data is optional
+			JSONRPC_MESSAGE_PARSE(val,
 				"data", JSONRPC_MESSAGE_GET_ITER(&iter2)
 			);
 
-			if (success)
-			{
-				edit = sem_tokens_edit_new();
-				edit->start = start;
-				edit->delete_count = delete_count;
+			edit.start = start;
+			edit.delete_count = delete_count;
+			edit.data_offset = edit_data->len;
 
+			if (iter2)
+			{
 				while (g_variant_iter_loop(iter2, "v", &val2))
 				{
 					guint v = g_variant_get_int64(val2);
-					g_array_append_val(edit->data, v);
+					g_array_append_val(edit_data, v);
 				}
-
-				g_ptr_array_add(edits, edit);
+				g_variant_iter_free(iter2);
 			}
+			edit.data_len = edit_data->len - edit.data_offset;
 
-			if (iter2)
-				g_variant_iter_free(iter2);
+			g_array_append_val(edits, edit);
 		}
 
-		g_ptr_array_sort(edits, sort_edits);
+		g_array_sort(edits, sort_edits);
+		new_tokens = apply_edits(data->tokens, edits, edit_data);
+
+		g_array_free(edits, TRUE);
+		g_array_free(edit_data, TRUE);
+	}
 
-		foreach_ptr_array(edit, i, edits)
-			sem_tokens_edit_apply(data, edit);
+	if (new_tokens)
+	{
+		g_array_free(data->tokens, TRUE);
+		data->tokens = new_tokens;
 
-		g_free(data->tokens_str);
-		data->tokens_str = process_tokens(data->tokens, doc, token_mask);
+		process_tokens(data, doc, token_mask);
 		g_free(data->result_id);
 		data->result_id = g_strdup(result_id);
-
-		g_ptr_array_free(edits, TRUE);
-
-		ret = TRUE;
+	}
+	else if (data)
+	{
+		// something got wrong - let's delete our cached result so the next request
+		// is full instead of delta which may be out of sync
+		set_cache(doc, NULL);
 	}
 
 	if (iter)
 		g_variant_iter_free(iter);
 
-	return ret;
+	return new_tokens != NULL;
 }
 
 
 static void semtokens_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
+	LspSemtokensData *data = user_data;
+
 	if (!error)
 	{
-		GeanyDocument *doc = user_data;
+		GeanyDocument *doc = data->doc;
 		LspServer *srv;
 
 		srv = DOC_VALID(doc) ? lsp_server_get(doc) : NULL;
 
-		if (srv)
+		if (srv && !lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/semanticTokens"))
 		{
 			gboolean success = TRUE;
 			GVariantIter *iter = NULL;
 
+			lsp_server_record_startup(srv, LSP_STARTUP_FIRST_SEMTOKENS);
+
 			//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
 			JSONRPC_MESSAGE_PARSE(return_value,
 				"data", JSONRPC_MESSAGE_GET_ITER(&iter)
 			);
 
-			if (iter)
+			// the full result arrived first
+			if (data->viewport && get_cache(doc))
+				success = FALSE;
+			else if (iter)
 			{
 				process_full_result(doc, return_value, srv->semantic_token_mask);
-				g_variant_iter_free(iter);
+				if (data->viewport)
+				{
+					CachedData *cached_data = get_cache(doc);
+					// no deltas against a partial result
+					g_free(cached_data->result_id);
+					cached_data->result_id = NULL;
+				}
 			}
 			else
 				success = process_delta_result(doc, return_value, srv->semantic_token_mask);
 
 			if (success)
 				highlight_keywords(srv, doc);
+
+			if (iter)
+				g_variant_iter_free(iter);
 		}
 	}
+
+	g_free(data);
+}
+
+
+static void send_range_request(LspServer *server, GeanyDocument *doc, const gchar *doc_uri,
+	LspPosition start, LspPosition end, gboolean viewport)
+{
+	LspSemtokensData *data;
+	GVariant *node;
+
+	data = g_new0(LspSemtokensData, 1);
+	data->doc = doc;
+	data->version = lsp_sync_peek_doc_version(server, doc);
+	data->viewport = viewport;
+
+	node = JSONRPC_MESSAGE_NEW(
+		"textDocument", "{",
+			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+		"}",
+		"range", "{",
+			"start", "{",
+				"line", JSONRPC_MESSAGE_PUT_INT32(start.line),
+				"character", JSONRPC_MESSAGE_PUT_INT32(start.character),
+			"}",
+			"end", "{",
+				"line", JSONRPC_MESSAGE_PUT_INT32(end.line),
+				"character", JSONRPC_MESSAGE_PUT_INT32(end.character),
+			"}",
+		"}"
+	);
+	lsp_rpc_call_background(server, "textDocument/semanticTokens/range", node,
+		semtokens_cb, data);
+
+	g_variant_unref(node);
+}
+
+
+static void get_visible_range(ScintillaObject *sci, LspPosition *start, LspPosition *end)
+{
+	gint first_visible = SSM(sci, SCI_GETFIRSTVISIBLELINE, 0, 0);
+	gint lines_on_screen = SSM(sci, SCI_LINESONSCREEN, 0, 0);
+	gint line_count = SSM(sci, SCI_GETLINECOUNT, 0, 0);
+
+	start->line = SSM(sci, SCI_DOCLINEFROMVISIBLE, first_visible, 0);
+	start->character = 0;
+	// the line after the last (possibly partially) visible one
+	end->line = MIN(SSM(sci, SCI_DOCLINEFROMVISIBLE, first_visible + lines_on_screen, 0) + 1,
+		line_count);
+	end->character = 0;
 }
 
 
 void lsp_semtokens_send_request(GeanyDocument *doc)
 {
 	LspServer *server = lsp_server_get(doc);
+	ScintillaObject *sci;
 	gchar *doc_uri;
 	GVariant *node;
 	CachedData *cached_data;
-	gboolean delta;
+	LspSemtokensData *data;
+	gboolean delta, viewport, large;
+
+	if (!doc || !server || lsp_rpc_is_degraded(server))
+		return;
 
-	if (!doc || !server)
+	// only the visible part of large files gets highlighted
+	large = lsp_server_is_large_file(server, doc);
+	if (large && !server->config.semantic_tokens_supports_range)
 		return;
 
+	sci = doc->editor->sci;
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
 	/* Geany requests symbols before firing "document-activate" signal so we may
 	 * need to request document opening here */
 	lsp_sync_text_document_did_open(server, doc);
 
-	cached_data = plugin_get_document_data(geany_plugin, doc, CACHE_KEY);
+	cached_data = get_cache(doc);
 	delta = cached_data != NULL && cached_data->result_id &&
 		server->config.semantic_tokens_supports_delta &&
 		!server->config.semantic_tokens_force_full;
+	viewport = (server->config.semantic_tokens_viewport_first || large) &&
+		server->config.semantic_tokens_supports_range;
 
-	if (delta)
+	if (server->config.semantic_tokens_range_only || large)
 	{
-		node = JSONRPC_MESSAGE_NEW(
-			"previousResultId", JSONRPC_MESSAGE_PUT_STRING(cached_data->result_id),
-			"textDocument", "{",
-				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-			"}"
-		);
-		lsp_rpc_call(server, "textDocument/semanticTokens/full/delta", node,
-			semtokens_cb, doc);
+		LspPosition start = {0, 0};
+		LspPosition end;
+
+		if (viewport)
+			get_visible_range(sci, &start, &end);
+		else
+			end = lsp_utils_scintilla_pos_to_lsp(sci, SSM(sci, SCI_GETLENGTH, 0, 0));
+
+		send_range_request(server, doc, doc_uri, start, end, FALSE);
+		g_free(doc_uri);
+		return;
 	}
-	else if (server->config.semantic_tokens_range_only)
+
+	// highlight what the user sees before the whole document gets processed
+	if (viewport && !cached_data)
 	{
-		guint last_pos = SSM(doc->editor->sci, SCI_GETLENGTH, 0, 0);
-		LspPosition pos = lsp_utils_scintilla_pos_to_lsp(doc->editor->sci, last_pos);
+		LspPosition start, end;
+
+		get_visible_range(sci, &start, &end);
+		send_range_request(server, doc, doc_uri, start, end, TRUE);
+	}
 
+	data = g_new0(LspSemtokensData, 1);
+	data->doc = doc;
+	data->version = lsp_sync_peek_doc_version(server, doc);
+
+	if (delta)
+	{
 		node = JSONRPC_MESSAGE_NEW(
+			"previousResultId", JSONRPC_MESSAGE_PUT_STRING(cached_data->result_id),
 			"textDocument", "{",
 				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-			"}",
-			"range", "{",
-				"start", "{",
-					"line", JSONRPC_MESSAGE_PUT_INT32(0),
-					"character", JSONRPC_MESSAGE_PUT_INT32(0),
-				"}",
-				"end", "{",
-					"line", JSONRPC_MESSAGE_PUT_INT32(pos.line),
-					"character", JSONRPC_MESSAGE_PUT_INT32(pos.character),
-				"}",
 			"}"
 		);
-		lsp_rpc_call(server, "textDocument/semanticTokens/range", node,
-			semtokens_cb, doc);
+		lsp_rpc_call_background(server, "textDocument/semanticTokens/full/delta", node,
+			semtokens_cb, data);
 	}
 	else
 	{
@@ -468,8 +803,8 @@ void lsp_semtokens_send_request(GeanyDocument *doc)
 				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
 			"}"
 		);
-		lsp_rpc_call(server, "textDocument/semanticTokens/full", node,
-			semtokens_cb, doc);
+		lsp_rpc_call_background(server, "textDocument/semanticTokens/full", node,
+			semtokens_cb, data);
 	}
 
 	g_free(doc_uri);
@@ -477,12 +812,139 @@ void lsp_semtokens_send_request(GeanyDocument *doc)
 }
 
 
+static gboolean viewport_request_idle(gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+
+	viewport_source = 0;
+
+	if (doc && lsp_server_get_if_running(doc))
+		lsp_semtokens_send_request(doc);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Servers supporting only range requests and large files get the newly
+ * visible lines after scrolling */
+void lsp_semtokens_viewport_changed(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+
+	if (!srv || !srv->config.semantic_tokens_enable)
+		return;
+
+	if (!(srv->config.semantic_tokens_range_only && srv->config.semantic_tokens_viewport_first) &&
+		!(srv->config.semantic_tokens_supports_range && lsp_server_is_large_file(srv, doc)))
+		return;
+
+	if (viewport_source != 0)
+		g_source_remove(viewport_source);
+	viewport_source = plugin_timeout_add(geany_plugin, 300, viewport_request_idle, NULL);
+}
+
+
+/* Handles workspace/semanticTokens/refresh - documents not visible are
+ * refreshed when activated */
+void lsp_semtokens_refresh(LspServer *srv)
+{
+	GeanyDocument *doc = document_get_current();
+
+	if (doc && srv->config.semantic_tokens_enable && lsp_server_get_if_running(doc) == srv)
+		lsp_semtokens_send_request(doc);
+}
+
+
+/* stores the highlighted ranges for the next session - only the positions are
+ * needed to highlight them again */
+void lsp_semtokens_persist(GeanyDocument *doc)
+{
+	CachedData *data = get_cache(doc);
+	GString *str;
+	guint i;
+
+	if (!data || !data->applied)
+		return;
+
+	str = g_string_new("");
+	for (i = 0; i < data->applied->len; i++)
+	{
+		AppliedToken *token = &g_array_index(data->applied, AppliedToken, i);
+
+		if (!token->damaged && token->end > token->start)
+			g_string_append_printf(str, "%d\t%d\n", token->start, token->end);
+	}
+	lsp_disk_cache_store(doc, "semtokens", str->str);
+
+	g_string_free(str, TRUE);
+}
+
+
+static void restore_cb(GeanyDocument *doc, const gchar *contents)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	gboolean keywords_changed = FALSE;
+	gchar **lines, **line;
+	CachedData *data;
+	GArray *applied;
+	gint len, prev_end = 0;
+
+	// the server may have sent the tokens meanwhile
+	if (!srv || !srv->config.semantic_tokens_enable || get_cache(doc))
+		return;
+
+	len = sci_get_length(doc->editor->sci);
+	applied = g_array_new(FALSE, TRUE, sizeof(AppliedToken));
+	lines = g_strsplit(contents, "\n", -1);
+	foreach_strv(line, lines)
+	{
+		AppliedToken token = {0};
+		gchar *tab;
+
+		token.start = strtol(*line, &tab, 10);
+		if (*tab != '\t')
+			continue;
+		token.end = strtol(tab + 1, NULL, 10);
+
+		// sorted and not overlapping as when stored
+		if (token.start < prev_end || token.end <= token.start || token.end > len)
+			continue;
+		g_array_append_val(applied, token);
+		prev_end = token.end;
+	}
+	g_strfreev(lines);
+
+	data = g_new0(CachedData, 1);
+	data->tokens = g_array_new(FALSE, FALSE, sizeof(SemanticToken));
+	data->keywords = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	set_cache(doc, data);
+
+	apply_tokens(data, doc, applied, &keywords_changed);
+	data->tokens_str = get_keywords_str(data->keywords);
+	highlight_keywords(srv, doc);
+}
+
+
+/* highlights the ranges stored in the previous session until the server sends
+ * the tokens; they are replaced by the first result. They are loaded in the
+ * background. */
+void lsp_semtokens_restore(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+
+	if (!srv || !srv->config.semantic_tokens_enable || get_cache(doc))
+		return;
+
+	lsp_disk_cache_load(doc, "semtokens", restore_cb);
+}
+
+
 void lsp_semtokens_clear(GeanyDocument *doc)
 {
 	if (!doc)
 		return;
 
-	plugin_set_document_data(geany_plugin, doc, CACHE_KEY, NULL);
+	set_cache(doc, NULL);
 	keyword_hash = 0;
 
 	if (style_index > 0)
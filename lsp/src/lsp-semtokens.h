@@ -24,11 +24,18 @@
 #include <glib.h>
 
 void lsp_semtokens_send_request(GeanyDocument *doc);
+void lsp_semtokens_viewport_changed(GeanyDocument *doc);
+void lsp_semtokens_refresh(LspServer *srv);
+void lsp_semtokens_text_modified(GeanyDocument *doc, gint pos, gint length, gboolean inserted);
 void lsp_semtokens_clear(GeanyDocument *doc);
+void lsp_semtokens_persist(GeanyDocument *doc);
+void lsp_semtokens_restore(GeanyDocument *doc);
 
 void lsp_semtokens_style_init(GeanyDocument *doc);
 
 void lsp_semtokens_init(gint ft_id);
 void lsp_semtokens_destroy(GeanyDocument *doc);
 
+gsize lsp_semtokens_get_cache_size(GeanyDocument *doc);
+
 #endif  /* LSP_SEMTOKENS_H */
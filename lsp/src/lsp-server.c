@@ -22,6 +22,7 @@
 
 #include "lsp-server.h"
 #include "lsp-utils.h"
+#include "lsp-doc-state.h"
 #include "lsp-rpc.h"
 #include "lsp-sync.h"
 #include "lsp-diagnostics.h"
@@ -29,29 +30,47 @@
 #include "lsp-semtokens.h"
 #include "lsp-progress.h"
 #include "lsp-symbols.h"
+#include "lsp-symbol-tree.h"
+#include "lsp-code-lens.h"
+#include "lsp-memory.h"
+#include "lsp-metrics.h"
 #include "lsp-symbol-kinds.h"
 #include "lsp-highlight.h"
 #include "lsp-workspace-folders.h"
+#include "lsp-watched-files.h"
+#include "lsp-timing.h"
+#include "lsp-trace.h"
 
 #include "spawn/spawn.h"
+#include "spawn/lspthreadedinputstream.h"
 
 #include <jsonrpc-glib.h>
 
 #ifdef G_OS_UNIX
 # include <gio/gunixinputstream.h>
 # include <gio/gunixoutputstream.h>
+# include <gio/gunixsocketaddress.h>
 #else
 # include "spawn/lspunixinputstream.h"
 # include "spawn/lspunixoutputstream.h"
 #endif
 
 #include <unistd.h>
+#include <string.h>
+#include <stdio.h>
 
-#define CACHED_FILETYPE_KEY "lsp_server_cached_filetype"
-#define CACHED_LANG_ID_KEY "lsp_server_cached_lang_id"
+#define RECONNECT_DELAY 2000
+#define WATCHDOG_INTERVAL 10000
+// stderr is drained in large chunks - verbose servers write megabytes of it
+#define STDERR_READ_LENGTH 65536
 
 static void start_lsp_server(LspServer *server);
+static gboolean spawn_server_process(LspServer *server);
+static void start_rpc(LspServer *server);
+static void kill_server(LspServer *srv);
+static void stop_and_free_server(LspServer *s);
 static LspServer *lsp_server_init(gint ft);
+static void show_stderr_tail(LspServer *srv);
 
 
 extern GeanyData *geany_data;
@@ -60,18 +79,40 @@ extern LspProjectConfigurationType project_configuration_type;
 
 static GPtrArray *lsp_servers = NULL;
 static GPtrArray *servers_in_shutdown = NULL;
+static guint watchdog_source = 0;
 
 static LspServerInitializedCallback lsp_server_initialized_cb;
 
+typedef struct
+{
+	GKeyFile *kf;
+	gint64 mtime;
+} KeyFileEntry;
+
+// config file path -> KeyFileEntry
+static GHashTable *keyfile_cache = NULL;
+
+typedef struct
+{
+	GeanyFiletype *ft;  // NULL when no lang_id_mappings pattern matches
+	gchar *lang_id;
+} FtMapping;
+
+// file base name -> FtMapping, valid until the configuration is reloaded
+static GHashTable *ft_mapping_cache = NULL;
+
 
 static void free_config(LspServerConfig *cfg)
 {
 	g_free(cfg->cmd);
+	g_free(cfg->connect);
+	g_free(cfg->companion_cmd);
 	g_strfreev(cfg->env);
 	g_free(cfg->ref_lang);
 	g_strfreev(cfg->autocomplete_trigger_sequences);
 	g_strfreev(cfg->semantic_tokens_types);
 	g_free(cfg->command_on_save_regex);
+	g_strfreev(cfg->command_on_save_kinds);
 	g_free(cfg->semantic_tokens_type_style);
 	g_free(cfg->autocomplete_hide_after_words);
 	g_free(cfg->diagnostics_disable_for);
@@ -88,31 +129,80 @@ static void free_config(LspServerConfig *cfg)
 	g_free(cfg->initialization_options);
 	g_free(cfg->word_chars);
 	g_free(cfg->document_symbols_tab_label);
+	g_free(cfg->hierarchy_tab_label);
 	g_free(cfg->rpc_log);
+	g_free(cfg->rpc_capture);
+	g_free(cfg->trace_events_file);
+	g_free(cfg->metrics_file);
 	g_strfreev(cfg->lang_id_mappings);
+	g_strfreev(cfg->request_timeouts);
+	if (cfg->lang_id_patterns)
+		g_ptr_array_free(cfg->lang_id_patterns, TRUE);
 	g_ptr_array_free(cfg->command_regexes, TRUE);
 	g_strfreev(cfg->project_root_marker_patterns);
+	if (cfg->project_root_marker_specs)
+		g_ptr_array_free(cfg->project_root_marker_specs, TRUE);
+	g_free(cfg->project_root_marker_key);
+	if (cfg->diagnostics_disable_specs)
+		g_ptr_array_free(cfg->diagnostics_disable_specs, TRUE);
+}
+
+
+static void stop_companion(LspServer *srv)
+{
+	LspServer *companion = srv->companion;
+
+	if (!companion)
+		return;
+
+	srv->companion = NULL;
+	companion->companion_owner = NULL;
+	stop_and_free_server(companion);
 }
 
 
 static void free_server(LspServer *s)
 {
+	stop_companion(s);
+	if (s->connect_cancellable)
+	{
+		g_cancellable_cancel(s->connect_cancellable);
+		g_object_unref(s->connect_cancellable);
+	}
+	if (s->reconnect_source)
+		g_source_remove(s->reconnect_source);
+	if (s->refresh_source)
+		g_source_remove(s->refresh_source);
+	if (s->init_queue)
+		g_queue_free_full(s->init_queue, g_free);
+	if (s->instances)
+		g_hash_table_destroy(s->instances);
 	if (s->rpc)
 		lsp_rpc_destroy(s->rpc);
 	if (s->stream)
 		g_object_unref(s->stream);
 	lsp_log_stop(s->log);
+	if (s->stderr_tail)
+		g_string_free(s->stderr_tail, TRUE);
 	lsp_sync_free(s);
 	lsp_diagnostics_free(s);
 	lsp_workspace_folders_free(s);
+	lsp_watched_files_free(s);
 
 	g_free(s->autocomplete_trigger_chars);
 	g_free(s->signature_trigger_chars);
 	g_free(s->initialize_response);
+	if (s->trimmed_capabilities)
+		g_ptr_array_free(s->trimmed_capabilities, TRUE);
+	if (s->config_sections)
+		g_hash_table_destroy(s->config_sections);
+	if (s->config_settings)
+		g_variant_unref(s->config_settings);
 	lsp_progress_free_all(s);
 
 	free_config(&s->config);
 
+	g_free(s->root);
 	g_free(s);
 }
 
@@ -131,6 +221,202 @@ static gboolean is_dead(LspServer *server)
 }
 
 
+static gboolean is_running(LspServer *server)
+{
+	return server->pid > 0 || server->connected;
+}
+
+
+/* Whether the server is still the one used for its filetype or root (and not
+ * a stopped or replaced one) */
+static gboolean is_registered(LspServer *srv)
+{
+	LspServer *slot;
+
+	if (!lsp_servers)
+		return FALSE;
+
+	slot = lsp_servers->pdata[srv->filetype];
+	if (!srv->root)
+		return slot == srv;
+
+	return slot->instances && g_hash_table_lookup(slot->instances, srv->root) == srv;
+}
+
+
+/* Puts new_srv in place of srv inside lsp_servers - per-root instances are
+ * just removed when new_srv is NULL */
+static void replace_server(LspServer *srv, LspServer *new_srv)
+{
+	LspServer *slot;
+
+	if (!is_registered(srv))
+		return;
+
+	slot = lsp_servers->pdata[srv->filetype];
+	if (srv->root)
+	{
+		g_hash_table_steal(slot->instances, srv->root);
+		if (new_srv)
+			g_hash_table_insert(slot->instances, new_srv->root, new_srv);
+	}
+	else
+	{
+		new_srv->instances = srv->instances;
+		srv->instances = NULL;
+		lsp_servers->pdata[srv->filetype] = new_srv;
+	}
+}
+
+
+static LspServer *new_server_for(LspServer *srv)
+{
+	LspServer *s = lsp_server_init(srv->filetype);
+
+	s->root = g_strdup(srv->root);
+	return s;
+}
+
+
+/* The standby is shut down like any other stopped server */
+static void discard_standby(LspServer *srv)
+{
+	LspServer *standby = srv->standby;
+
+	if (!standby)
+		return;
+
+	srv->standby = NULL;
+	standby->standby_owner = NULL;
+	g_ptr_array_add(servers_in_shutdown, standby);
+	kill_server(standby);
+}
+
+
+/* With warm_standby, a second process of an initialized server is spawned in
+ * advance so restarts only take the initialize handshake */
+static void spawn_standby(LspServer *srv)
+{
+	LspServer *standby;
+
+	if (srv->standby || srv->pid <= 0 || !srv->config.warm_standby || !is_registered(srv))
+		return;
+
+	standby = new_server_for(srv);
+	standby->standby_owner = srv;
+	lsp_server_record_startup(standby, LSP_STARTUP_START);
+	if (spawn_server_process(standby))
+		srv->standby = standby;
+	else
+		free_server(standby);
+}
+
+
+static LspServer *take_standby(LspServer *srv)
+{
+	LspServer *standby = srv->standby;
+
+	if (standby)
+	{
+		srv->standby = NULL;
+		standby->standby_owner = NULL;
+		standby->prestarted = TRUE;  // re-open the documents of srv
+		msgwin_status_add(_("Switching to standby LSP server %s"), standby->config.cmd);
+	}
+
+	return standby;
+}
+
+
+/* The companion is an additional server of the filetype, typically a linter,
+ * started once its owner is initialized. It receives the same documents as
+ * the owner but only its diagnostics, merged with those of the owner, and
+ * with companion_formatting its formatting are used. */
+static void start_companion(LspServer *srv)
+{
+	LspServer *companion;
+	LspServerConfig *cfg;
+
+	if (srv->companion || srv->is_companion || EMPTY(srv->config.companion_cmd) ||
+		srv->companion_restarts >= 10 || !is_registered(srv))
+		return;
+
+	companion = new_server_for(srv);
+	companion->companion_owner = srv;
+	companion->is_companion = TRUE;
+
+	cfg = &companion->config;
+	SETPTR(cfg->cmd, g_strdup(srv->config.companion_cmd));
+	g_strstrip(cfg->cmd);
+	// the options of the owner's server don't apply to the companion
+	SETPTR(cfg->connect, NULL);
+	SETPTR(cfg->initialization_options, NULL);
+	SETPTR(cfg->initialization_options_file, NULL);
+	SETPTR(cfg->rpc_log, NULL);
+	SETPTR(cfg->rpc_capture, NULL);
+	cfg->send_did_change_configuration = FALSE;
+	cfg->warm_standby = FALSE;
+	// documents are opened and closed together with the owner
+	cfg->open_docs_max_count = 0;
+	cfg->open_docs_max_size = 0;
+	cfg->open_docs_idle_timeout = 0;
+
+	srv->companion = companion;
+	start_lsp_server(companion);
+}
+
+
+/* Companions are restarted on their own, their owner keeps running */
+static void restart_companion(LspServer *companion)
+{
+	LspServer *owner = companion->companion_owner;
+
+	plugin_timeout_add(geany_plugin, 300, free_server_after_delay, companion);
+
+	owner->companion = NULL;
+	companion->companion_owner = NULL;
+	lsp_diagnostics_clear_companion(owner);
+
+	owner->companion_restarts++;
+	if (owner->companion_restarts >= 10)
+		msgwin_status_add(_("LSP server %s terminated %d times, giving up"),
+			companion->config.cmd, owner->companion_restarts);
+	else
+		start_companion(owner);
+}
+
+
+static void restart_server(LspServer *s)
+{
+	gint restarts = s->restarts;
+	LspServer *old_s = s;
+	LspServer *standby;
+
+	// it seems that calls/notifications get delivered to the plugin
+	// from the server even after the process is stopped in unnormal
+	// conditions like server crash and if we free the server immediately,
+	// the RPC call gets invalid server. Wait for a while until such
+	// calls get performed
+	plugin_timeout_add(geany_plugin, 300, free_server_after_delay, s);
+
+	if (is_registered(old_s))  // not on plugin unload
+	{
+		// no standby is used once we give up
+		standby = restarts + 1 < 10 ? take_standby(old_s) : NULL;
+		s = standby ? standby : new_server_for(old_s);
+		s->restarts = restarts + 1;
+		replace_server(old_s, s);
+		if (is_dead(s))
+			msgwin_status_add(_("LSP server %s terminated %d times, giving up"), s->config.cmd, s->restarts);
+		else if (standby)
+			start_rpc(s);
+		else
+			start_lsp_server(s);
+	}
+	discard_standby(old_s);
+}
+
+
 static void process_stopped(GPid pid, gint status, gpointer data)
 {
 	LspServer *s = data;
@@ -138,37 +424,44 @@ static void process_stopped(GPid pid, gint status, gpointer data)
 	g_spawn_close_pid(pid);
 	s->pid = 0;
 
+	if (s->standby_owner)
+	{
+		msgwin_status_add(_("Standby LSP server %s stopped unexpectedly"), s->config.cmd);
+		s->standby_owner->standby = NULL;
+		s->standby_owner = NULL;
+		plugin_timeout_add(geany_plugin, 300, free_server_after_delay, s);
+	}
 	// normal shutdown
-	if (g_ptr_array_find(servers_in_shutdown, s, NULL))
+	else if (g_ptr_array_find(servers_in_shutdown, s, NULL))
 	{
 		msgwin_status_add(_("LSP server %s stopped"), s->config.cmd);
 		g_ptr_array_remove_fast(servers_in_shutdown, s);
 	}
+	else if (s->companion_owner)
+	{
+		show_stderr_tail(s);
+		msgwin_status_add(_("LSP server %s stopped unexpectedly, restarting"), s->config.cmd);
+		restart_companion(s);
+	}
 	else  // crash
 	{
-		gint restarts = s->restarts;
-		gint ft = s->filetype;
-
+		show_stderr_tail(s);
 		msgwin_status_add(_("LSP server %s stopped unexpectedly, restarting"), s->config.cmd);
+		restart_server(s);
+	}
+}
 
-		// it seems that calls/notifications get delivered to the plugin
-		// from the server even after the process is stopped in unnormal
-		// conditions like server crash and if we free the server immediately,
-		// the RPC call gets invalid server. Wait for a while until such
-		// calls get performed
-		plugin_timeout_add(geany_plugin, 300, free_server_after_delay, s);
 
-		if (lsp_servers)  // NULL on plugin unload
-		{
-			s = lsp_server_init(ft);
-			s->restarts = restarts + 1;
-			lsp_servers->pdata[ft] = s;
-			if (is_dead(s))
-				msgwin_status_add(_("LSP server %s terminated %d times, giving up"), s->config.cmd, s->restarts);
-			else
-				start_lsp_server(s);
-		}
-	}
+/* Called by the RPC layer when the communication with the server fails */
+void lsp_server_connection_lost(LspServer *srv)
+{
+	// spawned servers are handled by process_stopped()
+	if (!srv->connected || !is_registered(srv))
+		return;
+
+	srv->connected = FALSE;
+	msgwin_status_add(_("Connection to LSP server %s lost, reconnecting"), srv->config.cmd);
+	restart_server(srv);
 }
 
 
@@ -229,9 +522,12 @@ static void stop_process(LspServer *s)
 
 	s->startup_shutdown = TRUE;
 	g_ptr_array_add(servers_in_shutdown, s);
+	discard_standby(s);
+	stop_companion(s);
 
-	if (lsp_servers)  // NULL on plugin unload
-		lsp_servers->pdata[s->filetype] = lsp_server_init(s->filetype);
+	// per-root instances are created on demand
+	if (is_registered(s))
+		replace_server(s, s->root ? NULL : lsp_server_init(s->filetype));
 
 	msgwin_status_add(_("Sending shutdown request to LSP server %s"), s->config.cmd);
 	lsp_rpc_call_startup_shutdown(s, "shutdown", NULL, shutdown_cb, s);
@@ -241,6 +537,8 @@ static void stop_process(LspServer *s)
 }
 
 
+/* Servers we are only connected to are shared with other clients so they are
+ * never asked to shut down, only the connection is closed */
 static void stop_and_free_server(LspServer *s)
 {
 	if (s->pid)
@@ -384,6 +682,23 @@ static gboolean use_incremental_sync(GVariant *node)
 }
 
 
+static LspPositionEncoding get_position_encoding(GVariant *node)
+{
+	const gchar *encoding = NULL;
+
+	JSONRPC_MESSAGE_PARSE(node,
+		"capabilities", "{",
+			"positionEncoding", JSONRPC_MESSAGE_GET_STRING(&encoding),
+		"}");
+
+	if (g_strcmp0(encoding, "utf-8") == 0)
+		return LspPositionEncodingUtf8;
+	if (g_strcmp0(encoding, "utf-32") == 0)
+		return LspPositionEncodingUtf32;
+	return LspPositionEncodingUtf16;
+}
+
+
 static gboolean use_workspace_folders(GVariant *node)
 {
 	gboolean change_notifications = FALSE;
@@ -524,6 +839,8 @@ static void initialize_cb(GVariant *return_value, GError *error, gpointer user_d
 	{
 		gboolean supports_semantic_token_range, supports_semantic_token_full;
 
+		lsp_server_record_startup(s, LSP_STARTUP_INITIALIZE_RECEIVED);
+
 		g_free(s->autocomplete_trigger_chars);
 		s->autocomplete_trigger_chars = get_autocomplete_trigger_chars(return_value);
 
@@ -540,6 +857,8 @@ static void initialize_cb(GVariant *return_value, GError *error, gpointer user_d
 		update_config(return_value, &s->config.document_symbols_available, "documentSymbolProvider");
 		update_config(return_value, &s->config.highlighting_enable, "documentHighlightProvider");
 		update_config(return_value, &s->config.code_lens_enable, "codeLensProvider");
+		update_config(return_value, &s->config.inlay_hints_enable, "inlayHintProvider");
+		update_config(return_value, &s->config.folding_range_enable, "foldingRangeProvider");
 		update_config(return_value, &s->config.goto_declaration_enable, "declarationProvider");
 		update_config(return_value, &s->config.goto_definition_enable, "definitionProvider");
 		update_config(return_value, &s->config.goto_implementation_enable, "implementationProvider");
@@ -551,13 +870,19 @@ static void initialize_cb(GVariant *return_value, GError *error, gpointer user_d
 		update_config(return_value, &s->config.code_action_enable, "codeActionProvider");
 		update_config(return_value, &s->config.rename_enable, "renameProvider");
 		update_config(return_value, &s->config.selection_range_enable, "selectionRangeProvider");
+		update_config(return_value, &s->config.call_hierarchy_enable, "callHierarchyProvider");
+		update_config(return_value, &s->config.type_hierarchy_enable, "typeHierarchyProvider");
 
 		s->supports_completion_resolve = has_capability(return_value, "completionProvider", "resolveProvider", NULL);
+		s->supports_code_lens_resolve = has_capability(return_value, "codeLensProvider", "resolveProvider", NULL);
 
 		s->supports_workspace_symbols = TRUE;
 		update_config(return_value, &s->supports_workspace_symbols, "workspaceSymbolProvider");
 
+		s->supports_pull_diagnostics = has_capability(return_value, "diagnosticProvider", NULL, NULL);
+
 		s->use_incremental_sync = use_incremental_sync(return_value);
+		s->position_encoding = get_position_encoding(return_value);
 		s->send_did_save = has_capability(return_value, "textDocumentSync", "save", NULL);
 		s->include_text_on_save = has_capability(return_value, "textDocumentSync", "save", "includeText");
 		s->use_workspace_folders = use_workspace_folders(return_value);
@@ -573,14 +898,23 @@ static void initialize_cb(GVariant *return_value, GError *error, gpointer user_d
 			(supports_semantic_token_full || supports_semantic_token_range);
 		s->config.semantic_tokens_range_only = !supports_semantic_token_full &&
 			supports_semantic_token_range;
+		s->config.semantic_tokens_supports_range = supports_semantic_token_range;
 
 		s->semantic_token_mask = get_semantic_token_mask(s, return_value);
 
 		msgwin_status_add(_("LSP server %s initialized"), s->config.cmd);
 
 		lsp_rpc_notify(s, "initialized", NULL, NULL, NULL);
+		lsp_server_record_startup(s, LSP_STARTUP_INITIALIZED_SENT);
 		s->startup_shutdown = FALSE;
 
+		if (s->is_companion)
+		{
+			if (s->companion_owner)
+				lsp_sync_open_companion_documents(s);
+			return;
+		}
+
 		lsp_semtokens_init(s->filetype);
 
 		// Duplicate request to add project root to workspace folders - this
@@ -596,6 +930,9 @@ static void initialize_cb(GVariant *return_value, GError *error, gpointer user_d
 
 		if (lsp_server_initialized_cb)
 			lsp_server_initialized_cb(s);
+
+		spawn_standby(s);
+		start_companion(s);
 	}
 	else
 	{
@@ -620,12 +957,78 @@ static const gchar *get_trace_level(LspServer *srv)
 }
 
 
+static void trim_capability(LspServer *server, GVariantDict *caps, const gchar *section,
+	const gchar *name)
+{
+	GVariant *value = g_variant_dict_lookup_value(caps, section, G_VARIANT_TYPE_VARDICT);
+	GVariantDict dict;
+
+	if (!value)
+		return;
+
+	g_variant_dict_init(&dict, value);
+	if (g_variant_dict_remove(&dict, name))
+	{
+		g_variant_dict_insert_value(caps, section, g_variant_dict_end(&dict));
+		g_ptr_array_add(server->trimmed_capabilities, g_strconcat(section, ".", name, NULL));
+	}
+	else
+		g_variant_dict_clear(&dict);
+
+	g_variant_unref(value);
+}
+
+
+/* Some servers compute or push data for everything the client claims to
+ * support - don't advertise features disabled in the configuration. Features
+ * which can also be invoked manually (like hover) are kept. */
+static GVariant *trim_capabilities(LspServer *server, GVariant *capabilities)
+{
+	LspServerConfig *cfg = &server->config;
+	GVariantDict caps;
+
+	if (server->trimmed_capabilities)
+		g_ptr_array_set_size(server->trimmed_capabilities, 0);
+	else
+		server->trimmed_capabilities = g_ptr_array_new_with_free_func(g_free);
+
+	g_variant_dict_init(&caps, capabilities);
+
+	if (!cfg->autocomplete_enable)
+		trim_capability(server, &caps, "textDocument", "completion");
+	if (!cfg->document_symbols_enable)
+		trim_capability(server, &caps, "textDocument", "documentSymbol");
+	if (!cfg->diagnostics_enable)
+	{
+		trim_capability(server, &caps, "textDocument", "publishDiagnostics");
+		trim_capability(server, &caps, "textDocument", "diagnostic");
+		trim_capability(server, &caps, "workspace", "diagnostics");
+	}
+	if (!cfg->inlay_hints_enable)
+	{
+		trim_capability(server, &caps, "textDocument", "inlayHint");
+		trim_capability(server, &caps, "workspace", "inlayHint");
+	}
+	if (!cfg->semantic_tokens_enable)
+	{
+		trim_capability(server, &caps, "textDocument", "semanticTokens");
+		trim_capability(server, &caps, "workspace", "semanticTokens");
+	}
+	if (!cfg->code_lens_enable)
+		trim_capability(server, &caps, "workspace", "codeLens");
+	if (!cfg->folding_range_enable)
+		trim_capability(server, &caps, "textDocument", "foldingRange");
+
+	return g_variant_take_ref(g_variant_dict_end(&caps));
+}
+
+
 static void perform_initialize(LspServer *server)
 {
 	GeanyDocument *doc = document_get_current();
-	gchar *project_base = lsp_utils_get_project_base_path();
+	gchar *project_base = server->root ? g_strdup(server->root) : lsp_utils_get_project_base_path();
 	GVariant *workspace_folders = NULL;
-	GVariant *node, *capabilities, *info;
+	GVariant *node, *capabilities, *trimmed, *info;
 	gchar *project_base_uri = NULL;
 	GVariantDict dct;
 
@@ -639,6 +1042,14 @@ static void perform_initialize(LspServer *server)
 		project_base_uri = g_filename_to_uri(project_base, NULL, NULL);
 
 	capabilities = JSONRPC_MESSAGE_NEW(
+		"general", "{",
+			// in order of preference, utf-8 maps directly to Scintilla positions
+			"positionEncodings", "[",
+				"utf-8",
+				"utf-32",
+				"utf-16",
+			"]",
+		"}",
 		"window", "{",
 			"workDoneProgress", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
 			"showDocument", "{",
@@ -678,6 +1089,8 @@ static void perform_initialize(LspServer *server)
 			"}",
 			"publishDiagnostics", "{",  // zls requires this to publish diagnostics
 			"}",
+			"diagnostic", "{",
+			"}",
 			"codeAction", "{",
 				"resolveSupport", "{",
 					"properties", "[",
@@ -701,6 +1114,15 @@ static void perform_initialize(LspServer *server)
 					"}",
 				"}",
 			"}",
+			"inlayHint", "{",
+			"}",
+			"foldingRange", "{",
+				"lineFoldingOnly", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
+			"callHierarchy", "{",
+			"}",
+			"typeHierarchy", "{",
+			"}",
 			"semanticTokens", "{",
 				"requests", "{",
 					"full", "{",
@@ -752,6 +1174,22 @@ static void perform_initialize(LspServer *server)
 				"}",
 			"}",
 			"workspaceFolders", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"didChangeWatchedFiles", "{",
+				"dynamicRegistration", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+				"relativePatternSupport", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
+			"semanticTokens", "{",
+				"refreshSupport", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
+			"inlayHint", "{",
+				"refreshSupport", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
+			"codeLens", "{",
+				"refreshSupport", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
+			"diagnostics", "{",
+				"refreshSupport", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
+			"}",
 			// possibly enable in the future - we have support for this
 			//"configuration", JSONRPC_MESSAGE_PUT_BOOLEAN(TRUE),
 		"}"
@@ -784,7 +1222,8 @@ static void perform_initialize(LspServer *server)
 		g_variant_dict_insert_value(&dct, "workspaceFolders", workspace_folders);
 	g_variant_dict_insert_value(&dct, "initializationOptions",
 		lsp_utils_parse_json_file_as_variant(server->config.initialization_options_file, server->config.initialization_options));
-	g_variant_dict_insert_value(&dct, "capabilities", capabilities);
+	trimmed = trim_capabilities(server, capabilities);
+	g_variant_dict_insert_value(&dct, "capabilities", trimmed);
 
 	node = g_variant_take_ref(g_variant_dict_end(&dct));
 
@@ -793,6 +1232,7 @@ static void perform_initialize(LspServer *server)
 	msgwin_status_add(_("Sending initialize request to LSP server %s"), server->config.cmd);
 
 	server->startup_shutdown = TRUE;
+	lsp_server_record_startup(server, LSP_STARTUP_INITIALIZE_SENT);
 	lsp_rpc_call_startup_shutdown(server, "initialize", node, initialize_cb, server);
 
 	g_free(project_base);
@@ -800,44 +1240,226 @@ static void perform_initialize(LspServer *server)
 	g_variant_unref(node);
 	g_variant_unref(info);
 	g_variant_unref(capabilities);
+	g_variant_unref(trimmed);
 	if (workspace_folders)
 		g_variant_unref(workspace_folders);
 }
 
 
+static void keyfile_entry_free(KeyFileEntry *entry)
+{
+	g_key_file_unref(entry->kf);
+	g_free(entry);
+}
+
+
+/* Re-initializing all servers reads the same files for every filetype on
+ * every project switch - reload them only after they change. The returned
+ * key file has to be released by g_key_file_unref(). */
 static GKeyFile *read_keyfile(const gchar *config_file)
 {
+	gint64 mtime = lsp_utils_get_file_mtime(config_file);
 	GError *error = NULL;
-	GKeyFile *kf = g_key_file_new();
+	KeyFileEntry *entry;
+
+	if (!keyfile_cache)
+		keyfile_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)keyfile_entry_free);
+
+	entry = g_hash_table_lookup(keyfile_cache, config_file);
+	if (entry && entry->mtime == mtime)
+		return g_key_file_ref(entry->kf);
 
-	if (!g_key_file_load_from_file(kf, config_file, G_KEY_FILE_NONE, &error))
+	entry = g_new0(KeyFileEntry, 1);
+	entry->kf = g_key_file_new();
+	entry->mtime = mtime;
+
+	if (!g_key_file_load_from_file(entry->kf, config_file, G_KEY_FILE_NONE, &error))
 	{
 		msgwin_status_add(_("Failed to load LSP configuration file with message %s"), error->message);
 		g_error_free(error);
 	}
 
-	return kf;
+	g_hash_table_insert(keyfile_cache, g_strdup(config_file), entry);
+
+	return g_key_file_ref(entry->kf);
 }
 
 
 static void stderr_cb(GString *string, GIOCondition condition, gpointer data)
 {
 	LspServer *srv = data;
+	gsize max_len = MAX(srv->config.stderr_tail_size, 0) * 1024;
 
 	if (srv->config.show_server_stderr)
-		fprintf(stderr, "%s", string->str);
+		fwrite(string->str, 1, string->len, stderr);
+
+	if (max_len == 0 || string->len == 0)
+		return;
+
+	if (!srv->stderr_tail)
+		srv->stderr_tail = g_string_sized_new(2 * max_len);
+
+	if (string->len >= max_len)
+		g_string_truncate(srv->stderr_tail, 0);
+	// trimmed only after reaching twice the size so the erase isn't
+	// performed for every chunk
+	else if (srv->stderr_tail->len + string->len > 2 * max_len)
+		g_string_erase(srv->stderr_tail, 0, srv->stderr_tail->len + string->len - max_len);
+
+	if (string->len > max_len)
+		g_string_append_len(srv->stderr_tail, string->str + string->len - max_len, max_len);
+	else
+		g_string_append_len(srv->stderr_tail, string->str, string->len);
 }
 
 
-static void start_lsp_server(LspServer *server)
+static void show_stderr_tail(LspServer *srv)
+{
+	gsize max_len = MAX(srv->config.stderr_tail_size, 0) * 1024;
+	const gchar *tail;
+	gchar **lines, **line;
+
+	if (!srv->stderr_tail || srv->stderr_tail->len == 0)
+		return;
+
+	tail = srv->stderr_tail->str;
+	if (srv->stderr_tail->len > max_len)
+	{
+		tail += srv->stderr_tail->len - max_len;
+		// skip the partial first line
+		if (strchr(tail, '\n'))
+			tail = strchr(tail, '\n') + 1;
+	}
+
+	msgwin_status_add(_("Last stderr output of LSP server %s:"), srv->config.cmd);
+	lines = g_strsplit(tail, "\n", -1);
+	foreach_strv(line, lines)
+	{
+		if (!EMPTY(*line))
+			msgwin_status_add("%s", *line);
+	}
+	g_strfreev(lines);
+}
+
+
+static void start_rpc(LspServer *server)
+{
+	lsp_server_record_startup(server, LSP_STARTUP_SPAWNED);
+	server->log = lsp_log_start(&server->config);
+	server->rpc = lsp_rpc_new(server, server->stream);
+
+	perform_initialize(server);
+}
+
+
+static gboolean reconnect_cb(gpointer user_data)
+{
+	LspServer *server = user_data;
+
+	server->reconnect_source = 0;
+	start_lsp_server(server);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void connect_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	GSocketConnection *connection;
+	LspServer *server = user_data;
+	GError *error = NULL;
+
+	connection = g_socket_client_connect_finish(G_SOCKET_CLIENT(source_object), res, &error);
+
+	// the server has been freed
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+		g_error_free(error);
+		return;
+	}
+
+	g_clear_object(&server->connect_cancellable);
+
+	if (!connection)
+	{
+		server->restarts++;
+		if (is_dead(server))
+		{
+			msgwin_status_add(_("Failed to connect to LSP server %s, giving up: %s"),
+				server->config.connect, error->message);
+			server->startup_shutdown = FALSE;
+		}
+		else
+		{
+			msgwin_status_add(_("Failed to connect to LSP server %s, retrying: %s"),
+				server->config.connect, error->message);
+			server->reconnect_source = plugin_timeout_add(geany_plugin, RECONNECT_DELAY,
+				reconnect_cb, server);
+		}
+		g_error_free(error);
+		return;
+	}
+
+	msgwin_status_add(_("Connected to LSP server %s"), server->config.connect);
+
+	server->connected = TRUE;
+	server->stream = G_IO_STREAM(connection);
+	start_rpc(server);
+}
+
+
+/* The address is either host:port or unix:/path/to/socket */
+static void connect_lsp_server(LspServer *server)
+{
+	const gchar *address = server->config.connect;
+	GSocketConnectable *connectable = NULL;
+	GSocketClient *client;
+	GError *error = NULL;
+
+#ifdef G_OS_UNIX
+	if (g_str_has_prefix(address, "unix:"))
+		connectable = G_SOCKET_CONNECTABLE(g_unix_socket_address_new(address + strlen("unix:")));
+	else
+#endif
+		connectable = g_network_address_parse(address, 0, &error);
+
+	if (!connectable)
+	{
+		msgwin_status_add(_("Invalid LSP server address %s, giving up: %s"), address, error->message);
+		server->restarts = 100;  // don't retry - wrong configuration
+		g_error_free(error);
+		return;
+	}
+
+	msgwin_status_add(_("Connecting to LSP server %s"), address);
+
+	// don't start again before the handshake completes
+	server->startup_shutdown = TRUE;
+	server->connect_cancellable = g_cancellable_new();
+
+	client = g_socket_client_new();
+	g_socket_client_connect_async(client, connectable, server->connect_cancellable,
+		connect_cb, server);
+
+	g_object_unref(client);
+	g_object_unref(connectable);
+}
+
+
+/* Spawns the server process without starting the RPC communication */
+static gboolean spawn_server_process(LspServer *server)
 {
 	GInputStream *input_stream;
+	GInputStream *pipe_stream;
 	GOutputStream *output_stream;
 	GError *error = NULL;
 	gint stdin_fd = -1;
 	gint stdout_fd = -1;
 	gboolean success;
-	GString *cmd = g_string_new(server->config.cmd);
+	GString *cmd;
+
+	cmd = g_string_new(server->config.cmd);
 
 #ifdef G_OS_UNIX
 	// command itself
@@ -849,11 +1471,14 @@ static void start_lsp_server(LspServer *server)
 	g_free(replacement);
 #endif
 
-	msgwin_status_add(_("Starting LSP server %s"), cmd->str);
+	if (server->standby_owner)
+		msgwin_status_add(_("Starting standby LSP server %s"), cmd->str);
+	else
+		msgwin_status_add(_("Starting LSP server %s"), cmd->str);
 
 	success = lsp_spawn_with_pipes_and_stderr_callback(NULL, cmd->str, NULL,
 		server->config.env,
-		&stdin_fd, &stdout_fd, stderr_cb, server, 0,
+		&stdin_fd, &stdout_fd, stderr_cb, server, STDERR_READ_LENGTH,
 		process_stopped, server, &server->pid, &error);
 
 	if (!success)
@@ -862,7 +1487,7 @@ static void start_lsp_server(LspServer *server)
 		server->restarts = 100;  // don't retry - probably missing executable
 		g_error_free(error);
 		g_string_free(cmd, TRUE);
-		return;
+		return FALSE;
 	}
 
 #ifdef G_OS_UNIX
@@ -871,21 +1496,40 @@ static void start_lsp_server(LspServer *server)
 #else
 	// GWin32InputStream / GWin32OutputStream use windows handle-based file
 	// API and we need fd-based API. Use our copy of unix input/output streams
-	// on Windows
+	// on Windows. They aren't pollable so GIO performs their asynchronous
+	// writes in its thread pool and reads are done by the threaded stream
+	// below - blocking pipe I/O never happens on the main thread
 	input_stream = lsp_unix_input_stream_new(stdout_fd, TRUE);
 	output_stream = lsp_unix_output_stream_new(stdin_fd, TRUE);
 #endif
+	/* keep reading server output while the main loop is busy so the server
+	 * never blocks on a full pipe */
+	pipe_stream = input_stream;
+	input_stream = lsp_threaded_input_stream_new(pipe_stream);
+	g_object_unref(pipe_stream);
 	server->stream = g_simple_io_stream_new(input_stream, output_stream);
 
-	server->log = lsp_log_start(&server->config);
-	server->rpc = lsp_rpc_new(server, server->stream);
-
-	perform_initialize(server);
 	g_string_free(cmd, TRUE);
+	return TRUE;
 }
 
 
-static void get_bool(gboolean *dest, GKeyFile *kf, const gchar *section, const gchar *key)
+static void start_lsp_server(LspServer *server)
+{
+	lsp_server_record_startup(server, LSP_STARTUP_START);
+
+	if (!EMPTY(server->config.connect))
+	{
+		connect_lsp_server(server);
+		return;
+	}
+
+	if (spawn_server_process(server))
+		start_rpc(server);
+}
+
+
+static void get_bool(gboolean *dest, GKeyFile *kf, const gchar *section, const gchar *key)
 {
 	GError *error = NULL;
 	gboolean bool_val = g_key_file_get_boolean(kf, section, key, &error);
@@ -940,7 +1584,15 @@ static void load_config(GKeyFile *kf, const gchar *section, LspServer *s)
 
 	get_bool(&s->config.use_outside_project_dir, kf, section, "use_outside_project_dir");
 	get_bool(&s->config.use_without_project, kf, section, "use_without_project");
+	get_bool(&s->config.prestart_on_project_open, kf, section, "prestart_on_project_open");
+	get_int(&s->config.root_instances_max, kf, section, "root_instances_max");
+	get_int(&s->config.restart_memory_limit, kf, section, "restart_memory_limit");
+	get_int(&s->config.restart_idle_timeout, kf, section, "restart_idle_timeout");
+	get_bool(&s->config.warm_standby, kf, section, "warm_standby");
 	get_bool(&s->config.rpc_log_full, kf, section, "rpc_log_full");
+	get_bool(&s->config.rpc_log_async, kf, section, "rpc_log_async");
+	get_int(&s->config.rpc_log_max_size, kf, section, "rpc_log_max_size");
+	get_int(&s->config.rpc_max_message_size, kf, section, "rpc_max_message_size");
 	get_str(&s->config.word_chars, kf, section, "extra_identifier_characters");
 	get_bool(&s->config.send_did_change_configuration, kf, section, "send_did_change_configuration");
 
@@ -960,7 +1612,9 @@ static void load_config(GKeyFile *kf, const gchar *section, LspServer *s)
 	get_bool(&s->config.autocomplete_use_snippets, kf, section, "autocomplete_use_snippets");
 	get_bool(&s->config.autocomplete_in_strings, kf, section, "autocomplete_in_strings");
 	get_bool(&s->config.autocomplete_show_documentation, kf, section, "autocomplete_show_documentation");
+	get_bool(&s->config.autocomplete_prefetch_enable, kf, section, "autocomplete_prefetch_enable");
 	get_int(&s->config.diagnostics_statusbar_severity, kf, section, "diagnostics_statusbar_severity");
+	get_int(&s->config.diagnostics_msgwin_severity, kf, section, "diagnostics_msgwin_severity");
 	get_str(&s->config.diagnostics_disable_for, kf, section, "diagnostics_disable_for");
 
 	get_str(&s->config.diagnostics_error_style, kf, section, "diagnostics_error_style");
@@ -974,28 +1628,45 @@ static void load_config(GKeyFile *kf, const gchar *section, LspServer *s)
 	get_bool(&s->config.signature_enable, kf, section, "signature_enable");
 	get_bool(&s->config.goto_enable, kf, section, "goto_enable");
 	get_bool(&s->config.show_server_stderr, kf, section, "show_server_stderr");
+	get_int(&s->config.stderr_tail_size, kf, section, "stderr_tail_size");
 
 	get_bool(&s->config.document_symbols_enable, kf, section, "document_symbols_enable");
 
 	get_bool(&s->config.semantic_tokens_enable, kf, section, "semantic_tokens_enable");
 	get_bool(&s->config.semantic_tokens_force_full, kf, section, "semantic_tokens_force_full");
+	get_bool(&s->config.semantic_tokens_viewport_first, kf, section, "semantic_tokens_viewport_first");
 	get_strv(&s->config.semantic_tokens_types, kf, section, "semantic_tokens_types");
 	get_int(&s->config.semantic_tokens_lexer_kw_index, kf, section, "semantic_tokens_lexer_kw_index");
 	get_str(&s->config.semantic_tokens_type_style, kf, section, "semantic_tokens_type_style");
 
 	get_bool(&s->config.highlighting_enable, kf, section, "highlighting_enable");
+	get_bool(&s->config.goto_prefetch_enable, kf, section, "goto_prefetch_enable");
 	get_str(&s->config.highlighting_style, kf, section, "highlighting_style");
 
 	get_bool(&s->config.code_lens_enable, kf, section, "code_lens_enable");
 	get_str(&s->config.code_lens_style, kf, section, "code_lens_style");
+	get_bool(&s->config.inlay_hints_enable, kf, section, "inlay_hints_enable");
+	get_bool(&s->config.folding_range_enable, kf, section, "folding_range_enable");
 
 	get_str(&s->config.formatting_options_file, kf, section, "formatting_options_file");
 	get_str(&s->config.formatting_options, kf, section, "formatting_options");
 
 	get_bool(&s->config.format_on_save, kf, section, "format_on_save");
 	get_str(&s->config.command_on_save_regex, kf, section, "command_on_save_regex");
+	get_strv(&s->config.command_on_save_kinds, kf, section, "command_on_save_kinds");
+	get_int(&s->config.on_save_timeout, kf, section, "on_save_timeout");
 
 	get_bool(&s->config.progress_bar_enable, kf, section, "progress_bar_enable");
+	get_int(&s->config.open_docs_max_count, kf, section, "open_docs_max_count");
+	get_int(&s->config.open_docs_max_size, kf, section, "open_docs_max_size");
+	get_int(&s->config.open_docs_idle_timeout, kf, section, "open_docs_idle_timeout");
+	get_int(&s->config.large_file_size, kf, section, "large_file_size");
+	get_int(&s->config.large_file_lines, kf, section, "large_file_lines");
+	get_int(&s->config.debounce_min, kf, section, "debounce_min");
+	get_int(&s->config.debounce_max, kf, section, "debounce_max");
+	get_int(&s->config.request_timeout, kf, section, "request_timeout");
+	get_strv(&s->config.request_timeouts, kf, section, "request_timeouts");
+	get_int(&s->config.background_suspend_timeouts, kf, section, "background_suspend_timeouts");
 	get_bool(&s->config.swap_header_source_enable, kf, section, "swap_header_source_enable");
 
 	get_str(&s->config.trace_value, kf, section, "trace_value");
@@ -1029,6 +1700,8 @@ static void load_config(GKeyFile *kf, const gchar *section, LspServer *s)
 	s->config.code_action_enable = TRUE;
 	s->config.rename_enable = TRUE;
 	s->config.selection_range_enable = TRUE;
+	s->config.call_hierarchy_enable = TRUE;
+	s->config.type_hierarchy_enable = TRUE;
 
 	s->config.hover_available = TRUE;
 	s->config.document_symbols_available = TRUE;
@@ -1043,6 +1716,27 @@ static void load_all_section_only_config(GKeyFile *kf, const gchar *section, Lsp
 	s->config.command_keybinding_num = CLAMP(s->config.command_keybinding_num, 1, 1000);
 
 	get_str(&s->config.document_symbols_tab_label, kf, section, "document_symbols_tab_label");
+	get_str(&s->config.hierarchy_tab_label, kf, section, "hierarchy_tab_label");
+
+	get_int(&s->config.goto_panel_max_items, kf, section, "goto_panel_max_items");
+	if (s->config.goto_panel_max_items <= 0)
+		s->config.goto_panel_max_items = 20;
+
+	get_bool(&s->config.goto_file_index_enable, kf, section, "goto_file_index_enable");
+
+	get_int(&s->config.stall_threshold, kf, section, "stall_threshold");
+	lsp_timing_set_stall_threshold(s->config.stall_threshold);
+
+	get_str(&s->config.trace_events_file, kf, section, "trace_events_file");
+	lsp_trace_start(s->config.trace_events_file);
+
+	get_str(&s->config.metrics_file, kf, section, "metrics_file");
+	get_int(&s->config.metrics_interval, kf, section, "metrics_interval");
+	lsp_metrics_start(s->config.metrics_file, s->config.metrics_interval);
+
+	get_int(&s->config.memory_cache_max_size, kf, section, "memory_cache_max_size");
+	get_bool(&s->config.memory_pressure_close_docs, kf, section, "memory_pressure_close_docs");
+	lsp_memory_set_limits(s->config.memory_cache_max_size, s->config.memory_pressure_close_docs);
 }
 
 
@@ -1061,29 +1755,29 @@ static void load_filetype_only_config(GKeyFile *kf, const gchar *section, LspSer
 		SETPTR(s->config.ref_lang, use);
 	}
 
+	get_str(&s->config.companion_cmd, kf, section, "companion_cmd");
+	get_bool(&s->config.companion_formatting, kf, section, "companion_formatting");
+
+	get_str(&s->config.connect, kf, section, "connect");
+	// connect takes precedence; cmd identifies the server everywhere
+	if (!EMPTY(s->config.connect))
+		SETPTR(s->config.cmd, g_strdup(s->config.connect));
+
 	get_strv(&s->config.env, kf, section, "env");
 	get_str(&s->config.rpc_log, kf, section, "rpc_log");
+	get_str(&s->config.rpc_capture, kf, section, "rpc_capture");
 	get_str(&s->config.initialization_options_file, kf, section, "initialization_options_file");
 	get_str(&s->config.initialization_options, kf, section, "initialization_options");
 	get_strv(&s->config.lang_id_mappings, kf, section, "lang_id_mappings");
 }
 
 
-static LspServer *server_get_or_start_for_ft(GeanyFiletype *ft, gboolean launch_server)
+static LspServer *get_or_start_server(LspServer *s, gboolean launch_server)
 {
-	LspServer *s, *s2 = NULL;
-
-	if (!ft || !lsp_servers || lsp_utils_is_lsp_disabled_for_project())
-		return NULL;
-
-	s = lsp_servers->pdata[ft->id];
-	if (s->referenced)
-		s = s->referenced;
-
 	if (s->startup_shutdown)
 		return NULL;
 
-	if (s->pid)
+	if (is_running(s))
 		return s;
 
 	if (s->not_used)
@@ -1095,22 +1789,6 @@ static LspServer *server_get_or_start_for_ft(GeanyFiletype *ft, gboolean launch_
 	if (!launch_server)
 		return NULL;
 
-	if (s->config.ref_lang)
-	{
-		GeanyFiletype *ref_ft = filetypes_lookup_by_name(s->config.ref_lang);
-
-		if (ref_ft)
-		{
-			s2 = g_ptr_array_index(lsp_servers, ref_ft->id);
-			s->referenced = s2;
-			if (s2->pid)
-				return s2;
-		}
-	}
-
-	if (s2)
-		s = s2;
-
 	if (s->config.cmd)
 		g_strstrip(s->config.cmd);
 	if (EMPTY(s->config.cmd))
@@ -1130,9 +1808,137 @@ static LspServer *server_get_or_start_for_ft(GeanyFiletype *ft, gboolean launch_
 }
 
 
+static void stop_lru_instance(LspServer *slot)
+{
+	LspServer *lru = NULL;
+	GHashTableIter iter;
+	gpointer val;
+
+	g_hash_table_iter_init(&iter, slot->instances);
+	while (g_hash_table_iter_next(&iter, NULL, &val))
+	{
+		LspServer *s = val;
+
+		if (!lru || s->last_used < lru->last_used)
+			lru = s;
+	}
+
+	msgwin_status_add(_("Stopping LSP server %s for %s - too many instances running"),
+		lru->config.cmd, lru->root);
+
+	g_hash_table_steal(slot->instances, lru->root);
+	stop_and_free_server(lru);
+}
+
+
+/* With root_instances_max, every workspace root gets its own server instance
+ * so indexes of big repositories stay small; the least recently used
+ * instance is stopped when the limit is reached */
+static LspServer *get_instance(LspServer *slot, const gchar *root, gboolean launch_server)
+{
+	LspServer *s = slot->instances ? g_hash_table_lookup(slot->instances, root) : NULL;
+
+	if (!s)
+	{
+		if (!launch_server)
+			return NULL;
+
+		if (!slot->instances)
+			slot->instances = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				(GDestroyNotify)stop_and_free_server);
+
+		while (g_hash_table_size(slot->instances) >= (guint)slot->config.root_instances_max)
+			stop_lru_instance(slot);
+
+		s = lsp_server_init(slot->filetype);
+		s->root = g_strdup(root);
+		g_hash_table_insert(slot->instances, s->root, s);
+	}
+
+	s->last_used = g_get_monotonic_time();
+
+	return s;
+}
+
+
+static LspServer *get_slot(GeanyFiletype *ft)
+{
+	LspServer *s = lsp_servers->pdata[ft->id];
+
+	if (!s->referenced && s->config.ref_lang)
+	{
+		GeanyFiletype *ref_ft = filetypes_lookup_by_name(s->config.ref_lang);
+
+		if (ref_ft)
+			s->referenced = lsp_servers->pdata[ref_ft->id];
+	}
+
+	return s->referenced ? s->referenced : s;
+}
+
+
+/* root is the workspace root of the document the server is requested for,
+ * NULL when unknown */
+static LspServer *server_get_or_start_for_ft(GeanyFiletype *ft, const gchar *root,
+	gboolean launch_server)
+{
+	LspServer *s;
+
+	if (!ft || !lsp_servers || lsp_utils_is_lsp_disabled_for_project())
+		return NULL;
+
+	s = get_slot(ft);
+
+	if (root && s->config.root_instances_max > 0)
+	{
+		s = get_instance(s, root, launch_server);
+		if (!s)
+			return NULL;
+	}
+
+	return get_or_start_server(s, launch_server);
+}
+
+
 LspServer *lsp_server_get_for_ft(GeanyFiletype *ft)
 {
-	return server_get_or_start_for_ft(ft, TRUE);
+	return server_get_or_start_for_ft(ft, NULL, TRUE);
+}
+
+
+/* Starts servers configured with prestart_on_project_open without waiting for
+ * a document needing them - the handshake and initial indexing then overlap
+ * with loading the project session */
+void lsp_server_prestart_all(void)
+{
+	GeanyFiletype *ft;
+	guint i;
+
+	if (!lsp_servers)
+		return;
+
+	for (i = 0; (ft = filetypes_index(i)); i++)
+	{
+		LspServer *s = lsp_servers->pdata[i];
+
+		// per-root instances need a document to find the root
+		if (!s->config.prestart_on_project_open || (EMPTY(s->config.cmd) && !s->config.ref_lang) ||
+			s->config.root_instances_max > 0)
+		{
+			continue;
+		}
+
+		s->prestarted = TRUE;
+		if (s->config.ref_lang)
+		{
+			GeanyFiletype *ref_ft = filetypes_lookup_by_name(s->config.ref_lang);
+
+			if (ref_ft)
+				((LspServer *)lsp_servers->pdata[ref_ft->id])->prestarted = TRUE;
+		}
+
+		server_get_or_start_for_ft(ft, NULL, TRUE);
+	}
 }
 
 
@@ -1178,21 +1984,19 @@ static gboolean is_lsp_valid_for_doc(LspServerConfig *cfg, GeanyDocument *doc)
 }
 
 
-#if ! GLIB_CHECK_VERSION(2, 70, 0)
-#define g_pattern_spec_match_string g_pattern_match_string
-#endif
+static void ft_mapping_free(FtMapping *mapping)
+{
+	g_free(mapping->lang_id);
+	g_free(mapping);
+}
 
-static GeanyFiletype *lsp_server_get_ft_impl(GeanyDocument *doc, gchar **lsp_lang_id)
+
+static FtMapping *find_ft_mapping(const gchar *fname)
 {
+	FtMapping *mapping = g_new0(FtMapping, 1);
 	LspServer *srv;
 	guint i;
 
-	if (!lsp_servers || !doc->real_path)
-	{
-		*lsp_lang_id = lsp_utils_get_lsp_lang_id(doc);
-		return doc->file_type;
-	}
-
 	foreach_ptr_array(srv, i, lsp_servers)
 	{
 		gint j = 0;
@@ -1206,29 +2010,54 @@ static GeanyFiletype *lsp_server_get_ft_impl(GeanyDocument *doc, gchar **lsp_lan
 		{
 			if (j % 2 == 0)
 				lang_id = *val;
-			else
+			else if (lsp_utils_pattern_match(srv->config.lang_id_patterns->pdata[j / 2], fname))
 			{
-				GPatternSpec *spec = g_pattern_spec_new(*val);
-				gchar *fname = g_path_get_basename(doc->file_name);
-				GeanyFiletype *ret = NULL;
-
-				if (g_pattern_spec_match_string(spec, fname))
-					ret = filetypes_index(i);
-
-				g_pattern_spec_free(spec);
-				g_free(fname);
-
-				if (ret)
-				{
-					*lsp_lang_id = g_strdup(lang_id);
-					return ret;
-				}
+				mapping->ft = filetypes_index(i);
+				mapping->lang_id = g_strdup(lang_id);
+				return mapping;
 			}
 
 			j++;
 		}
 	}
 
+	return mapping;
+}
+
+
+/* The patterns of all servers are only matched once per file name, the
+ * per-document cache is cleared e.g. whenever the file type changes */
+static GeanyFiletype *lsp_server_get_ft_impl(GeanyDocument *doc, gchar **lsp_lang_id)
+{
+	FtMapping *mapping;
+	gchar *fname;
+
+	if (!lsp_servers || !doc->real_path)
+	{
+		*lsp_lang_id = lsp_utils_get_lsp_lang_id(doc);
+		return doc->file_type;
+	}
+
+	if (!ft_mapping_cache)
+		ft_mapping_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)ft_mapping_free);
+
+	fname = g_path_get_basename(doc->file_name);
+	mapping = g_hash_table_lookup(ft_mapping_cache, fname);
+	if (!mapping)
+	{
+		mapping = find_ft_mapping(fname);
+		g_hash_table_insert(ft_mapping_cache, fname, mapping);
+	}
+	else
+		g_free(fname);
+
+	if (mapping->ft)
+	{
+		*lsp_lang_id = g_strdup(mapping->lang_id);
+		return mapping->ft;
+	}
+
 	*lsp_lang_id = lsp_utils_get_lsp_lang_id(doc);
 	return doc->file_type;
 }
@@ -1236,31 +2065,36 @@ static GeanyFiletype *lsp_server_get_ft_impl(GeanyDocument *doc, gchar **lsp_lan
 
 void lsp_server_clear_cached_ft(GeanyDocument *doc)
 {
-	plugin_set_document_data(geany_plugin, doc, CACHED_FILETYPE_KEY, NULL);
-	plugin_set_document_data_full(geany_plugin, doc, CACHED_LANG_ID_KEY, NULL, g_free);
+	LspDocState *state = lsp_doc_state_get(doc);
+
+	state->ft = NULL;
+	SETPTR(state->lang_id, NULL);
+	SETPTR(state->root, NULL);
+	state->configured_valid = FALSE;
+	state->configured_ft = -1;
+	SETPTR(state->configured_path, NULL);
+	state->diag_disabled_cfg = NULL;
 }
 
 
 GeanyFiletype *lsp_server_get_ft(GeanyDocument *doc, gchar **lsp_lang_id)
 {
-	GeanyFiletype *ft = plugin_get_document_data(geany_plugin, doc, CACHED_FILETYPE_KEY);
+	LspDocState *state = lsp_doc_state_get(doc);
 	gchar *lang_id;
 
-	if (ft)
+	if (state->ft)
 	{
 		if (lsp_lang_id)
-			*lsp_lang_id = g_strdup(plugin_get_document_data(geany_plugin, doc, CACHED_LANG_ID_KEY));
-		return ft;
+			*lsp_lang_id = g_strdup(state->lang_id);
+		return state->ft;
 	}
 
-	ft = lsp_server_get_ft_impl(doc, &lang_id);
+	state->ft = lsp_server_get_ft_impl(doc, &lang_id);
 	if (lsp_lang_id)
 		*lsp_lang_id = g_strdup(lang_id);
+	SETPTR(state->lang_id, lang_id);
 
-	plugin_set_document_data(geany_plugin, doc, CACHED_FILETYPE_KEY, ft);
-	plugin_set_document_data_full(geany_plugin, doc, CACHED_LANG_ID_KEY, lang_id, g_free);
-
-	return ft;
+	return state->ft;
 }
 
 
@@ -1295,15 +2129,61 @@ static LspServer *server_get_configured_for_doc(GeanyDocument *doc)
 }
 
 
+/* Root of the server instance for the document when servers run per root,
+ * cached because finding it requires file system access */
+static const gchar *get_doc_root(GeanyDocument *doc, LspServer *configured)
+{
+	LspDocState *state;
+
+	if (configured->config.root_instances_max <= 0)
+		return NULL;
+
+	state = lsp_doc_state_get(doc);
+	if (!state->root)
+	{
+		state->root = lsp_utils_find_project_root(doc, &configured->config);
+		if (!state->root)
+			state->root = g_strdup("");
+	}
+
+	return EMPTY(state->root) ? NULL : state->root;
+}
+
+
+/* Called for every notification - finding the configured server means
+ * checking project paths and root markers so the result is cached until the
+ * document's file name, file type or the server configuration change */
+static LspServer *server_get_configured_for_doc_cached(GeanyDocument *doc)
+{
+	LspDocState *state;
+
+	if (!doc || !doc->real_path || !lsp_servers || lsp_utils_is_lsp_disabled_for_project())
+		return NULL;
+
+	state = lsp_doc_state_get(doc);
+	if (!state->configured_valid || g_strcmp0(state->configured_path, doc->real_path) != 0)
+	{
+		LspServer *s = server_get_configured_for_doc(doc);
+
+		state->configured_ft = s ? s->filetype : -1;
+		SETPTR(state->configured_path, g_strdup(doc->real_path));
+		state->configured_valid = TRUE;
+	}
+
+	return state->configured_ft >= 0 ? lsp_servers->pdata[state->configured_ft] : NULL;
+}
+
+
 static LspServer *server_get_for_doc(GeanyDocument *doc, gboolean launch_server)
 {
+	LspServer *configured = server_get_configured_for_doc_cached(doc);
 	GeanyFiletype *ft;
 
-	if (server_get_configured_for_doc(doc) == NULL)
+	if (configured == NULL)
 		return NULL;
 
 	ft = lsp_server_get_ft(doc, NULL);
-	return server_get_or_start_for_ft(ft, launch_server);
+	return server_get_or_start_for_ft(ft, get_doc_root(doc, configured), launch_server);
 }
 
 
@@ -1319,6 +2199,78 @@ LspServer *lsp_server_get_if_running(GeanyDocument *doc)
 }
 
 
+/* The initialized companion of srv, NULL when there's none */
+LspServer *lsp_server_get_companion(LspServer *srv)
+{
+	LspServer *companion = srv ? srv->companion : NULL;
+
+	if (!companion || !companion->rpc || companion->startup_shutdown)
+		return NULL;
+
+	return companion;
+}
+
+
+/* The companion of srv when configured by companion_formatting, srv
+ * otherwise */
+LspServer *lsp_server_get_for_formatting(LspServer *srv)
+{
+	LspServer *companion = lsp_server_get_companion(srv);
+
+	// ranges and edits are converted with the owner's position encoding
+	if (companion && srv->config.companion_formatting &&
+		companion->position_encoding == srv->position_encoding)
+		return companion;
+
+	return srv;
+}
+
+
+/* When the document's server is being started, remembers the action so it
+ * can be performed after the initialize handshake instead of getting lost.
+ * Only the latest action of every kind is kept per document. Returns whether
+ * the action was queued. */
+gboolean lsp_server_queue_until_initialized(GeanyDocument *doc, guint action, gint pos)
+{
+	LspServer *s = server_get_configured_for_doc(doc);
+	LspServerQueuedAction *queued = NULL;
+	const gchar *root;
+	GList *item;
+
+	root = s ? get_doc_root(doc, s) : NULL;
+	if (root)
+		s = s->instances ? g_hash_table_lookup(s->instances, root) : NULL;
+
+	// set also when connecting; servers in shutdown are not in lsp_servers
+	if (!s || !s->startup_shutdown || is_dead(s))
+		return FALSE;
+
+	if (!s->init_queue)
+		s->init_queue = g_queue_new();
+
+	foreach_list(item, s->init_queue->head)
+	{
+		LspServerQueuedAction *a = item->data;
+
+		if (a->doc_id == doc->id && a->action == action)
+		{
+			queued = a;
+			g_queue_delete_link(s->init_queue, item);
+			break;
+		}
+	}
+
+	if (!queued)
+		queued = g_new0(LspServerQueuedAction, 1);
+	queued->doc_id = doc->id;
+	queued->action = action;
+	queued->pos = pos;
+	g_queue_push_tail(s->init_queue, queued);
+
+	return TRUE;
+}
+
+
 LspServerConfig *lsp_server_get_all_section_config(void)
 {
 	// hack - the assumption is that nobody will ever configure anything for
@@ -1341,6 +2293,134 @@ gboolean lsp_server_is_usable(GeanyDocument *doc)
 }
 
 
+/* Features processing the whole file are degraded for files above
+ * large_file_size kilobytes or large_file_lines lines */
+gboolean lsp_server_is_large_file(LspServer *srv, GeanyDocument *doc)
+{
+	ScintillaObject *sci = doc->editor->sci;
+
+	return (srv->config.large_file_size > 0 &&
+			sci_get_length(sci) > (gint64)srv->config.large_file_size * 1024) ||
+		(srv->config.large_file_lines > 0 && sci_get_line_count(sci) > srv->config.large_file_lines);
+}
+
+
+/* Reads the resident memory and the consumed CPU time of the server process
+ * from /proc */
+static gboolean update_resource_usage(LspServer *srv)
+{
+#ifdef __linux__
+	gchar *path, *contents = NULL;
+	gboolean success = FALSE;
+	guint64 resident, utime, stime;
+
+	if (srv->pid <= 0)
+		return FALSE;
+
+	path = g_strdup_printf("/proc/%d/statm", (gint)srv->pid);
+	if (g_file_get_contents(path, &contents, NULL, NULL) &&
+		sscanf(contents, "%*u %" G_GUINT64_FORMAT, &resident) == 1)
+	{
+		srv->mem_rss = resident * sysconf(_SC_PAGESIZE);
+		success = TRUE;
+	}
+	g_free(contents);
+	g_free(path);
+
+	contents = NULL;
+	path = g_strdup_printf("/proc/%d/stat", (gint)srv->pid);
+	if (success && g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		// the command name in parentheses may contain spaces
+		gchar *fields = strrchr(contents, ')');
+
+		if (fields && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %"
+			G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, &utime, &stime) == 2)
+		{
+			srv->cpu_time = (gdouble)(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+	}
+	g_free(contents);
+	g_free(path);
+
+	return success;
+#else
+	return FALSE;
+#endif
+}
+
+
+/* Replaces the server by a new one which re-opens the documents of the old one
+ * once initialized */
+static void restart_gracefully(LspServer *srv)
+{
+	LspServer *standby = take_standby(srv);
+	LspServer *new_srv = standby ? standby : new_server_for(srv);
+
+	new_srv->prestarted = TRUE;
+	replace_server(srv, new_srv);
+	stop_process(srv);
+	if (standby)
+		start_rpc(new_srv);
+	else
+		start_lsp_server(new_srv);
+}
+
+
+static void check_server_resources(LspServer *srv)
+{
+	gint64 idle_time;
+
+	if (srv->pid <= 0 || srv->startup_shutdown || !srv->rpc)
+		return;
+
+	if (srv->config.restart_memory_limit > 0 && update_resource_usage(srv) &&
+		srv->mem_rss > (guint64)srv->config.restart_memory_limit * 1024 * 1024)
+	{
+		msgwin_status_add(_("LSP server %s uses %" G_GUINT64_FORMAT " MB of memory, restarting"),
+			srv->config.cmd, srv->mem_rss / (1024 * 1024));
+		restart_gracefully(srv);
+		return;
+	}
+
+	idle_time = g_get_monotonic_time() - lsp_rpc_get_last_activity(srv->rpc);
+	if (srv->config.restart_idle_timeout > 0 &&
+		idle_time > (gint64)srv->config.restart_idle_timeout * 60 * G_USEC_PER_SEC)
+	{
+		gint ft = srv->filetype;
+		gboolean is_instance = srv->root != NULL;
+
+		msgwin_status_add(_("LSP server %s unused for %d minutes, stopping"),
+			srv->config.cmd, srv->config.restart_idle_timeout);
+		// started again on demand, re-opening the documents
+		stop_process(srv);
+		if (!is_instance && lsp_servers)
+			((LspServer *)lsp_servers->pdata[ft])->prestarted = TRUE;
+	}
+}
+
+
+static GPtrArray *get_all_servers(void);
+
+static gboolean watchdog_cb(gpointer user_data)
+{
+	GPtrArray *servers;
+	LspServer *srv;
+	guint i;
+
+	if (!lsp_servers)
+		return G_SOURCE_CONTINUE;
+
+	// restarts modify lsp_servers
+	servers = get_all_servers();
+	foreach_ptr_array(srv, i, servers)
+		check_server_resources(srv);
+	g_ptr_array_free(servers, TRUE);
+
+	return G_SOURCE_CONTINUE;
+}
+
+
 void lsp_server_stop_all(gboolean wait)
 {
 	GPtrArray *lsp_servers_tmp = lsp_servers;
@@ -1351,6 +2431,10 @@ void lsp_server_stop_all(gboolean wait)
 	if (lsp_servers_tmp)
 		g_ptr_array_free(lsp_servers_tmp, TRUE);
 
+	if (watchdog_source)
+		g_source_remove(watchdog_source);
+	watchdog_source = 0;
+
 	if (wait)
 	{
 		GMainContext *main_context = g_main_context_ref_thread_default();
@@ -1364,10 +2448,64 @@ void lsp_server_stop_all(gboolean wait)
 }
 
 
+/* Frees caches kept across server restarts, once the plugin is unloaded */
+void lsp_server_free_caches(void)
+{
+	if (ft_mapping_cache)
+		g_hash_table_destroy(ft_mapping_cache);
+	ft_mapping_cache = NULL;
+
+	if (keyfile_cache)
+		g_hash_table_destroy(keyfile_cache);
+	keyfile_cache = NULL;
+}
+
+
+// compiled once here instead of for every document and directory they are matched against
+static void compile_patterns(LspServerConfig *cfg)
+{
+	gchar **val;
+	gint j = 0;
+
+	if (cfg->lang_id_mappings)
+	{
+		cfg->lang_id_patterns = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+		foreach_strv(val, cfg->lang_id_mappings)
+		{
+			if (j % 2 == 1)
+				g_ptr_array_add(cfg->lang_id_patterns, g_pattern_spec_new(*val));
+			j++;
+		}
+	}
+
+	if (cfg->project_root_marker_patterns)
+	{
+		cfg->project_root_marker_specs = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+		foreach_strv(val, cfg->project_root_marker_patterns)
+			g_ptr_array_add(cfg->project_root_marker_specs, g_pattern_spec_new(*val));
+		cfg->project_root_marker_key = g_strjoinv("\n", cfg->project_root_marker_patterns);
+	}
+
+	if (!EMPTY(cfg->diagnostics_disable_for))
+	{
+		gchar **comps = g_strsplit(cfg->diagnostics_disable_for, ";", -1);
+
+		cfg->diagnostics_disable_specs = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+		foreach_strv(val, comps)
+		{
+			if (!EMPTY(*val))
+				g_ptr_array_add(cfg->diagnostics_disable_specs, g_pattern_spec_new(*val));
+		}
+		g_strfreev(comps);
+	}
+}
+
+
 static LspServer *lsp_server_new(GKeyFile *kf_global, GKeyFile *kf, GeanyFiletype *ft)
 {
 	LspServer *s = g_new0(LspServer, 1);
 	GString *wc = g_string_new(GEANY_WORDCHARS);
+	gint64 start_time = g_get_monotonic_time();
 	guint i, word_chars_len;
 
 	s->filetype = ft->id;
@@ -1394,6 +2532,9 @@ static LspServer *lsp_server_new(GKeyFile *kf_global, GKeyFile *kf, GeanyFiletyp
 	g_free(s->config.word_chars);
 	s->config.word_chars = g_string_free(wc, FALSE);
 
+	compile_patterns(&s->config);
+	s->config_load_time = g_get_monotonic_time() - start_time;
+
 	lsp_sync_init(s);
 	lsp_diagnostics_init(s);
 	lsp_workspace_folders_init(s);
@@ -1409,8 +2550,8 @@ static LspServer *lsp_server_init(gint ft)
 	GeanyFiletype *filetype = filetypes_index(ft);
 	LspServer *s = lsp_server_new(kf_global, kf, filetype);
 
-	g_key_file_free(kf);
-	g_key_file_free(kf_global);
+	g_key_file_unref(kf);
+	g_key_file_unref(kf_global);
 
 	return s;
 }
@@ -1434,6 +2575,8 @@ void lsp_server_init_all(void)
 		GeanyDocument *doc = documents[i];
 		lsp_server_clear_cached_ft(doc);
 	}
+	if (ft_mapping_cache)
+		g_hash_table_remove_all(ft_mapping_cache);
 
 	lsp_servers = g_ptr_array_new_full(0, (GDestroyNotify)stop_and_free_server);
 
@@ -1443,8 +2586,10 @@ void lsp_server_init_all(void)
 		g_ptr_array_add(lsp_servers, s);
 	}
 
-	g_key_file_free(kf);
-	g_key_file_free(kf_global);
+	g_key_file_unref(kf);
+	g_key_file_unref(kf_global);
+
+	watchdog_source = plugin_timeout_add(geany_plugin, WATCHDOG_INTERVAL, watchdog_cb, NULL);
 }
 
 
@@ -1479,9 +2624,151 @@ gboolean lsp_server_uses_init_file(gchar *path)
 }
 
 
+// servers of all filetypes including their per-root instances
+static GPtrArray *get_all_servers(void)
+{
+	GPtrArray *servers = g_ptr_array_new();
+	guint i;
+
+	for (i = 0; i < lsp_servers->len; i++)
+	{
+		LspServer *s = lsp_servers->pdata[i];
+
+		g_ptr_array_add(servers, s);
+		if (s->instances)
+		{
+			GHashTableIter iter;
+			gpointer val;
+
+			g_hash_table_iter_init(&iter, s->instances);
+			while (g_hash_table_iter_next(&iter, NULL, &val))
+				g_ptr_array_add(servers, val);
+		}
+	}
+
+	return servers;
+}
+
+
+/* Running servers including per-root instances, free with g_ptr_array_free() */
+GPtrArray *lsp_server_get_all_running(void)
+{
+	GPtrArray *running = g_ptr_array_new();
+	GPtrArray *servers;
+	LspServer *s;
+	guint i;
+
+	if (!lsp_servers)
+		return running;
+
+	servers = get_all_servers();
+	foreach_ptr_array(s, i, servers)
+	{
+		if (s->config.cmd && s->rpc)
+			g_ptr_array_add(running, s);
+	}
+	g_ptr_array_free(servers, TRUE);
+
+	return running;
+}
+
+
+static const gchar *get_server_name(LspServer *s, gchar **buf)
+{
+	if (!s->root)
+		return s->config.cmd;
+
+	*buf = g_strconcat(s->config.cmd, " (", s->root, ")", NULL);
+	return *buf;
+}
+
+
+void lsp_server_record_startup(LspServer *srv, LspStartupEvent event)
+{
+	if (srv && srv->startup_times[event] == 0)
+		srv->startup_times[event] = g_get_monotonic_time();
+}
+
+
+static const gchar *startup_event_names[LSP_STARTUP_NUM] = {
+	"start",
+	"spawned",
+	"initialize sent",
+	"initialize received",
+	"initialized sent",
+	"first didOpen",
+	"first diagnostics",
+	"first semantic tokens"
+};
+
+
+/* milliseconds since start_lsp_server(), -1 when the event hasn't happened */
+static gdouble get_startup_offset(LspServer *s, LspStartupEvent event)
+{
+	if (s->startup_times[LSP_STARTUP_START] == 0 || s->startup_times[event] == 0)
+		return -1;
+	return (s->startup_times[event] - s->startup_times[LSP_STARTUP_START]) / 1000.0;
+}
+
+
+static void append_startup_json(LspServer *s, GString *str)
+{
+	LspStartupEvent event;
+
+	g_string_append_printf(str, "{\n  \"config load\": %.1f", s->config_load_time / 1000.0);
+	for (event = LSP_STARTUP_SPAWNED; event < LSP_STARTUP_NUM; event++)
+	{
+		gdouble offset = get_startup_offset(s, event);
+
+		if (offset < 0)
+			g_string_append_printf(str, ",\n  \"%s\": null", startup_event_names[event]);
+		else
+			g_string_append_printf(str, ",\n  \"%s\": %.1f", startup_event_names[event], offset);
+	}
+	g_string_append(str, "\n}");
+}
+
+
+static void append_startup_statistics(LspServer *s, GString *str)
+{
+	LspStartupEvent event;
+
+	g_string_append_printf(str, "startup (ms since start, config load %.1f ms)\n",
+		s->config_load_time / 1000.0);
+	for (event = LSP_STARTUP_SPAWNED; event < LSP_STARTUP_NUM; event++)
+	{
+		gdouble offset = get_startup_offset(s, event);
+
+		if (offset < 0)
+			g_string_append_printf(str, "  %-24s -\n", startup_event_names[event]);
+		else
+			g_string_append_printf(str, "  %-24s %.1f\n", startup_event_names[event], offset);
+	}
+	g_string_append_c(str, '\n');
+}
+
+
+static void append_trimmed_capabilities_json(LspServer *s, const gchar *server_name, GString *str)
+{
+	const gchar *name;
+	guint i;
+
+	if (!s->trimmed_capabilities || s->trimmed_capabilities->len == 0)
+		return;
+
+	g_string_append(str, ",\n\n\"");
+	g_string_append(str, server_name);
+	g_string_append(str, " client capabilities not sent\":\n[");
+	foreach_ptr_array(name, i, s->trimmed_capabilities)
+		g_string_append_printf(str, "%s\n  \"%s\"", i > 0 ? "," : "", name);
+	g_string_append(str, "\n]");
+}
+
+
 gchar *lsp_server_get_initialize_responses(void)
 {
 	gboolean first = TRUE;
+	GPtrArray *servers;
 	GString *str;
 	guint i;
 
@@ -1489,23 +2776,34 @@ gchar *lsp_server_get_initialize_responses(void)
 		return FALSE;
 
 	str = g_string_new("{");
+	servers = get_all_servers();
 
-	for (i = 0; i < lsp_servers->len; i++)
+	for (i = 0; i < servers->len; i++)
 	{
-		LspServer *s = lsp_servers->pdata[i];
+		LspServer *s = servers->pdata[i];
+		const gchar *server_name;
+		gchar *name = NULL;
 
 		if (s->config.cmd && s->initialize_response)
 		{
 			if (!first)
 				g_string_append(str, "\n\n\"############################################################\": \"next server\",");
 			first = FALSE;
+			server_name = get_server_name(s, &name);
 			g_string_append(str, "\n\n\"");
-			g_string_append(str, s->config.cmd);
+			g_string_append(str, server_name);
 			g_string_append(str, "\":\n");
 			g_string_append(str, s->initialize_response);
+			g_string_append(str, ",\n\n\"");
+			g_string_append(str, server_name);
+			g_string_append(str, " startup ms\":\n");
+			append_startup_json(s, str);
+			append_trimmed_capabilities_json(s, server_name, str);
 			g_string_append_c(str, ',');
 		}
+		g_free(name);
 	}
+	g_ptr_array_free(servers, TRUE);
 	if (g_str_has_suffix(str->str, ","))
 		g_string_erase(str, str->len-1, 1);
 	g_string_append(str, "\n}");
@@ -1514,6 +2812,197 @@ gchar *lsp_server_get_initialize_responses(void)
 }
 
 
+static void append_memory_row(GString *str, const gchar *name, gsize *sizes)
+{
+	g_string_append_printf(str, "%-45s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+		sizes[0] / 1024.0, sizes[1] / 1024.0, sizes[2] / 1024.0, sizes[3] / 1024.0,
+		sizes[4] / 1024.0, (sizes[0] + sizes[1] + sizes[2] + sizes[3] + sizes[4]) / 1024.0);
+}
+
+
+// approximate memory of the plugin's caches of the server's documents
+static void append_memory_statistics(LspServer *s, GString *str)
+{
+	gsize totals[5] = {0, 0, 0, 0, 0};
+	guint i;
+
+	g_string_append_printf(str, "\n%-45s %9s %9s %9s %9s %9s %9s\n", "plugin memory KB",
+		"semtokens", "symbols", "sym tree", "diags", "code lens", "total");
+
+	foreach_document(i)
+	{
+		GeanyDocument *doc = documents[i];
+		gsize sizes[5];
+		gchar *name;
+		guint j;
+
+		if (lsp_server_get_if_running(doc) != s)
+			continue;
+
+		sizes[0] = lsp_semtokens_get_cache_size(doc);
+		sizes[1] = lsp_symbols_get_cache_size(doc);
+		sizes[2] = lsp_symbol_tree_get_cache_size(doc);
+		sizes[3] = lsp_diagnostics_get_cache_size(s, doc);
+		sizes[4] = lsp_code_lens_get_cache_size(doc);
+		for (j = 0; j < G_N_ELEMENTS(sizes); j++)
+			totals[j] += sizes[j];
+
+		name = g_path_get_basename(DOC_FILENAME(doc));
+		append_memory_row(str, name, sizes);
+		g_free(name);
+	}
+
+	// diagnostics are also kept for files that aren't open
+	totals[3] = lsp_diagnostics_get_cache_size(s, NULL);
+	append_memory_row(str, "server total", totals);
+}
+
+
+gchar *lsp_server_get_statistics(void)
+{
+	GPtrArray *servers;
+	GString *str;
+	guint i;
+
+	if (!lsp_servers)
+		return NULL;
+
+	str = g_string_new(NULL);
+	servers = get_all_servers();
+
+	for (i = 0; i < servers->len; i++)
+	{
+		LspServer *s = servers->pdata[i];
+
+		if (s->config.cmd && s->rpc)
+		{
+			gchar *name = NULL;
+
+			if (str->len > 0)
+				g_string_append_c(str, '\n');
+			g_string_append_printf(str, "%s\n\n", get_server_name(s, &name));
+			if (update_resource_usage(s))
+				g_string_append_printf(str, "pid %d, memory %.1f MB, CPU time %.1f s\n",
+					(gint)s->pid, s->mem_rss / (1024.0 * 1024.0), s->cpu_time);
+			g_string_append_printf(str, "idle %" G_GINT64_FORMAT " s\n\n",
+				(g_get_monotonic_time() - lsp_rpc_get_last_activity(s->rpc)) / G_USEC_PER_SEC);
+			append_startup_statistics(s, str);
+			lsp_rpc_append_statistics(s->rpc, str);
+			append_memory_statistics(s, str);
+			g_free(name);
+		}
+	}
+	g_ptr_array_free(servers, TRUE);
+
+	if (str->len > 0)
+		g_string_append_c(str, '\n');
+	lsp_timing_append_statistics(str);
+
+	return g_string_free(str, FALSE);
+}
+
+
+static gsize get_plugin_cache_size(LspServer *s)
+{
+	gsize size = lsp_diagnostics_get_cache_size(s, NULL);
+	guint i;
+
+	foreach_document(i)
+	{
+		GeanyDocument *doc = documents[i];
+
+		if (lsp_server_get_if_running(doc) == s)
+			size += lsp_semtokens_get_cache_size(doc) + lsp_symbols_get_cache_size(doc) +
+				lsp_symbol_tree_get_cache_size(doc) + lsp_code_lens_get_cache_size(doc);
+	}
+
+	return size;
+}
+
+
+static gchar *build_metrics_line(JsonBuilder *builder)
+{
+	JsonNode *root = json_builder_get_root(builder);
+	gchar *line = json_to_string(root, FALSE);
+
+	json_node_unref(root);
+	json_builder_reset(builder);
+
+	return line;
+}
+
+
+/* One JSON object per line for every running server and one for the plugin
+ * itself, see metrics_file in lsp.conf */
+gchar *lsp_server_get_metrics(void)
+{
+	JsonBuilder *builder = json_builder_new();
+	gint64 now = g_get_real_time();
+	GPtrArray *servers;
+	GString *str;
+	LspServer *s;
+	gchar *line;
+	guint i;
+
+	str = g_string_new(NULL);
+	servers = lsp_server_get_all_running();
+
+	foreach_ptr_array(s, i, servers)
+	{
+		json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "time");
+		json_builder_add_int_value(builder, now);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "server");
+		json_builder_set_member_name(builder, "server");
+		json_builder_add_string_value(builder, s->config.cmd);
+		json_builder_set_member_name(builder, "filetype");
+		json_builder_add_string_value(builder, filetypes_index(s->filetype)->name);
+		if (s->root)
+		{
+			json_builder_set_member_name(builder, "root");
+			json_builder_add_string_value(builder, s->root);
+		}
+		if (update_resource_usage(s))
+		{
+			json_builder_set_member_name(builder, "rss_bytes");
+			json_builder_add_int_value(builder, s->mem_rss);
+			json_builder_set_member_name(builder, "cpu_time");
+			json_builder_add_double_value(builder, s->cpu_time);
+		}
+		json_builder_set_member_name(builder, "resident_docs");
+		json_builder_add_int_value(builder, s->resident_docs->length);
+		json_builder_set_member_name(builder, "resident_docs_bytes");
+		json_builder_add_int_value(builder, s->resident_docs_size);
+		json_builder_set_member_name(builder, "plugin_cache_bytes");
+		json_builder_add_int_value(builder, get_plugin_cache_size(s));
+		lsp_rpc_append_metrics(s->rpc, builder);
+		json_builder_end_object(builder);
+
+		line = build_metrics_line(builder);
+		g_string_append_printf(str, "%s\n", line);
+		g_free(line);
+	}
+	g_ptr_array_free(servers, TRUE);
+
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, "time");
+	json_builder_add_int_value(builder, now);
+	json_builder_set_member_name(builder, "type");
+	json_builder_add_string_value(builder, "plugin");
+	lsp_timing_append_metrics(builder);
+	json_builder_end_object(builder);
+
+	line = build_metrics_line(builder);
+	g_string_append_printf(str, "%s\n", line);
+	g_free(line);
+
+	g_object_unref(builder);
+
+	return g_string_free(str, FALSE);
+}
+
+
 void lsp_server_set_initialized_cb(LspServerInitializedCallback cb)
 {
 	lsp_server_initialized_cb = cb;
@@ -19,6 +19,8 @@
 #ifndef LSP_SERVER_H
 #define LSP_SERVER_H 1
 
+#include "lsp-utils.h"
+
 #include <geanyplugin.h>
 
 #include <gio/gio.h>
@@ -32,21 +34,37 @@ typedef struct LspRpc LspRpc;
 typedef struct LspServerConfig
 {
 	gchar *cmd;
+	gchar *connect;
 	gchar **env;
 	gchar *ref_lang;
 	gchar **lang_id_mappings;
+	GPtrArray *lang_id_patterns;  // GPatternSpec of the file patterns in lang_id_mappings
 
 	gboolean show_server_stderr;
+	gint stderr_tail_size;
 	gchar *rpc_log;
+	gchar *rpc_capture;
 	gboolean rpc_log_full;
+	gboolean rpc_log_async;
+	gint rpc_log_max_size;
+	gint rpc_max_message_size;
 	gboolean send_did_change_configuration;
 	gchar *initialization_options_file;
 	gchar *word_chars;
 	gchar *initialization_options;
 	gchar **project_root_marker_patterns;
+	GPtrArray *project_root_marker_specs;  // compiled project_root_marker_patterns
+	gchar *project_root_marker_key;  // project_root_marker_patterns joined by '\n'
 	gboolean enable_by_default;
 	gboolean use_outside_project_dir;
 	gboolean use_without_project;
+	gboolean prestart_on_project_open;
+	gint root_instances_max;
+	gint restart_memory_limit;
+	gint restart_idle_timeout;
+	gboolean warm_standby;
+	gchar *companion_cmd;
+	gboolean companion_formatting;
 
 	gboolean autocomplete_enable;
 	gchar **autocomplete_trigger_sequences;
@@ -59,10 +77,13 @@ typedef struct LspServerConfig
 	gchar *autocomplete_hide_after_words;
 	gboolean autocomplete_in_strings;
 	gboolean autocomplete_show_documentation;
+	gboolean autocomplete_prefetch_enable;
 
 	gboolean diagnostics_enable;
 	gint diagnostics_statusbar_severity;
+	gint diagnostics_msgwin_severity;
 	gchar *diagnostics_disable_for;
+	GPtrArray *diagnostics_disable_specs;  // compiled diagnostics_disable_for
 	gchar *diagnostics_error_style;
 	gchar *diagnostics_warning_style;
 	gchar *diagnostics_info_style;
@@ -89,6 +110,8 @@ typedef struct LspServerConfig
 	gchar **semantic_tokens_types;
 	gboolean semantic_tokens_supports_delta;
 	gboolean semantic_tokens_range_only;
+	gboolean semantic_tokens_supports_range;
+	gboolean semantic_tokens_viewport_first;
 	gint semantic_tokens_lexer_kw_index;
 	gchar *semantic_tokens_type_style;
 
@@ -98,8 +121,13 @@ typedef struct LspServerConfig
 	gboolean code_lens_enable;
 	gchar *code_lens_style;
 
+	gboolean inlay_hints_enable;
+
+	gboolean folding_range_enable;
+
 	gboolean goto_declaration_enable;
 	gboolean goto_definition_enable;
+	gboolean goto_prefetch_enable;
 	gboolean goto_implementation_enable;
 	gboolean goto_references_enable;
 	gboolean goto_type_definition_enable;
@@ -110,12 +138,36 @@ typedef struct LspServerConfig
 
 	gboolean progress_bar_enable;
 
+	gint open_docs_max_count;
+	gint open_docs_max_size;
+	gint open_docs_idle_timeout;
+	gint large_file_size;
+	gint large_file_lines;
+	gint debounce_min;
+	gint debounce_max;
+	gint request_timeout;
+	gchar **request_timeouts;  // method;timeout pairs
+	gint background_suspend_timeouts;
+
 	gboolean execute_command_enable;
 	gboolean code_action_enable;
 	gboolean selection_range_enable;
+	gboolean call_hierarchy_enable;
+	gboolean type_hierarchy_enable;
+	gchar *hierarchy_tab_label;
 	gboolean swap_header_source_enable;
 	gchar *command_on_save_regex;
+	gchar **command_on_save_kinds;
+	gint on_save_timeout;
 	gint command_keybinding_num;
+	gint goto_panel_max_items;
+	gboolean goto_file_index_enable;
+	gint stall_threshold;
+	gchar *trace_events_file;
+	gchar *metrics_file;
+	gint metrics_interval;
+	gint memory_cache_max_size;
+	gboolean memory_pressure_close_docs;
 	GPtrArray *command_regexes;
 
 	gchar *trace_value;
@@ -130,40 +182,109 @@ typedef struct
 	gint type;  // 0: use stream, 1: stdout, 2: stderr
 	gboolean full;
 	GFileOutputStream *stream;
+	struct LspLogWriter *writer;  // NULL unless logging from a thread
 } LspLogInfo;
 
 
+// action of LspServerQueuedAction sending didOpen
+#define LSP_SERVER_QUEUED_DID_OPEN G_MAXUINT
+
+// startup milestones of a server, the first occurrence is recorded
+typedef enum
+{
+	LSP_STARTUP_START,  // start_lsp_server() called
+	LSP_STARTUP_SPAWNED,  // process spawned or connected to
+	LSP_STARTUP_INITIALIZE_SENT,
+	LSP_STARTUP_INITIALIZE_RECEIVED,
+	LSP_STARTUP_INITIALIZED_SENT,
+	LSP_STARTUP_FIRST_DID_OPEN,
+	LSP_STARTUP_FIRST_DIAGNOSTICS,
+	LSP_STARTUP_FIRST_SEMTOKENS,
+	LSP_STARTUP_NUM
+} LspStartupEvent;
+
+
+// user action performed while the server was initializing
+typedef struct
+{
+	guint doc_id;
+	guint action;  // plugin's keybinding ID or LSP_SERVER_QUEUED_DID_OPEN
+	gint pos;
+} LspServerQueuedAction;
+
+
 typedef struct LspServer
 {
 	LspRpc *rpc;
 	//GSubprocess *process;
 	GPid pid;
+	gboolean connected;  // to a server given by the 'connect' option
+	GCancellable *connect_cancellable;
+	guint reconnect_source;
 	GIOStream *stream;
 	LspLogInfo log;
+	GString *stderr_tail;  // last stderr output, up to config.stderr_tail_size KB
 
 	struct LspServer *referenced;
+	gchar *root;  // workspace root of a per-root instance, NULL otherwise
+	struct LspServer *standby;  // spawned, not initialized process replacing this one
+	struct LspServer *standby_owner;  // server this one is the standby of
+	struct LspServer *companion;  // additional server of companion_cmd
+	struct LspServer *companion_owner;  // server this one is the companion of
+	gboolean is_companion;  // also after detaching from its owner
+	guint companion_restarts;
+	GHashTable *instances;  // root -> per-root instance of this server
+	gint64 last_used;
 	gboolean not_used;
 	gboolean startup_shutdown;
+	gboolean prestarted;
+	GQueue *init_queue;  // LspServerQueuedAction, replayed once initialized
 	guint restarts;
 	gint filetype;
+	guint64 mem_rss;  // in bytes, sampled by the resource watchdog
+	gint64 config_load_time;  // in microseconds
+	gint64 startup_times[LSP_STARTUP_NUM];  // g_get_monotonic_time(), 0 if not reached
+	gdouble cpu_time;  // in seconds
 
 	LspServerConfig config;
 
 	GHashTable *open_docs;
-	GSList *mru_docs;
+	GQueue *resident_docs;
+	gsize resident_docs_size;
+	guint resident_docs_source;
+	GHashTable *pending_changes;
+	guint pending_changes_source;
+	gint64 pending_changes_time;  // of the oldest edit not sent yet, 0 if none
+	guint discarded_responses;
 	GHashTable *diag_table;
+	GHashTable *pending_diags;  // URI -> latest publishDiagnostics params
+	guint pending_diags_source;
 	GHashTable *wks_folder_table;
-	GSList *progress_ops;
+	GHashTable *wks_folder_pending;  // root -> added (TRUE) or removed (FALSE)
+	guint wks_folder_source;
+	GPtrArray *watch_registrations;  // workspace/didChangeWatchedFiles registrations
+	GHashTable *watched_changes;  // URI -> FileChangeType waiting to be sent
+	guint watched_changes_source;
+	guint refresh_pending;  // LspRefreshKind flags of refreshes not handled yet
+	guint refresh_source;
+	GHashTable *progress_ops;  // token -> LspProgress of work done progress
+	GVariant *config_settings;  // initialization options answering workspace/configuration
+	GHashTable *config_sections;  // section -> its GVariant inside config_settings
+	gint64 config_mtime;  // of initialization_options_file when config_settings were read
 
 	gchar *autocomplete_trigger_chars;
 	gchar *signature_trigger_chars;
 	gchar *initialize_response;
+	GPtrArray *trimmed_capabilities;  // client capabilities not advertised, as section.name
 	gboolean use_incremental_sync;
+	LspPositionEncoding position_encoding;
 	gboolean send_did_save;
 	gboolean include_text_on_save;
 	gboolean use_workspace_folders;
 	gboolean supports_workspace_symbols;
+	gboolean supports_pull_diagnostics;
 	gboolean supports_completion_resolve;
+	gboolean supports_code_lens_resolve;
 
 	guint64 semantic_token_mask;
 } LspServer;
@@ -173,18 +294,33 @@ typedef void (*LspServerInitializedCallback) (LspServer *srv);
 LspServer *lsp_server_get(GeanyDocument *doc);
 LspServer *lsp_server_get_for_ft(GeanyFiletype *ft);
 LspServer *lsp_server_get_if_running(GeanyDocument *doc);
+LspServer *lsp_server_get_for_formatting(LspServer *srv);
+LspServer *lsp_server_get_companion(LspServer *srv);
+GPtrArray *lsp_server_get_all_running(void);
 LspServerConfig *lsp_server_get_all_section_config(void);
 gboolean lsp_server_is_usable(GeanyDocument *doc);
+gboolean lsp_server_is_large_file(LspServer *srv, GeanyDocument *doc);
 GeanyFiletype *lsp_server_get_ft(GeanyDocument *doc, gchar **lsp_lang_id);
 void lsp_server_clear_cached_ft(GeanyDocument *doc);
 
 void lsp_server_stop_all(gboolean wait);
+void lsp_server_free_caches(void);
 void lsp_server_init_all(void);
 
 void lsp_server_set_initialized_cb(LspServerInitializedCallback cb);
 
+void lsp_server_connection_lost(LspServer *srv);
+
 gboolean lsp_server_uses_init_file(gchar *path);
 
+void lsp_server_prestart_all(void);
+
+gboolean lsp_server_queue_until_initialized(GeanyDocument *doc, guint action, gint pos);
+
+void lsp_server_record_startup(LspServer *srv, LspStartupEvent event);
+
 gchar *lsp_server_get_initialize_responses(void);
+gchar *lsp_server_get_statistics(void);
+gchar *lsp_server_get_metrics(void);
 
 #endif  /* LSP_SERVER_H */
@@ -27,6 +27,10 @@
 #include <jsonrpc-glib.h>
 
 
+/* how far back the opening bracket of a call is searched for */
+#define CALL_SITE_SCAN_MAX 4096
+
+
 typedef struct {
 	GeanyDocument *doc;
 	gint pos;
@@ -34,15 +38,44 @@ typedef struct {
 } LspSignatureData;
 
 
+typedef struct {
+	gint start;  /* byte offsets in the signature label */
+	gint end;
+} LspSignatureParam;
+
+
+typedef struct {
+	gchar *label;
+	GArray *params;  /* LspSignatureParam */
+	gint active_parameter;  /* -1 when the signature doesn't override the global one */
+} LspSignature;
+
+
+extern GeanyData *geany_data;
+
 static GPtrArray *signatures = NULL;
 static gint displayed_signature = 0;
+static gint active_parameter = 0;
+static gint call_site = -1;  /* position of the opening paren of the shown call */
 static ScintillaObject *calltip_sci;
+static LspRpcRequest pending_request;
+
+
+static void signature_free(LspSignature *sig)
+{
+	g_free(sig->label);
+	g_array_free(sig->params, TRUE);
+	g_free(sig);
+}
 
 
 static void show_signature(ScintillaObject *sci)
 {
+	LspSignature *sig = signatures->pdata[displayed_signature];
 	gboolean have_arrow = FALSE;
 	GString *str = g_string_new(NULL);
+	gint param;
+	gsize prefix_len;
 
 	if (displayed_signature > 0)
 	{
@@ -56,16 +89,133 @@ static void show_signature(ScintillaObject *sci)
 	}
 	if (have_arrow)
 		g_string_append_c(str, ' ');
-	g_string_append(str, signatures->pdata[displayed_signature]);
+	prefix_len = str->len;
+	g_string_append(str, sig->label);
 
+	// wrapping only replaces spaces so offsets stay valid
 	lsp_utils_wrap_string(str->str, -1);
 	calltip_sci = sci;
 	SSM(sci, SCI_CALLTIPSHOW, sci_get_current_position(sci), (sptr_t) str->str);
 
+	param = sig->active_parameter >= 0 ? sig->active_parameter : active_parameter;
+	if (param >= 0 && param < (gint)sig->params->len)
+	{
+		LspSignatureParam *p = &g_array_index(sig->params, LspSignatureParam, param);
+
+		SSM(sci, SCI_CALLTIPSETHLT, prefix_len + p->start, prefix_len + p->end);
+	}
+
 	g_string_free(str, TRUE);
 }
 
 
+/* position of the opening paren of the call the caret is in, -1 if none;
+ * commas returns the number of arguments before the caret */
+static gint find_call_site(ScintillaObject *sci, gint pos, gint *commas)
+{
+	gint lexer = sci_get_lexer(sci);
+	gint limit = MAX(0, pos - CALL_SITE_SCAN_MAX);
+	gint depth = 0;
+	gint i;
+
+	*commas = 0;
+
+	for (i = pos - 1; i >= limit; i--)
+	{
+		gchar c = sci_get_char_at(sci, i);
+
+		if (!highlighting_is_code_style(lexer, sci_get_style_at(sci, i)))
+			continue;
+
+		if (c == ')' || c == ']' || c == '}')
+			depth++;
+		else if (c == '(' || c == '[' || c == '{')
+		{
+			if (depth == 0)
+				return c == '(' ? i : -1;
+			depth--;
+		}
+		else if (c == ',' && depth == 0)
+			(*commas)++;
+		else if (c == ';' && depth == 0)
+			break;
+	}
+
+	return -1;
+}
+
+
+static gint get_int(GVariant *val)
+{
+	gint ret = 0;
+
+	if (g_variant_is_of_type(val, G_VARIANT_TYPE_VARIANT))
+	{
+		GVariant *inner = g_variant_get_variant(val);
+
+		ret = get_int(inner);
+		g_variant_unref(inner);
+	}
+	else if (g_variant_is_of_type(val, G_VARIANT_TYPE_INT64))
+		ret = g_variant_get_int64(val);
+	else if (g_variant_is_of_type(val, G_VARIANT_TYPE_DOUBLE))
+		ret = g_variant_get_double(val);
+
+	return ret;
+}
+
+
+/* parameter labels are either substrings of the signature label or offsets
+ * of characters in it */
+static void parse_params(LspSignature *sig, GVariantIter *iter)
+{
+	GVariant *member = NULL;
+	glong label_chars = g_utf8_strlen(sig->label, -1);
+	gint search_from = 0;
+
+	while (g_variant_iter_loop(iter, "v", &member))
+	{
+		LspSignatureParam param = {0, 0};
+		const gchar *label = NULL;
+		GVariantIter *offsets = NULL;
+
+		if (JSONRPC_MESSAGE_PARSE(member, "label", JSONRPC_MESSAGE_GET_STRING(&label)))
+		{
+			const gchar *found = *label ? strstr(sig->label + search_from, label) : NULL;
+
+			if (found)
+			{
+				param.start = found - sig->label;
+				param.end = param.start + strlen(label);
+				search_from = param.end;
+			}
+		}
+		else if (JSONRPC_MESSAGE_PARSE(member, "label", JSONRPC_MESSAGE_GET_ITER(&offsets)))
+		{
+			GVariant *start = g_variant_iter_next_value(offsets);
+			GVariant *end = g_variant_iter_next_value(offsets);
+
+			if (start && end)
+			{
+				glong start_char = CLAMP(get_int(start), 0, label_chars);
+				glong end_char = CLAMP(get_int(end), start_char, label_chars);
+
+				param.start = g_utf8_offset_to_pointer(sig->label, start_char) - sig->label;
+				param.end = g_utf8_offset_to_pointer(sig->label, end_char) - sig->label;
+			}
+
+			if (start)
+				g_variant_unref(start);
+			if (end)
+				g_variant_unref(end);
+			g_variant_iter_free(offsets);
+		}
+
+		g_array_append_val(sig->params, param);
+	}
+}
+
+
 static void signature_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	if (!error)
@@ -88,13 +238,17 @@ static void signature_cb(GVariant *return_value, GError *error, gpointer user_da
 			{
 				GVariantIter *iter = NULL;
 				gint64 active = 1;
+				gint64 active_param = 0;
+				gint commas;
 
 				JSONRPC_MESSAGE_PARSE(return_value, "signatures", JSONRPC_MESSAGE_GET_ITER(&iter));
 				JSONRPC_MESSAGE_PARSE(return_value, "activeSignature", JSONRPC_MESSAGE_GET_INT64(&active));
+				JSONRPC_MESSAGE_PARSE(return_value, "activeParameter", JSONRPC_MESSAGE_GET_INT64(&active_param));
 
 				if (signatures)
 					g_ptr_array_free(signatures, TRUE);
-				signatures = g_ptr_array_new_full(1, g_free);
+				signatures = g_ptr_array_new_full(1, (GDestroyNotify)signature_free);
+				active_parameter = active_param;
 
 				if (iter)
 				{
@@ -103,15 +257,34 @@ static void signature_cb(GVariant *return_value, GError *error, gpointer user_da
 					while (g_variant_iter_loop(iter, "v", &member))
 					{
 						const gchar *label = NULL;
+						GVariantIter *params = NULL;
+						gint64 sig_active_param = -1;
+						LspSignature *sig;
 
 						JSONRPC_MESSAGE_PARSE(member, "label", JSONRPC_MESSAGE_GET_STRING(&label));
+						if (!label)
+							continue;
+
+						sig = g_new0(LspSignature, 1);
+						sig->label = g_strdup(label);
+						sig->params = g_array_new(FALSE, FALSE, sizeof(LspSignatureParam));
 
-						if (label)
-							g_ptr_array_add(signatures, g_strdup(label));
+						JSONRPC_MESSAGE_PARSE(member, "activeParameter", JSONRPC_MESSAGE_GET_INT64(&sig_active_param));
+						sig->active_parameter = sig_active_param;
+
+						JSONRPC_MESSAGE_PARSE(member, "parameters", JSONRPC_MESSAGE_GET_ITER(&params));
+						if (params)
+						{
+							parse_params(sig, params);
+							g_variant_iter_free(params);
+						}
+
+						g_ptr_array_add(signatures, sig);
 					}
 				}
 
 				displayed_signature = CLAMP(active, 1, signatures->len) - 1;
+				call_site = find_call_site(current_doc->editor->sci, data->pos, &commas);
 
 				if (signatures->len == 0)
 					SSM(current_doc->editor->sci, SCI_CALLTIPCANCEL, 0, 0);
@@ -180,17 +353,27 @@ void lsp_signature_send_request(LspServer *server, GeanyDocument *doc, gboolean
 	if (!force && !strchr(trigger_chars, c))
 		return;
 
+	// another argument of the shown call - just move the highlighted parameter
+	if (!force && c == ',' && lsp_signature_showing_calltip(doc) && call_site >= 0)
+	{
+		gint commas;
+
+		if (find_call_site(sci, pos, &commas) == call_site)
+		{
+			LspSignature *sig;
+			guint i;
+
+			foreach_ptr_array(sig, i, signatures)
+				sig->active_parameter = -1;
+			active_parameter = commas;
+			show_signature(sci);
+			return;
+		}
+	}
+
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
-	node = JSONRPC_MESSAGE_NEW (
-		"textDocument", "{",
-			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-		"}",
-		"position", "{",
-			"line", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.line),
-			"character", JSONRPC_MESSAGE_PUT_INT32(lsp_pos.character),
-		"}"
-	);
+	node = lsp_utils_new_text_document_position(doc_uri, lsp_pos, NULL, NULL);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
@@ -199,7 +382,8 @@ void lsp_signature_send_request(LspServer *server, GeanyDocument *doc, gboolean
 	data->pos = pos;
 	data->force = force;
 
-	lsp_rpc_call(server, "textDocument/signatureHelp", node,
+	lsp_rpc_cancel(pending_request);
+	pending_request = lsp_rpc_call(server, "textDocument/signatureHelp", node,
 		signature_cb, data);
 
 	g_free(doc_uri);
@@ -222,5 +406,6 @@ void lsp_signature_hide_calltip(GeanyDocument *doc)
 		g_ptr_array_free(signatures, TRUE);
 		signatures = NULL;
 		calltip_sci = NULL;
+		call_site = -1;
 	}
 }
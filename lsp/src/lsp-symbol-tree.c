@@ -33,6 +33,7 @@
 #include "lsp-symbol-tree.h"
 #include "lsp-goto.h"
 #include "lsp-utils.h"
+#include "lsp-timing.h"
 
 #include <ctype.h>
 #include <string.h>
@@ -46,6 +47,13 @@
 #define SYM_TREE_KEY "lsp_symbol_tree"
 #define SYM_STORE_KEY "lsp_symbol_store"
 #define SYM_FILTER_KEY "lsp_symbol_filter"
+#define SYM_INDEX_KEY "lsp_symbol_index"
+
+/* maximum number of rows inserted into the sorted store one by one */
+#define SORT_INCREMENTAL_MAX 100
+/* with more symbols, children of new rows are only inserted when the row
+ * gets expanded */
+#define LAZY_SYMBOLS_MIN 1000
 
 
 enum
@@ -66,6 +74,52 @@ typedef struct
 } TreeSearchData;
 
 
+typedef struct
+{
+	LspSymbol *symbol;
+	gint parent;  /* index of the parent in the same array, -1 for the owning row */
+} DeferredSymbol;
+
+
+typedef struct
+{
+	LspSymbol *symbol;
+	GtkTreeIter iter;
+	LspSymbol *found;  /* matching new symbol during update */
+	gboolean removed;
+	GArray *deferred;  /* DeferredSymbol - descendants not inserted yet, parents first */
+	gboolean has_placeholder;
+	GtkTreeIter placeholder;  /* empty child row making the row expandable */
+	gboolean expanded;  /* before the filter was applied */
+} SymbolRow;
+
+
+typedef struct
+{
+	SymbolRow *row;  /* row of the symbol or the row holding it in deferred */
+	gint deferred;  /* index in row->deferred, -1 if the symbol has its own row */
+} ParentRef;
+
+
+/* persistent per-document index of the symbol store rows */
+typedef struct
+{
+	GPtrArray *symbols;  /* symbols the store was last updated with */
+	GPtrArray *rows;  /* SymbolRow */
+	GHashTable *row_table;  /* GHashTable<LspSymbol, GTree<line_num, GList<SymbolRow>>> */
+	GHashTable *symbol_rows;  /* GHashTable<LspSymbol pointer, SymbolRow> */
+
+	/* filtering - the symbol keys are only valid until the symbols change */
+	gchar *filter;  /* filter text the sets below were computed for */
+	GHashTable *names;  /* GHashTable<LspSymbol pointer, casefolded name> */
+	GHashTable *parents;  /* GHashTable<LspSymbol pointer, parent LspSymbol pointer or NULL> */
+	GHashTable *matched;  /* symbols matching the filter */
+	GHashTable *visible;  /* matched symbols and their ancestors */
+	GHashTable *expand;  /* ancestors of matched symbols */
+	gboolean expansion_saved;  /* SymbolRow.expanded holds the unfiltered state */
+} SymbolIndex;
+
+
 extern GeanyData *geany_data;
 extern GeanyPlugin *geany_plugin;
 
@@ -165,56 +219,18 @@ static gint compare_symbol_parent_first(gconstpointer a, gconstpointer b)
 }
 
 
+/* all symbols are in the store, the filter only hides rows */
 static GList *get_symbol_list(GeanyDocument *doc, GPtrArray *lsp_symbols)
 {
 	GList *symbols = NULL;
 	guint i;
-	gchar **tf_strv;
 
 	g_return_val_if_fail(doc, NULL);
 
-	const gchar *tag_filter = plugin_get_document_data(geany_plugin, doc, SYM_FILTER_KEY);
-	if (!tag_filter)
-		tag_filter = "";
-	tf_strv = g_strsplit_set(tag_filter, " ", -1);
-
 	for (i = 0; i < lsp_symbols->len; ++i)
-	{
-		LspSymbol *sym = lsp_symbols->pdata[i];
-		gboolean filtered = FALSE;
-		gchar **val;
-		gchar *full_tagname = lsp_symbol_get_symtree_name(sym, TRUE);
-		gchar *normalized_tagname = g_utf8_normalize(full_tagname, -1, G_NORMALIZE_ALL);
-
-		foreach_strv(val, tf_strv)
-		{
-			gchar *normalized_val = g_utf8_normalize(*val, -1, G_NORMALIZE_ALL);
-
-			if (normalized_tagname != NULL && normalized_val != NULL)
-			{
-				gchar *case_normalized_tagname = g_utf8_casefold(normalized_tagname, -1);
-				gchar *case_normalized_val = g_utf8_casefold(normalized_val, -1);
-
-				filtered = strstr(case_normalized_tagname, case_normalized_val) == NULL;
-				g_free(case_normalized_tagname);
-				g_free(case_normalized_val);
-			}
-			g_free(normalized_val);
-
-			if (filtered)
-				break;
-		}
-
-		if (!filtered)
-			symbols = g_list_prepend(symbols, sym);
-
-		g_free(normalized_tagname);
-		g_free(full_tagname);
-	}
+		symbols = g_list_prepend(symbols, lsp_symbols->pdata[i]);
 	symbols = g_list_sort(symbols, compare_symbol_parent_first);
 
-	g_strfreev(tf_strv);
-
 	return symbols;
 }
 
@@ -264,69 +280,28 @@ static guint symbols_table_hash(gconstpointer v)
 }
 
 
-/* like gtk_tree_view_expand_to_path() but with an iter */
-static void tree_view_expand_to_iter(GtkTreeView *view, GtkTreeIter *iter)
-{
-	GtkTreeModel *model = gtk_tree_view_get_model(view);
-	GtkTreePath *path = gtk_tree_model_get_path(model, iter);
-
-	gtk_tree_view_expand_to_path(view, path);
-	gtk_tree_path_free(path);
-}
-
-
-static gboolean ui_tree_model_iter_any_next(GtkTreeModel *model, GtkTreeIter *iter, gboolean down)
+/* path of the row of the store in the filtered model of the view, NULL when
+ * the row is hidden */
+static GtkTreePath *get_view_path(GtkTreeView *view, GtkTreeIter *store_iter)
 {
-	GtkTreeIter guess;
-	GtkTreeIter copy = *iter;
+	GtkTreeModelFilter *filter = GTK_TREE_MODEL_FILTER(gtk_tree_view_get_model(view));
+	GtkTreeModel *store = gtk_tree_model_filter_get_model(filter);
+	GtkTreePath *store_path = gtk_tree_model_get_path(store, store_iter);
+	GtkTreePath *path = gtk_tree_model_filter_convert_child_path_to_path(filter, store_path);
 
-	/* go down if the item has children */
-	if (down && gtk_tree_model_iter_children(model, &guess, iter))
-		*iter = guess;
-	/* or to the next item at the same level */
-	else if (gtk_tree_model_iter_next(model, &copy))
-		*iter = copy;
-	/* or to the next item at a parent level */
-	else if (gtk_tree_model_iter_parent(model, &guess, iter))
-	{
-		copy = guess;
-		while (TRUE)
-		{
-			if (gtk_tree_model_iter_next(model, &copy))
-			{
-				*iter = copy;
-				return TRUE;
-			}
-			else if (gtk_tree_model_iter_parent(model, &copy, &guess))
-				guess = copy;
-			else
-				return FALSE;
-		}
-	}
-	else
-		return FALSE;
-
-	return TRUE;
+	gtk_tree_path_free(store_path);
+	return path;
 }
 
 
-/* like gtk_tree_store_remove() but finds the next iter at any level */
-static gboolean tree_store_remove_row(GtkTreeStore *store, GtkTreeIter *iter)
+/* like gtk_tree_view_expand_to_path() but with an iter of the store */
+static void tree_view_expand_to_iter(GtkTreeView *view, GtkTreeIter *iter)
 {
-	GtkTreeIter parent;
-	gboolean has_parent;
-	gboolean cont;
+	GtkTreePath *path = get_view_path(view, iter);
 
-	has_parent = gtk_tree_model_iter_parent(GTK_TREE_MODEL(store), &parent, iter);
-	cont = gtk_tree_store_remove(store, iter);
-	/* if there is no next at this level but there is a parent iter, continue from it */
-	if (! cont && has_parent)
-	{
-		*iter = parent;
-		cont = ui_tree_model_iter_any_next(GTK_TREE_MODEL(store), iter, FALSE);
-	}
-
-	return cont;
+	if (path)
+		gtk_tree_view_expand_to_path(view, path);
+	gtk_tree_path_free(path);
 }
 
 
@@ -366,18 +341,21 @@ static gint tree_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
 
 static void parents_table_tree_value_free(gpointer data)
 {
-	g_slice_free(GtkTreeIter, data);
+	g_slice_free(ParentRef, data);
 }
 
 
 /* adds a new element in the parent table if its key is known. */
-static void update_parents_table(GHashTable *table, const LspSymbol *sym, const GtkTreeIter *iter)
+static void update_parents_table(GHashTable *table, const LspSymbol *sym, SymbolRow *row,
+	gint deferred)
 {
 	gchar *name = lsp_symbol_get_name_with_scope(sym);
 	GTree *tree;
 
 	if (name && g_hash_table_lookup_extended(table, name, NULL, (gpointer *) &tree))
 	{
+		ParentRef *ref;
+
 		if (!tree)
 		{
 			tree = g_tree_new_full(tree_cmp, NULL, NULL, parents_table_tree_value_free);
@@ -385,16 +363,19 @@ static void update_parents_table(GHashTable *table, const LspSymbol *sym, const
 			name = NULL;
 		}
 
-		g_tree_insert(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)), g_slice_dup(GtkTreeIter, iter));
+		ref = g_slice_new(ParentRef);
+		ref->row = row;
+		ref->deferred = deferred;
+		g_tree_insert(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)), ref);
 	}
 
 	g_free(name);
 }
 
 
-static GtkTreeIter *parents_table_lookup(GHashTable *table, const gchar *name, guint line)
+static ParentRef *parents_table_lookup(GHashTable *table, const gchar *name, guint line)
 {
-	GtkTreeIter *parent_search = NULL;
+	ParentRef *parent_search = NULL;
 	GTree *tree;
 
 	tree = g_hash_table_lookup(table, name);
@@ -420,30 +401,30 @@ static void parents_table_value_free(gpointer data)
 }
 
 
-/* inserts a @data in @table on key @sym.
- * previous data is not overwritten if the key is duplicated, but rather the
- * two values are kept in a list
+/* inserts @row in @table on key @row->symbol.
+ * rows with identical keys are kept in a list
  *
- * table is: GHashTable<LspSymbol, GTree<line_num, GList<GList<LspSymbol>>>> */
-static void symbols_table_insert(GHashTable *table, LspSymbol *sym, GList *data)
+ * table is: GHashTable<LspSymbol, GTree<line_num, GList<SymbolRow>>> */
+static void row_table_insert(GHashTable *table, SymbolRow *row)
 {
-	GTree *tree = g_hash_table_lookup(table, sym);
+	GTree *tree = g_hash_table_lookup(table, row->symbol);
+	gint line = lsp_symbol_get_line(row->symbol);
 	GList *list;
 
 	if (!tree)
 	{
 		tree = g_tree_new_full(tree_cmp, NULL, NULL, NULL);
-		g_hash_table_insert(table, sym, tree);
+		g_hash_table_insert(table, lsp_symbol_ref(row->symbol), tree);
 	}
-	list = g_tree_lookup(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)));
-	list = g_list_prepend(list, data);
-	g_tree_insert(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)), list);
+	list = g_tree_lookup(tree, GINT_TO_POINTER(line));
+	list = g_list_prepend(list, row);
+	g_tree_insert(tree, GINT_TO_POINTER(line), list);
 }
 
 
-/* looks up the entry in @table that best matches @sym.
+/* looks up the row in @table that best matches @sym.
  * if there is more than one candidate, the one that has closest line position to @sym is chosen */
-static GList *symbols_table_lookup(GHashTable *table, LspSymbol *sym)
+static SymbolRow *row_table_lookup(GHashTable *table, LspSymbol *sym)
 {
 	TreeSearchData user_data = {-1, lsp_symbol_get_line(sym), FALSE};
 	GTree *tree = g_hash_table_lookup(table, sym);
@@ -463,35 +444,25 @@ static GList *symbols_table_lookup(GHashTable *table, LspSymbol *sym)
 }
 
 
-/* removes the element at @sym from @table.
- * @sym must be the exact pointer used at insertion time */
-static void symbols_table_remove(GHashTable *table, LspSymbol *sym)
+static void row_table_remove(GHashTable *table, SymbolRow *row)
 {
-	GTree *tree = g_hash_table_lookup(table, sym);
+	GTree *tree = g_hash_table_lookup(table, row->symbol);
+	gint line = lsp_symbol_get_line(row->symbol);
+
 	if (tree)
 	{
-		GList *list = g_tree_lookup(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)));
-		if (list)
-		{
-			GList *node;
-			/* should always be the first element as we returned the first one in
-			 * symbols_table_lookup() */
-			foreach_list(node, list)
-			{
-				if (((GList *) node->data)->data == sym)
-					break;
-			}
-			list = g_list_delete_link(list, node);
-			if (!list)
-				g_tree_remove(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)));
-			else
-				g_tree_insert(tree, GINT_TO_POINTER(lsp_symbol_get_line(sym)), list);
-		}
+		GList *list = g_tree_lookup(tree, GINT_TO_POINTER(line));
+
+		list = g_list_remove(list, row);
+		if (!list)
+			g_tree_remove(tree, GINT_TO_POINTER(line));
+		else
+			g_tree_insert(tree, GINT_TO_POINTER(line), list);
 	}
 }
 
 
-static gboolean symbols_table_tree_value_free(gpointer key, gpointer value, gpointer data)
+static gboolean row_table_tree_value_free(gpointer key, gpointer value, gpointer data)
 {
 	GList *list = value;
 	g_list_free(list);
@@ -499,7 +470,7 @@ static gboolean symbols_table_tree_value_free(gpointer key, gpointer value, gpoi
 }
 
 
-static void symbols_table_value_free(gpointer data)
+static void row_table_value_free(gpointer data)
 {
 	GTree *tree = data;
 	if (tree)
@@ -507,169 +478,450 @@ static void symbols_table_value_free(gpointer data)
 		/* free any leftover elements.  note that we can't register a value_free_func when
 		 * creating the tree because we only want to free it when destroying the tree,
 		 * not when inserting a duplicate (we handle this manually) */
-		g_tree_foreach(tree, symbols_table_tree_value_free, NULL);
+		g_tree_foreach(tree, row_table_tree_value_free, NULL);
 		g_tree_destroy(tree);
 	}
 }
 
 
+static gboolean collect_rows(gpointer key, gpointer value, gpointer data)
+{
+	GList *list = value;
+	GPtrArray *arr = data;
+	GList *node;
+
+	foreach_list(node, list)
+		g_ptr_array_add(arr, node->data);
+	return FALSE;
+}
+
+
+static void deferred_symbol_clear(gpointer data)
+{
+	DeferredSymbol *deferred = data;
+	lsp_symbol_unref(deferred->symbol);
+}
+
+
+/* adds @symbol to the symbols inserted once @row is expanded, returns its index */
+static gint defer_symbol(SymbolRow *row, LspSymbol *symbol, gint parent)
+{
+	DeferredSymbol deferred = {lsp_symbol_ref(symbol), parent};
+
+	if (!row->deferred)
+	{
+		row->deferred = g_array_new(FALSE, FALSE, sizeof(DeferredSymbol));
+		g_array_set_clear_func(row->deferred, deferred_symbol_clear);
+	}
+	g_array_append_val(row->deferred, deferred);
+
+	return row->deferred->len - 1;
+}
+
+
+static void clear_deferred(SymbolRow *row)
+{
+	if (row->deferred)
+		g_array_free(row->deferred, TRUE);
+	row->deferred = NULL;
+}
+
+
+static void symbol_row_free(SymbolRow *row)
+{
+	if (!row)
+		return;
+	clear_deferred(row);
+	lsp_symbol_unref(row->symbol);
+	g_free(row);
+}
+
+
+static void clear_filter_sets(SymbolIndex *sym_index)
+{
+	g_clear_pointer(&sym_index->matched, g_hash_table_destroy);
+	g_clear_pointer(&sym_index->visible, g_hash_table_destroy);
+	g_clear_pointer(&sym_index->expand, g_hash_table_destroy);
+	g_clear_pointer(&sym_index->filter, g_free);
+}
+
+
+/* drops everything referring to the symbols the filter was computed for */
+static void clear_filter_cache(SymbolIndex *sym_index)
+{
+	clear_filter_sets(sym_index);
+	g_clear_pointer(&sym_index->names, g_hash_table_destroy);
+	g_clear_pointer(&sym_index->parents, g_hash_table_destroy);
+}
+
+
+static void symbol_index_free(SymbolIndex *sym_index)
+{
+	clear_filter_cache(sym_index);
+	if (sym_index->symbols)
+		g_ptr_array_unref(sym_index->symbols);
+	g_hash_table_destroy(sym_index->row_table);
+	g_hash_table_destroy(sym_index->symbol_rows);
+	g_ptr_array_free(sym_index->rows, TRUE);
+	g_free(sym_index);
+}
+
+
+static SymbolIndex *get_symbol_index(GeanyDocument *doc)
+{
+	SymbolIndex *sym_index = plugin_get_document_data(geany_plugin, doc, SYM_INDEX_KEY);
+
+	if (!sym_index)
+	{
+		sym_index = g_new0(SymbolIndex, 1);
+		sym_index->rows = g_ptr_array_new_with_free_func((GDestroyNotify)symbol_row_free);
+		sym_index->row_table = g_hash_table_new_full(symbols_table_hash, symbols_table_equal,
+			(GDestroyNotify)lsp_symbol_unref, row_table_value_free);
+		sym_index->symbol_rows = g_hash_table_new(g_direct_hash, g_direct_equal);
+		plugin_set_document_data_full(geany_plugin, doc, SYM_INDEX_KEY, sym_index,
+			(GDestroyNotify)symbol_index_free);
+	}
+
+	return sym_index;
+}
+
+
+/* marks all rows below @iter as removed, matched symbols of these rows have
+ * to be inserted again */
+static void mark_children_removed(GtkTreeModel *model, GtkTreeIter *iter, SymbolIndex *sym_index,
+	GHashTable *matches)
+{
+	GtkTreeIter child;
+	gboolean cont;
+
+	cont = gtk_tree_model_iter_children(model, &child, iter);
+	while (cont)
+	{
+		LspSymbol *symbol;
+		SymbolRow *row;
+
+		gtk_tree_model_get(model, &child, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+		row = symbol ? g_hash_table_lookup(sym_index->symbol_rows, symbol) : NULL;
+		if (row)
+		{
+			row->removed = TRUE;
+			if (row->found)
+				g_hash_table_remove(matches, row->found);
+			row->found = NULL;
+		}
+		lsp_symbol_unref(symbol);
+
+		mark_children_removed(model, &child, sym_index, matches);
+		cont = gtk_tree_model_iter_next(model, &child);
+	}
+}
+
+
+/* adds an empty child to rows with deferred children so they can be expanded
+ * and removes it from the others */
+static void update_placeholder(GtkTreeStore *store, SymbolRow *row)
+{
+	gboolean needed = row->deferred && row->deferred->len > 0;
+
+	if (needed && !row->has_placeholder)
+	{
+		gtk_tree_store_insert_with_values(store, &row->placeholder, &row->iter, 0, -1);
+		row->has_placeholder = TRUE;
+	}
+	else if (!needed && row->has_placeholder)
+	{
+		gtk_tree_store_remove(store, &row->placeholder);
+		row->has_placeholder = FALSE;
+	}
+}
+
+
+static SymbolRow *insert_symbol_row(GeanyDocument *doc, GtkTreeStore *store, LspSymbol *symbol,
+	GtkTreeIter *parent)
+{
+	GdkPixbuf *icon = symbols_get_icon_pixbuf(lsp_symbol_get_icon(symbol));
+	gchar *name = lsp_symbol_get_symtree_name(symbol, parent == NULL);
+	gchar *tooltip = lsp_symbol_get_symtree_tooltip(symbol, doc->encoding);
+	SymbolRow *row = g_new0(SymbolRow, 1);
+
+	gtk_tree_store_insert_with_values(store, &row->iter, parent, 0,
+			SYMBOLS_COLUMN_NAME, name,
+			SYMBOLS_COLUMN_TOOLTIP, tooltip,
+			SYMBOLS_COLUMN_ICON, icon,
+			SYMBOLS_COLUMN_SYMBOL, symbol,
+			-1);
+	g_free(tooltip);
+	g_free(name);
+
+	row->symbol = lsp_symbol_ref(symbol);
+
+	return row;
+}
+
+
+/* whether new children of @row should be deferred until the row is expanded */
+static gboolean is_row_lazy(GtkTreeView *view, SymbolRow *row, GHashTable *lazy_rows,
+	gboolean many_symbols)
+{
+	GtkTreeModel *store = gtk_tree_model_filter_get_model(GTK_TREE_MODEL_FILTER(gtk_tree_view_get_model(view)));
+	gpointer value;
+	gboolean lazy;
+
+	if (g_hash_table_lookup_extended(lazy_rows, row, NULL, &value))
+		return GPOINTER_TO_INT(value);
+
+	if (gtk_tree_model_iter_has_child(store, &row->iter))
+	{
+		/* keep the folding as it was before (already expanded, or closed by the user) */
+		GtkTreePath *path = get_view_path(view, &row->iter);
+
+		lazy = !path || !gtk_tree_view_row_expanded(view, path);
+		gtk_tree_path_free(path);
+	}
+	else
+		lazy = many_symbols;
+
+	g_hash_table_insert(lazy_rows, row, GINT_TO_POINTER(lazy));
+	return lazy;
+}
+
+
+static gint compare_row_depth(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	SymbolRow *row_a = *((SymbolRow **) a);
+	SymbolRow *row_b = *((SymbolRow **) b);
+	GtkTreeStore *store = user_data;
+
+	return gtk_tree_store_iter_depth(store, &row_a->iter) - gtk_tree_store_iter_depth(store, &row_b->iter);
+}
+
+
 /*
- * Updates the symbol tree for a document with the symbols in *list.
+ * Updates the symbol tree for a document with the symbols in list.
  * @param doc a document
- * @param symbols a pointer to a GList* holding the symbols to add/update.  This
- *             list may be updated, removing updated elements.
+ * @param symbols a GList* holding the symbols to add/update.
+ *
+ * The rows of the store are kept in a persistent index so the update doesn't
+ * have to walk the whole store. The update is done in these steps:
+ * 1) match the new symbols with the rows of the old symbols with the same
+ *    name, kind, scope and detail at the nearest line;
+ * 2) remove rows of symbols that don't exist any more (together with their
+ *    children - matched children are inserted again);
+ * 3) update the matched rows whose symbols changed;
+ * 4) insert rows for the remaining symbols.
  *
- * The update is done in two passes:
- * 1) walking the current tree, update symbols that still exist and remove the
- *    obsolescent ones;
- * 2) walking the remaining (non updated) symbols, adds them in the list.
+ * New children of collapsed rows (and, for documents with many symbols, of
+ * rows that had no children yet) aren't inserted into the store - they are
+ * kept in the deferred array of the row together with their descendants and
+ * inserted by populate_row() when the row gets expanded. Such rows get an
+ * empty placeholder child so they are shown as expandable.
  *
- * For better performances, we use 2 hash tables:
- * - one containing all the symbols for lookup in the first pass (actually stores a
- *   reference in the symbols list for removing it efficiently), avoiding list search
- *   on each symbol;
- * - the other holding "symbol-name":row references for symbols having children, used to
- *   lookup for a parent in both passes, avoiding tree traversal.
+ * Besides the index, a hash table holding "symbol-name":row references for
+ * symbols having children is used to lookup for a parent, avoiding tree
+ * traversal.
  */
-static void update_symbols(GeanyDocument *doc, GList **symbols)
+static void update_symbols(GeanyDocument *doc, GList *symbols)
 {
 	GtkTreeStore *store = plugin_get_document_data(geany_plugin, doc, SYM_STORE_KEY);
 	GtkWidget *sym_tree = plugin_get_document_data(geany_plugin, doc, SYM_TREE_KEY);
 	GtkTreeModel *model = GTK_TREE_MODEL(store);
+	SymbolIndex *sym_index = get_symbol_index(doc);
 	GHashTable *parents_table;
-	GHashTable *symbols_table;
-	GtkTreeIter iter;
-	gboolean cont;
+	GHashTable *matches;
+	GHashTable *lazy_rows;
+	GPtrArray *removed, *rows, *expand_rows;
+	GHashTableIter table_iter;
+	GTree *tree;
 	GList *item;
+	guint i, insert_num, symbol_num;
+	gboolean many_symbols;
 
-	/* Build hash tables holding symbols and parents */
-	/* parent table is GHashTable<symbol_name, GTree<line_num, GtkTreeIter>>
+	/* parent table is GHashTable<symbol_name, GTree<line_num, ParentRef>>
 	 * where symbol_name might be a fully qualified name (with scope) if the language
 	 * parser reports scope properly (see tm_parser_has_full_scope()). */
 	parents_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, parents_table_value_free);
-	/* symbols table is another representation of the @symbols list,
-	 * GHashTable<GeanySymbol, GTree<line_num, GList<GList<GeanySymbol>>>> */
-	symbols_table = g_hash_table_new_full(symbols_table_hash, symbols_table_equal,
-		NULL, symbols_table_value_free);
-	foreach_list(item, *symbols)
+	/* new symbol -> matching row */
+	matches = g_hash_table_new(g_direct_hash, g_direct_equal);
+	/* row -> whether its new children are deferred */
+	lazy_rows = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	symbol_num = g_list_length(symbols);
+	many_symbols = symbol_num > LAZY_SYMBOLS_MIN;
+
+	/* deferred symbols aren't in the index so they are inserted (or deferred)
+	 * again below */
+	for (i = 0; i < sym_index->rows->len; i++)
+		clear_deferred(sym_index->rows->pdata[i]);
+
+	/* 1) match */
+	foreach_list(item, symbols)
 	{
 		LspSymbol *symbol = item->data;
 		const gchar *parent_name;
+		SymbolRow *row;
 
-		symbols_table_insert(symbols_table, symbol, item);
+		row = row_table_lookup(sym_index->row_table, symbol);
+		if (row)
+		{
+			row_table_remove(sym_index->row_table, row);
+			row->found = symbol;
+			g_hash_table_insert(matches, symbol, row);
+		}
 
 		parent_name = get_parent_name(symbol);
 		if (parent_name)
 			g_hash_table_insert(parents_table, g_strdup(parent_name), NULL);
 	}
 
-	/* First pass, update existing rows or delete them.
-	 * It is OK to delete them since we walk top down so we would remove
-	 * parents before checking for their children, thus never implicitly
-	 * deleting an updated child */
-	cont = gtk_tree_model_get_iter_first(model, &iter);
-	while (cont)
+	/* 2) remove rows left in the table, parents first so their children are
+	 * known to be removed */
+	removed = g_ptr_array_new();
+	g_hash_table_iter_init(&table_iter, sym_index->row_table);
+	while (g_hash_table_iter_next(&table_iter, NULL, (gpointer *) &tree))
+		g_tree_foreach(tree, collect_rows, removed);
+	g_ptr_array_sort_with_data(removed, compare_row_depth, store);
+
+	for (i = 0; i < removed->len; i++)
 	{
-		LspSymbol *symbol;
+		SymbolRow *row = removed->pdata[i];
 
-		gtk_tree_model_get(model, &iter, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
-		if (! symbol) /* most probably a toplevel, skip it */
-			cont = ui_tree_model_iter_any_next(model, &iter, TRUE);
-		else
-		{
-			GList *found_item;
+		if (row->removed)
+			continue;
+		mark_children_removed(model, &row->iter, sym_index, matches);
+		gtk_tree_store_remove(store, &row->iter);
+		row->removed = TRUE;
+	}
+	g_ptr_array_free(removed, TRUE);
 
-			found_item = symbols_table_lookup(symbols_table, symbol);
-			if (! found_item) /* symbol doesn't exist, remove it */
-				cont = tree_store_remove_row(store, &iter);
-			else /* symbol still exist, update it */
-			{
-				const gchar *parent_name;
-				LspSymbol *found = found_item->data;
-
-				parent_name = get_parent_name(found);
-				/* if parent is unknown, ignore it */
-				if (parent_name && ! g_hash_table_lookup(parents_table, parent_name))
-					parent_name = NULL;
-
-				if (!lsp_symbol_equal(symbol, found))
-				{
-					gchar *name, *tooltip;
-
-					/* only update fields that (can) have changed (name that holds line
-					 * number, tooltip, and the symbol itself) */
-					name = lsp_symbol_get_symtree_name(found, parent_name == NULL);
-					tooltip = lsp_symbol_get_symtree_tooltip(found, doc->encoding);
-					gtk_tree_store_set(store, &iter,
-							SYMBOLS_COLUMN_NAME, name,
-							SYMBOLS_COLUMN_TOOLTIP, tooltip,
-							SYMBOLS_COLUMN_SYMBOL, found,
-							-1);
-					g_free(tooltip);
-					g_free(name);
-				}
-
-				update_parents_table(parents_table, found, &iter);
-
-				/* remove the updated symbol from the table and list */
-				symbols_table_remove(symbols_table, found);
-				*symbols = g_list_delete_link(*symbols, found_item);
-
-				cont = ui_tree_model_iter_any_next(model, &iter, TRUE);
-			}
+	insert_num = symbol_num - g_hash_table_size(matches);
 
-			lsp_symbol_unref(symbol);
+	/* sorting the whole tree is faster than inserting many rows into a sorted
+	 * store, but for small changes the rows are just moved to their position */
+	if (insert_num > SORT_INCREMENTAL_MAX)
+		gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store),
+			GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, 0);
+
+	/* 3) update matched rows */
+	rows = g_ptr_array_new_with_free_func((GDestroyNotify)symbol_row_free);
+	foreach_list(item, symbols)
+	{
+		LspSymbol *found = item->data;
+		SymbolRow *row = g_hash_table_lookup(matches, found);
+		const gchar *parent_name;
+
+		if (!row)
+			continue;
+
+		parent_name = get_parent_name(found);
+		/* if parent is unknown, ignore it */
+		if (parent_name && ! g_hash_table_lookup(parents_table, parent_name))
+			parent_name = NULL;
+
+		if (!lsp_symbol_equal(row->symbol, found))
+		{
+			gchar *name, *tooltip;
+
+			/* only update fields that (can) have changed (name that holds line
+			 * number, tooltip, and the symbol itself) */
+			name = lsp_symbol_get_symtree_name(found, parent_name == NULL);
+			tooltip = lsp_symbol_get_symtree_tooltip(found, doc->encoding);
+			gtk_tree_store_set(store, &row->iter,
+					SYMBOLS_COLUMN_NAME, name,
+					SYMBOLS_COLUMN_TOOLTIP, tooltip,
+					SYMBOLS_COLUMN_SYMBOL, found,
+					-1);
+			g_free(tooltip);
+			g_free(name);
+
+			lsp_symbol_unref(row->symbol);
+			row->symbol = lsp_symbol_ref(found);
 		}
+
+		update_parents_table(parents_table, found, row, -1);
 	}
 
-	/* Second pass, now we have a tree cleaned up from invalid rows,
-	 * we simply add new ones */
-	foreach_list (item, *symbols)
+	/* 4) insert new rows */
+	expand_rows = g_ptr_array_new();
+	foreach_list(item, symbols)
 	{
 		LspSymbol *symbol = item->data;
-		GtkTreeIter *parent = NULL;
+		ParentRef *parent = NULL;
 		gboolean expand = FALSE;
 		const gchar *parent_name;
-		gchar *tooltip, *name;
-		GdkPixbuf *icon = symbols_get_icon_pixbuf(lsp_symbol_get_icon(symbol));
+		SymbolRow *row;
+
+		if (g_hash_table_contains(matches, symbol))
+			continue;
 
 		parent_name = get_parent_name(symbol);
 		if (parent_name)
+			parent = parents_table_lookup(parents_table, parent_name, lsp_symbol_get_line(symbol));
+
+		if (parent)
 		{
-			GtkTreeIter *parent_search = parents_table_lookup(parents_table, parent_name,
-				lsp_symbol_get_line(symbol));
+			if (parent->deferred >= 0 ||
+				is_row_lazy(GTK_TREE_VIEW(sym_tree), parent->row, lazy_rows, many_symbols))
+			{
+				gint deferred = defer_symbol(parent->row, symbol, parent->deferred);
 
-			if (parent_search)
-				parent = parent_search;
-			else
-				parent_name = NULL;
-		}
+				update_parents_table(parents_table, symbol, parent->row, deferred);
+				continue;
+			}
 
-		/* only expand to the iter if the parent was empty, otherwise we let the
-		 * folding as it was before (already expanded, or closed by the user) */
-		if (parent)
-			expand = ! gtk_tree_model_iter_has_child(model, parent);
+			/* only expand to the iter if the parent was empty, otherwise we let the
+			 * folding as it was before (already expanded, or closed by the user) */
+			expand = ! gtk_tree_model_iter_has_child(model, &parent->row->iter);
+		}
 
 		/* insert the new element */
-		name = lsp_symbol_get_symtree_name(symbol, parent_name == NULL);
-		tooltip = lsp_symbol_get_symtree_tooltip(symbol, doc->encoding);
-		gtk_tree_store_insert_with_values(store, &iter, parent, 0,
-				SYMBOLS_COLUMN_NAME, name,
-				SYMBOLS_COLUMN_TOOLTIP, tooltip,
-				SYMBOLS_COLUMN_ICON, icon,
-				SYMBOLS_COLUMN_SYMBOL, symbol,
-				-1);
-		g_free(tooltip);
-		g_free(name);
-
-		update_parents_table(parents_table, symbol, &iter);
+		row = insert_symbol_row(doc, store, symbol, parent ? &parent->row->iter : NULL);
+		g_ptr_array_add(rows, row);
+		update_parents_table(parents_table, symbol, row, -1);
 
 		if (expand)
-			tree_view_expand_to_iter(GTK_TREE_VIEW(sym_tree), &iter);
+			g_ptr_array_add(expand_rows, row);
+	}
+
+	/* rebuild the index from the rows of the new symbols */
+	for (i = 0; i < sym_index->rows->len; i++)
+	{
+		SymbolRow *row = sym_index->rows->pdata[i];
+
+		if (row->found && !row->removed)
+		{
+			/* row->symbol is the symbol stored in the row */
+			row->found = NULL;
+			g_ptr_array_add(rows, row);
+			sym_index->rows->pdata[i] = NULL;
+		}
 	}
+	g_ptr_array_free(sym_index->rows, TRUE);
+	sym_index->rows = rows;
+
+	g_hash_table_remove_all(sym_index->row_table);
+	g_hash_table_remove_all(sym_index->symbol_rows);
+	for (i = 0; i < rows->len; i++)
+	{
+		SymbolRow *row = rows->pdata[i];
+
+		row_table_insert(sym_index->row_table, row);
+		g_hash_table_insert(sym_index->symbol_rows, row->symbol, row);
+		update_placeholder(store, row);
+	}
+
+	/* expanding may populate collapsed parents so it's done only once the
+	 * index is complete */
+	for (i = 0; i < expand_rows->len; i++)
+	{
+		SymbolRow *row = expand_rows->pdata[i];
 
+		tree_view_expand_to_iter(GTK_TREE_VIEW(sym_tree), &row->iter);
+	}
+	g_ptr_array_free(expand_rows, TRUE);
+
+	g_hash_table_destroy(lazy_rows);
 	g_hash_table_destroy(parents_table);
-	g_hash_table_destroy(symbols_table);
+	g_hash_table_destroy(matches);
 }
 
 
@@ -730,20 +982,393 @@ static gint tree_sort_func(GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b,
 }
 
 
+/* only sorts the store when it isn't sorted already */
 static void sort_tree(GtkTreeStore *store)
 {
-	gtk_tree_sortable_set_sort_func(GTK_TREE_SORTABLE(store), SYMBOLS_COLUMN_NAME, tree_sort_func,
-		NULL, NULL);
-
 	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store), SYMBOLS_COLUMN_NAME, GTK_SORT_ASCENDING);
 }
 
 
+/* inserts the deferred descendants of @row, their children are deferred
+ * again */
+static void populate_row(GeanyDocument *doc, SymbolIndex *sym_index, SymbolRow *row)
+{
+	GtkTreeStore *store = plugin_get_document_data(geany_plugin, doc, SYM_STORE_KEY);
+	GArray *deferred = row->deferred;
+	GPtrArray *new_rows;
+	ParentRef *refs;
+	guint i;
+
+	if (!deferred)
+		return;
+	row->deferred = NULL;
+
+	if (deferred->len > SORT_INCREMENTAL_MAX)
+		gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store),
+			GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, 0);
+
+	new_rows = g_ptr_array_new();
+	refs = g_new(ParentRef, deferred->len);
+	for (i = 0; i < deferred->len; i++)
+	{
+		DeferredSymbol *sym = &g_array_index(deferred, DeferredSymbol, i);
+
+		if (sym->parent < 0)
+		{
+			SymbolRow *child = insert_symbol_row(doc, store, sym->symbol, &row->iter);
+
+			g_ptr_array_add(sym_index->rows, child);
+			row_table_insert(sym_index->row_table, child);
+			g_hash_table_insert(sym_index->symbol_rows, child->symbol, child);
+			g_ptr_array_add(new_rows, child);
+
+			refs[i].row = child;
+			refs[i].deferred = -1;
+		}
+		else
+		{
+			ParentRef *parent = &refs[sym->parent];
+
+			refs[i].row = parent->row;
+			refs[i].deferred = defer_symbol(parent->row, sym->symbol, parent->deferred);
+		}
+	}
+
+	for (i = 0; i < new_rows->len; i++)
+		update_placeholder(store, new_rows->pdata[i]);
+	/* removes the placeholder now the row has real children */
+	update_placeholder(store, row);
+
+	g_free(refs);
+	g_ptr_array_free(new_rows, TRUE);
+	g_array_free(deferred, TRUE);
+
+	sort_tree(store);
+}
+
+
+static gboolean on_test_expand_row(GtkTreeView *view, GtkTreeIter *iter, GtkTreePath *path,
+		gpointer user_data)
+{
+	GeanyDocument *doc = document_get_current();
+	SymbolIndex *sym_index;
+	LspSymbol *symbol;
+	SymbolRow *row;
+
+	if (!doc || plugin_get_document_data(geany_plugin, doc, SYM_TREE_KEY) != (gpointer) view)
+		return FALSE;
+
+	sym_index = plugin_get_document_data(geany_plugin, doc, SYM_INDEX_KEY);
+	if (!sym_index)
+		return FALSE;
+
+	gtk_tree_model_get(gtk_tree_view_get_model(view), iter, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+	row = symbol ? g_hash_table_lookup(sym_index->symbol_rows, symbol) : NULL;
+	if (row)
+		populate_row(doc, sym_index, row);
+	lsp_symbol_unref(symbol);
+
+	/* allow the expansion */
+	return FALSE;
+}
+
+
+static gchar *normalize_for_filter(const gchar *str)
+{
+	gchar *normalized = g_utf8_normalize(str, -1, G_NORMALIZE_ALL);
+	gchar *folded = normalized ? g_utf8_casefold(normalized, -1) : NULL;
+
+	g_free(normalized);
+	return folded;
+}
+
+
+static gboolean symbol_matches(SymbolIndex *sym_index, LspSymbol *symbol, gchar **tokens)
+{
+	gchar *name;
+	gchar **val;
+
+	if (!g_hash_table_lookup_extended(sym_index->names, symbol, NULL, (gpointer *) &name))
+	{
+		gchar *full_tagname = lsp_symbol_get_symtree_name(symbol, TRUE);
+
+		name = normalize_for_filter(full_tagname);
+		g_hash_table_insert(sym_index->names, symbol, name);
+		g_free(full_tagname);
+	}
+
+	if (!name)
+		return TRUE;
+
+	foreach_strv(val, tokens)
+	{
+		if (strstr(name, *val) == NULL)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static gboolean add_row_parent(GtkTreeModel *model, G_GNUC_UNUSED GtkTreePath *path,
+	GtkTreeIter *iter, gpointer user_data)
+{
+	GHashTable *parents = user_data;
+	LspSymbol *symbol, *parent_symbol = NULL;
+	GtkTreeIter parent;
+
+	gtk_tree_model_get(model, iter, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+	if (!symbol)
+		return FALSE;
+
+	if (gtk_tree_model_iter_parent(model, &parent, iter))
+		gtk_tree_model_get(model, &parent, SYMBOLS_COLUMN_SYMBOL, &parent_symbol, -1);
+
+	/* the symbols are held by the store */
+	g_hash_table_insert(parents, symbol, parent_symbol);
+	lsp_symbol_unref(parent_symbol);
+	lsp_symbol_unref(symbol);
+
+	return FALSE;
+}
+
+
+/* parent of every symbol, both of those in the store and the deferred ones */
+static void build_parents(GtkTreeModel *store, SymbolIndex *sym_index)
+{
+	GHashTable *parents = g_hash_table_new(g_direct_hash, g_direct_equal);
+	SymbolRow *row;
+	guint i, j;
+
+	gtk_tree_model_foreach(store, add_row_parent, parents);
+
+	foreach_ptr_array(row, i, sym_index->rows)
+	{
+		if (!row->deferred)
+			continue;
+
+		for (j = 0; j < row->deferred->len; j++)
+		{
+			DeferredSymbol *sym = &g_array_index(row->deferred, DeferredSymbol, j);
+			LspSymbol *parent = sym->parent < 0 ? row->symbol :
+				g_array_index(row->deferred, DeferredSymbol, sym->parent).symbol;
+
+			g_hash_table_insert(parents, sym->symbol, parent);
+		}
+	}
+
+	sym_index->parents = parents;
+}
+
+
+/* when the filter only grew, just the symbols matching the previous filter
+ * can match the new one */
+static void compute_filter_sets(GtkTreeModel *store, SymbolIndex *sym_index, const gchar *text,
+	gboolean narrowing)
+{
+	gchar *folded = normalize_for_filter(text);
+	gchar **tokens = g_strsplit_set(folded ? folded : "", " ", -1);
+	GHashTable *matched = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTable *visible = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTable *expand = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	LspSymbol *symbol;
+
+	if (!sym_index->names)
+		sym_index->names = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	if (!sym_index->parents)
+		build_parents(store, sym_index);
+
+	g_hash_table_iter_init(&iter, narrowing ? sym_index->matched : sym_index->parents);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &symbol, NULL))
+	{
+		if (symbol_matches(sym_index, symbol, tokens))
+			g_hash_table_add(matched, symbol);
+	}
+
+	g_hash_table_iter_init(&iter, matched);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &symbol, NULL))
+	{
+		LspSymbol *parent = g_hash_table_lookup(sym_index->parents, symbol);
+
+		g_hash_table_add(visible, symbol);
+		/* ancestors already added have their ancestors added too */
+		while (parent && !g_hash_table_contains(expand, parent))
+		{
+			g_hash_table_add(expand, parent);
+			g_hash_table_add(visible, parent);
+			parent = g_hash_table_lookup(sym_index->parents, parent);
+		}
+	}
+
+	clear_filter_sets(sym_index);
+	sym_index->filter = g_strdup(text);
+	sym_index->matched = matched;
+	sym_index->visible = visible;
+	sym_index->expand = expand;
+
+	g_strfreev(tokens);
+	g_free(folded);
+}
+
+
+static gboolean symbol_visible_func(GtkTreeModel *model, GtkTreeIter *iter, gpointer user_data)
+{
+	GeanyDocument *doc = user_data;
+	SymbolIndex *sym_index = plugin_get_document_data(geany_plugin, doc, SYM_INDEX_KEY);
+	LspSymbol *symbol;
+	gboolean visible;
+
+	if (!sym_index || !sym_index->visible)
+		return TRUE;
+
+	gtk_tree_model_get(model, iter, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+	if (symbol)
+		visible = g_hash_table_contains(sym_index->visible, symbol);
+	else
+	{
+		GtkTreeIter parent;
+
+		/* placeholders only when some deferred descendant matches */
+		visible = FALSE;
+		if (gtk_tree_model_iter_parent(model, &parent, iter))
+		{
+			gtk_tree_model_get(model, &parent, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+			visible = symbol && g_hash_table_contains(sym_index->expand, symbol);
+		}
+	}
+	lsp_symbol_unref(symbol);
+
+	return visible;
+}
+
+
+static void save_expansion(GtkTreeView *view, SymbolIndex *sym_index)
+{
+	SymbolRow *row;
+	guint i;
+
+	foreach_ptr_array(row, i, sym_index->rows)
+	{
+		GtkTreePath *path = get_view_path(view, &row->iter);
+
+		row->expanded = path && gtk_tree_view_row_expanded(view, path);
+		gtk_tree_path_free(path);
+	}
+}
+
+
+static void restore_expansion(GtkTreeView *view, GtkTreeStore *store, SymbolIndex *sym_index)
+{
+	GPtrArray *rows = g_ptr_array_new();
+	SymbolRow *row;
+	guint i;
+
+	/* expanding populates rows which adds to sym_index->rows */
+	foreach_ptr_array(row, i, sym_index->rows)
+	{
+		if (row->expanded)
+			g_ptr_array_add(rows, row);
+	}
+	g_ptr_array_sort_with_data(rows, compare_row_depth, store);
+
+	gtk_tree_view_collapse_all(view);
+	foreach_ptr_array(row, i, rows)
+	{
+		GtkTreePath *path = get_view_path(view, &row->iter);
+
+		if (path)
+			gtk_tree_view_expand_row(view, path, FALSE);
+		gtk_tree_path_free(path);
+	}
+
+	g_ptr_array_free(rows, TRUE);
+}
+
+
+/* expands the ancestors of matched symbols, populating them if needed */
+static void expand_filtered(GtkTreeView *view, GtkTreeModel *model, GtkTreeIter *parent,
+	GHashTable *expand)
+{
+	GtkTreeIter iter;
+	gboolean cont;
+
+	cont = gtk_tree_model_iter_children(model, &iter, parent);
+	while (cont)
+	{
+		LspSymbol *symbol;
+
+		gtk_tree_model_get(model, &iter, SYMBOLS_COLUMN_SYMBOL, &symbol, -1);
+		if (symbol && g_hash_table_contains(expand, symbol))
+		{
+			GtkTreePath *path = gtk_tree_model_get_path(model, &iter);
+
+			gtk_tree_view_expand_row(view, path, FALSE);
+			gtk_tree_path_free(path);
+			expand_filtered(view, model, &iter, expand);
+		}
+		lsp_symbol_unref(symbol);
+
+		cont = gtk_tree_model_iter_next(model, &iter);
+	}
+}
+
+
+/* Applies the filter of the document to its symbol tree by hiding rows of
+ * the store so the rows (and their expansion) don't have to be re-created.
+ * The expansion before filtering is restored once the filter is cleared. */
+static void filter_symbols_tree(GeanyDocument *doc, gboolean symbols_changed)
+{
+	GtkTreeStore *store = plugin_get_document_data(geany_plugin, doc, SYM_STORE_KEY);
+	GtkWidget *sym_tree = plugin_get_document_data(geany_plugin, doc, SYM_TREE_KEY);
+	SymbolIndex *sym_index = plugin_get_document_data(geany_plugin, doc, SYM_INDEX_KEY);
+	const gchar *text = plugin_get_document_data(geany_plugin, doc, SYM_FILTER_KEY);
+	gboolean was_filtered, narrowing = FALSE;
+	GtkTreeModel *model;
+	GtkTreeView *view;
+
+	if (!store || !sym_tree || !sym_index)
+		return;
+
+	view = GTK_TREE_VIEW(sym_tree);
+	model = gtk_tree_view_get_model(view);
+	text = text ? text : "";
+	was_filtered = sym_index->visible != NULL;
+
+	if (symbols_changed)
+		clear_filter_cache(sym_index);
+	else if (g_strcmp0(text, sym_index->filter ? sym_index->filter : "") == 0)
+		return;
+	else
+		narrowing = sym_index->filter && g_str_has_prefix(text, sym_index->filter);
+
+	if (EMPTY(text))
+	{
+		clear_filter_sets(sym_index);
+		if (was_filtered)
+			gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(model));
+		if (sym_index->expansion_saved)
+			restore_expansion(view, store, sym_index);
+		sym_index->expansion_saved = FALSE;
+		return;
+	}
+
+	if (!sym_index->expansion_saved)
+		save_expansion(view, sym_index);
+	sym_index->expansion_saved = TRUE;
+
+	compute_filter_sets(GTK_TREE_MODEL(store), sym_index, text, narrowing);
+	gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(model));
+	expand_filtered(view, model, NULL, sym_index->expand);
+}
+
+
 static void symbols_recreate_symbol_list(GeanyDocument *doc)
 {
 	GList *symbols;
 	GPtrArray *lsp_symbols;
 	GtkTreeStore *sym_store;
+	SymbolIndex *sym_index;
 
 	g_return_if_fail(DOC_VALID(doc));
 
@@ -752,18 +1377,24 @@ static void symbols_recreate_symbol_list(GeanyDocument *doc)
 		return;
 
 	lsp_symbols = lsp_symbols_doc_get_cached(doc);
+	sym_index = get_symbol_index(doc);
+	/* nothing changed since the last update */
+	if (lsp_symbols == sym_index->symbols)
+		return;
+
 	symbols = get_symbol_list(doc, lsp_symbols);
 	if (symbols == NULL)
 		return;
 
-	/* disable sorting during update because the code doesn't support correctly
-	 * models that are currently being built */
-	gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(sym_store), GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, 0);
-
-	update_symbols(doc, &symbols);
+	update_symbols(doc, symbols);
 	g_list_free(symbols);
 
+	if (sym_index->symbols)
+		g_ptr_array_unref(sym_index->symbols);
+	sym_index->symbols = g_ptr_array_ref(lsp_symbols);
+
 	sort_tree(sym_store);
+	filter_symbols_tree(doc, TRUE);
 }
 
 
@@ -927,7 +1558,7 @@ static gboolean sidebar_key_press_cb(GtkWidget *widget, GdkEventKey *event,
 
 
 /* the prepare_* functions are document-related, but I think they fit better here than in document.c */
-static void prepare_symlist(GtkWidget *tree, GtkTreeStore *store)
+static void prepare_symlist(GtkWidget *tree, GtkTreeModel *model)
 {
 	GtkCellRenderer *text_renderer, *icon_renderer;
 	GtkTreeViewColumn *column;
@@ -956,13 +1587,15 @@ static void prepare_symlist(GtkWidget *tree, GtkTreeStore *store)
 
 	ui_widget_modify_font_from_string(tree, geany_data->interface_prefs->tagbar_font);
 
-	gtk_tree_view_set_model(GTK_TREE_VIEW(tree), GTK_TREE_MODEL(store));
-	g_object_unref(store);
+	gtk_tree_view_set_model(GTK_TREE_VIEW(tree), model);
+	g_object_unref(model);
 
 	g_signal_connect(tree, "button-press-event",
 		G_CALLBACK(sidebar_button_press_cb), NULL);
 	g_signal_connect(tree, "key-press-event",
 		G_CALLBACK(sidebar_key_press_cb), NULL);
+	g_signal_connect(tree, "test-expand-row",
+		G_CALLBACK(on_test_expand_row), NULL);
 
 	gtk_tree_view_set_show_expanders(GTK_TREE_VIEW(tree), geany_data->interface_prefs->show_symbol_list_expanders);
 	if (! geany_data->interface_prefs->show_symbol_list_expanders)
@@ -1015,6 +1648,7 @@ void lsp_symbol_tree_refresh(void)
 	const gchar *entry_text;
 	GtkTreeStore *sym_store;
 	GtkWidget *sym_tree;
+	gint64 start_time;
 
 	if (!doc || !s_sym_window)
 		return;
@@ -1060,10 +1694,21 @@ void lsp_symbol_tree_refresh(void)
 
 	if (sym_tree == NULL)
 	{
+		GtkTreeModel *sym_filter;
+
 		sym_store = gtk_tree_store_new(
 			SYMBOLS_N_COLUMNS, GDK_TYPE_PIXBUF, G_TYPE_STRING, LSP_TYPE_SYMBOL, G_TYPE_STRING);
+		gtk_tree_sortable_set_sort_func(GTK_TREE_SORTABLE(sym_store), SYMBOLS_COLUMN_NAME,
+			tree_sort_func, NULL, NULL);
+		/* the filter only hides rows so filtering doesn't rebuild the store */
+		sym_filter = gtk_tree_model_filter_new(GTK_TREE_MODEL(sym_store), NULL);
+		g_object_unref(sym_store);  /* held by the filter */
+		gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(sym_filter),
+			symbol_visible_func, doc, NULL);
+		/* a new store needs a new index */
+		plugin_set_document_data(geany_plugin, doc, SYM_INDEX_KEY, NULL);
 		sym_tree = gtk_tree_view_new();
-		prepare_symlist(sym_tree, sym_store);
+		prepare_symlist(sym_tree, sym_filter);
 		gtk_widget_show(sym_tree);
 		g_object_ref(sym_tree);	/* to hold it after removing */
 
@@ -1071,7 +1716,9 @@ void lsp_symbol_tree_refresh(void)
 		plugin_set_document_data_full(geany_plugin, doc, SYM_TREE_KEY, g_object_ref(sym_tree), g_object_unref);
 	}
 
+	start_time = g_get_monotonic_time();
 	symbols_recreate_symbol_list(doc);
+	lsp_timing_record(LSP_TIMING_SYMBOL_TREE_REFRESH, sci_get_line_count(doc->editor->sci), start_time);
 
 	CHANGE_TREE(sym_tree);
 
@@ -1090,7 +1737,6 @@ static void on_sidebar_switch_page(GtkNotebook *notebook,
 static void on_entry_tagfilter_changed(GtkAction *action, gpointer user_data)
 {
 	GeanyDocument *doc = document_get_current();
-	GtkTreeStore *store;
 
 	if (!doc)
 		return;
@@ -1098,13 +1744,9 @@ static void on_entry_tagfilter_changed(GtkAction *action, gpointer user_data)
 	plugin_set_document_data_full(geany_plugin, doc, SYM_FILTER_KEY,
 		g_strdup(gtk_entry_get_text(GTK_ENTRY(s_search_entry))), g_free);
 
-	/* make sure the tree is fully re-created so it appears correctly
-	 * after applying filter */
-	store = plugin_get_document_data(geany_plugin, doc, SYM_STORE_KEY);
-	if (store)
-		gtk_tree_store_clear(store);
-
 	lsp_symbol_tree_refresh();
+	/* only changes the visibility of the existing rows */
+	filter_symbols_tree(doc, FALSE);
 }
 
 
@@ -1254,7 +1896,81 @@ void lsp_symbol_tree_destroy(void)
 		plugin_set_document_data(geany_plugin, doc, SYM_TREE_KEY, NULL);
 		plugin_set_document_data(geany_plugin, doc, SYM_STORE_KEY, NULL);
 		plugin_set_document_data(geany_plugin, doc, SYM_FILTER_KEY, NULL);
+		plugin_set_document_data(geany_plugin, doc, SYM_INDEX_KEY, NULL);
+	}
+}
+
+
+static gboolean add_row_size(GtkTreeModel *model, G_GNUC_UNUSED GtkTreePath *path,
+	GtkTreeIter *iter, gpointer user_data)
+{
+	gsize *size = user_data;
+	gchar *name, *tooltip;
+
+	gtk_tree_model_get(model, iter, SYMBOLS_COLUMN_NAME, &name, SYMBOLS_COLUMN_TOOLTIP, &tooltip, -1);
+	// the tree node and a value per column, symbols are counted in their cache
+	*size += sizeof(GNode) + SYMBOLS_N_COLUMNS * 2 * sizeof(gpointer) +
+		lsp_utils_get_string_size(name) + lsp_utils_get_string_size(tooltip);
+	g_free(name);
+	g_free(tooltip);
+
+	return FALSE;
+}
+
+
+/* approximate memory of the document's symbol store and its index */
+gsize lsp_symbol_tree_get_cache_size(GeanyDocument *doc)
+{
+	GtkTreeModel *store = plugin_get_document_data(geany_plugin, doc, SYM_STORE_KEY);
+	SymbolIndex *sym_index = plugin_get_document_data(geany_plugin, doc, SYM_INDEX_KEY);
+	gsize size = 0;
+
+	if (store)
+		gtk_tree_model_foreach(store, add_row_size, &size);
+
+	if (sym_index)
+	{
+		SymbolRow *row;
+		guint i;
+
+		foreach_ptr_array(row, i, sym_index->rows)
+		{
+			size += sizeof(gpointer) + sizeof(SymbolRow);
+			if (row->deferred)
+				size += row->deferred->len * sizeof(DeferredSymbol);
+		}
+		// key, value and hash of every entry
+		size += (g_hash_table_size(sym_index->row_table) + g_hash_table_size(sym_index->symbol_rows)) *
+			(2 * sizeof(gpointer) + sizeof(guint));
+		if (sym_index->names)
+		{
+			GHashTableIter iter;
+			gchar *name;
+
+			g_hash_table_iter_init(&iter, sym_index->names);
+			while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &name))
+				size += 2 * sizeof(gpointer) + sizeof(guint) + lsp_utils_get_string_size(name);
+		}
 	}
+
+	return size;
+}
+
+
+/* Frees the symbol store of the document which is rebuilt from the cached
+ * symbols when the document is shown again - not done while its tree is
+ * displayed */
+void lsp_symbol_tree_drop_cache(GeanyDocument *doc)
+{
+	GtkWidget *sym_tree = plugin_get_document_data(geany_plugin, doc, SYM_TREE_KEY);
+
+	if (!sym_tree || (s_sym_window && gtk_bin_get_child(GTK_BIN(s_sym_window)) == sym_tree))
+		return;
+
+	gtk_widget_destroy(sym_tree);  /* releases the store */
+	plugin_set_document_data(geany_plugin, doc, SYM_TREE_KEY, NULL);
+	plugin_set_document_data(geany_plugin, doc, SYM_STORE_KEY, NULL);
+	plugin_set_document_data(geany_plugin, doc, SYM_INDEX_KEY, NULL);
 }
 
 
@@ -19,9 +19,14 @@
 #ifndef LSP_SYMBOL_TREE_H
 #define LSP_SYMBOL_TREE_H 1
 
+#include <geanyplugin.h>
+
 void lsp_symbol_tree_init(void);
 void lsp_symbol_tree_destroy(void);
 
 void lsp_symbol_tree_refresh(void);
 
+gsize lsp_symbol_tree_get_cache_size(GeanyDocument *doc);
+void lsp_symbol_tree_drop_cache(GeanyDocument *doc);
+
 #endif  /* LSP_SYMBOL_TREE_H */
@@ -21,6 +21,10 @@
 #endif
 
 #include "lsp-symbol.h"
+#include "lsp-utils.h"
+
+/* number of symbols allocated at once by a pool */
+#define POOL_BLOCK_SIZE 256
 
 
 typedef struct LspSymbol
@@ -35,10 +39,26 @@ typedef struct LspSymbol
 	glong kind;
 	guint icon;
 
+	LspSymbolPool *pool; /* owner of the symbol and its strings, NULL if allocated separately */
 	gint refcount; /* the reference count of the symbol */
 } LspSymbol;
 
 
+/* Symbols of a big result (e.g. workspace symbols or converted tags) are
+ * allocated in blocks and their strings are stored in a string chunk - file
+ * names and scopes, repeating for most of the symbols, are stored only once.
+ * Every symbol holds a reference of the pool so everything is freed together
+ * once the last symbol is gone. The pool itself isn't thread safe - it can
+ * only be filled from a single thread. */
+typedef struct LspSymbolPool
+{
+	GStringChunk *strings;
+	GSList *blocks;
+	guint block_used;  /* symbols used in the first block */
+	gint refcount;
+} LspSymbolPool;
+
+
 LspSymbol *lsp_symbol_new(const gchar *name, const gchar *detail, const gchar *scope, const gchar *file,
 	GeanyFiletypeID ft_id, glong kind, gulong line, gulong pos, guint icon)
 {
@@ -59,6 +79,69 @@ LspSymbol *lsp_symbol_new(const gchar *name, const gchar *detail, const gchar *s
 }
 
 
+LspSymbolPool *lsp_symbol_pool_new(void)
+{
+	LspSymbolPool *pool = g_new0(LspSymbolPool, 1);
+
+	pool->strings = g_string_chunk_new(4096);
+	pool->block_used = POOL_BLOCK_SIZE;
+	pool->refcount = 1;
+
+	return pool;
+}
+
+
+void lsp_symbol_pool_unref(LspSymbolPool *pool)
+{
+	if (pool && g_atomic_int_dec_and_test(&pool->refcount))
+	{
+		g_slist_free_full(pool->blocks, g_free);
+		g_string_chunk_free(pool->strings);
+		g_free(pool);
+	}
+}
+
+
+static gchar *pool_insert(LspSymbolPool *pool, const gchar *str, gboolean intern)
+{
+	if (!str)
+		return NULL;
+	if (intern)
+		return g_string_chunk_insert_const(pool->strings, str);
+	return g_string_chunk_insert(pool->strings, str);
+}
+
+
+LspSymbol *lsp_symbol_pool_new_symbol(LspSymbolPool *pool, const gchar *name, const gchar *detail,
+	const gchar *scope, const gchar *file, GeanyFiletypeID ft_id, glong kind, gulong line, gulong pos,
+	guint icon)
+{
+	LspSymbol *sym;
+
+	if (pool->block_used == POOL_BLOCK_SIZE)
+	{
+		pool->blocks = g_slist_prepend(pool->blocks, g_new0(LspSymbol, POOL_BLOCK_SIZE));
+		pool->block_used = 0;
+	}
+	sym = (LspSymbol *)pool->blocks->data + pool->block_used++;
+	sym->refcount = 1;
+	sym->pool = pool;
+	g_atomic_int_inc(&pool->refcount);
+
+	sym->name = pool_insert(pool, name, FALSE);
+	sym->detail = pool_insert(pool, detail, FALSE);
+	sym->scope = pool_insert(pool, scope, TRUE);
+	sym->file = pool_insert(pool, file, TRUE);
+	sym->ft_id = ft_id;
+	sym->kind = kind;
+	sym->line = line;
+	sym->pos = pos;
+	sym->icon = icon;
+
+	return sym;
+}
+
+
 LspSymbol *lsp_symbol_new_from_tag(TMTag *tag)
 {
 	LspSymbol *sym = g_slice_new0(LspSymbol);
@@ -92,8 +175,13 @@ void lsp_symbol_unref(LspSymbol *sym)
 {
 	if (sym && g_atomic_int_dec_and_test(&sym->refcount))
 	{
-		symbol_destroy(sym);
-		g_slice_free(LspSymbol, sym);
+		if (sym->pool)
+			lsp_symbol_pool_unref(sym->pool);
+		else
+		{
+			symbol_destroy(sym);
+			g_slice_free(LspSymbol, sym);
+		}
 	}
 }
 
@@ -147,6 +235,12 @@ glong lsp_symbol_get_kind(const LspSymbol *sym)
 }
 
 
+GeanyFiletypeID lsp_symbol_get_ft_id(const LspSymbol *sym)
+{
+	return sym->ft_id;
+}
+
+
 TMIcon lsp_symbol_get_icon(const LspSymbol *sym)
 {
 	return sym->icon;
@@ -200,3 +294,13 @@ gboolean lsp_symbol_equal(const LspSymbol *a, const LspSymbol *b)
 		g_strcmp0(a->scope, b->scope) == 0 &&
 		g_strcmp0(a->detail, b->detail) == 0;
 }
+
+
+/* approximate memory of the symbol and its strings; strings shared inside a
+ * pool are counted for every symbol */
+gsize lsp_symbol_get_size(const LspSymbol *sym)
+{
+	return sizeof(LspSymbol) + lsp_utils_get_string_size(sym->name) +
+		lsp_utils_get_string_size(sym->detail) + lsp_utils_get_string_size(sym->scope) +
+		lsp_utils_get_string_size(sym->file);
+}
@@ -29,6 +29,9 @@
 struct LspSymbol;
 typedef struct LspSymbol LspSymbol;
 
+struct LspSymbolPool;
+typedef struct LspSymbolPool LspSymbolPool;
+
 /* The GType for a LspSymbol */
 #define LSP_TYPE_SYMBOL (lsp_symbol_get_type())
 
@@ -39,9 +42,16 @@ LspSymbol *lsp_symbol_ref(LspSymbol *sym);
 LspSymbol *lsp_symbol_new(const gchar *name, const gchar *detail, const gchar *scope, const gchar *file,
 	GeanyFiletypeID ft_id, glong kind, gulong line, gulong pos, guint icon);
 
+LspSymbolPool *lsp_symbol_pool_new(void);
+void lsp_symbol_pool_unref(LspSymbolPool *pool);
+LspSymbol *lsp_symbol_pool_new_symbol(LspSymbolPool *pool, const gchar *name, const gchar *detail,
+	const gchar *scope, const gchar *file, GeanyFiletypeID ft_id, glong kind, gulong line, gulong pos,
+	guint icon);
+
 gulong lsp_symbol_get_line(const LspSymbol *sym);
 gulong lsp_symbol_get_pos(const LspSymbol *sym);
 glong lsp_symbol_get_kind(const LspSymbol *sym);
+GeanyFiletypeID lsp_symbol_get_ft_id(const LspSymbol *sym);
 TMIcon lsp_symbol_get_icon(const LspSymbol *sym);
 const gchar *lsp_symbol_get_scope(const LspSymbol *sym);
 const gchar *lsp_symbol_get_name(const LspSymbol *sym);
@@ -55,6 +65,8 @@ gchar *lsp_symbol_get_symtree_tooltip(const LspSymbol *sym, const gchar *encodin
 
 gboolean lsp_symbol_equal(const LspSymbol *a, const LspSymbol *b);
 
+gsize lsp_symbol_get_size(const LspSymbol *sym);
+
 G_END_DECLS
 
 #endif  /* LSP_SYMBOL_H */
@@ -26,27 +26,60 @@
 #include "lsp-sync.h"
 #include "lsp-symbol-kinds.h"
 #include "lsp-symbol.h"
+#include "lsp-progress.h"
+#include "lsp-disk-cache.h"
+#include "lsp-symbol-tree.h"
 
 #include <jsonrpc-glib.h>
 
+#include <stdlib.h>
+
 #define CACHED_SYMBOLS_KEY "lsp_symbols_cached"
 
+// version of symbols from the previous session, never matches the document
+#define RESTORED_VERSION G_MAXUINT
+
 typedef struct {
-	GeanyDocument *doc;
 	LspCallback callback;
 	gpointer user_data;
+} LspSymbolCallback;
+
+typedef struct {
+	GeanyDocument *doc;  /* NULL once the document's cache was destroyed */
+	guint version;
+	GSList *callbacks;  /* LspSymbolCallback, in reverse order */
 } LspSymbolUserData;
 
+/* symbols of a document shared by the symbol tree and goto anywhere */
+typedef struct {
+	GPtrArray *symbols;
+	guint version;  /* document version the symbols belong to */
+	LspSymbolUserData *pending;  /* in-flight request */
+} LspDocSymbols;
+
 typedef struct {
 	gint ft_id;
+	LspRpcRequest request;
 	LspWorkspaceSymbolRequestCallback callback;
 	gpointer user_data;
+	gchar *partial_token;
+	GPtrArray *partial;  /* symbols received as partial results so far */
 } LspWorkspaceSymbolUserData;
 
+typedef struct {
+	GVariant *result;
+	GeanyFiletypeID ft_id;
+	gchar *file_name;
+	const gchar *scope_sep;
+	gboolean workspace;
+} LspSymbolParseData;
+
 
 extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
+static LspRpcRequest pending_workspace_request;
+
 
 static void arr_free(GPtrArray *arr)
 {
@@ -55,17 +88,67 @@ static void arr_free(GPtrArray *arr)
 }
 
 
+static void doc_symbols_free(LspDocSymbols *doc_symbols)
+{
+	if (!doc_symbols)
+		return;
+	/* the request still completes, just without storing the result */
+	if (doc_symbols->pending)
+		doc_symbols->pending->doc = NULL;
+	arr_free(doc_symbols->symbols);
+	g_free(doc_symbols);
+}
+
+
+static LspDocSymbols *get_doc_symbols(GeanyDocument *doc)
+{
+	LspDocSymbols *doc_symbols = plugin_get_document_data(geany_plugin, doc, CACHED_SYMBOLS_KEY);
+
+	if (!doc_symbols)
+	{
+		doc_symbols = g_new0(LspDocSymbols, 1);
+		plugin_set_document_data_full(geany_plugin, doc, CACHED_SYMBOLS_KEY,
+			doc_symbols, (GDestroyNotify)doc_symbols_free);
+	}
+
+	return doc_symbols;
+}
+
+
 void lsp_symbols_destroy(GeanyDocument *doc)
 {
 	plugin_set_document_data_full(geany_plugin, doc, CACHED_SYMBOLS_KEY,
-			NULL, (GDestroyNotify)arr_free);
+			NULL, (GDestroyNotify)doc_symbols_free);
 }
 
 
-static void parse_symbols(GPtrArray *symbols, GVariant *symbol_variant, const gchar *scope,
-	const gchar *scope_sep, gboolean workspace)
+/* approximate memory of the cached document symbols */
+gsize lsp_symbols_get_cache_size(GeanyDocument *doc)
+{
+	LspDocSymbols *doc_symbols = plugin_get_document_data(geany_plugin, doc, CACHED_SYMBOLS_KEY);
+	LspSymbol *sym;
+	gsize size;
+	guint i;
+
+	if (!doc_symbols)
+		return 0;
+
+	size = sizeof(LspDocSymbols);
+	if (doc_symbols->symbols)
+	{
+		foreach_ptr_array(sym, i, doc_symbols->symbols)
+			size += sizeof(gpointer) + lsp_symbol_get_size(sym);
+	}
+
+	return size;
+}
+
+
+/* runs in a worker thread - must not touch any editor state */
+static void parse_symbols(GPtrArray *symbols, LspSymbolPool *pool, GVariant *symbol_variant,
+	const gchar *scope, const gchar *scope_sep, gboolean workspace, GeanyFiletypeID ft_id,
+	const gchar *doc_file_name)
 {
-	GeanyDocument *doc = document_get_current();
 	GVariant *member = NULL;
 	GVariantIter iter;
 
@@ -78,99 +161,89 @@ static void parse_symbols(GPtrArray *symbols, GVariant *symbol_variant, const gc
 		const gchar *detail = NULL;
 		const gchar *uri = NULL;
 		const gchar *container_name = NULL;
+		GVariant *selection_range = NULL;
+		GVariant *range_variant = NULL;
 		GVariant *loc_variant = NULL;
 		GVariant *children = NULL;
 		gchar *uri_str = NULL;
-		gint64 kind = 0;
+		gint64 kind = -1;
 		gint line_num = 0;
 		gint line_pos = 0;
 		gchar *file_name = NULL;
 		const gchar *sym_scope = NULL;
 
-		if (!JSONRPC_MESSAGE_PARSE(member, "name", JSONRPC_MESSAGE_GET_STRING(&name)))
-			continue;
-		if (!JSONRPC_MESSAGE_PARSE(member, "kind", JSONRPC_MESSAGE_GET_INT64(&kind)))
-			continue;
-
-		if (JSONRPC_MESSAGE_PARSE(member, "selectionRange", JSONRPC_MESSAGE_GET_VARIANT(&loc_variant)))
-		{
-			LspRange range = lsp_utils_parse_range(loc_variant);
-			line_num = range.start.line;
-			line_pos = range.start.character;
-		}
-		else if (JSONRPC_MESSAGE_PARSE(member, "range", JSONRPC_MESSAGE_GET_VARIANT(&loc_variant)))
-		{
-			LspRange range = lsp_utils_parse_range(loc_variant);
-			line_num = range.start.line;
-			line_pos = range.start.character;
-		}
-		else if (JSONRPC_MESSAGE_PARSE(member, "location", JSONRPC_MESSAGE_GET_VARIANT(&loc_variant)))
+		// all members in a single walk over the symbol
+		JSONRPC_MESSAGE_PARSE_MEMBERS(member,
+			"name", JSONRPC_MESSAGE_GET_STRING(&name),
+			"kind", JSONRPC_MESSAGE_GET_INT64(&kind),
+			"selectionRange", JSONRPC_MESSAGE_GET_VARIANT(&selection_range),
+			"range", JSONRPC_MESSAGE_GET_VARIANT(&range_variant),
+			"location", JSONRPC_MESSAGE_GET_VARIANT(&loc_variant),
+			"containerName", JSONRPC_MESSAGE_GET_STRING(&container_name),
+			"detail", JSONRPC_MESSAGE_GET_STRING(&detail),
+			"children", JSONRPC_MESSAGE_GET_VARIANT(&children));
+
+		if (name && kind >= 0 && (selection_range || range_variant || loc_variant || workspace))
 		{
-			LspLocation *loc = lsp_utils_parse_location(loc_variant);
-			if (loc)
+			if (selection_range || range_variant)
 			{
-				line_num = loc->range.start.line;
-				line_pos = loc->range.start.character;
-				if (loc->uri)
-					uri_str = g_strdup(loc->uri);
-				lsp_utils_free_lsp_location(loc);
+				LspRange range = lsp_utils_parse_range(selection_range ? selection_range : range_variant);
+				line_num = range.start.line;
+				line_pos = range.start.character;
 			}
-		}
-		else if (!workspace)
-		{
-			if (loc_variant)
-				g_variant_unref(loc_variant);
-			continue;
-		}
-
-		if (workspace)
-		{
-			JSONRPC_MESSAGE_PARSE(member, "containerName", JSONRPC_MESSAGE_GET_STRING(&container_name));
-
-			if (!uri_str)
+			else if (loc_variant)
 			{
-				if (JSONRPC_MESSAGE_PARSE(member, "location", "{",
-						"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
-					"}"))
+				LspLocation *loc = lsp_utils_parse_location(loc_variant);
+				if (loc)
 				{
-					if (uri)
-						uri_str = g_strdup(uri);
+					line_num = loc->range.start.line;
+					line_pos = loc->range.start.character;
+					if (loc->uri)
+						uri_str = g_strdup(loc->uri);
+					lsp_utils_free_lsp_location(loc);
 				}
-
-				if (!uri_str)
-					continue;
 			}
-		}
 
-		JSONRPC_MESSAGE_PARSE(member, "detail", JSONRPC_MESSAGE_GET_STRING(&detail));
+			if (workspace && !uri_str && loc_variant &&
+				JSONRPC_MESSAGE_PARSE(loc_variant, "uri", JSONRPC_MESSAGE_GET_STRING(&uri)) && uri)
+				uri_str = g_strdup(uri);
 
-		if (scope)
-			sym_scope = scope;
-		else if (container_name)
-			sym_scope = container_name;
+			// workspace symbols without a file are skipped
+			if (!workspace || uri_str)
+			{
+				if (scope)
+					sym_scope = scope;
+				else if (workspace && container_name)
+					sym_scope = container_name;
 
-		if (uri_str)
-			file_name = lsp_utils_get_real_path_from_uri_utf8(uri_str);
-		else if (doc && doc->real_path)
-			file_name = utils_get_utf8_from_locale(doc->real_path);
+				if (uri_str)
+					file_name = lsp_utils_get_real_path_from_uri_utf8(uri_str);
+				else
+					file_name = g_strdup(doc_file_name);
 
-		sym = lsp_symbol_new(name, detail, sym_scope, file_name, doc->file_type->id, kind,
-			line_num + 1, line_pos, lsp_symbol_kinds_get_symbol_icon(kind));
+				sym = lsp_symbol_pool_new_symbol(pool, name, detail, sym_scope, file_name, ft_id, kind,
+					line_num + 1, line_pos, lsp_symbol_kinds_get_symbol_icon(kind));
 
-		g_ptr_array_add(symbols, sym);
+				g_ptr_array_add(symbols, sym);
 
-		if (JSONRPC_MESSAGE_PARSE(member, "children", JSONRPC_MESSAGE_GET_VARIANT(&children)))
-		{
-			gchar *new_scope;
-
-			if (scope)
-				new_scope = g_strconcat(scope, scope_sep, lsp_symbol_get_name(sym), NULL);
-			else
-				new_scope = g_strdup(lsp_symbol_get_name(sym));
-			parse_symbols(symbols, children, new_scope, scope_sep, FALSE);
-			g_free(new_scope);
+				if (children)
+				{
+					gchar *new_scope;
+
+					if (scope)
+						new_scope = g_strconcat(scope, scope_sep, lsp_symbol_get_name(sym), NULL);
+					else
+						new_scope = g_strdup(lsp_symbol_get_name(sym));
+					parse_symbols(symbols, pool, children, new_scope, scope_sep, FALSE, ft_id, doc_file_name);
+					g_free(new_scope);
+				}
+			}
 		}
 
+		if (selection_range)
+			g_variant_unref(selection_range);
+		if (range_variant)
+			g_variant_unref(range_variant);
 		if (loc_variant)
 			g_variant_unref(loc_variant);
 		if (children)
@@ -181,62 +254,284 @@ static void parse_symbols(GPtrArray *symbols, GVariant *symbol_variant, const gc
 }
 
 
+static void parse_data_free(LspSymbolParseData *data)
+{
+	g_variant_unref(data->result);
+	g_free(data->file_name);
+	g_free(data);
+}
+
+
+static void parse_symbols_thread(GTask *task, gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	LspSymbolParseData *data = task_data;
+	GPtrArray *symbols = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+	LspSymbolPool *pool = lsp_symbol_pool_new();
+
+	parse_symbols(symbols, pool, data->result, NULL, data->scope_sep, data->workspace,
+		data->ft_id, data->file_name);
+	lsp_symbol_pool_unref(pool);
+
+	g_task_return_pointer(task, symbols, (GDestroyNotify)arr_free);
+}
+
+
+/* Big symbol replies (workspace/symbol in particular) take a while to convert
+ * so it's done off the main thread; callback receives the GPtrArray of
+ * LspSymbols via g_task_propagate_pointer() */
+static void parse_symbols_async(GVariant *result, GeanyFiletypeID ft_id, const gchar *file_name,
+	const gchar *scope_sep, gboolean workspace, GAsyncReadyCallback callback, gpointer user_data)
+{
+	LspSymbolParseData *data = g_new0(LspSymbolParseData, 1);
+	GTask *task;
+
+	data->result = g_variant_ref(result);
+	data->ft_id = ft_id;
+	data->file_name = g_strdup(file_name);
+	data->scope_sep = scope_sep;
+	data->workspace = workspace;
+
+	task = g_task_new(NULL, NULL, callback, user_data);
+	g_task_set_task_data(task, data, (GDestroyNotify)parse_data_free);
+	g_task_run_in_thread(task, parse_symbols_thread);
+	g_object_unref(task);
+}
+
+
+static void add_callback(LspSymbolUserData *data, LspCallback callback, gpointer user_data)
+{
+	LspSymbolCallback *cb = g_new0(LspSymbolCallback, 1);
+
+	cb->callback = callback;
+	cb->user_data = user_data;
+	data->callbacks = g_slist_prepend(data->callbacks, cb);
+}
+
+
+/* stores @symbols (if any and still up to date) and notifies everyone waiting
+ * for the request */
+static void finish_request(LspSymbolUserData *data, GPtrArray *symbols)
+{
+	LspDocSymbols *doc_symbols = NULL;
+	GSList *node;
+
+	if (data->doc)
+	{
+		doc_symbols = get_doc_symbols(data->doc);
+		if (doc_symbols->pending == data)
+			doc_symbols->pending = NULL;
+	}
+
+	if (symbols && doc_symbols)
+	{
+		LspServer *srv = lsp_server_get(data->doc);
+
+		// the document may have changed while parsing
+		if (srv && !lsp_sync_is_response_stale(srv, data->doc, data->version, "textDocument/documentSymbol"))
+		{
+			arr_free(doc_symbols->symbols);
+			doc_symbols->symbols = symbols;
+			doc_symbols->version = data->version;
+			symbols = NULL;
+		}
+	}
+	arr_free(symbols);
+
+	data->callbacks = g_slist_reverse(data->callbacks);
+	foreach_slist(node, data->callbacks)
+	{
+		LspSymbolCallback *cb = node->data;
+		cb->callback(cb->user_data);
+	}
+
+	g_slist_free_full(data->callbacks, g_free);
+	g_free(data);
+}
+
+
+static void symbols_parsed_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+	finish_request(user_data, g_task_propagate_pointer(G_TASK(result), NULL));
+}
+
+
 static void symbols_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	LspSymbolUserData *data = user_data;
 
-	if (!error && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
+	if (!error && data->doc && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
 	{
 		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
-		if (data->doc == document_get_current())
-		{
-			GPtrArray *cached_symbols = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+		GeanyDocument *doc = data->doc;
+		LspServer *srv = lsp_server_get(doc);
 
-			parse_symbols(cached_symbols, return_value, NULL, LSP_SCOPE_SEPARATOR, FALSE);
+		if (srv && !lsp_sync_is_response_stale(srv, doc, data->version, "textDocument/documentSymbol"))
+		{
+			gchar *file_name = utils_get_utf8_from_locale(doc->real_path);
 
-			plugin_set_document_data_full(geany_plugin, data->doc, CACHED_SYMBOLS_KEY,
-				cached_symbols, (GDestroyNotify)arr_free);
+			parse_symbols_async(return_value, doc->file_type->id, file_name,
+				LSP_SCOPE_SEPARATOR, FALSE, symbols_parsed_cb, data);
+			g_free(file_name);
+			return;
 		}
 	}
 
-	data->callback(data->user_data);
-
-	g_free(user_data);
+	finish_request(data, NULL);
 }
 
 
 GPtrArray *lsp_symbols_doc_get_cached(GeanyDocument *doc)
 {
+	LspDocSymbols *doc_symbols;
+
 	if (!doc)
 		return NULL;
 
-	return plugin_get_document_data(geany_plugin, doc, CACHED_SYMBOLS_KEY);
+	doc_symbols = plugin_get_document_data(geany_plugin, doc, CACHED_SYMBOLS_KEY);
+	return doc_symbols ? doc_symbols->symbols : NULL;
+}
+
+
+/* stores the symbols for the next session if they belong to the current
+ * document version */
+void lsp_symbols_doc_persist(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	LspDocSymbols *doc_symbols;
+	LspSymbol *sym;
+	GString *str;
+	guint i;
+
+	doc_symbols = plugin_get_document_data(geany_plugin, doc, CACHED_SYMBOLS_KEY);
+	if (!srv || !doc_symbols || !doc_symbols->symbols ||
+		doc_symbols->version != lsp_sync_peek_doc_version(srv, doc))
+		return;
+
+	str = g_string_new("");
+	foreach_ptr_array(sym, i, doc_symbols->symbols)
+	{
+		g_string_append_printf(str, "%ld\t%lu\t%lu\t%d\t", lsp_symbol_get_kind(sym),
+			lsp_symbol_get_line(sym), lsp_symbol_get_pos(sym), lsp_symbol_get_icon(sym));
+		lsp_utils_append_escaped(str, lsp_symbol_get_name(sym));
+		g_string_append_c(str, '\t');
+		lsp_utils_append_escaped(str, lsp_symbol_get_scope(sym));
+		g_string_append_c(str, '\t');
+		lsp_utils_append_escaped(str, lsp_symbol_get_detail(sym));
+		g_string_append_c(str, '\n');
+	}
+	lsp_disk_cache_store(doc, "symbols", str->str);
+
+	g_string_free(str, TRUE);
 }
 
 
-void lsp_symbols_doc_request(GeanyDocument *doc, LspCallback callback,
+static void restore_cb(GeanyDocument *doc, const gchar *contents)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+	LspDocSymbols *doc_symbols;
+	LspSymbolPool *pool;
+	GPtrArray *symbols;
+	gchar *file_name, **lines, **line;
+
+	// the server may have sent the symbols meanwhile
+	doc_symbols = get_doc_symbols(doc);
+	if (!srv || !srv->config.document_symbols_enable || doc_symbols->symbols)
+		return;
+
+	file_name = utils_get_utf8_from_locale(doc->real_path);
+	symbols = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+	pool = lsp_symbol_pool_new();
+	lines = g_strsplit(contents, "\n", -1);
+	foreach_strv(line, lines)
+	{
+		gchar **fields = g_strsplit(*line, "\t", 7);
+
+		if (g_strv_length(fields) == 7)
+		{
+			gchar *name = g_strcompress(fields[4]);
+			gchar *scope = g_strcompress(fields[5]);
+			gchar *detail = g_strcompress(fields[6]);
+
+			g_ptr_array_add(symbols, lsp_symbol_pool_new_symbol(pool, name, detail, scope,
+				file_name, doc->file_type->id, strtol(fields[0], NULL, 10),
+				strtoul(fields[1], NULL, 10), strtoul(fields[2], NULL, 10),
+				strtoul(fields[3], NULL, 10)));
+
+			g_free(detail);
+			g_free(scope);
+			g_free(name);
+		}
+		g_strfreev(fields);
+	}
+	lsp_symbol_pool_unref(pool);
+	g_strfreev(lines);
+	g_free(file_name);
+
+	doc_symbols->symbols = symbols;
+	doc_symbols->version = RESTORED_VERSION;
+
+	lsp_symbol_tree_refresh();
+}
+
+
+/* uses the symbols stored in the previous session until the server sends
+ * them, they are loaded in the background */
+void lsp_symbols_doc_restore(GeanyDocument *doc)
+{
+	LspServer *srv = lsp_server_get_if_running(doc);
+
+	if (!srv || !srv->config.document_symbols_enable || !doc->real_path)
+		return;
+
+	if (get_doc_symbols(doc)->symbols)
+		return;
+
+	lsp_disk_cache_load(doc, "symbols", restore_cb);
+}
+
+
+void lsp_symbols_doc_request(GeanyDocument *doc, gboolean background, LspCallback callback,
 	gpointer user_data)
 {
 	LspServer *server = lsp_server_get(doc);
+	LspDocSymbols *doc_symbols;
 	LspSymbolUserData *data;
 	GVariant *node;
 	gchar *doc_uri;
+	guint version;
 
 	if (!doc || !doc->real_path || !server)
 		return;
 
+	/* Geany requests symbols before firing "document-activate" signal so we may
+	 * need to request document opening here */
+	lsp_sync_text_document_did_open(server, doc);
+	version = lsp_sync_peek_doc_version(server, doc);
+
+	doc_symbols = get_doc_symbols(doc);
+	/* the document didn't change since the symbols were received */
+	if (doc_symbols->symbols && doc_symbols->version == version)
+	{
+		callback(user_data);
+		return;
+	}
+	/* the same symbols are being requested already */
+	if (doc_symbols->pending && doc_symbols->pending->version == version)
+	{
+		add_callback(doc_symbols->pending, callback, user_data);
+		return;
+	}
+
 	data = g_new0(LspSymbolUserData, 1);
-	data->user_data = user_data;
 	data->doc = doc;
-	data->callback = callback;
+	data->version = version;
+	add_callback(data, callback, user_data);
+	doc_symbols->pending = data;
 
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
-	/* Geany requests symbols before firing "document-activate" signal so we may
-	 * need to request document opening here */
-	lsp_sync_text_document_did_open(server, doc);
-
 	node = JSONRPC_MESSAGE_NEW (
 		"textDocument", "{",
 			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
@@ -245,31 +540,87 @@ void lsp_symbols_doc_request(GeanyDocument *doc, LspCallback callback,
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	lsp_rpc_call(server, "textDocument/documentSymbol", node,
-		symbols_cb, data);
+	if (background)
+		lsp_rpc_call_background(server, "textDocument/documentSymbol", node, symbols_cb, data);
+	else
+		lsp_rpc_call(server, "textDocument/documentSymbol", node, symbols_cb, data);
 
 	g_free(doc_uri);
 	g_variant_unref(node);
 }
 
 
+static void workspace_data_free(LspWorkspaceSymbolUserData *data)
+{
+	lsp_progress_partial_result_free(data->partial_token);
+	g_free(data->partial_token);
+	arr_free(data->partial);
+	g_free(data);
+}
+
+
+static void workspace_symbols_parsed_cb(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+	LspWorkspaceSymbolUserData *data = user_data;
+	GPtrArray *ret = g_task_propagate_pointer(G_TASK(result), NULL);
+
+	// superseded by a newer query while parsing
+	if (data->request == pending_workspace_request)
+	{
+		LspSymbol *sym;
+		guint i;
+
+		foreach_ptr_array(sym, i, data->partial)
+			g_ptr_array_add(ret, lsp_symbol_ref(sym));
+
+		pending_workspace_request = 0;
+		data->callback(ret, data->user_data);
+	}
+
+	arr_free(ret);
+	workspace_data_free(data);
+}
+
+
+/* servers supporting partial results stream them before the (usually empty)
+ * response - the callback gets everything received so far each time */
+static void workspace_symbols_partial_cb(GVariant *value, gpointer user_data)
+{
+	LspWorkspaceSymbolUserData *data = user_data;
+	LspSymbolPool *pool;
+
+	if (data->request != pending_workspace_request || !g_variant_is_of_type(value, G_VARIANT_TYPE_ARRAY))
+		return;
+
+	pool = lsp_symbol_pool_new();
+	parse_symbols(data->partial, pool, value, NULL, "", TRUE, data->ft_id, NULL);
+	lsp_symbol_pool_unref(pool);
+
+	data->callback(data->partial, data->user_data);
+}
+
+
 static void workspace_symbols_cb(GVariant *return_value, GError *error, gpointer user_data)
 {
 	LspWorkspaceSymbolUserData *data = user_data;
-	GPtrArray *ret = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+
+	lsp_progress_partial_result_free(data->partial_token);
 
 	if (!error && g_variant_is_of_type(return_value, G_VARIANT_TYPE_ARRAY))
 	{
 		//printf("%s\n\n\n", lsp_utils_json_pretty_print(return_value));
 
 		//scope separator doesn't matter here
-		parse_symbols(ret, return_value, NULL, "", TRUE);
+		parse_symbols_async(return_value, data->ft_id, NULL, "", TRUE,
+			workspace_symbols_parsed_cb, data);
+		return;
 	}
 
-	data->callback(ret, data->user_data);
+	// superseded by a newer query
+	if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		data->callback(data->partial, data->user_data);
 
-	g_ptr_array_free(ret, TRUE);
-	g_free(user_data);
+	workspace_data_free(data);
 }
 
 
@@ -287,15 +638,28 @@ void lsp_symbols_workspace_request(GeanyDocument *doc, const gchar *query,
 	data->user_data = user_data;
 	data->callback = callback;
 	data->ft_id = doc->file_type->id;
+	data->partial = g_ptr_array_new_full(0, (GDestroyNotify)lsp_symbol_unref);
+	data->partial_token = lsp_progress_partial_result_new(server, workspace_symbols_partial_cb, data);
 
 	node = JSONRPC_MESSAGE_NEW (
-		"query", JSONRPC_MESSAGE_PUT_STRING(query)
+		"query", JSONRPC_MESSAGE_PUT_STRING(query),
+		"partialResultToken", JSONRPC_MESSAGE_PUT_STRING(data->partial_token)
 	);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	lsp_rpc_call(server, "workspace/symbol", node,
+	lsp_rpc_cancel(pending_workspace_request);
+	pending_workspace_request = lsp_rpc_call(server, "workspace/symbol", node,
 		workspace_symbols_cb, data);
+	data->request = pending_workspace_request;
 
 	g_variant_unref(node);
 }
+
+
+/* cancels the pending workspace symbol request, its callback isn't called */
+void lsp_symbols_workspace_cancel(void)
+{
+	lsp_rpc_cancel(pending_workspace_request);
+	pending_workspace_request = 0;
+}
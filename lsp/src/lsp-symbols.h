@@ -23,17 +23,24 @@
 
 #include <glib.h>
 
-void lsp_symbols_doc_request(GeanyDocument *doc, LspCallback callback,
+void lsp_symbols_doc_request(GeanyDocument *doc, gboolean background, LspCallback callback,
 	gpointer user_data);
 
 GPtrArray *lsp_symbols_doc_get_cached(GeanyDocument *doc);
+void lsp_symbols_doc_persist(GeanyDocument *doc);
+void lsp_symbols_doc_restore(GeanyDocument *doc);
 
 
+/* may be called several times with the results received so far when the server
+ * streams them */
 typedef void (*LspWorkspaceSymbolRequestCallback) (GPtrArray *arr, gpointer user_data);
 
 void lsp_symbols_workspace_request(GeanyDocument *doc, const gchar *query, LspWorkspaceSymbolRequestCallback callback,
 	gpointer user_data);
+void lsp_symbols_workspace_cancel(void);
 
 void lsp_symbols_destroy(GeanyDocument *doc);
 
+gsize lsp_symbols_get_cache_size(GeanyDocument *doc);
+
 #endif  /* LSP_SYMBOLS_H */
@@ -22,39 +22,75 @@
 
 #include "lsp-sync.h"
 #include "lsp-utils.h"
+#include "lsp-doc-state.h"
 #include "lsp-rpc.h"
 #include "lsp-diagnostics.h"
 #include "lsp-highlight.h"
 #include "lsp-semtokens.h"
 #include "lsp-workspace-folders.h"
 #include "lsp-symbols.h"
+#include "lsp-folding.h"
+#include "lsp-log.h"
+#include "lsp-timing.h"
 
 #include <jsonrpc-glib.h>
 
-#define VERSION_NUM_KEY "lsp_sync_version_num"
 
-#define MRU_SIZE 50
+#define RESIDENCY_CHECK_INTERVAL 60000
+
+#define FULL_SYNC_DELAY 300
+#define LARGE_FILE_SYNC_DELAY 1000
+
+#define CONGESTION_RETRY_INTERVAL 50
 
 
 extern GeanyPlugin *geany_plugin;
 
+typedef struct
+{
+	GeanyDocument *doc;
+	gsize size;
+	gint64 last_used;
+} ResidentDoc;
+
+
+static void free_pending_changes(GPtrArray *changes)
+{
+	g_ptr_array_free(changes, TRUE);
+}
+
 
 void lsp_sync_init(LspServer *srv)
 {
+	// open document -> its link inside resident_docs
 	if (!srv->open_docs)
 		srv->open_docs = g_hash_table_new(NULL, NULL);
 	g_hash_table_remove_all(srv->open_docs);
 
-	g_slist_free(srv->mru_docs);
-	srv->mru_docs = NULL;
+	// most recently used documents first
+	if (srv->resident_docs)
+		g_queue_free_full(srv->resident_docs, g_free);
+	srv->resident_docs = g_queue_new();
+	srv->resident_docs_size = 0;
+
+	if (!srv->pending_changes)
+		srv->pending_changes = g_hash_table_new_full(NULL, NULL, NULL,
+			(GDestroyNotify)free_pending_changes);
+	g_hash_table_remove_all(srv->pending_changes);
 }
 
 
 static void destroy_doc_data(LspServer *srv, GeanyDocument *doc)
 {
-	lsp_semtokens_destroy(doc);
-	lsp_symbols_destroy(doc);
-	srv->mru_docs = g_slist_remove(srv->mru_docs, doc);
+	// belong to the owner of the companion
+	if (!srv->is_companion)
+	{
+		lsp_semtokens_destroy(doc);
+		lsp_symbols_destroy(doc);
+		lsp_folding_destroy(doc);
+	}
+	if (srv->pending_changes)
+		g_hash_table_remove(srv->pending_changes, doc);
 }
 
 
@@ -74,16 +110,93 @@ void lsp_sync_free(LspServer *srv)
 		g_hash_table_destroy(srv->open_docs);
 	}
 	srv->open_docs = NULL;
+
+	if (srv->resident_docs)
+		g_queue_free_full(srv->resident_docs, g_free);
+	srv->resident_docs = NULL;
+	srv->resident_docs_size = 0;
+
+	if (srv->resident_docs_source != 0)
+		g_source_remove(srv->resident_docs_source);
+	srv->resident_docs_source = 0;
+
+	if (srv->pending_changes_source != 0)
+		g_source_remove(srv->pending_changes_source);
+	srv->pending_changes_source = 0;
+
+	if (srv->pending_changes)
+		g_hash_table_destroy(srv->pending_changes);
+	srv->pending_changes = NULL;
+}
+
+
+static guint get_doc_version_num(GeanyDocument *doc)
+{
+	return lsp_doc_state_get(doc)->version;
+}
+
+
+/* Companions receive the changes together with their owner and get the same
+ * version the owner just got */
+static guint get_next_doc_version_num(LspServer *server, GeanyDocument *doc)
+{
+	if (server->is_companion)
+		return get_doc_version_num(doc);
+	return ++lsp_doc_state_get(doc)->version;
+}
+
+
+/* Version of the document as seen by the server - pending changes are flushed
+ * first as they would be anyway before sending a request */
+guint lsp_sync_get_doc_version(LspServer *server, GeanyDocument *doc)
+{
+	lsp_sync_flush_pending_changes(server, doc);
+	return get_doc_version_num(doc);
 }
 
 
-static guint get_next_doc_version_num(GeanyDocument *doc)
+/* Version the document gets once its pending changes are sent - all of them
+ * go out in a single didChange. Unlike lsp_sync_get_doc_version() nothing
+ * is flushed so it can be used for checks without defeating the batching. */
+guint lsp_sync_peek_doc_version(LspServer *server, GeanyDocument *doc)
 {
-	guint num = GPOINTER_TO_UINT(plugin_get_document_data(geany_plugin, doc, VERSION_NUM_KEY));
+	// changes of companions are only sent together with those of the owner
+	if (server && server->is_companion)
+		server = server->companion_owner;
+
+	if (server && server->pending_changes && g_hash_table_contains(server->pending_changes, doc))
+		return get_doc_version_num(doc) + 1;
+	return get_doc_version_num(doc);
+}
+
+
+/* TRUE when the document changed since the request was made so applying its
+ * result would be wasted work - a newer response follows anyway */
+gboolean lsp_sync_is_response_stale(LspServer *server, GeanyDocument *doc, guint version,
+	const gchar *method)
+{
+	guint current_version = lsp_sync_peek_doc_version(server, doc);
+	gchar *msg;
+
+	if (current_version == version)
+		return FALSE;
+
+	server->discarded_responses++;
+
+	msg = g_strdup_printf("%s (version %u, current %u, %u discarded in total)",
+		method, version, current_version, server->discarded_responses);
+	lsp_log(server->log, LspLogClientResponseDiscarded, msg, NULL, NULL, 0);
+	g_free(msg);
 
-	num++;
-	plugin_set_document_data(geany_plugin, doc, VERSION_NUM_KEY, GUINT_TO_POINTER(num));
-	return num;
+	return TRUE;
+}
+
+
+/* Pointer to the Scintilla buffer - valid only until the next document
+ * modification */
+static const gchar *get_doc_text(GeanyDocument *doc)
+{
+	return (const gchar *)SSM(doc->editor->sci, SCI_GETCHARACTERPOINTER, 0, 0);
 }
 
 
@@ -96,50 +209,240 @@ gboolean lsp_sync_is_document_open(LspServer *server, GeanyDocument *doc)
 }
 
 
+static void evict_doc(LspServer *server, ResidentDoc *rd, const gchar *reason, gint64 now)
+{
+	gchar *doc_uri = lsp_utils_get_doc_uri(rd->doc);
+	gchar *msg = g_strdup_printf("%s (%s)", doc_uri, reason);
+	GVariant *node;
+
+	node = JSONRPC_MESSAGE_NEW (
+		"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
+		"reason", JSONRPC_MESSAGE_PUT_STRING(reason),
+		"size", JSONRPC_MESSAGE_PUT_INT64(rd->size),
+		"idleSeconds", JSONRPC_MESSAGE_PUT_INT64((now - rd->last_used) / G_USEC_PER_SEC),
+		"residentDocs", JSONRPC_MESSAGE_PUT_INT32(server->resident_docs->length),
+		"residentSize", JSONRPC_MESSAGE_PUT_INT64(server->resident_docs_size)
+	);
+
+	lsp_log(server->log, LspLogClientDocumentEvicted, msg, node, NULL, 0);
+
+	lsp_sync_text_document_did_close(server, rd->doc);
+
+	g_variant_unref(node);
+	g_free(msg);
+	g_free(doc_uri);
+}
+
+
+static const gchar *get_exceeded_residency_limit(LspServer *server)
+{
+	LspServerConfig *cfg = &server->config;
+
+	if (cfg->open_docs_max_count > 0 &&
+		server->resident_docs->length > (guint)cfg->open_docs_max_count)
+		return "count limit";
+
+	if (cfg->open_docs_max_size > 0 &&
+		server->resident_docs_size > (gsize)cfg->open_docs_max_size * 1024)
+		return "size limit";
+
+	return NULL;
+}
+
+
+// close least recently used documents until within limits, except current doc
+static void enforce_residency_limits(LspServer *server, GeanyDocument *keep_doc)
+{
+	GeanyDocument *current_doc = document_get_current();
+	gint64 now = g_get_monotonic_time();
+	const gchar *reason;
+	GList *link, *prev;
+
+	for (link = server->resident_docs->tail;
+		link && (reason = get_exceeded_residency_limit(server));
+		link = prev)
+	{
+		ResidentDoc *rd = link->data;
+
+		prev = link->prev;
+		if (rd->doc != keep_doc && rd->doc != current_doc)
+			evict_doc(server, rd, reason, now);
+	}
+}
+
+
+/* Closes the least recently used half of the documents open on the server,
+ * except the current document */
+void lsp_sync_close_lru_documents(LspServer *server, const gchar *reason)
+{
+	GeanyDocument *current_doc = document_get_current();
+	gint64 now = g_get_monotonic_time();
+	guint keep = server->resident_docs->length / 2;
+	GList *link, *prev;
+
+	for (link = server->resident_docs->tail;
+		link && server->resident_docs->length > keep;
+		link = prev)
+	{
+		ResidentDoc *rd = link->data;
+
+		prev = link->prev;
+		if (rd->doc != current_doc)
+			evict_doc(server, rd, reason, now);
+	}
+}
+
+
+static gboolean close_idle_docs(gpointer user_data)
+{
+	LspServer *server = user_data;
+	GeanyDocument *current_doc = document_get_current();
+	gint64 now = g_get_monotonic_time();
+	gint64 timeout = (gint64)server->config.open_docs_idle_timeout * 60 * G_USEC_PER_SEC;
+	GList *link, *prev;
+
+	for (link = server->resident_docs->tail; link; link = prev)
+	{
+		ResidentDoc *rd = link->data;
+
+		prev = link->prev;
+		if (now - rd->last_used < timeout)
+			break;  // the rest was used more recently
+		if (rd->doc != current_doc)
+			evict_doc(server, rd, "idle", now);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+static void touch_resident_doc(LspServer *server, GeanyDocument *doc)
+{
+	GList *link = g_hash_table_lookup(server->open_docs, doc);
+	ResidentDoc *rd;
+
+	if (!link)
+		return;
+
+	rd = link->data;
+	rd->last_used = g_get_monotonic_time();
+	server->resident_docs_size -= rd->size;
+	rd->size = sci_get_length(doc->editor->sci);
+	server->resident_docs_size += rd->size;
+
+	if (link != server->resident_docs->head)
+	{
+		g_queue_unlink(server->resident_docs, link);
+		g_queue_push_head_link(server->resident_docs, link);
+	}
+}
+
+
+static void add_resident_doc(LspServer *server, GeanyDocument *doc)
+{
+	ResidentDoc *rd = g_new0(ResidentDoc, 1);
+
+	rd->doc = doc;
+	rd->size = sci_get_length(doc->editor->sci);
+	rd->last_used = g_get_monotonic_time();
+
+	g_queue_push_head(server->resident_docs, rd);
+	server->resident_docs_size += rd->size;
+	g_hash_table_insert(server->open_docs, doc, server->resident_docs->head);
+
+	enforce_residency_limits(server, doc);
+
+	if (server->config.open_docs_idle_timeout > 0 && server->resident_docs_source == 0)
+	{
+		server->resident_docs_source = plugin_timeout_add(geany_plugin,
+			RESIDENCY_CHECK_INTERVAL, close_idle_docs, server);
+	}
+}
+
+
+static void remove_resident_doc(LspServer *server, GeanyDocument *doc)
+{
+	GList *link = g_hash_table_lookup(server->open_docs, doc);
+
+	if (!link)
+		return;
+
+	server->resident_docs_size -= ((ResidentDoc *)link->data)->size;
+	g_free(link->data);
+	g_queue_delete_link(server->resident_docs, link);
+	g_hash_table_remove(server->open_docs, doc);
+}
+
+
 void lsp_sync_text_document_did_open(LspServer *server, GeanyDocument *doc)
 {
 	GVariant *node;
 	gchar *doc_uri;
 	gchar *lang_id = NULL;
-	gchar *doc_text;
 	guint doc_version;
 
-	if (!server || lsp_sync_is_document_open(server, doc))
+	if (!server)
 		return;
 
-	if (g_slist_length(server->mru_docs) >= MRU_SIZE)
+	if (lsp_sync_is_document_open(server, doc))
 	{
-		lsp_sync_text_document_did_close(server, server->mru_docs->data);
+		touch_resident_doc(server, doc);
+		return;
 	}
 
-	lsp_workspace_folders_doc_open(doc);
+	if (server->is_companion)
+	{
+		// the text sent below already contains the changes pending for
+		// the owner, they must not be applied again
+		lsp_sync_flush_pending_changes(server->companion_owner, doc);
+	}
+	else
+	{
+		lsp_workspace_folders_doc_open(doc);
+		lsp_utils_set_position_encoding(doc->editor->sci, server->position_encoding);
+	}
 
-	g_hash_table_add(server->open_docs, doc);
-	server->mru_docs = g_slist_append(server->mru_docs, doc);
+	add_resident_doc(server, doc);
 
 	lsp_server_get_ft(doc, &lang_id);
 	doc_uri = lsp_utils_get_doc_uri(doc);
-	doc_text = sci_get_contents(doc->editor->sci, -1);
-	doc_version = get_next_doc_version_num(doc);
+	doc_version = get_next_doc_version_num(server, doc);
 
 	node = JSONRPC_MESSAGE_NEW (
 		"textDocument", "{",
 			"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
 			"languageId", JSONRPC_MESSAGE_PUT_STRING(lang_id),
 			"version", JSONRPC_MESSAGE_PUT_INT32(doc_version),
-			"text", JSONRPC_MESSAGE_PUT_STRING(doc_text),
+			"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER),
 		"}"
 	);
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	lsp_rpc_notify(server, "textDocument/didOpen", node, NULL, NULL);
+	lsp_rpc_notify_with_text(server, "textDocument/didOpen", node,
+		get_doc_text(doc), sci_get_length(doc->editor->sci));
+	lsp_server_record_startup(server, LSP_STARTUP_FIRST_DID_OPEN);
 
 	g_free(doc_uri);
 	g_free(lang_id);
-	g_free(doc_text);
 
 	g_variant_unref(node);
+
+	lsp_sync_text_document_did_open(lsp_server_get_companion(server), doc);
+}
+
+
+/* Opens the documents open on the owner of a just initialized companion */
+void lsp_sync_open_companion_documents(LspServer *companion)
+{
+	GList *docs = g_hash_table_get_keys(companion->companion_owner->open_docs);
+	GList *item;
+
+	foreach_list(item, docs)
+	{
+		lsp_sync_text_document_did_open(companion, item->data);
+	}
+	g_list_free(docs);
 }
 
 
@@ -148,6 +451,9 @@ void lsp_sync_text_document_did_close(LspServer *server, GeanyDocument *doc)
 	GVariant *node;
 	gchar *doc_uri;
 
+	if (doc && server && lsp_sync_is_document_open(server, doc))
+		lsp_sync_flush_pending_changes(server, doc);
+
 	if (doc && server)
 		destroy_doc_data(server, doc);
 
@@ -164,37 +470,47 @@ void lsp_sync_text_document_did_close(LspServer *server, GeanyDocument *doc)
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	g_hash_table_remove(server->open_docs, doc);
+	remove_resident_doc(server, doc);
 
 	lsp_rpc_notify(server, "textDocument/didClose", node, NULL, NULL);
 
-	lsp_workspace_folders_doc_closed(doc);
+	if (!server->is_companion)
+		lsp_workspace_folders_doc_closed(doc);
 
 	g_free(doc_uri);
 	g_variant_unref(node);
+
+	lsp_sync_text_document_did_close(lsp_server_get_companion(server), doc);
 }
 
 
 void lsp_sync_text_document_did_save(LspServer *server, GeanyDocument *doc)
 {
+	LspServer *companion = lsp_server_get_companion(server);
 	gchar *doc_uri;
 	GVariant *node;
 
+	if (companion && lsp_sync_is_document_open(companion, doc))
+		lsp_sync_text_document_did_save(companion, doc);
+
 	if (!server->send_did_save)
 		return;
 
+	lsp_sync_flush_pending_changes(server, doc);
+
 	doc_uri = lsp_utils_get_doc_uri(doc);
 
 	if (server->include_text_on_save)
 	{
-		gchar *doc_text = sci_get_contents(doc->editor->sci, -1);
 		node = JSONRPC_MESSAGE_NEW (
 			"textDocument", "{",
 				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
 			"}",
-			"text", JSONRPC_MESSAGE_PUT_STRING(doc_text)
+			"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER)
 		);
-		g_free(doc_text);
+
+		lsp_rpc_notify_with_text(server, "textDocument/didSave", node,
+			get_doc_text(doc), sci_get_length(doc->editor->sci));
 	}
 	else
 	{
@@ -203,69 +519,332 @@ void lsp_sync_text_document_did_save(LspServer *server, GeanyDocument *doc)
 				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
 			"}"
 		);
+
+		lsp_rpc_notify(server, "textDocument/didSave", node, NULL, NULL);
 	}
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
-	lsp_rpc_notify(server, "textDocument/didSave", node, NULL, NULL);
-
 	g_free(doc_uri);
 	g_variant_unref(node);
 }
 
 
-void lsp_sync_text_document_did_change(LspServer *server, GeanyDocument *doc,
-	LspPosition pos_start, LspPosition pos_end, gchar *text)
+static void send_pending_changes(LspServer *server, GeanyDocument *doc, GPtrArray *changes,
+	gboolean with_text)
 {
-	GVariant *node;
 	gchar *doc_uri = lsp_utils_get_doc_uri(doc);
-	guint doc_version = get_next_doc_version_num(doc);
+	guint doc_version = get_next_doc_version_num(server, doc);
+	const gchar *doc_keys[] = {"uri", "version"};
+	GVariant *doc_values[] = {g_variant_new_string(doc_uri), g_variant_new_int32(doc_version)};
+	const gchar *keys[] = {"textDocument", "contentChanges"};
+	GVariant *values[2];
+	GVariant *node;
 
-	if (server->use_incremental_sync)
+	// sent on every keystroke - built directly without JSONRPC_MESSAGE_NEW()
+	values[0] = lsp_utils_new_vardict(2, doc_keys, doc_values);
+	values[1] = g_variant_new_array(G_VARIANT_TYPE_VARDICT,
+		(GVariant **)changes->pdata, changes->len);
+	node = g_variant_ref_sink(lsp_utils_new_vardict(2, keys, values));
+
+	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
+
+	if (with_text)
 	{
-		gint range = lsp_utils_lsp_pos_to_scintilla(doc->editor->sci, pos_end) - 
-			lsp_utils_lsp_pos_to_scintilla(doc->editor->sci, pos_start);
+		lsp_rpc_notify_with_text(server, "textDocument/didChange", node,
+			get_doc_text(doc), sci_get_length(doc->editor->sci));
+	}
+	else
+		lsp_rpc_notify(server, "textDocument/didChange", node, NULL, NULL);
 
-		node = JSONRPC_MESSAGE_NEW (
-			"textDocument", "{",
-				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-				"version", JSONRPC_MESSAGE_PUT_INT32(doc_version),
-			"}",
-			"contentChanges", "[", "{",
-				"range", "{",
-					"start", "{",
-						"line", JSONRPC_MESSAGE_PUT_INT32(pos_start.line),
-						"character", JSONRPC_MESSAGE_PUT_INT32(pos_start.character),
-					"}",
-					"end", "{",
-						"line", JSONRPC_MESSAGE_PUT_INT32(pos_end.line),
-						"character", JSONRPC_MESSAGE_PUT_INT32(pos_end.character),
-					"}",
-				"}",
-				// not required but the lemminx server crashes without it
-				"rangeLength", JSONRPC_MESSAGE_PUT_INT32(range),
-				"text", JSONRPC_MESSAGE_PUT_STRING(text),
-			"}", "]"
-		);
+	if (!server->is_companion)
+		lsp_timing_record(LSP_TIMING_DID_CHANGE, sci_get_line_count(doc->editor->sci),
+			server->pending_changes_time);
+	server->pending_changes_time = 0;
+
+	g_free(doc_uri);
+	g_variant_unref(node);
+}
+
+
+// set by lsp_sync_text_document_did_change_full(), always the first change
+static gboolean has_full_change(GPtrArray *changes)
+{
+	GVariant *range;
+
+	if (changes->len == 0)
+		return FALSE;
+
+	range = g_variant_lookup_value(changes->pdata[0], "range", NULL);
+	if (range)
+		g_variant_unref(range);
+	return range == NULL;
+}
+
+
+static void send_doc_pending_changes(LspServer *server, GeanyDocument *doc)
+{
+	GPtrArray *changes = g_hash_table_lookup(server->pending_changes, doc);
+
+	if (!changes)
+		return;
+
+	// steal before sending so re-entrant flushes from the RPC layer see
+	// nothing pending for this document
+	g_hash_table_steal(server->pending_changes, doc);
+
+	if (lsp_sync_is_document_open(server, doc))
+	{
+		touch_resident_doc(server, doc);
+
+		if (!server->use_incremental_sync)
+		{
+			g_ptr_array_add(changes, JSONRPC_MESSAGE_NEW (
+				"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER)
+			));
+			send_pending_changes(server, doc, changes, TRUE);
+		}
+		else if (changes->len > 0)
+			send_pending_changes(server, doc, changes, has_full_change(changes));
 	}
+
+	free_pending_changes(changes);
+}
+
+
+static void flush_doc_pending_changes(LspServer *server, GeanyDocument *doc)
+{
+	LspServer *companion = lsp_server_get_companion(server);
+
+	send_doc_pending_changes(server, doc);
+	// right after the owner's so both get the same version
+	if (companion)
+		send_doc_pending_changes(companion, doc);
+}
+
+
+void lsp_sync_flush_pending_changes(LspServer *server, GeanyDocument *doc)
+{
+	// changes of companions are only sent together with those of the owner
+	if (server && server->is_companion)
+		server = server->companion_owner;
+
+	if (!server || !server->pending_changes)
+		return;
+
+	if (doc)
+		flush_doc_pending_changes(server, doc);
 	else
 	{
-		node = JSONRPC_MESSAGE_NEW (
-			"textDocument", "{",
-				"uri", JSONRPC_MESSAGE_PUT_STRING(doc_uri),
-				"version", JSONRPC_MESSAGE_PUT_INT32(doc_version),
-			"}",
-			"contentChanges", "[", "{",
-				"text", JSONRPC_MESSAGE_PUT_STRING(text),
-			"}", "]"
-		);
+		GList *docs = g_hash_table_get_keys(server->pending_changes);
+		GList *item;
+
+		foreach_list(item, docs)
+		{
+			flush_doc_pending_changes(server, item->data);
+		}
+		g_list_free(docs);
 	}
 
-	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
+	if (server->pending_changes_source != 0 && g_hash_table_size(server->pending_changes) == 0)
+	{
+		g_source_remove(server->pending_changes_source);
+		server->pending_changes_source = 0;
+	}
+}
 
-	lsp_rpc_notify(server, "textDocument/didChange", node, NULL, NULL);
 
-	g_free(doc_uri);
+static gboolean flush_pending_changes_idle(gpointer user_data)
+{
+	LspServer *server = user_data;
 
-	g_variant_unref(node);
+	server->pending_changes_source = 0;
+
+	/* While the server doesn't read what was sent already, keep collecting
+	 * changes - full sync ones collapse into the latest text, incremental ones
+	 * are sent as a single notification. Flushes before requests still send
+	 * everything so requests never see outdated documents. */
+	if (lsp_rpc_is_output_congested(server))
+	{
+		server->pending_changes_source = plugin_timeout_add(geany_plugin,
+			CONGESTION_RETRY_INTERVAL, flush_pending_changes_idle, server);
+		return G_SOURCE_REMOVE;
+	}
+
+	lsp_sync_flush_pending_changes(server, NULL);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static GPtrArray *get_pending_changes(LspServer *server, GeanyDocument *doc)
+{
+	GPtrArray *changes = g_hash_table_lookup(server->pending_changes, doc);
+
+	if (!changes)
+	{
+		changes = g_ptr_array_new_full(1, (GDestroyNotify)g_variant_unref);
+		g_hash_table_insert(server->pending_changes, doc, changes);
+	}
+
+	return changes;
+}
+
+
+/* Changes for the companion are collected next to those of its owner and
+ * sent when the owner's get flushed; change is NULL when the full text has to
+ * be sent */
+static void add_companion_change(LspServer *server, GeanyDocument *doc, GVariant *change)
+{
+	LspServer *companion = lsp_server_get_companion(server);
+	GPtrArray *changes;
+
+	if (!companion || !lsp_sync_is_document_open(companion, doc))
+		return;
+
+	changes = get_pending_changes(companion, doc);
+
+	// the full text is added at flush time
+	if (!companion->use_incremental_sync)
+		g_ptr_array_set_size(changes, 0);
+	// positions are computed in the owner's encoding
+	else if (!change || companion->position_encoding != server->position_encoding)
+	{
+		g_ptr_array_set_size(changes, 0);
+		g_ptr_array_add(changes, JSONRPC_MESSAGE_NEW (
+			"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER)
+		));
+	}
+	else if (!has_full_change(changes))
+		g_ptr_array_add(changes, g_variant_ref(change));
+}
+
+
+static void mark_changed(LspServer *server, GeanyDocument *doc)
+{
+	GPtrArray *changes = get_pending_changes(server, doc);
+
+	if (server->pending_changes_time == 0)
+		server->pending_changes_time = g_get_monotonic_time();
+
+	// the full text is added at flush time
+	g_ptr_array_set_size(changes, 0);
+
+	if (server->pending_changes_source != 0)
+		g_source_remove(server->pending_changes_source);
+	server->pending_changes_source = plugin_timeout_add(geany_plugin,
+		lsp_server_is_large_file(server, doc) ? LARGE_FILE_SYNC_DELAY : FULL_SYNC_DELAY,
+		flush_pending_changes_idle, server);
+}
+
+
+/* Changes are not sent immediately but accumulated per document and sent as
+ * a single didChange notification with multiple contentChanges on idle, before
+ * any request to the server, or on save/close. This way operations like
+ * "replace all" or multi-cursor edits don't flood the server. */
+void lsp_sync_text_document_did_change(LspServer *server, GeanyDocument *doc,
+	LspPosition pos_start, LspPosition pos_end, gint range_length, const gchar *text)
+{
+	GPtrArray *changes;
+	GVariant *change;
+
+	if (server->pending_changes_time == 0)
+		server->pending_changes_time = g_get_monotonic_time();
+
+	if (lsp_server_get_companion(server))
+	{
+		change = lsp_utils_new_content_change(pos_start, pos_end, range_length, text);
+		add_companion_change(server, doc, change);
+		g_variant_unref(change);
+	}
+
+	if (!server->use_incremental_sync)
+	{
+		mark_changed(server, doc);
+		return;
+	}
+
+	changes = get_pending_changes(server, doc);
+
+	// the full text retrieved at flush time contains this change already
+	if (has_full_change(changes))
+		return;
+
+	change = lsp_utils_new_content_change(pos_start, pos_end, range_length, text);
+
+	g_ptr_array_add(changes, change);
+
+	if (server->pending_changes_source == 0)
+		server->pending_changes_source = plugin_timeout_add(geany_plugin, 0, flush_pending_changes_idle, server);
+}
+
+
+/* Like lsp_sync_text_document_did_change_full() but only sent by flushes
+ * before requests - the caller sends it later or drops it using
+ * lsp_sync_discard_pending_changes() */
+void lsp_sync_text_document_queue_full_change(LspServer *server, GeanyDocument *doc)
+{
+	GPtrArray *changes;
+
+	if (server->pending_changes_time == 0)
+		server->pending_changes_time = g_get_monotonic_time();
+
+	add_companion_change(server, doc, NULL);
+
+	changes = get_pending_changes(server, doc);
+	// the full text is added at flush time without incremental sync
+	g_ptr_array_set_size(changes, 0);
+	if (server->use_incremental_sync)
+	{
+		g_ptr_array_add(changes, JSONRPC_MESSAGE_NEW (
+			"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER)
+		));
+	}
+}
+
+
+/* Drops unsent changes of doc, returns whether there were any */
+gboolean lsp_sync_discard_pending_changes(LspServer *server, GeanyDocument *doc)
+{
+	LspServer *companion = lsp_server_get_companion(server);
+
+	if (companion && companion->pending_changes)
+		g_hash_table_remove(companion->pending_changes, doc);
+
+	return server->pending_changes && g_hash_table_remove(server->pending_changes, doc);
+}
+
+
+/* For servers without incremental sync only mark the document as modified -
+ * its full contents is retrieved just once when the pending changes get
+ * flushed, after the user stops typing for FULL_SYNC_DELAY ms */
+void lsp_sync_text_document_mark_changed(LspServer *server, GeanyDocument *doc)
+{
+	add_companion_change(server, doc, NULL);
+	mark_changed(server, doc);
+}
+
+
+/* Replaces pending incremental changes by a single change with the full text
+ * retrieved at flush time, e.g. after the whole document text was replaced */
+void lsp_sync_text_document_did_change_full(LspServer *server, GeanyDocument *doc)
+{
+	GPtrArray *changes;
+
+	add_companion_change(server, doc, NULL);
+
+	if (!server->use_incremental_sync)
+	{
+		mark_changed(server, doc);
+		return;
+	}
+
+	changes = get_pending_changes(server, doc);
+	g_ptr_array_set_size(changes, 0);
+	g_ptr_array_add(changes, JSONRPC_MESSAGE_NEW (
+		"text", JSONRPC_MESSAGE_PUT_STRING(LSP_RPC_TEXT_PLACEHOLDER)
+	));
+
+	if (server->pending_changes_source == 0)
+		server->pending_changes_source = plugin_timeout_add(geany_plugin, 0, flush_pending_changes_idle, server);
 }
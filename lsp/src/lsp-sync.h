@@ -27,11 +27,23 @@ void lsp_sync_init(LspServer *server);
 void lsp_sync_free(LspServer *server);
 
 void lsp_sync_text_document_did_open(LspServer *server, GeanyDocument *doc);
+void lsp_sync_open_companion_documents(LspServer *companion);
 void lsp_sync_text_document_did_close(LspServer *server, GeanyDocument *doc);
 void lsp_sync_text_document_did_save(LspServer *server, GeanyDocument *doc);
 void lsp_sync_text_document_did_change(LspServer *server, GeanyDocument *doc,
-	LspPosition pos_start, LspPosition pos_end, gchar *text);
+	LspPosition pos_start, LspPosition pos_end, gint range_length, const gchar *text);
+void lsp_sync_text_document_mark_changed(LspServer *server, GeanyDocument *doc);
+void lsp_sync_text_document_did_change_full(LspServer *server, GeanyDocument *doc);
+void lsp_sync_text_document_queue_full_change(LspServer *server, GeanyDocument *doc);
+gboolean lsp_sync_discard_pending_changes(LspServer *server, GeanyDocument *doc);
+void lsp_sync_flush_pending_changes(LspServer *server, GeanyDocument *doc);
 
 gboolean lsp_sync_is_document_open(LspServer *server, GeanyDocument *doc);
+void lsp_sync_close_lru_documents(LspServer *server, const gchar *reason);
+
+guint lsp_sync_get_doc_version(LspServer *server, GeanyDocument *doc);
+guint lsp_sync_peek_doc_version(LspServer *server, GeanyDocument *doc);
+gboolean lsp_sync_is_response_stale(LspServer *server, GeanyDocument *doc, guint version,
+	const gchar *method);
 
 #endif  /* LSP_SYNC_H */
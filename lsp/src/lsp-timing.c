@@ -0,0 +1,363 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Durations of the plugin-side operations most visible while typing, split
+ * by the size of the document so slowdowns specific to large files can be
+ * seen. Shown together with the per-method server statistics.
+ *
+ * Main loop callbacks running longer than stall_threshold are logged to the
+ * status window and counted per handler to find the cause of UI hiccups.
+ * They are also added to the trace file when tracing is active. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-timing.h"
+#include "lsp-trace.h"
+
+#include <geanyplugin.h>
+#include <jsonrpc-glib.h>
+
+
+typedef struct
+{
+	const gchar *name;
+	LspTimingHistogram sizes[4];  // < 1k, < 10k, < 100k and more lines
+} TimingStats;
+
+
+static TimingStats timings[LSP_TIMING_NUM] = {
+	{"keystroke to didChange"},
+	{"completion popup"},
+	{"semantic tokens apply"},
+	{"symbol tree refresh"}
+};
+
+typedef struct
+{
+	guint64 count;
+	gint64 max_time;
+	gsize max_payload;
+} StallStats;
+
+
+typedef struct
+{
+	const gchar *name;
+	guint64 hits;
+	guint64 misses;
+} CacheStats;
+
+
+static CacheStats caches[LSP_TIMING_CACHE_NUM] = {
+	{"completion"},
+	{"hover"},
+	{"highlight"},
+	{"goto"},
+	{"completion prefetch"}
+};
+
+
+static const gchar *size_names[] = {"< 1k lines", "< 10k lines", "< 100k lines", ">= 100k lines"};
+
+static gint64 stall_threshold;  // in microseconds, 0 when disabled
+static GHashTable *stalls;  // handler (and method) -> StallStats
+
+
+void lsp_timing_histogram_add(LspTimingHistogram *hist, gint64 us)
+{
+	guint bucket;
+
+	if (us < 4)
+		bucket = MAX(us, 0);
+	else
+	{
+		guint octave = g_bit_storage(us) - 1;
+		bucket = MIN(octave * 4 + ((us >> (octave - 2)) & 3), LSP_TIMING_BUCKETS - 1);
+	}
+
+	hist->buckets[bucket]++;
+	hist->count++;
+}
+
+
+static gint64 bucket_upper_bound(guint bucket)
+{
+	if (bucket < 8)
+		return bucket + 1;
+
+	return (gint64)(5 + bucket % 4) << (bucket / 4 - 2);
+}
+
+
+/* in milliseconds, upper bound of the histogram bucket (~20% precision) */
+gdouble lsp_timing_histogram_percentile(LspTimingHistogram *hist, gdouble percentile)
+{
+	guint64 rank = (guint64)(percentile * hist->count + 0.5);
+	guint64 sum = 0;
+	guint i;
+
+	for (i = 0; i < LSP_TIMING_BUCKETS; i++)
+	{
+		sum += hist->buckets[i];
+		if (sum >= MAX(rank, 1))
+			return bucket_upper_bound(i) / 1000.0;
+	}
+
+	return 0;
+}
+
+
+/* start_time is the g_get_monotonic_time() when the operation started */
+void lsp_timing_record(LspTiming timing, gint lines, gint64 start_time)
+{
+	guint size = lines < 1000 ? 0 : lines < 10000 ? 1 : lines < 100000 ? 2 : 3;
+
+	if (timing < LSP_TIMING_NUM && start_time > 0)
+		lsp_timing_histogram_add(&timings[timing].sizes[size], g_get_monotonic_time() - start_time);
+}
+
+
+void lsp_timing_cache_lookup(LspTimingCache cache, gboolean hit)
+{
+	if (cache >= LSP_TIMING_CACHE_NUM)
+		return;
+
+	if (hit)
+		caches[cache].hits++;
+	else
+		caches[cache].misses++;
+}
+
+
+void lsp_timing_set_stall_threshold(gint ms)
+{
+	stall_threshold = MAX(ms, 0) * (gint64)1000;
+}
+
+
+/* start time for lsp_timing_stall_end(), 0 when neither the detector nor
+ * tracing is active */
+gint64 lsp_timing_stall_start(void)
+{
+	return stall_threshold > 0 || lsp_trace_is_active() ? g_get_monotonic_time() : 0;
+}
+
+
+/* method is the LSP method of RPC handlers, NULL for others */
+void lsp_timing_stall_end(const gchar *handler, const gchar *method, gsize payload_size,
+	gint64 start_time)
+{
+	gint64 duration;
+	StallStats *stats;
+	gchar *key;
+
+	if (start_time == 0)
+		return;
+
+	lsp_trace_span(handler, start_time, NULL, method, NULL);
+
+	if (stall_threshold == 0)
+		return;
+
+	duration = g_get_monotonic_time() - start_time;
+	if (duration < stall_threshold)
+		return;
+
+	key = method ? g_strconcat(handler, " ", method, NULL) : g_strdup(handler);
+	msgwin_status_add(_("LSP: %s blocked the user interface for %.1f ms (payload %.1f KB)"),
+		key, duration / 1000.0, payload_size / 1024.0);
+
+	if (!stalls)
+		stalls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	stats = g_hash_table_lookup(stalls, key);
+	if (!stats)
+	{
+		stats = g_new0(StallStats, 1);
+		g_hash_table_insert(stalls, key, stats);
+	}
+	else
+		g_free(key);
+
+	stats->count++;
+	stats->max_time = MAX(stats->max_time, duration);
+	stats->max_payload = MAX(stats->max_payload, payload_size);
+}
+
+
+static void append_conversion(GString *str, const gchar *name, guint64 n_messages, guint64 n_bytes,
+	guint64 n_variants, gint64 usec)
+{
+	if (n_messages == 0)
+		return;
+
+	g_string_append_printf(str, "%-45s %8" G_GUINT64_FORMAT " %10.1f %10.1f %10.1f\n", name,
+		n_messages, n_bytes / (1024.0 * 1024.0),
+		usec > 0 ? n_bytes / (1024.0 * 1024.0) / (usec / (gdouble)G_USEC_PER_SEC) : 0,
+		(gdouble)n_variants / n_messages);
+}
+
+
+void lsp_timing_append_statistics(GString *str)
+{
+	guint64 n_messages, n_bytes, n_variants;
+	gint64 usec;
+	guint i, j;
+
+	g_string_append_printf(str, "%-45s %8s %9s %9s %9s\n",
+		"plugin operation", "count", "p50 ms", "p90 ms", "p99 ms");
+
+	for (i = 0; i < LSP_TIMING_NUM; i++)
+	{
+		for (j = 0; j < G_N_ELEMENTS(size_names); j++)
+		{
+			LspTimingHistogram *hist = &timings[i].sizes[j];
+			gchar *name;
+
+			if (hist->count == 0)
+				continue;
+
+			name = g_strdup_printf("%s (%s)", timings[i].name, size_names[j]);
+			g_string_append_printf(str, "%-45s %8" G_GUINT64_FORMAT " %9.1f %9.1f %9.1f\n",
+				name, hist->count, lsp_timing_histogram_percentile(hist, 0.5),
+				lsp_timing_histogram_percentile(hist, 0.9), lsp_timing_histogram_percentile(hist, 0.99));
+			g_free(name);
+		}
+	}
+
+	g_string_append_printf(str, "\n%-45s %8s %8s %9s\n", "plugin cache", "hits", "misses", "hit rate");
+	for (i = 0; i < LSP_TIMING_CACHE_NUM; i++)
+	{
+		guint64 lookups = caches[i].hits + caches[i].misses;
+
+		if (lookups == 0)
+			continue;
+
+		g_string_append_printf(str, "%-45s %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %8.1f%%\n",
+			caches[i].name, caches[i].hits, caches[i].misses, 100.0 * caches[i].hits / lookups);
+	}
+
+	// all the JSON <-> GVariant conversions of the jsonrpc streams
+	g_string_append_printf(str, "\n%-45s %8s %10s %10s %10s\n",
+		"JSON conversion", "messages", "MB", "MB/s", "values/msg");
+	jsonrpc_input_stream_get_decode_statistics(&n_messages, &n_bytes, &n_variants, &usec);
+	append_conversion(str, "received JSON to GVariant", n_messages, n_bytes, n_variants, usec);
+	jsonrpc_output_stream_get_encode_statistics(&n_messages, &n_bytes, &n_variants, &usec);
+	append_conversion(str, "GVariant to sent JSON", n_messages, n_bytes, n_variants, usec);
+
+	if (stalls)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+
+		g_string_append_printf(str, "\n%-45s %8s %10s %10s\n",
+			"stalls above threshold", "count", "max ms", "max KB");
+		g_hash_table_iter_init(&iter, stalls);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			StallStats *stats = value;
+
+			g_string_append_printf(str, "%-45s %8" G_GUINT64_FORMAT " %10.1f %10.1f\n",
+				(const gchar *)key, stats->count, stats->max_time / 1000.0,
+				stats->max_payload / 1024.0);
+		}
+	}
+}
+
+
+static void add_member_int(JsonBuilder *builder, const gchar *name, gint64 val)
+{
+	json_builder_set_member_name(builder, name);
+	json_builder_add_int_value(builder, val);
+}
+
+
+static void add_member_double(JsonBuilder *builder, const gchar *name, gdouble val)
+{
+	json_builder_set_member_name(builder, name);
+	json_builder_add_double_value(builder, val);
+}
+
+
+/* Adds the plugin operation timings, cache hits and stalls as members of the
+ * object being built, times in ms */
+void lsp_timing_append_metrics(JsonBuilder *builder)
+{
+	guint i, j;
+
+	json_builder_set_member_name(builder, "operations");
+	json_builder_begin_object(builder);
+	for (i = 0; i < LSP_TIMING_NUM; i++)
+	{
+		for (j = 0; j < G_N_ELEMENTS(size_names); j++)
+		{
+			LspTimingHistogram *hist = &timings[i].sizes[j];
+			gchar *name;
+
+			if (hist->count == 0)
+				continue;
+
+			name = g_strdup_printf("%s (%s)", timings[i].name, size_names[j]);
+			json_builder_set_member_name(builder, name);
+			json_builder_begin_object(builder);
+			add_member_int(builder, "count", hist->count);
+			add_member_double(builder, "p50", lsp_timing_histogram_percentile(hist, 0.5));
+			add_member_double(builder, "p90", lsp_timing_histogram_percentile(hist, 0.9));
+			add_member_double(builder, "p99", lsp_timing_histogram_percentile(hist, 0.99));
+			json_builder_end_object(builder);
+			g_free(name);
+		}
+	}
+	json_builder_end_object(builder);
+
+	json_builder_set_member_name(builder, "caches");
+	json_builder_begin_object(builder);
+	for (i = 0; i < LSP_TIMING_CACHE_NUM; i++)
+	{
+		json_builder_set_member_name(builder, caches[i].name);
+		json_builder_begin_object(builder);
+		add_member_int(builder, "hits", caches[i].hits);
+		add_member_int(builder, "misses", caches[i].misses);
+		json_builder_end_object(builder);
+	}
+	json_builder_end_object(builder);
+
+	json_builder_set_member_name(builder, "stalls");
+	json_builder_begin_object(builder);
+	if (stalls)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+
+		g_hash_table_iter_init(&iter, stalls);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			StallStats *stats = value;
+
+			json_builder_set_member_name(builder, key);
+			json_builder_begin_object(builder);
+			add_member_int(builder, "count", stats->count);
+			add_member_double(builder, "max", stats->max_time / 1000.0);
+			add_member_int(builder, "max_payload_bytes", stats->max_payload);
+			json_builder_end_object(builder);
+		}
+	}
+	json_builder_end_object(builder);
+}
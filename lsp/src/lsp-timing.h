@@ -0,0 +1,69 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_TIMING_H
+#define LSP_TIMING_H 1
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+/* latency histogram with 4 buckets per power of 2 microseconds, the last
+ * bucket covers everything above 2 hours */
+#define LSP_TIMING_BUCKETS 136
+
+typedef struct
+{
+	guint32 buckets[LSP_TIMING_BUCKETS];
+	guint64 count;
+} LspTimingHistogram;
+
+
+typedef enum
+{
+	LSP_TIMING_DID_CHANGE,  // from the first of the pending edits to sending didChange
+	LSP_TIMING_COMPLETION_POPUP,  // from the completion request to showing its popup
+	LSP_TIMING_SEMTOKENS_APPLY,  // applying received semantic tokens to the editor
+	LSP_TIMING_SYMBOL_TREE_REFRESH,  // rebuilding the symbol tree of the sidebar
+	LSP_TIMING_NUM
+} LspTiming;
+
+
+typedef enum
+{
+	LSP_TIMING_CACHE_COMPLETION,  // completion list filtered locally for the typed prefix
+	LSP_TIMING_CACHE_HOVER,  // hover of an identifier received before
+	LSP_TIMING_CACHE_HIGHLIGHT,  // occurrences of an identifier received before
+	LSP_TIMING_CACHE_GOTO,  // definition or declaration prefetched before the jump
+	LSP_TIMING_CACHE_COMPLETION_PREFETCH,  // completion prefetched when the caret stopped after an identifier
+	LSP_TIMING_CACHE_NUM
+} LspTimingCache;
+
+void lsp_timing_histogram_add(LspTimingHistogram *hist, gint64 us);
+gdouble lsp_timing_histogram_percentile(LspTimingHistogram *hist, gdouble percentile);
+
+void lsp_timing_record(LspTiming timing, gint lines, gint64 start_time);
+void lsp_timing_cache_lookup(LspTimingCache cache, gboolean hit);
+
+void lsp_timing_set_stall_threshold(gint ms);
+gint64 lsp_timing_stall_start(void);
+void lsp_timing_stall_end(const gchar *handler, const gchar *method, gsize payload_size,
+	gint64 start_time);
+void lsp_timing_append_statistics(GString *str);
+void lsp_timing_append_metrics(JsonBuilder *builder);
+
+#endif  /* LSP_TIMING_H */
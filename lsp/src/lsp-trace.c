@@ -0,0 +1,190 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Timeline of the plugin in the Chrome trace event format which can be
+ * loaded into Perfetto or chrome://tracing. Requests are async events from
+ * being queued to being freed with instant events for the steps in between,
+ * callbacks running on the main loop are complete events of a single track.
+ * The file is a JSON array closed when tracing stops, truncated files of
+ * crashed sessions can still be loaded. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-trace.h"
+
+#include <geanyplugin.h>
+#include <string.h>
+
+
+// all callbacks run on the main loop
+#define MAIN_LOOP_TID 1
+
+
+static GOutputStream *trace_stream;
+static gchar *trace_path;
+static gint64 trace_start_time;
+
+
+static void append_json_string(GString *str, const gchar *val)
+{
+	const gchar *p;
+
+	g_string_append_c(str, '"');
+	for (p = val ? val : ""; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+		{
+			g_string_append_c(str, '\\');
+			g_string_append_c(str, *p);
+		}
+		else if ((guchar)*p < 0x20)
+			g_string_append_printf(str, "\\u%04x", (guchar)*p);
+		else
+			g_string_append_c(str, *p);
+	}
+	g_string_append_c(str, '"');
+}
+
+
+static void append_arg(GString *str, const gchar *key, const gchar *val, gboolean *first)
+{
+	if (!val)
+		return;
+
+	if (!*first)
+		g_string_append_c(str, ',');
+	*first = FALSE;
+	append_json_string(str, key);
+	g_string_append_c(str, ':');
+	append_json_string(str, val);
+}
+
+
+static void write_event(GString *event, const gchar *server, const gchar *method, const gchar *uri)
+{
+	gboolean first = TRUE;
+
+	g_string_append(event, ",\"args\":{");
+	append_arg(event, "server", server, &first);
+	append_arg(event, "method", method, &first);
+	append_arg(event, "document", uri, &first);
+	g_string_append(event, "}}");
+
+	// the thread name metadata is always the first element
+	g_output_stream_write_all(trace_stream, ",\n", 2, NULL, NULL, NULL);
+	g_output_stream_write_all(trace_stream, event->str, event->len, NULL, NULL, NULL);
+}
+
+
+/* restarts tracing when path differs from the current trace file, empty or
+ * NULL path stops it */
+void lsp_trace_start(const gchar *path)
+{
+	GFileOutputStream *file_stream;
+	GFile *fp;
+
+	if (g_strcmp0(EMPTY(path) ? NULL : path, trace_path) == 0)
+		return;
+
+	lsp_trace_stop();
+
+	if (EMPTY(path))
+		return;
+
+	fp = g_file_new_for_path(path);
+	file_stream = g_file_replace(fp, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL);
+	if (file_stream)
+	{
+		const gchar *meta = "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+			"\"args\":{\"name\":\"Geany main loop\"}}";
+
+		// events are written synchronously, buffering keeps it cheap
+		trace_stream = g_buffered_output_stream_new_sized(G_OUTPUT_STREAM(file_stream), 256 * 1024);
+		g_object_unref(file_stream);
+		trace_path = g_strdup(path);
+		trace_start_time = g_get_monotonic_time();
+
+		g_output_stream_write_all(trace_stream, "[\n", 2, NULL, NULL, NULL);
+		g_output_stream_write_all(trace_stream, meta, strlen(meta), NULL, NULL, NULL);
+	}
+	else
+		msgwin_status_add(_("Failed to create trace file: %s"), path);
+
+	g_object_unref(fp);
+}
+
+
+void lsp_trace_stop(void)
+{
+	if (!trace_stream)
+		return;
+
+	g_output_stream_write_all(trace_stream, "\n]\n", 3, NULL, NULL, NULL);
+	g_output_stream_close(trace_stream, NULL, NULL);
+	g_clear_object(&trace_stream);
+	g_clear_pointer(&trace_path, g_free);
+}
+
+
+gboolean lsp_trace_is_active(void)
+{
+	return trace_stream != NULL;
+}
+
+
+/* complete event of a main loop callback from start_time till now */
+void lsp_trace_span(const gchar *name, gint64 start_time, const gchar *server, const gchar *method,
+	const gchar *uri)
+{
+	GString *event;
+	gint64 now;
+
+	if (!trace_stream || start_time == 0)
+		return;
+
+	now = g_get_monotonic_time();
+	event = g_string_new("{\"name\":");
+	append_json_string(event, name);
+	g_string_append_printf(event, ",\"cat\":\"callback\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT,
+		MAIN_LOOP_TID, MAX(start_time - trace_start_time, 0), now - start_time);
+	write_event(event, server, method, uri);
+	g_string_free(event, TRUE);
+}
+
+
+/* phase 'b' when the request with the given id is created, 'n' for its steps
+ * and 'e' when it is freed */
+void lsp_trace_request(gchar phase, guint id, const gchar *name, const gchar *server,
+	const gchar *method, const gchar *uri)
+{
+	GString *event;
+
+	if (!trace_stream)
+		return;
+
+	event = g_string_new("{\"name\":");
+	append_json_string(event, name);
+	g_string_append_printf(event, ",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%u,\"pid\":1,"
+		"\"tid\":%d,\"ts\":%" G_GINT64_FORMAT,
+		phase, id, MAIN_LOOP_TID, g_get_monotonic_time() - trace_start_time);
+	write_event(event, server, method, uri);
+	g_string_free(event, TRUE);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_TRACE_H
+#define LSP_TRACE_H 1
+
+#include <glib.h>
+
+void lsp_trace_start(const gchar *path);
+void lsp_trace_stop(void);
+gboolean lsp_trace_is_active(void);
+
+void lsp_trace_span(const gchar *name, gint64 start_time, const gchar *server, const gchar *method,
+	const gchar *uri);
+void lsp_trace_request(gchar phase, guint id, const gchar *name, const gchar *server,
+	const gchar *method, const gchar *uri);
+
+#endif  /* LSP_TRACE_H */
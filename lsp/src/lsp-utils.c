@@ -22,6 +22,9 @@
 
 #include "lsp-utils.h"
 #include "lsp-server.h"
+#include "lsp-sync.h"
+#include "lsp-doc-state.h"
+#include "lsp-watched-files.h"
 
 #include <geanyplugin.h>
 #include <jsonrpc-glib.h>
@@ -35,22 +38,230 @@ extern LspProjectConfigurationType project_configuration_type;
 extern gchar *project_configuration_file;
 
 
+#define LINE_INDEX_KEY "lsp_line_index"
+#define POSITION_ENCODING_KEY "lsp_position_encoding"
+#define BATCH_EDIT_KEY "lsp_batch_edit"
+
+#define URI_CACHE_MAX 1024
+
+// marks lines for which byte offsets and UTF-16 offsets are identical
+#define ASCII_LINE GINT_TO_POINTER(1)
+
+
+/* Per-ScintillaObject cache of line information used for position conversions.
+ * Unknown lines are NULL, pure ASCII lines ASCII_LINE and the remaining lines
+ * contain GArray of byte offsets (relative to line start) of every UTF-16 code
+ * unit of the line, terminated by the offset of the line end. */
+static void free_line_info(gpointer data)
+{
+	if (data && data != ASCII_LINE)
+		g_array_free(data, TRUE);
+}
+
+
+static void free_line_index(GPtrArray *index)
+{
+	guint i;
+
+	for (i = 0; i < index->len; i++)
+		free_line_info(index->pdata[i]);
+	g_ptr_array_free(index, TRUE);
+}
+
+
+static gpointer create_line_info(ScintillaObject *sci, gint line_start, gint line_end)
+{
+	gint len = line_end - line_start;
+	const gchar *text = (const gchar *)SSM(sci, SCI_GETRANGEPOINTER, line_start, len);
+	const gchar *p;
+	GArray *offsets;
+	gint i;
+
+	for (i = 0; i < len; i++)
+	{
+		if ((guchar)text[i] >= 0x80)
+			break;
+	}
+	if (i == len)
+		return ASCII_LINE;
+
+	offsets = g_array_sized_new(FALSE, FALSE, sizeof(gint), len + 1);
+	p = text;
+	while (p < text + len)
+	{
+		gunichar c = g_utf8_get_char_validated(p, text + len - p);
+		gint offset = p - text;
+
+		g_array_append_val(offsets, offset);
+		if (c == (gunichar)-1 || c == (gunichar)-2)
+		{
+			// invalid byte counts as a single code unit like in Scintilla
+			p++;
+			continue;
+		}
+		if (c >= 0x10000)
+			g_array_append_val(offsets, offset);  // surrogate pair
+		p = g_utf8_next_char(p);
+	}
+	g_array_append_val(offsets, len);
+
+	return offsets;
+}
+
+
+static gpointer get_line_info(ScintillaObject *sci, gint line, gint line_start, gint line_end)
+{
+	GPtrArray *index = g_object_get_data(G_OBJECT(sci), LINE_INDEX_KEY);
+
+	if (!index)
+	{
+		index = g_ptr_array_new();
+		g_object_set_data_full(G_OBJECT(sci), LINE_INDEX_KEY, index,
+			(GDestroyNotify)free_line_index);
+	}
+
+	if ((guint)line >= index->len)
+		g_ptr_array_set_size(index, line + 1);
+
+	if (!index->pdata[line])
+		index->pdata[line] = create_line_info(sci, line_start, line_end);
+
+	return index->pdata[line];
+}
+
+
+/* Has to be called from SCN_MODIFIED on every text insertion/deletion. When
+ * lines get added or removed, everything after the modified line is dropped
+ * and recomputed lazily. */
+void lsp_utils_invalidate_line_index(ScintillaObject *sci, gint line, gint lines_added)
+{
+	GPtrArray *index = g_object_get_data(G_OBJECT(sci), LINE_INDEX_KEY);
+	guint i;
+
+	if (!index || (guint)line >= index->len)
+		return;
+
+	if (lines_added == 0)
+	{
+		free_line_info(index->pdata[line]);
+		index->pdata[line] = NULL;
+		return;
+	}
+
+	for (i = line; i < index->len; i++)
+		free_line_info(index->pdata[i]);
+	g_ptr_array_set_size(index, line);
+}
+
+
+// set when the document is opened on the server
+void lsp_utils_set_position_encoding(ScintillaObject *sci, LspPositionEncoding encoding)
+{
+	g_object_set_data(G_OBJECT(sci), POSITION_ENCODING_KEY, GINT_TO_POINTER(encoding));
+}
+
+
+static LspPositionEncoding get_position_encoding(ScintillaObject *sci)
+{
+	return GPOINTER_TO_INT(g_object_get_data(G_OBJECT(sci), POSITION_ENCODING_KEY));
+}
+
+
 LspPosition lsp_utils_scintilla_pos_to_lsp(ScintillaObject *sci, gint sci_pos)
 {
 	LspPosition lsp_pos;
-	gint line_start_pos;
+	LspPositionEncoding encoding;
+	gint line_start_pos, line_end_pos, byte_offset;
+	GArray *offsets;
+	guint low, high;
 
 	lsp_pos.line = sci_get_line_from_position(sci, sci_pos);
 	line_start_pos = sci_get_position_from_line(sci, lsp_pos.line);
-	lsp_pos.character = SSM(sci, SCI_COUNTCODEUNITS, line_start_pos, sci_pos);
+	byte_offset = sci_pos - line_start_pos;
+
+	encoding = get_position_encoding(sci);
+	if (encoding == LspPositionEncodingUtf8)
+	{
+		lsp_pos.character = byte_offset;
+		return lsp_pos;
+	}
+
+	line_end_pos = sci_get_line_end_position(sci, lsp_pos.line);
+	offsets = get_line_info(sci, lsp_pos.line, line_start_pos, line_end_pos);
+	if (offsets == ASCII_LINE)
+	{
+		lsp_pos.character = byte_offset;
+		return lsp_pos;
+	}
+
+	if (encoding == LspPositionEncodingUtf32)
+	{
+		lsp_pos.character = SSM(sci, SCI_COUNTCHARACTERS, line_start_pos, sci_pos);
+		return lsp_pos;
+	}
+
+	// EOL characters are ASCII
+	if (byte_offset >= line_end_pos - line_start_pos)
+	{
+		lsp_pos.character = offsets->len - 1 + sci_pos - line_end_pos;
+		return lsp_pos;
+	}
+
+	// first code unit starting at or after byte_offset
+	low = 0;
+	high = offsets->len - 1;
+	while (low < high)
+	{
+		guint mid = (low + high) / 2;
+
+		if (g_array_index(offsets, gint, mid) < byte_offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	lsp_pos.character = low;
 	return lsp_pos;
 }
 
 
 gint lsp_utils_lsp_pos_to_scintilla(ScintillaObject *sci, LspPosition lsp_pos)
 {
+	LspPositionEncoding encoding = get_position_encoding(sci);
 	gint line_start_pos = sci_get_position_from_line(sci, lsp_pos.line);
-	return SSM(sci, SCI_POSITIONRELATIVECODEUNITS, line_start_pos, lsp_pos.character);
+	gint line_end_pos, pos;
+	GArray *offsets;
+
+	if (lsp_pos.line < 0 || lsp_pos.line >= sci_get_line_count(sci) || lsp_pos.character < 0)
+	{
+		if (encoding == LspPositionEncodingUtf16)
+			return SSM(sci, SCI_POSITIONRELATIVECODEUNITS, line_start_pos, lsp_pos.character);
+		return SSM(sci, SCI_POSITIONRELATIVE, line_start_pos, lsp_pos.character);
+	}
+
+	if (encoding == LspPositionEncodingUtf8)
+		return MIN(line_start_pos + lsp_pos.character, sci_get_length(sci));
+
+	line_end_pos = sci_get_line_end_position(sci, lsp_pos.line);
+	offsets = get_line_info(sci, lsp_pos.line, line_start_pos, line_end_pos);
+
+	if (offsets == ASCII_LINE)
+		pos = line_start_pos + lsp_pos.character;
+	else if (encoding == LspPositionEncodingUtf32)
+		return SSM(sci, SCI_POSITIONRELATIVE, line_start_pos, lsp_pos.character);
+	else if ((guint)lsp_pos.character < offsets->len)
+		return line_start_pos + g_array_index(offsets, gint, lsp_pos.character);
+	else
+		pos = line_end_pos + lsp_pos.character - (offsets->len - 1);
+
+	// past the line end - rare, let Scintilla deal with EOLs and document end
+	if (pos > line_end_pos)
+	{
+		return SSM(sci, encoding == LspPositionEncodingUtf16 ?
+			SCI_POSITIONRELATIVECODEUNITS : SCI_POSITIONRELATIVE, line_end_pos, pos - line_end_pos);
+	}
+
+	return pos;
 }
 
 
@@ -138,45 +349,134 @@ gchar *lsp_utils_json_pretty_print(GVariant *variant)
 }
 
 
+// URIs received from servers
+typedef struct
+{
+	gchar *uri;
+	gchar *locale_path;
+	gchar *utf8_path;  // computed on first use
+	GList *link;  // in uri_cache_lru
+} UriCacheEntry;
+
+
+// also used by worker threads parsing symbols, entries are only accessed
+// with uri_cache_mutex locked
+static GHashTable *uri_cache;
+static GQueue uri_cache_lru = G_QUEUE_INIT;  // most recently used first
+static GMutex uri_cache_mutex;
+
+
+/* The URI is computed once per document and recomputed only when the document
+ * gets a different file name */
 gchar *lsp_utils_get_doc_uri(GeanyDocument *doc)
 {
+	LspDocState *state;
 	gchar *fname;
 
 	g_return_val_if_fail(doc->real_path, NULL);
 
+	state = lsp_doc_state_get(doc);
+	if (state->uri && g_strcmp0(state->uri_path, doc->real_path) == 0)
+		return g_strdup(state->uri);
+
 	fname = g_filename_to_uri(doc->real_path, NULL, NULL);
 
 	g_return_val_if_fail(fname, NULL);
 
+	SETPTR(state->uri_path, g_strdup(doc->real_path));
+	SETPTR(state->uri, g_strdup(fname));
+
 	return fname;
 }
 
 
-gchar *lsp_utils_get_real_path_from_uri_locale(const gchar *uri)
+static void uri_cache_entry_free(UriCacheEntry *entry)
 {
+	g_free(entry->uri);
+	g_free(entry->locale_path);
+	g_free(entry->utf8_path);
+	g_free(entry);
+}
+
+
+/* Bounded LRU cache - the same URIs come repeatedly in diagnostics, locations
+ * and symbols and resolving the real path means system calls. To be called
+ * with uri_cache_mutex locked. */
+static UriCacheEntry *get_uri_cache_entry(const gchar *uri)
+{
+	UriCacheEntry *entry;
 	gchar *fname;
 
-	g_return_val_if_fail(uri, NULL);
+	if (!uri_cache)
+		uri_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			(GDestroyNotify)uri_cache_entry_free);
+
+	entry = g_hash_table_lookup(uri_cache, uri);
+	if (entry)
+	{
+		g_queue_unlink(&uri_cache_lru, entry->link);
+		g_queue_push_head_link(&uri_cache_lru, entry->link);
+		return entry;
+	}
 
 	fname = g_filename_from_uri(uri, NULL, NULL);
 
 	g_return_val_if_fail(fname, NULL);
 
-	SETPTR(fname, utils_get_real_path(fname));
+	if (g_hash_table_size(uri_cache) >= URI_CACHE_MAX)
+	{
+		UriCacheEntry *oldest = g_queue_pop_tail(&uri_cache_lru);
+
+		g_hash_table_remove(uri_cache, oldest->uri);
+	}
 
-	return fname;
+	entry = g_new0(UriCacheEntry, 1);
+	entry->uri = g_strdup(uri);
+	entry->locale_path = utils_get_real_path(fname);
+	g_queue_push_head(&uri_cache_lru, entry);
+	entry->link = uri_cache_lru.head;
+	g_hash_table_insert(uri_cache, entry->uri, entry);
+
+	g_free(fname);
+	return entry;
+}
+
+
+gchar *lsp_utils_get_real_path_from_uri_locale(const gchar *uri)
+{
+	UriCacheEntry *entry;
+	gchar *ret = NULL;
+
+	g_return_val_if_fail(uri, NULL);
+
+	g_mutex_lock(&uri_cache_mutex);
+	entry = get_uri_cache_entry(uri);
+	if (entry)
+		ret = g_strdup(entry->locale_path);
+	g_mutex_unlock(&uri_cache_mutex);
+
+	return ret;
 }
 
 
 gchar *lsp_utils_get_real_path_from_uri_utf8(const gchar *uri)
 {
-	gchar *locale_fname = lsp_utils_get_real_path_from_uri_locale(uri);
+	UriCacheEntry *entry;
+	gchar *ret = NULL;
 
-	if (!locale_fname)
-		return NULL;
+	g_return_val_if_fail(uri, NULL);
 
-	SETPTR(locale_fname, utils_get_utf8_from_locale(locale_fname));
-	return locale_fname;
+	g_mutex_lock(&uri_cache_mutex);
+	entry = get_uri_cache_entry(uri);
+	if (entry && entry->locale_path)
+	{
+		if (!entry->utf8_path)
+			entry->utf8_path = utils_get_utf8_from_locale(entry->locale_path);
+		ret = g_strdup(entry->utf8_path);
+	}
+	g_mutex_unlock(&uri_cache_mutex);
+
+	return ret;
 }
 
 
@@ -341,6 +641,62 @@ LspRange lsp_utils_parse_range(GVariant *variant)
 }
 
 
+/* Floating a{sv} of the given members built directly instead of through
+ * JSONRPC_MESSAGE_NEW() which interprets its arguments and uses a
+ * GVariantBuilder for every nested object. Takes the floating values. */
+GVariant *lsp_utils_new_vardict(guint n, const gchar **keys, GVariant **values)
+{
+	GVariant *entries[LSP_UTILS_VARDICT_MAX];
+	guint i;
+
+	g_return_val_if_fail(n <= LSP_UTILS_VARDICT_MAX, NULL);
+
+	for (i = 0; i < n; i++)
+		entries[i] = g_variant_new_dict_entry(g_variant_new_string(keys[i]),
+			g_variant_new_variant(values[i]));
+
+	return g_variant_new_array(G_VARIANT_TYPE("{sv}"), entries, n);
+}
+
+
+static GVariant *new_position(LspPosition pos)
+{
+	const gchar *keys[] = {"line", "character"};
+	GVariant *values[] = {g_variant_new_int32(pos.line), g_variant_new_int32(pos.character)};
+
+	return lsp_utils_new_vardict(2, keys, values);
+}
+
+
+/* TextDocumentPositionParams of the position-based requests, followed by
+ * the extra member unless extra_key is NULL */
+GVariant *lsp_utils_new_text_document_position(const gchar *doc_uri, LspPosition pos,
+	const gchar *extra_key, GVariant *extra_value)
+{
+	const gchar *uri_key[] = {"uri"};
+	GVariant *uri_value[] = {g_variant_new_string(doc_uri)};
+	const gchar *keys[] = {"textDocument", "position", extra_key};
+	GVariant *values[] = {lsp_utils_new_vardict(1, uri_key, uri_value), new_position(pos), extra_value};
+
+	return g_variant_ref_sink(lsp_utils_new_vardict(extra_key ? 3 : 2, keys, values));
+}
+
+
+/* TextDocumentContentChangeEvent of an incremental didChange */
+GVariant *lsp_utils_new_content_change(LspPosition start, LspPosition end, gint range_length,
+	const gchar *text)
+{
+	const gchar *range_keys[] = {"start", "end"};
+	GVariant *range_values[] = {new_position(start), new_position(end)};
+	// rangeLength is not required but the lemminx server crashes without it
+	const gchar *keys[] = {"range", "rangeLength", "text"};
+	GVariant *values[] = {lsp_utils_new_vardict(2, range_keys, range_values),
+		g_variant_new_int32(range_length), g_variant_new_string(text)};
+
+	return g_variant_ref_sink(lsp_utils_new_vardict(3, keys, values));
+}
+
+
 void lsp_utils_free_lsp_text_edit(LspTextEdit *e)
 {
 	if (!e)
@@ -447,6 +803,67 @@ static gint sort_edits(gconstpointer a, gconstpointer b)
 }
 
 
+static gboolean applying_workspace_edit = FALSE;
+
+
+static GeanyDocument *get_doc_for_sci(ScintillaObject *sci)
+{
+	guint i;
+
+	foreach_document(i)
+	{
+		if (documents[i]->editor->sci == sci)
+			return documents[i];
+	}
+	return NULL;
+}
+
+
+/* Edits sorted in reverse order. All positions are converted against the
+ * unmodified document where the line index is complete, the edits are applied
+ * without generating per-modification didChange changes and the server gets
+ * the original edit ranges afterwards - applied in reverse order they are
+ * valid as sequential content changes. */
+static void apply_text_edits_batch(ScintillaObject *sci, GPtrArray *edits)
+{
+	GeanyDocument *doc = get_doc_for_sci(sci);
+	LspServer *srv = doc && doc->real_path ? lsp_server_get(doc) : NULL;
+	gint *positions = g_new(gint, 2 * edits->len + 1);
+	guint i;
+
+	if (srv && !lsp_sync_is_document_open(srv, doc))
+		lsp_sync_text_document_did_open(srv, doc);
+
+	for (i = 0; i < edits->len; i++)
+	{
+		LspTextEdit *e = edits->pdata[i];
+
+		positions[2 * i] = lsp_utils_lsp_pos_to_scintilla(sci, e->range.start);
+		positions[2 * i + 1] = lsp_utils_lsp_pos_to_scintilla(sci, e->range.end);
+	}
+
+	g_object_set_data(G_OBJECT(sci), BATCH_EDIT_KEY, GINT_TO_POINTER(TRUE));
+	for (i = 0; i < edits->len; i++)
+	{
+		LspTextEdit *e = edits->pdata[i];
+
+		SSM(sci, SCI_SETTARGETRANGE, positions[2 * i], positions[2 * i + 1]);
+		SSM(sci, SCI_REPLACETARGET, -1, (sptr_t)e->new_text);
+	}
+	g_object_set_data(G_OBJECT(sci), BATCH_EDIT_KEY, NULL);
+
+	for (i = 0; srv && i < edits->len; i++)
+	{
+		LspTextEdit *e = edits->pdata[i];
+
+		lsp_sync_text_document_did_change(srv, doc, e->range.start, e->range.end,
+			positions[2 * i + 1] - positions[2 * i], e->new_text);
+	}
+
+	g_free(positions);
+}
+
+
 void lsp_utils_apply_text_edits(ScintillaObject *sci, LspTextEdit *edit, GPtrArray *edits,
 	gboolean process_snippets)
 {
@@ -465,73 +882,418 @@ void lsp_utils_apply_text_edits(ScintillaObject *sci, LspTextEdit *edit, GPtrArr
 			g_ptr_array_add(arr, edits->pdata[i]);
 	}
 
-	// We get the text edit ranges against the original document. We need to sort
-	// the edits by position in reverse order so we don't affect positions by applying
-	// earlier edits (edits are guaranteed to be non-overlapping by the LSP specs)
-	g_ptr_array_sort(arr, sort_edits);
+	// We get the text edit ranges against the original document. We need to sort
+	// the edits by position in reverse order so we don't affect positions by applying
+	// earlier edits (edits are guaranteed to be non-overlapping by the LSP specs)
+	g_ptr_array_sort(arr, sort_edits);
+
+	// snippets and the main completion edit need the cursor placement below
+	if (!edit && !process_snippets)
+		apply_text_edits_batch(sci, arr);
+	else
+	{
+		for (i = 0; i < arr->len; i++)
+		{
+			LspTextEdit *e = arr->pdata[i];
+			lsp_utils_apply_text_edit(sci, e, process_snippets);
+		}
+	}
+
+	g_ptr_array_free(arr, TRUE);
+}
+
+
+gboolean lsp_utils_is_applying_edits(ScintillaObject *sci)
+{
+	return g_object_get_data(G_OBJECT(sci), BATCH_EDIT_KEY) != NULL;
+}
+
+
+/* TRUE while lsp_utils_apply_workspace_edit_full() edits open documents -
+ * the caller refreshes the visible document once afterwards */
+gboolean lsp_utils_is_applying_workspace_edit(void)
+{
+	return applying_workspace_edit;
+}
+
+
+typedef struct
+{
+	gchar *fname;  // locale
+	// GPtrArray of LspTextEdit for every occurrence of the file in the edit
+	GPtrArray *edit_arrays;
+	LspPositionEncoding encoding;
+} FileEditJob;
+
+
+typedef struct
+{
+	guint total;
+	guint done;
+	LspWorkspaceEditCallback callback;
+	gpointer user_data;
+} WorkspaceEditBatch;
+
+
+static void file_edit_job_free(FileEditJob *job)
+{
+	g_free(job->fname);
+	g_ptr_array_free(job->edit_arrays, TRUE);
+	g_free(job);
+}
+
+
+static gint sort_edits_ascending(gconstpointer a, gconstpointer b)
+{
+	return sort_edits(b, a);
+}
+
+
+static gsize get_line_end(const gchar *contents, gsize len, gsize offset)
+{
+	while (offset < len && contents[offset] != '\n' && contents[offset] != '\r')
+		offset++;
+	return offset;
+}
+
+
+static gsize get_next_line_start(const gchar *contents, gsize len, gsize offset)
+{
+	offset = get_line_end(contents, len, offset);
+	if (offset < len && contents[offset] == '\r')
+		offset++;
+	if (offset < len && contents[offset] == '\n')
+		offset++;
+	return offset;
+}
+
+
+/* Converts LSP position to byte offset in contents. Positions have to be passed
+ * in ascending order - *line and *line_start keep the scan position between calls
+ * so the whole file is scanned only once. */
+static gsize lsp_pos_to_offset(const gchar *contents, gsize len, LspPosition pos,
+	LspPositionEncoding encoding, gint64 *line, gsize *line_start)
+{
+	gsize offset, line_end;
+	gint64 units = 0;
+
+	while (*line < pos.line && *line_start < len)
+	{
+		*line_start = get_next_line_start(contents, len, *line_start);
+		(*line)++;
+	}
+	if (*line < pos.line)
+		return len;
+
+	offset = *line_start;
+	line_end = get_line_end(contents, len, offset);
+
+	// positions past the line end are clamped to the line end by the LSP specs
+	while (offset < line_end && units < pos.character)
+	{
+		const guchar c = contents[offset];
+		gsize char_len = 1;
+
+		if (c >= 0xF0)
+			char_len = 4;
+		else if (c >= 0xE0)
+			char_len = 3;
+		else if (c >= 0xC0)
+			char_len = 2;
+
+		if (encoding == LspPositionEncodingUtf8)
+			units += char_len;
+		else if (encoding == LspPositionEncodingUtf16 && char_len == 4)
+			units += 2;
+		else
+			units++;
+		offset = MIN(offset + char_len, line_end);
+	}
+
+	return offset;
+}
+
+
+static void apply_edits_thread(GTask *task, gpointer source_object, gpointer task_data,
+	GCancellable *cancellable)
+{
+	FileEditJob *job = task_data;
+	GError *error = NULL;
+	GMappedFile *file;
+	const gchar *contents;
+	GPtrArray *edits, *arr;
+	GString *result;
+	gsize len, copied = 0, line_start = 0;
+	gint64 line = 0;
+	guint i, j;
+
+	file = g_mapped_file_new(job->fname, FALSE, &error);
+	if (!file)
+	{
+		g_task_return_error(task, error);
+		return;
+	}
+
+	contents = g_mapped_file_get_contents(file);
+	len = g_mapped_file_get_length(file);
+	if (!contents)
+		len = 0;
+
+	edits = g_ptr_array_new();
+	foreach_ptr_array(arr, i, job->edit_arrays)
+	{
+		for (j = 0; j < arr->len; j++)
+			g_ptr_array_add(edits, arr->pdata[j]);
+	}
+
+	// edits are non-overlapping so both starts and ends come in ascending order
+	g_ptr_array_sort(edits, sort_edits_ascending);
+
+	result = g_string_sized_new(len + len / 16);
+	for (i = 0; i < edits->len; i++)
+	{
+		LspTextEdit *e = edits->pdata[i];
+		gsize start, end;
+
+		if (e->range.start.line < line || e->range.end.line < e->range.start.line)
+			continue;  // overlapping edit, invalid
+		start = lsp_pos_to_offset(contents, len, e->range.start, job->encoding, &line, &line_start);
+		end = lsp_pos_to_offset(contents, len, e->range.end, job->encoding, &line, &line_start);
+		if (start < copied || end < start)
+			continue;
+
+		g_string_append_len(result, contents + copied, start - copied);
+		g_string_append(result, e->new_text);
+		copied = end;
+	}
+	g_string_append_len(result, contents + copied, len - copied);
+
+	g_ptr_array_free(edits, TRUE);
+	g_mapped_file_unref(file);
+
+	// writes to a temporary file and renames it over the original
+	if (g_file_set_contents(job->fname, result->str, result->len, &error))
+		g_task_return_boolean(task, TRUE);
+	else
+		g_task_return_error(task, error);
+
+	g_string_free(result, TRUE);
+}
+
+
+static void apply_edits_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	WorkspaceEditBatch *batch = user_data;
+	FileEditJob *job = g_task_get_task_data(G_TASK(res));
+	GError *error = NULL;
+
+	if (!g_task_propagate_boolean(G_TASK(res), &error))
+	{
+		gchar *fname = utils_get_utf8_from_locale(job->fname);
+
+		msgwin_status_add(_("Failed to apply edits to %s: %s"), fname, error->message);
+		g_free(fname);
+		g_error_free(error);
+	}
+	else
+		lsp_watched_files_file_written(job->fname);
+
+	batch->done++;
+	if (batch->callback)
+		batch->callback(batch->done, batch->total, batch->done == batch->total, batch->user_data);
+	if (batch->done == batch->total)
+		g_free(batch);
+}
+
+
+static void apply_edits_in_file(const gchar *uri, GPtrArray *edits, LspPositionEncoding encoding,
+	GPtrArray *jobs, GPtrArray *docs)
+{
+	gchar *fname = lsp_utils_get_real_path_from_uri_utf8(uri);
+	gchar *fname_locale = lsp_utils_get_real_path_from_uri_locale(uri);
+
+	if (fname && fname_locale)
+	{
+		GeanyDocument *doc = document_find_by_filename(fname);
+
+		if (doc)
+		{
+			ScintillaObject *sci = doc->editor->sci;
+
+			sci_start_undo_action(sci);
+			lsp_utils_apply_text_edits(sci, NULL, edits, FALSE);
+			sci_end_undo_action(sci);
+			if (!g_ptr_array_find(docs, doc, NULL))
+				g_ptr_array_add(docs, doc);
+		}
+		else
+		{
+			// files which aren't open are rewritten by worker threads, a single
+			// one per file so writes of the same file don't race
+			FileEditJob *job = NULL;
+			guint i;
+
+			for (i = 0; i < jobs->len && !job; i++)
+			{
+				FileEditJob *j = jobs->pdata[i];
+				if (g_strcmp0(j->fname, fname_locale) == 0)
+					job = j;
+			}
+
+			if (!job)
+			{
+				job = g_new0(FileEditJob, 1);
+				job->fname = g_strdup(fname_locale);
+				job->edit_arrays = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+				job->encoding = encoding;
+				g_ptr_array_add(jobs, job);
+			}
+			g_ptr_array_add(job->edit_arrays, g_ptr_array_ref(edits));
+		}
+	}
+	g_free(fname);
+	g_free(fname_locale);
+}
+
+
+static gboolean collect_workspace_edit(GVariant *workspace_edit, LspPositionEncoding encoding,
+	GPtrArray *jobs, GPtrArray *docs)
+{
+	GVariant *changes = NULL;
+	gboolean ret = FALSE;
+
+	JSONRPC_MESSAGE_PARSE(workspace_edit,
+		"changes", JSONRPC_MESSAGE_GET_VARIANT(&changes)
+		);
+
+	if (changes && g_variant_is_of_type(changes, G_VARIANT_TYPE_DICTIONARY))
+	{
+		GVariantIter iter;
+		GVariant *text_edits;
+		gchar *uri;
+
+		g_variant_iter_init(&iter, changes);
+		while (g_variant_iter_loop(&iter, "{sv}", &uri, &text_edits))
+		{
+			GVariantIter iter2;
+			GPtrArray *edits;
+
+			g_variant_iter_init(&iter2, text_edits);
+
+			edits = lsp_utils_parse_text_edits(&iter2);
+			apply_edits_in_file(uri, edits, encoding, jobs, docs);
+
+			g_ptr_array_unref(edits);
+		}
+
+		ret = TRUE;
+	}
+
+	if (changes)
+		g_variant_unref(changes);
+
+	if (!ret)
+	{
+		GVariantIter *iter = NULL;
+		GVariant *document_chages = NULL;
+
+		JSONRPC_MESSAGE_PARSE(workspace_edit,
+			"documentChanges", JSONRPC_MESSAGE_GET_ITER(&iter)
+			);
+
+		while (iter && g_variant_iter_loop(iter, "v", &document_chages))
+		{
+			const gchar *uri = NULL;
+			GVariantIter *iter2 = NULL;
+
+			//TODO: support CreateFile, RenameFile, DeleteFile
+			JSONRPC_MESSAGE_PARSE(document_chages,
+				"textDocument", "{",
+					"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
+				"}",
+				"edits", JSONRPC_MESSAGE_GET_ITER(&iter2)
+			);
+
+			if (uri && iter2)
+			{
+				GPtrArray *edits = lsp_utils_parse_text_edits(iter2);
+
+				apply_edits_in_file(uri, edits, encoding, jobs, docs);
+				ret = TRUE;
+
+				g_ptr_array_unref(edits);
+				g_variant_iter_free(iter2);
+			}
+		}
+
+		if (iter)
+			g_variant_iter_free(iter);
+	}
+
+	return ret;
+}
 
-	for (i = 0; i < arr->len; i++)
-	{
-		LspTextEdit *e = arr->pdata[i];
-		lsp_utils_apply_text_edit(sci, e, process_snippets);
-	}
 
-	g_ptr_array_free(arr, TRUE);
+typedef struct
+{
+	GPtrArray *edits;  // GVariant TextEdit
+	GArray *ranges;  // LspRange of the edits
+} MergedEdits;
+
+
+static void merged_edits_free(MergedEdits *m)
+{
+	g_ptr_array_free(m->edits, TRUE);
+	g_array_free(m->ranges, TRUE);
+	g_free(m);
 }
 
 
-static void apply_edits_in_file(const gchar *uri, GPtrArray *edits)
+static gint pos_cmp(LspPosition a, LspPosition b)
 {
-	gchar *fname = lsp_utils_get_real_path_from_uri_utf8(uri);
-	gchar *fname_locale = lsp_utils_get_real_path_from_uri_locale(uri);
+	if (a.line != b.line)
+		return a.line < b.line ? -1 : 1;
+	if (a.character != b.character)
+		return a.character < b.character ? -1 : 1;
+	return 0;
+}
 
-	if (fname && fname_locale)
-	{
-		GeanyDocument *doc = document_find_by_filename(fname);
-		ScintillaObject *sci = NULL;
 
-		if (doc)
-			sci = doc->editor->sci;
-		else
-			sci = lsp_utils_new_sci_from_file(fname);
+static gboolean ranges_conflict(LspRange *a, LspRange *b)
+{
+	// insertions at the same place coming from different edits have no defined order
+	if (pos_cmp(a->start, a->end) == 0 && pos_cmp(b->start, b->end) == 0)
+		return pos_cmp(a->start, b->start) == 0;
 
-		sci_start_undo_action(sci);
-		lsp_utils_apply_text_edits(sci, NULL, edits, FALSE);
-		sci_end_undo_action(sci);
+	return pos_cmp(a->start, b->end) < 0 && pos_cmp(b->start, a->end) < 0;
+}
 
-		if (!doc)
-		{
-			gchar *contents = sci_get_contents(sci, -1);
 
-			g_file_set_contents(fname, contents, -1, NULL);
+static void add_uri_edits(const gchar *uri, GVariantIter *iter, GPtrArray *uris, GPtrArray *edits,
+	GArray *ranges)
+{
+	GVariant *val = NULL;
 
-#if 0
-			GVariant *node;
-			node = JSONRPC_MESSAGE_NEW (
-				"changes", "[", "{",
-					"uri", JSONRPC_MESSAGE_PUT_STRING(uri),
-					"type", JSONRPC_MESSAGE_PUT_INT32(2),  //changed
-				"}", "]"
-			);
+	while (g_variant_iter_loop(iter, "v", &val))
+	{
+		LspTextEdit *e = lsp_utils_parse_text_edit(val);
 
-			lsp_client_notify(srv, "workspace/didChangeWatchedFiles", node, NULL, NULL);
-			g_variant_unref(node);
-#endif
+		if (!e)
+			continue;
 
-			g_free(contents);
-			g_object_ref_sink(sci);
-			g_object_unref(sci);
-		}
+		g_ptr_array_add(uris, g_strdup(uri));
+		g_ptr_array_add(edits, g_variant_ref(val));
+		g_array_append_val(ranges, e->range);
+		lsp_utils_free_lsp_text_edit(e);
 	}
-	g_free(fname);
-	g_free(fname_locale);
 }
 
 
-gboolean lsp_utils_apply_workspace_edit(GVariant *workspace_edit)
+// text edits of both forms of WorkspaceEdit, file operations are ignored like when applying
+static void get_text_edits(GVariant *workspace_edit, GPtrArray *uris, GPtrArray *edits, GArray *ranges)
 {
 	GVariant *changes = NULL;
-	gboolean ret = FALSE;
+	GVariantIter *iter = NULL;
 
 	JSONRPC_MESSAGE_PARSE(workspace_edit,
 		"changes", JSONRPC_MESSAGE_GET_VARIANT(&changes)
@@ -539,72 +1301,222 @@ gboolean lsp_utils_apply_workspace_edit(GVariant *workspace_edit)
 
 	if (changes && g_variant_is_of_type(changes, G_VARIANT_TYPE_DICTIONARY))
 	{
-		GVariantIter iter;
+		GVariantIter changes_iter;
 		GVariant *text_edits;
 		gchar *uri;
 
-		g_variant_iter_init(&iter, changes);
-		while (g_variant_iter_loop(&iter, "{sv}", &uri, &text_edits))
+		g_variant_iter_init(&changes_iter, changes);
+		while (g_variant_iter_loop(&changes_iter, "{sv}", &uri, &text_edits))
 		{
-			GVariantIter iter2;
-			GPtrArray *edits;
-
-			g_variant_iter_init(&iter2, text_edits);
-
-			edits = lsp_utils_parse_text_edits(&iter2);
-			apply_edits_in_file(uri,  edits);
+			GVariantIter edits_iter;
 
-			g_ptr_array_free(edits, TRUE);
+			g_variant_iter_init(&edits_iter, text_edits);
+			add_uri_edits(uri, &edits_iter, uris, edits, ranges);
 		}
-
-		ret = TRUE;
+		g_variant_unref(changes);
+		return;
 	}
 
 	if (changes)
 		g_variant_unref(changes);
 
-	if (!ret)
-	{
-		GVariantIter *iter = NULL;
-		GVariant *document_chages = NULL;
+	JSONRPC_MESSAGE_PARSE(workspace_edit,
+		"documentChanges", JSONRPC_MESSAGE_GET_ITER(&iter)
+		);
 
-		JSONRPC_MESSAGE_PARSE(workspace_edit,
-			"documentChanges", JSONRPC_MESSAGE_GET_ITER(&iter)
-			);
+	if (iter)
+	{
+		GVariant *document_change = NULL;
 
-		while (iter && g_variant_iter_loop(iter, "v", &document_chages))
+		while (g_variant_iter_loop(iter, "v", &document_change))
 		{
 			const gchar *uri = NULL;
-			GVariantIter *iter2 = NULL;
+			GVariantIter *edits_iter = NULL;
 
-			//TODO: support CreateFile, RenameFile, DeleteFile
-			JSONRPC_MESSAGE_PARSE(document_chages,
+			JSONRPC_MESSAGE_PARSE(document_change,
 				"textDocument", "{",
 					"uri", JSONRPC_MESSAGE_GET_STRING(&uri),
 				"}",
-				"edits", JSONRPC_MESSAGE_GET_ITER(&iter2)
+				"edits", JSONRPC_MESSAGE_GET_ITER(&edits_iter)
 			);
 
-			if (uri && iter2)
+			if (uri && edits_iter)
+				add_uri_edits(uri, edits_iter, uris, edits, ranges);
+			if (edits_iter)
+				g_variant_iter_free(edits_iter);
+		}
+		g_variant_iter_free(iter);
+	}
+}
+
+
+/* Combines workspace edits computed against the same document versions into
+ * one so they can be applied at once - applying them one by one would shift
+ * the positions of the later ones. Workspace edits overlapping an already
+ * included one are left out, their indices are added to skipped. */
+GVariant *lsp_utils_merge_workspace_edits(GPtrArray *workspace_edits, GArray *skipped)
+{
+	GHashTable *merged = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)merged_edits_free);
+	GPtrArray *uri_order = g_ptr_array_new();
+	GVariantDict changes, dict;
+	GVariant *workspace_edit;
+	gchar *uri;
+	guint i;
+
+	foreach_ptr_array(workspace_edit, i, workspace_edits)
+	{
+		GPtrArray *uris = g_ptr_array_new_with_free_func(g_free);
+		GPtrArray *edits = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+		GArray *ranges = g_array_new(FALSE, FALSE, sizeof(LspRange));
+		gboolean conflict = FALSE;
+		guint j, k;
+
+		get_text_edits(workspace_edit, uris, edits, ranges);
+
+		for (j = 0; j < edits->len && !conflict; j++)
+		{
+			MergedEdits *m = g_hash_table_lookup(merged, uris->pdata[j]);
+
+			for (k = 0; m && k < m->ranges->len && !conflict; k++)
+				conflict = ranges_conflict(&g_array_index(ranges, LspRange, j),
+					&g_array_index(m->ranges, LspRange, k));
+		}
+
+		if (conflict)
+			g_array_append_val(skipped, i);
+		else
+		{
+			for (j = 0; j < edits->len; j++)
 			{
-				GPtrArray *edits = lsp_utils_parse_text_edits(iter2);
+				MergedEdits *m = g_hash_table_lookup(merged, uris->pdata[j]);
 
-				apply_edits_in_file(uri, edits);
-				ret = TRUE;
+				if (!m)
+				{
+					m = g_new0(MergedEdits, 1);
+					m->edits = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+					m->ranges = g_array_new(FALSE, FALSE, sizeof(LspRange));
+					uri = g_strdup(uris->pdata[j]);
+					g_hash_table_insert(merged, uri, m);
+					g_ptr_array_add(uri_order, uri);
+				}
 
-				g_ptr_array_free(edits, TRUE);
-				g_variant_iter_free(iter2);
+				g_ptr_array_add(m->edits, g_variant_ref(edits->pdata[j]));
+				g_array_append_val(m->ranges, g_array_index(ranges, LspRange, j));
 			}
 		}
 
-		if (iter)
-			g_variant_iter_free(iter);
+		g_ptr_array_free(uris, TRUE);
+		g_ptr_array_free(edits, TRUE);
+		g_array_free(ranges, TRUE);
+	}
+
+	g_variant_dict_init(&changes, NULL);
+	foreach_ptr_array(uri, i, uri_order)
+	{
+		MergedEdits *m = g_hash_table_lookup(merged, uri);
+		GVariantBuilder builder;
+		GVariant *edit;
+		guint j;
+
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+		foreach_ptr_array(edit, j, m->edits)
+			g_variant_builder_add(&builder, "v", edit);
+		g_variant_dict_insert_value(&changes, uri, g_variant_builder_end(&builder));
+	}
+
+	g_variant_dict_init(&dict, NULL);
+	g_variant_dict_insert_value(&dict, "changes", g_variant_dict_end(&changes));
+
+	g_ptr_array_free(uri_order, TRUE);
+	g_hash_table_destroy(merged);
+
+	return g_variant_take_ref(g_variant_dict_end(&dict));
+}
+
+
+/* Edits open documents with repainting of the visible one frozen and sends
+ * the queued changes of each edited document as a single didChange. */
+static gboolean apply_workspace_edit_to_docs(GVariant *workspace_edit, LspPositionEncoding encoding,
+	GPtrArray *jobs)
+{
+	GeanyDocument *current = document_get_current();
+	GdkWindow *window = current ? gtk_widget_get_window(GTK_WIDGET(current->editor->sci)) : NULL;
+	GPtrArray *docs = g_ptr_array_new();
+	GeanyDocument *doc;
+	gboolean ret;
+	guint i;
+
+	if (window)
+		gdk_window_freeze_updates(window);
+	applying_workspace_edit = TRUE;
+
+	ret = collect_workspace_edit(workspace_edit, encoding, jobs, docs);
+
+	applying_workspace_edit = FALSE;
+	if (window)
+		gdk_window_thaw_updates(window);
+
+	foreach_ptr_array(doc, i, docs)
+	{
+		LspServer *srv = doc->real_path ? lsp_server_get_if_running(doc) : NULL;
+
+		if (srv)
+			lsp_sync_flush_pending_changes(srv, doc);
 	}
 
+	g_ptr_array_free(docs, TRUE);
 	return ret;
 }
 
 
+/* Open documents are edited immediately, other files in the background. When
+ * TRUE is returned, callback is called after each written file and always once
+ * with finished set (synchronously when there's nothing to write). */
+gboolean lsp_utils_apply_workspace_edit_full(GVariant *workspace_edit, LspPositionEncoding encoding,
+	LspWorkspaceEditCallback callback, gpointer user_data)
+{
+	GPtrArray *jobs = g_ptr_array_new();
+	WorkspaceEditBatch *batch;
+	FileEditJob *job;
+	guint i;
+
+	if (!apply_workspace_edit_to_docs(workspace_edit, encoding, jobs))
+	{
+		g_ptr_array_free(jobs, TRUE);
+		return FALSE;
+	}
+
+	if (jobs->len == 0)
+	{
+		if (callback)
+			callback(0, 0, TRUE, user_data);
+		g_ptr_array_free(jobs, TRUE);
+		return TRUE;
+	}
+
+	batch = g_new0(WorkspaceEditBatch, 1);
+	batch->total = jobs->len;
+	batch->callback = callback;
+	batch->user_data = user_data;
+
+	foreach_ptr_array(job, i, jobs)
+	{
+		GTask *task = g_task_new(NULL, NULL, apply_edits_done, batch);
+
+		g_task_set_task_data(task, job, (GDestroyNotify)file_edit_job_free);
+		g_task_run_in_thread(task, apply_edits_thread);
+		g_object_unref(task);
+	}
+
+	if (callback)
+		callback(0, batch->total, FALSE, user_data);
+
+	g_ptr_array_free(jobs, TRUE);
+	return TRUE;
+}
+
+
 void lsp_utils_free_lsp_location(LspLocation *e)
 {
 	if (!e)
@@ -682,7 +1594,7 @@ gboolean lsp_utils_wrap_string(gchar *string, gint wrapstart)
 }
 
 
-static gchar *utf8_strdown(const gchar *str)
+gchar *lsp_utils_utf8_strdown(const gchar *str)
 {
 	gchar *down;
 
@@ -708,10 +1620,10 @@ gpointer lsp_utils_lowercase_cmp(LspUtilsCmpFn cmp, const gchar *s1, const gchar
 	g_return_val_if_fail(s2 != NULL, GINT_TO_POINTER(-1));
 
 	/* ensure strings are UTF-8 and lowercase */
-	tmp1 = utf8_strdown(s1);
+	tmp1 = lsp_utils_utf8_strdown(s1);
 	if (!tmp1)
 		return GINT_TO_POINTER(1);
-	tmp2 = utf8_strdown(s2);
+	tmp2 = lsp_utils_utf8_strdown(s2);
 	if (!tmp2)
 	{
 		g_free(tmp1);
@@ -727,12 +1639,90 @@ gpointer lsp_utils_lowercase_cmp(LspUtilsCmpFn cmp, const gchar *s1, const gchar
 }
 
 
+typedef struct
+{
+	gint64 mtime;
+	gboolean loaded;
+	JsonNode *node;  // NULL when loaded but not valid JSON
+} JsonFileEntry;
+
+// locale path -> JsonFileEntry
+static GHashTable *json_file_cache;
+
+
+static void json_file_entry_free(JsonFileEntry *entry)
+{
+	if (entry->node)
+		json_node_free(entry->node);
+	g_free(entry);
+}
+
+
+// modification time in microseconds, -1 for non-existent files
+gint64 lsp_utils_get_file_mtime(const gchar *locale_fname)
+{
+	GFile *file = g_file_new_for_path(locale_fname);
+	GFileInfo *info = g_file_query_info(file, G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+		G_FILE_QUERY_INFO_NONE, NULL, NULL);
+	gint64 mtime = -1;
+
+	if (info)
+	{
+		mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+			g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+		g_object_unref(info);
+	}
+	g_object_unref(file);
+
+	return mtime;
+}
+
+
+/* Files like initialization_options_file are shared by many servers and read
+ * on every server start and configuration request - parse them only when
+ * they change. */
+static JsonFileEntry *get_json_file(const gchar *fname)
+{
+	gint64 mtime = lsp_utils_get_file_mtime(fname);
+	JsonFileEntry *entry;
+	gchar *file_contents;
+
+	if (!json_file_cache)
+		json_file_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)json_file_entry_free);
+
+	entry = g_hash_table_lookup(json_file_cache, fname);
+	if (entry && entry->mtime == mtime)
+		return entry;
+
+	entry = g_new0(JsonFileEntry, 1);
+	entry->mtime = mtime;
+
+	if (mtime >= 0 && g_file_get_contents(fname, &file_contents, NULL, NULL))
+	{
+		GError *error = NULL;
+
+		entry->loaded = TRUE;
+		entry->node = json_from_string(file_contents, &error);
+		if (error)
+		{
+			msgwin_status_add(_("JSON parsing error: initialization_options_file: %s"), error->message);
+			g_error_free(error);
+		}
+		g_free(file_contents);
+	}
+
+	g_hash_table_insert(json_file_cache, g_strdup(fname), entry);
+
+	return entry;
+}
+
+
 JsonNode *lsp_utils_parse_json_file(const gchar *utf8_fname, const gchar *fallback_json)
 {
 	JsonNode *json_node = NULL;
-	gchar *file_contents;
+	JsonFileEntry *entry;
 	gchar *fname;
-	gboolean success;
 	GError *error = NULL;
 
 	if (!EMPTY(fallback_json))
@@ -756,23 +1746,15 @@ JsonNode *lsp_utils_parse_json_file(const gchar *utf8_fname, const gchar *fallba
 	if (!fname)
 		return json_node;
 
-	success = g_file_get_contents(fname, &file_contents, NULL, NULL);
+	entry = get_json_file(fname);
 	g_free(fname);
 
-	if (!success)
+	if (!entry->loaded)
 		return json_node;
 
 	json_node_free(json_node);
 
-	json_node = json_from_string(file_contents, &error);
-	if (error)
-	{
-		msgwin_status_add(_("JSON parsing error: initialization_options_file: %s"), error->message);
-		g_error_free(error);
-	}
-
-	g_free(file_contents);
-	return json_node;
+	return entry->node ? json_node_copy(entry->node) : NULL;
 }
 
 
@@ -820,7 +1802,93 @@ ScintillaObject *lsp_utils_new_sci_from_file(const gchar *utf8_fname)
 }
 
 
-gchar *lsp_utils_get_current_iden(GeanyDocument *doc, gint current_pos, const gchar *wordchars)
+static const gchar *find_eol(const gchar *p, const gchar *end)
+{
+	while (p < end && *p != '\n' && *p != '\r')
+		p++;
+	return p;
+}
+
+
+static gint compare_line_indices(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	GArray *lines = user_data;
+	guint line_a = g_array_index(lines, guint, *(const guint *)a);
+	guint line_b = g_array_index(lines, guint, *(const guint *)b);
+
+	return line_a < line_b ? -1 : line_a > line_b;
+}
+
+
+/* Returns the text of the given 0-based lines of the file (without EOLs), in
+ * the order of lines, reading the file only once and without creating an
+ * editor for it. Lines past the end of the file, or of unreadable files, are
+ * NULL. */
+GPtrArray *lsp_utils_get_file_lines(const gchar *utf8_fname, GArray *lines)
+{
+	GPtrArray *ret = g_ptr_array_new_full(lines->len, g_free);
+	GMappedFile *file = NULL;
+	const gchar *p, *end;
+	GArray *order;
+	gchar *fname;
+	guint line = 0;
+	guint i;
+
+	g_ptr_array_set_size(ret, lines->len);
+
+	fname = utils_get_locale_from_utf8(utf8_fname);
+	if (fname)
+		file = g_mapped_file_new(fname, FALSE, NULL);
+	g_free(fname);
+	if (!file)
+		return ret;
+
+	// empty files have no contents
+	p = g_mapped_file_get_contents(file);
+	if (!p)
+		p = "";
+	end = p + g_mapped_file_get_length(file);
+
+	order = g_array_sized_new(FALSE, FALSE, sizeof(guint), lines->len);
+	for (i = 0; i < lines->len; i++)
+		g_array_append_val(order, i);
+	g_array_sort_with_data(order, compare_line_indices, lines);
+
+	for (i = 0; i < order->len; i++)
+	{
+		guint index = g_array_index(order, guint, i);
+		guint wanted = g_array_index(lines, guint, index);
+		gchar *str;
+
+		while (line < wanted && p < end)
+		{
+			p = find_eol(p, end);
+			if (p < end && *p == '\r')
+				p++;
+			if (p < end && *p == '\n')
+				p++;
+			line++;
+		}
+
+		if (line < wanted)
+			break;
+
+		str = g_strndup(p, find_eol(p, end) - p);
+		if (!g_utf8_validate(str, -1, NULL))
+			SETPTR(str, g_utf8_make_valid(str, -1));
+		ret->pdata[index] = str;
+	}
+
+	g_array_free(order, TRUE);
+	g_mapped_file_unref(file);
+
+	return ret;
+}
+
+
+/* start and end positions of the identifier at current_pos, FALSE if there's none */
+gboolean lsp_utils_get_current_iden_range(GeanyDocument *doc, gint current_pos, const gchar *wordchars,
+	gint *start, gint *end)
 {
 	ScintillaObject *sci = doc->editor->sci;
 	gint start_pos, end_pos, pos;
@@ -857,10 +1925,21 @@ gchar *lsp_utils_get_current_iden(GeanyDocument *doc, gint current_pos, const gc
 	}
 	end_pos = pos;
 
-	if (start_pos == end_pos)
+	*start = start_pos;
+	*end = end_pos;
+
+	return start_pos != end_pos;
+}
+
+
+gchar *lsp_utils_get_current_iden(GeanyDocument *doc, gint current_pos, const gchar *wordchars)
+{
+	gint start_pos, end_pos;
+
+	if (!lsp_utils_get_current_iden_range(doc, current_pos, wordchars, &start_pos, &end_pos))
 		return NULL;
 
-	return sci_get_contents_range(sci, start_pos, end_pos);
+	return sci_get_contents_range(doc->editor->sci, start_pos, end_pos);
 }
 
 
@@ -959,7 +2038,29 @@ void lsp_utils_save_all_docs(void)
 }
 
 
-static gboolean content_matches_pattern(const gchar *dirname, gchar **patterns)
+#define ROOT_MARKER_CACHE_TTL (60 * G_USEC_PER_SEC)
+
+typedef struct
+{
+	gboolean matches;
+	gint64 time;
+} RootMarkerEntry;
+
+// "dirname\npatterns" -> RootMarkerEntry
+static GHashTable *root_marker_cache;
+
+
+gboolean lsp_utils_pattern_match(GPatternSpec *pattern, const gchar *str)
+{
+#if GLIB_CHECK_VERSION(2, 70, 0)
+	return g_pattern_spec_match_string(pattern, str);
+#else
+	return g_pattern_match_string(pattern, str);
+#endif
+}
+
+
+static gboolean content_matches_pattern(const gchar *dirname, GPtrArray *patterns)
 {
 	gboolean success = FALSE;
 	const gchar *filename;
@@ -971,11 +2072,12 @@ static gboolean content_matches_pattern(const gchar *dirname, gchar **patterns)
 
 	while ((filename = g_dir_read_name(dir)) && !success)
 	{
-		gchar **pattern;
+		GPatternSpec *pattern;
+		guint i;
 
-		foreach_strv(pattern, patterns)
+		foreach_ptr_array(pattern, i, patterns)
 		{
-			if (g_pattern_match_simple(*pattern, filename))
+			if (lsp_utils_pattern_match(pattern, filename))
 			{
 				success = TRUE;
 				break;
@@ -989,11 +2091,60 @@ static gboolean content_matches_pattern(const gchar *dirname, gchar **patterns)
 }
 
 
+/* Whether directories contain project root markers - shared by all servers with
+ * the same marker patterns. Entries expire so markers created outside Geany
+ * are found eventually. */
+static gboolean dir_matches_pattern(const gchar *dirname, GPtrArray *patterns, const gchar *patterns_key)
+{
+	gint64 now = g_get_monotonic_time();
+	gchar *key = g_strconcat(dirname, "\n", patterns_key, NULL);
+	RootMarkerEntry *entry;
+
+	if (!root_marker_cache)
+		root_marker_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	entry = g_hash_table_lookup(root_marker_cache, key);
+	if (entry && now - entry->time < ROOT_MARKER_CACHE_TTL)
+	{
+		g_free(key);
+		return entry->matches;
+	}
+
+	entry = g_new(RootMarkerEntry, 1);
+	entry->matches = content_matches_pattern(dirname, patterns);
+	entry->time = now;
+	g_hash_table_insert(root_marker_cache, key, entry);
+
+	return entry->matches;
+}
+
+
+// e.g. after saving a file which might be a new marker
+void lsp_utils_invalidate_project_root_cache(const gchar *dirname)
+{
+	GHashTableIter iter;
+	gchar *prefix;
+	gpointer key;
+
+	if (!root_marker_cache || !dirname)
+		return;
+
+	prefix = g_strconcat(dirname, "\n", NULL);
+	g_hash_table_iter_init(&iter, root_marker_cache);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		if (g_str_has_prefix(key, prefix))
+			g_hash_table_iter_remove(&iter);
+	}
+	g_free(prefix);
+}
+
+
 gchar *lsp_utils_find_project_root(GeanyDocument *doc, LspServerConfig *cfg)
 {
 	gchar *dirname;
 
-	if (!doc || !cfg || !cfg->project_root_marker_patterns || !doc->real_path)
+	if (!doc || !cfg || !cfg->project_root_marker_specs || !doc->real_path)
 		return NULL;
 
 	dirname = g_path_get_dirname(doc->real_path);
@@ -1002,7 +2153,7 @@ gchar *lsp_utils_find_project_root(GeanyDocument *doc, LspServerConfig *cfg)
 	{
 		gchar *new_dirname;
 
-		if (content_matches_pattern(dirname, cfg->project_root_marker_patterns))
+		if (dir_matches_pattern(dirname, cfg->project_root_marker_specs, cfg->project_root_marker_key))
 			break;
 
 		new_dirname = g_path_get_dirname(dirname);
@@ -1144,3 +2295,38 @@ gchar *lsp_utils_process_snippet(const gchar *snippet, GSList **positions)
 
 	return g_string_free(res, FALSE);
 }
+
+
+/* appends val with tabs, newlines and backslashes escaped the way
+ * g_strcompress() reads them back */
+void lsp_utils_append_escaped(GString *str, const gchar *val)
+{
+	const gchar *p;
+
+	for (p = val ? val : ""; *p; p++)
+	{
+		if (*p == '\\')
+			g_string_append(str, "\\\\");
+		else if (*p == '\t')
+			g_string_append(str, "\\t");
+		else if (*p == '\n')
+			g_string_append(str, "\\n");
+		else if (*p == '\r')
+			g_string_append(str, "\\r");
+		else
+			g_string_append_c(str, *p);
+	}
+}
+
+
+/* approximate heap memory taken by an optional string, for memory statistics */
+gsize lsp_utils_get_string_size(const gchar *str)
+{
+	return str ? strlen(str) + 1 : 0;
+}
+
+
+gsize lsp_utils_get_variant_size(GVariant *variant)
+{
+	return variant ? g_variant_get_size(variant) : 0;
+}
@@ -42,10 +42,18 @@ typedef enum
 } LspProjectConfigurationType;
 
 
+typedef enum
+{
+	LspPositionEncodingUtf16,  // LSP default
+	LspPositionEncodingUtf8,
+	LspPositionEncodingUtf32
+} LspPositionEncoding;
+
+
 typedef struct
 {
 	gint64 line;       // zero-based
-	gint64 character;  // pos. on line - number of code units in UTF-16, zero-based
+	gint64 character;  // pos. on line - number of code units in negotiated encoding, zero-based
 } LspPosition;
 
 
@@ -72,12 +80,17 @@ typedef struct
 
 typedef gpointer (* LspUtilsCmpFn)(const gchar *s1, const gchar *s2);
 
+typedef void (*LspWorkspaceEditCallback)(guint files_done, guint files_total, gboolean finished,
+	gpointer user_data);
+
 
 void lsp_utils_free_lsp_text_edit(LspTextEdit *e);
 void lsp_utils_free_lsp_location(LspLocation *e);
 
 LspPosition lsp_utils_scintilla_pos_to_lsp(ScintillaObject *sci, gint sci_pos);
 gint lsp_utils_lsp_pos_to_scintilla(ScintillaObject *sci, LspPosition lsp_pos);
+void lsp_utils_invalidate_line_index(ScintillaObject *sci, gint line, gint lines_added);
+void lsp_utils_set_position_encoding(ScintillaObject *sci, LspPositionEncoding encoding);
 
 gchar *lsp_utils_get_doc_uri(GeanyDocument *doc);
 gchar *lsp_utils_get_lsp_lang_id(GeanyDocument *doc);
@@ -98,6 +111,14 @@ gboolean lsp_utils_is_lsp_disabled_for_project(void);
 LspPosition lsp_utils_parse_pos(GVariant *variant);
 LspRange lsp_utils_parse_range(GVariant *variant);
 
+#define LSP_UTILS_VARDICT_MAX 8
+
+GVariant *lsp_utils_new_vardict(guint n, const gchar **keys, GVariant **values);
+GVariant *lsp_utils_new_text_document_position(const gchar *doc_uri, LspPosition pos,
+	const gchar *extra_key, GVariant *extra_value);
+GVariant *lsp_utils_new_content_change(LspPosition start, LspPosition end, gint range_length,
+	const gchar *text);
+
 LspTextEdit *lsp_utils_parse_text_edit(GVariant *variant);
 GPtrArray *lsp_utils_parse_text_edits(GVariantIter *iter);
 
@@ -107,18 +128,27 @@ GPtrArray *lsp_utils_parse_locations(GVariantIter *iter);
 void lsp_utils_apply_text_edit(ScintillaObject *sci, LspTextEdit *e, gboolean process_snippets);
 void lsp_utils_apply_text_edits(ScintillaObject *sci, LspTextEdit *edit, GPtrArray *edits,
 	gboolean process_snippets);
-gboolean lsp_utils_apply_workspace_edit(GVariant *workspace_edit);
+gboolean lsp_utils_is_applying_edits(ScintillaObject *sci);
+gboolean lsp_utils_is_applying_workspace_edit(void);
+GVariant *lsp_utils_merge_workspace_edits(GPtrArray *workspace_edits, GArray *skipped);
+gboolean lsp_utils_apply_workspace_edit_full(GVariant *workspace_edit, LspPositionEncoding encoding,
+	LspWorkspaceEditCallback callback, gpointer user_data);
 
 gboolean lsp_utils_wrap_string(gchar *string, gint wrapstart);
 
+gchar *lsp_utils_utf8_strdown(const gchar *str);
 gpointer lsp_utils_lowercase_cmp(LspUtilsCmpFn cmp, const gchar *s1, const gchar *s2);
 
 GVariant *lsp_utils_parse_json_file_as_variant(const gchar *utf8_fname, const gchar *fallback_json);
 JsonNode *lsp_utils_parse_json_file(const gchar *utf8_fname, const gchar *fallback_json);
+gint64 lsp_utils_get_file_mtime(const gchar *locale_fname);
 
 ScintillaObject *lsp_utils_new_sci_from_file(const gchar *utf8_fname);
+GPtrArray *lsp_utils_get_file_lines(const gchar *utf8_fname, GArray *lines);
 
 gchar *lsp_utils_get_current_iden(GeanyDocument *doc, gint current_pos, const gchar *wordchars);
+gboolean lsp_utils_get_current_iden_range(GeanyDocument *doc, gint current_pos, const gchar *wordchars,
+	gint *start, gint *end);
 
 gint lsp_utils_set_indicator_style(ScintillaObject *sci, const gchar *style_str);
 
@@ -126,8 +156,15 @@ gchar *lsp_utils_get_relative_path(const gchar *utf8_parent, const gchar *utf8_d
 
 void lsp_utils_save_all_docs(void);
 
+gboolean lsp_utils_pattern_match(GPatternSpec *pattern, const gchar *str);
 gchar *lsp_utils_find_project_root(GeanyDocument *doc, LspServerConfig *cfg);
+void lsp_utils_invalidate_project_root_cache(const gchar *dirname);
 
 gchar *lsp_utils_process_snippet(const gchar *snippet, GSList **positions);
 
+void lsp_utils_append_escaped(GString *str, const gchar *val);
+
+gsize lsp_utils_get_string_size(const gchar *str);
+gsize lsp_utils_get_variant_size(GVariant *variant);
+
 #endif  /* LSP_UTILS_H */
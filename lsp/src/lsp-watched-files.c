@@ -0,0 +1,522 @@
+/*
+ * Copyright 2024 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* workspace/didChangeWatchedFiles support. File events come from the
+ * directory monitors of the file index, bursts of events (checkouts, builds,
+ * multi-file edits) are merged per file and sent in a single notification. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-watched-files.h"
+#include "lsp-file-index.h"
+#include "lsp-rpc.h"
+#include "lsp-utils.h"
+
+#include <jsonrpc-glib.h>
+#include <string.h>
+
+#define NOTIFY_DELAY 300
+
+#define WATCH_KIND_CREATE 1
+#define WATCH_KIND_CHANGE 2
+#define WATCH_KIND_DELETE 4
+
+typedef enum
+{
+	FileChangeNone,
+	FileChangeCreated,
+	FileChangeChanged,
+	FileChangeDeleted
+} FileChangeType;
+
+
+typedef struct
+{
+	GPtrArray *patterns;  // GPatternSpec
+	gchar *base_path;  // locale, without trailing separator; NULL for absolute patterns
+	guint kind;
+} FileWatcher;
+
+
+typedef struct
+{
+	gchar *id;
+	GPtrArray *watchers;  // FileWatcher
+} WatchRegistration;
+
+
+extern GeanyPlugin *geany_plugin;
+extern GeanyData *geany_data;
+
+static GPtrArray *watching_servers = NULL;
+
+
+static void file_watcher_free(FileWatcher *watcher)
+{
+	g_ptr_array_free(watcher->patterns, TRUE);
+	g_free(watcher->base_path);
+	g_free(watcher);
+}
+
+
+static void registration_free(WatchRegistration *reg)
+{
+	g_ptr_array_free(reg->watchers, TRUE);
+	g_free(reg->id);
+	g_free(reg);
+}
+
+
+// "*.{c,h}" -> "*.c", "*.h"; nested braces aren't allowed by the LSP glob syntax
+static void expand_braces(const gchar *glob, GPtrArray *result)
+{
+	const gchar *open = strchr(glob, '{');
+	const gchar *close = open ? strchr(open, '}') : NULL;
+	const gchar *start, *p;
+
+	if (!close)
+	{
+		g_ptr_array_add(result, g_strdup(glob));
+		return;
+	}
+
+	start = open + 1;
+	for (p = start; p <= close; p++)
+	{
+		if (*p == ',' || p == close)
+		{
+			gchar *alt = g_strdup_printf("%.*s%.*s%s", (gint)(open - glob), glob,
+				(gint)(p - start), start, close + 1);
+
+			expand_braces(alt, result);
+			g_free(alt);
+			start = p + 1;
+		}
+	}
+}
+
+
+static void add_glob(FileWatcher *watcher, const gchar *glob)
+{
+	GPtrArray *globs = g_ptr_array_new_with_free_func(g_free);
+	gchar *str;
+	guint i;
+
+	expand_braces(glob, globs);
+
+	foreach_ptr_array(str, i, globs)
+	{
+		gchar **parts;
+		gchar *no_dirs;
+
+		// '*' of GPatternSpec matches '/' too so "**" works as expected except
+		// for matching zero directories in "**/" which needs another pattern
+		g_ptr_array_add(watcher->patterns, g_pattern_spec_new(str));
+
+		parts = g_strsplit(str, "**/", -1);
+		no_dirs = g_strjoinv("", parts);
+		if (g_strcmp0(no_dirs, str) != 0)
+			g_ptr_array_add(watcher->patterns, g_pattern_spec_new(no_dirs));
+		g_free(no_dirs);
+		g_strfreev(parts);
+	}
+
+	g_ptr_array_free(globs, TRUE);
+}
+
+
+static gchar *get_workspace_base_path(LspServer *srv)
+{
+	gchar *base_path = srv->root ? g_strdup(srv->root) : lsp_utils_get_project_base_path();
+
+	if (!base_path)
+		return NULL;
+
+	SETPTR(base_path, utils_get_locale_from_utf8(base_path));
+	return base_path;
+}
+
+
+static FileWatcher *parse_watcher(LspServer *srv, GVariant *variant)
+{
+	FileWatcher *watcher;
+	const gchar *pattern = NULL;
+	const gchar *base_uri = NULL;
+	gint64 kind = WATCH_KIND_CREATE | WATCH_KIND_CHANGE | WATCH_KIND_DELETE;
+	gchar *base_path = NULL;
+
+	if (JSONRPC_MESSAGE_PARSE(variant, "globPattern", JSONRPC_MESSAGE_GET_STRING(&pattern)))
+	{
+		if (!g_path_is_absolute(pattern))
+			base_path = get_workspace_base_path(srv);
+	}
+	// RelativePattern with baseUri being either URI or WorkspaceFolder
+	else if (!JSONRPC_MESSAGE_PARSE(variant,
+			"globPattern", "{",
+				"baseUri", JSONRPC_MESSAGE_GET_STRING(&base_uri),
+				"pattern", JSONRPC_MESSAGE_GET_STRING(&pattern),
+			"}") &&
+		!JSONRPC_MESSAGE_PARSE(variant,
+			"globPattern", "{",
+				"baseUri", "{",
+					"uri", JSONRPC_MESSAGE_GET_STRING(&base_uri),
+				"}",
+				"pattern", JSONRPC_MESSAGE_GET_STRING(&pattern),
+			"}"))
+		return NULL;
+
+	if (base_uri)
+	{
+		base_path = lsp_utils_get_real_path_from_uri_locale(base_uri);
+		if (!base_path)
+			return NULL;
+	}
+
+	if (base_path && strlen(base_path) > 1 && g_str_has_suffix(base_path, G_DIR_SEPARATOR_S))
+		base_path[strlen(base_path) - 1] = '\0';
+
+	JSONRPC_MESSAGE_PARSE(variant, "kind", JSONRPC_MESSAGE_GET_INT64(&kind));
+
+	watcher = g_new0(FileWatcher, 1);
+	watcher->patterns = g_ptr_array_new_with_free_func((GDestroyNotify)g_pattern_spec_free);
+	watcher->base_path = base_path;
+	watcher->kind = kind;
+	add_glob(watcher, pattern);
+
+	return watcher;
+}
+
+
+static gboolean watcher_matches(FileWatcher *watcher, const gchar *path)
+{
+	const gchar *rel_path = path;
+	GPatternSpec *pattern;
+	guint i;
+
+	if (watcher->base_path)
+	{
+		gsize base_len = strlen(watcher->base_path);
+
+		if (!g_str_has_prefix(path, watcher->base_path) || path[base_len] != G_DIR_SEPARATOR)
+			return FALSE;
+		rel_path = path + base_len + 1;
+	}
+
+	foreach_ptr_array(pattern, i, watcher->patterns)
+	{
+		if (lsp_utils_pattern_match(pattern, rel_path))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+static gboolean is_watched(LspServer *srv, const gchar *path, FileChangeType type)
+{
+	guint kind = type == FileChangeCreated ? WATCH_KIND_CREATE :
+		type == FileChangeDeleted ? WATCH_KIND_DELETE : WATCH_KIND_CHANGE;
+	WatchRegistration *reg;
+	guint i;
+
+	foreach_ptr_array(reg, i, srv->watch_registrations)
+	{
+		FileWatcher *watcher;
+		guint j;
+
+		foreach_ptr_array(watcher, j, reg->watchers)
+		{
+			if ((watcher->kind & kind) && watcher_matches(watcher, path))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+static gboolean notify_changes(gpointer user_data)
+{
+	LspServer *srv = user_data;
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer key, value;
+	GVariantDict dict;
+	GVariant *node;
+
+	srv->watched_changes_source = 0;
+
+	if (!srv->watched_changes || g_hash_table_size(srv->watched_changes) == 0 || !srv->rpc)
+		return G_SOURCE_REMOVE;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+
+	g_hash_table_iter_init(&iter, srv->watched_changes);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		GVariant *change = JSONRPC_MESSAGE_NEW (
+			"uri", JSONRPC_MESSAGE_PUT_STRING(key),
+			"type", JSONRPC_MESSAGE_PUT_INT32(GPOINTER_TO_INT(value))
+		);
+
+		g_variant_builder_add(&builder, "v", change);
+		g_variant_unref(change);
+	}
+
+	g_variant_dict_init(&dict, NULL);
+	g_variant_dict_insert_value(&dict, "changes", g_variant_builder_end(&builder));
+	node = g_variant_take_ref(g_variant_dict_end(&dict));
+
+	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
+
+	lsp_rpc_notify(srv, "workspace/didChangeWatchedFiles", node, NULL, NULL);
+
+	g_hash_table_remove_all(srv->watched_changes);
+	g_variant_unref(node);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void queue_change(LspServer *srv, const gchar *uri, FileChangeType type)
+{
+	gpointer pending;
+
+	if (!srv->watched_changes)
+		srv->watched_changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (g_hash_table_lookup_extended(srv->watched_changes, uri, NULL, &pending))
+	{
+		FileChangeType prev = GPOINTER_TO_INT(pending);
+
+		if (prev == FileChangeCreated)
+		{
+			// temporary file which the server never needs to know about
+			if (type == FileChangeDeleted)
+				g_hash_table_remove(srv->watched_changes, uri);
+			return;
+		}
+		else if (prev == FileChangeChanged && type != FileChangeDeleted)
+			return;
+		// deleted and created again, e.g. by editors saving atomically
+		else if (prev == FileChangeDeleted && type != FileChangeDeleted)
+			type = FileChangeChanged;
+	}
+
+	g_hash_table_insert(srv->watched_changes, g_strdup(uri), GINT_TO_POINTER(type));
+
+	// not restarted by further events so a continuous stream of changes
+	// is still reported periodically
+	if (srv->watched_changes_source == 0)
+		srv->watched_changes_source = plugin_timeout_add(geany_plugin, NOTIFY_DELAY, notify_changes, srv);
+}
+
+
+static void file_changed(const gchar *path, FileChangeType type)
+{
+	LspServer *srv;
+	gchar *uri = NULL;
+	guint i;
+
+	if (!watching_servers)
+		return;
+
+	foreach_ptr_array(srv, i, watching_servers)
+	{
+		if (!is_watched(srv, path, type))
+			continue;
+
+		if (!uri)
+			uri = g_filename_to_uri(path, NULL, NULL);
+		if (uri)
+			queue_change(srv, uri, type);
+	}
+
+	g_free(uri);
+}
+
+
+static void on_file_event(const gchar *path, GFileMonitorEvent event, G_GNUC_UNUSED gpointer user_data)
+{
+	FileChangeType type = FileChangeNone;
+
+	switch (event)
+	{
+		case G_FILE_MONITOR_EVENT_CREATED:
+			type = FileChangeCreated;
+			break;
+		case G_FILE_MONITOR_EVENT_DELETED:
+			type = FileChangeDeleted;
+			break;
+		case G_FILE_MONITOR_EVENT_CHANGED:
+		case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+			type = FileChangeChanged;
+			break;
+		default:
+			break;
+	}
+
+	if (type != FileChangeNone)
+		file_changed(path, type);
+}
+
+
+void lsp_watched_files_file_written(const gchar *locale_path)
+{
+	// also reported by the monitors when inside the project but unopened
+	// files may be written outside of it
+	file_changed(locale_path, FileChangeChanged);
+}
+
+
+gboolean lsp_watched_files_register(LspServer *srv, GVariant *params)
+{
+	GVariantIter *iter = NULL;
+	GVariant *registration = NULL;
+	gboolean registered = FALSE;
+
+	JSONRPC_MESSAGE_PARSE(params,
+		"registrations", JSONRPC_MESSAGE_GET_ITER(&iter)
+	);
+
+	if (!iter)
+		return FALSE;
+
+	while (g_variant_iter_loop(iter, "v", &registration))
+	{
+		const gchar *id = NULL;
+		const gchar *method = NULL;
+		GVariantIter *watchers_iter = NULL;
+		WatchRegistration *reg;
+		GVariant *watcher_variant = NULL;
+
+		JSONRPC_MESSAGE_PARSE(registration,
+			"id", JSONRPC_MESSAGE_GET_STRING(&id),
+			"method", JSONRPC_MESSAGE_GET_STRING(&method)
+		);
+
+		if (g_strcmp0(method, "workspace/didChangeWatchedFiles") != 0)
+			continue;
+
+		JSONRPC_MESSAGE_PARSE(registration,
+			"registerOptions", "{",
+				"watchers", JSONRPC_MESSAGE_GET_ITER(&watchers_iter),
+			"}"
+		);
+
+		if (!watchers_iter)
+			continue;
+
+		reg = g_new0(WatchRegistration, 1);
+		reg->id = g_strdup(id);
+		reg->watchers = g_ptr_array_new_with_free_func((GDestroyNotify)file_watcher_free);
+
+		while (g_variant_iter_loop(watchers_iter, "v", &watcher_variant))
+		{
+			FileWatcher *watcher = parse_watcher(srv, watcher_variant);
+
+			if (watcher)
+				g_ptr_array_add(reg->watchers, watcher);
+		}
+		g_variant_iter_free(watchers_iter);
+
+		if (!srv->watch_registrations)
+			srv->watch_registrations = g_ptr_array_new_with_free_func((GDestroyNotify)registration_free);
+		g_ptr_array_add(srv->watch_registrations, reg);
+		registered = TRUE;
+	}
+	g_variant_iter_free(iter);
+
+	if (registered)
+	{
+		if (!watching_servers)
+			watching_servers = g_ptr_array_new();
+		if (!g_ptr_array_find(watching_servers, srv, NULL))
+			g_ptr_array_add(watching_servers, srv);
+
+		lsp_file_index_set_listener(on_file_event, NULL);
+	}
+
+	return registered;
+}
+
+
+gboolean lsp_watched_files_unregister(LspServer *srv, GVariant *params)
+{
+	GVariantIter *iter = NULL;
+	GVariant *unregistration = NULL;
+	gboolean unregistered = FALSE;
+
+	// the misspelling comes from the specification
+	JSONRPC_MESSAGE_PARSE(params,
+		"unregisterations", JSONRPC_MESSAGE_GET_ITER(&iter)
+	);
+
+	if (!iter)
+		return FALSE;
+
+	while (g_variant_iter_loop(iter, "v", &unregistration))
+	{
+		const gchar *id = NULL;
+		const gchar *method = NULL;
+		WatchRegistration *reg;
+		guint i;
+
+		JSONRPC_MESSAGE_PARSE(unregistration,
+			"id", JSONRPC_MESSAGE_GET_STRING(&id),
+			"method", JSONRPC_MESSAGE_GET_STRING(&method)
+		);
+
+		if (g_strcmp0(method, "workspace/didChangeWatchedFiles") != 0 || !srv->watch_registrations)
+			continue;
+
+		foreach_ptr_array(reg, i, srv->watch_registrations)
+		{
+			if (g_strcmp0(reg->id, id) == 0)
+			{
+				g_ptr_array_remove_index(srv->watch_registrations, i);
+				unregistered = TRUE;
+				break;
+			}
+		}
+	}
+	g_variant_iter_free(iter);
+
+	return unregistered;
+}
+
+
+void lsp_watched_files_free(LspServer *srv)
+{
+	if (watching_servers)
+		g_ptr_array_remove(watching_servers, srv);
+
+	if (srv->watched_changes_source)
+		g_source_remove(srv->watched_changes_source);
+	srv->watched_changes_source = 0;
+
+	if (srv->watched_changes)
+		g_hash_table_destroy(srv->watched_changes);
+	srv->watched_changes = NULL;
+
+	if (srv->watch_registrations)
+		g_ptr_array_free(srv->watch_registrations, TRUE);
+	srv->watch_registrations = NULL;
+}
@@ -27,14 +27,32 @@
 #include "lsp-rpc.h"
 
 
+// folder changes of restored sessions or multi-file operations are sent together
+#define NOTIFY_DELAY 200
+
+
+extern GeanyPlugin *geany_plugin;
 extern GeanyData *geany_data;
 
 
+static void clear_pending(LspServer *srv)
+{
+	if (srv->wks_folder_source)
+		g_source_remove(srv->wks_folder_source);
+	srv->wks_folder_source = 0;
+
+	if (srv->wks_folder_pending)
+		g_hash_table_destroy(srv->wks_folder_pending);
+	srv->wks_folder_pending = NULL;
+}
+
+
 void lsp_workspace_folders_init(LspServer *srv)
 {
 	if (!srv->wks_folder_table)
 		srv->wks_folder_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	g_hash_table_remove_all(srv->wks_folder_table);
+	clear_pending(srv);
 }
 
 
@@ -43,47 +61,91 @@ void lsp_workspace_folders_free(LspServer *srv)
 	if (srv->wks_folder_table)
 		g_hash_table_destroy(srv->wks_folder_table);
 	srv->wks_folder_table = NULL;
+	clear_pending(srv);
 }
 
 
-static void notify_root_change(LspServer *srv, const gchar *root, gboolean added)
+static void put_folders(GVariantBuilder *builder, GHashTable *pending, gboolean added)
 {
-	gchar *root_uri = g_filename_to_uri(root, NULL, NULL);
-	GVariant *node;
+	GHashTableIter iter;
+	gpointer key, value;
 
-	if (added)
-	{
-		node = JSONRPC_MESSAGE_NEW (
-			"event", "{",
-				"added", "[", "{",
-					"uri", JSONRPC_MESSAGE_PUT_STRING(root_uri),
-					"name", JSONRPC_MESSAGE_PUT_STRING(root),
-				"}", "]",
-				"removed", "[",
-				"]",
-			"}"
-		);
-	}
-	else
+	g_variant_builder_init(builder, G_VARIANT_TYPE("av"));
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &key, &value))
 	{
-		node = JSONRPC_MESSAGE_NEW (
-			"event", "{",
-				"added", "[",
-				"]",
-				"removed", "[", "{",
-					"uri", JSONRPC_MESSAGE_PUT_STRING(root_uri),
-					"name", JSONRPC_MESSAGE_PUT_STRING(root),
-				"}", "]",
-			"}"
+		GVariant *folder;
+		gchar *root_uri;
+
+		if (GPOINTER_TO_INT(value) != added)
+			continue;
+
+		root_uri = g_filename_to_uri(key, NULL, NULL);
+		folder = JSONRPC_MESSAGE_NEW (
+			"uri", JSONRPC_MESSAGE_PUT_STRING(root_uri),
+			"name", JSONRPC_MESSAGE_PUT_STRING(key)
 		);
+		g_variant_builder_add(builder, "v", folder);
+		g_variant_unref(folder);
+		g_free(root_uri);
 	}
+}
+
+
+static gboolean notify_pending_changes(gpointer user_data)
+{
+	LspServer *srv = user_data;
+	GVariantBuilder added, removed;
+	GVariantDict event, dict;
+	GVariant *node;
+
+	srv->wks_folder_source = 0;
+
+	if (!srv->wks_folder_pending || g_hash_table_size(srv->wks_folder_pending) == 0)
+		return G_SOURCE_REMOVE;
+
+	put_folders(&added, srv->wks_folder_pending, TRUE);
+	put_folders(&removed, srv->wks_folder_pending, FALSE);
+
+	g_variant_dict_init(&event, NULL);
+	g_variant_dict_insert_value(&event, "added", g_variant_builder_end(&added));
+	g_variant_dict_insert_value(&event, "removed", g_variant_builder_end(&removed));
+
+	g_variant_dict_init(&dict, NULL);
+	g_variant_dict_insert_value(&dict, "event", g_variant_dict_end(&event));
+	node = g_variant_take_ref(g_variant_dict_end(&dict));
 
 	//printf("%s\n\n\n", lsp_utils_json_pretty_print(node));
 
 	lsp_rpc_notify(srv, "workspace/didChangeWorkspaceFolders", node, NULL, NULL);
 
-	g_free(root_uri);
+	g_hash_table_remove_all(srv->wks_folder_pending);
 	g_variant_unref(node);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void notify_root_change(LspServer *srv, const gchar *root, gboolean added)
+{
+	gpointer pending_added;
+
+	if (!srv->wks_folder_pending)
+		srv->wks_folder_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	// added and removed again (or the opposite) before notifying - no change
+	if (g_hash_table_lookup_extended(srv->wks_folder_pending, root, NULL, &pending_added) &&
+		GPOINTER_TO_INT(pending_added) != added)
+	{
+		g_hash_table_remove(srv->wks_folder_pending, root);
+		return;
+	}
+
+	g_hash_table_insert(srv->wks_folder_pending, g_strdup(root), GINT_TO_POINTER(added));
+
+	if (srv->wks_folder_source == 0)
+		srv->wks_folder_source = plugin_timeout_add(geany_plugin, NOTIFY_DELAY, notify_pending_changes, srv);
 }
 
 
@@ -91,7 +153,8 @@ void lsp_workspace_folders_add_project_root(LspServer *srv)
 {
 	gchar *base_path;
 
-	if (!srv || !srv->use_workspace_folders)
+	// per-root instances only serve their own root
+	if (!srv || !srv->use_workspace_folders || srv->root)
 		return;
 
 	base_path = lsp_utils_get_project_base_path();
@@ -110,10 +173,11 @@ void lsp_workspace_folders_doc_open(GeanyDocument *doc)
 	if (!doc->real_path || !srv || !srv->use_workspace_folders)
 		return;
 
-	project_base = lsp_utils_get_project_base_path();
+	project_base = srv->root ? g_strdup(srv->root) : lsp_utils_get_project_base_path();
 	if (project_base)
 	{
-		SETPTR(project_base, g_strconcat(project_base, G_DIR_SEPARATOR_S, NULL));
+		if (!g_str_has_suffix(project_base, G_DIR_SEPARATOR_S))
+			SETPTR(project_base, g_strconcat(project_base, G_DIR_SEPARATOR_S, NULL));
 		if (g_str_has_prefix(doc->real_path, project_base))  // already added during initialize
 		{
 			g_free(project_base);
@@ -190,7 +254,6 @@ GPtrArray *lsp_workspace_folders_get(LspServer *srv)
 	project_base = lsp_utils_get_project_base_path();
 	if (project_base)
 		g_ptr_array_add(arr, project_base);
-	g_free(project_base);
 
 	lst = g_hash_table_get_keys(srv->wks_folder_table);
 	foreach_list(node, lst)
@@ -0,0 +1,496 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/* Local index of workspace symbols used by goto anywhere. It is filled from
+ * workspace/symbol results, document symbols and tags of saved and open
+ * documents, and stored per project in the plugin's configuration directory
+ * so it survives restarts. Symbols of a file are replaced whenever the file
+ * is saved and dropped when it is deleted. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "lsp-workspace-index.h"
+#include "lsp-server.h"
+#include "lsp-symbols.h"
+#include "lsp-symbol.h"
+#include "lsp-symbol-kinds.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_HEADER "LSP-INDEX 1"
+
+
+extern GeanyData *geany_data;
+
+static struct
+{
+	gchar *path;  /* locale, NULL when not persisted */
+	GHashTable *files;  /* GHashTable<utf8 file name, GPtrArray<LspSymbol>> */
+	GHashTable *symbols;  /* all indexed symbols, each stored once */
+	GHashTable *complete;  /* files indexed as a whole, not just from workspace/symbol */
+	GHashTable *views;  /* GHashTable<ft_id, GPtrArray<LspSymbol>> built on demand */
+	gboolean dirty;
+} s_index;
+
+
+static guint symbol_hash(gconstpointer v)
+{
+	const LspSymbol *sym = v;
+	const gchar *scope = lsp_symbol_get_scope(sym);
+
+	return g_str_hash(lsp_symbol_get_file(sym)) ^ g_str_hash(lsp_symbol_get_name(sym)) ^
+		(scope ? g_str_hash(scope) : 0) ^ (lsp_symbol_get_line(sym) * 31 + lsp_symbol_get_kind(sym));
+}
+
+
+static gboolean symbol_equal(gconstpointer v1, gconstpointer v2)
+{
+	const LspSymbol *s1 = v1;
+	const LspSymbol *s2 = v2;
+
+	return lsp_symbol_get_line(s1) == lsp_symbol_get_line(s2) &&
+		lsp_symbol_get_kind(s1) == lsp_symbol_get_kind(s2) &&
+		g_strcmp0(lsp_symbol_get_name(s1), lsp_symbol_get_name(s2)) == 0 &&
+		g_strcmp0(lsp_symbol_get_file(s1), lsp_symbol_get_file(s2)) == 0 &&
+		g_strcmp0(lsp_symbol_get_scope(s1), lsp_symbol_get_scope(s2)) == 0;
+}
+
+
+static void ensure_index(void)
+{
+	if (s_index.files)
+		return;
+
+	s_index.files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+		(GDestroyNotify)g_ptr_array_unref);
+	s_index.symbols = g_hash_table_new(symbol_hash, symbol_equal);
+	s_index.complete = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	s_index.views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+		(GDestroyNotify)g_ptr_array_unref);
+}
+
+
+static void index_changed(void)
+{
+	g_hash_table_remove_all(s_index.views);
+	s_index.dirty = TRUE;
+}
+
+
+static gboolean add_symbol(LspSymbol *sym)
+{
+	const gchar *file = lsp_symbol_get_file(sym);
+	GPtrArray *arr;
+
+	if (EMPTY(file) || !lsp_symbol_get_name(sym) || g_hash_table_contains(s_index.symbols, sym))
+		return FALSE;
+
+	arr = g_hash_table_lookup(s_index.files, file);
+	if (!arr)
+	{
+		arr = g_ptr_array_new_with_free_func((GDestroyNotify)lsp_symbol_unref);
+		g_hash_table_insert(s_index.files, g_strdup(file), arr);
+	}
+	g_ptr_array_add(arr, lsp_symbol_ref(sym));
+	g_hash_table_add(s_index.symbols, sym);
+
+	return TRUE;
+}
+
+
+static void remove_file(const gchar *file)
+{
+	GPtrArray *arr = g_hash_table_lookup(s_index.files, file);
+	guint i;
+
+	if (!arr)
+		return;
+
+	for (i = 0; i < arr->len; i++)
+		g_hash_table_remove(s_index.symbols, arr->pdata[i]);
+	g_hash_table_remove(s_index.complete, file);
+	g_hash_table_remove(s_index.files, file);
+}
+
+
+void lsp_workspace_index_add(GPtrArray *symbols)
+{
+	gboolean changed = FALSE;
+	guint i;
+
+	if (!symbols)
+		return;
+
+	ensure_index();
+	for (i = 0; i < symbols->len; i++)
+		changed = add_symbol(symbols->pdata[i]) || changed;
+
+	if (changed)
+		index_changed();
+}
+
+
+/* replaces all symbols of @file */
+static void set_file(const gchar *file, GPtrArray *symbols)
+{
+	guint i;
+
+	ensure_index();
+	remove_file(file);
+	for (i = 0; i < symbols->len; i++)
+		add_symbol(symbols->pdata[i]);
+	g_hash_table_add(s_index.complete, g_strdup(file));
+	index_changed();
+}
+
+
+/* drops the symbols of the deleted file or directory @locale_path */
+void lsp_workspace_index_file_removed(const gchar *locale_path)
+{
+	GPtrArray *removed;
+	GHashTableIter iter;
+	const gchar *indexed;
+	gchar *file, *prefix;
+	guint i;
+
+	if (!s_index.files)
+		return;
+
+	file = utils_get_utf8_from_locale(locale_path);
+	prefix = g_strconcat(file, G_DIR_SEPARATOR_S, NULL);
+	removed = g_ptr_array_new_with_free_func(g_free);
+
+	g_hash_table_iter_init(&iter, s_index.files);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &indexed, NULL))
+	{
+		if (g_strcmp0(indexed, file) == 0 || g_str_has_prefix(indexed, prefix))
+			g_ptr_array_add(removed, g_strdup(indexed));
+	}
+
+	for (i = 0; i < removed->len; i++)
+		remove_file(removed->pdata[i]);
+	if (removed->len > 0)
+		index_changed();
+
+	g_ptr_array_free(removed, TRUE);
+	g_free(prefix);
+	g_free(file);
+}
+
+
+static GPtrArray *tags_to_symbols(GeanyDocument *doc, const gchar *file_name)
+{
+	GPtrArray *symbols = g_ptr_array_new_with_free_func((GDestroyNotify)lsp_symbol_unref);
+	LspSymbolPool *pool = lsp_symbol_pool_new();
+	TMTag *tag;
+	guint i;
+
+	foreach_ptr_array(tag, i, doc->tm_file->tags_array)
+	{
+		glong kind;
+
+		if (tag->type == tm_tag_local_var_t)
+			continue;
+
+		kind = lsp_symbol_kinds_tm_to_lsp(tag->type);
+		g_ptr_array_add(symbols, lsp_symbol_pool_new_symbol(pool, tag->name, "", tag->scope,
+			file_name, doc->file_type->id, kind, tag->line, 0, lsp_symbol_kinds_get_symbol_icon(kind)));
+	}
+	lsp_symbol_pool_unref(pool);
+
+	return symbols;
+}
+
+
+/* indexes document symbols of @doc if known, otherwise its tags */
+static void index_document(GeanyDocument *doc, gboolean replace)
+{
+	gchar *file_name = utils_get_utf8_from_locale(doc->real_path);
+	GPtrArray *symbols;
+
+	ensure_index();
+
+	// files known only from workspace/symbol results miss most of their symbols
+	if (!replace && g_hash_table_contains(s_index.complete, file_name))
+	{
+		g_free(file_name);
+		return;
+	}
+
+	symbols = lsp_symbols_doc_get_cached(doc);
+	if (symbols)
+		set_file(file_name, symbols);
+	else if (doc->tm_file)
+	{
+		symbols = tags_to_symbols(doc, file_name);
+		set_file(file_name, symbols);
+		g_ptr_array_free(symbols, TRUE);
+	}
+
+	g_free(file_name);
+}
+
+
+/* makes sure open documents not seen before are part of the index */
+void lsp_workspace_index_add_open_documents(GeanyFiletypeID ft_id)
+{
+	guint i;
+
+	foreach_document(i)
+	{
+		GeanyDocument *doc = documents[i];
+
+		if (doc->real_path && doc->file_type->id == ft_id)
+			index_document(doc, FALSE);
+	}
+}
+
+
+static void saved_symbols_cb(gpointer user_data)
+{
+	GeanyDocument *doc = user_data;
+
+	if (DOC_VALID(doc) && doc->real_path && lsp_symbols_doc_get_cached(doc))
+		index_document(doc, TRUE);
+}
+
+
+void lsp_workspace_index_document_saved(GeanyDocument *doc)
+{
+	LspServer *srv;
+
+	if (!doc->real_path)
+		return;
+
+	srv = lsp_server_get(doc);
+	if (srv && srv->config.document_symbols_available)
+	{
+		// symbols of large files are requested only when needed
+		if (!lsp_server_is_large_file(srv, doc))
+			lsp_symbols_doc_request(doc, TRUE, saved_symbols_cb, doc);
+	}
+	else
+		index_document(doc, TRUE);
+}
+
+
+/* returns the indexed symbols of the given filetype, the array is owned by
+ * the index and valid until the next change */
+GPtrArray *lsp_workspace_index_get(GeanyFiletypeID ft_id)
+{
+	GHashTableIter iter;
+	GPtrArray *view, *arr;
+
+	ensure_index();
+
+	view = g_hash_table_lookup(s_index.views, GINT_TO_POINTER(ft_id));
+	if (view)
+		return view;
+
+	view = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, s_index.files);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &arr))
+	{
+		guint i;
+
+		for (i = 0; i < arr->len; i++)
+		{
+			LspSymbol *sym = arr->pdata[i];
+
+			if (lsp_symbol_get_ft_id(sym) == ft_id)
+				g_ptr_array_add(view, sym);
+		}
+	}
+	g_hash_table_insert(s_index.views, GINT_TO_POINTER(ft_id), view);
+
+	return view;
+}
+
+
+static gchar *get_index_path(void)
+{
+	GeanyProject *project = geany_data->app->project;
+	gchar *checksum, *name, *path;
+
+	if (!project || !project->file_name)
+		return NULL;
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_MD5, project->file_name, -1);
+	name = g_strconcat(checksum, ".idx", NULL);
+	path = g_build_filename(geany_data->app->configdir, "plugins", PLUGIN, "index", name, NULL);
+
+	g_free(name);
+	g_free(checksum);
+	return path;
+}
+
+
+static void save_index(void)
+{
+	GHashTableIter iter;
+	GPtrArray *arr;
+	gchar *file, *dirname;
+	GString *str;
+
+	if (!s_index.path || !s_index.dirty)
+		return;
+
+	str = g_string_new(INDEX_HEADER"\n");
+	g_hash_table_iter_init(&iter, s_index.files);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &file, (gpointer *) &arr))
+	{
+		guint i;
+
+		g_string_append(str, "F\t");
+		lsp_utils_append_escaped(str, file);
+		g_string_append_c(str, '\n');
+
+		for (i = 0; i < arr->len; i++)
+		{
+			LspSymbol *sym = arr->pdata[i];
+			GeanyFiletype *ft = filetypes_index(lsp_symbol_get_ft_id(sym));
+
+			if (!ft)
+				continue;
+
+			g_string_append_printf(str, "%s\t%ld\t%lu\t%lu\t%d\t", ft->name, lsp_symbol_get_kind(sym),
+				lsp_symbol_get_line(sym), lsp_symbol_get_pos(sym), lsp_symbol_get_icon(sym));
+			lsp_utils_append_escaped(str, lsp_symbol_get_name(sym));
+			g_string_append_c(str, '\t');
+			lsp_utils_append_escaped(str, lsp_symbol_get_scope(sym));
+			g_string_append_c(str, '\t');
+			lsp_utils_append_escaped(str, lsp_symbol_get_detail(sym));
+			g_string_append_c(str, '\n');
+		}
+	}
+
+	dirname = g_path_get_dirname(s_index.path);
+	utils_mkdir(dirname, TRUE);
+	if (!g_file_set_contents(s_index.path, str->str, str->len, NULL))
+		msgwin_status_add(_("Cannot write LSP symbol index %s"), s_index.path);
+	else
+		s_index.dirty = FALSE;
+
+	g_free(dirname);
+	g_string_free(str, TRUE);
+}
+
+
+static void load_index(void)
+{
+	LspSymbolPool *pool;
+	gchar *contents = NULL;
+	gchar *file = NULL;
+	gchar **lines, **line;
+
+	if (!s_index.path || !g_file_get_contents(s_index.path, &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	if (g_strcmp0(lines[0], INDEX_HEADER) != 0)
+	{
+		g_strfreev(lines);
+		return;
+	}
+
+	pool = lsp_symbol_pool_new();
+	for (line = lines + 1; *line; line++)
+	{
+		gchar **fields;
+
+		if (g_str_has_prefix(*line, "F\t"))
+		{
+			gchar *locale_file;
+
+			SETPTR(file, g_strcompress(*line + 2));
+			// files deleted while the index wasn't loaded are dropped
+			locale_file = utils_get_locale_from_utf8(file);
+			if (!g_file_test(locale_file, G_FILE_TEST_EXISTS))
+			{
+				g_free(file);
+				file = NULL;
+				s_index.dirty = TRUE;
+			}
+			g_free(locale_file);
+			continue;
+		}
+
+		fields = g_strsplit(*line, "\t", 8);
+		if (file && g_strv_length(fields) == 8)
+		{
+			GeanyFiletype *ft = filetypes_lookup_by_name(fields[0]);
+
+			if (ft)
+			{
+				gchar *name = g_strcompress(fields[5]);
+				gchar *scope = g_strcompress(fields[6]);
+				gchar *detail = g_strcompress(fields[7]);
+				LspSymbol *sym;
+
+				sym = lsp_symbol_pool_new_symbol(pool, name, detail, scope, file, ft->id,
+					strtol(fields[1], NULL, 10), strtoul(fields[2], NULL, 10),
+					strtoul(fields[3], NULL, 10), strtoul(fields[4], NULL, 10));
+				add_symbol(sym);
+				lsp_symbol_unref(sym);
+
+				g_free(detail);
+				g_free(scope);
+				g_free(name);
+			}
+		}
+		g_strfreev(fields);
+	}
+	lsp_symbol_pool_unref(pool);
+
+	g_free(file);
+	g_strfreev(lines);
+}
+
+
+/* loads the index of the current project */
+void lsp_workspace_index_load(void)
+{
+	lsp_workspace_index_unload();
+
+	ensure_index();
+	s_index.path = get_index_path();
+	s_index.dirty = FALSE;
+	load_index();
+}
+
+
+/* stores the index of the current project and frees it */
+void lsp_workspace_index_unload(void)
+{
+	if (!s_index.files)
+		return;
+
+	save_index();
+
+	g_hash_table_destroy(s_index.views);
+	g_hash_table_destroy(s_index.symbols);
+	g_hash_table_destroy(s_index.complete);
+	g_hash_table_destroy(s_index.files);
+	g_free(s_index.path);
+	memset(&s_index, 0, sizeof(s_index));
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef LSP_WORKSPACE_INDEX_H
+#define LSP_WORKSPACE_INDEX_H 1
+
+#include <geanyplugin.h>
+
+
+void lsp_workspace_index_load(void);
+void lsp_workspace_index_unload(void);
+
+void lsp_workspace_index_add(GPtrArray *symbols);
+void lsp_workspace_index_add_open_documents(GeanyFiletypeID ft_id);
+void lsp_workspace_index_document_saved(GeanyDocument *doc);
+void lsp_workspace_index_file_removed(const gchar *locale_path);
+
+GPtrArray *lsp_workspace_index_get(GeanyFiletypeID ft_id);
+
+#endif  /* LSP_WORKSPACE_INDEX_H */
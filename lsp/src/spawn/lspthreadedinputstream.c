@@ -0,0 +1,377 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "lspthreadedinputstream.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+/* drained buffers bigger than this are released */
+#define MAX_IDLE_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * The reader thread performs blocking reads on the base stream and appends
+ * everything it gets to data. Reads of this stream are served from data;
+ * asynchronous ones are completed in the main context the stream was
+ * created in.
+ *
+ * The reader thread owns a reference to the stream and closes the base
+ * stream once it reaches end of file or an error (i.e. when the server
+ * process terminates).
+ */
+struct _LspThreadedInputStream
+{
+  GInputStream parent_instance;
+
+  GInputStream *base_stream;
+  GMainContext *context;
+
+  GMutex        mutex;
+  GCond         cond;
+  GByteArray   *data;
+  gsize         offset;
+  GError       *error;
+  gboolean      eof;
+
+  /* pending asynchronous read */
+  GTask        *pending;
+  guint8       *pending_buffer;
+  gsize         pending_count;
+  gboolean      dispatch_scheduled;
+
+  GCancellable *cancellable;
+  gulong        cancel_id;
+};
+
+G_DEFINE_TYPE (LspThreadedInputStream, lsp_threaded_input_stream, G_TYPE_INPUT_STREAM)
+
+static gssize   lsp_threaded_input_stream_read        (GInputStream         *stream,
+                                                       void                 *buffer,
+                                                       gsize                 count,
+                                                       GCancellable         *cancellable,
+                                                       GError              **error);
+static void     lsp_threaded_input_stream_read_async  (GInputStream         *stream,
+                                                       void                 *buffer,
+                                                       gsize                 count,
+                                                       int                   io_priority,
+                                                       GCancellable         *cancellable,
+                                                       GAsyncReadyCallback   callback,
+                                                       gpointer              user_data);
+static gssize   lsp_threaded_input_stream_read_finish (GInputStream         *stream,
+                                                       GAsyncResult         *result,
+                                                       GError              **error);
+static gboolean lsp_threaded_input_stream_close       (GInputStream         *stream,
+                                                       GCancellable         *cancellable,
+                                                       GError              **error);
+
+static void
+lsp_threaded_input_stream_finalize (GObject *object)
+{
+  LspThreadedInputStream *self = LSP_THREADED_INPUT_STREAM (object);
+
+  g_object_unref (self->base_stream);
+  g_main_context_unref (self->context);
+  g_byte_array_unref (self->data);
+  g_clear_error (&self->error);
+  g_clear_object (&self->cancellable);
+  g_mutex_clear (&self->mutex);
+  g_cond_clear (&self->cond);
+
+  G_OBJECT_CLASS (lsp_threaded_input_stream_parent_class)->finalize (object);
+}
+
+static void
+lsp_threaded_input_stream_class_init (LspThreadedInputStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  gobject_class->finalize = lsp_threaded_input_stream_finalize;
+
+  stream_class->read_fn = lsp_threaded_input_stream_read;
+  stream_class->read_async = lsp_threaded_input_stream_read_async;
+  stream_class->read_finish = lsp_threaded_input_stream_read_finish;
+  stream_class->close_fn = lsp_threaded_input_stream_close;
+}
+
+static void
+lsp_threaded_input_stream_init (LspThreadedInputStream *self)
+{
+  g_mutex_init (&self->mutex);
+  g_cond_init (&self->cond);
+  self->data = g_byte_array_sized_new (READ_CHUNK_SIZE);
+}
+
+/* called with the mutex held */
+static gboolean
+has_result (LspThreadedInputStream *self)
+{
+  return self->data->len > self->offset || self->eof || self->error;
+}
+
+/* called with the mutex held, returns number of bytes copied, 0 on end of
+ * file and -1 on error */
+static gssize
+take_data (LspThreadedInputStream  *self,
+           guint8                  *buffer,
+           gsize                    count,
+           GError                 **error)
+{
+  gsize available = self->data->len - self->offset;
+
+  if (available > 0)
+    {
+      gsize n = MIN (count, available);
+
+      memcpy (buffer, self->data->data + self->offset, n);
+      self->offset += n;
+
+      if (self->offset == self->data->len)
+        {
+          self->offset = 0;
+
+          if (self->data->len > MAX_IDLE_BUFFER_SIZE)
+            {
+              g_byte_array_unref (self->data);
+              self->data = g_byte_array_sized_new (READ_CHUNK_SIZE);
+            }
+          else
+            g_byte_array_set_size (self->data, 0);
+        }
+
+      return n;
+    }
+
+  if (self->error)
+    {
+      g_propagate_error (error, g_error_copy (self->error));
+      return -1;
+    }
+
+  return 0;
+}
+
+static gboolean
+dispatch_pending (gpointer user_data)
+{
+  LspThreadedInputStream *self = user_data;
+  GError *error = NULL;
+  GTask *task = NULL;
+  gssize n = 0;
+
+  g_mutex_lock (&self->mutex);
+  self->dispatch_scheduled = FALSE;
+  if (self->pending && has_result (self))
+    {
+      task = self->pending;
+      self->pending = NULL;
+      n = take_data (self, self->pending_buffer, self->pending_count, &error);
+    }
+  g_mutex_unlock (&self->mutex);
+
+  if (task)
+    {
+      if (self->cancel_id)
+        g_cancellable_disconnect (self->cancellable, self->cancel_id);
+      self->cancel_id = 0;
+      g_clear_object (&self->cancellable);
+
+      if (n < 0)
+        g_task_return_error (task, error);
+      else
+        g_task_return_int (task, n);
+      g_object_unref (task);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+reader_thread (gpointer user_data)
+{
+  LspThreadedInputStream *self = user_data;
+  guint8 *buffer = g_malloc (READ_CHUNK_SIZE);
+
+  while (TRUE)
+    {
+      GError *error = NULL;
+      gboolean schedule;
+      gssize n;
+
+      n = g_input_stream_read (self->base_stream, buffer, READ_CHUNK_SIZE, NULL, &error);
+
+      g_mutex_lock (&self->mutex);
+      if (n > 0)
+        g_byte_array_append (self->data, buffer, n);
+      else if (n == 0)
+        self->eof = TRUE;
+      else
+        self->error = error;
+
+      schedule = self->pending && !self->dispatch_scheduled;
+      if (schedule)
+        self->dispatch_scheduled = TRUE;
+      g_cond_broadcast (&self->cond);
+      g_mutex_unlock (&self->mutex);
+
+      if (schedule)
+        g_main_context_invoke_full (self->context, G_PRIORITY_DEFAULT, dispatch_pending,
+                                    g_object_ref (self), g_object_unref);
+
+      if (n <= 0)
+        break;
+    }
+
+  g_free (buffer);
+  g_input_stream_close (self->base_stream, NULL, NULL);
+  g_object_unref (self);
+
+  return NULL;
+}
+
+static gssize
+lsp_threaded_input_stream_read (GInputStream  *stream,
+                                void          *buffer,
+                                gsize          count,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  LspThreadedInputStream *self = LSP_THREADED_INPUT_STREAM (stream);
+  gssize n;
+
+  g_mutex_lock (&self->mutex);
+  while (!has_result (self))
+    g_cond_wait (&self->cond, &self->mutex);
+  n = take_data (self, buffer, count, error);
+  g_mutex_unlock (&self->mutex);
+
+  return n;
+}
+
+static void
+read_cancelled_cb (GCancellable *cancellable,
+                   gpointer      user_data)
+{
+  LspThreadedInputStream *self = user_data;
+  GTask *task;
+
+  g_mutex_lock (&self->mutex);
+  task = self->pending;
+  self->pending = NULL;
+  g_mutex_unlock (&self->mutex);
+
+  /* the handler is disconnected with the next read, it can't be done from
+   * inside the handler */
+  if (task)
+    {
+      g_task_return_error_if_cancelled (task);
+      g_object_unref (task);
+    }
+}
+
+static void
+lsp_threaded_input_stream_read_async (GInputStream        *stream,
+                                      void                *buffer,
+                                      gsize                count,
+                                      int                  io_priority,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
+{
+  LspThreadedInputStream *self = LSP_THREADED_INPUT_STREAM (stream);
+  GTask *task;
+
+  task = g_task_new (stream, cancellable, callback, user_data);
+  g_task_set_source_tag (task, lsp_threaded_input_stream_read_async);
+  g_task_set_priority (task, io_priority);
+
+  if (self->cancel_id)
+    g_cancellable_disconnect (self->cancellable, self->cancel_id);
+  self->cancel_id = 0;
+  g_clear_object (&self->cancellable);
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      g_object_unref (task);
+      return;
+    }
+
+  g_mutex_lock (&self->mutex);
+  g_assert (self->pending == NULL);
+  self->pending = task;
+  self->pending_buffer = buffer;
+  self->pending_count = count;
+  g_mutex_unlock (&self->mutex);
+
+  if (cancellable)
+    {
+      self->cancellable = g_object_ref (cancellable);
+      self->cancel_id = g_cancellable_connect (cancellable, G_CALLBACK (read_cancelled_cb),
+                                               self, NULL);
+    }
+
+  /* data may already be waiting */
+  dispatch_pending (self);
+}
+
+static gssize
+lsp_threaded_input_stream_read_finish (GInputStream  *stream,
+                                       GAsyncResult  *result,
+                                       GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, stream), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+static gboolean
+lsp_threaded_input_stream_close (GInputStream  *stream,
+                                 GCancellable  *cancellable,
+                                 GError       **error)
+{
+  /* the base stream is closed by the reader thread - closing it while the
+   * thread is blocked in read() isn't safe */
+  return TRUE;
+}
+
+/**
+ * lsp_threaded_input_stream_new:
+ * @base_stream: the stream to drain from a thread
+ *
+ * Asynchronous reads are completed in the thread-default main context of
+ * the caller.
+ *
+ * Returns: a new #GInputStream
+ **/
+GInputStream *
+lsp_threaded_input_stream_new (GInputStream *base_stream)
+{
+  LspThreadedInputStream *self;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base_stream), NULL);
+
+  self = g_object_new (LSP_TYPE_THREADED_INPUT_STREAM, NULL);
+  self->base_stream = g_object_ref (base_stream);
+  self->context = g_main_context_ref_thread_default ();
+
+  g_thread_unref (g_thread_new ("lsp-reader", reader_thread, g_object_ref (self)));
+
+  return G_INPUT_STREAM (self);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2023 Jiri Techet <techet@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// input stream draining its base stream from a dedicated thread so the
+// peer never blocks on a full pipe while the main loop is busy
+
+#ifndef __LSP_THREADED_INPUT_STREAM_H__
+#define __LSP_THREADED_INPUT_STREAM_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define LSP_TYPE_THREADED_INPUT_STREAM (lsp_threaded_input_stream_get_type ())
+
+G_DECLARE_FINAL_TYPE (LspThreadedInputStream, lsp_threaded_input_stream, LSP, THREADED_INPUT_STREAM, GInputStream)
+
+GInputStream * lsp_threaded_input_stream_new (GInputStream *base_stream);
+
+G_END_DECLS
+
+#endif /* __LSP_THREADED_INPUT_STREAM_H__ */
@@ -46,6 +46,10 @@
 /* Each 4KB under Windows seem to come in 2 portions, so 2K + 2K is more
    balanced than 4095 + 1. May be different on the latest Windows/glib? */
 # define DEFAULT_IO_LENGTH 2048
+/* The default pipe buffer is just a few KB so servers writing large responses
+   and large didOpen messages written to servers stall on every few KB. The
+   size is only a hint for the system. */
+# define PIPE_BUFFER_SIZE 65536
 #else
 # define DEFAULT_IO_LENGTH 4096
 
@@ -190,7 +194,7 @@ static gchar *spawn_create_process_with_pipes(wchar_t *w_command_line, const wch
 			static int pindex[3][2] = { { READ_STDIN, WRITE_STDIN },
 					{ READ_STDOUT, WRITE_STDOUT }, { READ_STDERR, WRITE_STDERR } };
 
-			if (!CreatePipe(&hpipe[pindex[i][0]], &hpipe[pindex[i][1]], NULL, 0))
+			if (!CreatePipe(&hpipe[pindex[i][0]], &hpipe[pindex[i][1]], NULL, PIPE_BUFFER_SIZE))
 			{
 				hpipe[pindex[i][0]] = hpipe[pindex[i][1]] = NULL;
 				failed = "create pipe";
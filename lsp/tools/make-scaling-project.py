@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#
+# Copyright 2024 Jiri Techet <techet@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+"""Creates a synthetic C project for measuring how the plugin scales.
+
+The project contains FILES source files with SYMBOLS top-level symbols each
+(every tenth one a struct with members so the symbol tree has nested rows).
+All files call hot_function() in file 0 REFERENCES times in total. Next to the
+sources, capture.jsonl contains canned server traffic in the format written by
+rpc_capture (see lsp-capture.c) so a mock server can answer without indexing:
+
+  - textDocument/documentSymbol for every file (symbol tree, goto anywhere)
+  - textDocument/publishDiagnostics with DIAGNOSTICS items for every file
+  - workspace/symbol for an empty query (goto panel filtering)
+  - textDocument/references and textDocument/rename of hot_function()
+    (reference panel and workspace edits touching every file)
+
+The same project can also be opened with a real server such as clangd
+(compile_flags.txt is created for it). Runs with the same arguments produce
+identical output so results of different plugin versions can be compared.
+
+Example of a scaling series:
+
+  for n in 1000 10000 100000; do
+      make-scaling-project.py --files $((n / 100)) --symbols 100 /tmp/scale-$n
+  done
+"""
+
+import argparse
+import json
+import os
+import random
+
+
+def symbol_name(file_index, symbol_index):
+    return 'f%05d_%04d' % (file_index, symbol_index)
+
+
+def file_name(file_index):
+    return 'file_%05d.c' % file_index
+
+
+def lsp_range(line, start, end):
+    return {'start': {'line': line, 'character': start},
+            'end': {'line': line, 'character': end}}
+
+
+class Capture:
+    def __init__(self, path):
+        self.out = open(path, 'w')
+        self.time = 0
+        self.last_id = 0
+        self.write({'capture': 1, 'server': 'synthetic', 'start': 0})
+
+    def write(self, msg):
+        self.out.write(json.dumps(msg, separators=(',', ':')) + '\n')
+
+    def request(self, method, params, result):
+        self.last_id += 1
+        self.time += 1000
+        self.write({'time': self.time, 'from': 'client', 'type': 'request',
+                    'method': method, 'id': self.last_id, 'params': params})
+        self.time += 1000
+        self.write({'time': self.time, 'from': 'server', 'type': 'response',
+                    'method': method, 'id': self.last_id, 'result': result})
+
+    def notification(self, method, params):
+        self.time += 1000
+        self.write({'time': self.time, 'from': 'server', 'type': 'notification',
+                    'method': method, 'params': params})
+
+    def close(self):
+        self.out.close()
+
+
+def generate_file(args, file_index, hot_calls):
+    """Returns the source and the document symbols of the file and the
+    positions of hot_function() calls in it"""
+    lines = []
+    symbols = []
+    calls = []
+
+    if file_index == 0:
+        lines += ['int hot_function(int a)', '{', '\treturn a;', '}', '']
+        symbols.append({'name': 'hot_function', 'kind': 12, 'detail': 'int (int)',
+                        'range': {'start': {'line': 0, 'character': 0},
+                                  'end': {'line': 3, 'character': 1}},
+                        'selectionRange': lsp_range(0, 4, 16)})
+
+    for i in range(args.symbols):
+        name = symbol_name(file_index, i)
+        start = len(lines)
+        if i % 10 == 9:
+            lines.append('struct %s' % name)
+            lines.append('{')
+            children = []
+            for j in range(3):
+                member = 'member_%d' % j
+                children.append({'name': member, 'kind': 8, 'detail': 'int',
+                                 'range': lsp_range(len(lines), 1, 6 + len(member)),
+                                 'selectionRange': lsp_range(len(lines), 5, 5 + len(member))})
+                lines.append('\tint %s;' % member)
+            lines.append('};')
+            symbols.append({'name': name, 'kind': 23, 'children': children,
+                            'range': {'start': {'line': start, 'character': 0},
+                                      'end': {'line': len(lines) - 1, 'character': 2}},
+                            'selectionRange': lsp_range(start, 7, 7 + len(name))})
+        else:
+            lines.append('int %s(int a)' % name)
+            lines.append('{')
+            for _ in range(hot_calls.pop(i, 0)):
+                calls.append(len(lines))
+                lines.append('\ta = hot_function(a);')
+            lines.append('\treturn a + %d;' % i)
+            lines.append('}')
+            symbols.append({'name': name, 'kind': 12, 'detail': 'int (int)',
+                            'range': {'start': {'line': start, 'character': 0},
+                                      'end': {'line': len(lines) - 1, 'character': 1}},
+                            'selectionRange': lsp_range(start, 4, 4 + len(name))})
+        lines.append('')
+
+    return '\n'.join(lines), symbols, calls
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--files', type=int, default=100, help='number of source files')
+    parser.add_argument('--symbols', type=int, default=100, help='top-level symbols per file')
+    parser.add_argument('--diagnostics', type=int, default=10, help='diagnostics per file')
+    parser.add_argument('--references', type=int, default=1000,
+                        help='calls of hot_function() spread over all files')
+    parser.add_argument('--seed', type=int, default=1, help='seed of the random generator')
+    parser.add_argument('directory', help='output directory, created when missing')
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    os.makedirs(args.directory, exist_ok=True)
+    root_uri = 'file://' + os.path.abspath(args.directory)
+
+    # file -> {function index -> number of calls}
+    hot_calls = {}
+    functions = [i for i in range(args.symbols) if i % 10 != 9]
+    for _ in range(args.references if functions else 0):
+        per_file = hot_calls.setdefault(rng.randrange(args.files), {})
+        func = rng.choice(functions)
+        per_file[func] = per_file.get(func, 0) + 1
+
+    with open(os.path.join(args.directory, 'compile_flags.txt'), 'w') as f:
+        f.write('-Wall\n')
+
+    capture = Capture(os.path.join(args.directory, 'capture.jsonl'))
+    workspace_symbols = []
+    references = []
+    edits = {}
+
+    for file_index in range(args.files):
+        uri = root_uri + '/' + file_name(file_index)
+        text, symbols, calls = generate_file(args, file_index, hot_calls.get(file_index, {}))
+
+        with open(os.path.join(args.directory, file_name(file_index)), 'w') as f:
+            f.write(text)
+
+        capture.request('textDocument/documentSymbol', {'textDocument': {'uri': uri}}, symbols)
+
+        diags = []
+        for _ in range(args.diagnostics if symbols else 0):
+            sym = rng.choice(symbols)
+            line = sym['selectionRange']['start']['line']
+            diags.append({'range': sym['selectionRange'], 'severity': rng.choice([1, 2, 3, 4]),
+                          'source': 'synthetic', 'message': 'synthetic issue on line %d' % (line + 1)})
+        capture.notification('textDocument/publishDiagnostics', {'uri': uri, 'diagnostics': diags})
+
+        for sym in symbols:
+            workspace_symbols.append({'name': sym['name'], 'kind': sym['kind'],
+                                      'location': {'uri': uri, 'range': sym['selectionRange']}})
+
+        file_edits = []
+        if file_index == 0:
+            file_edits.append({'range': lsp_range(0, 4, 16), 'newText': 'renamed_function'})
+        for line in calls:
+            references.append({'uri': uri, 'range': lsp_range(line, 5, 17)})
+            file_edits.append({'range': lsp_range(line, 5, 17), 'newText': 'renamed_function'})
+        if file_edits:
+            edits[uri] = file_edits
+
+    capture.request('workspace/symbol', {'query': ''}, workspace_symbols)
+
+    position = {'textDocument': {'uri': root_uri + '/' + file_name(0)},
+                'position': {'line': 0, 'character': 8}}
+    capture.request('textDocument/references',
+                    dict(position, context={'includeDeclaration': False}), references)
+    capture.request('textDocument/rename', dict(position, newName='renamed_function'),
+                    {'changes': edits})
+    capture.close()
+
+
+if __name__ == '__main__':
+    main()